@@ -0,0 +1,868 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "compression.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "packfile.h"
+#include "sha1.h"
+#include "synthetic_repo.h"
+#include "tree_walk.h"
+
+#define MAX_SAMPLES 1000
+#define MAX_BATCH_OBJECTS 200
+#define MICRO_DATA_SIZE (1024 * 1024)
+#define MICRO_HASH_COUNT 256
+#define MICRO_TREE_ENTRIES 1000
+
+char *git_path_opt = nullptr;
+char *bench_dir_opt = nullptr;
+char *suite_opt = "all";
+char *bench_output_opt = nullptr;
+long iterations_opt = 5;
+bool generate_only_opt = false;
+
+static synthetic_repo_options repo_opts;
+
+typedef struct bench_result
+{
+    const char *name;
+
+    // Work done by one sample: operations and, where throughput matters,
+    // bytes processed
+    uint64_t ops;
+    uint64_t bytes;
+
+    size_t sample_count;
+    uint64_t samples[MAX_SAMPLES];
+} bench_result;
+
+// Runs one sample, returning false on failure
+typedef bool (*bench_sample)(void *ctx);
+
+typedef struct micro_data
+{
+    unsigned char *text;
+    unsigned char *deflated;
+    size_t deflated_size;
+    unsigned char hashes[MICRO_HASH_COUNT][SHA_DIGEST_LENGTH];
+    char hexes[MICRO_HASH_COUNT][SHA_HEX_LENGTH + 1];
+    char *tree;
+    size_t tree_size;
+} micro_data;
+
+typedef struct e2e_state
+{
+    char repo_dir[PATH_MAX];
+    char objects_dir[PATH_MAX];
+    char tree_hex[SHA_HEX_LENGTH + 1];
+    char batch[MAX_BATCH_OBJECTS][SHA_HEX_LENGTH + 1];
+    size_t batch_count;
+} e2e_state;
+
+// Keeps the compiler from dropping results nothing else reads
+static volatile uint64_t sink;
+
+static FILE *results;
+
+static bool parse_size_arg(const char *value, size_t *size)
+{
+    char *end;
+    const unsigned long long parsed = strtoull(value, &end, 10);
+    validate(end != value, "Invalid size '%s'.", value);
+
+    unsigned long long scale = 1;
+    if (*end == 'k' || *end == 'K') scale = 1024;
+    else if (*end == 'm' || *end == 'M') scale = 1024 * 1024;
+    validate(*end == '\0' || end[1] == '\0', "Invalid size '%s'.", value);
+
+    *size = parsed * scale;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool try_resolve_bench_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "git", required_argument, nullptr, 'g' },
+        { "dir", required_argument, nullptr, 'd' },
+        { "suite", required_argument, nullptr, 's' },
+        { "output", required_argument, nullptr, 'o' },
+        { "iterations", required_argument, nullptr, 'i' },
+        { "generate-only", no_argument, nullptr, 'G' },
+        { "files", required_argument, nullptr, 'f' },
+        { "depth", required_argument, nullptr, 'D' },
+        { "fanout", required_argument, nullptr, 'F' },
+        { "min-size", required_argument, nullptr, 'm' },
+        { "max-size", required_argument, nullptr, 'M' },
+        { "binary-ratio", required_argument, nullptr, 'b' },
+        { "seed", required_argument, nullptr, 'S' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'g':
+                git_path_opt = optarg;
+                break;
+            case 'd':
+                bench_dir_opt = optarg;
+                break;
+            case 's':
+                suite_opt = optarg;
+                break;
+            case 'o':
+                bench_output_opt = optarg;
+                break;
+            case 'i':
+                iterations_opt = strtol(optarg, nullptr, 10);
+                break;
+            case 'G':
+                generate_only_opt = true;
+                break;
+            case 'f':
+                repo_opts.file_count = strtoull(optarg, nullptr, 10);
+                break;
+            case 'D':
+                repo_opts.depth = strtoul(optarg, nullptr, 10);
+                break;
+            case 'F':
+                repo_opts.fanout = strtoul(optarg, nullptr, 10);
+                break;
+            case 'm':
+                validate(parse_size_arg(optarg, &repo_opts.min_size), "Invalid --min-size.");
+                break;
+            case 'M':
+                validate(parse_size_arg(optarg, &repo_opts.max_size), "Invalid --max-size.");
+                break;
+            case 'b':
+                repo_opts.binary_ratio = strtod(optarg, nullptr);
+                break;
+            case 'S':
+                repo_opts.seed = strtoull(optarg, nullptr, 10);
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind == argc, "Usage: git_bench [--git=<path>] [--dir=<path>] [--suite=all|micro|e2e] ...");
+    validate(iterations_opt > 0 && iterations_opt <= MAX_SAMPLES, "--iterations must be within 1 and %d.", MAX_SAMPLES);
+    validate(
+        strcmp(suite_opt, "all") == 0 || strcmp(suite_opt, "micro") == 0 || strcmp(suite_opt, "e2e") == 0,
+        "Unknown suite '%s'.",
+        suite_opt);
+    validate(!generate_only_opt || bench_dir_opt, "--generate-only needs --dir.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    const uint64_t sample1 = *(const uint64_t *)a;
+    const uint64_t sample2 = *(const uint64_t *)b;
+
+    return (sample1 > sample2) - (sample1 < sample2);
+}
+
+// One JSON object per line on the results stream, and a readable line on
+// stderr. Times are per sample; ns_per_op and mb_per_s use the median.
+static void report_result(bench_result *result)
+{
+    qsort(result->samples, result->sample_count, sizeof(uint64_t), compare_samples);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < result->sample_count; i++) total += result->samples[i];
+
+    const uint64_t min = result->samples[0];
+    const uint64_t max = result->samples[result->sample_count - 1];
+    const uint64_t median = result->samples[result->sample_count / 2];
+    const double mean = (double)total / result->sample_count;
+    const double ns_per_op = (double)median / result->ops;
+    const double mb_per_s = median ? (double)result->bytes / (1024.0 * 1024.0) / ((double)median / 1e9) : 0;
+
+    fprintf(
+        results,
+        "{\"type\":\"result\",\"name\":\"%s\",\"samples\":%zu,\"ops\":%lu,\"bytes\":%lu,"
+        "\"min_ns\":%lu,\"median_ns\":%lu,\"mean_ns\":%.0f,\"max_ns\":%lu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f}\n",
+        result->name,
+        result->sample_count,
+        (unsigned long)result->ops,
+        (unsigned long)result->bytes,
+        (unsigned long)min,
+        (unsigned long)median,
+        mean,
+        (unsigned long)max,
+        ns_per_op,
+        mb_per_s);
+
+    fprintf(stderr, "%-28s %12.1f ns/op", result->name, ns_per_op);
+    if (result->bytes) fprintf(stderr, " %10.2f MB/s", mb_per_s);
+    fputc('\n', stderr);
+}
+
+// One warm-up sample, then iterations_opt timed ones. A prepare step, when
+// given, runs before every sample and outside of its time.
+static bool run_bench(
+    const char *name,
+    const uint64_t ops,
+    const uint64_t bytes,
+    const bench_sample prepare,
+    const bench_sample sample,
+    void *ctx)
+{
+    bench_result result = { .name = name, .ops = ops, .bytes = bytes };
+
+    for (long i = -1; i < iterations_opt; i++)
+    {
+        if (prepare) validate(prepare(ctx), "Failed to prepare '%s'.", name);
+
+        const uint64_t start = now_ns();
+        validate(sample(ctx), "Benchmark '%s' failed.", name);
+        const uint64_t elapsed = now_ns() - start;
+
+        if (i >= 0) result.samples[result.sample_count++] = elapsed;
+    }
+
+    report_result(&result);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool hex_encode_sample(void *ctx)
+{
+    micro_data *data = ctx;
+
+    for (size_t i = 0; i < MICRO_HASH_COUNT; i++) hash_bytes_to_hex(data->hexes[i], data->hashes[i]);
+    sink += data->hexes[MICRO_HASH_COUNT - 1][0];
+
+    return true;
+}
+
+static bool hex_decode_sample(void *ctx)
+{
+    micro_data *data = ctx;
+
+    for (size_t i = 0; i < MICRO_HASH_COUNT; i++)
+    {
+        if (!hash_hex_to_bytes(data->hashes[i], data->hexes[i])) return false;
+    }
+
+    sink += data->hashes[MICRO_HASH_COUNT - 1][0];
+
+    return true;
+}
+
+static bool sha1_sample(void *ctx, const size_t chunk_size)
+{
+    const micro_data *data = ctx;
+
+    for (size_t pos = 0; pos < MICRO_DATA_SIZE; pos += chunk_size)
+    {
+        sha1_ctx sha;
+        if (!sha1_init(&sha)) return false;
+
+        sha1_update(&sha, &data->text[pos], chunk_size);
+
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        sha1_final(&sha, hash);
+        sink += hash[0];
+    }
+
+    return true;
+}
+
+static bool sha1_4k_sample(void *ctx)
+{
+    return sha1_sample(ctx, 4096);
+}
+
+static bool sha1_1m_sample(void *ctx)
+{
+    return sha1_sample(ctx, MICRO_DATA_SIZE);
+}
+
+// deflate_object streams between files, as loose objects are written
+static bool deflate_sample(void *ctx)
+{
+    micro_data *data = ctx;
+
+    FILE *source = fmemopen(data->text, MICRO_DATA_SIZE, "r");
+    if (!source) return false;
+
+    char *deflated = nullptr;
+    size_t deflated_size = 0;
+    FILE *dest = open_memstream(&deflated, &deflated_size);
+
+    if (!dest)
+    {
+        fclose(source);
+        return false;
+    }
+
+    deflate_object(source, dest);
+
+    fclose(source);
+    fclose(dest);
+
+    if (!data->deflated)
+    {
+        data->deflated = (unsigned char *)deflated;
+        data->deflated_size = deflated_size;
+    }
+    else
+    {
+        free(deflated);
+    }
+
+    return deflated_size > 0;
+}
+
+// inflate_to_buffer is the packed object read path
+static bool inflate_sample(void *ctx)
+{
+    const micro_data *data = ctx;
+
+    char *inflated = malloc(MICRO_DATA_SIZE);
+    if (!inflated) return false;
+
+    const bool result = inflate_to_buffer(data->deflated, data->deflated_size, inflated, MICRO_DATA_SIZE);
+    sink += inflated[0];
+
+    free(inflated);
+
+    return result;
+}
+
+static bool tree_parse_sample(void *ctx)
+{
+    const micro_data *data = ctx;
+
+    git_tree_node node = { };
+    size_t pos = 0;
+    size_t count = 0;
+
+    while (pos < data->tree_size)
+    {
+        pos = try_set_node(&node, data->tree, data->tree_size, pos);
+        if (!pos) return false;
+
+        sink += node.name[0];
+        clear_git_tree_node(&node);
+        count++;
+    }
+
+    return count == MICRO_TREE_ENTRIES;
+}
+
+// Entries as write-tree stores them, sorted by name
+static bool build_micro_tree(micro_data *data, synthetic_rng *rng)
+{
+    FILE *tree = open_memstream(&data->tree, &data->tree_size);
+    validate(tree, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < MICRO_TREE_ENTRIES; i++)
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        fill_synthetic_content(rng, hash, SHA_DIGEST_LENGTH, false);
+
+        fprintf(tree, "100644 f%06zu.txt", i);
+        fputc('\0', tree);
+        (void)fwrite(hash, 1, SHA_DIGEST_LENGTH, tree);
+    }
+
+    validate(fclose(tree) == 0, "Failed to build tree.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool run_micro_benchmarks(void)
+{
+    micro_data data = { };
+    synthetic_rng rng = { .state = repo_opts.seed };
+
+    data.text = malloc(MICRO_DATA_SIZE);
+    validate(data.text, "Failed to allocate memory.");
+    fill_synthetic_content(&rng, data.text, MICRO_DATA_SIZE, true);
+
+    for (size_t i = 0; i < MICRO_HASH_COUNT; i++) fill_synthetic_content(&rng, data.hashes[i], SHA_DIGEST_LENGTH, false);
+
+    validate(build_micro_tree(&data, &rng), "Failed to build the tree.");
+
+    validate(
+        run_bench("micro/hex_encode", MICRO_HASH_COUNT, 0, nullptr, hex_encode_sample, &data),
+        "Failed to run hex_encode.");
+    validate(
+        run_bench("micro/hex_decode", MICRO_HASH_COUNT, 0, nullptr, hex_decode_sample, &data),
+        "Failed to run hex_decode.");
+    validate(
+        run_bench("micro/sha1_4k", MICRO_DATA_SIZE / 4096, MICRO_DATA_SIZE, nullptr, sha1_4k_sample, &data),
+        "Failed to run sha1_4k.");
+    validate(
+        run_bench("micro/sha1_1m", 1, MICRO_DATA_SIZE, nullptr, sha1_1m_sample, &data),
+        "Failed to run sha1_1m.");
+    validate(
+        run_bench("micro/deflate", 1, MICRO_DATA_SIZE, nullptr, deflate_sample, &data),
+        "Failed to run deflate.");
+    validate(
+        run_bench("micro/inflate", 1, MICRO_DATA_SIZE, nullptr, inflate_sample, &data),
+        "Failed to run inflate.");
+    validate(
+        run_bench("micro/tree_parse", MICRO_TREE_ENTRIES, data.tree_size, nullptr, tree_parse_sample, &data),
+        "Failed to run tree_parse.");
+
+    free(data.text);
+    free(data.deflated);
+    free(data.tree);
+
+    return true;
+
+error:
+    if (data.text) free(data.text);
+    if (data.deflated) free(data.deflated);
+    if (data.tree) free(data.tree);
+
+    return false;
+}
+
+// Runs git in dir, with its stdout in out when given and discarded
+// otherwise. Timing a command includes starting its process, as a user
+// running it would see.
+static bool run_git(const char *dir, const char *const args[], char *out, const size_t out_size)
+{
+    int pipe_fds[2] = { -1, -1 };
+    if (out) validate(pipe(pipe_fds) == 0, "Failed to create pipe.");
+
+    const pid_t pid = fork();
+    validate(pid != -1, "Failed to fork.");
+
+    if (pid == 0)
+    {
+        const int null_fd = open("/dev/null", O_WRONLY);
+
+        if (out)
+        {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        }
+        else
+        {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+
+        if (chdir(dir) != 0) _exit(127);
+
+        size_t argc = 0;
+        while (args[argc]) argc++;
+
+        char *argv[argc + 2];
+        argv[0] = git_path_opt;
+        for (size_t i = 0; i < argc; i++) argv[i + 1] = (char *)args[i];
+        argv[argc + 1] = nullptr;
+
+        execv(git_path_opt, argv);
+        _exit(127);
+    }
+
+    size_t len = 0;
+
+    if (out)
+    {
+        close(pipe_fds[1]);
+
+        ssize_t n;
+        while (len < out_size - 1 && (n = read(pipe_fds[0], &out[len], out_size - 1 - len)) > 0) len += n;
+
+        // Whatever does not fit is drained, so git never blocks on the pipe
+        char scratch[4096];
+        while (read(pipe_fds[0], scratch, sizeof(scratch)) > 0) { }
+
+        out[len] = '\0';
+        close(pipe_fds[0]);
+    }
+
+    int status;
+    validate(waitpid(pid, &status, 0) == pid, "Failed to wait for git.");
+    validate(WIFEXITED(status) && WEXITSTATUS(status) == 0, "git %s failed.", args[0]);
+
+    return true;
+
+error:
+    if (pipe_fds[0] != -1) close(pipe_fds[0]);
+    if (pipe_fds[1] != -1) close(pipe_fds[1]);
+
+    return false;
+}
+
+static int remove_path(
+    const char *path,
+    [[maybe_unused]] const struct stat *fs,
+    [[maybe_unused]] const int type,
+    [[maybe_unused]] struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static bool remove_tree(const char *path)
+{
+    return nftw(path, remove_path, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+static bool is_fanout_dir(const char *name)
+{
+    return strlen(name) == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]);
+}
+
+// Empties the object store, so the next write-tree writes every object
+static bool clear_objects(void *ctx)
+{
+    const e2e_state *state = ctx;
+
+    DIR *dir = opendir(state->objects_dir);
+    validate(dir, "Failed to open '%s'.", state->objects_dir);
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (!is_fanout_dir(entry->d_name)) continue;
+
+        char path[PATH_MAX];
+        const int path_len = snprintf(path, PATH_MAX, "%s/%s", state->objects_dir, entry->d_name);
+
+        if (path_len >= PATH_MAX || !remove_tree(path))
+        {
+            closedir(dir);
+            validate(false, "Failed to remove '%s'.", path);
+        }
+    }
+
+    closedir(dir);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_tree_sample(void *ctx)
+{
+    e2e_state *state = ctx;
+
+    const char *args[] = { "write-tree", nullptr };
+    validate(run_git(state->repo_dir, args, state->tree_hex, sizeof(state->tree_hex)), "write-tree failed.");
+
+    return strlen(state->tree_hex) == SHA_HEX_LENGTH;
+
+error:
+    return false;
+}
+
+static bool ls_tree_sample(void *ctx)
+{
+    const e2e_state *state = ctx;
+
+    const char *args[] = { "ls-tree", state->tree_hex, nullptr };
+
+    return run_git(state->repo_dir, args, nullptr, 0);
+}
+
+static bool ls_tree_name_only_sample(void *ctx)
+{
+    const e2e_state *state = ctx;
+
+    const char *args[] = { "ls-tree", "--name-only", state->tree_hex, nullptr };
+
+    return run_git(state->repo_dir, args, nullptr, 0);
+}
+
+static bool cat_file_batch_sample(void *ctx)
+{
+    const e2e_state *state = ctx;
+
+    for (size_t i = 0; i < state->batch_count; i++)
+    {
+        const char *args[] = { "cat-file", "-p", state->batch[i], nullptr };
+        if (!run_git(state->repo_dir, args, nullptr, 0)) return false;
+    }
+
+    return true;
+}
+
+static int compare_hexes(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+// Every n-th loose object in hash order, so the batch is the same on every
+// run of the same repository
+static bool collect_object_batch(e2e_state *state)
+{
+    char (*all)[SHA_HEX_LENGTH + 1] = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    DIR *dir = opendir(state->objects_dir);
+    validate(dir, "Failed to open '%s'.", state->objects_dir);
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (!is_fanout_dir(entry->d_name)) continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", state->objects_dir, entry->d_name) >= PATH_MAX) continue;
+
+        DIR *fanout = opendir(path);
+        if (!fanout) continue;
+
+        const struct dirent *object;
+        while ((object = readdir(fanout)) != nullptr)
+        {
+            if (strlen(object->d_name) != SHA_HEX_LENGTH - 2) continue;
+
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 256;
+
+                char (*grown)[SHA_HEX_LENGTH + 1] = realloc(all, capacity * sizeof(*all));
+                if (!grown) break;
+
+                all = grown;
+            }
+
+            const int hex_len = snprintf(all[count], SHA_HEX_LENGTH + 1, "%s%s", entry->d_name, object->d_name);
+            if (hex_len == SHA_HEX_LENGTH) count++;
+        }
+
+        closedir(fanout);
+    }
+
+    closedir(dir);
+    validate(count > 0, "No objects were written.");
+
+    qsort(all, count, sizeof(*all), compare_hexes);
+
+    const size_t step = count > MAX_BATCH_OBJECTS ? count / MAX_BATCH_OBJECTS : 1;
+
+    state->batch_count = 0;
+    for (size_t i = 0; i < count && state->batch_count < MAX_BATCH_OBJECTS; i += step)
+    {
+        memcpy(state->batch[state->batch_count++], all[i], SHA_HEX_LENGTH + 1);
+    }
+
+    free(all);
+
+    return true;
+
+error:
+    if (all) free(all);
+
+    return false;
+}
+
+// The same layout git init creates, written directly so that generating a
+// repository does not need the binary under test
+static bool init_git_dir(const char *dir)
+{
+    const char *subdirs[] = { ".git", ".git/objects", ".git/refs" };
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++)
+    {
+        validate(snprintf(path, PATH_MAX, "%s/%s", dir, subdirs[i]) < PATH_MAX, "Path too long.");
+        validate(mkdir(path, 0755) == 0, "Failed to create '%s'.", path);
+    }
+
+    validate(snprintf(path, PATH_MAX, "%s/.git/HEAD", dir) < PATH_MAX, "Path too long.");
+
+    FILE *head_file = fopen(path, "w");
+    validate(head_file, "Failed to create '%s'.", path);
+
+    const bool is_written = fputs("ref: refs/heads/main\n", head_file) >= 0;
+    const int close_result = fclose(head_file);
+    validate(is_written && close_result == 0, "Failed to write '%s'.", path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// An empty repository, with the synthetic working tree
+static bool prepare_repo(const char *dir)
+{
+    validate(init_git_dir(dir), "Failed to initialize '%s'.", dir);
+
+    synthetic_repo_stats stats;
+    validate(generate_synthetic_repo(dir, &repo_opts, &stats), "Failed to generate the repository.");
+
+    fprintf(
+        results,
+        "{\"type\":\"repo\",\"files\":%zu,\"binary_files\":%zu,\"dirs\":%zu,\"bytes\":%lu,"
+        "\"depth\":%u,\"fanout\":%u,\"min_size\":%zu,\"max_size\":%zu,\"binary_ratio\":%.3f,\"seed\":%lu}\n",
+        stats.file_count,
+        stats.binary_count,
+        stats.dir_count,
+        (unsigned long)stats.total_bytes,
+        repo_opts.depth,
+        repo_opts.fanout,
+        repo_opts.min_size,
+        repo_opts.max_size,
+        repo_opts.binary_ratio,
+        (unsigned long)repo_opts.seed);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool run_e2e_benchmarks(const char *dir)
+{
+    e2e_state *state = calloc(1, sizeof(e2e_state));
+    validate(state, "Failed to allocate memory.");
+
+    (void)snprintf(state->repo_dir, PATH_MAX, "%s", dir);
+    (void)snprintf(state->objects_dir, PATH_MAX, "%s/.git/objects", dir);
+
+    const uint64_t file_count = repo_opts.file_count ? repo_opts.file_count : 1;
+
+    validate(
+        run_bench("e2e/write_tree_cold", file_count, 0, clear_objects, write_tree_sample, state),
+        "Failed to run write_tree_cold.");
+    validate(
+        run_bench("e2e/write_tree_warm", file_count, 0, nullptr, write_tree_sample, state),
+        "Failed to run write_tree_warm.");
+    validate(
+        run_bench("e2e/ls_tree", 1, 0, nullptr, ls_tree_sample, state),
+        "Failed to run ls_tree.");
+    validate(
+        run_bench("e2e/ls_tree_name_only", 1, 0, nullptr, ls_tree_name_only_sample, state),
+        "Failed to run ls_tree_name_only.");
+
+    validate(collect_object_batch(state), "Failed to collect objects for cat-file.");
+    validate(
+        run_bench("e2e/cat_file_batch", state->batch_count, 0, nullptr, cat_file_batch_sample, state),
+        "Failed to run cat_file_batch.");
+
+    free(state);
+
+    return true;
+
+error:
+    if (state) free(state);
+
+    return false;
+}
+
+// git_bench [--git=<path>] [--dir=<path>] [--suite=all|micro|e2e]
+//           [--iterations=<n>] [--output=<file>] [--generate-only]
+//           [--files=<n>] [--depth=<n>] [--fanout=<n>] [--min-size=<size>]
+//           [--max-size=<size>] [--binary-ratio=<r>] [--seed=<n>]
+// Results go to <file>, or stdout, one JSON object per line: the
+// repository that was generated, then one per benchmark. The end-to-end
+// suite runs the git at <path> in a synthetic repository at <dir>, a
+// temporary one by default. --generate-only only writes that repository,
+// and needs no --git.
+int main(const int argc, char *argv[])
+{
+    char temp_dir[] = "/tmp/git-bench-XXXXXX";
+    static char git_path[PATH_MAX];
+    const char *dir = nullptr;
+    bool is_temp_dir = false;
+
+    results = stdout;
+    init_synthetic_repo_options(&repo_opts);
+
+    validate(try_resolve_bench_opts(argc, argv), "Failed to resolve options.");
+
+    if (bench_output_opt)
+    {
+        results = fopen(bench_output_opt, "w");
+        validate(results, "Failed to open '%s'.", bench_output_opt);
+    }
+
+    const bool is_micro = strcmp(suite_opt, "e2e") != 0 && !generate_only_opt;
+    const bool is_e2e = strcmp(suite_opt, "micro") != 0 || generate_only_opt;
+
+    if (is_e2e && !generate_only_opt)
+    {
+        validate(git_path_opt, "--git is required for end-to-end benchmarks.");
+
+        // Children run in the repository, so a relative path would not do
+        validate(realpath(git_path_opt, git_path), "Cannot find '%s'.", git_path_opt);
+        git_path_opt = git_path;
+    }
+
+    if (is_e2e)
+    {
+        if (bench_dir_opt)
+        {
+            validate(mkdir(bench_dir_opt, 0755) == 0, "Failed to create '%s'.", bench_dir_opt);
+            dir = bench_dir_opt;
+        }
+        else
+        {
+            dir = mkdtemp(temp_dir);
+            validate(dir, "Failed to create a temporary directory.");
+            is_temp_dir = true;
+        }
+
+        validate(prepare_repo(dir), "Failed to prepare the repository.");
+    }
+
+    if (is_micro) validate(run_micro_benchmarks(), "Micro benchmarks failed.");
+
+    if (is_e2e && !generate_only_opt) validate(run_e2e_benchmarks(dir), "End-to-end benchmarks failed.");
+
+    if (is_temp_dir) (void)remove_tree(dir);
+    if (results != stdout) fclose(results);
+
+    return 0;
+
+error:
+    if (is_temp_dir) (void)remove_tree(dir);
+    if (results && results != stdout) fclose(results);
+
+    return 1;
+}
@@ -0,0 +1,237 @@
+#include "synthetic_repo.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+
+#define MAX_DIR_COUNT (1 << 20)
+
+static const char *words[] = {
+    "int", "char", "return", "static", "const", "struct", "if", "else",
+    "while", "for", "size_t", "bool", "true", "false", "nullptr", "void",
+    "buffer", "hash", "tree", "blob", "commit", "object", "index", "pack",
+    "entry", "offset", "count", "length", "error", "result", "data", "path",
+};
+
+void init_synthetic_repo_options(synthetic_repo_options *options)
+{
+    *options = (synthetic_repo_options){
+        .file_count = 2000,
+        .depth = 3,
+        .fanout = 4,
+        .min_size = 64,
+        .max_size = 256 * 1024,
+        .binary_ratio = 0.1,
+        .seed = 1,
+    };
+}
+
+uint64_t synthetic_rng_next(synthetic_rng *rng)
+{
+    uint64_t z = rng->state += 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double next_fraction(synthetic_rng *rng)
+{
+    return (double)(synthetic_rng_next(rng) >> 11) / (double)(1ULL << 53);
+}
+
+static uint64_t next_in_range(synthetic_rng *rng, const uint64_t min, const uint64_t max)
+{
+    return min + synthetic_rng_next(rng) % (max - min + 1);
+}
+
+static unsigned floor_log2(uint64_t value)
+{
+    unsigned log = 0;
+    while (value >>= 1) log++;
+
+    return log;
+}
+
+// A power of two range is picked uniformly first, then a size within it
+static size_t next_file_size(synthetic_rng *rng, const synthetic_repo_options *options)
+{
+    const size_t min = options->min_size ? options->min_size : 1;
+    const size_t max = options->max_size ? options->max_size : 1;
+
+    const unsigned exponent = next_in_range(rng, floor_log2(min), floor_log2(max));
+
+    const uint64_t low = (1ULL << exponent) > min ? 1ULL << exponent : min;
+    const uint64_t high = (2ULL << exponent) - 1 < max ? (2ULL << exponent) - 1 : max;
+
+    const size_t size = next_in_range(rng, low, high);
+
+    return options->min_size == 0 && size == 1 ? 0 : size;
+}
+
+void fill_synthetic_content(synthetic_rng *rng, unsigned char *data, const size_t size, const bool is_text)
+{
+    size_t pos = 0;
+
+    if (!is_text)
+    {
+        while (pos < size)
+        {
+            const uint64_t value = synthetic_rng_next(rng);
+            const size_t n = size - pos < sizeof(value) ? size - pos : sizeof(value);
+
+            memcpy(&data[pos], &value, n);
+            pos += n;
+        }
+
+        return;
+    }
+
+    size_t words_left = 0;
+
+    while (pos < size)
+    {
+        if (words_left == 0)
+        {
+            if (pos > 0) data[pos++] = '\n';
+            words_left = next_in_range(rng, 4, 12);
+            continue;
+        }
+
+        const char *word = words[synthetic_rng_next(rng) % (sizeof(words) / sizeof(words[0]))];
+        const size_t word_len = strlen(word);
+
+        for (size_t i = 0; i < word_len && pos < size; i++) data[pos++] = word[i];
+        if (--words_left > 0 && pos < size) data[pos++] = ' ';
+    }
+
+    if (size > 0) data[size - 1] = '\n';
+}
+
+static bool write_file(const char *path, const unsigned char *data, const size_t size)
+{
+    FILE *file = fopen(path, "w");
+    validate(file, "Failed to create '%s'.", path);
+
+    const size_t written = fwrite(data, 1, size, file);
+    const int close_result = fclose(file);
+    validate(written == size && close_result == 0, "Failed to write '%s'.", path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Directories are named by level, d0 to d<fanout - 1> in each parent, and
+// listed breadth first with the root first
+static char **create_dirs(const char *root, const synthetic_repo_options *options, size_t *dir_count)
+{
+    char **dirs = nullptr;
+    size_t count = 1;
+    size_t level_count = 1;
+
+    for (unsigned level = 0; level < options->depth; level++)
+    {
+        level_count *= options->fanout;
+        count += level_count;
+        validate(count <= MAX_DIR_COUNT, "Too many directories, lower the depth or fanout.");
+    }
+
+    dirs = calloc(count, sizeof(char *));
+    validate(dirs, "Failed to allocate memory.");
+
+    dirs[0] = strdup(root);
+    validate(dirs[0], "Failed to allocate memory.");
+
+    size_t next = 1;
+
+    for (size_t parent = 0; next < count; parent++)
+    {
+        for (unsigned i = 0; i < options->fanout; i++)
+        {
+            char path[PATH_MAX];
+            validate(snprintf(path, PATH_MAX, "%s/d%u", dirs[parent], i) < PATH_MAX, "Path too long.");
+            validate(mkdir(path, 0755) == 0 || errno == EEXIST, "Failed to create '%s'.", path);
+
+            dirs[next] = strdup(path);
+            validate(dirs[next], "Failed to allocate memory.");
+            next++;
+        }
+    }
+
+    *dir_count = count;
+
+    return dirs;
+
+error:
+    if (dirs)
+    {
+        for (size_t i = 0; i < count; i++) free(dirs[i]);
+        free(dirs);
+    }
+
+    return nullptr;
+}
+
+bool generate_synthetic_repo(const char *root, const synthetic_repo_options *options, synthetic_repo_stats *stats)
+{
+    *stats = (synthetic_repo_stats){ };
+
+    synthetic_rng rng = { .state = options->seed };
+    unsigned char *content = nullptr;
+    size_t dir_count = 0;
+    char **dirs = nullptr;
+
+    validate(options->min_size <= options->max_size, "The minimum file size exceeds the maximum.");
+    validate(options->binary_ratio >= 0 && options->binary_ratio <= 1, "The binary ratio must be within 0 and 1.");
+
+    dirs = create_dirs(root, options, &dir_count);
+    validate(dirs, "Failed to create directories.");
+
+    content = malloc(options->max_size ? options->max_size : 1);
+    validate(content, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < options->file_count; i++)
+    {
+        const char *dir = dirs[synthetic_rng_next(&rng) % dir_count];
+        const bool is_binary = next_fraction(&rng) < options->binary_ratio;
+        const size_t size = next_file_size(&rng, options);
+
+        char path[PATH_MAX];
+        const int path_len = snprintf(path, PATH_MAX, "%s/f%06zu.%s", dir, i, is_binary ? "bin" : "txt");
+        validate(path_len < PATH_MAX, "Path too long.");
+
+        fill_synthetic_content(&rng, content, size, !is_binary);
+        validate(write_file(path, content, size), "Failed to write file.");
+
+        stats->file_count++;
+        stats->binary_count += is_binary;
+        stats->total_bytes += size;
+    }
+
+    stats->dir_count = dir_count;
+
+    for (size_t i = 0; i < dir_count; i++) free(dirs[i]);
+    free(dirs);
+    free(content);
+
+    return true;
+
+error:
+    if (dirs)
+    {
+        for (size_t i = 0; i < dir_count; i++) free(dirs[i]);
+        free(dirs);
+    }
+
+    if (content) free(content);
+
+    return false;
+}
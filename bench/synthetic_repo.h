@@ -0,0 +1,53 @@
+#ifndef SYNTHETIC_REPO_H
+#define SYNTHETIC_REPO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct synthetic_repo_options
+{
+    size_t file_count;
+
+    // Levels of directories below the root, each directory holding fanout
+    // subdirectories until the deepest level
+    unsigned depth;
+    unsigned fanout;
+
+    // File sizes are log-uniform between these, so most files are small
+    // and a few are large, as in a typical source tree
+    size_t min_size;
+    size_t max_size;
+
+    // Share of files with random, incompressible content; the rest are text
+    double binary_ratio;
+
+    // The same seed always generates the same tree, byte for byte
+    uint64_t seed;
+} synthetic_repo_options;
+
+typedef struct synthetic_repo_stats
+{
+    size_t file_count;
+    size_t binary_count;
+    size_t dir_count;
+    uint64_t total_bytes;
+} synthetic_repo_stats;
+
+// Deterministic pseudo-random numbers (splitmix64)
+typedef struct synthetic_rng
+{
+    uint64_t state;
+} synthetic_rng;
+
+void init_synthetic_repo_options(synthetic_repo_options *options);
+
+uint64_t synthetic_rng_next(synthetic_rng *rng);
+
+// Fills data with size bytes: random ones, or lines of words when is_text
+void fill_synthetic_content(synthetic_rng *rng, unsigned char *data, size_t size, bool is_text);
+
+// Writes the working tree below root, which must exist and be empty apart
+// from .git
+bool generate_synthetic_repo(const char *root, const synthetic_repo_options *options, synthetic_repo_stats *stats);
+
+#endif //SYNTHETIC_REPO_H
@@ -0,0 +1,1036 @@
+#include "blame.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bloom.h"
+#include "commit.h"
+#include "commit_graph.h"
+#include "debug_helpers.h"
+#include "diffcore_rename.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "line_diff.h"
+#include "midx.h"
+#include "oid_map.h"
+#include "packfile.h"
+#include "refs.h"
+#include "tree_walk.h"
+
+#define MIN_ABBREV 7
+
+bool incremental_opt = false;
+
+// Lines [lno, lno + num_lines) of the final file, which are lines
+// [s_lno, s_lno + num_lines) of the suspect's version
+typedef struct blame_entry
+{
+    uint32_t lno;
+    uint32_t s_lno;
+    uint32_t num_lines;
+} blame_entry;
+
+// Blob contents are shared by every origin with the same blob and dropped
+// once none of them needs it any more
+typedef struct blame_blob
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    char *content;
+    const char *data;
+    size_t size;
+    uint32_t refs;
+} blame_blob;
+
+typedef struct blame_commit_info
+{
+    char *author;
+    char *author_mail;
+    char *author_time;
+    char *author_tz;
+    char *committer;
+    char *committer_mail;
+    char *committer_time;
+    char *committer_tz;
+    char *summary;
+    bool is_shown;
+} blame_commit_info;
+
+// A file at a commit, with the entries it is still suspected of
+typedef struct blame_origin
+{
+    commit *commit;
+    char *path;
+    unsigned char blob_hash[SHA_DIGEST_LENGTH];
+    unsigned int mode;
+    blame_blob *blob;
+    struct blame_origin *previous;
+    struct blame_origin *next;
+
+    blame_entry *suspects;
+    size_t suspect_count;
+    size_t suspect_capacity;
+
+    bloom_key *bloom_keys;
+    size_t bloom_key_count;
+} blame_origin;
+
+typedef struct blamed_range
+{
+    blame_origin *origin;
+    blame_entry entry;
+} blamed_range;
+
+typedef struct cached_diff
+{
+    change_region *regions;
+    size_t count;
+} cached_diff;
+
+typedef struct blame_scoreboard
+{
+    const char *path;
+    commit_queue queue;
+
+    // Origins by commit, chained through next
+    oid_map origins_by_commit;
+    blame_origin **origins;
+    size_t origin_count;
+    size_t origin_capacity;
+
+    oid_map blobs_by_hash;
+    blame_blob **blobs;
+    size_t blob_count;
+    size_t blob_capacity;
+
+    // Keyed by the SHA-1 of both blob oids
+    oid_map diffs_by_pair;
+    cached_diff *diffs;
+    size_t diff_count;
+    size_t diff_capacity;
+
+    oid_map infos_by_commit;
+    blame_commit_info **infos;
+    size_t info_count;
+    size_t info_capacity;
+
+    blamed_range *results;
+    size_t result_count;
+    size_t result_capacity;
+} blame_scoreboard;
+
+static bool try_resolve_blame_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "incremental", no_argument, nullptr, 'i' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                incremental_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool grow_array(void **items, size_t *capacity, const size_t count, const size_t item_size)
+{
+    if (count < *capacity) return true;
+
+    const size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+
+    void *grown = realloc(*items, grown_capacity * item_size);
+    validate(grown, "Failed to allocate memory.");
+
+    *items = grown;
+    *capacity = grown_capacity;
+
+    return true;
+
+error:
+    return false;
+}
+
+static blame_blob *acquire_blob(blame_scoreboard *sb, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    blame_blob *blob = nullptr;
+    uint64_t index;
+
+    if (oid_map_get(&sb->blobs_by_hash, hash, &index))
+    {
+        blob = sb->blobs[index];
+    }
+    else
+    {
+        validate(grow_array((void **)&sb->blobs, &sb->blob_capacity, sb->blob_count, sizeof(blame_blob *)), "Failed to grow blobs.");
+
+        blob = calloc(1, sizeof(blame_blob));
+        validate(blob, "Failed to allocate memory.");
+
+        memcpy(blob->hash, hash, SHA_DIGEST_LENGTH);
+        sb->blobs[sb->blob_count] = blob;
+        validate(oid_map_put(&sb->blobs_by_hash, hash, sb->blob_count++), "Failed to cache blob.");
+    }
+
+    if (!blob->content)
+    {
+        char hash_hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hash_hex, hash);
+        hash_hex[SHA_HEX_LENGTH] = '\0';
+
+        const size_t content_size = get_object_content(hash_hex, &blob->content);
+        validate(blob->content, "Failed to read blob '%s'.", hash_hex);
+        validate(strncmp(blob->content, "blob ", 5) == 0, "Object '%s' is not a blob.", hash_hex);
+
+        const size_t header_size = (size_t)get_header_size(blob->content) + 1;
+        blob->data = &blob->content[header_size];
+        blob->size = content_size - header_size;
+    }
+
+    blob->refs++;
+
+    return blob;
+
+error:
+    return nullptr;
+}
+
+static void release_blob(blame_blob *blob)
+{
+    if (!blob || --blob->refs) return;
+
+    free(blob->content);
+    blob->content = nullptr;
+    blob->data = nullptr;
+    blob->size = 0;
+}
+
+static bool load_origin_blob(blame_scoreboard *sb, blame_origin *origin)
+{
+    if (!origin->blob) origin->blob = acquire_blob(sb, origin->blob_hash);
+
+    return origin->blob;
+}
+
+// Origins are interned by commit and path, so blame passed to a commit
+// from several children collects in one place
+static blame_origin *get_origin(
+    blame_scoreboard *sb,
+    commit *commit,
+    const char *path,
+    const unsigned char blob_hash[SHA_DIGEST_LENGTH],
+    const unsigned int mode)
+{
+    blame_origin *first = nullptr;
+    uint64_t value;
+
+    if (oid_map_get(&sb->origins_by_commit, commit->hash, &value)) first = (blame_origin *)(uintptr_t)value;
+
+    for (blame_origin *origin = first; origin; origin = origin->next)
+    {
+        if (strcmp(origin->path, path) == 0) return origin;
+    }
+
+    validate(grow_array((void **)&sb->origins, &sb->origin_capacity, sb->origin_count, sizeof(blame_origin *)), "Failed to grow origins.");
+
+    blame_origin *origin = calloc(1, sizeof(blame_origin));
+    validate(origin, "Failed to allocate memory.");
+
+    sb->origins[sb->origin_count++] = origin;
+
+    origin->path = strdup(path);
+    validate(origin->path, "Failed to allocate memory.");
+
+    origin->commit = commit;
+    memcpy(origin->blob_hash, blob_hash, SHA_DIGEST_LENGTH);
+    origin->mode = mode;
+    origin->next = first;
+
+    validate(oid_map_put(&sb->origins_by_commit, commit->hash, (uint64_t)(uintptr_t)origin), "Failed to store origin.");
+
+    return origin;
+
+error:
+    return nullptr;
+}
+
+// Merges entries, sorted by s_lno, into those the origin already has. A
+// commit is queued when its first suspects arrive.
+static bool queue_blames(blame_scoreboard *sb, blame_origin *origin, const blame_entry *entries, const size_t count)
+{
+    if (!count) return true;
+
+    if (!origin->suspect_count) validate(commit_queue_put(&sb->queue, origin->commit), "Failed to queue commit.");
+
+    const size_t total = origin->suspect_count + count;
+    blame_entry *merged = malloc(total * sizeof(blame_entry));
+    validate(merged, "Failed to allocate memory.");
+
+    size_t i = 0;
+    size_t j = 0;
+    for (size_t k = 0; k < total; k++)
+    {
+        const bool is_own = j == count || (i < origin->suspect_count && origin->suspects[i].s_lno <= entries[j].s_lno);
+        merged[k] = is_own ? origin->suspects[i++] : entries[j++];
+    }
+
+    if (origin->suspects) free(origin->suspects);
+
+    origin->suspects = merged;
+    origin->suspect_count = total;
+    origin->suspect_capacity = total;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool pass_whole_blame(blame_scoreboard *sb, blame_origin *origin, blame_origin *parent)
+{
+    if (origin->blob && !parent->blob)
+    {
+        parent->blob = origin->blob;
+        parent->blob->refs++;
+    }
+
+    validate(queue_blames(sb, parent, origin->suspects, origin->suspect_count), "Failed to pass blame.");
+
+    origin->suspect_count = 0;
+
+    return true;
+
+error:
+    return false;
+}
+
+static cached_diff *get_blob_diff(blame_scoreboard *sb, blame_origin *parent, blame_origin *target)
+{
+    line_diff diff = { };
+    change_region *regions = nullptr;
+
+    unsigned char pair[2 * SHA_DIGEST_LENGTH];
+    memcpy(pair, parent->blob_hash, SHA_DIGEST_LENGTH);
+    memcpy(&pair[SHA_DIGEST_LENGTH], target->blob_hash, SHA_DIGEST_LENGTH);
+
+    unsigned char key[SHA_DIGEST_LENGTH];
+    SHA1(pair, sizeof(pair), key);
+
+    uint64_t index;
+    if (oid_map_get(&sb->diffs_by_pair, key, &index)) return &sb->diffs[index];
+
+    validate(load_origin_blob(sb, parent) && load_origin_blob(sb, target), "Failed to load blobs.");
+    validate(grow_array((void **)&sb->diffs, &sb->diff_capacity, sb->diff_count, sizeof(cached_diff)), "Failed to grow diffs.");
+
+    validate(compute_line_diff(
+        &diff,
+        parent->blob->data,
+        parent->blob->size,
+        target->blob->data,
+        target->blob->size,
+        DIFF_ALGORITHM_MYERS), "Failed to diff blobs.");
+
+    size_t count;
+    validate(collect_change_regions(&diff, &regions, &count), "Failed to collect changes.");
+    release_line_diff(&diff);
+
+    sb->diffs[sb->diff_count] = (cached_diff){ .regions = regions, .count = count };
+    validate(oid_map_put(&sb->diffs_by_pair, key, sb->diff_count), "Failed to cache diff.");
+
+    return &sb->diffs[sb->diff_count++];
+
+error:
+    release_line_diff(&diff);
+    if (regions) free(regions);
+
+    return nullptr;
+}
+
+typedef struct entry_list
+{
+    blame_entry *items;
+    size_t count;
+    size_t capacity;
+} entry_list;
+
+static bool append_entry(entry_list *list, const blame_entry *entry)
+{
+    validate(grow_array((void **)&list->items, &list->capacity, list->count, sizeof(blame_entry)), "Failed to grow entries.");
+
+    list->items[list->count++] = *entry;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Entries are cut wherever a change starts or ends. Pieces outside the
+// changes move to the parent, at the line they have there; the rest stay.
+static bool pass_blame_to_parent(blame_scoreboard *sb, blame_origin *target, blame_origin *parent)
+{
+    entry_list kept = { };
+    entry_list passed = { };
+
+    const cached_diff *diff = get_blob_diff(sb, parent, target);
+    validate(diff, "Failed to diff '%s'.", target->path);
+
+    size_t region = 0;
+    int64_t offset = 0;
+
+    for (size_t i = 0; i < target->suspect_count; i++)
+    {
+        const blame_entry entry = target->suspects[i];
+        uint32_t start = entry.s_lno;
+        const uint32_t end = entry.s_lno + entry.num_lines;
+
+        while (start < end)
+        {
+            // Changes ending at start are behind it, deletions there included
+            while (region < diff->count && diff->regions[region].b_end <= start)
+            {
+                offset = (int64_t)diff->regions[region].a_end - (int64_t)diff->regions[region].b_end;
+                region++;
+            }
+
+            const bool has_region = region < diff->count;
+            const bool is_changed = has_region && diff->regions[region].b_start <= start;
+
+            uint32_t piece_end = end;
+            if (has_region)
+            {
+                const size_t boundary = is_changed ? diff->regions[region].b_end : diff->regions[region].b_start;
+                if (boundary < piece_end) piece_end = (uint32_t)boundary;
+            }
+
+            blame_entry piece = {
+                .lno = entry.lno + (start - entry.s_lno),
+                .s_lno = start,
+                .num_lines = piece_end - start,
+            };
+
+            if (!is_changed) piece.s_lno = (uint32_t)(start + offset);
+
+            validate(append_entry(is_changed ? &kept : &passed, &piece), "Failed to split entry.");
+
+            start = piece_end;
+        }
+    }
+
+    free(target->suspects);
+    target->suspects = kept.items;
+    target->suspect_count = kept.count;
+    target->suspect_capacity = kept.capacity;
+    kept = (entry_list){ };
+
+    validate(queue_blames(sb, parent, passed.items, passed.count), "Failed to pass blame.");
+
+    if (passed.items) free(passed.items);
+
+    return true;
+
+error:
+    if (kept.items) free(kept.items);
+    if (passed.items) free(passed.items);
+
+    return false;
+}
+
+// The changed-path filter of a commit can tell that its first parent has
+// the same blob at the path, without reading a tree
+static bool is_path_unchanged_in_filter(blame_origin *origin)
+{
+    const commit_graph *graph = get_commit_graph();
+    if (!graph || !graph->bloom_indexes || origin->commit->graph_position == COMMIT_NOT_FROM_GRAPH) return false;
+
+    bloom_filter filter;
+    if (!get_commit_graph_bloom_filter(graph, origin->commit->graph_position, &filter)) return false;
+
+    if (!origin->bloom_keys)
+    {
+        origin->bloom_keys = malloc(count_bloom_path_keys(origin->path) * sizeof(bloom_key));
+        if (!origin->bloom_keys) return false;
+
+        origin->bloom_key_count = fill_bloom_path_keys(origin->path, &graph->bloom_settings, origin->bloom_keys);
+    }
+
+    return !bloom_filter_may_contain_path(&filter, origin->bloom_keys, origin->bloom_key_count, &graph->bloom_settings);
+}
+
+// The file at the same path in the parent, if it is there with the same
+// type. *parent_origin is nullptr when it is not.
+static bool find_origin(blame_scoreboard *sb, commit *parent, const bool is_first_parent, blame_origin *origin, blame_origin **parent_origin)
+{
+    *parent_origin = nullptr;
+
+    if (is_first_parent && is_path_unchanged_in_filter(origin))
+    {
+        *parent_origin = get_origin(sb, parent, origin->path, origin->blob_hash, origin->mode);
+        return *parent_origin;
+    }
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    unsigned int mode;
+    validate(find_tree_entry(parent->tree_hash, origin->path, hash, &mode), "Failed to read tree of parent.");
+
+    if (!mode || (mode & 0170000) != (origin->mode & 0170000)) return true;
+
+    *parent_origin = get_origin(sb, parent, origin->path, hash, mode);
+    validate(*parent_origin, "Failed to create origin.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// A file missing from the parent may have been renamed; the parent's side
+// of the rename takes over
+static bool find_rename(blame_scoreboard *sb, commit *parent, blame_origin *origin, blame_origin **parent_origin)
+{
+    diff_queue queue;
+    diff_queue_init(&queue);
+
+    *parent_origin = nullptr;
+
+    const diff_tree_opts opts = { .recursive = true, .report = diff_queue_add_change, .ctx = &queue };
+    const rename_opts renames = { .min_score = DEFAULT_RENAME_SCORE, .rename_limit = DEFAULT_RENAME_LIMIT };
+
+    validate(diff_tree_hashes(parent->tree_hash, origin->commit->tree_hash, &opts), "Failed to diff trees.");
+    validate(diffcore_rename(&queue, &renames), "Failed to detect renames.");
+
+    for (size_t i = 0; i < queue.count; i++)
+    {
+        const diff_pair *pair = &queue.pairs[i];
+        if (pair->is_removed || (pair->status != 'R' && pair->status != 'C')) continue;
+        if (strcmp(pair->new_path, origin->path) != 0) continue;
+
+        *parent_origin = get_origin(sb, parent, pair->old_path, pair->old_hash, pair->old_mode);
+        validate(*parent_origin, "Failed to create origin.");
+        break;
+    }
+
+    diff_queue_destroy(&queue);
+
+    return true;
+
+error:
+    diff_queue_destroy(&queue);
+
+    return false;
+}
+
+// A parent with the very same blob takes all the blame. Otherwise each
+// parent in turn takes what its version already had, and the commit keeps
+// the lines no parent can explain.
+static bool pass_blame(blame_scoreboard *sb, blame_origin *origin)
+{
+    const commit *commit = origin->commit;
+    blame_origin **parent_origins = calloc(commit->parent_count ? commit->parent_count : 1, sizeof(blame_origin *));
+    validate(parent_origins, "Failed to allocate memory.");
+
+    for (uint32_t i = 0; i < commit->parent_count; i++)
+    {
+        struct commit *parent = commit->parents[i];
+        validate(parse_commit(parent), "Failed to parse commit.");
+
+        blame_origin *parent_origin;
+        validate(find_origin(sb, parent, i == 0, origin, &parent_origin), "Failed to find origin.");
+        if (!parent_origin) validate(find_rename(sb, parent, origin, &parent_origin), "Failed to find rename.");
+        if (!parent_origin) continue;
+
+        if (memcmp(parent_origin->blob_hash, origin->blob_hash, SHA_DIGEST_LENGTH) == 0)
+        {
+            validate(pass_whole_blame(sb, origin, parent_origin), "Failed to pass blame.");
+            free(parent_origins);
+            return true;
+        }
+
+        bool is_duplicate = false;
+        for (uint32_t j = 0; j < i && !is_duplicate; j++)
+        {
+            is_duplicate = parent_origins[j] && memcmp(parent_origins[j]->blob_hash, parent_origin->blob_hash, SHA_DIGEST_LENGTH) == 0;
+        }
+
+        if (!is_duplicate) parent_origins[i] = parent_origin;
+    }
+
+    for (uint32_t i = 0; i < commit->parent_count && origin->suspect_count; i++)
+    {
+        if (!parent_origins[i]) continue;
+
+        if (!origin->previous) origin->previous = parent_origins[i];
+
+        validate(pass_blame_to_parent(sb, origin, parent_origins[i]), "Failed to pass blame.");
+    }
+
+    free(parent_origins);
+
+    return true;
+
+error:
+    if (parent_origins) free(parent_origins);
+
+    return false;
+}
+
+// "Name <mail> 1234567890 +0100" split the way git blame shows it
+static bool parse_ident(const char *line, const size_t len, char **name, char **mail, char **time, char **tz)
+{
+    const char *mail_start = memchr(line, '<', len);
+    const char *mail_end = mail_start ? memchr(mail_start, '>', len - (mail_start - line)) : nullptr;
+    validate(mail_end, "Malformed ident line.");
+
+    const char *name_end = mail_start;
+    while (name_end > line && name_end[-1] == ' ') name_end--;
+
+    const char *time_start = mail_end + 1;
+    while (time_start < line + len && *time_start == ' ') time_start++;
+
+    const char *tz_start = memchr(time_start, ' ', len - (time_start - line));
+    const char *line_end = line + len;
+
+    *name = strndup(line, name_end - line);
+    *mail = strndup(mail_start, mail_end + 1 - mail_start);
+    *time = strndup(time_start, (tz_start ? tz_start : line_end) - time_start);
+    *tz = strndup(tz_start ? tz_start + 1 : line_end, tz_start ? line_end - tz_start - 1 : 0);
+    validate(*name && *mail && *time && *tz, "Failed to allocate memory.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool parse_commit_info(const commit *commit, blame_commit_info *info)
+{
+    char *content = nullptr;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, commit->hash);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    const size_t size = get_object_content(hash_hex, &content);
+    validate(content, "Failed to read commit '%s'.", hash_hex);
+
+    const char *p = &content[get_header_size(content) + 1];
+    const char *end = content + size;
+
+    while (p < end && *p != '\n')
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+
+        if (strncmp(p, "author ", 7) == 0)
+        {
+            validate(parse_ident(p + 7, eol - p - 7, &info->author, &info->author_mail, &info->author_time, &info->author_tz), "Malformed author.");
+        }
+        else if (strncmp(p, "committer ", 10) == 0)
+        {
+            validate(parse_ident(p + 10, eol - p - 10, &info->committer, &info->committer_mail, &info->committer_time, &info->committer_tz), "Malformed committer.");
+        }
+
+        p = eol + 1;
+    }
+
+    // The summary is the first line of the message after any blank ones
+    while (p < end && *p == '\n') p++;
+
+    const char *summary_end = memchr(p, '\n', p < end ? end - p : 0);
+    info->summary = strndup(p, (summary_end ? summary_end : end) - p);
+    validate(info->summary && info->author && info->committer, "Malformed commit '%s'.", hash_hex);
+
+    free(content);
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
+
+static blame_commit_info *get_commit_info(blame_scoreboard *sb, const commit *commit)
+{
+    uint64_t index;
+    if (oid_map_get(&sb->infos_by_commit, commit->hash, &index)) return sb->infos[index];
+
+    validate(grow_array((void **)&sb->infos, &sb->info_capacity, sb->info_count, sizeof(blame_commit_info *)), "Failed to grow infos.");
+
+    blame_commit_info *info = calloc(1, sizeof(blame_commit_info));
+    validate(info, "Failed to allocate memory.");
+
+    sb->infos[sb->info_count] = info;
+    validate(oid_map_put(&sb->infos_by_commit, commit->hash, sb->info_count++), "Failed to cache commit info.");
+    validate(parse_commit_info(commit, info), "Failed to parse commit.");
+
+    return info;
+
+error:
+    return nullptr;
+}
+
+// Root commits are the boundary of the blame, as in git without --root
+static bool is_boundary(const blame_origin *origin)
+{
+    return !origin->commit->parent_count;
+}
+
+// The porcelain of git blame --incremental: the commit details the first
+// time a commit shows up, its file name every time
+static bool emit_incremental(blame_scoreboard *sb, const blame_origin *origin, const blame_entry *entry)
+{
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, origin->commit->hash);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    printf("%s %u %u %u\n", hash_hex, entry->s_lno + 1, entry->lno + 1, entry->num_lines);
+
+    blame_commit_info *info = get_commit_info(sb, origin->commit);
+    validate(info, "Failed to read commit details.");
+
+    if (!info->is_shown)
+    {
+        info->is_shown = true;
+
+        printf("author %s\n", info->author);
+        printf("author-mail %s\n", info->author_mail);
+        printf("author-time %s\n", info->author_time);
+        printf("author-tz %s\n", info->author_tz);
+        printf("committer %s\n", info->committer);
+        printf("committer-mail %s\n", info->committer_mail);
+        printf("committer-time %s\n", info->committer_time);
+        printf("committer-tz %s\n", info->committer_tz);
+        printf("summary %s\n", info->summary);
+        if (is_boundary(origin)) printf("boundary\n");
+    }
+
+    if (origin->previous)
+    {
+        hash_bytes_to_hex(hash_hex, origin->previous->commit->hash);
+        hash_hex[SHA_HEX_LENGTH] = '\0';
+
+        printf("previous %s %s\n", hash_hex, origin->previous->path);
+    }
+
+    printf("filename %s\n", origin->path);
+
+    // Consumers act on each range as it is found
+    fflush(stdout);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool take_responsibility(blame_scoreboard *sb, blame_origin *origin)
+{
+    for (size_t i = 0; i < origin->suspect_count; i++)
+    {
+        if (incremental_opt) validate(emit_incremental(sb, origin, &origin->suspects[i]), "Failed to write entry.");
+
+        validate(grow_array((void **)&sb->results, &sb->result_capacity, sb->result_count, sizeof(blamed_range)), "Failed to grow results.");
+        sb->results[sb->result_count++] = (blamed_range){ .origin = origin, .entry = origin->suspects[i] };
+    }
+
+    origin->suspect_count = 0;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Newest commits first, so every commit has heard from all its children
+// before it passes blame on
+static bool assign_blame(blame_scoreboard *sb)
+{
+    commit *commit;
+    while ((commit = commit_queue_get(&sb->queue)) != nullptr)
+    {
+        uint64_t value;
+        if (!oid_map_get(&sb->origins_by_commit, commit->hash, &value)) continue;
+
+        for (blame_origin *origin = (blame_origin *)(uintptr_t)value; origin; origin = origin->next)
+        {
+            if (!origin->suspect_count) continue;
+
+            validate(parse_commit(commit), "Failed to parse commit.");
+            validate(pass_blame(sb, origin), "Failed to pass blame.");
+            validate(take_responsibility(sb, origin), "Failed to take blame.");
+
+            // Parents that need the contents have taken a reference
+            release_blob(origin->blob);
+            origin->blob = nullptr;
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static int compare_results_by_line(const void *a, const void *b)
+{
+    const uint32_t lno_a = ((const blamed_range *)a)->entry.lno;
+    const uint32_t lno_b = ((const blamed_range *)b)->entry.lno;
+
+    return (lno_a > lno_b) - (lno_a < lno_b);
+}
+
+static int count_digits(size_t value)
+{
+    int digits = 1;
+    while (value >= 10)
+    {
+        value /= 10;
+        digits++;
+    }
+
+    return digits;
+}
+
+// git's default iso date, in the author's own time zone
+static void format_blame_date(const char *time_text, const char *tz_text, char *out, const size_t out_size)
+{
+    const long tz = strtol(tz_text, nullptr, 10);
+    const long offset = (tz < 0 ? -1 : 1) * ((labs(tz) / 100) * 60 + labs(tz) % 100) * 60;
+    const time_t local = (time_t)(strtoll(time_text, nullptr, 10) + offset);
+
+    struct tm tm;
+    gmtime_r(&local, &tm);
+
+    (void)snprintf(out, out_size, "%04d-%02d-%02d %02d:%02d:%02d %s",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tz_text);
+}
+
+// git's automatic abbreviation: enough hex digits that a collision among
+// the packed objects is unlikely, plus one for the boundary marker
+static int get_blame_abbrev(void)
+{
+    const midx_file *midx = get_multi_pack_index();
+    size_t count = midx ? midx->object_count : 0;
+
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        if (!pack->is_in_midx) count += pack->object_count;
+    }
+
+    int bits = 1;
+    while (count >>= 1) bits++;
+
+    const int len = (bits + 1) / 2;
+
+    return (len < MIN_ABBREV ? MIN_ABBREV : len) + 1;
+}
+
+// hash (author date line) content, one line each, like git blame
+static bool show_blame(blame_scoreboard *sb, const blame_blob *final)
+{
+    qsort(sb->results, sb->result_count, sizeof(blamed_range), compare_results_by_line);
+
+    size_t longest_author = 0;
+    size_t longest_path = 0;
+    bool is_path_shown = false;
+
+    for (size_t i = 0; i < sb->result_count; i++)
+    {
+        const blame_origin *origin = sb->results[i].origin;
+
+        const blame_commit_info *info = get_commit_info(sb, origin->commit);
+        validate(info, "Failed to read commit details.");
+
+        if (strlen(info->author) > longest_author) longest_author = strlen(info->author);
+        if (strlen(origin->path) > longest_path) longest_path = strlen(origin->path);
+        if (strcmp(origin->path, sb->path) != 0) is_path_shown = true;
+    }
+
+    size_t line_count = 0;
+    for (size_t i = 0; i < sb->result_count; i++) line_count += sb->results[i].entry.num_lines;
+
+    const int max_digits = count_digits(line_count);
+    const int abbrev = get_blame_abbrev();
+    const char *line = final->data;
+    const char *end = final->data + final->size;
+
+    for (size_t i = 0; i < sb->result_count; i++)
+    {
+        const blame_origin *origin = sb->results[i].origin;
+        const blame_entry *entry = &sb->results[i].entry;
+        const blame_commit_info *info = get_commit_info(sb, origin->commit);
+
+        char hash_hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hash_hex, origin->commit->hash);
+
+        char date[64];
+        format_blame_date(info->author_time, info->author_tz, date, sizeof(date));
+
+        for (uint32_t n = 0; n < entry->num_lines; n++)
+        {
+            if (is_boundary(origin))
+                printf("^%.*s", abbrev - 1, hash_hex);
+            else
+                printf("%.*s", abbrev, hash_hex);
+
+            if (is_path_shown) printf(" %-*s", (int)longest_path, origin->path);
+
+            printf(" (%-*s %s %*u) ", (int)longest_author, info->author, date, max_digits, entry->lno + n + 1);
+
+            const char *eol = memchr(line, '\n', end - line);
+            const char *line_end = eol ? eol + 1 : end;
+
+            fwrite(line, 1, line_end - line, stdout);
+            if (!eol) putchar('\n');
+
+            line = line_end;
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static void destroy_scoreboard(blame_scoreboard *sb)
+{
+    commit_queue_destroy(&sb->queue);
+
+    for (size_t i = 0; i < sb->origin_count; i++)
+    {
+        blame_origin *origin = sb->origins[i];
+
+        free(origin->path);
+        if (origin->suspects) free(origin->suspects);
+        if (origin->bloom_keys) free(origin->bloom_keys);
+        free(origin);
+    }
+
+    for (size_t i = 0; i < sb->blob_count; i++)
+    {
+        if (sb->blobs[i]->content) free(sb->blobs[i]->content);
+        free(sb->blobs[i]);
+    }
+
+    for (size_t i = 0; i < sb->diff_count; i++) free(sb->diffs[i].regions);
+
+    for (size_t i = 0; i < sb->info_count; i++)
+    {
+        blame_commit_info *info = sb->infos[i];
+        char *fields[] = {
+            info->author, info->author_mail, info->author_time, info->author_tz,
+            info->committer, info->committer_mail, info->committer_time, info->committer_tz,
+            info->summary,
+        };
+
+        for (size_t j = 0; j < sizeof(fields) / sizeof(fields[0]); j++)
+        {
+            if (fields[j]) free(fields[j]);
+        }
+
+        free(info);
+    }
+
+    if (sb->origins) free(sb->origins);
+    if (sb->blobs) free(sb->blobs);
+    if (sb->diffs) free(sb->diffs);
+    if (sb->infos) free(sb->infos);
+    if (sb->results) free(sb->results);
+
+    if (sb->origins_by_commit.entries) oid_map_destroy(&sb->origins_by_commit);
+    if (sb->blobs_by_hash.entries) oid_map_destroy(&sb->blobs_by_hash);
+    if (sb->diffs_by_pair.entries) oid_map_destroy(&sb->diffs_by_pair);
+    if (sb->infos_by_commit.entries) oid_map_destroy(&sb->infos_by_commit);
+}
+
+static size_t count_lines(const blame_blob *blob)
+{
+    size_t count = 0;
+    for (const char *p = blob->data; (p = memchr(p, '\n', blob->data + blob->size - p)); p++) count++;
+
+    return count + (blob->size && blob->data[blob->size - 1] != '\n');
+}
+
+// blame [--incremental] [<rev>] [--] <file>
+int blame(const int argc, char *argv[])
+{
+    blame_scoreboard sb = { };
+    blame_blob *final_blob = nullptr;
+    commit_queue_init(&sb.queue);
+
+    validate(try_resolve_blame_opts(argc, argv), "Failed to resolve options.");
+
+    const command_args args = get_command_args(argc, argv);
+    validate(args.count == 1 || args.count == 2, "Usage: blame [--incremental] [<rev>] [--] <file>");
+
+    const char *rev = args.count == 2 ? args.argv[0] : "HEAD";
+    sb.path = args.argv[args.count - 1];
+
+    char commit_hex[SHA_HEX_LENGTH + 1];
+    validate(resolve_commit_hex(rev, commit_hex), "Not a valid commit '%s'.", rev);
+
+    unsigned char commit_hash[SHA_DIGEST_LENGTH];
+    hash_hex_to_bytes(commit_hash, commit_hex);
+
+    commit *final_commit = lookup_commit(commit_hash);
+    validate(final_commit && parse_commit(final_commit), "Failed to read commit '%s'.", rev);
+
+    unsigned char blob_hash[SHA_DIGEST_LENGTH];
+    unsigned int mode;
+    validate(find_tree_entry(final_commit->tree_hash, sb.path, blob_hash, &mode), "Failed to read tree of '%s'.", rev);
+    validate(mode && !is_tree_mode(mode) && (mode & 0170000) != TREE_MODE_GITLINK, "No such file '%s' in %s.", sb.path, rev);
+
+    validate(oid_map_init(&sb.origins_by_commit, 256), "Failed to allocate memory.");
+    validate(oid_map_init(&sb.blobs_by_hash, 256), "Failed to allocate memory.");
+    validate(oid_map_init(&sb.diffs_by_pair, 256), "Failed to allocate memory.");
+    validate(oid_map_init(&sb.infos_by_commit, 256), "Failed to allocate memory.");
+
+    blame_origin *final = get_origin(&sb, final_commit, sb.path, blob_hash, mode);
+    validate(final && load_origin_blob(&sb, final), "Failed to read '%s'.", sb.path);
+
+    // The final blob outlives its origin, for the output
+    final_blob = final->blob;
+    final_blob->refs++;
+
+    const blame_entry whole = { .num_lines = (uint32_t)count_lines(final_blob) };
+    validate(queue_blames(&sb, final, &whole, whole.num_lines ? 1 : 0), "Failed to start blame.");
+
+    validate(assign_blame(&sb), "Failed to blame '%s'.", sb.path);
+
+    if (!incremental_opt) validate(show_blame(&sb, final_blob), "Failed to show blame.");
+
+    fflush(stdout);
+
+    release_blob(final_blob);
+    destroy_scoreboard(&sb);
+
+    return 0;
+
+error:
+    fflush(stdout);
+
+    release_blob(final_blob);
+    destroy_scoreboard(&sb);
+
+    return 1;
+}
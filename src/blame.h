@@ -0,0 +1,6 @@
+#ifndef BLAME_H
+#define BLAME_H
+
+int blame(int argc, char *argv[]);
+
+#endif //BLAME_H
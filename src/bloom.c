@@ -0,0 +1,277 @@
+#include "bloom.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "tree_diff.h"
+
+#define BITS_PER_WORD 8
+#define BLOOM_TRUNCATED_FILTER 0xff
+
+static const uint32_t bloom_seed0 = 0x293ae76f;
+static const uint32_t bloom_seed1 = 0x7e646e2c;
+
+typedef struct changed_paths
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+    size_t change_count;
+    bool is_truncated;
+} changed_paths;
+
+static uint32_t rotate_left(const uint32_t value, const int count)
+{
+    return value << count | value >> (32 - count);
+}
+
+static uint32_t get_byte(const char *data, const size_t i, const uint32_t hash_version)
+{
+    if (hash_version == BLOOM_HASH_VERSION_SIGNED_CHARS) return (uint32_t)(int32_t)(signed char)data[i];
+
+    return (unsigned char)data[i];
+}
+
+uint32_t murmur3_seeded(uint32_t seed, const char *data, const size_t len, const uint32_t hash_version)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const size_t len4 = len / 4;
+
+    for (size_t i = 0; i < len4; i++)
+    {
+        uint32_t k = get_byte(data, 4 * i, hash_version)
+            | get_byte(data, 4 * i + 1, hash_version) << 8
+            | get_byte(data, 4 * i + 2, hash_version) << 16
+            | get_byte(data, 4 * i + 3, hash_version) << 24;
+
+        k *= c1;
+        k = rotate_left(k, 15);
+        k *= c2;
+
+        seed ^= k;
+        seed = rotate_left(seed, 13) * 5 + 0xe6546b64;
+    }
+
+    const size_t tail = len4 * 4;
+    uint32_t k1 = 0;
+
+    switch (len & 3)
+    {
+        case 3:
+            k1 ^= get_byte(data, tail + 2, hash_version) << 16;
+            [[fallthrough]];
+        case 2:
+            k1 ^= get_byte(data, tail + 1, hash_version) << 8;
+            [[fallthrough]];
+        case 1:
+            k1 ^= get_byte(data, tail, hash_version);
+            k1 *= c1;
+            k1 = rotate_left(k1, 15);
+            k1 *= c2;
+            seed ^= k1;
+            break;
+        default:
+            break;
+    }
+
+    seed ^= (uint32_t)len;
+    seed ^= seed >> 16;
+    seed *= 0x85ebca6b;
+    seed ^= seed >> 13;
+    seed *= 0xc2b2ae35;
+    seed ^= seed >> 16;
+
+    return seed;
+}
+
+void fill_bloom_key(const char *path, const size_t len, const bloom_settings *settings, bloom_key *key)
+{
+    key->hash0 = murmur3_seeded(bloom_seed0, path, len, settings->hash_version);
+    key->hash1 = murmur3_seeded(bloom_seed1, path, len, settings->hash_version);
+}
+
+void add_key_to_bloom_filter(const bloom_key *key, unsigned char *data, const size_t len, const bloom_settings *settings)
+{
+    const uint64_t bit_count = (uint64_t)len * BITS_PER_WORD;
+
+    for (uint32_t i = 0; i < settings->num_hashes; i++)
+    {
+        const uint64_t pos = (uint32_t)(key->hash0 + i * key->hash1) % bit_count;
+        data[pos / BITS_PER_WORD] |= 1 << (pos % BITS_PER_WORD);
+    }
+}
+
+bool bloom_filter_may_contain(const bloom_filter *filter, const bloom_key *key, const bloom_settings *settings)
+{
+    if (!filter->len) return true;
+
+    const uint64_t bit_count = (uint64_t)filter->len * BITS_PER_WORD;
+
+    for (uint32_t i = 0; i < settings->num_hashes; i++)
+    {
+        const uint64_t pos = (uint32_t)(key->hash0 + i * key->hash1) % bit_count;
+        if (!(filter->data[pos / BITS_PER_WORD] & 1 << (pos % BITS_PER_WORD))) return false;
+    }
+
+    return true;
+}
+
+size_t count_bloom_path_keys(const char *path)
+{
+    size_t count = 1;
+    for (const char *c = path; *c; c++) count += *c == '/';
+
+    return count;
+}
+
+size_t fill_bloom_path_keys(const char *path, const bloom_settings *settings, bloom_key *keys)
+{
+    size_t count = 0;
+
+    for (size_t len = strlen(path); len > 0; len--)
+    {
+        if (path[len] != '\0' && path[len] != '/') continue;
+
+        fill_bloom_key(path, len, settings, &keys[count++]);
+    }
+
+    return count;
+}
+
+bool bloom_filter_may_contain_path(const bloom_filter *filter, const bloom_key *keys, const size_t key_count, const bloom_settings *settings)
+{
+    for (size_t i = 0; i < key_count; i++)
+    {
+        if (!bloom_filter_may_contain(filter, &keys[i], settings)) return false;
+    }
+
+    return true;
+}
+
+static bool add_changed_path(changed_paths *changes, const char *path, const size_t len)
+{
+    if (changes->count == changes->capacity)
+    {
+        const size_t capacity = changes->capacity ? changes->capacity * 2 : 64;
+
+        char **paths = realloc(changes->paths, capacity * sizeof(char *));
+        validate(paths, "Failed to allocate memory.");
+
+        changes->paths = paths;
+        changes->capacity = capacity;
+    }
+
+    changes->paths[changes->count] = strndup(path, len);
+    validate(changes->paths[changes->count], "Failed to allocate memory.");
+    changes->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+// A change to dir/subdir/file also counts for dir/subdir and dir, so that
+// history of a directory can use the filters too. Past the limit the diff
+// runs on without collecting, as stopping it would read as a failure.
+static bool collect_changed_path(const tree_change *change, void *ctx)
+{
+    changed_paths *changes = ctx;
+
+    if (++changes->change_count > BLOOM_MAX_CHANGED_PATHS) changes->is_truncated = true;
+    if (changes->is_truncated) return true;
+
+    for (size_t len = strlen(change->path); len > 0;)
+    {
+        validate(add_changed_path(changes, change->path, len), "Failed to record changed path.");
+
+        while (len > 0 && change->path[len - 1] != '/') len--;
+        if (len > 0) len--;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool compute_changed_paths_filter(
+    const unsigned char *old_tree,
+    const unsigned char *new_tree,
+    const bloom_settings *settings,
+    unsigned char **data,
+    size_t *len)
+{
+    changed_paths changes = { };
+    *data = nullptr;
+    *len = 0;
+
+    const diff_tree_opts opts = { .recursive = true, .report = collect_changed_path, .ctx = &changes };
+    validate(diff_tree_hashes(old_tree, new_tree, &opts), "Failed to diff trees.");
+
+    size_t unique_count = 0;
+
+    if (!changes.is_truncated)
+    {
+        qsort(changes.paths, changes.count, sizeof(char *), compare_paths);
+
+        for (size_t i = 0; i < changes.count; i++)
+        {
+            if (unique_count && strcmp(changes.paths[unique_count - 1], changes.paths[i]) == 0)
+            {
+                free(changes.paths[i]);
+                continue;
+            }
+
+            changes.paths[unique_count++] = changes.paths[i];
+        }
+
+        changes.count = unique_count;
+        changes.is_truncated = unique_count > BLOOM_MAX_CHANGED_PATHS;
+    }
+
+    if (changes.is_truncated)
+    {
+        *data = malloc(1);
+        validate(*data, "Failed to allocate memory.");
+
+        **data = BLOOM_TRUNCATED_FILTER;
+        *len = 1;
+    }
+    else
+    {
+        // No changes at all still gets a byte, all zeros, to tell it apart
+        // from a filter that was never computed
+        *len = (unique_count * settings->bits_per_entry + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        if (!*len) *len = 1;
+
+        *data = calloc(*len, 1);
+        validate(*data, "Failed to allocate memory.");
+
+        for (size_t i = 0; i < unique_count; i++)
+        {
+            bloom_key key;
+            fill_bloom_key(changes.paths[i], strlen(changes.paths[i]), settings, &key);
+            add_key_to_bloom_filter(&key, *data, *len, settings);
+        }
+    }
+
+    for (size_t i = 0; i < changes.count; i++) free(changes.paths[i]);
+    if (changes.paths) free(changes.paths);
+
+    return true;
+
+error:
+    for (size_t i = 0; i < changes.count; i++) free(changes.paths[i]);
+    if (changes.paths) free(changes.paths);
+    *len = 0;
+
+    return false;
+}
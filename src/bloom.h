@@ -0,0 +1,68 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Changed-path filters as git stores them in the commit-graph. Version 1
+// hashes path bytes as signed chars, as git did before version 2 fixed it;
+// the two only disagree on paths with bytes above 0x7f.
+#define BLOOM_HASH_VERSION_SIGNED_CHARS 1
+#define BLOOM_HASH_VERSION_UNSIGNED_CHARS 2
+#define BLOOM_NUM_HASHES 7
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_MAX_CHANGED_PATHS 512
+#define BLOOM_DATA_HEADER_SIZE 12
+
+typedef struct bloom_settings
+{
+    uint32_t hash_version;
+    uint32_t num_hashes;
+    uint32_t bits_per_entry;
+} bloom_settings;
+
+// The k bit positions of a key are hash0 + i * hash1
+typedef struct bloom_key
+{
+    uint32_t hash0;
+    uint32_t hash1;
+} bloom_key;
+
+// Filters are byte arrays; a single 0xff byte marks a commit that changed
+// too many paths to be worth filtering
+typedef struct bloom_filter
+{
+    const unsigned char *data;
+    size_t len;
+} bloom_filter;
+
+uint32_t murmur3_seeded(uint32_t seed, const char *data, size_t len, uint32_t hash_version);
+
+void fill_bloom_key(const char *path, size_t len, const bloom_settings *settings, bloom_key *key);
+
+void add_key_to_bloom_filter(const bloom_key *key, unsigned char *data, size_t len, const bloom_settings *settings);
+
+// False means the path was definitely not changed
+bool bloom_filter_may_contain(const bloom_filter *filter, const bloom_key *key, const bloom_settings *settings);
+
+// Keys of a path and of each of its leading directories, as many as the
+// path has components; keys needs room for that many
+size_t fill_bloom_path_keys(const char *path, const bloom_settings *settings, bloom_key *keys);
+
+size_t count_bloom_path_keys(const char *path);
+
+// A changed path sets the keys of all its leading directories too, so a
+// filter missing any of them rules the path out
+bool bloom_filter_may_contain_path(const bloom_filter *filter, const bloom_key *keys, size_t key_count, const bloom_settings *settings);
+
+// The filter of paths changed between two trees, leading directories
+// included, as git builds it for a commit and its first parent. A null
+// hash stands for the empty tree. *data is malloc'ed.
+bool compute_changed_paths_filter(
+    const unsigned char *old_tree,
+    const unsigned char *new_tree,
+    const bloom_settings *settings,
+    unsigned char **data,
+    size_t *len);
+
+#endif //BLOOM_H
@@ -10,6 +10,7 @@
 #include <zlib.h>
 
 #include "git_obj_helpers.h"
+#include "refs.h"
 
 bool pretty_print_opt = false;
 bool show_type_opt = false;
@@ -80,9 +81,13 @@ int cat_file(const int argc, char *argv[])
 {
     validate(try_resolve_cat_file_opts(argc, argv), "Failed to resolve options.");
 
-    const char *obj_hash = argv[3];
     char *inflated_buffer = nullptr;
 
+    validate(argc > 3, "Usage: cat-file (-t | -s | -p) <object>");
+
+    char obj_hash[SHA_HEX_LENGTH + 1];
+    validate(resolve_revision_hex(argv[3], obj_hash), "Not a valid object name '%s'.", argv[3]);
+
     (void)get_object_content(obj_hash, &inflated_buffer);
     validate(inflated_buffer, "Failed to obtain object content.");
 
@@ -0,0 +1,335 @@
+#include "commit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit_graph.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "oid_map.h"
+#include "shallow.h"
+
+#define COMMIT_BLOCK_SIZE 4096
+#define COMMIT_QUEUE_MIN_CAPACITY 64
+
+static oid_map commits = { };
+static bool is_commit_store_prepared = false;
+static commit *current_block = nullptr;
+static size_t current_block_used = COMMIT_BLOCK_SIZE;
+static uint32_t graph_commit_count = 0;
+static uint32_t other_commit_count = 0;
+
+static bool prepare_commit_store(void)
+{
+    validate(oid_map_init(&commits, COMMIT_BLOCK_SIZE), "Failed to allocate commit map.");
+
+    const commit_graph *graph = get_commit_graph();
+    graph_commit_count = graph ? graph->commit_count : 0;
+    is_commit_store_prepared = true;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Commits are never freed one by one, so they are carved out of blocks
+static commit *alloc_commit(void)
+{
+    if (current_block_used == COMMIT_BLOCK_SIZE)
+    {
+        current_block = calloc(COMMIT_BLOCK_SIZE, sizeof(commit));
+        if (!current_block) return nullptr;
+
+        current_block_used = 0;
+    }
+
+    return &current_block[current_block_used++];
+}
+
+commit *lookup_commit(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (!is_commit_store_prepared && !prepare_commit_store()) return nullptr;
+
+    uint64_t value;
+    if (oid_map_get(&commits, hash, &value)) return (commit *)(uintptr_t)value;
+
+    commit *result = alloc_commit();
+    validate(result, "Failed to allocate memory.");
+
+    memcpy(result->hash, hash, SHA_DIGEST_LENGTH);
+    result->generation = GENERATION_NUMBER_INFINITY;
+    result->graph_position = COMMIT_NOT_FROM_GRAPH;
+
+    const commit_graph *graph = get_commit_graph();
+    uint32_t position;
+
+    if (graph && find_commit_graph_position(graph, hash, &position))
+    {
+        result->graph_position = position;
+        result->index = position;
+    }
+    else
+    {
+        result->index = graph_commit_count + other_commit_count++;
+    }
+
+    validate(oid_map_put(&commits, hash, (uint64_t)(uintptr_t)result), "Failed to store commit.");
+
+    return result;
+
+error:
+    return nullptr;
+}
+
+uint32_t get_commit_count(void)
+{
+    return graph_commit_count + other_commit_count;
+}
+
+static bool parse_commit_from_graph(commit *commit)
+{
+    const commit_graph *graph = get_commit_graph();
+
+    commit_graph_entry entry;
+    read_commit_graph_entry(graph, commit->graph_position, &entry);
+
+    memcpy(commit->tree_hash, entry.tree_hash, SHA_DIGEST_LENGTH);
+    commit->date = entry.date;
+
+    // Graphs written before generation numbers existed store zero
+    commit->generation = entry.generation ? entry.generation : GENERATION_NUMBER_INFINITY;
+
+    if (entry.parent_count)
+    {
+        commit->parents = malloc(entry.parent_count * sizeof(struct commit *));
+        validate(commit->parents, "Failed to allocate memory.");
+    }
+
+    uint32_t position;
+    for (uint32_t i = 0; get_commit_graph_parent(&entry, i, &position); i++)
+    {
+        validate(position < graph->commit_count, "Commit-graph parent position %u is out of range.", position);
+
+        struct commit *parent = lookup_commit(get_commit_graph_oid(graph, position));
+        validate(parent, "Failed to look up parent commit.");
+
+        commit->parents[commit->parent_count++] = parent;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_parent(commit *commit, const char *parent_hex, uint32_t *capacity)
+{
+    if (commit->parent_count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 1;
+
+        struct commit **grown = realloc(commit->parents, *capacity * sizeof(struct commit *));
+        validate(grown, "Failed to allocate memory.");
+        commit->parents = grown;
+    }
+
+    unsigned char parent_hash[SHA_DIGEST_LENGTH];
+    hash_hex_to_bytes(parent_hash, parent_hex);
+
+    struct commit *parent = lookup_commit(parent_hash);
+    validate(parent, "Failed to look up parent commit.");
+
+    commit->parents[commit->parent_count++] = parent;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Only the header lines up to the committer are looked at; author and
+// message are skipped
+static bool parse_commit_from_object(commit *commit)
+{
+    char *content = nullptr;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, commit->hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    const size_t size = get_object_content(hex, &content);
+    validate(content, "Failed to obtain object content.");
+    validate(strncmp(content, "commit ", 7) == 0, "Object '%s' is not a commit.", hex);
+
+    const char *line = &content[get_header_size(content) + 1];
+    const char *end = content + size;
+
+    validate(end - line > 5 + SHA_HEX_LENGTH && strncmp(line, "tree ", 5) == 0, "Malformed commit '%s'.", hex);
+    hash_hex_to_bytes(commit->tree_hash, &line[5]);
+    line += 5 + SHA_HEX_LENGTH + 1;
+
+    uint32_t capacity = 0;
+
+    // The parents of a shallow commit are not in the repository
+    const bool is_shallow = is_shallow_commit(commit->hash);
+
+    while (end - line > 7 + SHA_HEX_LENGTH && strncmp(line, "parent ", 7) == 0)
+    {
+        if (!is_shallow) validate(add_parent(commit, &line[7], &capacity), "Failed to add parent.");
+        line += 7 + SHA_HEX_LENGTH + 1;
+    }
+
+    while (line < end && *line != '\n')
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) break;
+
+        if (strncmp(line, "committer ", 10) == 0)
+        {
+            const char *email_end = memrchr(line, '>', eol - line);
+            if (email_end) commit->date = strtoull(email_end + 1, nullptr, 10);
+            break;
+        }
+
+        line = eol + 1;
+    }
+
+    free(content);
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
+
+bool parse_commit(commit *commit)
+{
+    if (commit->is_parsed) return true;
+
+    const bool result = commit->graph_position != COMMIT_NOT_FROM_GRAPH
+        ? parse_commit_from_graph(commit)
+        : parse_commit_from_object(commit);
+
+    if (!result)
+    {
+        if (commit->parents) free(commit->parents);
+        commit->parents = nullptr;
+        commit->parent_count = 0;
+
+        return false;
+    }
+
+    commit->is_parsed = true;
+
+    return true;
+}
+
+int compare_commits_by_generation(const commit *a, const commit *b)
+{
+    if (a->generation != b->generation) return a->generation > b->generation ? 1 : -1;
+    if (a->date != b->date) return a->date > b->date ? 1 : -1;
+
+    return 0;
+}
+
+void commit_queue_init(commit_queue *queue)
+{
+    *queue = (commit_queue){ };
+}
+
+void commit_queue_destroy(commit_queue *queue)
+{
+    if (queue->commits) free(queue->commits);
+    if (queue->order) free(queue->order);
+
+    *queue = (commit_queue){ };
+}
+
+static bool is_before(const commit_queue *queue, const size_t i, const size_t j)
+{
+    const int cmp = compare_commits_by_generation(queue->commits[i], queue->commits[j]);
+    if (cmp) return cmp > 0;
+
+    return queue->order[i] < queue->order[j];
+}
+
+static void swap_entries(const commit_queue *queue, const size_t i, const size_t j)
+{
+    commit *commit = queue->commits[i];
+    queue->commits[i] = queue->commits[j];
+    queue->commits[j] = commit;
+
+    const uint64_t order = queue->order[i];
+    queue->order[i] = queue->order[j];
+    queue->order[j] = order;
+}
+
+bool commit_queue_put(commit_queue *queue, commit *commit)
+{
+    if (queue->count == queue->capacity)
+    {
+        const size_t capacity = queue->capacity ? queue->capacity * 2 : COMMIT_QUEUE_MIN_CAPACITY;
+
+        struct commit **commits = realloc(queue->commits, capacity * sizeof(struct commit *));
+        validate(commits, "Failed to allocate memory.");
+        queue->commits = commits;
+
+        uint64_t *order = realloc(queue->order, capacity * sizeof(uint64_t));
+        validate(order, "Failed to allocate memory.");
+        queue->order = order;
+
+        queue->capacity = capacity;
+    }
+
+    size_t i = queue->count++;
+    queue->commits[i] = commit;
+    queue->order[i] = queue->next_order++;
+
+    while (i > 0)
+    {
+        const size_t parent = (i - 1) / 2;
+        if (!is_before(queue, i, parent)) break;
+
+        swap_entries(queue, i, parent);
+        i = parent;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+commit *commit_queue_get(commit_queue *queue)
+{
+    if (!queue->count) return nullptr;
+
+    commit *result = queue->commits[0];
+    queue->count--;
+
+    if (!queue->count) return result;
+
+    queue->commits[0] = queue->commits[queue->count];
+    queue->order[0] = queue->order[queue->count];
+
+    size_t i = 0;
+
+    while (true)
+    {
+        const size_t left = 2 * i + 1;
+        const size_t right = left + 1;
+        size_t best = i;
+
+        if (left < queue->count && is_before(queue, left, best)) best = left;
+        if (right < queue->count && is_before(queue, right, best)) best = right;
+        if (best == i) break;
+
+        swap_entries(queue, i, best);
+        i = best;
+    }
+
+    return result;
+}
@@ -0,0 +1,54 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+// Commits are interned: one struct per oid for the life of the process.
+// index is the commit-graph position for commits found there, so per-commit
+// slabs line up with the graph; other commits are numbered after them.
+typedef struct commit
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    unsigned char tree_hash[SHA_DIGEST_LENGTH];
+    struct commit **parents;
+    uint32_t parent_count;
+    uint32_t index;
+    uint32_t graph_position;
+    uint32_t generation;
+    uint64_t date;
+    bool is_parsed;
+} commit;
+
+// Max-heap on generation, then commit date; equal keys come out in
+// insertion order
+typedef struct commit_queue
+{
+    commit **commits;
+    uint64_t *order;
+    size_t count;
+    size_t capacity;
+    uint64_t next_order;
+} commit_queue;
+
+commit *lookup_commit(const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Fills tree, parents, generation and date, from the commit-graph when it
+// has the commit. Objects are only read up to the committer line.
+bool parse_commit(commit *commit);
+
+// Number of commits interned so far; every index is below it
+uint32_t get_commit_count(void);
+
+int compare_commits_by_generation(const commit *a, const commit *b);
+
+void commit_queue_init(commit_queue *queue);
+
+void commit_queue_destroy(commit_queue *queue);
+
+bool commit_queue_put(commit_queue *queue, commit *commit);
+
+commit *commit_queue_get(commit_queue *queue);
+
+#endif //COMMIT_H
@@ -0,0 +1,676 @@
+#include "commit_graph.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+#include "oid_map.h"
+#include "packfile.h"
+#include "shallow.h"
+#include "thread_pool.h"
+
+#define COMMIT_GRAPH_DATE_MASK ((1ULL << 34) - 1)
+
+typedef struct graph_dfs_frame
+{
+    commit *commit;
+    uint32_t next_parent;
+} graph_dfs_frame;
+
+typedef struct changed_paths_filter
+{
+    unsigned char *data;
+    size_t len;
+    bool is_reused;
+} changed_paths_filter;
+
+// Commits of the graph being written, in oid order, with what is known
+// about each by graph position
+typedef struct graph_writer
+{
+    commit **commits;
+    uint32_t count;
+    oid_map positions;
+    uint32_t *generations;
+    size_t extra_edge_count;
+
+    changed_paths_filter *filters;
+    bloom_settings settings;
+    const commit_graph *previous;
+} graph_writer;
+
+static commit_graph graph = { };
+static bool is_commit_graph_prepared = false;
+static bool has_commit_graph = false;
+
+static bool parse_commit_graph(const unsigned char *data, const size_t size)
+{
+    validate(size >= COMMIT_GRAPH_HEADER_SIZE + SHA_DIGEST_LENGTH, "Commit-graph file is too small.");
+    validate(memcmp(data, COMMIT_GRAPH_SIGNATURE, 4) == 0, "Commit-graph signature mismatch.");
+    validate(data[4] == COMMIT_GRAPH_VERSION, "Unsupported commit-graph version %d.", data[4]);
+    validate(data[5] == COMMIT_GRAPH_HASH_VERSION, "Unsupported commit-graph hash version %d.", data[5]);
+
+    const uint8_t chunk_count = data[6];
+    size_t bloom_indexes_size = 0;
+    const size_t table_end = COMMIT_GRAPH_HEADER_SIZE + ((size_t)chunk_count + 1) * COMMIT_GRAPH_CHUNK_ENTRY_SIZE;
+    validate(table_end <= size - SHA_DIGEST_LENGTH, "Commit-graph chunk table is truncated.");
+
+    graph = (commit_graph){ .data = data, .size = size };
+
+    for (uint8_t i = 0; i < chunk_count; i++)
+    {
+        const unsigned char *entry = &data[COMMIT_GRAPH_HEADER_SIZE + (size_t)i * COMMIT_GRAPH_CHUNK_ENTRY_SIZE];
+        const uint32_t chunk_id = get_be32(entry);
+        const uint64_t offset = get_be64(&entry[4]);
+        const uint64_t next_offset = get_be64(&entry[4 + COMMIT_GRAPH_CHUNK_ENTRY_SIZE]);
+
+        validate(offset >= table_end && offset <= next_offset && next_offset <= size - SHA_DIGEST_LENGTH,
+                 "Commit-graph chunk %08x is out of bounds.", chunk_id);
+
+        const size_t chunk_size = next_offset - offset;
+
+        switch (chunk_id)
+        {
+            case CHUNK_ID_OID_FANOUT:
+                validate(chunk_size == PACK_FANOUT_SIZE, "Malformed commit-graph fanout.");
+                graph.oid_fanout = &data[offset];
+                graph.commit_count = get_be32(&graph.oid_fanout[255 * 4]);
+                break;
+            case CHUNK_ID_OID_LOOKUP:
+                graph.oid_lookup = &data[offset];
+                break;
+            case CHUNK_ID_COMMIT_DATA:
+                graph.commit_data = &data[offset];
+                break;
+            case CHUNK_ID_EXTRA_EDGES:
+                graph.extra_edges = &data[offset];
+                graph.extra_edge_count = chunk_size / 4;
+                break;
+            case CHUNK_ID_BLOOM_INDEXES:
+                graph.bloom_indexes = &data[offset];
+                bloom_indexes_size = chunk_size;
+                break;
+            case CHUNK_ID_BLOOM_DATA:
+                if (chunk_size < BLOOM_DATA_HEADER_SIZE) break;
+
+                graph.bloom_settings = (bloom_settings){
+                    .hash_version = get_be32(&data[offset]),
+                    .num_hashes = get_be32(&data[offset + 4]),
+                    .bits_per_entry = get_be32(&data[offset + 8]),
+                };
+                graph.bloom_data = &data[offset + BLOOM_DATA_HEADER_SIZE];
+                graph.bloom_data_size = chunk_size - BLOOM_DATA_HEADER_SIZE;
+                break;
+            default:
+                break;
+        }
+    }
+
+    validate(graph.oid_fanout && graph.oid_lookup && graph.commit_data, "Commit-graph is missing required chunks.");
+
+    // Filters are an optimization; ones that cannot be used are ignored
+    const uint32_t hash_version = graph.bloom_settings.hash_version;
+    const bool has_usable_filters = graph.bloom_indexes && graph.bloom_data
+        && bloom_indexes_size == (size_t)graph.commit_count * 4
+        && (hash_version == BLOOM_HASH_VERSION_SIGNED_CHARS || hash_version == BLOOM_HASH_VERSION_UNSIGNED_CHARS)
+        && graph.bloom_settings.num_hashes > 0;
+
+    if (!has_usable_filters)
+    {
+        graph.bloom_indexes = nullptr;
+        graph.bloom_data = nullptr;
+        graph.bloom_data_size = 0;
+        graph.bloom_settings = (bloom_settings){ };
+    }
+
+    return true;
+
+error:
+    graph = (commit_graph){ };
+
+    return false;
+}
+
+static void prepare_commit_graph(void)
+{
+    is_commit_graph_prepared = true;
+
+    // Parents and generations in a graph describe history a shallow
+    // repository cuts off, so there it goes unused, as in git
+    if (is_shallow_repository()) return;
+
+    char path[PATH_MAX];
+    if (!get_git_path(path, PATH_MAX, "objects/info/commit-graph")) return;
+
+    size_t size = 0;
+    const unsigned char *data = map_file(path, &size);
+    if (!data) return;
+
+    if (!parse_commit_graph(data, size))
+    {
+        munmap((void *)data, size);
+        return;
+    }
+
+    has_commit_graph = true;
+}
+
+const commit_graph *get_commit_graph(void)
+{
+    if (!is_commit_graph_prepared) prepare_commit_graph();
+
+    return has_commit_graph ? &graph : nullptr;
+}
+
+void reprepare_commit_graph(void)
+{
+    if (has_commit_graph) munmap((void *)graph.data, graph.size);
+
+    graph = (commit_graph){ };
+    has_commit_graph = false;
+    is_commit_graph_prepared = false;
+}
+
+const unsigned char *get_commit_graph_oid(const commit_graph *graph, const uint32_t position)
+{
+    return &graph->oid_lookup[(size_t)position * SHA_DIGEST_LENGTH];
+}
+
+bool find_commit_graph_position(const commit_graph *graph, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *position)
+{
+    uint32_t lo = hash[0] == 0 ? 0 : get_be32(&graph->oid_fanout[(hash[0] - 1) * 4]);
+    uint32_t hi = get_be32(&graph->oid_fanout[hash[0] * 4]);
+
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(get_commit_graph_oid(graph, mid), hash, SHA_DIGEST_LENGTH);
+
+        if (cmp == 0)
+        {
+            *position = mid;
+            return true;
+        }
+
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return false;
+}
+
+void read_commit_graph_entry(const commit_graph *graph, const uint32_t position, commit_graph_entry *entry)
+{
+    const unsigned char *data = &graph->commit_data[(size_t)position * COMMIT_GRAPH_DATA_SIZE];
+
+    *entry = (commit_graph_entry){ .tree_hash = data };
+
+    const uint32_t parent1 = get_be32(&data[SHA_DIGEST_LENGTH]);
+    const uint32_t parent2 = get_be32(&data[SHA_DIGEST_LENGTH + 4]);
+
+    if (parent1 != GRAPH_PARENT_NONE) entry->parent_positions[entry->parent_count++] = parent1;
+
+    if (parent2 & GRAPH_EXTRA_EDGES_NEEDED)
+    {
+        // The second parent onwards live in the EDGE chunk, the last one flagged
+        const size_t edge = parent2 & ~GRAPH_EXTRA_EDGES_NEEDED;
+
+        if (graph->extra_edges && edge < graph->extra_edge_count)
+        {
+            entry->extra_edges = &graph->extra_edges[edge * 4];
+
+            for (size_t i = edge; i < graph->extra_edge_count; i++)
+            {
+                entry->parent_count++;
+                if (get_be32(&graph->extra_edges[i * 4]) & GRAPH_LAST_EDGE) break;
+            }
+        }
+    }
+    else if (parent2 != GRAPH_PARENT_NONE)
+    {
+        entry->parent_positions[entry->parent_count++] = parent2;
+    }
+
+    // 30 bits of topological level over 34 bits of commit time
+    const uint64_t generation_and_date = get_be64(&data[SHA_DIGEST_LENGTH + 8]);
+    entry->generation = (uint32_t)(generation_and_date >> 34);
+    entry->date = generation_and_date & ((1ULL << 34) - 1);
+}
+
+bool get_commit_graph_parent(const commit_graph_entry *entry, const uint32_t n, uint32_t *position)
+{
+    if (n >= entry->parent_count) return false;
+
+    if (!entry->extra_edges || n == 0)
+    {
+        *position = entry->parent_positions[n];
+        return true;
+    }
+
+    *position = get_be32(&entry->extra_edges[(size_t)(n - 1) * 4]) & ~GRAPH_LAST_EDGE;
+
+    return true;
+}
+
+bool get_commit_graph_bloom_filter(const commit_graph *graph, const uint32_t position, bloom_filter *filter)
+{
+    if (!graph->bloom_indexes || position >= graph->commit_count) return false;
+
+    const uint32_t end = get_be32(&graph->bloom_indexes[(size_t)position * 4]);
+    const uint32_t start = position ? get_be32(&graph->bloom_indexes[(size_t)(position - 1) * 4]) : 0;
+
+    // An empty range means no filter was computed for the commit
+    if (start >= end || end > graph->bloom_data_size) return false;
+
+    *filter = (bloom_filter){ .data = &graph->bloom_data[start], .len = end - start };
+
+    return true;
+}
+
+static bool push_graph_frame(graph_dfs_frame **frames, size_t *depth, size_t *capacity, commit *commit)
+{
+    validate(parse_commit(commit), "Failed to parse commit.");
+
+    if (*depth == *capacity)
+    {
+        const size_t grown_capacity = *capacity ? *capacity * 2 : 256;
+
+        graph_dfs_frame *grown = realloc(*frames, grown_capacity * sizeof(graph_dfs_frame));
+        validate(grown, "Failed to allocate memory.");
+
+        *frames = grown;
+        *capacity = grown_capacity;
+    }
+
+    (*frames)[(*depth)++] = (graph_dfs_frame){ .commit = commit };
+
+    return true;
+
+error:
+    return false;
+}
+
+// Parents come before their children in ordered, so topological levels can
+// be assigned in one pass over it
+static bool collect_reachable_commits(commit **tips, const size_t tip_count, oid_map *visited, commit_list *ordered)
+{
+    graph_dfs_frame *frames = nullptr;
+    size_t depth = 0;
+    size_t capacity = 0;
+
+    for (size_t i = 0; i < tip_count; i++)
+    {
+        if (oid_map_contains(visited, tips[i]->hash)) continue;
+
+        validate(oid_map_put(visited, tips[i]->hash, 0), "Failed to mark commit.");
+        validate(push_graph_frame(&frames, &depth, &capacity, tips[i]), "Failed to add commit.");
+
+        while (depth)
+        {
+            graph_dfs_frame *frame = &frames[depth - 1];
+
+            if (frame->next_parent == frame->commit->parent_count)
+            {
+                validate(commit_list_append(ordered, frame->commit), "Failed to add commit.");
+                depth--;
+                continue;
+            }
+
+            commit *parent = frame->commit->parents[frame->next_parent++];
+            if (oid_map_contains(visited, parent->hash)) continue;
+
+            validate(oid_map_put(visited, parent->hash, 0), "Failed to mark commit.");
+            validate(push_graph_frame(&frames, &depth, &capacity, parent), "Failed to add commit.");
+        }
+    }
+
+    if (frames) free(frames);
+
+    return true;
+
+error:
+    if (frames) free(frames);
+
+    return false;
+}
+
+static int compare_commits_by_oid(const void *a, const void *b)
+{
+    return memcmp((*(commit *const *)a)->hash, (*(commit *const *)b)->hash, SHA_DIGEST_LENGTH);
+}
+
+static uint32_t get_writer_position(const graph_writer *writer, const commit *commit)
+{
+    uint64_t position = 0;
+    (void)oid_map_get(&writer->positions, commit->hash, &position);
+
+    return (uint32_t)position;
+}
+
+static bool prepare_graph_writer(graph_writer *writer, commit **tips, const size_t tip_count)
+{
+    commit_list ordered;
+    commit_list_init(&ordered);
+
+    validate(oid_map_init(&writer->positions, 1024), "Failed to allocate memory.");
+    validate(collect_reachable_commits(tips, tip_count, &writer->positions, &ordered), "Failed to collect commits.");
+    validate(ordered.count <= GRAPH_PARENT_NONE, "Too many commits for a commit-graph.");
+
+    writer->count = (uint32_t)ordered.count;
+    writer->commits = malloc((writer->count ? writer->count : 1) * sizeof(commit *));
+    writer->generations = calloc(writer->count ? writer->count : 1, sizeof(uint32_t));
+    validate(writer->commits && writer->generations, "Failed to allocate memory.");
+
+    memcpy(writer->commits, ordered.items, writer->count * sizeof(commit *));
+    qsort(writer->commits, writer->count, sizeof(commit *), compare_commits_by_oid);
+
+    for (uint32_t i = 0; i < writer->count; i++)
+    {
+        validate(oid_map_put(&writer->positions, writer->commits[i]->hash, i), "Failed to record position.");
+
+        if (writer->commits[i]->parent_count > 2) writer->extra_edge_count += writer->commits[i]->parent_count - 1;
+    }
+
+    // A root is on level one, every other commit one above its highest parent
+    for (size_t i = 0; i < ordered.count; i++)
+    {
+        const commit *commit = ordered.items[i];
+        uint32_t generation = 0;
+
+        for (uint32_t p = 0; p < commit->parent_count; p++)
+        {
+            const uint32_t parent_generation = writer->generations[get_writer_position(writer, commit->parents[p])];
+            if (parent_generation > generation) generation = parent_generation;
+        }
+
+        writer->generations[get_writer_position(writer, commit)] =
+            generation < GENERATION_NUMBER_V1_MAX ? generation + 1 : GENERATION_NUMBER_V1_MAX;
+    }
+
+    commit_list_destroy(&ordered);
+
+    return true;
+
+error:
+    commit_list_destroy(&ordered);
+
+    return false;
+}
+
+static bool copy_previous_filter(const graph_writer *writer, const commit *commit, changed_paths_filter *filter)
+{
+    const commit_graph *previous = writer->previous;
+    if (!previous || commit->graph_position == COMMIT_NOT_FROM_GRAPH) return false;
+    if (memcmp(&previous->bloom_settings, &writer->settings, sizeof(bloom_settings)) != 0) return false;
+
+    bloom_filter stored;
+    if (!get_commit_graph_bloom_filter(previous, commit->graph_position, &stored)) return false;
+
+    filter->data = malloc(stored.len);
+    if (!filter->data) return false;
+
+    memcpy(filter->data, stored.data, stored.len);
+    filter->len = stored.len;
+
+    return true;
+}
+
+// Each commit is diffed against its first parent only, the way git does.
+// A filter left empty marks a failure, as computed ones are never empty.
+static void compute_filter_task(void *ctx, const size_t index)
+{
+    graph_writer *writer = ctx;
+    const commit *commit = writer->commits[index];
+    changed_paths_filter *filter = &writer->filters[index];
+
+    if (copy_previous_filter(writer, commit, filter))
+    {
+        filter->is_reused = true;
+        return;
+    }
+
+    const unsigned char *parent_tree = commit->parent_count ? commit->parents[0]->tree_hash : nullptr;
+    (void)compute_changed_paths_filter(parent_tree, commit->tree_hash, &writer->settings, &filter->data, &filter->len);
+}
+
+static bool compute_changed_paths_filters(graph_writer *writer)
+{
+    writer->filters = calloc(writer->count ? writer->count : 1, sizeof(changed_paths_filter));
+    validate(writer->filters, "Failed to allocate memory.");
+
+    // First parents are parsed already; their trees are all the tasks read
+    for (uint32_t i = 0; i < writer->count; i++)
+    {
+        if (writer->commits[i]->parent_count) validate(parse_commit(writer->commits[i]->parents[0]), "Failed to parse commit.");
+    }
+
+    prepare_packed_git_for_threads();
+    run_parallel(writer->count, get_worker_count("commitgraph.threads"), compute_filter_task, writer);
+
+    size_t reused_count = 0;
+    for (uint32_t i = 0; i < writer->count; i++)
+    {
+        validate(writer->filters[i].len, "Failed to compute changed paths of a commit.");
+        reused_count += writer->filters[i].is_reused;
+    }
+
+    fprintf(stderr, "Computed %zu changed-path filters, reused %zu\n", writer->count - reused_count, reused_count);
+
+    return true;
+
+error:
+    return false;
+}
+
+static void write_commit_data(const graph_writer *writer, unsigned char *commit_data, unsigned char *extra_edges)
+{
+    uint32_t edge = 0;
+
+    for (uint32_t i = 0; i < writer->count; i++)
+    {
+        const commit *commit = writer->commits[i];
+        unsigned char *data = &commit_data[(size_t)i * COMMIT_GRAPH_DATA_SIZE];
+
+        memcpy(data, commit->tree_hash, SHA_DIGEST_LENGTH);
+
+        const uint32_t parent1 = commit->parent_count > 0 ? get_writer_position(writer, commit->parents[0]) : GRAPH_PARENT_NONE;
+        uint32_t parent2 = commit->parent_count > 1 ? get_writer_position(writer, commit->parents[1]) : GRAPH_PARENT_NONE;
+
+        // Octopus merges list every parent after the first as extra edges
+        if (commit->parent_count > 2)
+        {
+            parent2 = GRAPH_EXTRA_EDGES_NEEDED | edge;
+
+            for (uint32_t p = 1; p < commit->parent_count; p++)
+            {
+                const uint32_t last = p + 1 == commit->parent_count ? GRAPH_LAST_EDGE : 0;
+                put_be32(&extra_edges[(size_t)edge++ * 4], get_writer_position(writer, commit->parents[p]) | last);
+            }
+        }
+
+        put_be32(&data[SHA_DIGEST_LENGTH], parent1);
+        put_be32(&data[SHA_DIGEST_LENGTH + 4], parent2);
+        put_be64(&data[SHA_DIGEST_LENGTH + 8], (uint64_t)writer->generations[i] << 34 | (commit->date & COMMIT_GRAPH_DATE_MASK));
+    }
+}
+
+static bool serialize_commit_graph(const graph_writer *writer, buffer *out)
+{
+    *out = (buffer){ };
+
+    size_t bloom_data_size = 0;
+    for (uint32_t i = 0; writer->filters && i < writer->count; i++) bloom_data_size += writer->filters[i].len;
+
+    validate(bloom_data_size <= UINT32_MAX, "Changed-path filters are too large.");
+
+    uint32_t chunk_ids[6];
+    size_t chunk_sizes[6];
+    uint8_t chunk_count = 0;
+
+    chunk_ids[chunk_count] = CHUNK_ID_OID_FANOUT;
+    chunk_sizes[chunk_count++] = PACK_FANOUT_SIZE;
+    chunk_ids[chunk_count] = CHUNK_ID_OID_LOOKUP;
+    chunk_sizes[chunk_count++] = (size_t)writer->count * SHA_DIGEST_LENGTH;
+    chunk_ids[chunk_count] = CHUNK_ID_COMMIT_DATA;
+    chunk_sizes[chunk_count++] = (size_t)writer->count * COMMIT_GRAPH_DATA_SIZE;
+
+    if (writer->extra_edge_count)
+    {
+        chunk_ids[chunk_count] = CHUNK_ID_EXTRA_EDGES;
+        chunk_sizes[chunk_count++] = writer->extra_edge_count * 4;
+    }
+
+    if (writer->filters)
+    {
+        chunk_ids[chunk_count] = CHUNK_ID_BLOOM_INDEXES;
+        chunk_sizes[chunk_count++] = (size_t)writer->count * 4;
+        chunk_ids[chunk_count] = CHUNK_ID_BLOOM_DATA;
+        chunk_sizes[chunk_count++] = BLOOM_DATA_HEADER_SIZE + bloom_data_size;
+    }
+
+    size_t chunk_offsets[7];
+    chunk_offsets[0] = COMMIT_GRAPH_HEADER_SIZE + ((size_t)chunk_count + 1) * COMMIT_GRAPH_CHUNK_ENTRY_SIZE;
+    for (uint8_t i = 0; i < chunk_count; i++) chunk_offsets[i + 1] = chunk_offsets[i] + chunk_sizes[i];
+
+    out->size = chunk_offsets[chunk_count] + SHA_DIGEST_LENGTH;
+    out->data = calloc(1, out->size);
+    validate(out->data, "Failed to allocate memory.");
+
+    unsigned char *data = (unsigned char *)out->data;
+
+    memcpy(data, COMMIT_GRAPH_SIGNATURE, 4);
+    data[4] = COMMIT_GRAPH_VERSION;
+    data[5] = COMMIT_GRAPH_HASH_VERSION;
+    data[6] = chunk_count;
+    data[7] = 0;
+
+    for (uint8_t i = 0; i <= chunk_count; i++)
+    {
+        unsigned char *entry = &data[COMMIT_GRAPH_HEADER_SIZE + (size_t)i * COMMIT_GRAPH_CHUNK_ENTRY_SIZE];
+        put_be32(entry, i < chunk_count ? chunk_ids[i] : 0);
+        put_be64(&entry[4], chunk_offsets[i]);
+    }
+
+    unsigned char *fanout = &data[chunk_offsets[0]];
+    unsigned char *lookup = &data[chunk_offsets[1]];
+    uint32_t counts[256] = { };
+
+    for (uint32_t i = 0; i < writer->count; i++)
+    {
+        counts[writer->commits[i]->hash[0]]++;
+        memcpy(&lookup[(size_t)i * SHA_DIGEST_LENGTH], writer->commits[i]->hash, SHA_DIGEST_LENGTH);
+    }
+
+    uint32_t cumulative = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        cumulative += counts[i];
+        put_be32(&fanout[i * 4], cumulative);
+    }
+
+    unsigned char *extra_edges = writer->extra_edge_count ? &data[chunk_offsets[3]] : nullptr;
+    write_commit_data(writer, &data[chunk_offsets[2]], extra_edges);
+
+    if (writer->filters)
+    {
+        const uint8_t bloom_chunk = chunk_count - 2;
+        unsigned char *indexes = &data[chunk_offsets[bloom_chunk]];
+        unsigned char *bloom_data = &data[chunk_offsets[bloom_chunk + 1]];
+
+        put_be32(bloom_data, writer->settings.hash_version);
+        put_be32(&bloom_data[4], writer->settings.num_hashes);
+        put_be32(&bloom_data[8], writer->settings.bits_per_entry);
+
+        size_t end = 0;
+        for (uint32_t i = 0; i < writer->count; i++)
+        {
+            memcpy(&bloom_data[BLOOM_DATA_HEADER_SIZE + end], writer->filters[i].data, writer->filters[i].len);
+            end += writer->filters[i].len;
+            put_be32(&indexes[(size_t)i * 4], (uint32_t)end);
+        }
+    }
+
+    SHA1(data, out->size - SHA_DIGEST_LENGTH, &data[out->size - SHA_DIGEST_LENGTH]);
+
+    return true;
+
+error:
+    *out = (buffer){ };
+
+    return false;
+}
+
+static void destroy_graph_writer(graph_writer *writer)
+{
+    if (writer->commits) free(writer->commits);
+    if (writer->generations) free(writer->generations);
+    if (writer->positions.entries) oid_map_destroy(&writer->positions);
+
+    for (uint32_t i = 0; writer->filters && i < writer->count; i++)
+    {
+        if (writer->filters[i].data) free(writer->filters[i].data);
+    }
+
+    if (writer->filters) free(writer->filters);
+}
+
+bool write_reachable_commit_graph(const unsigned char (*tips)[SHA_DIGEST_LENGTH], const size_t tip_count, const bool with_changed_paths)
+{
+    graph_writer writer = {
+        .settings = {
+            .hash_version = BLOOM_HASH_VERSION_SIGNED_CHARS,
+            .num_hashes = BLOOM_NUM_HASHES,
+            .bits_per_entry = BLOOM_BITS_PER_ENTRY,
+        },
+        .previous = get_commit_graph(),
+    };
+    commit **tip_commits = malloc((tip_count ? tip_count : 1) * sizeof(commit *));
+    buffer content = { };
+
+    validate(tip_commits, "Failed to allocate memory.");
+    validate(!is_shallow_repository(), "Shallow repositories do not support commit-graph.");
+
+    for (size_t i = 0; i < tip_count; i++)
+    {
+        tip_commits[i] = lookup_commit(tips[i]);
+        validate(tip_commits[i], "Failed to look up commit.");
+    }
+
+    validate(prepare_graph_writer(&writer, tip_commits, tip_count), "Failed to collect commits.");
+    validate(!with_changed_paths || compute_changed_paths_filters(&writer), "Failed to compute changed paths.");
+    validate(serialize_commit_graph(&writer, &content), "Failed to serialize commit-graph.");
+
+    char info_dir[PATH_MAX];
+    validate(get_git_path(info_dir, PATH_MAX, "objects/info"), "Failed to resolve objects/info.");
+    validate(mkdir(info_dir, 0755) == 0 || errno == EEXIST, "Failed to create '%s'.", info_dir);
+    errno = 0;
+
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, "objects/info/commit-graph"), "Failed to resolve commit-graph path.");
+    validate(replace_file_atomically(path, (const unsigned char *)content.data, content.size), "Failed to write '%s'.", path);
+
+    free(content.data);
+    destroy_graph_writer(&writer);
+    free(tip_commits);
+
+    reprepare_commit_graph();
+
+    return true;
+
+error:
+    if (content.data) free(content.data);
+    destroy_graph_writer(&writer);
+    if (tip_commits) free(tip_commits);
+
+    return false;
+}
@@ -0,0 +1,86 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#include "bloom.h"
+
+#define COMMIT_GRAPH_SIGNATURE "CGPH"
+#define COMMIT_GRAPH_VERSION 1
+#define COMMIT_GRAPH_HASH_VERSION 1
+#define COMMIT_GRAPH_HEADER_SIZE 8
+#define COMMIT_GRAPH_CHUNK_ENTRY_SIZE 12
+#define COMMIT_GRAPH_DATA_SIZE (SHA_DIGEST_LENGTH + 16)
+
+#define CHUNK_ID_OID_FANOUT 0x4f494446 // "OIDF"
+#define CHUNK_ID_OID_LOOKUP 0x4f49444c // "OIDL"
+#define CHUNK_ID_COMMIT_DATA 0x43444154 // "CDAT"
+#define CHUNK_ID_EXTRA_EDGES 0x45444745 // "EDGE"
+#define CHUNK_ID_BLOOM_INDEXES 0x42494458 // "BIDX"
+#define CHUNK_ID_BLOOM_DATA 0x42444154 // "BDAT"
+
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES_NEEDED 0x80000000
+#define GRAPH_LAST_EDGE 0x80000000
+
+#define GENERATION_NUMBER_INFINITY UINT32_MAX
+#define GENERATION_NUMBER_V1_MAX 0x3fffffff
+#define COMMIT_NOT_FROM_GRAPH UINT32_MAX
+
+// .git/objects/info/commit-graph, mapped on first use. Only the single file
+// layout is read; split graph chains are ignored.
+typedef struct commit_graph
+{
+    const unsigned char *data;
+    size_t size;
+    uint32_t commit_count;
+    const unsigned char *oid_fanout;
+    const unsigned char *oid_lookup;
+    const unsigned char *commit_data;
+    const unsigned char *extra_edges;
+    size_t extra_edge_count;
+
+    // Changed-path filters: end offsets into the data by graph position
+    const unsigned char *bloom_indexes;
+    const unsigned char *bloom_data;
+    size_t bloom_data_size;
+    bloom_settings bloom_settings;
+} commit_graph;
+
+// Parents are graph positions; generation is the topological level
+typedef struct commit_graph_entry
+{
+    const unsigned char *tree_hash;
+    uint32_t parent_positions[2];
+    uint32_t parent_count;
+    const unsigned char *extra_edges;
+    uint32_t generation;
+    uint64_t date;
+} commit_graph_entry;
+
+// nullptr when the repository has no (valid) commit-graph
+const commit_graph *get_commit_graph(void);
+
+void reprepare_commit_graph(void);
+
+const unsigned char *get_commit_graph_oid(const commit_graph *graph, uint32_t position);
+
+bool find_commit_graph_position(const commit_graph *graph, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *position);
+
+void read_commit_graph_entry(const commit_graph *graph, uint32_t position, commit_graph_entry *entry);
+
+// Walks all parents of an entry, octopus edges included. Returns false past
+// the last one.
+bool get_commit_graph_parent(const commit_graph_entry *entry, uint32_t n, uint32_t *position);
+
+// The changed-path filter of a commit; false when the graph has none for it
+bool get_commit_graph_bloom_filter(const commit_graph *graph, uint32_t position, bloom_filter *filter);
+
+// Writes objects/info/commit-graph for every commit reachable from tips,
+// with changed-path filters if asked for. Filters of commits already in
+// the current graph are copied over instead of computed again.
+bool write_reachable_commit_graph(const unsigned char (*tips)[SHA_DIGEST_LENGTH], size_t tip_count, bool with_changed_paths);
+
+#endif //COMMIT_GRAPH_H
@@ -0,0 +1,417 @@
+#include "commit_reach.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit_graph.h"
+#include "debug_helpers.h"
+
+#define PARENT1 (1u << 0)
+#define PARENT2 (1u << 1)
+#define STALE (1u << 2)
+#define RESULT (1u << 3)
+
+#define SLAB_MIN_CAPACITY 1024
+
+// Flags and queue membership per commit, indexed by commit->index. Every
+// commit that gets flags is remembered, so clearing costs what painting did.
+static uint8_t *flags = nullptr;
+static uint32_t *queued = nullptr;
+static size_t slab_capacity = 0;
+static commit_list touched = { };
+
+// Queue entries whose commit is not stale; the walk ends when none are left
+static size_t nonstale_count = 0;
+
+void commit_list_init(commit_list *list)
+{
+    *list = (commit_list){ };
+}
+
+void commit_list_destroy(commit_list *list)
+{
+    if (list->items) free(list->items);
+
+    *list = (commit_list){ };
+}
+
+bool commit_list_append(commit_list *list, commit *commit)
+{
+    if (list->count == list->capacity)
+    {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 16;
+
+        struct commit **items = realloc(list->items, capacity * sizeof(struct commit *));
+        validate(items, "Failed to allocate memory.");
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = commit;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Newest first; a commit goes after others with the same date
+static bool commit_list_insert_by_date(commit_list *list, commit *commit)
+{
+    validate(commit_list_append(list, commit), "Failed to add commit.");
+
+    size_t i = list->count - 1;
+    while (i > 0 && list->items[i - 1]->date < commit->date)
+    {
+        list->items[i] = list->items[i - 1];
+        i--;
+    }
+
+    list->items[i] = commit;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool ensure_slab(const uint32_t index)
+{
+    if (index < slab_capacity) return true;
+
+    size_t capacity = slab_capacity ? slab_capacity : SLAB_MIN_CAPACITY;
+    while (capacity <= index) capacity *= 2;
+
+    uint8_t *grown_flags = realloc(flags, capacity * sizeof(uint8_t));
+    validate(grown_flags, "Failed to allocate memory.");
+    flags = grown_flags;
+
+    uint32_t *grown_queued = realloc(queued, capacity * sizeof(uint32_t));
+    validate(grown_queued, "Failed to allocate memory.");
+    queued = grown_queued;
+
+    memset(&flags[slab_capacity], 0, (capacity - slab_capacity) * sizeof(uint8_t));
+    memset(&queued[slab_capacity], 0, (capacity - slab_capacity) * sizeof(uint32_t));
+    slab_capacity = capacity;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_flags(commit *commit, const uint8_t new_flags)
+{
+    validate(ensure_slab(commit->index), "Failed to grow the flag slab.");
+
+    const uint8_t old_flags = flags[commit->index];
+    if (!old_flags) validate(commit_list_append(&touched, commit), "Failed to track commit.");
+
+    flags[commit->index] = old_flags | new_flags;
+
+    // Entries already queued for this commit stop counting once it goes stale
+    if (!(old_flags & STALE) && (new_flags & STALE)) nonstale_count -= queued[commit->index];
+
+    return true;
+
+error:
+    return false;
+}
+
+static void clear_flags(void)
+{
+    for (size_t i = 0; i < touched.count; i++)
+    {
+        flags[touched.items[i]->index] = 0;
+        queued[touched.items[i]->index] = 0;
+    }
+
+    touched.count = 0;
+    nonstale_count = 0;
+}
+
+static bool queue_commit(commit_queue *queue, commit *commit)
+{
+    validate(commit_queue_put(queue, commit), "Failed to queue commit.");
+
+    queued[commit->index]++;
+    if (!(flags[commit->index] & STALE)) nonstale_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static commit *unqueue_commit(commit_queue *queue)
+{
+    commit *commit = commit_queue_get(queue);
+
+    queued[commit->index]--;
+    if (!(flags[commit->index] & STALE)) nonstale_count--;
+
+    return commit;
+}
+
+// Paints one with PARENT1 and twos with PARENT2 down to their common
+// ancestors, which collect in result. Ancestors of a common ancestor go
+// stale, and the walk stops once only stale commits are queued, or below
+// min_generation.
+static bool paint_down_to_common(commit *one, const size_t n, commit **twos, const uint32_t min_generation, commit_list *result)
+{
+    commit_queue queue;
+    commit_queue_init(&queue);
+
+    validate(add_flags(one, PARENT1), "Failed to mark commit.");
+
+    if (!n)
+    {
+        validate(commit_list_append(result, one), "Failed to add commit.");
+        return true;
+    }
+
+    validate(queue_commit(&queue, one), "Failed to queue commit.");
+
+    for (size_t i = 0; i < n; i++)
+    {
+        validate(add_flags(twos[i], PARENT2), "Failed to mark commit.");
+        validate(queue_commit(&queue, twos[i]), "Failed to queue commit.");
+    }
+
+    while (nonstale_count)
+    {
+        commit *commit = unqueue_commit(&queue);
+        if (commit->generation < min_generation) break;
+
+        uint8_t commit_flags = flags[commit->index] & (PARENT1 | PARENT2 | STALE);
+
+        if (commit_flags == (PARENT1 | PARENT2))
+        {
+            if (!(flags[commit->index] & RESULT))
+            {
+                validate(add_flags(commit, RESULT), "Failed to mark commit.");
+                validate(commit_list_insert_by_date(result, commit), "Failed to add commit.");
+            }
+
+            commit_flags |= STALE;
+        }
+
+        for (uint32_t i = 0; i < commit->parent_count; i++)
+        {
+            struct commit *parent = commit->parents[i];
+
+            validate(ensure_slab(parent->index), "Failed to grow the flag slab.");
+            if ((flags[parent->index] & commit_flags) == commit_flags) continue;
+
+            validate(parse_commit(parent), "Failed to parse commit.");
+            validate(add_flags(parent, commit_flags), "Failed to mark commit.");
+            validate(queue_commit(&queue, parent), "Failed to queue commit.");
+        }
+    }
+
+    commit_queue_destroy(&queue);
+
+    return true;
+
+error:
+    commit_queue_destroy(&queue);
+
+    return false;
+}
+
+static bool merge_bases_many(commit *one, const size_t n, commit **twos, commit_list *result)
+{
+    commit_list painted;
+    commit_list_init(&painted);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (one == twos[i]) return commit_list_append(result, one);
+    }
+
+    validate(parse_commit(one), "Failed to parse commit.");
+    for (size_t i = 0; i < n; i++) validate(parse_commit(twos[i]), "Failed to parse commit.");
+
+    validate(paint_down_to_common(one, n, twos, 0, &painted), "Failed to walk commits.");
+
+    // Common ancestors found before one of their descendants went stale
+    for (size_t i = 0; i < painted.count; i++)
+    {
+        if (flags[painted.items[i]->index] & STALE) continue;
+
+        validate(commit_list_insert_by_date(result, painted.items[i]), "Failed to add commit.");
+    }
+
+    clear_flags();
+    commit_list_destroy(&painted);
+
+    return true;
+
+error:
+    clear_flags();
+    commit_list_destroy(&painted);
+
+    return false;
+}
+
+// Drops every commit that is an ancestor of another one in the list, by
+// painting each against all the others
+static bool remove_redundant(commit_list *list)
+{
+    bool *is_redundant = calloc(list->count, sizeof(bool));
+    commit **work = malloc(list->count * sizeof(commit *));
+    size_t *work_index = malloc(list->count * sizeof(size_t));
+    commit_list common;
+    commit_list_init(&common);
+
+    validate(is_redundant && work && work_index, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (is_redundant[i]) continue;
+
+        uint32_t min_generation = list->items[i]->generation;
+        size_t filled = 0;
+
+        for (size_t j = 0; j < list->count; j++)
+        {
+            if (i == j || is_redundant[j]) continue;
+
+            work[filled] = list->items[j];
+            work_index[filled] = j;
+            filled++;
+
+            if (list->items[j]->generation < min_generation) min_generation = list->items[j]->generation;
+        }
+
+        common.count = 0;
+        validate(paint_down_to_common(list->items[i], filled, work, min_generation, &common), "Failed to walk commits.");
+
+        if (flags[list->items[i]->index] & PARENT2) is_redundant[i] = true;
+
+        for (size_t j = 0; j < filled; j++)
+        {
+            if (flags[work[j]->index] & PARENT1) is_redundant[work_index[j]] = true;
+        }
+
+        clear_flags();
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (!is_redundant[i]) list->items[kept++] = list->items[i];
+    }
+
+    list->count = kept;
+
+    free(is_redundant);
+    free(work);
+    free(work_index);
+    commit_list_destroy(&common);
+
+    return true;
+
+error:
+    clear_flags();
+    if (is_redundant) free(is_redundant);
+    if (work) free(work);
+    if (work_index) free(work_index);
+    commit_list_destroy(&common);
+
+    return false;
+}
+
+bool get_merge_bases(commit *one, const size_t n, commit **twos, commit_list *result)
+{
+    const size_t first = result->count;
+
+    validate(merge_bases_many(one, n, twos, result), "Failed to find merge bases.");
+
+    if (result->count - first < 2) return true;
+
+    // Several candidates may still be ancestors of one another
+    commit_list candidates = {
+        .items = &result->items[first],
+        .count = result->count - first,
+        .capacity = result->count - first,
+    };
+
+    validate(remove_redundant(&candidates), "Failed to reduce merge bases.");
+    result->count = first + candidates.count;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool get_octopus_merge_bases(commit **commits, const size_t n, commit_list *result)
+{
+    commit_list bases;
+    commit_list_init(&bases);
+
+    if (!n) return true;
+
+    validate(commit_list_append(&bases, commits[0]), "Failed to add commit.");
+
+    for (size_t i = 1; i < n; i++)
+    {
+        commit_list next_bases;
+        commit_list_init(&next_bases);
+
+        for (size_t j = 0; j < bases.count; j++)
+        {
+            if (!get_merge_bases(commits[i], 1, &bases.items[j], &next_bases))
+            {
+                commit_list_destroy(&next_bases);
+                validate(false, "Failed to find merge bases.");
+            }
+        }
+
+        commit_list_destroy(&bases);
+        bases = next_bases;
+    }
+
+    for (size_t i = 0; i < bases.count; i++)
+    {
+        validate(commit_list_append(result, bases.items[i]), "Failed to add commit.");
+    }
+
+    commit_list_destroy(&bases);
+
+    return true;
+
+error:
+    commit_list_destroy(&bases);
+
+    return false;
+}
+
+bool reduce_heads(commit_list *list)
+{
+    // Duplicates would make each other redundant, so only the first stays
+    size_t kept = 0;
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        validate(ensure_slab(list->items[i]->index), "Failed to grow the flag slab.");
+        if (flags[list->items[i]->index] & RESULT) continue;
+
+        validate(add_flags(list->items[i], RESULT), "Failed to mark commit.");
+        list->items[kept++] = list->items[i];
+    }
+
+    list->count = kept;
+    clear_flags();
+
+    for (size_t i = 0; i < list->count; i++) validate(parse_commit(list->items[i]), "Failed to parse commit.");
+
+    return list->count < 2 || remove_redundant(list);
+
+error:
+    clear_flags();
+
+    return false;
+}
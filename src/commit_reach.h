@@ -0,0 +1,32 @@
+#ifndef COMMIT_REACH_H
+#define COMMIT_REACH_H
+
+#include <stddef.h>
+
+#include "commit.h"
+
+typedef struct commit_list
+{
+    commit **items;
+    size_t count;
+    size_t capacity;
+} commit_list;
+
+void commit_list_init(commit_list *list);
+
+void commit_list_destroy(commit_list *list);
+
+bool commit_list_append(commit_list *list, commit *commit);
+
+// Best common ancestors of one and all of twos, newest first. Commits are
+// painted down from both sides on a per-commit flag slab; with a
+// commit-graph, generation numbers stop the walk early.
+bool get_merge_bases(commit *one, size_t n, commit **twos, commit_list *result);
+
+// Merge bases of all commits at once, folding them in one by one
+bool get_octopus_merge_bases(commit **commits, size_t n, commit_list *result);
+
+// Drops duplicates and every commit reachable from another one in the list
+bool reduce_heads(commit_list *list);
+
+#endif //COMMIT_REACH_H
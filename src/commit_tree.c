@@ -6,6 +6,7 @@
 
 #include "debug_helpers.h"
 #include "git_obj_helpers.h"
+#include "refs.h"
 
 static bool try_resolve_commit_tree_opts(const int argc, char *argv[], commit_info *commit_opts)
 {
@@ -18,12 +19,12 @@ static bool try_resolve_commit_tree_opts(const int argc, char *argv[], commit_in
     {
         switch (opt)
         {
-            case 'p':
-                commit_opts->parent_sha = malloc(SHA_HEX_LENGTH + 1);
-                validate(commit_opts->parent_sha, "Failed to allocate memory.");
-                strncpy(commit_opts->parent_sha, optarg, SHA_HEX_LENGTH);
-                commit_opts->parent_sha[SHA_HEX_LENGTH] = '\0';
+            case 'p': {
+                char parent_sha[SHA_HEX_LENGTH + 1];
+                validate(resolve_revision_hex(optarg, parent_sha), "Not a valid parent '%s'.", optarg);
+                validate(add_commit_parent(commit_opts, parent_sha), "Failed to add parent '%s'.", optarg);
                 break;
+            }
             case 'm':
                 const size_t commit_message_len = strlen(optarg);
                 commit_opts->message = malloc(commit_message_len + 1);
@@ -92,7 +93,9 @@ int commit_tree(const int argc, char *argv[])
         offset_hours,
         offset_minutes);
 
-    commit_info.tree_sha = strndup(argv[2], SHA_HEX_LENGTH);
+    commit_info.tree_sha = malloc(SHA_HEX_LENGTH + 1);
+    validate(commit_info.tree_sha, "Failed to allocate memory.");
+    validate(resolve_tree_hex(argv[2], commit_info.tree_sha), "Not a valid tree '%s'.", argv[2]);
 
     bool opt_result = try_resolve_commit_tree_opts(argc, argv, &commit_info);
     validate(opt_result, "Failed to resolve options.");
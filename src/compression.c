@@ -1,9 +1,11 @@
 #include "compression.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <zlib.h>
 
 #include "debug_helpers.h"
+#include "trace.h"
 
 void deflate_object(FILE *source, FILE *dest)
 {
@@ -13,6 +15,8 @@ void deflate_object(FILE *source, FILE *dest)
         .opaque = Z_NULL,
     };
 
+    trace_timer_start(TRACE_TIMER_DEFLATE);
+
     int ret = deflateInit(&defstream, Z_DEFAULT_COMPRESSION);
     validate(ret == Z_OK, "Failed to initialize deflate.");
 
@@ -48,11 +52,15 @@ void deflate_object(FILE *source, FILE *dest)
     } while (flush != Z_FINISH);
     assert(ret == Z_STREAM_END);
 
+    trace_counter_add(TRACE_COUNTER_BYTES_OUT, defstream.total_out);
+
     (void)deflateEnd(&defstream);
+    trace_timer_stop(TRACE_TIMER_DEFLATE);
     return;
 
 error:
     (void)deflateEnd(&defstream);
+    trace_timer_stop(TRACE_TIMER_DEFLATE);
 }
 
 void inflate_object(FILE *source, FILE *dest)
@@ -65,6 +73,8 @@ void inflate_object(FILE *source, FILE *dest)
         .next_in = Z_NULL,
     };
 
+    trace_timer_start(TRACE_TIMER_INFLATE);
+
     int ret = inflateInit(&infstream);
     validate(ret == Z_OK, "Failed to initialize inflate.");
 
@@ -110,10 +120,36 @@ void inflate_object(FILE *source, FILE *dest)
 
     validate(ret == Z_STREAM_END, "Failed to inflate with Z error code: %d", Z_DATA_ERROR);
 
+    trace_counter_add(TRACE_COUNTER_BYTES_IN, infstream.total_in);
+
     (void)inflateEnd(&infstream);
+    trace_timer_stop(TRACE_TIMER_INFLATE);
 
     return;
 
 error:
     (void)inflateEnd(&infstream);
+    trace_timer_stop(TRACE_TIMER_INFLATE);
+}
+
+size_t inflate_prefix(const unsigned char *source, const size_t source_size, unsigned char *dest, const size_t dest_size)
+{
+    z_stream infstream = {
+        .zalloc = Z_NULL,
+        .zfree = Z_NULL,
+        .opaque = Z_NULL,
+        .next_in = (unsigned char *)source,
+        .avail_in = source_size > UINT32_MAX ? UINT32_MAX : (uInt)source_size,
+        .next_out = dest,
+        .avail_out = (uInt)dest_size,
+    };
+
+    if (inflateInit(&infstream) != Z_OK) return 0;
+
+    const int ret = inflate(&infstream, Z_SYNC_FLUSH);
+    const size_t have = ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR ? infstream.total_out : 0;
+
+    (void)inflateEnd(&infstream);
+
+    return have;
 }
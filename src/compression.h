@@ -1,5 +1,6 @@
 #ifndef COMPRESSION_H
 #define COMPRESSION_H
+#include <stddef.h>
 #include <stdio.h>
 
 #define CHUNK 65536
@@ -8,4 +9,8 @@ void deflate_object(FILE *source, FILE *dest);
 
 void inflate_object(FILE *source, FILE *dest);
 
+// Inflates only as much of a zlib stream as fits in dest, enough to read the
+// header at its start. Returns the number of bytes produced.
+size_t inflate_prefix(const unsigned char *source, size_t source_size, unsigned char *dest, size_t dest_size);
+
 #endif //COMPRESSION_H
@@ -0,0 +1,336 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "odb_transaction.h"
+
+typedef struct config_entry
+{
+    char *key;
+    char *value;
+} config_entry;
+
+static config_entry *config_entries = nullptr;
+static size_t config_entries_count = 0;
+static bool is_config_loaded = false;
+
+static char *trim(char *str)
+{
+    while (isspace((unsigned char)*str)) str++;
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+
+    return str;
+}
+
+static void lowercase(char *str)
+{
+    for (; *str; str++) *str = (char)tolower((unsigned char)*str);
+}
+
+static bool parse_section(char *section, const char *line)
+{
+    // [section] or [section "subsection"]
+    const char *end = strchr(line, ']');
+    if (!end) return false;
+
+    const char *quote = memchr(line, '"', end - line);
+
+    if (!quote)
+    {
+        const size_t len = end - line - 1;
+        memcpy(section, line + 1, len);
+        section[len] = '\0';
+        lowercase(trim(section));
+        return true;
+    }
+
+    const char *quote_end = strrchr(quote + 1, '"');
+    if (!quote_end) return false;
+
+    size_t len = quote - line - 1;
+    memcpy(section, line + 1, len);
+    section[len] = '\0';
+
+    char *name = trim(section);
+    lowercase(name);
+    memmove(section, name, strlen(name) + 1);
+
+    len = strlen(section);
+    section[len++] = '.';
+    memcpy(&section[len], quote + 1, quote_end - quote - 1);
+    section[len + (quote_end - quote - 1)] = '\0';
+
+    return true;
+}
+
+static bool add_config_entry(const char *section, char *line)
+{
+    char *eq = strchr(line, '=');
+    char *value = "true";
+
+    if (eq)
+    {
+        *eq = '\0';
+        value = trim(eq + 1);
+    }
+
+    char *name = trim(line);
+    lowercase(name);
+
+    config_entry *entries = realloc(config_entries, (config_entries_count + 1) * sizeof(config_entry));
+    validate(entries, "Failed to allocate memory.");
+    config_entries = entries;
+
+    config_entry *entry = &config_entries[config_entries_count];
+    entry->key = malloc(strlen(section) + strlen(name) + 2);
+    validate(entry->key, "Failed to allocate memory.");
+    sprintf(entry->key, "%s.%s", section, name);
+
+    const size_t value_len = strlen(value);
+    if (value_len >= 2 && value[0] == '"' && value[value_len - 1] == '"')
+    {
+        value[value_len - 1] = '\0';
+        value++;
+    }
+
+    entry->value = strdup(value);
+    validate(entry->value, "Failed to allocate memory.");
+
+    config_entries_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void load_config(void)
+{
+    is_config_loaded = true;
+
+    char config_path[PATH_MAX];
+    if (!get_git_path(config_path, PATH_MAX, "config")) return;
+
+    FILE *config_file = fopen(config_path, "r");
+    if (!config_file) return;
+
+    char section[256] = "";
+    char line[1024];
+
+    while (fgets(line, sizeof(line), config_file))
+    {
+        char *comment = strpbrk(line, "#;");
+        if (comment) *comment = '\0';
+
+        char *content = trim(line);
+
+        if (*content == '\0') continue;
+
+        if (*content == '[')
+        {
+            validate(parse_section(section, content), "Malformed config section: %s", content);
+            continue;
+        }
+
+        validate(add_config_entry(section, content), "Failed to read config entry.");
+    }
+
+error:
+    fclose(config_file);
+}
+
+const char *get_config_value(const char *key)
+{
+    if (!is_config_loaded) load_config();
+
+    // Later entries override earlier ones, as in git
+    for (size_t i = config_entries_count; i > 0; i--)
+    {
+        if (strcasecmp(config_entries[i - 1].key, key) == 0)
+        {
+            return config_entries[i - 1].value;
+        }
+    }
+
+    return nullptr;
+}
+
+bool get_config_bool(const char *key, const bool default_value)
+{
+    const char *value = get_config_value(key);
+
+    if (!value) return default_value;
+
+    return strcasecmp(value, "true") == 0
+        || strcasecmp(value, "yes") == 0
+        || strcasecmp(value, "on") == 0
+        || strcmp(value, "1") == 0;
+}
+
+long get_config_long(const char *key, const long default_value)
+{
+    const char *value = get_config_value(key);
+
+    if (!value) return default_value;
+
+    char *end;
+    long result = strtol(value, &end, 10);
+
+    switch (*end)
+    {
+        case 'k': case 'K': result *= 1024; break;
+        case 'm': case 'M': result *= 1024L * 1024; break;
+        case 'g': case 'G': result *= 1024L * 1024 * 1024; break;
+        default: break;
+    }
+
+    return result;
+}
+
+static void unload_config(void)
+{
+    for (size_t i = 0; i < config_entries_count; i++)
+    {
+        free(config_entries[i].key);
+        free(config_entries[i].value);
+    }
+
+    if (config_entries) free(config_entries);
+
+    config_entries = nullptr;
+    config_entries_count = 0;
+    is_config_loaded = false;
+}
+
+// The variable name of a "name = value" line, lowercased into name
+static bool get_line_name(char *name, const size_t name_size, const char *line)
+{
+    while (isspace((unsigned char)*line)) line++;
+
+    size_t len = 0;
+    while (line[len] && (isalnum((unsigned char)line[len]) || line[len] == '-') && len + 1 < name_size)
+    {
+        name[len] = (char)tolower((unsigned char)line[len]);
+        len++;
+    }
+
+    name[len] = '\0';
+
+    return len > 0;
+}
+
+bool set_config_value(const char *key, const char *value)
+{
+    char *content = nullptr;
+    size_t content_size = 0;
+    FILE *old_file = nullptr;
+    FILE *stream = nullptr;
+
+    // The subsection of "section.subsection.name" keeps its case, as it
+    // does when read back
+    const char *first_dot = strchr(key, '.');
+    const char *dot = strrchr(key, '.');
+    validate(dot && first_dot != key && dot[1] && (first_dot == dot || first_dot + 1 < dot), "Unsupported config key '%s'.", key);
+
+    char wanted_section[256];
+    char wanted_name[256];
+    (void)snprintf(wanted_section, sizeof(wanted_section), "%.*s", (int)(first_dot - key), key);
+    (void)snprintf(wanted_name, sizeof(wanted_name), "%s", dot + 1);
+    lowercase(wanted_section);
+    lowercase(wanted_name);
+
+    const size_t section_len = strlen(wanted_section);
+    (void)snprintf(&wanted_section[section_len], sizeof(wanted_section) - section_len, "%.*s", (int)(dot - first_dot), first_dot);
+
+    char config_path[PATH_MAX];
+    validate(get_git_path(config_path, PATH_MAX, "config"), "Not a git repository.");
+
+    stream = open_memstream(&content, &content_size);
+    validate(stream, "Failed to open memory stream.");
+
+    // Lines are copied over, with the key's last line replaced, or the new
+    // line put in after the last line of its section
+    char section[256] = "";
+    char line[1024];
+    long key_line = -1;
+    long section_end_line = -1;
+    long line_count = 0;
+
+    old_file = fopen(config_path, "r");
+
+    for (int pass = 0; pass < 2 && old_file; pass++)
+    {
+        rewind(old_file);
+        line_count = 0;
+        section[0] = '\0';
+
+        while (fgets(line, sizeof(line), old_file))
+        {
+            const char *content_start = line;
+            while (isspace((unsigned char)*content_start)) content_start++;
+
+            char name[256];
+            const bool is_section = *content_start == '[';
+            if (is_section) validate(parse_section(section, content_start), "Malformed config section: %s", content_start);
+
+            const bool is_in_section = strcmp(section, wanted_section) == 0;
+            const bool is_key = !is_section && is_in_section && get_line_name(name, sizeof(name), line) && strcmp(name, wanted_name) == 0;
+
+            if (pass == 0)
+            {
+                if (is_key) key_line = line_count;
+                if (is_in_section) section_end_line = line_count;
+            }
+            else if (line_count == key_line)
+            {
+                fprintf(stream, "\t%s = %s\n", dot + 1, value);
+            }
+            else
+            {
+                fputs(line, stream);
+                if (!strchr(line, '\n')) fputc('\n', stream);
+
+                if (key_line == -1 && line_count == section_end_line) fprintf(stream, "\t%s = %s\n", dot + 1, value);
+            }
+
+            line_count++;
+        }
+    }
+
+    if (key_line == -1 && section_end_line == -1)
+    {
+        if (first_dot == dot)
+            fprintf(stream, "[%s]\n\t%s = %s\n", wanted_section, dot + 1, value);
+        else
+            fprintf(stream, "[%.*s \"%.*s\"]\n\t%s = %s\n", (int)section_len, wanted_section, (int)(dot - first_dot - 1), first_dot + 1, dot + 1, value);
+    }
+
+    fclose(stream);
+    stream = nullptr;
+
+    if (old_file) fclose(old_file);
+    old_file = nullptr;
+
+    validate(replace_locked_file(config_path, (unsigned char *)content, content_size), "Failed to write '%s'.", config_path);
+
+    free(content);
+    unload_config();
+
+    return true;
+
+error:
+    if (stream) fclose(stream);
+    if (old_file) fclose(old_file);
+    if (content) free(content);
+
+    return false;
+}
@@ -0,0 +1,17 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+const char *get_config_value(const char *key);
+
+bool get_config_bool(const char *key, bool default_value);
+
+long get_config_long(const char *key, long default_value);
+
+// Sets a "section.name" or "section.subsection.name" key in .git/config,
+// replacing the last value it had or adding it to the end of its section,
+// the way git config does
+bool set_config_value(const char *key, const char *value);
+
+#endif //CONFIG_H
@@ -0,0 +1,250 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+
+// Matches are found in base blocks of this many bytes, and shorter ones
+// are not worth a copy instruction
+#define DELTA_BLOCK_SIZE 16
+
+// Repetitive bases hash many blocks alike; past this many per bucket the
+// rest are dropped, which bounds the work per target byte
+#define DELTA_MAX_BUCKET_ENTRIES 64
+
+typedef struct delta_output
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t max_size;
+} delta_output;
+
+static uint32_t hash_block(const unsigned char *block)
+{
+    uint64_t low;
+    uint64_t high;
+    memcpy(&low, block, 8);
+    memcpy(&high, &block[8], 8);
+
+    const uint64_t mixed = (low ^ high * 0x9e3779b97f4a7c15) * 0xff51afd7ed558ccd;
+
+    return (uint32_t)(mixed >> 32);
+}
+
+bool create_delta_index(delta_index *index, const unsigned char *base, const size_t base_size)
+{
+    uint8_t *bucket_sizes = nullptr;
+    *index = (delta_index){ .base = base, .base_size = base_size };
+
+    validate(base_size < UINT32_MAX, "Delta base too large.");
+
+    const size_t block_count = base_size / DELTA_BLOCK_SIZE;
+
+    size_t bucket_count = 16;
+    while (bucket_count < block_count) bucket_count *= 2;
+
+    index->buckets = calloc(bucket_count, sizeof(uint32_t));
+    index->chain = malloc((block_count ? block_count : 1) * sizeof(uint32_t));
+    bucket_sizes = calloc(bucket_count, sizeof(uint8_t));
+    validate(index->buckets && index->chain && bucket_sizes, "Failed to allocate memory.");
+
+    index->bucket_mask = (uint32_t)(bucket_count - 1);
+
+    // Walked backwards so that chains list earlier blocks first
+    for (size_t block = block_count; block-- > 0;)
+    {
+        const size_t offset = block * DELTA_BLOCK_SIZE;
+        const uint32_t bucket = hash_block(&base[offset]) & index->bucket_mask;
+
+        if (bucket_sizes[bucket] == DELTA_MAX_BUCKET_ENTRIES) continue;
+        bucket_sizes[bucket]++;
+
+        index->chain[block] = index->buckets[bucket];
+        index->buckets[bucket] = (uint32_t)offset + 1;
+    }
+
+    free(bucket_sizes);
+
+    return true;
+
+error:
+    if (bucket_sizes) free(bucket_sizes);
+    release_delta_index(index);
+
+    return false;
+}
+
+void release_delta_index(delta_index *index)
+{
+    if (index->buckets) free(index->buckets);
+    if (index->chain) free(index->chain);
+
+    *index = (delta_index){ };
+}
+
+static bool reserve_output(delta_output *out, const size_t size)
+{
+    if (out->size + size > out->max_size) return false;
+    if (out->size + size <= out->capacity) return true;
+
+    size_t capacity = out->capacity ? out->capacity * 2 : 256;
+    while (capacity < out->size + size) capacity *= 2;
+
+    unsigned char *data = realloc(out->data, capacity);
+    if (!data) return false;
+
+    out->data = data;
+    out->capacity = capacity;
+
+    return true;
+}
+
+static bool write_delta_size(delta_output *out, size_t size)
+{
+    if (!reserve_output(out, 10)) return false;
+
+    do
+    {
+        out->data[out->size++] = (unsigned char)(size & 0x7f) | (size >= 0x80 ? 0x80 : 0);
+        size >>= 7;
+    } while (size);
+
+    return true;
+}
+
+static bool write_insert(delta_output *out, const unsigned char *data, size_t size)
+{
+    while (size)
+    {
+        const size_t n = size < DELTA_MAX_INSERT_SIZE ? size : DELTA_MAX_INSERT_SIZE;
+        if (!reserve_output(out, n + 1)) return false;
+
+        out->data[out->size++] = (unsigned char)n;
+        memcpy(&out->data[out->size], data, n);
+        out->size += n;
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// Offset and size bytes that are zero are left out, their bits in the
+// opcode clear; a size of exactly DELTA_MAX_COPY_SIZE is written as none
+static bool write_copy(delta_output *out, size_t offset, size_t size)
+{
+    while (size)
+    {
+        const size_t n = size < DELTA_MAX_COPY_SIZE ? size : DELTA_MAX_COPY_SIZE;
+        if (!reserve_output(out, 8)) return false;
+
+        unsigned char *op = &out->data[out->size++];
+        *op = 0x80;
+
+        for (int i = 0; i < 4; i++)
+        {
+            const unsigned char byte = (unsigned char)(offset >> (8 * i));
+            if (!byte) continue;
+
+            *op |= (unsigned char)(1 << i);
+            out->data[out->size++] = byte;
+        }
+
+        for (int i = 0; i < 3 && n != DELTA_MAX_COPY_SIZE; i++)
+        {
+            const unsigned char byte = (unsigned char)(n >> (8 * i));
+            if (!byte) continue;
+
+            *op |= (unsigned char)(0x10 << i);
+            out->data[out->size++] = byte;
+        }
+
+        offset += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// The longest run of target bytes at position that the base also has,
+// starting at a block boundary of the base
+static size_t find_match(const delta_index *index, const unsigned char *target, const size_t target_size, const size_t position, size_t *match_offset)
+{
+    size_t best_size = 0;
+    if (target_size - position < DELTA_BLOCK_SIZE) return 0;
+
+    const unsigned char *block = &target[position];
+    const uint32_t bucket = hash_block(block) & index->bucket_mask;
+
+    for (uint32_t entry = index->buckets[bucket]; entry; entry = index->chain[(entry - 1) / DELTA_BLOCK_SIZE])
+    {
+        const size_t offset = entry - 1;
+        if (memcmp(&index->base[offset], block, DELTA_BLOCK_SIZE) != 0) continue;
+
+        const size_t base_left = index->base_size - offset;
+        const size_t target_left = target_size - position;
+        const size_t limit = base_left < target_left ? base_left : target_left;
+
+        size_t size = DELTA_BLOCK_SIZE;
+        while (size < limit && index->base[offset + size] == block[size]) size++;
+
+        if (size > best_size)
+        {
+            best_size = size;
+            *match_offset = offset;
+        }
+    }
+
+    return best_size;
+}
+
+size_t create_delta(const delta_index *index, const unsigned char *target, const size_t target_size, const size_t max_size, unsigned char **delta)
+{
+    delta_output out = { .max_size = max_size };
+    *delta = nullptr;
+
+    if (!write_delta_size(&out, index->base_size) || !write_delta_size(&out, target_size)) goto error;
+
+    size_t insert_start = 0;
+    size_t position = 0;
+
+    while (position < target_size)
+    {
+        size_t match_offset = 0;
+        size_t match_size = find_match(index, target, target_size, position, &match_offset);
+
+        if (match_size < DELTA_BLOCK_SIZE)
+        {
+            position++;
+            continue;
+        }
+
+        // The match may reach back into bytes that were about to be inserted
+        while (position > insert_start && match_offset > 0 && index->base[match_offset - 1] == target[position - 1])
+        {
+            position--;
+            match_offset--;
+            match_size++;
+        }
+
+        if (!write_insert(&out, &target[insert_start], position - insert_start)) goto error;
+        if (!write_copy(&out, match_offset, match_size)) goto error;
+
+        position += match_size;
+        insert_start = position;
+    }
+
+    if (!write_insert(&out, &target[insert_start], target_size - insert_start)) goto error;
+
+    *delta = out.data;
+
+    return out.size;
+
+error:
+    if (out.data) free(out.data);
+
+    return 0;
+}
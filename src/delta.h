@@ -0,0 +1,36 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Copies in a delta are at most this long, the limit older readers of pack
+// version 2 accept
+#define DELTA_MAX_COPY_SIZE 0x10000
+#define DELTA_MAX_INSERT_SIZE 0x7f
+
+// The blocks of a delta base, hashed so that a target can look up where
+// its bytes occur in the base. Built once per base and reused for every
+// target tried against it.
+typedef struct delta_index
+{
+    const unsigned char *base;
+    size_t base_size;
+
+    // Bucket heads and chains hold base offsets plus one; 0 ends a chain
+    uint32_t *buckets;
+    uint32_t *chain;
+    uint32_t bucket_mask;
+} delta_index;
+
+// base has to outlive the index. Bases of 4 GiB and more are not indexed.
+bool create_delta_index(delta_index *index, const unsigned char *base, size_t base_size);
+
+void release_delta_index(delta_index *index);
+
+// Encodes target as copies from the base and inserted bytes, in the format
+// apply_delta reads. Returns the delta's size, or 0 when it would take
+// more than max_size bytes; *delta is malloc'ed.
+size_t create_delta(const delta_index *index, const unsigned char *target, size_t target_size, size_t max_size, unsigned char **delta);
+
+#endif //DELTA_H
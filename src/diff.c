@@ -0,0 +1,182 @@
+#include "diff.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "line_diff.h"
+#include "refs.h"
+
+#define ABBREV_LENGTH 7
+
+// One side of the diff. Blob content is used in place, right behind the
+// object header; worktree files are mapped.
+typedef struct diff_input
+{
+    const char *label;
+    char *object;
+    const unsigned char *mapping;
+    const char *data;
+    size_t size;
+    char hex[SHA_HEX_LENGTH + 1];
+    bool is_blob;
+} diff_input;
+
+diff_algorithm diff_algorithm_opt = DIFF_ALGORITHM_MYERS;
+long unified_opt = DEFAULT_DIFF_CONTEXT;
+
+static bool try_resolve_diff_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "histogram", no_argument, nullptr, 'H' },
+        { "unified", required_argument, nullptr, 'U' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "U:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'H':
+                diff_algorithm_opt = DIFF_ALGORITHM_HISTOGRAM;
+                break;
+            case 'U':
+            {
+                char *end;
+                unified_opt = strtol(optarg, &end, 10);
+                validate(*end == '\0' && unified_opt >= 0, "Invalid context length '%s'.", optarg);
+                break;
+            }
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool load_blob(diff_input *input, const char *name)
+{
+    validate(resolve_revision_hex(name, input->hex), "Not a valid object name '%s'.", name);
+
+    (void)get_object_content(input->hex, &input->object);
+    validate(input->object, "Failed to obtain object content.");
+    validate(strncmp(input->object, "blob ", 5) == 0, "Object '%s' is not a blob.", name);
+
+    const int header_size = get_header_size(input->object);
+    input->data = &input->object[header_size + 1];
+    input->size = strtoul(&input->object[5], nullptr, 10);
+    input->is_blob = true;
+
+    return true;
+
+error:
+    return false;
+}
+
+// A path that exists in the worktree wins over a revision of the same name
+static bool load_input(diff_input *input, const char *name)
+{
+    *input = (diff_input){ .label = name, .data = "" };
+
+    struct stat fs;
+    if (stat(name, &fs) != 0 || !S_ISREG(fs.st_mode)) return load_blob(input, name);
+
+    if (fs.st_size == 0) return true;
+
+    input->mapping = map_file(name, &input->size);
+    validate(input->mapping, "Failed to read '%s'.", name);
+    input->data = (const char *)input->mapping;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_input(const diff_input *input)
+{
+    if (input->object) free(input->object);
+    if (input->mapping) munmap((void *)input->mapping, input->size);
+}
+
+static void print_headers(const diff_input *old_input, const diff_input *new_input)
+{
+    printf("diff --git a/%s b/%s\n", old_input->label, new_input->label);
+
+    if (old_input->is_blob && new_input->is_blob)
+    {
+        printf("index %.*s..%.*s\n", ABBREV_LENGTH, old_input->hex, ABBREV_LENGTH, new_input->hex);
+    }
+}
+
+// diff [--histogram] [-U<n>] <blob> <blob | path>
+int diff(const int argc, char *argv[])
+{
+    diff_input old_input = { };
+    diff_input new_input = { };
+    line_diff lines = { };
+
+    validate(try_resolve_diff_opts(argc, argv), "Failed to resolve options.");
+
+    const int first_arg = optind + 1;
+    validate(argc - first_arg == 2, "Usage: diff [--histogram] [-U<n>] <blob> <blob | path>");
+
+    validate(load_input(&old_input, argv[first_arg]), "Failed to load '%s'.", argv[first_arg]);
+    validate(load_input(&new_input, argv[first_arg + 1]), "Failed to load '%s'.", argv[first_arg + 1]);
+
+    if (old_input.size == new_input.size && memcmp(old_input.data, new_input.data, old_input.size) == 0)
+    {
+        release_input(&old_input);
+        release_input(&new_input);
+        return 0;
+    }
+
+    // Big diffs are written line by line, so stdout must not be unbuffered
+    setvbuf(stdout, nullptr, _IOFBF, 1 << 16);
+
+    print_headers(&old_input, &new_input);
+
+    if (is_binary_content(old_input.data, old_input.size) || is_binary_content(new_input.data, new_input.size))
+    {
+        printf("Binary files a/%s and b/%s differ\n", old_input.label, new_input.label);
+    }
+    else
+    {
+        validate(
+            compute_line_diff(&lines, old_input.data, old_input.size, new_input.data, new_input.size, diff_algorithm_opt),
+            "Failed to diff '%s' and '%s'.", old_input.label, new_input.label);
+
+        printf("--- a/%s\n+++ b/%s\n", old_input.label, new_input.label);
+        validate(write_unified_diff(stdout, &lines, (unsigned int)unified_opt), "Failed to write diff.");
+
+        release_line_diff(&lines);
+    }
+
+    fflush(stdout);
+    release_input(&old_input);
+    release_input(&new_input);
+
+    return 0;
+
+error:
+    release_line_diff(&lines);
+    release_input(&old_input);
+    release_input(&new_input);
+
+    return 1;
+}
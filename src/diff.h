@@ -0,0 +1,6 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+int diff(int argc, char *argv[]);
+
+#endif //DIFF_H
@@ -0,0 +1,279 @@
+#include "diff_tree.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "diffcore.h"
+#include "diffcore_rename.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+#include "shallow.h"
+#include "tree_diff.h"
+
+typedef enum diff_output_format
+{
+    DIFF_OUTPUT_RAW,
+    DIFF_OUTPUT_NAME_STATUS,
+    DIFF_OUTPUT_NAME_ONLY,
+} diff_output_format;
+
+bool recursive_opt = false;
+bool root_opt = false;
+diff_output_format output_format_opt = DIFF_OUTPUT_RAW;
+bool find_renames_opt = false;
+bool find_copies_opt = false;
+int rename_score_opt = DEFAULT_RENAME_SCORE;
+long rename_limit_opt = 0;
+
+static bool try_resolve_diff_tree_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "name-status", no_argument, nullptr, 's' },
+        { "name-only", no_argument, nullptr, 'n' },
+        { "root", no_argument, nullptr, 'R' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "rM::C::l:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                recursive_opt = true;
+                break;
+            case 'C':
+                find_copies_opt = true;
+                [[fallthrough]];
+            case 'M':
+                find_renames_opt = true;
+                rename_score_opt = parse_rename_score(optarg);
+                validate(rename_score_opt >= 0, "Invalid similarity score '%s'.", optarg);
+                break;
+            case 'l':
+                rename_limit_opt = strtol(optarg, nullptr, 10);
+                break;
+            case 's':
+                output_format_opt = DIFF_OUTPUT_NAME_STATUS;
+                break;
+            case 'n':
+                output_format_opt = DIFF_OUTPUT_NAME_ONLY;
+                break;
+            case 'R':
+                root_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static void print_diff_pair(const diff_pair *pair)
+{
+    const bool has_two_paths = pair->status == 'R' || pair->status == 'C';
+
+    if (output_format_opt == DIFF_OUTPUT_NAME_ONLY)
+    {
+        printf("%s\n", pair->new_path);
+        return;
+    }
+
+    if (output_format_opt == DIFF_OUTPUT_RAW)
+    {
+        char old_hex[SHA_HEX_LENGTH + 1];
+        char new_hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(old_hex, pair->old_hash);
+        hash_bytes_to_hex(new_hex, pair->new_hash);
+        old_hex[SHA_HEX_LENGTH] = '\0';
+        new_hex[SHA_HEX_LENGTH] = '\0';
+
+        printf(":%06o %06o %s %s ", pair->old_mode, pair->new_mode, old_hex, new_hex);
+    }
+
+    if (has_two_paths)
+    {
+        printf("%c%03d\t%s\t%s\n", pair->status, pair->score * 100 / DIFF_MAX_SCORE, pair->old_path, pair->new_path);
+    }
+    else
+    {
+        printf("%c\t%s\n", pair->status, pair->new_path);
+    }
+}
+
+static bool print_change(const tree_change *change, void *ctx)
+{
+    (void)ctx;
+
+    diff_pair pair = {
+        .status = change->status,
+        .old_mode = change->old_mode,
+        .new_mode = change->new_mode,
+        .old_path = (char *)change->path,
+        .new_path = (char *)change->path,
+    };
+
+    memcpy(pair.old_hash, change->old_hash, SHA_DIGEST_LENGTH);
+    memcpy(pair.new_hash, change->new_hash, SHA_DIGEST_LENGTH);
+
+    print_diff_pair(&pair);
+
+    return true;
+}
+
+// Renames need the whole change set, so it is queued instead of streamed
+static bool diff_and_print(const unsigned char *old_tree, const unsigned char *new_tree)
+{
+    if (!find_renames_opt)
+    {
+        const diff_tree_opts opts = {
+            .recursive = recursive_opt,
+            .report = print_change,
+            .ctx = nullptr,
+        };
+
+        return diff_tree_hashes(old_tree, new_tree, &opts);
+    }
+
+    diff_queue queue;
+    diff_queue_init(&queue);
+
+    const diff_tree_opts opts = {
+        .recursive = recursive_opt,
+        .report = diff_queue_add_change,
+        .ctx = &queue,
+    };
+
+    const rename_opts renames = {
+        .find_copies = find_copies_opt,
+        .min_score = rename_score_opt,
+        .rename_limit = rename_limit_opt > 0
+            ? (size_t)rename_limit_opt
+            : (size_t)get_config_long("diff.renameLimit", DEFAULT_RENAME_LIMIT),
+    };
+
+    validate(diff_tree_hashes(old_tree, new_tree, &opts), "Failed to diff trees.");
+    validate(diffcore_rename(&queue, &renames), "Failed to detect renames.");
+
+    for (size_t i = 0; i < queue.count; i++)
+    {
+        if (!queue.pairs[i].is_removed) print_diff_pair(&queue.pairs[i]);
+    }
+
+    diff_queue_destroy(&queue);
+
+    return true;
+
+error:
+    diff_queue_destroy(&queue);
+
+    return false;
+}
+
+// Reads the tree and the first parent of a commit. has_parent is false for
+// root commits.
+static bool read_commit_tree_and_parent(
+    const unsigned char commit_hash[SHA_DIGEST_LENGTH],
+    unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    unsigned char parent_hash[SHA_DIGEST_LENGTH],
+    bool *has_parent)
+{
+    char *content = nullptr;
+
+    char commit_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(commit_hex, commit_hash);
+    commit_hex[SHA_HEX_LENGTH] = '\0';
+
+    (void)get_object_content(commit_hex, &content);
+    validate(content, "Failed to obtain object content.");
+    validate(strncmp(content, "commit ", 7) == 0, "Object '%s' is not a commit.", commit_hex);
+
+    const char *body = &content[get_header_size(content) + 1];
+    validate(strncmp(body, "tree ", 5) == 0, "Malformed commit '%s'.", commit_hex);
+    hash_hex_to_bytes(tree_hash, &body[5]);
+
+    const char *parent_line = strchr(body, '\n');
+    *has_parent = parent_line && strncmp(parent_line + 1, "parent ", 7) == 0 && !is_shallow_commit(commit_hash);
+
+    if (*has_parent) hash_hex_to_bytes(parent_hash, parent_line + 8);
+
+    free(content);
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
+
+// diff-tree [-r] [-M[<n>] | -C[<n>]] [-l<n>] [--name-status | --name-only] <tree-ish> <tree-ish>
+// diff-tree [-r] [-M[<n>] | -C[<n>]] [-l<n>] [--name-status | --name-only] [--root] <commit>
+int diff_tree(const int argc, char *argv[])
+{
+    validate(try_resolve_diff_tree_opts(argc, argv), "Failed to resolve options.");
+
+    const command_args args = get_command_args(argc, argv);
+    validate(args.count == 1 || args.count == 2, "Usage: diff-tree [-r] [--name-status | --name-only] <tree-ish> [<tree-ish>]");
+
+    if (args.count == 2)
+    {
+        char old_hex[SHA_HEX_LENGTH + 1];
+        char new_hex[SHA_HEX_LENGTH + 1];
+        validate(resolve_tree_hex(args.argv[0], old_hex), "Not a tree-ish '%s'.", args.argv[0]);
+        validate(resolve_tree_hex(args.argv[1], new_hex), "Not a tree-ish '%s'.", args.argv[1]);
+
+        unsigned char old_tree[SHA_DIGEST_LENGTH];
+        unsigned char new_tree[SHA_DIGEST_LENGTH];
+        hash_hex_to_bytes(old_tree, old_hex);
+        hash_hex_to_bytes(new_tree, new_hex);
+
+        validate(diff_and_print(old_tree, new_tree), "Failed to diff trees.");
+
+        return 0;
+    }
+
+    // A single commit is compared with its first parent, like git does
+    unsigned char commit_hash[SHA_DIGEST_LENGTH];
+    validate(resolve_revision(args.argv[0], commit_hash), "Not a valid object name '%s'.", args.argv[0]);
+
+    unsigned char tree_hash[SHA_DIGEST_LENGTH];
+    unsigned char parent_hash[SHA_DIGEST_LENGTH];
+    bool has_parent;
+    validate(read_commit_tree_and_parent(commit_hash, tree_hash, parent_hash, &has_parent), "Failed to read commit.");
+
+    if (!has_parent && !root_opt) return 0;
+
+    unsigned char parent_tree_hash[SHA_DIGEST_LENGTH];
+    bool has_grandparent;
+
+    if (has_parent)
+    {
+        validate(read_commit_tree_and_parent(parent_hash, parent_tree_hash, parent_hash, &has_grandparent), "Failed to read parent commit.");
+    }
+
+    char commit_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(commit_hex, commit_hash);
+    commit_hex[SHA_HEX_LENGTH] = '\0';
+    printf("%s\n", commit_hex);
+
+    validate(diff_and_print(has_parent ? parent_tree_hash : nullptr, tree_hash), "Failed to diff trees.");
+
+    return 0;
+
+error:
+    return 1;
+}
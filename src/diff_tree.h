@@ -0,0 +1,6 @@
+#ifndef DIFF_TREE_H
+#define DIFF_TREE_H
+
+int diff_tree(int argc, char *argv[]);
+
+#endif //DIFF_TREE_H
@@ -0,0 +1,65 @@
+#include "diffcore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+
+#define DIFF_QUEUE_MIN_CAPACITY 64
+
+void diff_queue_init(diff_queue *queue)
+{
+    queue->pairs = nullptr;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+void diff_queue_destroy(diff_queue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        diff_pair *pair = &queue->pairs[i];
+
+        if (pair->old_path != pair->new_path) free(pair->old_path);
+        free(pair->new_path);
+    }
+
+    if (queue->pairs) free(queue->pairs);
+
+    diff_queue_init(queue);
+}
+
+bool diff_queue_add_change(const tree_change *change, void *ctx)
+{
+    diff_queue *queue = ctx;
+
+    if (queue->count == queue->capacity)
+    {
+        const size_t capacity = queue->capacity ? queue->capacity * 2 : DIFF_QUEUE_MIN_CAPACITY;
+        diff_pair *pairs = realloc(queue->pairs, capacity * sizeof(diff_pair));
+        validate(pairs, "Failed to allocate memory.");
+
+        queue->pairs = pairs;
+        queue->capacity = capacity;
+    }
+
+    char *path = strdup(change->path);
+    validate(path, "Failed to allocate memory.");
+
+    diff_pair *pair = &queue->pairs[queue->count++];
+
+    pair->status = change->status;
+    pair->old_mode = change->old_mode;
+    pair->new_mode = change->new_mode;
+    memcpy(pair->old_hash, change->old_hash, SHA_DIGEST_LENGTH);
+    memcpy(pair->new_hash, change->new_hash, SHA_DIGEST_LENGTH);
+    pair->old_path = path;
+    pair->new_path = path;
+    pair->score = 0;
+    pair->is_removed = false;
+
+    return true;
+
+error:
+    return false;
+}
@@ -0,0 +1,44 @@
+#ifndef DIFFCORE_H
+#define DIFFCORE_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+#include "tree_diff.h"
+
+#define DIFF_MAX_SCORE 60000
+
+// One file level change. Rename and copy detection turns pairs of added
+// and deleted entries into 'R' and 'C' pairs with two paths.
+typedef struct diff_pair
+{
+    char status;
+    unsigned int old_mode;
+    unsigned int new_mode;
+    unsigned char old_hash[SHA_DIGEST_LENGTH];
+    unsigned char new_hash[SHA_DIGEST_LENGTH];
+    char *old_path;
+    char *new_path;
+
+    // Similarity in [0, DIFF_MAX_SCORE] for renames and copies
+    int score;
+
+    // Dropped from the output, e.g. the deletion half of a rename
+    bool is_removed;
+} diff_pair;
+
+typedef struct diff_queue
+{
+    diff_pair *pairs;
+    size_t count;
+    size_t capacity;
+} diff_queue;
+
+void diff_queue_init(diff_queue *queue);
+
+void diff_queue_destroy(diff_queue *queue);
+
+// tree_change_fn collecting changes into a diff_queue passed as ctx
+bool diff_queue_add_change(const tree_change *change, void *ctx);
+
+#endif //DIFFCORE_H
@@ -0,0 +1,561 @@
+#include "diffcore_rename.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "oid_map.h"
+#include "packfile.h"
+#include "thread_pool.h"
+#include "tree_walk.h"
+
+#define NUM_CANDIDATES_PER_DST 4
+#define MAX_SPAN_LENGTH 64
+#define NO_SOURCE SIZE_MAX
+
+// Content is cut into spans ending at a newline or after 64 bytes. A
+// fingerprint lists the hashes of those spans, sorted, with the number of
+// bytes each hash covers, so two fingerprints compare in one merge pass.
+typedef struct span_hash
+{
+    uint32_t hash;
+    uint32_t count;
+} span_hash;
+
+typedef struct fingerprint
+{
+    span_hash *spans;
+    size_t count;
+    size_t size;
+    bool is_loaded;
+} fingerprint;
+
+typedef struct rename_source
+{
+    diff_pair *pair;
+    fingerprint fp;
+    bool is_renamed;
+    size_t next_same_oid;
+} rename_source;
+
+typedef struct rename_dest
+{
+    diff_pair *pair;
+    fingerprint fp;
+    bool is_matched;
+} rename_dest;
+
+typedef struct rename_candidate
+{
+    int score;
+    size_t src;
+    size_t dst;
+} rename_candidate;
+
+typedef struct rename_state
+{
+    rename_source *sources;
+    size_t source_count;
+    rename_dest *dests;
+    size_t dest_count;
+
+    // Indices of the entries taking part in inexact detection
+    size_t *inexact_sources;
+    size_t inexact_source_count;
+    size_t *inexact_dests;
+    size_t inexact_dest_count;
+
+    // NUM_CANDIDATES_PER_DST best sources for every inexact destination
+    rename_candidate *candidates;
+    int min_score;
+} rename_state;
+
+int parse_rename_score(const char *arg)
+{
+    if (!arg || !*arg) return DEFAULT_RENAME_SCORE;
+
+    long num = 0;
+    long scale = 1;
+    bool is_percent = false;
+
+    for (const char *p = arg; *p; p++)
+    {
+        if (*p == '%')
+        {
+            is_percent = true;
+            break;
+        }
+
+        if (*p < '0' || *p > '9') return -1;
+
+        if (scale <= 100000)
+        {
+            num = num * 10 + (*p - '0');
+            scale *= 10;
+        }
+    }
+
+    if (is_percent) scale = 100;
+    if (num >= scale) return DIFF_MAX_SCORE;
+
+    return (int)(num * DIFF_MAX_SCORE / scale);
+}
+
+static bool is_rename_candidate_mode(const unsigned int mode)
+{
+    const unsigned int type = mode & 0170000;
+    return type == 0100000 || type == TREE_MODE_SYMLINK;
+}
+
+static bool is_regular_file_mode(const unsigned int mode)
+{
+    return (mode & 0170000) == 0100000;
+}
+
+static const char *get_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static int compare_span_hashes(const void *a, const void *b)
+{
+    const uint32_t hash_a = ((const span_hash *)a)->hash;
+    const uint32_t hash_b = ((const span_hash *)b)->hash;
+
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+static bool build_fingerprint(const char *data, const size_t size, fingerprint *fp)
+{
+    size_t capacity = size / 32 + 16;
+    fp->spans = malloc(capacity * sizeof(span_hash));
+    validate(fp->spans, "Failed to allocate memory.");
+
+    fp->count = 0;
+    fp->size = size;
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        // FNV-1a over the span
+        uint32_t hash = 2166136261u;
+        size_t len = 0;
+
+        while (pos < size && len < MAX_SPAN_LENGTH)
+        {
+            const unsigned char c = data[pos++];
+            len++;
+
+            hash = (hash ^ c) * 16777619u;
+            if (c == '\n') break;
+        }
+
+        if (fp->count == capacity)
+        {
+            capacity *= 2;
+            span_hash *spans = realloc(fp->spans, capacity * sizeof(span_hash));
+            validate(spans, "Failed to allocate memory.");
+            fp->spans = spans;
+        }
+
+        fp->spans[fp->count++] = (span_hash){ .hash = hash, .count = (uint32_t)len };
+    }
+
+    qsort(fp->spans, fp->count, sizeof(span_hash), compare_span_hashes);
+
+    // Fold equal hashes into one entry covering all their bytes
+    size_t merged = 0;
+    for (size_t i = 0; i < fp->count; i++)
+    {
+        if (merged && fp->spans[merged - 1].hash == fp->spans[i].hash)
+        {
+            fp->spans[merged - 1].count += fp->spans[i].count;
+        }
+        else
+        {
+            fp->spans[merged++] = fp->spans[i];
+        }
+    }
+
+    fp->count = merged;
+    fp->is_loaded = true;
+
+    return true;
+
+error:
+    if (fp->spans) free(fp->spans);
+    fp->spans = nullptr;
+    fp->count = 0;
+
+    return false;
+}
+
+static void release_fingerprint(fingerprint *fp)
+{
+    if (fp->spans) free(fp->spans);
+
+    fp->spans = nullptr;
+    fp->count = 0;
+    fp->is_loaded = false;
+}
+
+static void load_fingerprint(const unsigned char hash[SHA_DIGEST_LENGTH], fingerprint *fp)
+{
+    char *content = nullptr;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, hash);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    const size_t content_size = get_object_content(hash_hex, &content);
+    validate(content, "Failed to obtain object content.");
+
+    const size_t header_size = get_header_size(content) + 1;
+    (void)build_fingerprint(&content[header_size], content_size - header_size, fp);
+
+    free(content);
+
+    return;
+
+error:
+    if (content) free(content);
+}
+
+// Shared bytes over the size of the larger file. Files whose sizes alone
+// rule out min_score are never merged.
+static int estimate_similarity(const fingerprint *src, const fingerprint *dst, const int min_score)
+{
+    if (!src->is_loaded || !dst->is_loaded) return 0;
+
+    const uint64_t max_size = src->size > dst->size ? src->size : dst->size;
+    const uint64_t delta_size = src->size > dst->size ? src->size - dst->size : dst->size - src->size;
+
+    if (max_size == 0) return 0;
+    if (max_size * (DIFF_MAX_SCORE - min_score) < delta_size * DIFF_MAX_SCORE) return 0;
+
+    // Spans are visited in hash order, so the bytes not yet visited bound
+    // what can still be shared; once that cannot reach min_score, stop
+    const uint64_t needed = (max_size * min_score + DIFF_MAX_SCORE - 1) / DIFF_MAX_SCORE;
+    uint64_t src_left = src->size;
+    uint64_t dst_left = dst->size;
+
+    uint64_t copied = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < src->count && j < dst->count)
+    {
+        if (copied + (src_left < dst_left ? src_left : dst_left) < needed) return 0;
+
+        const uint32_t src_count = src->spans[i].count;
+        const uint32_t dst_count = dst->spans[j].count;
+
+        if (src->spans[i].hash < dst->spans[j].hash)
+        {
+            src_left -= src_count;
+            i++;
+        }
+        else if (src->spans[i].hash > dst->spans[j].hash)
+        {
+            dst_left -= dst_count;
+            j++;
+        }
+        else
+        {
+            copied += src_count < dst_count ? src_count : dst_count;
+            src_left -= src_count;
+            dst_left -= dst_count;
+            i++;
+            j++;
+        }
+    }
+
+    return (int)(copied * DIFF_MAX_SCORE / max_size);
+}
+
+static void load_fingerprint_task(void *ctx, const size_t index)
+{
+    rename_state *state = ctx;
+
+    if (index < state->inexact_source_count)
+    {
+        rename_source *source = &state->sources[state->inexact_sources[index]];
+        load_fingerprint(source->pair->old_hash, &source->fp);
+    }
+    else
+    {
+        rename_dest *dest = &state->dests[state->inexact_dests[index - state->inexact_source_count]];
+        load_fingerprint(dest->pair->new_hash, &dest->fp);
+    }
+}
+
+static void record_candidate(rename_candidate *slots, const rename_candidate candidate)
+{
+    size_t pos = NUM_CANDIDATES_PER_DST;
+    while (pos > 0 && slots[pos - 1].score < candidate.score) pos--;
+
+    if (pos == NUM_CANDIDATES_PER_DST) return;
+
+    memmove(&slots[pos + 1], &slots[pos], (NUM_CANDIDATES_PER_DST - pos - 1) * sizeof(rename_candidate));
+    slots[pos] = candidate;
+}
+
+// Each worker owns the candidate slots of the destination it scores
+static void score_dest_task(void *ctx, const size_t index)
+{
+    rename_state *state = ctx;
+
+    const size_t dst = state->inexact_dests[index];
+    const fingerprint *dst_fp = &state->dests[dst].fp;
+    rename_candidate *slots = &state->candidates[index * NUM_CANDIDATES_PER_DST];
+
+    for (size_t i = 0; i < NUM_CANDIDATES_PER_DST; i++)
+    {
+        slots[i] = (rename_candidate){ .score = -1, .src = NO_SOURCE, .dst = dst };
+    }
+
+    for (size_t i = 0; i < state->inexact_source_count; i++)
+    {
+        const size_t src = state->inexact_sources[i];
+
+        // Only a score beating the weakest kept candidate matters
+        const int weakest = slots[NUM_CANDIDATES_PER_DST - 1].score;
+        const int threshold = weakest > state->min_score ? weakest : state->min_score;
+
+        const int score = estimate_similarity(&state->sources[src].fp, dst_fp, threshold);
+        if (score < threshold) continue;
+
+        record_candidate(slots, (rename_candidate){ .score = score, .src = src, .dst = dst });
+    }
+}
+
+static int compare_candidates(const void *a, const void *b)
+{
+    const rename_candidate *candidate_a = a;
+    const rename_candidate *candidate_b = b;
+
+    if (candidate_a->score != candidate_b->score) return candidate_a->score > candidate_b->score ? -1 : 1;
+    if (candidate_a->dst != candidate_b->dst) return candidate_a->dst < candidate_b->dst ? -1 : 1;
+
+    return (candidate_a->src > candidate_b->src) - (candidate_a->src < candidate_b->src);
+}
+
+// A deletion can be renamed once; anything else can only be copied
+static bool is_unused_deletion(const rename_source *source)
+{
+    return source->pair->status == 'D' && !source->is_renamed;
+}
+
+// Turns the destination's addition into a rename, or into a copy when the
+// source is kept or was renamed already
+static bool record_match(rename_state *state, const size_t src, const size_t dst, const int score)
+{
+    rename_source *source = &state->sources[src];
+    rename_dest *dest = &state->dests[dst];
+
+    const bool is_rename = is_unused_deletion(source);
+
+    char *old_path = strdup(source->pair->old_path);
+    validate(old_path, "Failed to allocate memory.");
+
+    diff_pair *pair = dest->pair;
+    pair->status = is_rename ? 'R' : 'C';
+    pair->old_mode = source->pair->old_mode;
+    memcpy(pair->old_hash, source->pair->old_hash, SHA_DIGEST_LENGTH);
+    pair->old_path = old_path;
+    pair->score = score;
+
+    if (is_rename)
+    {
+        source->is_renamed = true;
+        source->pair->is_removed = true;
+    }
+
+    dest->is_matched = true;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool find_exact_renames(rename_state *state, const bool find_copies)
+{
+    oid_map sources_by_oid = { };
+    validate(oid_map_init(&sources_by_oid, state->source_count), "Failed to allocate memory.");
+
+    // Chains of sources sharing an oid, in queue order
+    for (size_t i = state->source_count; i-- > 0;)
+    {
+        rename_source *source = &state->sources[i];
+
+        uint64_t next;
+        source->next_same_oid = oid_map_get(&sources_by_oid, source->pair->old_hash, &next) ? (size_t)next : NO_SOURCE;
+        validate(oid_map_put(&sources_by_oid, source->pair->old_hash, i), "Failed to allocate memory.");
+    }
+
+    for (size_t dst = 0; dst < state->dest_count; dst++)
+    {
+        const diff_pair *dest_pair = state->dests[dst].pair;
+
+        uint64_t first;
+        if (!oid_map_get(&sources_by_oid, dest_pair->new_hash, &first)) continue;
+
+        // Prefer an unused deletion with the same basename, then any unused
+        // deletion, then (for copies) any source at all
+        size_t best = NO_SOURCE;
+        int best_rank = 0;
+
+        for (size_t src = (size_t)first; src != NO_SOURCE; src = state->sources[src].next_same_oid)
+        {
+            const rename_source *source = &state->sources[src];
+            if ((source->pair->old_mode & 0170000) != (dest_pair->new_mode & 0170000)) continue;
+
+            const bool is_same_basename = strcmp(get_basename(source->pair->old_path), get_basename(dest_pair->new_path)) == 0;
+            const int rank = is_unused_deletion(source) ? (is_same_basename ? 3 : 2) : find_copies ? 1 : 0;
+
+            if (rank > best_rank)
+            {
+                best = src;
+                best_rank = rank;
+            }
+        }
+
+        if (best == NO_SOURCE) continue;
+
+        validate(record_match(state, best, dst, DIFF_MAX_SCORE), "Failed to record exact rename.");
+    }
+
+    oid_map_destroy(&sources_by_oid);
+
+    return true;
+
+error:
+    oid_map_destroy(&sources_by_oid);
+
+    return false;
+}
+
+static bool find_inexact_renames(rename_state *state, const rename_opts *opts)
+{
+    state->inexact_sources = malloc((state->source_count + 1) * sizeof(size_t));
+    state->inexact_dests = malloc((state->dest_count + 1) * sizeof(size_t));
+    validate(state->inexact_sources && state->inexact_dests, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state->source_count; i++)
+    {
+        const rename_source *source = &state->sources[i];
+        if (!is_regular_file_mode(source->pair->old_mode)) continue;
+        if (!opts->find_copies && source->is_renamed) continue;
+
+        state->inexact_sources[state->inexact_source_count++] = i;
+    }
+
+    for (size_t i = 0; i < state->dest_count; i++)
+    {
+        const rename_dest *dest = &state->dests[i];
+        if (dest->is_matched || !is_regular_file_mode(dest->pair->new_mode)) continue;
+
+        state->inexact_dests[state->inexact_dest_count++] = i;
+    }
+
+    if (!state->inexact_source_count || !state->inexact_dest_count) return true;
+
+    const uint64_t limit = opts->rename_limit;
+    if ((uint64_t)state->inexact_source_count * state->inexact_dest_count > limit * limit)
+    {
+        fprintf(stderr, "warning: inexact rename detection was skipped due to too many files.\n");
+        fprintf(stderr, "warning: you may want to set diff.renameLimit to at least %zu.\n",
+            state->inexact_source_count > state->inexact_dest_count
+                ? state->inexact_source_count
+                : state->inexact_dest_count);
+        return true;
+    }
+
+    state->candidates = malloc(state->inexact_dest_count * NUM_CANDIDATES_PER_DST * sizeof(rename_candidate));
+    validate(state->candidates, "Failed to allocate memory.");
+
+    const unsigned workers = get_worker_count("diff.threads");
+    prepare_packed_git_for_threads();
+
+    run_parallel(state->inexact_source_count + state->inexact_dest_count, workers, load_fingerprint_task, state);
+    run_parallel(state->inexact_dest_count, workers, score_dest_task, state);
+
+    const size_t candidate_count = state->inexact_dest_count * NUM_CANDIDATES_PER_DST;
+    qsort(state->candidates, candidate_count, sizeof(rename_candidate), compare_candidates);
+
+    for (size_t i = 0; i < candidate_count; i++)
+    {
+        const rename_candidate *candidate = &state->candidates[i];
+
+        // Empty slots sort last
+        if (candidate->src == NO_SOURCE) break;
+        if (state->dests[candidate->dst].is_matched) continue;
+        if (!opts->find_copies && !is_unused_deletion(&state->sources[candidate->src])) continue;
+
+        validate(record_match(state, candidate->src, candidate->dst, candidate->score), "Failed to record rename.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_rename_state(rename_state *state)
+{
+    for (size_t i = 0; i < state->source_count; i++) release_fingerprint(&state->sources[i].fp);
+    for (size_t i = 0; i < state->dest_count; i++) release_fingerprint(&state->dests[i].fp);
+
+    if (state->sources) free(state->sources);
+    if (state->dests) free(state->dests);
+    if (state->inexact_sources) free(state->inexact_sources);
+    if (state->inexact_dests) free(state->inexact_dests);
+    if (state->candidates) free(state->candidates);
+}
+
+bool diffcore_rename(diff_queue *queue, const rename_opts *opts)
+{
+    rename_state state = { .min_score = opts->min_score };
+
+    state.sources = calloc(queue->count + 1, sizeof(rename_source));
+    state.dests = calloc(queue->count + 1, sizeof(rename_dest));
+    validate(state.sources && state.dests, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        diff_pair *pair = &queue->pairs[i];
+
+        if (pair->status == 'A')
+        {
+            if (!is_rename_candidate_mode(pair->new_mode)) continue;
+
+            state.dests[state.dest_count++].pair = pair;
+            continue;
+        }
+
+        const bool is_source = pair->status == 'D' || (opts->find_copies && (pair->status == 'M' || pair->status == 'T'));
+        if (!is_source || !is_rename_candidate_mode(pair->old_mode)) continue;
+
+        state.sources[state.source_count++].pair = pair;
+    }
+
+    if (state.source_count && state.dest_count)
+    {
+        validate(find_exact_renames(&state, opts->find_copies), "Failed to find exact renames.");
+        validate(find_inexact_renames(&state, opts), "Failed to find inexact renames.");
+    }
+
+    release_rename_state(&state);
+
+    return true;
+
+error:
+    release_rename_state(&state);
+
+    return false;
+}
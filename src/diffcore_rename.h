@@ -0,0 +1,31 @@
+#ifndef DIFFCORE_RENAME_H
+#define DIFFCORE_RENAME_H
+
+#include <stddef.h>
+
+#include "diffcore.h"
+
+#define DEFAULT_RENAME_SCORE (DIFF_MAX_SCORE / 2)
+#define DEFAULT_RENAME_LIMIT 1000
+
+typedef struct rename_opts
+{
+    bool find_copies;
+
+    // Minimum similarity in DIFF_MAX_SCORE units
+    int min_score;
+
+    // Inexact detection is skipped when sources * destinations exceeds
+    // rename_limit squared. Exact renames are always found.
+    size_t rename_limit;
+} rename_opts;
+
+// Pairs deleted (and with find_copies, modified) files with added ones.
+// Exact matches are paired by oid first; the rest are scored on chunk
+// fingerprints in parallel.
+bool diffcore_rename(diff_queue *queue, const rename_opts *opts);
+
+// Parses the <n> of -M<n>/-C<n>: "5" and "50" mean 50%, "50%" too
+int parse_rename_score(const char *arg);
+
+#endif //DIFFCORE_RENAME_H
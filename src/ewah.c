@@ -0,0 +1,365 @@
+#include "ewah.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "debug_helpers.h"
+#include "packfile.h"
+
+#define BITS_IN_WORD 64
+#define CLEAN_WORD_ONES UINT64_MAX
+
+// A running length word: bit 0 is the value of the run, the next 32 bits
+// its length in words, the top 31 bits the number of literal words after it
+#define RLW_RUNNING_BITS 32
+#define RLW_LITERAL_BITS 31
+#define RLW_LARGEST_RUNNING_COUNT ((1ULL << RLW_RUNNING_BITS) - 1)
+#define RLW_LARGEST_LITERAL_COUNT ((1ULL << RLW_LITERAL_BITS) - 1)
+
+typedef enum word_op
+{
+    WORD_OP_OR,
+    WORD_OP_XOR,
+} word_op;
+
+static bool get_running_bit(const uint64_t rlw)
+{
+    return rlw & 1;
+}
+
+static uint64_t get_running_len(const uint64_t rlw)
+{
+    return (rlw >> 1) & RLW_LARGEST_RUNNING_COUNT;
+}
+
+static uint64_t get_literal_count(const uint64_t rlw)
+{
+    return rlw >> (1 + RLW_RUNNING_BITS);
+}
+
+static uint64_t make_rlw(const bool running_bit, const uint64_t running_len, const uint64_t literal_count)
+{
+    return (uint64_t)running_bit | running_len << 1 | literal_count << (1 + RLW_RUNNING_BITS);
+}
+
+static void or_words(uint64_t *dest, const uint64_t *src, size_t count)
+{
+#if defined(__SSE2__)
+    for (; count >= 4; count -= 4, dest += 4, src += 4)
+    {
+        const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)dest), _mm_loadu_si128((const __m128i *)src));
+        const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)&dest[2]), _mm_loadu_si128((const __m128i *)&src[2]));
+        _mm_storeu_si128((__m128i *)dest, a);
+        _mm_storeu_si128((__m128i *)&dest[2], b);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) dest[i] |= src[i];
+}
+
+static void xor_words(uint64_t *dest, const uint64_t *src, size_t count)
+{
+#if defined(__SSE2__)
+    for (; count >= 2; count -= 2, dest += 2, src += 2)
+    {
+        const __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)dest), _mm_loadu_si128((const __m128i *)src));
+        _mm_storeu_si128((__m128i *)dest, a);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) dest[i] ^= src[i];
+}
+
+static void and_not_words(uint64_t *dest, const uint64_t *src, size_t count)
+{
+#if defined(__SSE2__)
+    for (; count >= 4; count -= 4, dest += 4, src += 4)
+    {
+        // _mm_andnot_si128 computes ~first & second
+        const __m128i a = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)src), _mm_loadu_si128((const __m128i *)dest));
+        const __m128i b = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)&src[2]), _mm_loadu_si128((const __m128i *)&dest[2]));
+        _mm_storeu_si128((__m128i *)dest, a);
+        _mm_storeu_si128((__m128i *)&dest[2], b);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) dest[i] &= ~src[i];
+}
+
+static bool bitmap_grow(bitmap *bitmap, const size_t word_count)
+{
+    if (word_count <= bitmap->word_count) return true;
+
+    size_t capacity = bitmap->word_count ? bitmap->word_count : 1;
+    while (capacity < word_count) capacity *= 2;
+
+    uint64_t *words = realloc(bitmap->words, capacity * sizeof(uint64_t));
+    validate(words, "Failed to allocate memory.");
+
+    memset(&words[bitmap->word_count], 0, (capacity - bitmap->word_count) * sizeof(uint64_t));
+    bitmap->words = words;
+    bitmap->word_count = capacity;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool bitmap_init(bitmap *bitmap, const size_t bit_count)
+{
+    *bitmap = (struct bitmap){ };
+
+    return bitmap_grow(bitmap, (bit_count + BITS_IN_WORD - 1) / BITS_IN_WORD);
+}
+
+void bitmap_release(bitmap *bitmap)
+{
+    if (bitmap->words) free(bitmap->words);
+
+    *bitmap = (struct bitmap){ };
+}
+
+void bitmap_clear(bitmap *bitmap)
+{
+    if (bitmap->words) memset(bitmap->words, 0, bitmap->word_count * sizeof(uint64_t));
+}
+
+bool bitmap_set(bitmap *bitmap, const size_t pos)
+{
+    validate(bitmap_grow(bitmap, pos / BITS_IN_WORD + 1), "Failed to grow bitmap.");
+
+    bitmap->words[pos / BITS_IN_WORD] |= 1ULL << (pos % BITS_IN_WORD);
+
+    return true;
+
+error:
+    return false;
+}
+
+bool bitmap_get(const bitmap *bitmap, const size_t pos)
+{
+    if (pos / BITS_IN_WORD >= bitmap->word_count) return false;
+
+    return bitmap->words[pos / BITS_IN_WORD] >> (pos % BITS_IN_WORD) & 1;
+}
+
+bool bitmap_or(bitmap *dest, const bitmap *src)
+{
+    validate(bitmap_grow(dest, src->word_count), "Failed to grow bitmap.");
+
+    or_words(dest->words, src->words, src->word_count);
+
+    return true;
+
+error:
+    return false;
+}
+
+void bitmap_and(bitmap *dest, const bitmap *src)
+{
+    const size_t common = dest->word_count < src->word_count ? dest->word_count : src->word_count;
+
+    for (size_t i = 0; i < common; i++) dest->words[i] &= src->words[i];
+
+    if (dest->word_count > common) memset(&dest->words[common], 0, (dest->word_count - common) * sizeof(uint64_t));
+}
+
+void bitmap_and_not(bitmap *dest, const bitmap *src)
+{
+    const size_t common = dest->word_count < src->word_count ? dest->word_count : src->word_count;
+
+    and_not_words(dest->words, src->words, common);
+}
+
+size_t bitmap_popcount(const bitmap *bitmap)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < bitmap->word_count; i++) count += __builtin_popcountll(bitmap->words[i]);
+
+    return count;
+}
+
+bool bitmap_next_set(const bitmap *bitmap, size_t *pos)
+{
+    size_t word_index = *pos / BITS_IN_WORD;
+    if (word_index >= bitmap->word_count) return false;
+
+    uint64_t word = bitmap->words[word_index] & (CLEAN_WORD_ONES << (*pos % BITS_IN_WORD));
+
+    while (!word)
+    {
+        if (++word_index >= bitmap->word_count) return false;
+        word = bitmap->words[word_index];
+    }
+
+    *pos = word_index * BITS_IN_WORD + __builtin_ctzll(word);
+
+    return true;
+}
+
+// Layout: be32 bit size, be32 word count, the words as be64, then the be32
+// position of the last running length word
+size_t ewah_read(ewah_bitmap *ewah, const unsigned char *data, const size_t size)
+{
+    *ewah = (ewah_bitmap){ };
+
+    validate(size >= 8, "Truncated EWAH bitmap.");
+
+    const uint32_t bit_size = get_be32(data);
+    const uint32_t word_count = get_be32(&data[4]);
+    const size_t total_size = 8 + (size_t)word_count * 8 + 4;
+    validate(total_size <= size, "Truncated EWAH bitmap.");
+
+    ewah->words = malloc((word_count ? word_count : 1) * sizeof(uint64_t));
+    validate(ewah->words, "Failed to allocate memory.");
+
+    for (uint32_t i = 0; i < word_count; i++) ewah->words[i] = get_be64(&data[8 + (size_t)i * 8]);
+
+    ewah->word_count = word_count;
+    ewah->bit_size = bit_size;
+
+    // Each running length word has to leave room for its literals
+    for (size_t i = 0; i < ewah->word_count; i += 1 + get_literal_count(ewah->words[i]))
+    {
+        validate(i + 1 + get_literal_count(ewah->words[i]) <= ewah->word_count, "Corrupt EWAH bitmap.");
+    }
+
+    return total_size;
+
+error:
+    ewah_release(ewah);
+
+    return 0;
+}
+
+void ewah_release(ewah_bitmap *ewah)
+{
+    if (ewah->words) free(ewah->words);
+
+    *ewah = (ewah_bitmap){ };
+}
+
+bool ewah_from_bitmap(ewah_bitmap *ewah, const bitmap *bitmap)
+{
+    *ewah = (ewah_bitmap){ };
+
+    // Trailing zero words are implied by the bit size
+    size_t count = bitmap->word_count;
+    while (count && !bitmap->words[count - 1]) count--;
+
+    // Worst case is one running length word for every two words of input
+    ewah->words = malloc((count + count / 2 + 1) * sizeof(uint64_t));
+    validate(ewah->words, "Failed to allocate memory.");
+
+    const uint64_t *words = bitmap->words;
+    size_t i = 0;
+
+    do
+    {
+        bool running_bit = false;
+        uint64_t running_len = 0;
+
+        if (i < count && (words[i] == 0 || words[i] == CLEAN_WORD_ONES))
+        {
+            running_bit = words[i] == CLEAN_WORD_ONES;
+            const uint64_t clean = running_bit ? CLEAN_WORD_ONES : 0;
+
+            while (i < count && words[i] == clean && running_len < RLW_LARGEST_RUNNING_COUNT)
+            {
+                running_len++;
+                i++;
+            }
+        }
+
+        const size_t literal_start = i;
+        while (i < count && words[i] != 0 && words[i] != CLEAN_WORD_ONES && i - literal_start < RLW_LARGEST_LITERAL_COUNT) i++;
+
+        const uint64_t literal_count = i - literal_start;
+
+        ewah->words[ewah->word_count++] = make_rlw(running_bit, running_len, literal_count);
+        memcpy(&ewah->words[ewah->word_count], &words[literal_start], literal_count * sizeof(uint64_t));
+        ewah->word_count += literal_count;
+    }
+    while (i < count);
+
+    ewah->bit_size = (uint32_t)(count * BITS_IN_WORD);
+
+    return true;
+
+error:
+    ewah_release(ewah);
+
+    return false;
+}
+
+size_t ewah_serialized_size(const ewah_bitmap *ewah)
+{
+    return 8 + ewah->word_count * 8 + 4;
+}
+
+void ewah_serialize(const ewah_bitmap *ewah, unsigned char *out)
+{
+    put_be32(out, ewah->bit_size);
+    put_be32(&out[4], (uint32_t)ewah->word_count);
+
+    size_t last_rlw = 0;
+
+    for (size_t i = 0; i < ewah->word_count; i++) put_be64(&out[8 + i * 8], ewah->words[i]);
+
+    for (size_t i = 0; i < ewah->word_count; i += 1 + get_literal_count(ewah->words[i])) last_rlw = i;
+
+    put_be32(&out[8 + ewah->word_count * 8], (uint32_t)last_rlw);
+}
+
+static bool apply_ewah(bitmap *dest, const ewah_bitmap *src, const word_op op)
+{
+    size_t pos = 0;
+
+    for (size_t i = 0; i < src->word_count;)
+    {
+        const uint64_t rlw = src->words[i++];
+        const uint64_t running_len = get_running_len(rlw);
+        const uint64_t literal_count = get_literal_count(rlw);
+
+        validate(bitmap_grow(dest, pos + running_len + literal_count), "Failed to grow bitmap.");
+
+        if (get_running_bit(rlw))
+        {
+            for (uint64_t k = 0; k < running_len; k++)
+            {
+                dest->words[pos + k] = op == WORD_OP_OR ? CLEAN_WORD_ONES : ~dest->words[pos + k];
+            }
+        }
+
+        pos += running_len;
+
+        if (op == WORD_OP_OR)
+            or_words(&dest->words[pos], &src->words[i], literal_count);
+        else
+            xor_words(&dest->words[pos], &src->words[i], literal_count);
+
+        pos += literal_count;
+        i += literal_count;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+bool bitmap_or_ewah(bitmap *dest, const ewah_bitmap *src)
+{
+    return apply_ewah(dest, src, WORD_OP_OR);
+}
+
+bool bitmap_xor_ewah(bitmap *dest, const ewah_bitmap *src)
+{
+    return apply_ewah(dest, src, WORD_OP_XOR);
+}
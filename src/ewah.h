@@ -0,0 +1,62 @@
+#ifndef EWAH_H
+#define EWAH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Plain bitset, grown on demand; bits past word_count read as zero
+typedef struct bitmap
+{
+    uint64_t *words;
+    size_t word_count;
+} bitmap;
+
+// EWAH compressed bitset, as stored in .bitmap files. words holds running
+// length words, each followed by its literal words, in host byte order.
+typedef struct ewah_bitmap
+{
+    uint64_t *words;
+    size_t word_count;
+    uint32_t bit_size;
+} ewah_bitmap;
+
+bool bitmap_init(bitmap *bitmap, size_t bit_count);
+
+void bitmap_release(bitmap *bitmap);
+
+void bitmap_clear(bitmap *bitmap);
+
+bool bitmap_set(bitmap *bitmap, size_t pos);
+
+bool bitmap_get(const bitmap *bitmap, size_t pos);
+
+bool bitmap_or(bitmap *dest, const bitmap *src);
+
+void bitmap_and(bitmap *dest, const bitmap *src);
+
+void bitmap_and_not(bitmap *dest, const bitmap *src);
+
+size_t bitmap_popcount(const bitmap *bitmap);
+
+// Finds the first set bit at or after *pos
+bool bitmap_next_set(const bitmap *bitmap, size_t *pos);
+
+// Parses a serialized EWAH bitmap, returning the number of bytes it took or
+// zero when the data is malformed
+size_t ewah_read(ewah_bitmap *ewah, const unsigned char *data, size_t size);
+
+void ewah_release(ewah_bitmap *ewah);
+
+bool ewah_from_bitmap(ewah_bitmap *ewah, const bitmap *bitmap);
+
+size_t ewah_serialized_size(const ewah_bitmap *ewah);
+
+void ewah_serialize(const ewah_bitmap *ewah, unsigned char *out);
+
+// Combines the compressed bitmap into a plain one without inflating it:
+// clean runs become word fills, literal words go through the SIMD kernels
+bool bitmap_or_ewah(bitmap *dest, const ewah_bitmap *src);
+
+bool bitmap_xor_ewah(bitmap *dest, const ewah_bitmap *src);
+
+#endif //EWAH_H
@@ -0,0 +1,463 @@
+#include "fast_import.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "object_filter.h"
+#include "pack_writer.h"
+
+// Input is a stream of records, each optionally tagged with a mark that later
+// records can use in place of an oid:
+//
+//   blob                          tree                          commit
+//   mark :<n>                     mark :<n>                     mark :<n>
+//   data <size>                   <mode> <oid|:mark> <name>     tree <oid|:mark>
+//   <size raw bytes>              ...                           parent <oid|:mark>, one per parent
+//                                 <empty line>                  author <name> <<email>> <time> <tz>
+//                                                               committer <name> <<email>> <time> <tz>
+//                                                               data <size>
+//                                                               <size raw bytes of message>
+//
+// Every object is hashed in memory and appended once to a single new pack.
+
+typedef struct fast_import_state
+{
+    FILE *input;
+    char *line;
+    size_t line_capacity;
+
+    unsigned char (*marks)[SHA_DIGEST_LENGTH];
+    size_t marks_capacity;
+
+    pack_writer pack;
+    size_t records_count;
+} fast_import_state;
+
+typedef struct import_tree_entry
+{
+    char mode[8];
+    char *name;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} import_tree_entry;
+
+static bool read_line(fast_import_state *state)
+{
+    const ssize_t len = getline(&state->line, &state->line_capacity, state->input);
+
+    if (len <= 0) return false;
+
+    if (state->line[len - 1] == '\n') state->line[len - 1] = '\0';
+
+    return true;
+}
+
+static bool set_mark(fast_import_state *state, const size_t mark, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (mark >= state->marks_capacity)
+    {
+        size_t capacity = state->marks_capacity ? state->marks_capacity : 1024;
+        while (capacity <= mark) capacity *= 2;
+
+        unsigned char (*marks)[SHA_DIGEST_LENGTH] = realloc(state->marks, capacity * SHA_DIGEST_LENGTH);
+        validate(marks, "Failed to allocate memory.");
+
+        memset(marks[state->marks_capacity], 0, (capacity - state->marks_capacity) * SHA_DIGEST_LENGTH);
+        state->marks = marks;
+        state->marks_capacity = capacity;
+    }
+
+    memcpy(state->marks[mark], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool resolve_object_ref(const fast_import_state *state, const char *ref, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (ref[0] != ':')
+    {
+        return strlen(ref) >= SHA_HEX_LENGTH && hash_hex_to_bytes(hash, ref) != nullptr;
+    }
+
+    const size_t mark = strtoul(&ref[1], nullptr, 10);
+    validate(mark > 0 && mark < state->marks_capacity, "Unknown mark '%s'.", ref);
+
+    static const unsigned char null_hash[SHA_DIGEST_LENGTH] = { 0 };
+    validate(memcmp(state->marks[mark], null_hash, SHA_DIGEST_LENGTH) != 0, "Unknown mark '%s'.", ref);
+
+    memcpy(hash, state->marks[mark], SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Reads the optional "mark :<n>" line; leaves the next line in state->line
+static size_t read_mark(fast_import_state *state)
+{
+    if (!read_line(state)) return 0;
+
+    if (strncmp(state->line, "mark :", 6) != 0) return 0;
+
+    const size_t mark = strtoul(&state->line[6], nullptr, 10);
+
+    if (!read_line(state)) state->line[0] = '\0';
+
+    return mark;
+}
+
+static bool read_data(fast_import_state *state, buffer *data)
+{
+    data->data = nullptr;
+
+    validate(strncmp(state->line, "data ", 5) == 0, "Expected 'data <size>', got '%s'.", state->line);
+
+    data->size = strtoull(&state->line[5], nullptr, 10);
+    data->data = malloc(data->size + 1);
+    validate(data->data, "Failed to allocate memory.");
+
+    validate(fread(data->data, 1, data->size, state->input) == data->size, "Unexpected end of data.");
+    data->data[data->size] = '\0';
+
+    return true;
+
+error:
+    if (data->data) free(data->data);
+    data->data = nullptr;
+
+    return false;
+}
+
+static bool finish_record(fast_import_state *state, const size_t mark, const unsigned char hash[SHA_DIGEST_LENGTH], FILE *object_data)
+{
+    // Content the repository already has is not packed again
+    if (!has_object(hash))
+    {
+        validate(pack_writer_add_object(&state->pack, hash, object_data), "Failed to add object to pack.");
+    }
+
+    if (mark)
+    {
+        validate(set_mark(state, mark, hash), "Failed to set mark :%zu.", mark);
+    }
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, hash);
+    printf("%s\n", hash_hex);
+
+    state->records_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool import_blob(fast_import_state *state)
+{
+    buffer content = { nullptr, 0 };
+    FILE *blob_data = nullptr;
+
+    const size_t mark = read_mark(state);
+
+    validate(read_data(state, &content), "Failed to read blob data.");
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    validate(create_blob_from_buffer(&content, &blob_data, hash), "Failed to create a blob object.");
+    validate(finish_record(state, mark, hash, blob_data), "Failed to import blob.");
+
+    fclose(blob_data);
+    free(content.data);
+
+    return true;
+
+error:
+    if (blob_data) fclose(blob_data);
+    if (content.data) free(content.data);
+
+    return false;
+}
+
+// Git sorts tree entries by name, with directories compared as if they ended in '/'
+static int compare_import_tree_entries(const void *a, const void *b)
+{
+    const import_tree_entry *entry_a = a;
+    const import_tree_entry *entry_b = b;
+
+    const size_t len_a = strlen(entry_a->name);
+    const size_t len_b = strlen(entry_b->name);
+    const size_t min_len = len_a < len_b ? len_a : len_b;
+
+    const int cmp = memcmp(entry_a->name, entry_b->name, min_len);
+    if (cmp != 0) return cmp;
+
+    const unsigned char c_a = len_a > min_len ? entry_a->name[min_len] : strcmp(entry_a->mode, "40000") == 0 ? '/' : '\0';
+    const unsigned char c_b = len_b > min_len ? entry_b->name[min_len] : strcmp(entry_b->mode, "40000") == 0 ? '/' : '\0';
+
+    return c_a - c_b;
+}
+
+static bool parse_tree_entry(const fast_import_state *state, import_tree_entry *entry)
+{
+    char *line = state->line;
+
+    char *ref = strchr(line, ' ');
+    validate(ref, "Malformed tree entry '%s'.", line);
+    *ref++ = '\0';
+
+    char *name = strchr(ref, ' ');
+    validate(name, "Malformed tree entry '%s'.", line);
+    *name++ = '\0';
+
+    // Trees are stored with "40000", not the zero padded "040000"
+    while (line[0] == '0' && line[1] != '\0') line++;
+    validate(strlen(line) < sizeof(entry->mode), "Invalid mode '%s'.", line);
+    strcpy(entry->mode, line);
+
+    validate(resolve_object_ref(state, ref, entry->hash), "Invalid object reference '%s'.", ref);
+
+    entry->name = strdup(name);
+    validate(entry->name, "Failed to allocate memory.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool import_tree(fast_import_state *state)
+{
+    import_tree_entry *entries = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    buffer content = { nullptr, 0 };
+    FILE *content_stream = nullptr;
+    FILE *tree_data = nullptr;
+
+    const size_t mark = read_mark(state);
+
+    while (state->line[0] != '\0')
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            import_tree_entry *grown = realloc(entries, capacity * sizeof(import_tree_entry));
+            validate(grown, "Failed to allocate memory.");
+            entries = grown;
+        }
+
+        validate(parse_tree_entry(state, &entries[count]), "Failed to read tree entry.");
+        count++;
+
+        if (!read_line(state)) break;
+    }
+
+    qsort(entries, count, sizeof(import_tree_entry), compare_import_tree_entries);
+
+    content_stream = open_memstream(&content.data, &content.size);
+    validate(content_stream, "Failed to open memory stream.");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(content_stream, "%s %s", entries[i].mode, entries[i].name);
+        fputc('\0', content_stream);
+        fwrite(entries[i].hash, 1, SHA_DIGEST_LENGTH, content_stream);
+    }
+
+    fclose(content_stream);
+    content_stream = nullptr;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    validate(create_tree(&content, &tree_data, hash), "Failed to create a tree object.");
+    validate(finish_record(state, mark, hash, tree_data), "Failed to import tree.");
+
+    fclose(tree_data);
+    free(content.data);
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+
+    return true;
+
+error:
+    if (content_stream) fclose(content_stream);
+    if (tree_data) fclose(tree_data);
+    if (content.data) free(content.data);
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    if (entries) free(entries);
+
+    return false;
+}
+
+// "<name> <<email>> <time> <tz>"
+static bool parse_identity(const char *identity, char **name, char **email, char **date, char **timezone)
+{
+    const char *email_start = strchr(identity, '<');
+    const char *email_end = email_start ? strchr(email_start, '>') : nullptr;
+    validate(email_start && email_end, "Malformed identity '%s'.", identity);
+
+    size_t name_len = email_start - identity;
+    while (name_len > 0 && identity[name_len - 1] == ' ') name_len--;
+
+    char date_value[32];
+    char timezone_value[16];
+    validate(
+        sscanf(email_end + 1, " %31s %15s", date_value, timezone_value) == 2,
+        "Malformed identity date '%s'.", identity);
+
+    *name = strndup(identity, name_len);
+    *email = strndup(email_start + 1, email_end - email_start - 1);
+    *date = strdup(date_value);
+    *timezone = strdup(timezone_value);
+
+    return *name && *email && *date && *timezone;
+
+error:
+    return false;
+}
+
+static bool import_commit(fast_import_state *state)
+{
+    commit_info info;
+    init_commit_tree_info(&info);
+
+    buffer message = { nullptr, 0 };
+    FILE *commit_data = nullptr;
+
+    const size_t mark = read_mark(state);
+
+    while (strncmp(state->line, "data ", 5) != 0)
+    {
+        char *value = strchr(state->line, ' ');
+        validate(value, "Malformed commit header '%s'.", state->line);
+        *value++ = '\0';
+
+        if (strcmp(state->line, "tree") == 0)
+        {
+            validate(!info.tree_sha, "Duplicate 'tree' header.");
+
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(resolve_object_ref(state, value, hash), "Invalid object reference '%s'.", value);
+
+            info.tree_sha = malloc(SHA_HEX_LENGTH + 1);
+            validate(info.tree_sha, "Failed to allocate memory.");
+            hash_bytes_to_hex(info.tree_sha, hash);
+        }
+        else if (strcmp(state->line, "parent") == 0)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(resolve_object_ref(state, value, hash), "Invalid object reference '%s'.", value);
+
+            char parent_sha[SHA_HEX_LENGTH + 1];
+            hash_bytes_to_hex(parent_sha, hash);
+            validate(add_commit_parent(&info, parent_sha), "Failed to add parent.");
+        }
+        else if (strcmp(state->line, "author") == 0)
+        {
+            validate(!info.author_name, "Duplicate 'author' header.");
+            validate(
+                parse_identity(value, &info.author_name, &info.author_email, &info.author_date, &info.author_timezone),
+                "Failed to parse author.");
+        }
+        else if (strcmp(state->line, "committer") == 0)
+        {
+            validate(!info.committer_name, "Duplicate 'committer' header.");
+            validate(
+                parse_identity(value, &info.committer_name, &info.committer_email, &info.committer_date, &info.commiter_timezone),
+                "Failed to parse committer.");
+        }
+        else
+        {
+            validate(false, "Unknown commit header '%s'.", state->line);
+        }
+
+        validate(read_line(state), "Unexpected end of commit record.");
+    }
+
+    validate(info.tree_sha && info.author_name, "Commit record requires 'tree' and 'author'.");
+    validate(read_data(state, &message), "Failed to read commit message.");
+
+    // create_commit() terminates the message itself
+    if (message.size > 0 && message.data[message.size - 1] == '\n') message.data[--message.size] = '\0';
+    info.message = message.data;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    validate(create_commit(&info, &commit_data, hash), "Failed to create a commit object.");
+    validate(finish_record(state, mark, hash, commit_data), "Failed to import commit.");
+
+    fclose(commit_data);
+    destroy_commit_tree_info(&info);
+
+    return true;
+
+error:
+    if (commit_data) fclose(commit_data);
+    if (!info.message && message.data) free(message.data);
+    destroy_commit_tree_info(&info);
+
+    return false;
+}
+
+int fast_import(const int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    fast_import_state state = {
+        .input = stdin,
+        .line = nullptr,
+        .line_capacity = 0,
+        .marks = nullptr,
+        .marks_capacity = 0,
+        .records_count = 0,
+    };
+
+    validate(pack_writer_open(&state.pack), "Failed to create pack.");
+
+    while (read_line(&state))
+    {
+        if (state.line[0] == '\0') continue;
+
+        if (strcmp(state.line, "blob") == 0)
+        {
+            validate(import_blob(&state), "Failed to import blob record.");
+        }
+        else if (strcmp(state.line, "tree") == 0)
+        {
+            validate(import_tree(&state), "Failed to import tree record.");
+        }
+        else if (strcmp(state.line, "commit") == 0)
+        {
+            validate(import_commit(&state), "Failed to import commit record.");
+        }
+        else
+        {
+            validate(false, "Unknown record '%s'.", state.line);
+        }
+    }
+
+    const size_t objects_count = state.pack.count;
+
+    char pack_hash_hex[SHA_HEX_LENGTH + 1];
+    validate(pack_writer_finish(&state.pack, pack_hash_hex), "Failed to finish pack.");
+
+    fprintf(stderr, "Imported %zu records as %zu objects into pack-%s\n",
+        state.records_count, objects_count, pack_hash_hex);
+
+    if (state.line) free(state.line);
+    if (state.marks) free(state.marks);
+
+    return 0;
+
+error:
+    pack_writer_abort(&state.pack);
+    if (state.line) free(state.line);
+    if (state.marks) free(state.marks);
+
+    return 1;
+}
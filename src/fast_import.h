@@ -0,0 +1,6 @@
+#ifndef FAST_IMPORT_H
+#define FAST_IMPORT_H
+
+int fast_import(int argc, char *argv[]);
+
+#endif //FAST_IMPORT_H
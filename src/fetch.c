@@ -0,0 +1,1101 @@
+#include "fetch.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "list_objects.h"
+#include "object_filter.h"
+#include "odb_transaction.h"
+#include "oid_map.h"
+#include "pack_indexer.h"
+#include "pkt_line.h"
+#include "promisor.h"
+#include "refs.h"
+#include "shallow.h"
+#include "transport.h"
+
+// Haves go out in growing batches; after this many in total without the
+// server being ready, the client gives up negotiating and says "done"
+#define INITIAL_HAVES_BATCH 16
+#define MAX_HAVES_BATCH 256
+#define MAX_HAVES 1024
+
+char *upload_pack_opt = nullptr;
+char *filter_opt = nullptr;
+long depth_opt = 0;
+
+typedef struct remote_ref
+{
+    char *name;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} remote_ref;
+
+// "[+]<src>[:<dst>]"; a '*' in src matches any part of a ref name, and
+// stands for that same part in dst
+typedef struct refspec
+{
+    const char *src;
+    const char *dst;
+    bool is_force;
+    bool is_glob;
+} refspec;
+
+typedef struct ref_update
+{
+    const remote_ref *ref;
+    char *dst;
+    bool is_force;
+    bool is_for_merge;
+} ref_update;
+
+typedef struct fetch_state
+{
+    const char *url;
+    const char *upload_pack;
+    transport remote;
+
+    // Set when the repository was given by the name of a configured remote
+    const char *remote_name;
+    char remote_name_buffer[256];
+
+    // Packs from the promisor remote are marked, as the objects they leave
+    // out may be fetched from it later; lazy fetches name what they need
+    // and neither negotiate nor print progress
+    const char *filter;
+    bool is_promisor;
+    bool is_lazy;
+
+    // With a depth, history is cut that many commits below the wants; the
+    // server says which commits become, or stop being, shallow
+    long depth;
+    unsigned char (*shallow)[SHA_DIGEST_LENGTH];
+    size_t shallow_count;
+    unsigned char (*unshallow)[SHA_DIGEST_LENGTH];
+    size_t unshallow_count;
+
+    remote_ref *refs;
+    size_t ref_count;
+    size_t ref_capacity;
+
+    refspec *refspecs;
+    size_t refspec_count;
+
+    ref_update *updates;
+    size_t update_count;
+    size_t update_capacity;
+
+    unsigned char (*wants)[SHA_DIGEST_LENGTH];
+    size_t want_count;
+
+    // Local commits offered as haves, newest first
+    commit_queue haves;
+    oid_map offered;
+    unsigned char (*common)[SHA_DIGEST_LENGTH];
+    size_t common_count;
+} fetch_state;
+
+// The ways git expands a short ref name, in order of precedence
+static const char *ref_rules[] = {
+    "%s",
+    "refs/%s",
+    "refs/tags/%s",
+    "refs/heads/%s",
+    "refs/remotes/%s",
+    "refs/remotes/%s/HEAD",
+};
+
+static bool try_resolve_fetch_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "upload-pack", required_argument, nullptr, 'u' },
+        { "filter", required_argument, nullptr, 'f' },
+        { "depth", required_argument, nullptr, 'd' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                upload_pack_opt = optarg;
+                break;
+            case 'f':
+                filter_opt = optarg;
+                validate(strcmp(filter_opt, "blob:none") == 0, "Unsupported filter '%s', only blob:none is.", filter_opt);
+                break;
+            case 'd':
+            {
+                char *end;
+                depth_opt = strtol(optarg, &end, 10);
+                validate(*end == '\0' && depth_opt > 0, "Invalid depth '%s'.", optarg);
+                break;
+            }
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 2 <= argc, "Usage: fetch [--upload-pack=<command>] [--filter=blob:none] [--depth=<n>] <repository> [<refspec>...]");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool parse_refspec(char *arg, refspec *spec)
+{
+    *spec = (refspec){ };
+
+    if (*arg == '+')
+    {
+        spec->is_force = true;
+        arg++;
+    }
+
+    char *colon = strchr(arg, ':');
+    if (colon) *colon = '\0';
+
+    spec->src = arg;
+    spec->dst = colon && colon[1] ? &colon[1] : nullptr;
+    spec->is_glob = strchr(spec->src, '*') != nullptr;
+
+    validate(*spec->src, "Invalid refspec '%s'.", arg);
+    validate(!spec->is_glob || !spec->dst || strchr(spec->dst, '*'), "Invalid refspec '%s'.", arg);
+    validate(!spec->dst || strncmp(spec->dst, "refs/", 5) == 0, "Invalid destination '%s', it must start with refs/.", spec->dst);
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_fetch_state(fetch_state *state)
+{
+    for (size_t i = 0; i < state->ref_count; i++) free(state->refs[i].name);
+    if (state->refs) free(state->refs);
+
+    for (size_t i = 0; i < state->update_count; i++) free(state->updates[i].dst);
+    if (state->updates) free(state->updates);
+
+    if (state->refspecs) free(state->refspecs);
+    if (state->wants) free(state->wants);
+    if (state->common) free(state->common);
+    if (state->shallow) free(state->shallow);
+    if (state->unshallow) free(state->unshallow);
+
+    commit_queue_destroy(&state->haves);
+    oid_map_destroy(&state->offered);
+    transport_disconnect(&state->remote);
+}
+
+static bool add_hash(unsigned char (**hashes)[SHA_DIGEST_LENGTH], size_t *count, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    // Grown in powers of two
+    if ((*count & (*count - 1)) == 0)
+    {
+        unsigned char (*grown)[SHA_DIGEST_LENGTH] = realloc(*hashes, (*count ? *count * 2 : 16) * SHA_DIGEST_LENGTH);
+        validate(grown, "Failed to allocate memory.");
+        *hashes = grown;
+    }
+
+    memcpy((*hashes)[(*count)++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+static FILE *begin_request(char **request, size_t *request_size, const char *command)
+{
+    FILE *stream = open_memstream(request, request_size);
+    validate(stream, "Failed to open memory stream.");
+
+    validate(
+        write_pkt_linef(stream, "command=%s\n", command) &&
+        write_pkt_linef(stream, "agent=%s\n", GIT_AGENT) &&
+        write_pkt_linef(stream, "object-format=sha1\n") &&
+        write_pkt_delim(stream),
+        "Failed to write request.");
+
+    return stream;
+
+error:
+    if (stream) fclose(stream);
+
+    return nullptr;
+}
+
+// The stream is closed here, which is when request and request_size
+// become valid
+static bool send_request(fetch_state *state, FILE *stream, char **request, const size_t *request_size)
+{
+    const bool is_written = write_pkt_flush(stream);
+    fclose(stream);
+
+    validate(is_written, "Failed to write request.");
+    validate(transport_send_request(&state->remote, *request, *request_size), "Failed to send request.");
+
+    free(*request);
+    *request = nullptr;
+
+    return true;
+
+error:
+    free(*request);
+    *request = nullptr;
+
+    return false;
+}
+
+static bool add_ref_prefixes(FILE *stream, const refspec *spec)
+{
+    if (spec->is_glob) return write_pkt_linef(stream, "ref-prefix %.*s\n", (int)(strchr(spec->src, '*') - spec->src), spec->src);
+
+    for (size_t i = 0; i < sizeof(ref_rules) / sizeof(ref_rules[0]); i++)
+    {
+        char prefix[PATH_MAX];
+        (void)snprintf(prefix, sizeof(prefix), ref_rules[i], spec->src);
+
+        if (!write_pkt_linef(stream, "ref-prefix %s\n", prefix)) return false;
+    }
+
+    return true;
+}
+
+static bool add_remote_ref(fetch_state *state, const char *line)
+{
+    if (state->ref_count == state->ref_capacity)
+    {
+        const size_t capacity = state->ref_capacity ? state->ref_capacity * 2 : 64;
+
+        remote_ref *refs = realloc(state->refs, capacity * sizeof(remote_ref));
+        validate(refs, "Failed to allocate memory.");
+
+        state->refs = refs;
+        state->ref_capacity = capacity;
+    }
+
+    remote_ref *ref = &state->refs[state->ref_count];
+    validate(strlen(line) > SHA_HEX_LENGTH + 1 && line[SHA_HEX_LENGTH] == ' ', "Malformed ref line '%s'.", line);
+    validate(hash_hex_to_bytes(ref->hash, line), "Malformed ref line '%s'.", line);
+
+    // Attributes such as symref-target: and peeled: follow the name
+    const char *name = &line[SHA_HEX_LENGTH + 1];
+    ref->name = strndup(name, strcspn(name, " \n"));
+    validate(ref->name, "Failed to allocate memory.");
+
+    state->ref_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool list_remote_refs(fetch_state *state)
+{
+    char *request = nullptr;
+    size_t request_size = 0;
+
+    FILE *stream = begin_request(&request, &request_size, "ls-refs");
+    validate(stream, "Failed to start request.");
+
+    bool is_written = write_pkt_linef(stream, "symrefs\n") && write_pkt_linef(stream, "peel\n");
+
+    for (size_t i = 0; i < state->refspec_count; i++) is_written = is_written && add_ref_prefixes(stream, &state->refspecs[i]);
+
+    if (!is_written) fclose(stream);
+    validate(is_written, "Failed to write request.");
+    validate(send_request(state, stream, &request, &request_size), "Failed to list remote refs.");
+
+    while (true)
+    {
+        pkt_type type;
+        validate(read_pkt_line(&state->remote.reader, &type), "Failed to read remote refs.");
+
+        if (type == PKT_FLUSH) break;
+        validate(type == PKT_DATA, "Malformed ls-refs response.");
+
+        validate(add_remote_ref(state, state->remote.reader.line), "Failed to read remote ref.");
+    }
+
+    return true;
+
+error:
+    if (request) free(request);
+
+    return false;
+}
+
+static bool add_update(fetch_state *state, const remote_ref *ref, const char *dst, const size_t dst_len, const refspec *spec)
+{
+    if (state->update_count == state->update_capacity)
+    {
+        const size_t capacity = state->update_capacity ? state->update_capacity * 2 : 64;
+
+        ref_update *updates = realloc(state->updates, capacity * sizeof(ref_update));
+        validate(updates, "Failed to allocate memory.");
+
+        state->updates = updates;
+        state->update_capacity = capacity;
+    }
+
+    ref_update *update = &state->updates[state->update_count];
+    *update = (ref_update){ .ref = ref, .is_force = spec->is_force, .is_for_merge = !spec->is_glob };
+
+    if (dst)
+    {
+        update->dst = strndup(dst, dst_len);
+        validate(update->dst, "Failed to allocate memory.");
+        validate(check_refname_format(update->dst), "Invalid ref name '%s'.", update->dst);
+    }
+
+    state->update_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static const remote_ref *find_remote_ref(const fetch_state *state, const char *name)
+{
+    for (size_t i = 0; i < state->ref_count; i++)
+    {
+        if (strcmp(state->refs[i].name, name) == 0) return &state->refs[i];
+    }
+
+    return nullptr;
+}
+
+static bool match_glob_refspec(fetch_state *state, const refspec *spec)
+{
+    const char *star = strchr(spec->src, '*');
+    const size_t prefix_len = star - spec->src;
+    const size_t suffix_len = strlen(&star[1]);
+
+    for (size_t i = 0; i < state->ref_count; i++)
+    {
+        const remote_ref *ref = &state->refs[i];
+        const size_t name_len = strlen(ref->name);
+
+        if (name_len < prefix_len + suffix_len) continue;
+        if (strncmp(ref->name, spec->src, prefix_len) != 0) continue;
+        if (strcmp(&ref->name[name_len - suffix_len], &star[1]) != 0) continue;
+
+        if (!spec->dst)
+        {
+            validate(add_update(state, ref, nullptr, 0, spec), "Failed to add update.");
+            continue;
+        }
+
+        // The part the '*' matched goes in place of the '*' in dst
+        const char *dst_star = strchr(spec->dst, '*');
+        char dst[PATH_MAX];
+        const int len = snprintf(
+            dst, sizeof(dst), "%.*s%.*s%s",
+            (int)(dst_star - spec->dst), spec->dst,
+            (int)(name_len - prefix_len - suffix_len), &ref->name[prefix_len],
+            &dst_star[1]);
+
+        validate(len > 0 && len < (int)sizeof(dst), "Ref name too long.");
+        validate(add_update(state, ref, dst, len, spec), "Failed to add update.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool match_refspecs(fetch_state *state)
+{
+    for (size_t i = 0; i < state->refspec_count; i++)
+    {
+        const refspec *spec = &state->refspecs[i];
+
+        if (spec->is_glob)
+        {
+            validate(match_glob_refspec(state, spec), "Failed to match '%s'.", spec->src);
+            continue;
+        }
+
+        const remote_ref *ref = nullptr;
+
+        for (size_t r = 0; r < sizeof(ref_rules) / sizeof(ref_rules[0]) && !ref; r++)
+        {
+            char name[PATH_MAX];
+            (void)snprintf(name, sizeof(name), ref_rules[r], spec->src);
+
+            ref = find_remote_ref(state, name);
+        }
+
+        validate(ref, "Couldn't find remote ref %s.", spec->src);
+        validate(add_update(state, ref, spec->dst, spec->dst ? strlen(spec->dst) : 0, spec), "Failed to add update.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool collect_wants(fetch_state *state)
+{
+    oid_map wanted;
+    validate(oid_map_init(&wanted, 64), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state->update_count; i++)
+    {
+        const unsigned char *hash = state->updates[i].ref->hash;
+        if (oid_map_contains(&wanted, hash)) continue;
+
+        // Deepening asks again for tips this side already has
+        if (has_object(hash) && !state->depth) continue;
+
+        if (!oid_map_put(&wanted, hash, 0) || !add_hash(&state->wants, &state->want_count, hash))
+        {
+            oid_map_destroy(&wanted);
+            validate(false, "Failed to add want.");
+        }
+    }
+
+    oid_map_destroy(&wanted);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool offer_commit(fetch_state *state, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (oid_map_contains(&state->offered, hash)) return true;
+
+    validate(oid_map_put(&state->offered, hash, 0), "Failed to mark commit.");
+
+    commit *commit = lookup_commit(hash);
+    validate(commit && parse_commit(commit), "Failed to parse commit.");
+    validate(commit_queue_put(&state->haves, commit), "Failed to queue commit.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Local ref tips are where haves start; refs that do not name a commit
+// have nothing to offer
+static bool add_have_tip(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    (void)refname;
+
+    unsigned char target[SHA_DIGEST_LENGTH];
+    const unsigned char *current = hash;
+    while (peel_tag(current, target)) current = target;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, current);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    char *content = nullptr;
+    (void)get_object_content(hex, &content);
+    if (!content) return true;
+
+    char type[16];
+    get_object_type(type, content);
+    free(content);
+
+    if (strcmp(type, "commit") != 0) return true;
+
+    return offer_commit(data, current);
+}
+
+static bool prepare_haves(fetch_state *state)
+{
+    commit_queue_init(&state->haves);
+    validate(oid_map_init(&state->offered, 1024), "Failed to allocate memory.");
+
+    if (state->is_lazy) return true;
+
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+    if (resolve_ref("HEAD", nullptr, head_hash)) validate(add_have_tip("HEAD", head_hash, state), "Failed to add HEAD.");
+
+    validate(for_each_ref(add_have_tip, state), "Failed to list local refs.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_hash_line(FILE *stream, const char *prefix, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    return write_pkt_linef(stream, "%s %s\n", prefix, hex);
+}
+
+// Each request repeats the wants and what is known to be in common, as
+// the server keeps no state between requests
+static bool send_fetch_request(fetch_state *state, const size_t batch, size_t *sent_count, bool *is_done)
+{
+    char *request = nullptr;
+    size_t request_size = 0;
+
+    FILE *stream = begin_request(&request, &request_size, "fetch");
+    validate(stream, "Failed to start request.");
+
+    bool is_written = write_pkt_linef(stream, "ofs-delta\n");
+
+    if (state->is_lazy) is_written = is_written && write_pkt_linef(stream, "no-progress\n");
+    if (state->filter) is_written = is_written && write_pkt_linef(stream, "filter %s\n", state->filter);
+
+    for (size_t i = 0; i < state->want_count; i++) is_written = is_written && write_hash_line(stream, "want", state->wants[i]);
+    for (size_t i = 0; i < state->common_count; i++) is_written = is_written && write_hash_line(stream, "have", state->common[i]);
+
+    size_t shallow_count;
+    const unsigned char (*shallow)[SHA_DIGEST_LENGTH] = get_shallow_commits(&shallow_count);
+    for (size_t i = 0; i < shallow_count; i++) is_written = is_written && write_hash_line(stream, "shallow", shallow[i]);
+
+    if (state->depth) is_written = is_written && write_pkt_linef(stream, "deepen %ld\n", state->depth);
+
+    for (size_t i = 0; i < batch && state->haves.count && is_written; i++)
+    {
+        const commit *commit = commit_queue_get(&state->haves);
+        is_written = write_hash_line(stream, "have", commit->hash);
+        (*sent_count)++;
+
+        for (uint32_t p = 0; p < commit->parent_count && is_written; p++)
+        {
+            is_written = offer_commit(state, commit->parents[p]->hash);
+        }
+    }
+
+    *is_done = state->haves.count == 0 || *sent_count >= MAX_HAVES;
+    if (*is_done) is_written = is_written && write_pkt_linef(stream, "done\n");
+
+    if (!is_written) fclose(stream);
+    validate(is_written, "Failed to write request.");
+
+    return send_request(state, stream, &request, &request_size);
+
+error:
+    if (request) free(request);
+
+    return false;
+}
+
+// Returns with is_ready set when the packfile section follows
+static bool read_acknowledgments(fetch_state *state, bool *is_ready)
+{
+    pkt_reader *reader = &state->remote.reader;
+    *is_ready = false;
+
+    while (true)
+    {
+        pkt_type type;
+        validate(read_pkt_line(reader, &type), "Failed to read acknowledgments.");
+
+        if (type == PKT_FLUSH) return true;
+
+        if (type == PKT_DELIM)
+        {
+            validate(*is_ready, "Unexpected section after acknowledgments.");
+            return true;
+        }
+
+        validate(type == PKT_DATA, "Malformed acknowledgments.");
+
+        if (strncmp(reader->line, "ACK ", 4) == 0)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(hash_hex_to_bytes(hash, &reader->line[4]), "Malformed ACK '%s'.", reader->line);
+            validate(add_hash(&state->common, &state->common_count, hash), "Failed to record common commit.");
+        }
+        else if (strcmp(reader->line, "ready\n") == 0)
+        {
+            *is_ready = true;
+        }
+        else
+        {
+            validate(strcmp(reader->line, "NAK\n") == 0, "Unexpected acknowledgment '%s'.", reader->line);
+        }
+    }
+
+error:
+    return false;
+}
+
+// Progress lines may be split across packets, or several may share one;
+// each line gets the "remote: " prefix once, and '\r' keeps redrawing it
+static void print_progress(const unsigned char *data, const size_t size)
+{
+    static bool is_line_start = true;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (is_line_start) (void)fputs("remote: ", stderr);
+
+        (void)fputc(data[i], stderr);
+        is_line_start = data[i] == '\n' || data[i] == '\r';
+    }
+}
+
+// "shallow <oid>" and "unshallow <oid>" lines up to the delimiter
+static bool read_shallow_info(fetch_state *state)
+{
+    pkt_reader *reader = &state->remote.reader;
+
+    while (true)
+    {
+        pkt_type type;
+        validate(read_pkt_line(reader, &type), "Failed to read shallow info.");
+
+        if (type == PKT_DELIM) return true;
+        validate(type == PKT_DATA, "Malformed shallow info.");
+
+        unsigned char hash[SHA_DIGEST_LENGTH];
+
+        if (strncmp(reader->line, "shallow ", 8) == 0)
+        {
+            validate(hash_hex_to_bytes(hash, &reader->line[8]), "Malformed shallow line '%s'.", reader->line);
+            validate(add_hash(&state->shallow, &state->shallow_count, hash), "Failed to record shallow commit.");
+        }
+        else
+        {
+            validate(strncmp(reader->line, "unshallow ", 10) == 0, "Unexpected shallow info '%s'.", reader->line);
+            validate(hash_hex_to_bytes(hash, &reader->line[10]), "Malformed unshallow line '%s'.", reader->line);
+            validate(add_hash(&state->unshallow, &state->unshallow_count, hash), "Failed to record unshallow commit.");
+        }
+    }
+
+error:
+    return false;
+}
+
+// Pack data is indexed as each packet arrives, progress goes to stderr
+static bool receive_pack(fetch_state *state, pack_indexer *indexer)
+{
+    pkt_reader *reader = &state->remote.reader;
+
+    while (true)
+    {
+        pkt_type type;
+        validate(read_pkt_line(reader, &type), "Failed to read the pack.");
+
+        if (type == PKT_FLUSH || type == PKT_RESPONSE_END) return true;
+        validate(type == PKT_DATA && reader->line_len > 0, "The pack stream ended early.");
+
+        const unsigned char *data = (unsigned char *)&reader->line[1];
+        const size_t size = reader->line_len - 1;
+
+        switch (reader->line[0])
+        {
+            case SIDEBAND_PACK_DATA:
+                validate(pack_indexer_feed(indexer, data, size), "Failed to index the pack.");
+                break;
+            case SIDEBAND_PROGRESS:
+                print_progress(data, size);
+                break;
+            case SIDEBAND_ERROR:
+                validate(false, "remote error: %.*s", (int)size, data);
+            default:
+                validate(false, "Unknown side-band channel %d.", reader->line[0]);
+        }
+    }
+
+error:
+    return false;
+}
+
+// An empty pack-<hash>.promisor next to the pack says its objects came
+// from the promisor remote
+static bool write_promisor_marker(const char *pack_hash_hex)
+{
+    char rel_path[PATH_MAX];
+    char path[PATH_MAX];
+    (void)snprintf(rel_path, sizeof(rel_path), "objects/pack/pack-%s.promisor", pack_hash_hex);
+    validate(get_git_path(path, PATH_MAX, rel_path), "Not a git repository.");
+
+    return replace_file_atomically(path, (const unsigned char *)"", 0);
+
+error:
+    return false;
+}
+
+static bool fetch_pack(fetch_state *state)
+{
+    pack_indexer indexer = { };
+
+    validate(prepare_haves(state), "Failed to prepare haves.");
+
+    size_t batch = INITIAL_HAVES_BATCH;
+    size_t sent_count = 0;
+
+    while (true)
+    {
+        bool is_done;
+        validate(send_fetch_request(state, batch, &sent_count, &is_done), "Failed to send fetch request.");
+
+        validate(read_pkt_data(&state->remote.reader), "Failed to read fetch response.");
+        const char *section = state->remote.reader.line;
+
+        if (strcmp(section, "acknowledgments\n") == 0)
+        {
+            bool is_ready;
+            validate(read_acknowledgments(state, &is_ready), "Failed to read acknowledgments.");
+
+            if (!is_ready)
+            {
+                validate(!is_done, "The server sent no pack.");
+
+                if (batch < MAX_HAVES_BATCH) batch *= 2;
+                continue;
+            }
+
+            validate(read_pkt_data(&state->remote.reader), "Failed to read fetch response.");
+        }
+
+        if (strcmp(section, "shallow-info\n") == 0)
+        {
+            validate(read_shallow_info(state), "Failed to read shallow info.");
+            validate(read_pkt_data(&state->remote.reader), "Failed to read fetch response.");
+        }
+
+        validate(strcmp(section, "packfile\n") == 0, "Unexpected section '%s'.", section);
+        break;
+    }
+
+    char pack_hash_hex[SHA_HEX_LENGTH + 1];
+    validate(pack_indexer_open(&indexer), "Failed to start the pack.");
+    validate(receive_pack(state, &indexer), "Failed to receive the pack.");
+    validate(pack_indexer_finish(&indexer, pack_hash_hex), "Failed to index the pack.");
+
+    if (state->is_promisor) validate(write_promisor_marker(pack_hash_hex), "Failed to mark the pack.");
+
+    // Only once the pack is in place, so the boundary never names commits
+    // this side does not have
+    if (state->shallow_count || state->unshallow_count)
+    {
+        validate(update_shallow_file(state->shallow, state->shallow_count, state->unshallow, state->unshallow_count), "Failed to update the shallow file.");
+    }
+
+    return true;
+
+error:
+    pack_indexer_abort(&indexer);
+
+    return false;
+}
+
+static const char *shorten_ref_name(const char *refname)
+{
+    static const char *prefixes[] = { "refs/heads/", "refs/tags/", "refs/remotes/", "refs/" };
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+    {
+        const size_t prefix_len = strlen(prefixes[i]);
+        if (strncmp(refname, prefixes[i], prefix_len) == 0) return &refname[prefix_len];
+    }
+
+    return refname;
+}
+
+static bool is_fast_forward(const unsigned char old_hash[SHA_DIGEST_LENGTH], const unsigned char new_hash[SHA_DIGEST_LENGTH])
+{
+    commit *old_commit = lookup_commit(old_hash);
+    commit *new_commit = lookup_commit(new_hash);
+    if (!old_commit || !new_commit || !parse_commit(old_commit) || !parse_commit(new_commit)) return false;
+
+    commit_list bases;
+    commit_list_init(&bases);
+
+    bool result = false;
+    if (get_merge_bases(new_commit, 1, &old_commit, &bases))
+    {
+        for (size_t i = 0; i < bases.count; i++) result = result || bases.items[i] == old_commit;
+    }
+
+    commit_list_destroy(&bases);
+
+    return result;
+}
+
+static void print_update(const char flag, const char *summary, const ref_update *update, const char *note)
+{
+    (void)fprintf(
+        stderr, " %c %-17s %-10s -> %s%s\n",
+        flag, summary, shorten_ref_name(update->ref->name), shorten_ref_name(update->dst), note);
+}
+
+// Tags are never moved without force; other refs only fast-forward
+static bool update_local_ref(const ref_update *update, bool *is_rejected)
+{
+    char old_hex[SHA_HEX_LENGTH + 1];
+    char new_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(new_hex, update->ref->hash);
+    new_hex[SHA_HEX_LENGTH] = '\0';
+
+    unsigned char old_hash[SHA_DIGEST_LENGTH];
+    if (!resolve_ref(update->dst, nullptr, old_hash))
+    {
+        validate(set_ref(update->dst, update->ref->hash, (unsigned char[SHA_DIGEST_LENGTH]){ }, false), "Failed to create '%s'.", update->dst);
+
+        const char *kind = strncmp(update->ref->name, "refs/tags/", 10) == 0 ? "[new tag]"
+            : strncmp(update->ref->name, "refs/heads/", 11) == 0 ? "[new branch]"
+            : "[new ref]";
+        print_update('*', kind, update, "");
+
+        return true;
+    }
+
+    if (memcmp(old_hash, update->ref->hash, SHA_DIGEST_LENGTH) == 0) return true;
+
+    hash_bytes_to_hex(old_hex, old_hash);
+    char summary[32];
+
+    const bool is_tag = strncmp(update->dst, "refs/tags/", 10) == 0;
+    const bool is_ff = !is_tag && is_fast_forward(old_hash, update->ref->hash);
+
+    if (!is_ff && !update->is_force)
+    {
+        print_update('!', "[rejected]", update, is_tag ? "  (would clobber existing tag)" : "  (non-fast-forward)");
+        *is_rejected = true;
+
+        return true;
+    }
+
+    validate(set_ref(update->dst, update->ref->hash, old_hash, false), "Failed to update '%s'.", update->dst);
+
+    (void)snprintf(summary, sizeof(summary), "%.7s%s%.7s", old_hex, is_ff ? ".." : "...", new_hex);
+    print_update(is_ff ? ' ' : '+', summary, update, is_ff ? "" : "  (forced update)");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_fetch_head(const fetch_state *state)
+{
+    char *content = nullptr;
+    size_t content_size = 0;
+
+    FILE *stream = open_memstream(&content, &content_size);
+    validate(stream, "Failed to open memory stream.");
+
+    for (size_t i = 0; i < state->update_count; i++)
+    {
+        const ref_update *update = &state->updates[i];
+        const char *name = update->ref->name;
+
+        char hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hex, update->ref->hash);
+        hex[SHA_HEX_LENGTH] = '\0';
+
+        fprintf(stream, "%s\t%s\t", hex, update->is_for_merge ? "" : "not-for-merge");
+
+        if (strcmp(name, "HEAD") == 0)
+            fprintf(stream, "%s\n", state->url);
+        else if (strncmp(name, "refs/heads/", 11) == 0)
+            fprintf(stream, "branch '%s' of %s\n", &name[11], state->url);
+        else if (strncmp(name, "refs/tags/", 10) == 0)
+            fprintf(stream, "tag '%s' of %s\n", &name[10], state->url);
+        else
+            fprintf(stream, "'%s' of %s\n", name, state->url);
+    }
+
+    fclose(stream);
+
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, "FETCH_HEAD"), "Not a git repository.");
+    validate(replace_file_atomically(path, (unsigned char *)content, content_size), "Failed to write '%s'.", path);
+
+    free(content);
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
+
+// A repository given by name is looked up as remote.<name>.url, along
+// with the upload-pack it is reached through
+static bool resolve_remote(fetch_state *state, const char *repository)
+{
+    state->url = repository;
+    state->upload_pack = upload_pack_opt;
+
+    char key[512];
+    (void)snprintf(key, sizeof(key), "remote.%s.url", repository);
+    const char *url = strchr(repository, '/') ? nullptr : get_config_value(key);
+
+    if (url)
+    {
+        (void)snprintf(state->remote_name_buffer, sizeof(state->remote_name_buffer), "%s", repository);
+        state->remote_name = state->remote_name_buffer;
+        state->url = url;
+
+        (void)snprintf(key, sizeof(key), "remote.%s.uploadpack", repository);
+        if (!state->upload_pack) state->upload_pack = get_config_value(key);
+    }
+
+    // Later fetches from the promisor remote keep to the filter it was
+    // first fetched with
+    const char *promisor_remote = get_promisor_remote();
+    state->is_promisor = filter_opt || (state->remote_name && promisor_remote && strcmp(state->remote_name, promisor_remote) == 0);
+    state->filter = filter_opt;
+
+    if (state->is_promisor && !state->filter)
+    {
+        (void)snprintf(key, sizeof(key), "remote.%s.partialclonefilter", state->remote_name);
+        state->filter = get_config_value(key);
+    }
+
+    if (filter_opt && !state->remote_name)
+    {
+        // A partial clone needs a remote to go back to; a URL becomes
+        // "origin", as in a clone
+        const char *origin_url = get_config_value("remote.origin.url");
+        validate(!origin_url || strcmp(origin_url, repository) == 0, "remote 'origin' has a different URL, fetch by remote name to filter.");
+
+        state->remote_name = "origin";
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool set_remote_config(const char *remote_name, const char *name, const char *value)
+{
+    char key[512];
+    (void)snprintf(key, sizeof(key), "remote.%s.%s", remote_name, name);
+
+    const char *current = get_config_value(key);
+    if (current && strcmp(current, value) == 0) return true;
+
+    return set_config_value(key, value);
+}
+
+// Records the remote as the one that promises the objects the filter left
+// out. Repository format 1 makes git honor the extension too.
+static bool record_promisor_remote(const fetch_state *state)
+{
+    validate(set_remote_config(state->remote_name, "url", state->url), "Failed to update config.");
+    if (state->upload_pack) validate(set_remote_config(state->remote_name, "uploadpack", state->upload_pack), "Failed to update config.");
+    validate(set_remote_config(state->remote_name, "promisor", "true"), "Failed to update config.");
+    validate(set_remote_config(state->remote_name, "partialclonefilter", state->filter), "Failed to update config.");
+
+    validate(set_config_value("core.repositoryformatversion", "1"), "Failed to update config.");
+    validate(set_config_value("extensions.partialClone", state->remote_name), "Failed to update config.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool fetch_missing_objects(const char *remote_name, const unsigned char (*hashes)[SHA_DIGEST_LENGTH], const size_t count)
+{
+    fetch_state state = { .is_promisor = true, .is_lazy = true };
+
+    validate(resolve_remote(&state, remote_name) && state.remote_name, "No URL for promisor remote '%s'.", remote_name);
+    validate(transport_connect(&state.remote, state.url, state.upload_pack), "Failed to connect to '%s'.", state.url);
+
+    for (size_t i = 0; i < count; i++) validate(add_hash(&state.wants, &state.want_count, hashes[i]), "Failed to add want.");
+
+    // What a lazy fetch names it wants whole, whatever the remote's filter
+    state.filter = nullptr;
+    validate(fetch_pack(&state), "Failed to fetch from '%s'.", state.url);
+
+    release_fetch_state(&state);
+
+    return true;
+
+error:
+    release_fetch_state(&state);
+
+    return false;
+}
+
+// fetch [--upload-pack=<command>] [--filter=blob:none] [--depth=<n>] <repository> [<refspec>...]
+// Talks protocol v2 to the repository's upload-pack, over smart HTTP or a
+// local process: lists the refs the refspecs ask for, negotiates what is
+// already here, and indexes the pack as it streams in. Without refspecs
+// only the remote HEAD is fetched, into FETCH_HEAD. <repository> may also
+// name a configured remote. With --filter=blob:none blobs are left out,
+// to be fetched on first access from the remote, which is recorded as the
+// promisor remote. With --depth=<n> history is cut n commits below the
+// fetched tips, recorded in .git/shallow; fetching again with a greater
+// depth deepens it.
+int fetch(const int argc, char *argv[])
+{
+    fetch_state state = { };
+    bool is_rejected = false;
+
+    validate(try_resolve_fetch_opts(argc, argv), "Failed to resolve options.");
+
+    validate(resolve_remote(&state, argv[optind + 1]), "Failed to resolve the repository.");
+    state.depth = depth_opt;
+
+    static char head_arg[] = "HEAD";
+    char *default_refspecs[] = { head_arg };
+    char **specs = optind + 2 < argc ? &argv[optind + 2] : default_refspecs;
+    state.refspec_count = optind + 2 < argc ? argc - optind - 2 : 1;
+
+    state.refspecs = calloc(state.refspec_count, sizeof(refspec));
+    validate(state.refspecs, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state.refspec_count; i++) validate(parse_refspec(specs[i], &state.refspecs[i]), "Invalid refspec.");
+
+    validate(transport_connect(&state.remote, state.url, state.upload_pack), "Failed to connect to '%s'.", state.url);
+    validate(!state.filter || transport_has_capability(&state.remote, "fetch", "filter"), "The server does not support filters.");
+    validate(!state.depth || transport_has_capability(&state.remote, "fetch", "shallow"), "The server does not support shallow fetches.");
+    validate(list_remote_refs(&state), "Failed to list remote refs.");
+    validate(match_refspecs(&state), "Failed to match refspecs.");
+    validate(collect_wants(&state), "Failed to collect wants.");
+
+    if (state.want_count) validate(fetch_pack(&state), "Failed to fetch from '%s'.", state.url);
+    if (filter_opt) validate(record_promisor_remote(&state), "Failed to record the promisor remote.");
+
+    (void)fprintf(stderr, "From %s\n", state.url);
+
+    for (size_t i = 0; i < state.update_count; i++)
+    {
+        if (state.updates[i].dst) validate(update_local_ref(&state.updates[i], &is_rejected), "Failed to update refs.");
+    }
+
+    validate(write_fetch_head(&state), "Failed to write FETCH_HEAD.");
+
+    release_fetch_state(&state);
+
+    return is_rejected ? 1 : 0;
+
+error:
+    release_fetch_state(&state);
+
+    return 1;
+}
@@ -0,0 +1,13 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+int fetch(int argc, char *argv[]);
+
+// Fetches the named objects from a configured remote in one request,
+// without negotiating; used to fill in a partial clone
+bool fetch_missing_objects(const char *remote_name, const unsigned char (*hashes)[SHA_DIGEST_LENGTH], size_t count);
+
+#endif //FETCH_H
@@ -0,0 +1,831 @@
+#include "fsck.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "index_file.h"
+#include "object_filter.h"
+#include "oid_map.h"
+#include "pack_indexer.h"
+#include "packfile.h"
+#include "refs.h"
+#include "shallow.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "tree_walk.h"
+
+#define MAX_TYPE_NAME_LENGTH 16
+
+bool connectivity_only_opt = false;
+long fsck_threads_opt = 0;
+
+// An object the walk reaches, with the type the object naming it expects,
+// OBJ_NONE for a root. A promised object may be missing: a partial clone
+// is never sent what the objects from its promisor remote name.
+typedef struct fsck_link
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    object_type type;
+    unsigned char from[SHA_DIGEST_LENGTH];
+    object_type from_type;
+    bool is_promised;
+} fsck_link;
+
+typedef struct link_list
+{
+    fsck_link *items;
+    size_t count;
+    size_t capacity;
+} link_list;
+
+typedef struct fsck_state
+{
+    unsigned workers;
+    atomic_bool has_errors;
+
+    unsigned char (*loose)[SHA_DIGEST_LENGTH];
+    size_t loose_count;
+    size_t loose_capacity;
+
+    packed_git **promisor_packs;
+    size_t promisor_pack_count;
+
+    // The walk goes one level at a time: workers read the objects of the
+    // frontier, each listing what its object names in found, and what was
+    // not seen before makes the next frontier
+    oid_map seen;
+    link_list frontier;
+    link_list *found;
+    link_list next;
+} fsck_state;
+
+static bool try_resolve_fsck_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "connectivity-only", no_argument, nullptr, 'c' },
+        { "threads", required_argument, nullptr, 't' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                connectivity_only_opt = true;
+                break;
+            case 't':
+                fsck_threads_opt = strtol(optarg, nullptr, 10);
+                validate(fsck_threads_opt > 0, "Invalid thread count '%s'.", optarg);
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 1 == argc, "Usage: fsck [--connectivity-only] [--threads=<n>]");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Each report is a single write, so lines from workers do not interleave
+static void report(fsck_state *state, FILE *stream, const bool is_error, const char *format, ...)
+{
+    char message[1024];
+
+    va_list args;
+    va_start(args, format);
+    (void)vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    (void)fprintf(stream, "%s\n", message);
+
+    if (is_error) atomic_store(&state->has_errors, true);
+}
+
+static void report_object(fsck_state *state, const bool is_error, const object_type type, const unsigned char hash[SHA_DIGEST_LENGTH], const char *problem)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    report(state, stderr, is_error, "%s in %s %s: %s", is_error ? "error" : "warning", object_type_name(type), hex, problem);
+}
+
+static void report_link(fsck_state *state, const fsck_link *link, const object_type actual_type)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, link->hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    const char *type_name = object_type_name(link->type == OBJ_NONE ? actual_type : link->type);
+
+    if (link->from_type == OBJ_NONE)
+    {
+        report(state, stdout, true, actual_type == OBJ_NONE ? "missing %s %s" : "bad type of %s %s", type_name, hex);
+        return;
+    }
+
+    char from_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(from_hex, link->from);
+    from_hex[SHA_HEX_LENGTH] = '\0';
+
+    if (actual_type == OBJ_NONE) report(state, stdout, true, "missing %s %s", type_name, hex);
+
+    report(state, stdout, true, "broken link from %s %s to %s %s", object_type_name(link->from_type), from_hex, type_name, hex);
+}
+
+static bool add_link(
+    link_list *list,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const object_type type,
+    const unsigned char *from,
+    const object_type from_type,
+    const bool is_promised)
+{
+    if (list->count == list->capacity)
+    {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 16;
+
+        fsck_link *items = realloc(list->items, capacity * sizeof(fsck_link));
+        validate(items, "Failed to allocate memory.");
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    fsck_link *link = &list->items[list->count++];
+    *link = (fsck_link){ .type = type, .from_type = from_type, .is_promised = is_promised };
+
+    memcpy(link->hash, hash, SHA_DIGEST_LENGTH);
+    if (from) memcpy(link->from, from, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_link_list(link_list *list)
+{
+    if (list->items) free(list->items);
+
+    *list = (link_list){ };
+}
+
+static bool is_promisor_object(const fsck_state *state, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (!state->promisor_pack_count) return false;
+
+    packed_git *pack;
+    uint64_t offset;
+    if (!find_pack_entry(hash, &pack, &offset)) return false;
+
+    for (size_t i = 0; i < state->promisor_pack_count; i++)
+    {
+        if (state->promisor_packs[i] == pack) return true;
+    }
+
+    return false;
+}
+
+// "<type> <size>\0", bounded by the content, which may be corrupt
+static bool parse_object_header(const char *content, const size_t content_size, object_type *type, size_t *header_size)
+{
+    const char *header_end = memchr(content, '\0', content_size);
+    if (!header_end) return false;
+
+    const char *space = memchr(content, ' ', header_end - content);
+    if (!space || space - content >= MAX_TYPE_NAME_LENGTH) return false;
+
+    char type_name[MAX_TYPE_NAME_LENGTH];
+    memcpy(type_name, content, space - content);
+    type_name[space - content] = '\0';
+
+    *type = object_type_from_name(type_name);
+    *header_size = header_end - content + 1;
+
+    char *size_end;
+    const unsigned long long size = strtoull(&space[1], &size_end, 10);
+
+    return *type != OBJ_NONE && size_end == header_end && isdigit((unsigned char)space[1]) && size == content_size - *header_size;
+}
+
+// "<key> <hex>\n"
+static bool parse_hash_line(const char **pos, const char *end, const char *key, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    const char *line = *pos;
+    const size_t key_len = strlen(key);
+
+    if ((size_t)(end - line) < key_len + SHA_HEX_LENGTH + 2) return false;
+    if (memcmp(line, key, key_len) != 0 || line[key_len] != ' ' || line[key_len + 1 + SHA_HEX_LENGTH] != '\n') return false;
+    if (!hash_hex_to_bytes(hash, &line[key_len + 1])) return false;
+
+    *pos = &line[key_len + SHA_HEX_LENGTH + 2];
+
+    return true;
+}
+
+// "<key> <name> <<email>> <seconds> <+|-><hhmm>\n", as create_commit()
+// writes it
+static bool parse_ident_line(const char **pos, const char *end, const char *key)
+{
+    const char *line = *pos;
+    const size_t key_len = strlen(key);
+
+    const char *line_end = memchr(line, '\n', end - line);
+    if (!line_end || (size_t)(line_end - line) <= key_len || memcmp(line, key, key_len) != 0 || line[key_len] != ' ') return false;
+
+    const char *name = &line[key_len + 1];
+    const char *email = memchr(name, '<', line_end - name);
+    if (!email || email == name || email[-1] != ' ') return false;
+
+    const char *email_end = memchr(&email[1], '>', line_end - &email[1]);
+    if (!email_end || memchr(&email[1], '<', email_end - &email[1])) return false;
+
+    const char *p = &email_end[1];
+    if (line_end - p < 2 || *p++ != ' ' || !isdigit((unsigned char)*p)) return false;
+    while (p < line_end && isdigit((unsigned char)*p)) p++;
+
+    if (line_end - p != 6 || p[0] != ' ' || (p[1] != '+' && p[1] != '-')) return false;
+
+    for (int i = 2; i < 6; i++)
+    {
+        if (!isdigit((unsigned char)p[i])) return false;
+    }
+
+    *pos = &line_end[1];
+
+    return true;
+}
+
+static bool is_known_tree_mode(const unsigned mode)
+{
+    return mode == TREE_MODE_DIR || mode == TREE_MODE_FILE || mode == TREE_MODE_EXECUTABLE ||
+           mode == TREE_MODE_SYMLINK || mode == TREE_MODE_GITLINK;
+}
+
+// Each kind of problem is reported once per tree, however many entries
+// have it
+typedef struct tree_problems
+{
+    bool is_malformed;
+    bool has_malformed_mode;
+    bool has_zero_padded_mode;
+    bool has_bad_mode;
+    bool has_empty_name;
+    bool has_full_path;
+    bool has_dot;
+    bool has_dot_git;
+    bool has_duplicates;
+    bool is_unsorted;
+} tree_problems;
+
+static void check_tree_entry(tree_problems *problems, const git_tree_node *node, const unsigned mode, const char *mode_end)
+{
+    if (!node->mode[0] || *mode_end) problems->has_malformed_mode = true;
+    else if (node->mode[0] == '0') problems->has_zero_padded_mode = true;
+    else if (!is_known_tree_mode(mode)) problems->has_bad_mode = true;
+
+    if (!node->name[0]) problems->has_empty_name = true;
+    else if (strchr(node->name, '/')) problems->has_full_path = true;
+    else if (strcmp(node->name, ".") == 0 || strcmp(node->name, "..") == 0) problems->has_dot = true;
+    else if (strcasecmp(node->name, ".git") == 0) problems->has_dot_git = true;
+}
+
+static void report_tree_problems(fsck_state *state, const unsigned char hash[SHA_DIGEST_LENGTH], const tree_problems *problems)
+{
+    if (problems->is_malformed) report_object(state, true, OBJ_TREE, hash, "malformed entry");
+    if (problems->has_malformed_mode) report_object(state, true, OBJ_TREE, hash, "malformed file mode");
+    if (problems->has_duplicates) report_object(state, true, OBJ_TREE, hash, "contains duplicate file entries");
+    if (problems->is_unsorted) report_object(state, true, OBJ_TREE, hash, "not properly sorted");
+    if (problems->has_zero_padded_mode) report_object(state, false, OBJ_TREE, hash, "contains zero-padded file modes");
+    if (problems->has_bad_mode) report_object(state, false, OBJ_TREE, hash, "contains bad file modes");
+    if (problems->has_empty_name) report_object(state, false, OBJ_TREE, hash, "contains empty pathname");
+    if (problems->has_full_path) report_object(state, false, OBJ_TREE, hash, "contains full pathnames");
+    if (problems->has_dot) report_object(state, false, OBJ_TREE, hash, "contains '.' or '..'");
+    if (problems->has_dot_git) report_object(state, false, OBJ_TREE, hash, "contains '.git'");
+}
+
+// Entries out of order or named twice make a tree unreadable by name, and
+// are errors. Modes other than the five git writes, and names that cannot
+// be checked out, are only warned about, as git does.
+static bool check_tree(fsck_state *state, const unsigned char hash[SHA_DIGEST_LENGTH], const char *data, const size_t size, link_list *links)
+{
+    git_tree_node nodes[2] = { };
+    git_tree_node *node = &nodes[0];
+    const git_tree_node *previous = nullptr;
+    bool is_previous_dir = false;
+
+    tree_problems problems = { };
+    const bool is_promised = is_promisor_object(state, hash);
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        clear_git_tree_node(node);
+
+        const size_t next_pos = try_set_node(node, data, size, pos);
+        if (!next_pos)
+        {
+            problems.is_malformed = true;
+            break;
+        }
+
+        pos = next_pos;
+
+        char *mode_end;
+        const unsigned mode = (unsigned)strtoul(node->mode, &mode_end, 8);
+        const bool is_dir = is_tree_mode(mode);
+
+        check_tree_entry(&problems, node, mode, mode_end);
+
+        if (previous)
+        {
+            if (strcmp(previous->name, node->name) == 0) problems.has_duplicates = true;
+            else if (compare_tree_entry_names(previous->name, is_previous_dir, node->name, is_dir) > 0) problems.is_unsorted = true;
+        }
+
+        if (mode != TREE_MODE_GITLINK)
+        {
+            validate(add_link(links, node->hash, is_dir ? OBJ_TREE : OBJ_BLOB, hash, OBJ_TREE, is_promised), "Failed to list tree entry.");
+        }
+
+        previous = node;
+        is_previous_dir = is_dir;
+        node = node == &nodes[0] ? &nodes[1] : &nodes[0];
+    }
+
+    report_tree_problems(state, hash, &problems);
+
+    clear_git_tree_node(&nodes[0]);
+    clear_git_tree_node(&nodes[1]);
+
+    return true;
+
+error:
+    clear_git_tree_node(&nodes[0]);
+    clear_git_tree_node(&nodes[1]);
+
+    return false;
+}
+
+// The header create_commit() writes: tree, parents, author and committer,
+// in that order; other headers may follow before the message
+static bool check_commit(fsck_state *state, const unsigned char hash[SHA_DIGEST_LENGTH], const char *data, const size_t size, link_list *links)
+{
+    const char *pos = data;
+    const char *end = &data[size];
+    const bool is_promised = is_promisor_object(state, hash);
+
+    unsigned char link_hash[SHA_DIGEST_LENGTH];
+
+    if (!parse_hash_line(&pos, end, "tree", link_hash))
+    {
+        report_object(state, true, OBJ_COMMIT, hash, "invalid tree line");
+        return true;
+    }
+
+    validate(add_link(links, link_hash, OBJ_TREE, hash, OBJ_COMMIT, is_promised), "Failed to list commit tree.");
+
+    // A shallow commit's parents were never fetched
+    const bool is_shallow = is_shallow_commit(hash);
+
+    while (parse_hash_line(&pos, end, "parent", link_hash))
+    {
+        if (is_shallow) continue;
+
+        validate(add_link(links, link_hash, OBJ_COMMIT, hash, OBJ_COMMIT, is_promised), "Failed to list commit parent.");
+    }
+
+    if (!parse_ident_line(&pos, end, "author")) report_object(state, true, OBJ_COMMIT, hash, "invalid author line");
+    else if (!parse_ident_line(&pos, end, "committer")) report_object(state, true, OBJ_COMMIT, hash, "invalid committer line");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool check_tag(fsck_state *state, const unsigned char hash[SHA_DIGEST_LENGTH], const char *data, const size_t size, link_list *links)
+{
+    const char *pos = data;
+    const char *end = &data[size];
+
+    unsigned char target[SHA_DIGEST_LENGTH];
+
+    if (!parse_hash_line(&pos, end, "object", target))
+    {
+        report_object(state, true, OBJ_TAG, hash, "invalid object line");
+        return true;
+    }
+
+    const char *line_end = memchr(pos, '\n', end - pos);
+    const size_t type_len = line_end ? (size_t)(line_end - pos) : 0;
+
+    char type_name[MAX_TYPE_NAME_LENGTH] = { };
+    if (type_len > 5 && type_len - 5 < MAX_TYPE_NAME_LENGTH && strncmp(pos, "type ", 5) == 0) memcpy(type_name, &pos[5], type_len - 5);
+
+    const object_type target_type = object_type_from_name(type_name);
+    if (target_type == OBJ_NONE)
+    {
+        report_object(state, true, OBJ_TAG, hash, "invalid type line");
+        return true;
+    }
+
+    validate(add_link(links, target, target_type, hash, OBJ_TAG, is_promisor_object(state, hash)), "Failed to list tag target.");
+
+    pos = &line_end[1];
+    line_end = memchr(pos, '\n', end - pos);
+
+    if (!line_end || line_end - pos <= 4 || strncmp(pos, "tag ", 4) != 0)
+    {
+        report_object(state, true, OBJ_TAG, hash, "invalid tag line");
+        return true;
+    }
+
+    pos = &line_end[1];
+
+    // Old tags have no tagger
+    if (end - pos > 7 && strncmp(pos, "tagger ", 7) == 0 && !parse_ident_line(&pos, end, "tagger"))
+    {
+        report_object(state, true, OBJ_TAG, hash, "invalid tagger line");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool check_object(
+    fsck_state *state,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const object_type type,
+    const char *data,
+    const size_t size,
+    link_list *links)
+{
+    switch (type)
+    {
+        case OBJ_TREE:
+            return check_tree(state, hash, data, size, links);
+        case OBJ_COMMIT:
+            return check_commit(state, hash, data, size, links);
+        case OBJ_TAG:
+            return check_tag(state, hash, data, size, links);
+        default:
+            return true;
+    }
+}
+
+static bool add_loose_object(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path, void *data)
+{
+    (void)path;
+    fsck_state *state = data;
+
+    if (state->loose_count == state->loose_capacity)
+    {
+        const size_t capacity = state->loose_capacity ? state->loose_capacity * 2 : 256;
+
+        unsigned char (*loose)[SHA_DIGEST_LENGTH] = realloc(state->loose, capacity * SHA_DIGEST_LENGTH);
+        validate(loose, "Failed to allocate memory.");
+
+        state->loose = loose;
+        state->loose_capacity = capacity;
+    }
+
+    memcpy(state->loose[state->loose_count++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+// The whole inflated object, header included, hashes to its name
+static void check_loose_task(void *ctx, const size_t index)
+{
+    fsck_state *state = ctx;
+    const unsigned char *hash = state->loose[index];
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    char *content = nullptr;
+    const size_t content_size = get_object_content(hex, &content);
+
+    if (!content)
+    {
+        report(state, stderr, true, "error: unable to read loose object %s", hex);
+        return;
+    }
+
+    unsigned char actual_hash[SHA_DIGEST_LENGTH];
+    trace_timer_start(TRACE_TIMER_HASH);
+    SHA1((const unsigned char *)content, content_size, actual_hash);
+    trace_timer_stop(TRACE_TIMER_HASH);
+
+    object_type type;
+    size_t header_size;
+
+    if (memcmp(actual_hash, hash, SHA_DIGEST_LENGTH) != 0) report(state, stderr, true, "error: hash mismatch for loose object %s", hex);
+    else if (!parse_object_header(content, content_size, &type, &header_size)) report(state, stderr, true, "error: malformed header in loose object %s", hex);
+
+    free(content);
+}
+
+static bool check_loose_objects(fsck_state *state)
+{
+    validate(for_each_loose_object(add_loose_object, state), "Failed to list loose objects.");
+
+    run_parallel(state->loose_count, state->workers, check_loose_task, state);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Packs are checked one at a time, each with all the workers on its deltas
+static void check_packs(fsck_state *state)
+{
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        if (!pack_indexer_verify_pack(pack, state->workers)) report(state, stderr, true, "error: '%s' is corrupt", pack->pack_path);
+    }
+}
+
+// What a .promisor file marks came from a promisor remote, whichever way
+// the partial clone is configured
+static bool collect_promisor_packs(fsck_state *state)
+{
+    size_t count = 0;
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next) count++;
+
+    state->promisor_packs = malloc((count ? count : 1) * sizeof(packed_git *));
+    validate(state->promisor_packs, "Failed to allocate memory.");
+
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        const size_t stem_len = strlen(pack->pack_path) - strlen(".pack");
+
+        char path[PATH_MAX + 16];
+        (void)snprintf(path, sizeof(path), "%.*s.promisor", (int)stem_len, pack->pack_path);
+
+        if (access(path, F_OK) == 0) state->promisor_packs[state->promisor_pack_count++] = pack;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_root(fsck_state *state, const char *name, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, const bool is_promised)
+{
+    if (oid_map_contains(&state->seen, hash)) return true;
+
+    if (!has_object(hash))
+    {
+        char hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hex, hash);
+        hex[SHA_HEX_LENGTH] = '\0';
+
+        if (!is_promised) report(state, stderr, true, "error: %s: invalid sha1 pointer %s", name, hex);
+
+        return true;
+    }
+
+    validate(oid_map_put(&state->seen, hash, 0), "Failed to allocate memory.");
+    validate(add_link(&state->frontier, hash, type, nullptr, OBJ_NONE, false), "Failed to add root.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_ref_root(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    return add_root(data, refname, hash, OBJ_NONE, false);
+}
+
+// Staged content is reachable too, though no commit has it yet. A partial
+// clone may lack blobs of entries outside a sparse checkout.
+static bool collect_roots(fsck_state *state)
+{
+    index_state index = { };
+
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+    if (resolve_ref("HEAD", nullptr, head_hash)) validate(add_ref_root("HEAD", head_hash, state), "Failed to add HEAD.");
+
+    validate(for_each_ref(add_ref_root, state), "Failed to read refs.");
+    validate(read_index(&index), "Failed to read the index.");
+
+    for (size_t i = 0; i < index.count; i++)
+    {
+        const index_entry *entry = &index.entries[i];
+        if ((entry->mode & 0170000) == TREE_MODE_GITLINK) continue;
+
+        char name[PATH_MAX + 16];
+        (void)snprintf(name, sizeof(name), "index entry '%s'", entry->path);
+
+        const object_type type = is_tree_mode(entry->mode) ? OBJ_TREE : OBJ_BLOB;
+        validate(add_root(state, name, entry->hash, type, state->promisor_pack_count > 0), "Failed to add index entry.");
+    }
+
+    release_index(&index);
+
+    return true;
+
+error:
+    release_index(&index);
+
+    return false;
+}
+
+// Blobs are only checked to be blobs; their content, when it is checked at
+// all, was hashed with every other object before the walk
+static void visit_object(fsck_state *state, const fsck_link *link, link_list *found)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, link->hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    if (!has_object(link->hash))
+    {
+        if (!link->is_promised) report_link(state, link, OBJ_NONE);
+        return;
+    }
+
+    if (link->type == OBJ_BLOB)
+    {
+        object_type type;
+        size_t size;
+
+        if (!get_object_info(link->hash, &type, &size)) report(state, stderr, true, "error: unable to read blob %s", hex);
+        else if (type != OBJ_BLOB) report_link(state, link, type);
+
+        return;
+    }
+
+    char *content = nullptr;
+    const size_t content_size = get_object_content(hex, &content);
+
+    if (!content)
+    {
+        report(state, stderr, true, "error: unable to read object %s", hex);
+        return;
+    }
+
+    object_type type;
+    size_t header_size;
+
+    if (!parse_object_header(content, content_size, &type, &header_size))
+    {
+        report(state, stderr, true, "error: malformed header in object %s", hex);
+    }
+    else if (link->type != OBJ_NONE && type != link->type)
+    {
+        report_link(state, link, type);
+    }
+    else if (!check_object(state, link->hash, type, &content[header_size], content_size - header_size, found))
+    {
+        report(state, stderr, true, "error: failed to check object %s", hex);
+    }
+
+    free(content);
+}
+
+static void visit_task(void *ctx, const size_t index)
+{
+    fsck_state *state = ctx;
+
+    visit_object(state, &state->frontier.items[index], &state->found[index]);
+}
+
+static void release_found(fsck_state *state)
+{
+    if (!state->found) return;
+
+    for (size_t i = 0; i < state->frontier.count; i++) release_link_list(&state->found[i]);
+
+    free(state->found);
+    state->found = nullptr;
+}
+
+static bool check_connectivity(fsck_state *state)
+{
+    validate(oid_map_init(&state->seen, 1024), "Failed to allocate memory.");
+    validate(collect_roots(state), "Failed to collect roots.");
+
+    // Loaded up front, as the workers only read them
+    (void)is_shallow_repository();
+    prepare_packed_git_for_threads();
+
+    while (state->frontier.count)
+    {
+        state->found = calloc(state->frontier.count, sizeof(link_list));
+        validate(state->found, "Failed to allocate memory.");
+
+        run_parallel(state->frontier.count, state->workers, visit_task, state);
+
+        for (size_t i = 0; i < state->frontier.count; i++)
+        {
+            const link_list *found = &state->found[i];
+
+            for (size_t k = 0; k < found->count; k++)
+            {
+                const fsck_link *link = &found->items[k];
+                if (oid_map_contains(&state->seen, link->hash)) continue;
+
+                validate(oid_map_put(&state->seen, link->hash, 0), "Failed to allocate memory.");
+                validate(
+                    add_link(&state->next, link->hash, link->type, link->from, link->from_type, link->is_promised),
+                    "Failed to list object.");
+            }
+        }
+
+        release_found(state);
+        release_link_list(&state->frontier);
+
+        state->frontier = state->next;
+        state->next = (link_list){ };
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_fsck_state(fsck_state *state)
+{
+    release_found(state);
+    release_link_list(&state->frontier);
+    release_link_list(&state->next);
+    oid_map_destroy(&state->seen);
+
+    if (state->loose) free(state->loose);
+    if (state->promisor_packs) free(state->promisor_packs);
+}
+
+// fsck [--connectivity-only] [--threads=<n>]
+// Checks the object store. Every loose object is hashed again and checked
+// against its name, and every pack is indexed again in memory and checked
+// against its .idx, with its deltas resolved by the workers. Then all
+// that HEAD, refs and the index reach is walked, one level at a time
+// across the workers: each object has to be there, with the type it is
+// named as, and trees, commits and tags have to be well formed.
+// --connectivity-only does the walk alone, never reading blob content.
+// Missing objects and broken links go to stdout, other problems to
+// stderr; any error makes the exit code 1.
+int fsck(const int argc, char *argv[])
+{
+    fsck_state state = { };
+    atomic_init(&state.has_errors, false);
+
+    validate(try_resolve_fsck_opts(argc, argv), "Failed to resolve options.");
+
+    state.workers = fsck_threads_opt ? (unsigned)fsck_threads_opt : get_worker_count(nullptr);
+
+    validate(collect_promisor_packs(&state), "Failed to list promisor packs.");
+    prepare_packed_git_for_threads();
+
+    if (!connectivity_only_opt)
+    {
+        check_packs(&state);
+        validate(check_loose_objects(&state), "Failed to check loose objects.");
+    }
+
+    validate(check_connectivity(&state), "Failed to check connectivity.");
+
+    const bool has_errors = atomic_load(&state.has_errors);
+    release_fsck_state(&state);
+
+    return has_errors ? 1 : 0;
+
+error:
+    release_fsck_state(&state);
+
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+int fsck(int argc, char *argv[]);
+
+#endif //FSCK_H
@@ -0,0 +1,467 @@
+#include "fsmonitor.h"
+
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+
+#define FSMONITOR_HOOK_VERSION "2"
+#define COOKIE_WAIT_STEP_US 1000
+#define COOKIE_WAIT_MAX_US 1000000
+
+typedef struct fsmonitor_paths
+{
+    char **items;
+    size_t count;
+    size_t capacity;
+} fsmonitor_paths;
+
+bool is_fsmonitor_enabled(void)
+{
+    const char *value = get_config_value("core.fsmonitor");
+
+    return value && *value && strcmp(value, "false") != 0;
+}
+
+static bool is_builtin_fsmonitor(void)
+{
+    return get_config_bool("core.fsmonitor", false);
+}
+
+static bool add_path(fsmonitor_paths *paths, const char *path, const size_t path_len)
+{
+    if (paths->count == paths->capacity)
+    {
+        const size_t capacity = paths->capacity ? paths->capacity * 2 : 64;
+        char **items = realloc(paths->items, capacity * sizeof(char *));
+        validate(items, "Failed to allocate memory.");
+
+        paths->items = items;
+        paths->capacity = capacity;
+    }
+
+    paths->items[paths->count] = strndup(path, path_len);
+    validate(paths->items[paths->count], "Failed to allocate memory.");
+    paths->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Marks the changed path and every directory above it as dirty
+static bool add_dirty_path(fsmonitor_paths *dirty, const char *path, size_t path_len)
+{
+    while (path_len > 0 && path[path_len - 1] == '/') path_len--;
+
+    validate(add_path(dirty, path, path_len), "Failed to record changed path.");
+
+    while (path_len > 0)
+    {
+        while (path_len > 0 && path[path_len - 1] != '/') path_len--;
+        if (path_len > 0) path_len--;
+
+        validate(add_path(dirty, path, path_len), "Failed to record changed path.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void finalize_dirty_dirs(fsmonitor_changes *changes, fsmonitor_paths *dirty)
+{
+    qsort(dirty->items, dirty->count, sizeof(char *), compare_paths);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < dirty->count; i++)
+    {
+        if (unique > 0 && strcmp(dirty->items[unique - 1], dirty->items[i]) == 0)
+        {
+            free(dirty->items[i]);
+            continue;
+        }
+
+        dirty->items[unique++] = dirty->items[i];
+    }
+
+    changes->dirty_dirs = dirty->items;
+    changes->dirty_dirs_count = unique;
+}
+
+static char *read_fd_to_end(const int fd, size_t *size)
+{
+    buffer output = { nullptr, 0 };
+    FILE *output_stream = open_memstream(&output.data, &output.size);
+    validate(output_stream, "Failed to open memory stream.");
+
+    char chunk[BUFSIZ];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        fwrite(chunk, 1, n, output_stream);
+    }
+
+    fclose(output_stream);
+    *size = output.size;
+
+    return output.data;
+
+error:
+    return nullptr;
+}
+
+// Hook protocol version 2: '<hook> 2 <token>' prints the new token followed by
+// the changed paths, all NUL-terminated. A "/" path means "everything".
+static bool query_fsmonitor_hook(const char *hook, const char *since_token, fsmonitor_changes *changes)
+{
+    char *output = nullptr;
+    fsmonitor_paths dirty = { nullptr, 0, 0 };
+
+    int pipe_fds[2];
+    validate(pipe(pipe_fds) == 0, "Failed to create pipe for fsmonitor hook.");
+
+    const pid_t pid = fork();
+    validate(pid != -1, "Failed to start fsmonitor hook.");
+
+    if (pid == 0)
+    {
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[1]);
+
+        if (chdir(get_repository_root()) == 0)
+        {
+            execl(hook, hook, FSMONITOR_HOOK_VERSION, since_token ? since_token : "", (char *)nullptr);
+        }
+
+        _exit(127);
+    }
+
+    close(pipe_fds[1]);
+
+    size_t output_size;
+    output = read_fd_to_end(pipe_fds[0], &output_size);
+    close(pipe_fds[0]);
+
+    int status;
+    validate(waitpid(pid, &status, 0) == pid, "Failed to wait for fsmonitor hook.");
+    validate(WIFEXITED(status) && WEXITSTATUS(status) == 0, "fsmonitor hook '%s' failed.", hook);
+    validate(output && memchr(output, '\0', output_size), "fsmonitor hook returned no token.");
+
+    changes->token = strdup(output);
+    validate(changes->token, "Failed to allocate memory.");
+
+    // Without a previous token the hook cannot know what changed
+    changes->is_complete = since_token && *since_token;
+
+    size_t pos = strlen(output) + 1;
+    while (pos < output_size)
+    {
+        const char *path = &output[pos];
+        const size_t path_len = strnlen(path, output_size - pos);
+
+        if (path_len == 1 && path[0] == '/')
+        {
+            changes->is_complete = false;
+        }
+        else if (path_len > 0)
+        {
+            validate(add_dirty_path(&dirty, path, path_len), "Failed to read fsmonitor hook output.");
+        }
+
+        pos += path_len + 1;
+    }
+
+    finalize_dirty_dirs(changes, &dirty);
+    free(output);
+
+    return true;
+
+error:
+    if (output) free(output);
+    for (size_t i = 0; i < dirty.count; i++) free(dirty.items[i]);
+    if (dirty.items) free(dirty.items);
+
+    return false;
+}
+
+static bool is_daemon_running(void)
+{
+    char pid_path[PATH_MAX];
+    if (!get_git_path(pid_path, PATH_MAX, FSMONITOR_DAEMON_PID)) return false;
+
+    FILE *pid_file = fopen(pid_path, "r");
+    if (!pid_file) return false;
+
+    long pid = 0;
+    const int read_count = fscanf(pid_file, "%ld", &pid);
+    fclose(pid_file);
+
+    return read_count == 1 && pid > 0 && kill((pid_t)pid, 0) == 0;
+}
+
+// Reads the journal starting at 'offset'; the returned size excludes the offset
+static char *read_journal(const off_t offset, size_t *size)
+{
+    char journal_path[PATH_MAX];
+    if (!get_git_path(journal_path, PATH_MAX, FSMONITOR_DAEMON_JOURNAL)) return nullptr;
+
+    const int fd = open(journal_path, O_RDONLY);
+    if (fd == -1) return nullptr;
+
+    char *journal = nullptr;
+
+    if (lseek(fd, offset, SEEK_SET) == offset)
+    {
+        journal = read_fd_to_end(fd, size);
+    }
+
+    close(fd);
+
+    return journal;
+}
+
+static off_t get_journal_size(void)
+{
+    char journal_path[PATH_MAX];
+    if (!get_git_path(journal_path, PATH_MAX, FSMONITOR_DAEMON_JOURNAL)) return 0;
+
+    struct stat fs;
+    return stat(journal_path, &fs) == 0 ? fs.st_size : 0;
+}
+
+// Whether the journal holds line, newline included, as one of its lines
+static bool has_journal_line(const char *journal, const size_t journal_size, const char *line, const size_t line_len)
+{
+    size_t pos = 0;
+
+    while (pos + line_len <= journal_size)
+    {
+        if (memcmp(&journal[pos], line, line_len) == 0) return true;
+
+        const char *eol = memchr(&journal[pos], '\n', journal_size - pos);
+        if (!eol) break;
+
+        pos = (size_t)(eol - journal) + 1;
+    }
+
+    return false;
+}
+
+// Events are delivered to the daemon asynchronously. Creating a cookie file and
+// waiting until the daemon journals it guarantees that every change made before
+// this query is already in the journal.
+static bool sync_with_daemon(void)
+{
+    static unsigned cookie_counter = 0;
+
+    char cookie_name[64];
+    (void)snprintf(cookie_name, sizeof(cookie_name), "%d-%u", getpid(), cookie_counter++);
+
+    char cookie_rel_path[PATH_MAX];
+    (void)snprintf(cookie_rel_path, PATH_MAX, "%s/%s", FSMONITOR_DAEMON_COOKIES, cookie_name);
+
+    char cookie_path[PATH_MAX];
+    validate(get_git_path(cookie_path, PATH_MAX, cookie_rel_path), "Failed to resolve cookie path.");
+
+    char journal_line[PATH_MAX];
+    const int line_len = snprintf(journal_line, PATH_MAX, ".git/%s\n", cookie_rel_path);
+    validate(line_len < PATH_MAX, "Path too long '%s'.", cookie_rel_path);
+
+    // The cookie line can only show up after the current end of the journal
+    const off_t journal_start = get_journal_size();
+
+    const int fd = open(cookie_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    validate(fd != -1, "Failed to create fsmonitor cookie '%s'.", cookie_path);
+    close(fd);
+
+    bool is_synced = false;
+
+    for (long waited = 0; waited < COOKIE_WAIT_MAX_US && !is_synced; waited += COOKIE_WAIT_STEP_US)
+    {
+        size_t journal_size;
+        char *journal = read_journal(journal_start, &journal_size);
+
+        is_synced = journal && has_journal_line(journal, journal_size, journal_line, (size_t)line_len);
+
+        if (journal) free(journal);
+        if (!is_synced) usleep(COOKIE_WAIT_STEP_US);
+    }
+
+    unlink(cookie_path);
+
+    return is_synced;
+
+error:
+    return false;
+}
+
+static bool read_journal_instance(char *instance, const size_t instance_size)
+{
+    char journal_path[PATH_MAX];
+    if (!get_git_path(journal_path, PATH_MAX, FSMONITOR_DAEMON_JOURNAL)) return false;
+
+    FILE *journal_file = fopen(journal_path, "r");
+    if (!journal_file) return false;
+
+    const bool result = fgets(instance, (int)instance_size, journal_file) && strchr(instance, '\n');
+    fclose(journal_file);
+
+    if (result) instance[strcspn(instance, "\n")] = '\0';
+
+    return result;
+}
+
+// Builtin tokens look like "builtin:<journal instance>:<journal offset>"
+static bool query_fsmonitor_daemon(const char *since_token, fsmonitor_changes *changes)
+{
+    char *journal = nullptr;
+    fsmonitor_paths dirty = { nullptr, 0, 0 };
+
+    // No daemon is an expected state, the caller falls back to a full scan
+    if (!is_daemon_running()) goto error;
+
+    validate(sync_with_daemon(), "Failed to synchronize with fsmonitor daemon.");
+
+    char instance[64];
+    validate(read_journal_instance(instance, sizeof(instance)), "Malformed fsmonitor journal.");
+
+    const size_t prefix_len = strlen(FSMONITOR_TOKEN_PREFIX);
+    const size_t instance_len = strlen(instance);
+    size_t since_offset = instance_len + 1;
+
+    changes->is_complete = false;
+
+    if (since_token
+        && strncmp(since_token, FSMONITOR_TOKEN_PREFIX, prefix_len) == 0
+        && strncmp(&since_token[prefix_len], instance, instance_len) == 0
+        && since_token[prefix_len + instance_len] == ':')
+    {
+        char *end;
+        since_offset = strtoul(&since_token[prefix_len + instance_len + 1], &end, 10);
+        changes->is_complete = *end == '\0' && since_offset > instance_len;
+    }
+
+    size_t journal_size = 0;
+    journal = read_journal((off_t)since_offset, &journal_size);
+
+    // The journal was rotated (and restarted) since the token was handed out
+    if (!journal || (journal_size == 0 && (off_t)since_offset > get_journal_size()))
+    {
+        changes->is_complete = false;
+        since_offset = instance_len + 1;
+        if (journal) free(journal);
+        journal = read_journal((off_t)since_offset, &journal_size);
+        validate(journal, "Failed to read fsmonitor journal.");
+    }
+
+    // Only complete lines are consumed, the daemon may be appending right now
+    size_t journal_end = journal_size;
+    while (journal_end > 0 && journal[journal_end - 1] != '\n') journal_end--;
+
+    char token[128];
+    (void)snprintf(token, sizeof(token), "%s%s:%zu", FSMONITOR_TOKEN_PREFIX, instance, since_offset + journal_end);
+    changes->token = strdup(token);
+    validate(changes->token, "Failed to allocate memory.");
+
+    size_t pos = 0;
+    while (changes->is_complete && pos < journal_end)
+    {
+        const char *path = &journal[pos];
+        const size_t path_len = (const char *)memchr(path, '\n', journal_end - pos) - path;
+
+        if (path_len == 1 && path[0] == '/')
+        {
+            changes->is_complete = false;
+        }
+        else if (strncmp(path, ".git/", 5) != 0)
+        {
+            validate(add_dirty_path(&dirty, path, path_len), "Failed to read fsmonitor journal.");
+        }
+
+        pos += path_len + 1;
+    }
+
+    finalize_dirty_dirs(changes, &dirty);
+    free(journal);
+
+    return true;
+
+error:
+    if (journal) free(journal);
+    for (size_t i = 0; i < dirty.count; i++) free(dirty.items[i]);
+    if (dirty.items) free(dirty.items);
+
+    return false;
+}
+
+bool query_fsmonitor(const char *since_token, fsmonitor_changes *changes)
+{
+    changes->token = nullptr;
+    changes->is_complete = false;
+    changes->dirty_dirs = nullptr;
+    changes->dirty_dirs_count = 0;
+
+    if (is_builtin_fsmonitor())
+    {
+        return query_fsmonitor_daemon(since_token, changes);
+    }
+
+    const char *hook = get_config_value("core.fsmonitor");
+    validate(hook, "core.fsmonitor is not configured.");
+
+    char hook_path[PATH_MAX];
+    if (hook[0] == '/')
+    {
+        (void)snprintf(hook_path, PATH_MAX, "%s", hook);
+    }
+    else
+    {
+        (void)snprintf(hook_path, PATH_MAX, "%s/%s", get_repository_root(), hook);
+    }
+
+    return query_fsmonitor_hook(hook_path, since_token, changes);
+
+error:
+    return false;
+}
+
+bool is_dir_unchanged(const fsmonitor_changes *changes, const char *rel_path)
+{
+    if (!changes->is_complete) return false;
+
+    return bsearch(&rel_path, changes->dirty_dirs, changes->dirty_dirs_count, sizeof(char *), compare_paths) == nullptr;
+}
+
+void destroy_fsmonitor_changes(fsmonitor_changes *changes)
+{
+    if (changes->token) free(changes->token);
+
+    for (size_t i = 0; i < changes->dirty_dirs_count; i++)
+    {
+        free(changes->dirty_dirs[i]);
+    }
+
+    if (changes->dirty_dirs) free(changes->dirty_dirs);
+
+    changes->token = nullptr;
+    changes->dirty_dirs = nullptr;
+    changes->dirty_dirs_count = 0;
+}
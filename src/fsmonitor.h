@@ -0,0 +1,33 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+#include <stddef.h>
+
+#define FSMONITOR_DAEMON_JOURNAL "fsmonitor--daemon.journal"
+#define FSMONITOR_DAEMON_PID "fsmonitor--daemon.pid"
+#define FSMONITOR_DAEMON_COOKIES "fsmonitor--daemon.cookies"
+#define FSMONITOR_TOKEN_PREFIX "builtin:"
+
+// Answer to "what changed since token X". When is_complete is false the
+// monitor could not vouch for anything (first query, daemon restart, event
+// queue overflow...) and every directory has to be treated as changed.
+typedef struct fsmonitor_changes
+{
+    char *token;
+    bool is_complete;
+
+    // Sorted directories (relative to the repository root, "" being the root)
+    // that contain, or are themselves, a changed path.
+    char **dirty_dirs;
+    size_t dirty_dirs_count;
+} fsmonitor_changes;
+
+bool is_fsmonitor_enabled(void);
+
+bool query_fsmonitor(const char *since_token, fsmonitor_changes *changes);
+
+bool is_dir_unchanged(const fsmonitor_changes *changes, const char *rel_path);
+
+void destroy_fsmonitor_changes(fsmonitor_changes *changes);
+
+#endif //FSMONITOR_H
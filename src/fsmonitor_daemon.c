@@ -0,0 +1,414 @@
+#include "fsmonitor_daemon.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+#include "fsmonitor.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_CLOSE_WRITE | IN_ONLYDIR)
+#define EVENT_BUFFER_SIZE (64 * 1024)
+#define JOURNAL_ROTATE_SIZE (64L * 1024 * 1024)
+
+typedef struct daemon_state
+{
+    int inotify_fd;
+    int journal_fd;
+    off_t journal_size;
+
+    // Watch descriptors are small increasing integers, so they index directly
+    char **watch_paths;
+    int watch_paths_capacity;
+} daemon_state;
+
+static volatile sig_atomic_t is_stop_requested = false;
+
+static void request_stop(const int signal_number)
+{
+    (void)signal_number;
+    is_stop_requested = true;
+}
+
+static bool set_watch_path(daemon_state *state, const int wd, const char *rel_path)
+{
+    if (wd >= state->watch_paths_capacity)
+    {
+        int capacity = state->watch_paths_capacity ? state->watch_paths_capacity : 1024;
+        while (capacity <= wd) capacity *= 2;
+
+        char **paths = realloc(state->watch_paths, capacity * sizeof(char *));
+        validate(paths, "Failed to allocate memory.");
+
+        memset(&paths[state->watch_paths_capacity], 0, (capacity - state->watch_paths_capacity) * sizeof(char *));
+        state->watch_paths = paths;
+        state->watch_paths_capacity = capacity;
+    }
+
+    if (state->watch_paths[wd]) free(state->watch_paths[wd]);
+
+    state->watch_paths[wd] = strdup(rel_path);
+    validate(state->watch_paths[wd], "Failed to allocate memory.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool start_journal(daemon_state *state)
+{
+    char journal_path[PATH_MAX];
+    validate(get_git_path(journal_path, PATH_MAX, FSMONITOR_DAEMON_JOURNAL), "Failed to resolve journal path.");
+
+    if (state->journal_fd != -1) close(state->journal_fd);
+
+    state->journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    validate(state->journal_fd != -1, "Failed to open '%s'.", journal_path);
+
+    // A fresh instance id invalidates every token handed out for older journals
+    char instance[64];
+    const int instance_len = snprintf(instance, sizeof(instance), "%lx-%x\n", (long)time(nullptr), getpid());
+
+    validate(write(state->journal_fd, instance, instance_len) == instance_len, "Failed to write journal header.");
+    state->journal_size = instance_len;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void append_to_journal(daemon_state *state, FILE *pending, buffer *pending_buffer)
+{
+    fflush(pending);
+
+    if (pending_buffer->size == 0) return;
+
+    if (state->journal_size + (off_t)pending_buffer->size > JOURNAL_ROTATE_SIZE)
+    {
+        (void)start_journal(state);
+    }
+
+    // A single write keeps readers from seeing a partially appended batch
+    const ssize_t written = write(state->journal_fd, pending_buffer->data, pending_buffer->size);
+    if (written > 0) state->journal_size += written;
+
+    rewind(pending);
+    pending_buffer->size = 0;
+}
+
+static bool is_ignored_dir(const char *name)
+{
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0;
+}
+
+// Watches 'rel_path' and everything below it. Entries found while adding the
+// watches are journaled, as they may have been created before the watch existed.
+static bool add_watches(daemon_state *state, const char *rel_path, FILE *pending)
+{
+    char full_path[PATH_MAX];
+    (void)snprintf(full_path, PATH_MAX, "%s%s%s", get_repository_root(), *rel_path ? "/" : "", rel_path);
+
+    const int wd = inotify_add_watch(state->inotify_fd, full_path, WATCH_MASK);
+    if (wd == -1) return errno == ENOENT || errno == ENOTDIR;
+
+    validate(set_watch_path(state, wd, rel_path), "Failed to register watch for '%s'.", full_path);
+
+    DIR *dir = opendir(full_path);
+    if (!dir) return true;
+
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (is_ignored_dir(entry->d_name)) continue;
+
+        char child_path[PATH_MAX];
+        (void)snprintf(child_path, PATH_MAX, "%s%s%s", rel_path, *rel_path ? "/" : "", entry->d_name);
+
+        if (pending) fprintf(pending, "%s\n", child_path);
+
+        if (entry->d_type == DT_DIR)
+        {
+            if (!add_watches(state, child_path, pending))
+            {
+                closedir(dir);
+                return false;
+            }
+        }
+    }
+
+    closedir(dir);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_cookie_watch(daemon_state *state)
+{
+    char cookies_path[PATH_MAX];
+    validate(get_git_path(cookies_path, PATH_MAX, FSMONITOR_DAEMON_COOKIES), "Failed to resolve cookie path.");
+
+    if (!dir_exists(cookies_path))
+    {
+        validate(mkdir(cookies_path, 0755) == 0, "Failed to create '%s'.", cookies_path);
+    }
+
+    const int wd = inotify_add_watch(state->inotify_fd, cookies_path, IN_CREATE);
+    validate(wd != -1, "Failed to watch '%s'.", cookies_path);
+
+    return set_watch_path(state, wd, ".git/" FSMONITOR_DAEMON_COOKIES);
+
+error:
+    return false;
+}
+
+static void handle_event(daemon_state *state, const struct inotify_event *event, FILE *pending)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // Events were dropped, nothing can be vouched for any more
+        fprintf(pending, "/\n");
+        return;
+    }
+
+    if (event->wd < 0 || event->wd >= state->watch_paths_capacity || !state->watch_paths[event->wd]) return;
+
+    const char *dir_path = state->watch_paths[event->wd];
+
+    if (event->mask & IN_IGNORED)
+    {
+        free(state->watch_paths[event->wd]);
+        state->watch_paths[event->wd] = nullptr;
+        return;
+    }
+
+    if (event->len == 0 || event->name[0] == '\0')
+    {
+        if (*dir_path) fprintf(pending, "%s\n", dir_path);
+        return;
+    }
+
+    if (*dir_path == '\0' && strcmp(event->name, ".git") == 0) return;
+
+    char path[PATH_MAX];
+    (void)snprintf(path, PATH_MAX, "%s%s%s", dir_path, *dir_path ? "/" : "", event->name);
+
+    fprintf(pending, "%s\n", path);
+
+    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        if (!add_watches(state, path, pending))
+        {
+            fprintf(pending, "/\n");
+        }
+    }
+}
+
+static bool write_pid_file(void)
+{
+    char pid_path[PATH_MAX];
+    validate(get_git_path(pid_path, PATH_MAX, FSMONITOR_DAEMON_PID), "Failed to resolve pid file path.");
+
+    FILE *pid_file = fopen(pid_path, "w");
+    validate(pid_file, "Failed to open '%s'.", pid_path);
+
+    fprintf(pid_file, "%d\n", getpid());
+    fclose(pid_file);
+
+    return true;
+
+error:
+    return false;
+}
+
+static long read_daemon_pid(void)
+{
+    char pid_path[PATH_MAX];
+    if (!get_git_path(pid_path, PATH_MAX, FSMONITOR_DAEMON_PID)) return 0;
+
+    FILE *pid_file = fopen(pid_path, "r");
+    if (!pid_file) return 0;
+
+    long pid = 0;
+    if (fscanf(pid_file, "%ld", &pid) != 1 || pid <= 0 || kill((pid_t)pid, 0) != 0)
+    {
+        pid = 0;
+    }
+
+    fclose(pid_file);
+
+    return pid;
+}
+
+static int run_daemon(void)
+{
+    daemon_state state = {
+        .inotify_fd = -1,
+        .journal_fd = -1,
+        .journal_size = 0,
+        .watch_paths = nullptr,
+        .watch_paths_capacity = 0,
+    };
+
+    buffer pending_buffer = { nullptr, 0 };
+    FILE *pending = nullptr;
+
+    validate(read_daemon_pid() == 0, "fsmonitor daemon is already running.");
+
+    struct sigaction stop_action = { .sa_handler = request_stop };
+    sigaction(SIGTERM, &stop_action, nullptr);
+    sigaction(SIGINT, &stop_action, nullptr);
+
+    state.inotify_fd = inotify_init1(IN_CLOEXEC);
+    validate(state.inotify_fd != -1, "Failed to initialize inotify.");
+
+    pending = open_memstream(&pending_buffer.data, &pending_buffer.size);
+    validate(pending, "Failed to open memory stream.");
+
+    // Watches go in before the journal starts; anything that changes meanwhile
+    // is covered because clients holding no token for this instance rescan fully
+    validate(add_watches(&state, "", nullptr), "Failed to watch worktree.");
+    validate(add_cookie_watch(&state), "Failed to watch cookie directory.");
+    validate(start_journal(&state), "Failed to start journal.");
+    validate(write_pid_file(), "Failed to write pid file.");
+
+    char events[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!is_stop_requested)
+    {
+        const ssize_t len = read(state.inotify_fd, events, sizeof(events));
+
+        if (len == -1)
+        {
+            if (errno == EINTR) continue;
+            validate(false, "Failed to read inotify events.");
+        }
+
+        for (ssize_t pos = 0; pos < len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)&events[pos];
+            handle_event(&state, event, pending);
+            pos += (ssize_t)sizeof(struct inotify_event) + event->len;
+        }
+
+        append_to_journal(&state, pending, &pending_buffer);
+    }
+
+    char pid_path[PATH_MAX];
+    if (get_git_path(pid_path, PATH_MAX, FSMONITOR_DAEMON_PID)) unlink(pid_path);
+
+error:
+    if (pending) fclose(pending);
+    if (pending_buffer.data) free(pending_buffer.data);
+    if (state.inotify_fd != -1) close(state.inotify_fd);
+    if (state.journal_fd != -1) close(state.journal_fd);
+
+    for (int i = 0; i < state.watch_paths_capacity; i++)
+    {
+        if (state.watch_paths[i]) free(state.watch_paths[i]);
+    }
+
+    if (state.watch_paths) free(state.watch_paths);
+
+    return is_stop_requested ? 0 : 1;
+}
+
+static int start_daemon(void)
+{
+    validate(get_repository_root(), "Not a git repository.");
+    validate(read_daemon_pid() == 0, "fsmonitor daemon is already running.");
+
+    const pid_t pid = fork();
+    validate(pid != -1, "Failed to start fsmonitor daemon.");
+
+    if (pid == 0)
+    {
+        setsid();
+
+        const int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd != -1)
+        {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+
+        _exit(run_daemon());
+    }
+
+    // Wait until the daemon is ready to answer queries
+    for (int i = 0; i < 1000 && read_daemon_pid() == 0; i++)
+    {
+        usleep(1000);
+    }
+
+    validate(read_daemon_pid() != 0, "fsmonitor daemon failed to start.");
+
+    printf("fsmonitor daemon started (pid %d)\n", pid);
+
+    return 0;
+
+error:
+    return 1;
+}
+
+static int stop_daemon(void)
+{
+    const long pid = read_daemon_pid();
+    validate(pid != 0, "fsmonitor daemon is not running.");
+
+    validate(kill((pid_t)pid, SIGTERM) == 0, "Failed to stop fsmonitor daemon.");
+
+    for (int i = 0; i < 1000 && read_daemon_pid() != 0; i++)
+    {
+        usleep(1000);
+    }
+
+    return 0;
+
+error:
+    return 1;
+}
+
+int fsmonitor_daemon(const int argc, char *argv[])
+{
+    validate(argc >= 3, "Usage: fsmonitor--daemon (start|run|stop|status)");
+
+    const char *subcommand = argv[2];
+
+    if (strcmp(subcommand, "run") == 0) return run_daemon();
+
+    if (strcmp(subcommand, "start") == 0) return start_daemon();
+
+    if (strcmp(subcommand, "stop") == 0) return stop_daemon();
+
+    if (strcmp(subcommand, "status") == 0)
+    {
+        const long pid = read_daemon_pid();
+
+        if (pid == 0)
+        {
+            printf("fsmonitor daemon is not watching '%s'\n", get_repository_root());
+            return 1;
+        }
+
+        printf("fsmonitor daemon is watching '%s' (pid %ld)\n", get_repository_root(), pid);
+        return 0;
+    }
+
+    validate(false, "Unknown fsmonitor--daemon subcommand: %s", subcommand);
+
+error:
+    return 1;
+}
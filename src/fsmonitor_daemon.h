@@ -0,0 +1,6 @@
+#ifndef FSMONITOR_DAEMON_H
+#define FSMONITOR_DAEMON_H
+
+int fsmonitor_daemon(int argc, char *argv[]);
+
+#endif //FSMONITOR_DAEMON_H
@@ -0,0 +1,240 @@
+#include "gc.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "packfile.h"
+#include "repack.h"
+
+#define DEFAULT_PRUNE_EXPIRE "2.weeks.ago"
+#define DEFAULT_GC_AUTO 6700
+#define DEFAULT_GC_AUTO_PACK_LIMIT 50
+#define AUTO_GEOMETRIC_FACTOR 2
+
+bool gc_auto_opt = false;
+char *prune_opt = nullptr;
+bool no_prune_opt = false;
+
+typedef struct time_unit
+{
+    const char *name;
+    time_t seconds;
+} time_unit;
+
+static const time_unit time_units[] = {
+    { "second", 1 },
+    { "minute", 60 },
+    { "hour", 60 * 60 },
+    { "day", 24 * 60 * 60 },
+    { "week", 7 * 24 * 60 * 60 },
+    { "month", 30 * 24 * 60 * 60 },
+    { "year", 365 * 24 * 60 * 60 },
+};
+
+static bool try_resolve_gc_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "auto", no_argument, nullptr, 'a' },
+        { "prune", required_argument, nullptr, 'p' },
+        { "no-prune", no_argument, nullptr, 'n' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                gc_auto_opt = true;
+                break;
+            case 'p':
+                prune_opt = optarg;
+                break;
+            case 'n':
+                no_prune_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 1 == argc, "Usage: gc [--auto] [--prune=<date> | --no-prune]");
+
+    return true;
+
+error:
+    return false;
+}
+
+// "now", "never", seconds since the epoch, or "<n>.<unit>.ago" with '.'
+// or ' ' between the parts, the forms gc.pruneExpire takes. 0 stands for
+// never.
+static bool parse_expiry_date(const char *value, time_t *expire)
+{
+    const time_t now = time(nullptr);
+
+    if (strcmp(value, "now") == 0)
+    {
+        *expire = now;
+        return true;
+    }
+
+    if (strcmp(value, "never") == 0)
+    {
+        *expire = 0;
+        return true;
+    }
+
+    char *end;
+    const long count = strtol(value, &end, 10);
+    validate(end != value && count >= 0, "Invalid date '%s'.", value);
+
+    if (*end == '\0')
+    {
+        *expire = (time_t)count;
+        return true;
+    }
+
+    validate(*end == '.' || *end == ' ', "Invalid date '%s'.", value);
+
+    const char *unit = &end[1];
+    size_t unit_len = 0;
+    while (isalpha((unsigned char)unit[unit_len])) unit_len++;
+
+    const char *rest = &unit[unit_len];
+    validate(strcmp(rest, ".ago") == 0 || strcmp(rest, " ago") == 0, "Invalid date '%s'.", value);
+
+    // Plurals are optional
+    if (unit_len > 1 && unit[unit_len - 1] == 's') unit_len--;
+
+    for (size_t i = 0; i < sizeof(time_units) / sizeof(time_units[0]); i++)
+    {
+        if (strlen(time_units[i].name) != unit_len || strncmp(unit, time_units[i].name, unit_len) != 0) continue;
+
+        *expire = now - (time_t)count * time_units[i].seconds;
+        return true;
+    }
+
+    validate(false, "Unknown time unit in '%s'.", value);
+
+error:
+    return false;
+}
+
+// Loose objects are estimated from one fan-out directory, as git does
+static bool is_auto_gc_needed(void)
+{
+    const long loose_limit = get_config_long("gc.auto", DEFAULT_GC_AUTO);
+    const long pack_limit = get_config_long("gc.autoPackLimit", DEFAULT_GC_AUTO_PACK_LIMIT);
+
+    if (loose_limit <= 0) return false;
+
+    char dir_path[PATH_MAX];
+    long loose_count = 0;
+
+    if (get_git_path(dir_path, PATH_MAX, "objects/17"))
+    {
+        DIR *dir = opendir(dir_path);
+        const struct dirent *entry;
+
+        while (dir && (entry = readdir(dir)) != nullptr)
+        {
+            if (strlen(entry->d_name) == SHA_HEX_LENGTH - 2) loose_count++;
+        }
+
+        if (dir) closedir(dir);
+    }
+
+    if (loose_count * 256 > loose_limit) return true;
+
+    long pack_count = 0;
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next) pack_count++;
+
+    return pack_limit > 0 && pack_count > pack_limit;
+}
+
+// After a full repack every reachable object is packed, so a loose object
+// that is not must be unreachable; it goes once it is no newer than expire
+static bool prune_loose_object(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path, void *data)
+{
+    const time_t *expire = data;
+
+    packed_git *pack;
+    uint64_t offset;
+    if (find_pack_entry(hash, &pack, &offset)) return true;
+
+    struct stat fs;
+    if (stat(path, &fs) != 0 || fs.st_mtime > *expire) return true;
+
+    validate(unlink(path) == 0 || errno == ENOENT, "Failed to remove '%s'.", path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// gc [--auto] [--prune=<date> | --no-prune]
+// Repacks everything reachable into one pack, with a bitmap unless
+// repack.writeBitmaps is false, and removes the packs and loose objects it
+// replaces. Unreachable objects are pruned once older than <date>
+// (gc.pruneExpire, 2 weeks ago by default): loose ones by their own time,
+// packed ones by their pack's. --auto only runs when there are more loose
+// objects than gc.auto or more packs than gc.autoPackLimit, and then only
+// rolls up the smallest packs, leaving unreachable objects be.
+int gc(const int argc, char *argv[])
+{
+    validate(try_resolve_gc_opts(argc, argv), "Failed to resolve options.");
+
+    const char *prune_value = prune_opt ? prune_opt : get_config_value("gc.pruneExpire");
+    if (!prune_value) prune_value = DEFAULT_PRUNE_EXPIRE;
+
+    time_t expire = 0;
+    if (!no_prune_opt) validate(parse_expiry_date(prune_value, &expire), "Invalid prune date.");
+
+    repack_options options;
+    init_repack_options(&options);
+    options.is_delete = true;
+
+    if (gc_auto_opt)
+    {
+        if (!is_auto_gc_needed()) return 0;
+
+        options.geometric_factor = AUTO_GEOMETRIC_FACTOR;
+
+        validate(repack_repository(&options), "Failed to repack.");
+
+        return 0;
+    }
+
+    options.is_all = true;
+    options.is_write_bitmap = get_config_bool("repack.writeBitmaps", true);
+
+    // Never pruning keeps every unreachable object, whatever its time
+    options.keep_unreachable_since = expire ? expire : 1;
+
+    validate(repack_repository(&options), "Failed to repack.");
+
+    if (expire) validate(for_each_loose_object(prune_loose_object, &expire), "Failed to prune loose objects.");
+
+    return 0;
+
+error:
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef GC_H
+#define GC_H
+
+int gc(int argc, char *argv[]);
+
+#endif //GC_H
@@ -1,10 +1,14 @@
 #include "git_dir_helpers.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "debug_helpers.h"
+#include "trace.h"
 
 struct object_path get_object_path(const char *obj_hash)
 {
@@ -80,6 +84,8 @@ error:
 
 char *find_repository_root_dir(char *root_path, const size_t root_path_len)
 {
+    trace_region_enter("repo", "discovery");
+
     char *curr = getcwd(root_path, root_path_len);
     validate(curr, "Failed to get current working directory.");
 
@@ -96,12 +102,66 @@ char *find_repository_root_dir(char *root_path, const size_t root_path_len)
 
     } while (true);
 
+    trace_region_leave("repo", "discovery");
+
     return root_path;
 
+error:
+    trace_region_leave("repo", "discovery");
+
+    return nullptr;
+}
+
+const char *get_repository_root(void)
+{
+    static char repo_root[PATH_MAX];
+    static bool is_resolved = false;
+
+    if (!is_resolved)
+    {
+        validate(find_repository_root_dir(repo_root, PATH_MAX), "Not a git repository.");
+        is_resolved = true;
+    }
+
+    return repo_root;
+
+error:
+    return nullptr;
+}
+
+char *get_git_path(char *path, const size_t path_len, const char *rel_path)
+{
+    const char *root = get_repository_root();
+    validate(root, "Not a git repository.");
+
+    const int size = snprintf(path, path_len, "%s/.git/%s", root, rel_path);
+    validate(size > 0 && (size_t)size < path_len, "Failed to generate path for '%s'.", rel_path);
+
+    return path;
+
 error:
     return nullptr;
 }
 
+const unsigned char *map_file(const char *path, size_t *size)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) return nullptr;
+
+    struct stat fs;
+    void *data = MAP_FAILED;
+
+    if (fstat(fd, &fs) == 0 && fs.st_size > 0)
+    {
+        data = mmap(nullptr, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *size = fs.st_size;
+    }
+
+    close(fd);
+
+    return data == MAP_FAILED ? nullptr : data;
+}
+
 bool dir_exists(const char *path)
 {
     struct stat fs;
@@ -157,3 +217,10 @@ bool is_excluded_dir(const struct dirent *dir_entry)
         || strcmp(dir_entry->d_name, "..") == 0
         || strcmp(dir_entry->d_name, ".git") == 0;
 }
+
+command_args get_command_args(const int argc, char *argv[])
+{
+    const int first_arg = optind + 1;
+
+    return (command_args){ .argv = &argv[first_arg], .count = argc - first_arg };
+}
@@ -2,6 +2,7 @@
 #define OBJECT_FILE_HELPERS_H
 
 #include <dirent.h>
+#include <stddef.h>
 
 struct object_path
 {
@@ -13,10 +14,27 @@ struct object_path get_object_path(const char *obj_hash);
 
 char *find_repository_root_dir(char *root_path, size_t root_path_len);
 
+const char *get_repository_root(void);
+
+char *get_git_path(char *path, size_t path_len, const char *rel_path);
+
+// Maps a whole file read-only, nullptr if it is missing or empty
+const unsigned char *map_file(const char *path, size_t *size);
+
 bool dir_exists(const char *path);
 
 const char *get_dir_name(const char *path);
 
 bool is_excluded_dir(const struct dirent *dir_entry);
 
+typedef struct command_args
+{
+    char **argv;
+    int count;
+} command_args;
+
+// The arguments left once a command has parsed its options. getopt permutes
+// the options in front of them, so they start right behind the command name.
+command_args get_command_args(int argc, char *argv[]);
+
 #endif //OBJECT_FILE_HELPERS_H
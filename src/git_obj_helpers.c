@@ -1,19 +1,29 @@
 #include "git_obj_helpers.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <zlib.h>
 #include <sys/stat.h>
 
 #include "compression.h"
 #include "debug_helpers.h"
 #include "git_dir_helpers.h"
+#include "object_filter.h"
+#include "odb_transaction.h"
+#include "packfile.h"
+#include "promisor.h"
+#include "trace.h"
 
 void init_commit_tree_info(commit_info *commit_opts)
 {
     commit_opts->tree_sha = nullptr;
-    commit_opts->parent_sha = nullptr;
+    commit_opts->parent_shas = nullptr;
+    commit_opts->parent_count = 0;
     commit_opts->author_name = nullptr;
     commit_opts->author_email = nullptr;
     commit_opts->author_date = nullptr;
@@ -28,7 +38,8 @@ void init_commit_tree_info(commit_info *commit_opts)
 void destroy_commit_tree_info(const commit_info *commit_opts)
 {
     if (commit_opts->tree_sha) free(commit_opts->tree_sha);
-    if (commit_opts->parent_sha) free(commit_opts->parent_sha);
+    for (size_t i = 0; i < commit_opts->parent_count; i++) free(commit_opts->parent_shas[i]);
+    if (commit_opts->parent_shas) free(commit_opts->parent_shas);
     if (commit_opts->message) free(commit_opts->message);
     if (commit_opts->author_name) free(commit_opts->author_name);
     if (commit_opts->author_email) free(commit_opts->author_email);
@@ -40,6 +51,24 @@ void destroy_commit_tree_info(const commit_info *commit_opts)
     if (commit_opts->commiter_timezone) free(commit_opts->commiter_timezone);
 }
 
+bool add_commit_parent(commit_info *commit_opts, const char *parent_hex)
+{
+    char *parent = strndup(parent_hex, SHA_HEX_LENGTH);
+    validate(parent, "Failed to allocate memory.");
+
+    char **parents = realloc(commit_opts->parent_shas, (commit_opts->parent_count + 1) * sizeof(char *));
+    if (!parents) free(parent);
+    validate(parents, "Failed to allocate memory.");
+
+    parents[commit_opts->parent_count++] = parent;
+    commit_opts->parent_shas = parents;
+
+    return true;
+
+error:
+    return false;
+}
+
 int get_header_size(const char *content)
 {
     int i = 0;
@@ -57,18 +86,43 @@ void hash_bytes_to_hex(char *hash_hex, const unsigned char *hash)
     }
 }
 
+static int hex_digit_value(const char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+unsigned char *hash_hex_to_bytes(unsigned char *hash, const char *hash_hex)
+{
+    for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++)
+    {
+        const int high = hex_digit_value(hash_hex[2 * i]);
+        const int low = hex_digit_value(hash_hex[2 * i + 1]);
+
+        if (high < 0 || low < 0) return nullptr;
+
+        hash[i] = (unsigned char)(high << 4 | low);
+    }
+
+    return hash;
+}
+
 size_t get_object_content(const char *obj_hash, char **inflated_buffer)
 {
-    struct object_path obj_path = get_object_path(obj_hash);
+    *inflated_buffer = nullptr;
 
-    char *repo_root = malloc(sizeof(char) * PATH_MAX);
-    validate(repo_root, "Failed to allocate memory.");
+    FILE *obj_file = nullptr;
+    FILE *obj_inflated = nullptr;
 
-    find_repository_root_dir(repo_root, PATH_MAX);
+    const struct object_path obj_path = get_object_path(obj_hash);
 
-    char *git_obj_path = malloc(sizeof(char) * PATH_MAX);
-    validate(git_obj_path, "Failed to allocate memory.");
+    const char *repo_root = get_repository_root();
+    validate(repo_root, "Not a git repository.");
 
+    char git_obj_path[PATH_MAX];
     (void)snprintf(
         git_obj_path,
         PATH_MAX,
@@ -77,32 +131,117 @@ size_t get_object_content(const char *obj_hash, char **inflated_buffer)
         obj_path.subdir,
         obj_path.name);
 
-    FILE *obj_file = fopen(git_obj_path, "r");
-    validate(obj_file, "Failed to open object file: %s", git_obj_path);
+    obj_file = fopen(git_obj_path, "r");
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+
+    if (!obj_file)
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        validate(hash_hex_to_bytes(hash, obj_hash), "Not a valid object name: %s", obj_hash);
+
+        size_t packed_size = get_packed_object_content(hash, inflated_buffer);
+
+        // A partial clone fetches what its filter left out on first access
+        if (!*inflated_buffer && fetch_promised_object(hash)) packed_size = get_packed_object_content(hash, inflated_buffer);
+
+        validate(*inflated_buffer, "Failed to find object: %s", obj_hash);
+
+        return packed_size;
+    }
 
     size_t inflated_buffer_size;
-    FILE *obj_inflated = open_memstream(inflated_buffer, &inflated_buffer_size);
+    obj_inflated = open_memstream(inflated_buffer, &inflated_buffer_size);
     validate(obj_inflated, "Failed to allocate memory for object content.");
 
     inflate_object(obj_file, obj_inflated);
 
-    free(repo_root);
-    free(git_obj_path);
     fclose(obj_file);
     fclose(obj_inflated);
 
+    trace_counter_add(TRACE_COUNTER_OBJECTS_READ, 1);
+
     return inflated_buffer_size;
 
 error:
-    if (repo_root) free(repo_root);
-    if (git_obj_path) free(git_obj_path);
     if (obj_inflated) fclose(obj_inflated);
     if (obj_file) fclose(obj_file);
-    if (inflated_buffer) free(inflated_buffer);
+    if (*inflated_buffer) free(*inflated_buffer);
+    *inflated_buffer = nullptr;
 
     return 0;
 }
 
+bool get_object_size(const unsigned char hash[SHA_DIGEST_LENGTH], size_t *size)
+{
+    object_type type;
+
+    return get_object_info(hash, &type, size);
+}
+
+bool get_object_info(const unsigned char hash[SHA_DIGEST_LENGTH], object_type *type, size_t *size)
+{
+    int fd = -1;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, hash);
+
+    const struct object_path obj_path = get_object_path(hash_hex);
+
+    char rel_path[PATH_MAX];
+    char git_obj_path[PATH_MAX];
+    (void)snprintf(rel_path, PATH_MAX, "objects/%s/%s", obj_path.subdir, obj_path.name);
+    validate(get_git_path(git_obj_path, PATH_MAX, rel_path), "Not a git repository.");
+
+    fd = open(git_obj_path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        packed_git *pack;
+        uint64_t offset;
+        bool is_found = find_pack_entry(hash, &pack, &offset);
+
+        if (!is_found && fetch_promised_object(hash)) is_found = find_pack_entry(hash, &pack, &offset);
+
+        validate(is_found, "Failed to find object: %s", hash_hex);
+
+        *type = get_packed_object_type(pack, offset);
+        validate(*type != OBJ_NONE, "Failed to read object: %s", hash_hex);
+
+        return get_packed_object_size(pack, offset, size);
+    }
+
+    // "<type> <size>\0" fits in the first few dozen inflated bytes
+    unsigned char deflated[256];
+    const ssize_t deflated_size = read(fd, deflated, sizeof(deflated));
+    validate(deflated_size > 0, "Failed to read object: %s", hash_hex);
+
+    close(fd);
+    fd = -1;
+
+    char header[32];
+    const size_t header_size = inflate_prefix(deflated, deflated_size, (unsigned char *)header, sizeof(header) - 1);
+    header[header_size] = '\0';
+
+    const char *size_start = strchr(header, ' ');
+    validate(size_start && strlen(header) < header_size, "Malformed object header: %s", hash_hex);
+
+    char type_name[16];
+    (void)snprintf(type_name, sizeof(type_name), "%.*s", (int)(size_start - header), header);
+    *type = object_type_from_name(type_name);
+    validate(*type != OBJ_NONE, "Unknown object type '%s': %s", type_name, hash_hex);
+
+    char *size_end;
+    *size = strtoull(&size_start[1], &size_end, 10);
+    validate(size_end != &size_start[1] && *size_end == '\0', "Malformed object header: %s", hash_hex);
+
+    return true;
+
+error:
+    if (fd != -1) close(fd);
+
+    return false;
+}
+
 void get_object_type(char *obj_type, const char *object_content)
 {
     int i = 0;
@@ -116,6 +255,50 @@ void get_object_type(char *obj_type, const char *object_content)
     obj_type[i] = '\0';
 }
 
+bool for_each_loose_object(const each_loose_object_fn fn, void *data)
+{
+    char objects_path[PATH_MAX];
+    validate(get_git_path(objects_path, PATH_MAX, "objects"), "Not a git repository.");
+
+    for (int fanout = 0; fanout < 256; fanout++)
+    {
+        char dir_path[PATH_MAX + 4];
+        (void)snprintf(dir_path, sizeof(dir_path), "%s/%02x", objects_path, fanout);
+
+        DIR *dir = opendir(dir_path);
+        if (!dir) continue;
+
+        bool result = true;
+        const struct dirent *entry;
+
+        while (result && (entry = readdir(dir)) != nullptr)
+        {
+            if (strlen(entry->d_name) != SHA_HEX_LENGTH - 2) continue;
+
+            char hash_hex[SHA_HEX_LENGTH + 1];
+            const int hex_len = snprintf(hash_hex, sizeof(hash_hex), "%02x%s", fanout, entry->d_name);
+            if (hex_len != SHA_HEX_LENGTH) continue;
+
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            if (!hash_hex_to_bytes(hash, hash_hex)) continue;
+
+            char path[PATH_MAX * 2];
+            (void)snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+            result = fn(hash, path, data);
+        }
+
+        closedir(dir);
+
+        if (!result) return false;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
 static unsigned char *calculate_hash(FILE *source, const size_t src_size, unsigned char hash[20])
 {
     unsigned char *input = malloc(src_size);
@@ -124,7 +307,10 @@ static unsigned char *calculate_hash(FILE *source, const size_t src_size, unsign
     (void)fread(input, 1, src_size, source);
     rewind(source);
 
+    trace_timer_start(TRACE_TIMER_HASH);
     unsigned char *result = SHA1(input, src_size, hash);
+    trace_timer_stop(TRACE_TIMER_HASH);
+
     validate(result, "Failed to compute hash.");
 
     free(input);
@@ -139,6 +325,8 @@ error:
 
 unsigned char *create_blob(char *filename, FILE **blob_data, unsigned char hash[SHA_DIGEST_LENGTH])
 {
+    *blob_data = nullptr;
+
     FILE *src_file = fopen(filename, "r");
     validate(src_file, "Failed to open file: %s", filename);
 
@@ -179,42 +367,79 @@ unsigned char *create_blob(char *filename, FILE **blob_data, unsigned char hash[
 
 error:
     if (src_file) fclose(src_file);
-    if (blob_data) fclose(*blob_data);
+    if (*blob_data) fclose(*blob_data);
+    *blob_data = nullptr;
 
     return nullptr;
 }
 
-unsigned char *create_tree(const buffer *tree_buffer, FILE **tree_data, unsigned char hash[SHA_DIGEST_LENGTH])
+static unsigned char *create_object_from_buffer(
+    const char *obj_type,
+    const buffer *content,
+    FILE **object_data,
+    unsigned char hash[SHA_DIGEST_LENGTH])
 {
-    char tree_header[24];
+    char object_header[24];
 
-    const int header_size = sprintf(tree_header, "tree %lu", tree_buffer->size) + 1;
-    tree_header[header_size - 1] = '\0';
+    const int header_size = sprintf(object_header, "%s %lu", obj_type, content->size) + 1;
+    object_header[header_size - 1] = '\0';
 
-    const size_t tree_size = header_size + tree_buffer->size;
+    const size_t object_size = header_size + content->size;
 
-    *tree_data = fmemopen(NULL, tree_size, "r+");
-    validate(*tree_data, "Failed to allocate memory for tree_data");
+    *object_data = fmemopen(NULL, object_size, "r+");
+    validate(*object_data, "Failed to allocate memory for %s data", obj_type);
 
-    size_t write_size = fwrite(tree_header, sizeof(char), header_size, *tree_data);
-    validate(write_size == header_size, "Failed to write tree header.");
+    size_t write_size = fwrite(object_header, sizeof(char), header_size, *object_data);
+    validate(write_size == header_size, "Failed to write %s header.", obj_type);
 
-    write_size = fwrite(tree_buffer->data, sizeof(char), tree_buffer->size, *tree_data);
-    validate(write_size == tree_buffer->size, "Failed to write tree content.");
+    write_size = fwrite(content->data, sizeof(char), content->size, *object_data);
+    validate(write_size == content->size, "Failed to write %s content.", obj_type);
 
-    rewind(*tree_data);
+    rewind(*object_data);
 
-    unsigned char *result = calculate_hash(*tree_data, tree_size, hash);
-    validate(result, "Failed to calculate tree hash.");
+    unsigned char *result = calculate_hash(*object_data, object_size, hash);
+    validate(result, "Failed to calculate %s hash.", obj_type);
 
     return hash;
 
 error:
-    if (*tree_data) fclose(*tree_data);
+    if (*object_data) fclose(*object_data);
 
     return nullptr;
 }
 
+unsigned char *create_blob_from_buffer(const buffer *blob_buffer, FILE **blob_data, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    return create_object_from_buffer("blob", blob_buffer, blob_data, hash);
+}
+
+unsigned char *create_tree(const buffer *tree_buffer, FILE **tree_data, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    return create_object_from_buffer("tree", tree_buffer, tree_data, hash);
+}
+
+static size_t write_identity(
+    FILE *commit_content,
+    const char *role,
+    const char *name,
+    const char *email,
+    const char *date,
+    const char *timezone)
+{
+    size_t size = fwrite(role, sizeof(char), strlen(role), commit_content);
+    size += fwrite(" ", sizeof(char), 1, commit_content);
+    size += fwrite(name, sizeof(char), strlen(name), commit_content);
+    size += fwrite(" <", sizeof(char), 2, commit_content);
+    size += fwrite(email, sizeof(char), strlen(email), commit_content);
+    size += fwrite("> ", sizeof(char), 2, commit_content);
+    size += fwrite(date, sizeof(char), strlen(date), commit_content);
+    size += fwrite(" ", sizeof(char), 1, commit_content);
+    size += fwrite(timezone, sizeof(char), strlen(timezone), commit_content);
+    size += fwrite("\n", sizeof(char), 1, commit_content);
+
+    return size;
+}
+
 unsigned char *create_commit(const commit_info *commit_info, FILE **commit_data, unsigned char hash[SHA_DIGEST_LENGTH])
 {
     buffer buffer;
@@ -225,32 +450,30 @@ unsigned char *create_commit(const commit_info *commit_info, FILE **commit_data,
     content_size += fwrite(commit_info->tree_sha, sizeof(char), SHA_HEX_LENGTH, commit_content);
     content_size += fwrite("\n", sizeof(char), 1, commit_content);
 
-    if (commit_info->parent_sha)
+    for (size_t i = 0; i < commit_info->parent_count; i++)
     {
         content_size += fwrite("parent ", sizeof(char), 7, commit_content);
-        content_size += fwrite(commit_info->parent_sha, sizeof(char), SHA_HEX_LENGTH, commit_content);
+        content_size += fwrite(commit_info->parent_shas[i], sizeof(char), SHA_HEX_LENGTH, commit_content);
         content_size += fwrite("\n", sizeof(char), 1, commit_content);
     }
 
-    content_size += fwrite("author ", sizeof(char), 7, commit_content);
-    content_size += fwrite(commit_info->author_name, sizeof(char), strlen(commit_info->author_name), commit_content);
-    content_size += fwrite(" <", sizeof(char), 2, commit_content);
-    content_size += fwrite(commit_info->author_email, sizeof(char), strlen(commit_info->author_email), commit_content);
-    content_size += fwrite(" >", sizeof(char), 2, commit_content);
-    content_size += fwrite(commit_info->author_date, sizeof(char), strlen(commit_info->author_date), commit_content);
-    content_size += fwrite(" ", sizeof(char), 1, commit_content);
-    content_size += fwrite(commit_info->author_timezone, sizeof(char), strlen(commit_info->author_timezone), commit_content);
-    content_size += fwrite("\n", sizeof(char), 1, commit_content);
+    content_size += write_identity(
+        commit_content,
+        "author",
+        commit_info->author_name,
+        commit_info->author_email,
+        commit_info->author_date,
+        commit_info->author_timezone);
+
+    content_size += write_identity(
+        commit_content,
+        "committer",
+        commit_info->committer_name ? commit_info->committer_name : commit_info->author_name,
+        commit_info->committer_email ? commit_info->committer_email : commit_info->author_email,
+        commit_info->committer_date ? commit_info->committer_date : commit_info->author_date,
+        commit_info->commiter_timezone ? commit_info->commiter_timezone : commit_info->author_timezone);
 
-    content_size += fwrite("committer ", sizeof(char), 10, commit_content);
-    content_size += fwrite(commit_info->author_name, sizeof(char), strlen(commit_info->author_name), commit_content);
-    content_size += fwrite(" <", sizeof(char), 2, commit_content);
-    content_size += fwrite(commit_info->author_email, sizeof(char), strlen(commit_info->author_email), commit_content);
-    content_size += fwrite(" >", sizeof(char), 2, commit_content);
-    content_size += fwrite(commit_info->author_date, sizeof(char), strlen(commit_info->author_date), commit_content);
-    content_size += fwrite(" ", sizeof(char), 1, commit_content);
-    content_size += fwrite(commit_info->author_timezone, sizeof(char), strlen(commit_info->author_timezone), commit_content);
-    content_size += fwrite("\n\n", sizeof(char), 2, commit_content);
+    content_size += fwrite("\n", sizeof(char), 1, commit_content);
 
     content_size += fwrite(commit_info->message, sizeof(char), strlen(commit_info->message), commit_content);
     content_size += fwrite("\n", sizeof(char), 1, commit_content);
@@ -297,47 +520,93 @@ error:
 
 static char *write_git_object(char *hash_hex, FILE *object_data, unsigned char hash[20])
 {
+    char tmp_path[PATH_MAX];
+    tmp_path[0] = '\0';
+    FILE *deflated_file = nullptr;
+
     hash_bytes_to_hex(hash_hex, hash);
 
     struct object_path path = get_object_path(hash_hex);
 
-    char *repo_root_path = malloc(sizeof(char) * PATH_MAX);
-    validate(repo_root_path, "Failed to allocate memory.");
-
-    char *root = find_repository_root_dir(repo_root_path, PATH_MAX);
+    const char *root = get_repository_root();
     validate(root, "Not a git repository.");
 
-    char *full_path = malloc(sizeof(char) * PATH_MAX);
-    validate(full_path, "Failed to allocate memory.");
+    char full_path[PATH_MAX];
+    const int size = snprintf(full_path, PATH_MAX, "%s/.git/objects/%s/%s", root, path.subdir, path.name);
+    validate(size < PATH_MAX, "Failed to generate object path for '%s'. Exceeded PATH_MAX", hash_hex);
 
-    const int size = snprintf(full_path, PATH_MAX, "%s/.git/objects/%s", root, path.subdir);
-    validate(size <= PATH_MAX, "Failed to generate object path for '%s'. Exceeded PATH_MAX", path.subdir);
+    // Objects are immutable, an existing one never has to be written again
+    if (has_object(hash)) return hash_hex;
 
-    if (!dir_exists(full_path))
+    const size_t fanout_path_len = strlen(full_path) - strlen(path.name) - 1;
+    (void)snprintf(tmp_path, PATH_MAX, "%.*s", (int)fanout_path_len, full_path);
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+    if (!dir_exists(tmp_path))
     {
-        const int mkdir_result = mkdir(full_path, 0755);
-        validate(mkdir_result == 0, "Failed to create directory '%s'.", full_path);
+        // A parallel writer may have created the fan-out directory meanwhile
+        trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+        const int mkdir_result = mkdir(tmp_path, 0755);
+        validate(mkdir_result == 0 || errno == EEXIST, "Failed to create directory '%s'.", tmp_path);
     }
 
-    strcat(full_path, "/");
-    strcat(full_path, path.name);
+    // Content goes to a unique temporary file first, so a crash or a
+    // concurrent writer can never leave a truncated file under the final name
+    strcat(tmp_path, "/tmp_obj_XXXXXX");
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+    const int fd = mkstemp(tmp_path);
+    validate(fd != -1, "Failed to create temporary object '%s'.", tmp_path);
 
-    FILE *deflated_file = fopen(full_path, "w+");
-    validate(deflated_file, "Failed to open file '%s'.", full_path);
+    deflated_file = fdopen(fd, "w");
+    if (!deflated_file) close(fd);
+    validate(deflated_file, "Failed to open file '%s'.", tmp_path);
 
     deflate_object(object_data, deflated_file);
 
-    free(repo_root_path);
-    free(full_path);
-    fclose(deflated_file);
+    validate(fflush(deflated_file) == 0 && ferror(deflated_file) == 0, "Failed to write '%s'.", tmp_path);
+
+    if (get_fsync_mode() == FSYNC_OBJECT)
+    {
+        trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+        validate(fsync(fd) == 0, "Failed to fsync '%s'.", tmp_path);
+    }
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+    const int close_result = fclose(deflated_file);
+    deflated_file = nullptr;
+    validate(close_result == 0, "Failed to write '%s'.", tmp_path);
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+    (void)fchmodat(AT_FDCWD, tmp_path, 0444, 0);
+
+    validate(finalize_object_file(tmp_path, full_path), "Failed to store object '%s'.", hash_hex);
+    note_object_written(hash);
+
+    trace_counter_add(TRACE_COUNTER_OBJECTS_WRITTEN, 1);
 
     return hash_hex;
 
 error:
-    if (repo_root_path) free(repo_root_path);
-    if (root) free(root);
     if (deflated_file) fclose(deflated_file);
+    if (tmp_path[0] && strstr(tmp_path, "tmp_obj_")) (void)unlink(tmp_path);
+
+    return nullptr;
+}
+
+char *hash_blob_object(char *filename, char *hash_hex)
+{
+    FILE *blob_data = nullptr;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    validate(create_blob(filename, &blob_data, hash), "Failed to create a blob object.");
+
+    hash_bytes_to_hex(hash_hex, hash);
+
+    fclose(blob_data);
+
+    return hash_hex;
 
+error:
     return nullptr;
 }
 
@@ -359,6 +628,24 @@ error:
     return nullptr;
 }
 
+char *write_blob_object_from_buffer(const buffer *blob_buffer, char *hash_hex)
+{
+    FILE *blob_data = nullptr;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    validate(create_blob_from_buffer(blob_buffer, &blob_data, hash), "Failed to create a blob object.");
+
+    validate(write_git_object(hash_hex, blob_data, hash), "Failed to write a blob object.");
+
+    fclose(blob_data);
+
+    return hash_hex;
+
+error:
+    if (blob_data) fclose(blob_data);
+
+    return nullptr;
+}
+
 char *write_tree_object(const buffer *tree_buffer, char *hash_hex)
 {
     FILE *tree_data = nullptr;
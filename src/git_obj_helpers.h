@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <openssl/sha.h>
 
+#include "packfile.h"
+
 #define SHA_HEX_LENGTH 40
 
 typedef struct git_tree_node
@@ -23,7 +25,11 @@ typedef struct buffer
 typedef struct commit_info
 {
     char *tree_sha;
-    char *parent_sha;
+
+    // One "parent" line each, in order; more than one makes a merge
+    char **parent_shas;
+    size_t parent_count;
+
     char *author_name;
     char *author_email;
     char *author_date;
@@ -39,20 +45,46 @@ void init_commit_tree_info(commit_info *commit_opts);
 
 void destroy_commit_tree_info(const commit_info *commit_opts);
 
+// Appends a copy of parent_hex to the parents of the commit
+bool add_commit_parent(commit_info *commit_opts, const char *parent_hex);
+
 int get_header_size(const char *content);
 
 void hash_bytes_to_hex(char *hash_hex, const unsigned char *hash);
 
+unsigned char *hash_hex_to_bytes(unsigned char *hash, const char *hash_hex);
+
 size_t get_object_content(const char *obj_hash, char **inflated_buffer);
 
+// Reads the size of an object's content from its header alone
+bool get_object_size(const unsigned char hash[SHA_DIGEST_LENGTH], size_t *size);
+
+// Reads an object's type and the size of its content from headers alone
+bool get_object_info(const unsigned char hash[SHA_DIGEST_LENGTH], object_type *type, size_t *size);
+
 void get_object_type(char *obj_type, const char* object_content);
 
+// path is the loose object's file, valid during the call only
+typedef bool (*each_loose_object_fn)(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path, void *data);
+
+// Calls fn for every loose object, one fan-out directory after another,
+// until it returns false
+bool for_each_loose_object(each_loose_object_fn fn, void *data);
+
 unsigned char *create_blob(char *filename, FILE **blob_data, unsigned char hash[SHA_DIGEST_LENGTH]);
 
+unsigned char *create_blob_from_buffer(const buffer *blob_buffer, FILE **blob_data, unsigned char hash[SHA_DIGEST_LENGTH]);
+
 unsigned char *create_tree(const buffer *tree_buffer, FILE **tree_data, unsigned char hash[SHA_DIGEST_LENGTH]);
 
+unsigned char *create_commit(const commit_info *commit_info, FILE **commit_data, unsigned char hash[SHA_DIGEST_LENGTH]);
+
+char *hash_blob_object(char *filename, char *hash_hex);
+
 char *write_blob_object(char *filename, char *hash_hex);
 
+char *write_blob_object_from_buffer(const buffer *blob_buffer, char *hash_hex);
+
 char *write_tree_object(const buffer *tree_buffer, char *hash_hex);
 
 char *write_commit_object(const commit_info *commit_info, char *hash_hex);
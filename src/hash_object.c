@@ -1,26 +1,48 @@
 #include "hash_object.h"
 
 #include <assert.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "git_obj_helpers.h"
 
 #include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "thread_pool.h"
+
+#define HASH_OBJECT_BATCH_SIZE 4096
 
 bool write_opt = false;
+bool stdin_paths_opt = false;
+
+typedef struct hash_object_item
+{
+    char *path;
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    bool is_hashed;
+} hash_object_item;
 
 static bool try_resolve_hash_object_opts(const int argc, char *argv[])
 {
     opterr = 0;
 
+    const struct option long_opts[] = {
+        { "stdin-paths", no_argument, nullptr, 's' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
     int opt;
-    while ((opt = getopt(argc, argv, "w")) != -1)
+    while ((opt = getopt_long(argc, argv, "w", long_opts, nullptr)) != -1)
     {
         switch (opt)
         {
             case 'w':
                 write_opt = true;
                 break;
+            case 's':
+                stdin_paths_opt = true;
+                break;
             case '?':
                 validate(false, "Invalid switch: '%c'\n", optopt);
             default:
@@ -34,24 +56,119 @@ error:
     return false;
 }
 
+static void hash_item(void *ctx, const size_t index)
+{
+    hash_object_item *item = &((hash_object_item *)ctx)[index];
+
+    const char *hash = write_opt
+        ? write_blob_object(item->path, item->hash_hex)
+        : hash_blob_object(item->path, item->hash_hex);
+
+    item->is_hashed = hash != nullptr;
+}
+
+// Hashes a batch across the workers, then prints it in input order
+static bool hash_batch(hash_object_item *items, const size_t count, const unsigned workers, const bool is_single)
+{
+    run_parallel(count, workers, hash_item, items);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        validate(items[i].is_hashed, "Failed to hash '%s'.", items[i].path);
+
+        printf(is_single ? "%s" : "%s\n", items[i].hash_hex);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool hash_stdin_paths(hash_object_item *items, const unsigned workers)
+{
+    char *line = nullptr;
+    size_t line_capacity = 0;
+    size_t count = 0;
+    bool result = true;
+
+    ssize_t len;
+    while (result && (len = getline(&line, &line_capacity, stdin)) > 0)
+    {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) continue;
+
+        items[count].path = strdup(line);
+        validate(items[count].path, "Failed to allocate memory.");
+        count++;
+
+        if (count == HASH_OBJECT_BATCH_SIZE)
+        {
+            result = hash_batch(items, count, workers, false);
+            for (size_t i = 0; i < count; i++) free(items[i].path);
+            count = 0;
+        }
+    }
+
+    if (result && count > 0)
+    {
+        result = hash_batch(items, count, workers, false);
+    }
+
+    for (size_t i = 0; i < count; i++) free(items[i].path);
+    if (line) free(line);
+
+    return result;
+
+error:
+    for (size_t i = 0; i < count; i++) free(items[i].path);
+    if (line) free(line);
+
+    return false;
+}
+
 int hash_object(const int argc, char *argv[])
 {
-    char *filename = argv[3];
+    hash_object_item *items = nullptr;
 
     bool opt_result = try_resolve_hash_object_opts(argc, argv);
     validate(opt_result, "Failed to resolve options.");
 
-    if (write_opt)
+    // Options are permuted in front, so the command name sits at optind
+    char **paths = &argv[optind + 1];
+    const size_t paths_count = argc - optind - 1;
+
+    validate(paths_count > 0 || stdin_paths_opt, "No files to hash.");
+    validate(paths_count == 0 || !stdin_paths_opt, "Can't specify files with --stdin-paths.");
+
+    // Lazily initialized shared state (repository root, config) has to be set
+    // up before the workers start
+    validate(!write_opt || get_repository_root(), "Not a git repository.");
+    const unsigned workers = get_worker_count("hashobject.threads");
+
+    items = calloc(stdin_paths_opt ? HASH_OBJECT_BATCH_SIZE : paths_count, sizeof(hash_object_item));
+    validate(items, "Failed to allocate memory.");
+
+    if (stdin_paths_opt)
     {
-        char hash_hex[SHA_HEX_LENGTH];
-        char *hash = write_blob_object(filename, hash_hex);
-        validate(hash, "Failed to write blob.");
+        validate(hash_stdin_paths(items, workers), "Failed to hash paths from stdin.");
+    }
+    else
+    {
+        for (size_t i = 0; i < paths_count; i++)
+        {
+            items[i].path = paths[i];
+        }
 
-        printf("%s", hash_hex);
+        validate(hash_batch(items, paths_count, workers, paths_count == 1), "Failed to hash files.");
     }
 
+    free(items);
+
     return 0;
 
 error:
+    if (items) free(items);
+
     return 1;
 }
@@ -0,0 +1,448 @@
+#include "index_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+#include "packfile.h"
+#include "tree_walk.h"
+
+// Ten 32-bit stat and mode fields, the oid and 16 bits of flags
+#define INDEX_ENTRY_FIXED_SIZE (10 * 4 + SHA_DIGEST_LENGTH + 2)
+#define INDEX_ENTRY_NAME_MASK 0x0fff
+#define INDEX_ENTRY_STAGE_MASK 0x3000
+#define INDEX_ENTRY_EXTENDED 0x4000
+
+// Version 3 entries with the extended bit carry 16 more bits of flags
+#define INDEX_EXTENDED_FLAGS_SIZE 2
+#define INDEX_EXTENDED_SKIP_WORKTREE 0x4000
+
+// A zeroed slot at the end of the entries
+static index_entry *append_index_slot(index_state *index)
+{
+    if (index->count == index->capacity)
+    {
+        const size_t capacity = index->capacity ? index->capacity * 2 : 64;
+
+        index_entry *entries = realloc(index->entries, capacity * sizeof(index_entry));
+        validate(entries, "Failed to allocate memory.");
+
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+
+    index_entry *entry = &index->entries[index->count];
+    *entry = (index_entry){ };
+
+    return entry;
+
+error:
+    return nullptr;
+}
+
+index_entry *add_index_entry(
+    index_state *index,
+    const char *path,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const unsigned int mode)
+{
+    index_entry *entry = append_index_slot(index);
+    validate(entry, "Failed to add index entry.");
+
+    entry->path = strdup(path);
+    validate(entry->path, "Failed to allocate memory.");
+    memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+    entry->mode = mode;
+
+    index->count++;
+
+    return entry;
+
+error:
+    return nullptr;
+}
+
+void fill_index_stat(index_stat *stat, const struct stat *fs)
+{
+    stat->ctime_sec = (uint32_t)fs->st_ctim.tv_sec;
+    stat->ctime_nsec = (uint32_t)fs->st_ctim.tv_nsec;
+    stat->mtime_sec = (uint32_t)fs->st_mtim.tv_sec;
+    stat->mtime_nsec = (uint32_t)fs->st_mtim.tv_nsec;
+    stat->dev = (uint32_t)fs->st_dev;
+    stat->ino = (uint32_t)fs->st_ino;
+    stat->uid = (uint32_t)fs->st_uid;
+    stat->gid = (uint32_t)fs->st_gid;
+    stat->size = (uint32_t)fs->st_size;
+}
+
+bool is_index_entry_up_to_date(const index_state *index, const index_entry *entry, const struct stat *fs)
+{
+    index_stat current;
+    fill_index_stat(&current, fs);
+
+    if (memcmp(&current, &entry->stat, sizeof(index_stat)) != 0) return false;
+
+    // A file changed right after the index was written may keep its stat
+    // data, so only entries older than the index file itself are trusted
+    return entry->stat.mtime_sec < index->mtime_sec
+        || (entry->stat.mtime_sec == index->mtime_sec && entry->stat.mtime_nsec < index->mtime_nsec);
+}
+
+bool is_sparse_dir_entry(const index_entry *entry)
+{
+    return (entry->mode & S_IFMT) == S_IFDIR;
+}
+
+size_t find_index_pos(const index_state *index, const char *path)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+
+        if (strcmp(index->entries[mid].path, path) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static void append_tree_entry(FILE *tree_content, const unsigned int mode, const char *name, const size_t name_len, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    fprintf(tree_content, "%o ", mode);
+    fwrite(name, sizeof(char), name_len, tree_content);
+    fputc('\0', tree_content);
+    fwrite(hash, sizeof(char), SHA_DIGEST_LENGTH, tree_content);
+}
+
+// Index order is tree order, so entries are appended as they come
+bool write_index_tree(
+    const index_state *index,
+    const char *prefix,
+    const size_t prefix_len,
+    size_t *pos,
+    unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    buffer tree_buffer = { };
+
+    FILE *tree_content = open_memstream(&tree_buffer.data, &tree_buffer.size);
+    validate(tree_content, "Failed to open memory stream.");
+
+    while (*pos < index->count && strncmp(index->entries[*pos].path, prefix, prefix_len) == 0)
+    {
+        const index_entry *entry = &index->entries[*pos];
+        const char *name = &entry->path[prefix_len];
+        const char *slash = strchr(name, '/');
+
+        if (!slash)
+        {
+            append_tree_entry(tree_content, entry->mode, name, strlen(name), entry->hash);
+            (*pos)++;
+        }
+        else if (slash[1] == '\0')
+        {
+            append_tree_entry(tree_content, TREE_MODE_DIR, name, slash - name, entry->hash);
+            (*pos)++;
+        }
+        else
+        {
+            unsigned char subtree_hash[SHA_DIGEST_LENGTH];
+            const size_t subtree_prefix_len = slash - entry->path + 1;
+
+            validate(write_index_tree(index, entry->path, subtree_prefix_len, pos, subtree_hash), "Failed to write tree.");
+            append_tree_entry(tree_content, TREE_MODE_DIR, name, slash - name, subtree_hash);
+        }
+    }
+
+    fclose(tree_content);
+    tree_content = nullptr;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    validate(write_tree_object(&tree_buffer, hash_hex), "Failed to write a tree object.");
+    validate(hash_hex_to_bytes(hash, hash_hex), "Invalid tree hash '%s'.", hash_hex);
+
+    free(tree_buffer.data);
+
+    return true;
+
+error:
+    if (tree_content) fclose(tree_content);
+    if (tree_buffer.data) free(tree_buffer.data);
+
+    return false;
+}
+
+// Entries are NUL padded to a multiple of eight bytes, with at least one NUL
+static size_t get_index_entry_size(const size_t path_len, const bool is_extended)
+{
+    const size_t fixed_size = INDEX_ENTRY_FIXED_SIZE + (is_extended ? INDEX_EXTENDED_FLAGS_SIZE : 0);
+
+    return (fixed_size + path_len + 8) & ~(size_t)7;
+}
+
+static bool read_index_entry(
+    index_state *index,
+    const unsigned char *data,
+    const size_t size,
+    const uint32_t version,
+    size_t *pos)
+{
+    validate(*pos + INDEX_ENTRY_FIXED_SIZE <= size, "Truncated index entry.");
+
+    const unsigned char *entry_data = &data[*pos];
+    const uint16_t flags = (uint16_t)(entry_data[60] << 8 | entry_data[61]);
+    const bool is_extended = flags & INDEX_ENTRY_EXTENDED;
+
+    validate(!(flags & INDEX_ENTRY_STAGE_MASK), "Unmerged index entries are not supported.");
+    validate(!is_extended || version >= INDEX_VERSION_EXTENDED, "Extended flags in a version %u index.", version);
+
+    size_t name_start = INDEX_ENTRY_FIXED_SIZE;
+    uint16_t extended_flags = 0;
+
+    if (is_extended)
+    {
+        validate(*pos + name_start + INDEX_EXTENDED_FLAGS_SIZE <= size, "Truncated index entry.");
+        extended_flags = (uint16_t)(entry_data[name_start] << 8 | entry_data[name_start + 1]);
+        name_start += INDEX_EXTENDED_FLAGS_SIZE;
+    }
+
+    const unsigned char *name = &entry_data[name_start];
+    const unsigned char *name_end = memchr(name, '\0', size - *pos - name_start);
+    validate(name_end, "Unterminated index entry name.");
+
+    index_entry *entry = append_index_slot(index);
+    validate(entry, "Failed to add index entry.");
+
+    entry->path = strndup((const char *)name, name_end - name);
+    validate(entry->path, "Failed to allocate memory.");
+    index->count++;
+
+    memcpy(entry->hash, &entry_data[40], SHA_DIGEST_LENGTH);
+    entry->mode = get_be32(&entry_data[24]);
+    entry->stat = (index_stat){
+        .ctime_sec = get_be32(&entry_data[0]),
+        .ctime_nsec = get_be32(&entry_data[4]),
+        .mtime_sec = get_be32(&entry_data[8]),
+        .mtime_nsec = get_be32(&entry_data[12]),
+        .dev = get_be32(&entry_data[16]),
+        .ino = get_be32(&entry_data[20]),
+        .uid = get_be32(&entry_data[28]),
+        .gid = get_be32(&entry_data[32]),
+        .size = get_be32(&entry_data[36]),
+    };
+    entry->is_skip_worktree = extended_flags & INDEX_EXTENDED_SKIP_WORKTREE;
+
+    *pos += get_index_entry_size(name_end - name, is_extended);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Extensions whose signature starts with an uppercase letter are optional
+// and may be dropped; any other one changes what the entries mean
+static bool read_index_extensions(index_state *index, const unsigned char *data, const size_t size, size_t pos)
+{
+    while (pos + 8 <= size)
+    {
+        const unsigned char *signature = &data[pos];
+        const uint32_t ext_size = get_be32(&data[pos + 4]);
+        validate(pos + 8 + ext_size <= size, "Truncated index extension.");
+
+        if (memcmp(signature, INDEX_EXT_SPARSE_DIRECTORIES, 4) == 0)
+        {
+            index->is_sparse = true;
+        }
+        else
+        {
+            validate(signature[0] >= 'A' && signature[0] <= 'Z',
+                "Unsupported index extension '%.4s'.", (const char *)signature);
+        }
+
+        pos += 8 + ext_size;
+    }
+
+    validate(pos == size, "Malformed index extensions.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool read_index(index_state *index)
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    *index = (index_state){ };
+
+    char index_path[PATH_MAX];
+    validate(get_git_path(index_path, PATH_MAX, "index"), "Not a git repository.");
+
+    struct stat fs;
+    if (stat(index_path, &fs) != 0)
+    {
+        validate(errno == ENOENT, "Failed to stat the index.");
+        return true;
+    }
+
+    index->mtime_sec = (uint32_t)fs.st_mtim.tv_sec;
+    index->mtime_nsec = (uint32_t)fs.st_mtim.tv_nsec;
+
+    data = map_file(index_path, &size);
+    validate(data && size >= INDEX_HEADER_SIZE + SHA_DIGEST_LENGTH, "Failed to read the index.");
+    validate(memcmp(data, INDEX_SIGNATURE, 4) == 0, "Bad index signature.");
+
+    const uint32_t version = get_be32(&data[4]);
+    validate(version == INDEX_VERSION || version == INDEX_VERSION_EXTENDED, "Unsupported index version %u.", version);
+
+    const size_t content_size = size - SHA_DIGEST_LENGTH;
+
+    // An all-zero trailer means the writer skipped the checksum
+    static const unsigned char null_hash[SHA_DIGEST_LENGTH] = { };
+    unsigned char checksum[SHA_DIGEST_LENGTH];
+
+    if (memcmp(&data[content_size], null_hash, SHA_DIGEST_LENGTH) != 0)
+    {
+        SHA1(data, content_size, checksum);
+        validate(memcmp(checksum, &data[content_size], SHA_DIGEST_LENGTH) == 0, "Index checksum mismatch.");
+    }
+
+    const uint32_t count = get_be32(&data[8]);
+    size_t pos = INDEX_HEADER_SIZE;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        validate(read_index_entry(index, data, content_size, version, &pos), "Failed to read index entry.");
+    }
+
+    validate(read_index_extensions(index, data, content_size, pos), "Failed to read index extensions.");
+
+    munmap((void *)data, size);
+
+    return true;
+
+error:
+    if (data) munmap((void *)data, size);
+    release_index(index);
+
+    return false;
+}
+
+static unsigned char *write_index_entry(unsigned char *pos, const index_entry *entry)
+{
+    const size_t path_len = strlen(entry->path);
+    const bool is_extended = entry->is_skip_worktree;
+    const size_t entry_size = get_index_entry_size(path_len, is_extended);
+
+    const uint32_t fields[] = {
+        entry->stat.ctime_sec,
+        entry->stat.ctime_nsec,
+        entry->stat.mtime_sec,
+        entry->stat.mtime_nsec,
+        entry->stat.dev,
+        entry->stat.ino,
+        entry->mode,
+        entry->stat.uid,
+        entry->stat.gid,
+        entry->stat.size,
+    };
+
+    memset(pos, 0, entry_size);
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) put_be32(&pos[4 * i], fields[i]);
+    memcpy(&pos[40], entry->hash, SHA_DIGEST_LENGTH);
+
+    // Longer names store the mask and are found by their terminating NUL
+    uint16_t flags = path_len < INDEX_ENTRY_NAME_MASK ? (uint16_t)path_len : INDEX_ENTRY_NAME_MASK;
+    if (is_extended) flags |= INDEX_ENTRY_EXTENDED;
+
+    pos[60] = flags >> 8;
+    pos[61] = flags & 0xff;
+
+    size_t name_start = INDEX_ENTRY_FIXED_SIZE;
+
+    if (is_extended)
+    {
+        pos[name_start] = INDEX_EXTENDED_SKIP_WORKTREE >> 8;
+        pos[name_start + 1] = INDEX_EXTENDED_SKIP_WORKTREE & 0xff;
+        name_start += INDEX_EXTENDED_FLAGS_SIZE;
+    }
+
+    memcpy(&pos[name_start], entry->path, path_len);
+
+    return &pos[entry_size];
+}
+
+bool write_index(const index_state *index)
+{
+    unsigned char *data = nullptr;
+    char index_path[PATH_MAX];
+
+    validate(index->count <= UINT32_MAX, "Too many index entries.");
+
+    bool is_extended = false;
+    size_t size = INDEX_HEADER_SIZE + SHA_DIGEST_LENGTH + (index->is_sparse ? 8 : 0);
+
+    for (size_t i = 0; i < index->count; i++)
+    {
+        const index_entry *entry = &index->entries[i];
+
+        size += get_index_entry_size(strlen(entry->path), entry->is_skip_worktree);
+        is_extended |= entry->is_skip_worktree;
+    }
+
+    data = malloc(size);
+    validate(data, "Failed to allocate memory.");
+
+    memcpy(data, INDEX_SIGNATURE, 4);
+    put_be32(&data[4], is_extended ? INDEX_VERSION_EXTENDED : INDEX_VERSION);
+    put_be32(&data[8], (uint32_t)index->count);
+
+    unsigned char *pos = &data[INDEX_HEADER_SIZE];
+    for (size_t i = 0; i < index->count; i++) pos = write_index_entry(pos, &index->entries[i]);
+
+    // The extension is only a marker and has no content
+    if (index->is_sparse)
+    {
+        memcpy(pos, INDEX_EXT_SPARSE_DIRECTORIES, 4);
+        put_be32(&pos[4], 0);
+        pos += 8;
+    }
+
+    SHA1(data, pos - data, pos);
+
+    validate(get_git_path(index_path, PATH_MAX, "index"), "Not a git repository.");
+    validate(replace_locked_file(index_path, data, size), "Failed to update the index.");
+
+    free(data);
+
+    return true;
+
+error:
+    if (data) free(data);
+
+    return false;
+}
+
+void release_index(index_state *index)
+{
+    for (size_t i = 0; i < index->count; i++) free(index->entries[i].path);
+    if (index->entries) free(index->entries);
+
+    *index = (index_state){ };
+}
@@ -0,0 +1,87 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include <sys/stat.h>
+
+#define INDEX_SIGNATURE "DIRC"
+#define INDEX_VERSION 2
+#define INDEX_VERSION_EXTENDED 3
+#define INDEX_HEADER_SIZE 12
+
+// Marks an index that holds sparse directory entries
+#define INDEX_EXT_SPARSE_DIRECTORIES "sdir"
+
+// What git compares against lstat() to tell whether a worktree file may
+// have changed since it was recorded. Stored as 32 bits each, truncated.
+typedef struct index_stat
+{
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t dev;
+    uint32_t ino;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+} index_stat;
+
+// A skip-worktree entry is tracked without being checked out. A sparse
+// directory entry stands for a whole subtree outside the sparse cone: its
+// path ends in '/', its mode is 040000 and its oid is the tree's.
+typedef struct index_entry
+{
+    char *path;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    unsigned int mode;
+    index_stat stat;
+    bool is_skip_worktree;
+} index_entry;
+
+// The entries of .git/index, kept in git's order: by path, compared
+// bytewise, which is the order a recursive walk of a tree yields
+typedef struct index_state
+{
+    index_entry *entries;
+    size_t count;
+    size_t capacity;
+    bool is_sparse;
+
+    // When the file was last written; entries modified in that same instant
+    // cannot be trusted to be unchanged by their stat data
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+} index_state;
+
+// Appends an entry with no stat data; entries must be added in order
+index_entry *add_index_entry(index_state *index, const char *path, const unsigned char hash[SHA_DIGEST_LENGTH], unsigned int mode);
+
+void fill_index_stat(index_stat *stat, const struct stat *fs);
+
+// Whether the file at fs is known to be unchanged since the entry was
+// recorded, going by stat data alone
+bool is_index_entry_up_to_date(const index_state *index, const index_entry *entry, const struct stat *fs);
+
+bool is_sparse_dir_entry(const index_entry *entry);
+
+// Position of the first entry whose path sorts at or after path
+size_t find_index_pos(const index_state *index, const char *path);
+
+// Writes the tree of the entries below prefix, which ends in '/', starting
+// at *pos and advancing it past them. Sparse directory entries go in as
+// the trees they stand for.
+bool write_index_tree(const index_state *index, const char *prefix, size_t prefix_len, size_t *pos, unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Reads .git/index, version 2 or 3. A missing index reads as empty.
+bool read_index(index_state *index);
+
+// Writes the index through index.lock, in version 2 format unless an entry
+// needs the extended flags of version 3
+bool write_index(const index_state *index);
+
+void release_index(index_state *index);
+
+#endif //INDEX_FILE_H
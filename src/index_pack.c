@@ -0,0 +1,142 @@
+#include "index_pack.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "pack_indexer.h"
+#include "pkt_line.h"
+#include "thread_pool.h"
+
+bool stdin_opt = false;
+char *index_output_opt = nullptr;
+long index_threads_opt = 0;
+
+static bool try_resolve_index_pack_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "stdin", no_argument, nullptr, 's' },
+        { "threads", required_argument, nullptr, 't' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                stdin_opt = true;
+                break;
+            case 'o':
+                index_output_opt = optarg;
+                break;
+            case 't':
+                index_threads_opt = strtol(optarg, nullptr, 10);
+                validate(index_threads_opt > 0, "Invalid thread count '%s'.", optarg);
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(
+        stdin_opt ? optind + 1 == argc && !index_output_opt : optind + 2 == argc,
+        "Usage: index-pack [--threads=<n>] (--stdin | [-o <index-file>] <pack-file>)");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Names the .idx after the pack, as git does: x.pack gets x.idx
+static bool get_default_idx_path(char *idx_path, const size_t idx_path_len, const char *pack_path)
+{
+    const size_t len = strlen(pack_path);
+    validate(len > 5 && strcmp(&pack_path[len - 5], ".pack") == 0, "Pack file name '%s' does not end in .pack.", pack_path);
+    validate(len < idx_path_len, "Path too long '%s'.", pack_path);
+
+    (void)snprintf(idx_path, idx_path_len, "%.*s.idx", (int)(len - 5), pack_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool index_stdin_pack(const unsigned workers, char *pack_hash_hex)
+{
+    pack_indexer indexer = { };
+
+    validate(pack_indexer_open(&indexer), "Failed to start the pack.");
+    indexer.workers = workers;
+
+    unsigned char buffer[PKT_READ_BUFFER_SIZE];
+
+    while (true)
+    {
+        const ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+
+        validate(n >= 0, "Failed to read the pack.");
+        if (n == 0) break;
+
+        validate(pack_indexer_feed(&indexer, buffer, n), "Failed to index the pack.");
+    }
+
+    validate(pack_indexer_finish(&indexer, pack_hash_hex), "Failed to finish the pack.");
+
+    return true;
+
+error:
+    pack_indexer_abort(&indexer);
+
+    return false;
+}
+
+// index-pack [--threads=<n>] (--stdin | [-o <index-file>] <pack-file>)
+// With --stdin, stores the pack stream under objects/pack, indexing it
+// while it is read, and prints "pack\t<pack-hash>". Otherwise writes the
+// .idx of an existing pack file and prints its hash. Non-delta objects are
+// hashed in one sequential pass; delta trees are then resolved by
+// pack.threads workers, one tree per worker at a time.
+int index_pack(const int argc, char *argv[])
+{
+    validate(try_resolve_index_pack_opts(argc, argv), "Failed to resolve options.");
+
+    const unsigned workers = index_threads_opt ? (unsigned)index_threads_opt : get_worker_count("pack.threads");
+    char pack_hash_hex[SHA_HEX_LENGTH + 1];
+
+    if (stdin_opt)
+    {
+        validate(index_stdin_pack(workers, pack_hash_hex), "Failed to index the pack.");
+        printf("pack\t%s\n", pack_hash_hex);
+
+        return 0;
+    }
+
+    const char *pack_path = argv[optind + 1];
+    char idx_path[PATH_MAX];
+
+    if (index_output_opt)
+        (void)snprintf(idx_path, sizeof(idx_path), "%s", index_output_opt);
+    else
+        validate(get_default_idx_path(idx_path, sizeof(idx_path), pack_path), "Failed to name the index.");
+
+    validate(pack_indexer_index_file(pack_path, idx_path, workers, pack_hash_hex), "Failed to index '%s'.", pack_path);
+    printf("%s\n", pack_hash_hex);
+
+    return 0;
+
+error:
+    return 1;
+}
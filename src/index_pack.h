@@ -0,0 +1,6 @@
+#ifndef INDEX_PACK_H
+#define INDEX_PACK_H
+
+int index_pack(int argc, char *argv[]);
+
+#endif //INDEX_PACK_H
@@ -0,0 +1,984 @@
+#include "line_diff.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "debug_helpers.h"
+
+#define BINARY_CHECK_SIZE 8000
+#define HISTOGRAM_MAX_CHAIN 64
+#define MYERS_MIN_COST_LIMIT 256
+#define FUNCNAME_MAX_LENGTH 80
+
+typedef struct line_record
+{
+    uint64_t hash;
+    const diff_line *line;
+    uint32_t id;
+} line_record;
+
+// Myers works on the lines that have a match on the other side only;
+// the rest are changed no matter what. map[] leads back to the real line.
+typedef struct myers_file
+{
+    uint32_t *ids;
+    size_t *map;
+    size_t count;
+} myers_file;
+
+typedef struct myers_ctx
+{
+    const uint32_t *a;
+    const uint32_t *b;
+    bool *changed_a;
+    bool *changed_b;
+    const size_t *map_a;
+    const size_t *map_b;
+    long *kvdf;
+    long *kvdb;
+    long max_cost;
+} myers_ctx;
+
+// Occurrences of every line of the current A range, rebuilt per range
+typedef struct histogram_ctx
+{
+    const line_diff *diff;
+    myers_ctx *myers;
+    uint32_t *counts;
+    size_t *heads;
+    size_t *next;
+} histogram_ctx;
+
+typedef struct lcs_region
+{
+    size_t begin_a;
+    size_t end_a;
+    size_t begin_b;
+    size_t end_b;
+} lcs_region;
+
+typedef struct change_group
+{
+    size_t start;
+    size_t end;
+} change_group;
+
+static uint64_t hash_line(const char *p, size_t len)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ len;
+
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+
+        p += 8;
+        len -= 8;
+    }
+
+    if (len)
+    {
+        uint64_t word = 0;
+        memcpy(&word, p, len);
+
+        hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+#if defined(__SSE2__)
+
+// Newlines are found 16 bytes at a time: compare, then walk the bit mask
+static size_t count_newlines(const char *data, const size_t size)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)&data[i]);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+
+    for (; i < size; i++) count += data[i] == '\n';
+
+    return count;
+}
+
+static size_t fill_lines(const char *data, const size_t size, diff_line *lines)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t line_start = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)&data[i]);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        while (mask)
+        {
+            const size_t line_end = i + __builtin_ctz(mask) + 1;
+            lines[count++] = (diff_line){ .start = &data[line_start], .len = line_end - line_start };
+
+            line_start = line_end;
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < size; i++)
+    {
+        if (data[i] != '\n') continue;
+
+        lines[count++] = (diff_line){ .start = &data[line_start], .len = i + 1 - line_start };
+        line_start = i + 1;
+    }
+
+    if (line_start < size)
+    {
+        lines[count++] = (diff_line){ .start = &data[line_start], .len = size - line_start };
+    }
+
+    return count;
+}
+
+#else
+
+static size_t count_newlines(const char *data, const size_t size)
+{
+    size_t count = 0;
+
+    for (const char *p = data; (p = memchr(p, '\n', data + size - p)); p++) count++;
+
+    return count;
+}
+
+static size_t fill_lines(const char *data, const size_t size, diff_line *lines)
+{
+    size_t count = 0;
+    const char *line_start = data;
+    const char *end = data + size;
+
+    while (line_start < end)
+    {
+        const char *eol = memchr(line_start, '\n', end - line_start);
+        const char *line_end = eol ? eol + 1 : end;
+
+        lines[count++] = (diff_line){ .start = line_start, .len = line_end - line_start };
+        line_start = line_end;
+    }
+
+    return count;
+}
+
+#endif
+
+static bool split_lines(line_file *file, const char *data, const size_t size)
+{
+    file->data = data;
+    file->size = size;
+
+    const size_t newlines = count_newlines(data, size);
+    const size_t capacity = newlines + 1;
+
+    file->lines = malloc(capacity * sizeof(diff_line));
+    file->ids = malloc(capacity * sizeof(uint32_t));
+    file->changed = calloc(capacity, sizeof(bool));
+    validate(file->lines && file->ids && file->changed, "Failed to allocate memory.");
+
+    file->count = fill_lines(data, size, file->lines);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Gives equal lines of both files the same id, so the algorithms compare
+// integers instead of bytes
+static bool intern_lines(line_diff *diff, uint32_t *id_count)
+{
+    const size_t total = diff->a.count + diff->b.count;
+
+    size_t capacity = 64;
+    while (capacity < total * 2) capacity *= 2;
+
+    line_record *records = calloc(capacity, sizeof(line_record));
+    validate(records, "Failed to allocate memory.");
+
+    uint32_t next_id = 0;
+    line_file *files[] = { &diff->a, &diff->b };
+
+    for (size_t f = 0; f < 2; f++)
+    {
+        line_file *file = files[f];
+
+        for (size_t i = 0; i < file->count; i++)
+        {
+            const diff_line *line = &file->lines[i];
+            const uint64_t hash = hash_line(line->start, line->len);
+
+            size_t slot = hash & (capacity - 1);
+            while (records[slot].line)
+            {
+                const line_record *record = &records[slot];
+                if (record->hash == hash
+                    && record->line->len == line->len
+                    && memcmp(record->line->start, line->start, line->len) == 0) break;
+
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            if (!records[slot].line)
+            {
+                records[slot] = (line_record){ .hash = hash, .line = line, .id = next_id++ };
+            }
+
+            file->ids[i] = records[slot].id;
+        }
+    }
+
+    free(records);
+    *id_count = next_id;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void mark_changed(bool *changed, const size_t *map, const size_t from, const size_t to)
+{
+    for (size_t i = from; i < to; i++) changed[map ? map[i] : i] = true;
+}
+
+// Finds the middle snake of the shortest edit script for a[off_a, lim_a)
+// and b[off_b, lim_b), searching from both ends at once. Past max_cost
+// edit steps it settles for the diagonal that got furthest.
+static void split_myers(const myers_ctx *ctx, const long off_a, const long lim_a, const long off_b, const long lim_b, long *mid_a, long *mid_b)
+{
+    const uint32_t *a = ctx->a;
+    const uint32_t *b = ctx->b;
+    long *kvdf = ctx->kvdf;
+    long *kvdb = ctx->kvdb;
+
+    const long dmin = off_a - lim_b;
+    const long dmax = lim_a - off_b;
+    const long fmid = off_a - off_b;
+    const long bmid = lim_a - lim_b;
+    const bool is_odd = (fmid - bmid) & 1;
+
+    long fmin = fmid;
+    long fmax = fmid;
+    long bmin = bmid;
+    long bmax = bmid;
+
+    kvdf[fmid] = off_a;
+    kvdb[bmid] = lim_a;
+
+    for (long cost = 1;; cost++)
+    {
+        if (fmin > dmin) kvdf[--fmin - 1] = -1; else ++fmin;
+        if (fmax < dmax) kvdf[++fmax + 1] = -1; else --fmax;
+
+        for (long d = fmax; d >= fmin; d -= 2)
+        {
+            long i_a = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            long i_b = i_a - d;
+
+            while (i_a < lim_a && i_b < lim_b && a[i_a] == b[i_b])
+            {
+                i_a++;
+                i_b++;
+            }
+
+            kvdf[d] = i_a;
+
+            if (is_odd && bmin <= d && d <= bmax && kvdb[d] <= i_a)
+            {
+                *mid_a = i_a;
+                *mid_b = i_b;
+                return;
+            }
+        }
+
+        if (bmin > dmin) kvdb[--bmin - 1] = LONG_MAX; else ++bmin;
+        if (bmax < dmax) kvdb[++bmax + 1] = LONG_MAX; else --bmax;
+
+        for (long d = bmax; d >= bmin; d -= 2)
+        {
+            long i_a = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            long i_b = i_a - d;
+
+            while (i_a > off_a && i_b > off_b && a[i_a - 1] == b[i_b - 1])
+            {
+                i_a--;
+                i_b--;
+            }
+
+            kvdb[d] = i_a;
+
+            if (!is_odd && fmin <= d && d <= fmax && i_a <= kvdf[d])
+            {
+                *mid_a = i_a;
+                *mid_b = i_b;
+                return;
+            }
+        }
+
+        if (cost < ctx->max_cost) continue;
+
+        long best_forward = -1;
+        long best_backward = LONG_MAX;
+        long forward_a = off_a;
+        long backward_a = lim_a;
+        long forward_d = fmid;
+        long backward_d = bmid;
+
+        for (long d = fmax; d >= fmin; d -= 2)
+        {
+            const long i_a = kvdf[d] < lim_a ? kvdf[d] : lim_a;
+            const long i_b = i_a - d;
+            if (i_b > lim_b || i_a + i_b <= best_forward) continue;
+
+            best_forward = i_a + i_b;
+            forward_a = i_a;
+            forward_d = d;
+        }
+
+        for (long d = bmax; d >= bmin; d -= 2)
+        {
+            const long i_a = kvdb[d] > off_a ? kvdb[d] : off_a;
+            const long i_b = i_a - d;
+            if (i_b < off_b || i_a + i_b >= best_backward) continue;
+
+            best_backward = i_a + i_b;
+            backward_a = i_a;
+            backward_d = d;
+        }
+
+        if (best_forward - (off_a + off_b) >= (lim_a + lim_b) - best_backward)
+        {
+            *mid_a = forward_a;
+            *mid_b = forward_a - forward_d;
+        }
+        else
+        {
+            *mid_a = backward_a;
+            *mid_b = backward_a - backward_d;
+        }
+
+        return;
+    }
+}
+
+static void compare_myers(const myers_ctx *ctx, long off_a, long lim_a, long off_b, long lim_b)
+{
+    while (off_a < lim_a && off_b < lim_b && ctx->a[off_a] == ctx->b[off_b])
+    {
+        off_a++;
+        off_b++;
+    }
+
+    while (off_a < lim_a && off_b < lim_b && ctx->a[lim_a - 1] == ctx->b[lim_b - 1])
+    {
+        lim_a--;
+        lim_b--;
+    }
+
+    if (off_a == lim_a || off_b == lim_b)
+    {
+        mark_changed(ctx->changed_a, ctx->map_a, off_a, lim_a);
+        mark_changed(ctx->changed_b, ctx->map_b, off_b, lim_b);
+        return;
+    }
+
+    long mid_a;
+    long mid_b;
+    split_myers(ctx, off_a, lim_a, off_b, lim_b, &mid_a, &mid_b);
+
+    // A split that makes no progress would recurse forever
+    if ((mid_a == off_a && mid_b == off_b) || (mid_a == lim_a && mid_b == lim_b))
+    {
+        mark_changed(ctx->changed_a, ctx->map_a, off_a, lim_a);
+        mark_changed(ctx->changed_b, ctx->map_b, off_b, lim_b);
+        return;
+    }
+
+    compare_myers(ctx, off_a, mid_a, off_b, mid_b);
+    compare_myers(ctx, mid_a, lim_a, mid_b, lim_b);
+}
+
+static long isqrt(const long value)
+{
+    long root = 1;
+    while (root * root < value) root <<= 1;
+
+    return root;
+}
+
+// Lines without a counterpart on the other side can never be matched, so
+// they are marked up front and the search space shrinks accordingly
+static bool build_myers_file(const line_file *file, const size_t from, const size_t to, const uint32_t *other_counts, bool *changed, myers_file *out)
+{
+    out->ids = malloc((to - from + 1) * sizeof(uint32_t));
+    out->map = malloc((to - from + 1) * sizeof(size_t));
+    validate(out->ids && out->map, "Failed to allocate memory.");
+
+    out->count = 0;
+
+    for (size_t i = from; i < to; i++)
+    {
+        if (!other_counts[file->ids[i]])
+        {
+            changed[i] = true;
+            continue;
+        }
+
+        out->ids[out->count] = file->ids[i];
+        out->map[out->count] = i;
+        out->count++;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool diff_range_myers(const line_diff *diff, const size_t a_from, const size_t a_to, const size_t b_from, const size_t b_to, const uint32_t id_count)
+{
+    uint32_t *counts_a = calloc(id_count + 1, sizeof(uint32_t));
+    uint32_t *counts_b = calloc(id_count + 1, sizeof(uint32_t));
+    myers_file file_a = { };
+    myers_file file_b = { };
+    long *kvd = nullptr;
+
+    validate(counts_a && counts_b, "Failed to allocate memory.");
+
+    for (size_t i = a_from; i < a_to; i++) counts_a[diff->a.ids[i]]++;
+    for (size_t i = b_from; i < b_to; i++) counts_b[diff->b.ids[i]]++;
+
+    validate(build_myers_file(&diff->a, a_from, a_to, counts_b, diff->a.changed, &file_a), "Failed to prepare diff.");
+    validate(build_myers_file(&diff->b, b_from, b_to, counts_a, diff->b.changed, &file_b), "Failed to prepare diff.");
+
+    const long diagonals = (long)(file_a.count + file_b.count) + 3;
+    kvd = malloc(2 * diagonals * sizeof(long));
+    validate(kvd, "Failed to allocate memory.");
+
+    long max_cost = isqrt(diagonals);
+    if (max_cost < MYERS_MIN_COST_LIMIT) max_cost = MYERS_MIN_COST_LIMIT;
+
+    const myers_ctx ctx = {
+        .a = file_a.ids,
+        .b = file_b.ids,
+        .changed_a = diff->a.changed,
+        .changed_b = diff->b.changed,
+        .map_a = file_a.map,
+        .map_b = file_b.map,
+        .kvdf = kvd + file_b.count + 1,
+        .kvdb = kvd + diagonals + file_b.count + 1,
+        .max_cost = max_cost,
+    };
+
+    compare_myers(&ctx, 0, (long)file_a.count, 0, (long)file_b.count);
+
+    free(kvd);
+    free(file_a.ids);
+    free(file_a.map);
+    free(file_b.ids);
+    free(file_b.map);
+    free(counts_a);
+    free(counts_b);
+
+    return true;
+
+error:
+    if (kvd) free(kvd);
+    if (file_a.ids) free(file_a.ids);
+    if (file_a.map) free(file_a.map);
+    if (file_b.ids) free(file_b.ids);
+    if (file_b.map) free(file_b.map);
+    if (counts_a) free(counts_a);
+    if (counts_b) free(counts_b);
+
+    return false;
+}
+
+// The longest common run in the ranges, preferring runs made of lines that
+// are rare in A. Returns false when every common line is too frequent.
+static bool find_lcs(const histogram_ctx *ctx, const size_t a_from, const size_t a_to, const size_t b_from, const size_t b_to, lcs_region *lcs, bool *has_common)
+{
+    const uint32_t *a = ctx->diff->a.ids;
+    const uint32_t *b = ctx->diff->b.ids;
+
+    uint32_t best_count = HISTOGRAM_MAX_CHAIN + 1;
+    *has_common = false;
+    lcs->begin_a = lcs->end_a = 0;
+    lcs->begin_b = lcs->end_b = 0;
+    bool has_lcs = false;
+
+    for (size_t i = a_to; i-- > a_from;)
+    {
+        const uint32_t id = a[i];
+        ctx->next[i] = ctx->heads[id];
+        ctx->heads[id] = i;
+        ctx->counts[id]++;
+    }
+
+    for (size_t b_pos = b_from; b_pos < b_to;)
+    {
+        const uint32_t id = b[b_pos];
+        size_t b_next = b_pos + 1;
+
+        if (!ctx->counts[id])
+        {
+            b_pos = b_next;
+            continue;
+        }
+
+        *has_common = true;
+
+        if (ctx->counts[id] > best_count)
+        {
+            b_pos = b_next;
+            continue;
+        }
+
+        for (size_t a_pos = ctx->heads[id]; a_pos != SIZE_MAX;)
+        {
+            size_t begin_a = a_pos;
+            size_t begin_b = b_pos;
+            size_t end_a = a_pos + 1;
+            size_t end_b = b_pos + 1;
+            uint32_t run_count = ctx->counts[id];
+
+            while (begin_a > a_from && begin_b > b_from && a[begin_a - 1] == b[begin_b - 1])
+            {
+                begin_a--;
+                begin_b--;
+                if (ctx->counts[a[begin_a]] < run_count) run_count = ctx->counts[a[begin_a]];
+            }
+
+            while (end_a < a_to && end_b < b_to && a[end_a] == b[end_b])
+            {
+                if (ctx->counts[a[end_a]] < run_count) run_count = ctx->counts[a[end_a]];
+                end_a++;
+                end_b++;
+            }
+
+            if (b_next < end_b) b_next = end_b;
+
+            if (!has_lcs || lcs->end_a - lcs->begin_a < end_a - begin_a || run_count < best_count)
+            {
+                *lcs = (lcs_region){ .begin_a = begin_a, .end_a = end_a, .begin_b = begin_b, .end_b = end_b };
+                best_count = run_count;
+                has_lcs = true;
+            }
+
+            // Occurrences inside the run just found would only find it again
+            do a_pos = ctx->next[a_pos];
+            while (a_pos != SIZE_MAX && a_pos < end_a);
+        }
+
+        b_pos = b_next;
+    }
+
+    for (size_t i = a_from; i < a_to; i++)
+    {
+        ctx->heads[a[i]] = SIZE_MAX;
+        ctx->counts[a[i]] = 0;
+    }
+
+    return has_lcs;
+}
+
+static bool diff_range_histogram(const histogram_ctx *ctx, const size_t a_from, const size_t a_to, const size_t b_from, const size_t b_to, const uint32_t id_count)
+{
+    if (a_from == a_to || b_from == b_to)
+    {
+        mark_changed(ctx->diff->a.changed, nullptr, a_from, a_to);
+        mark_changed(ctx->diff->b.changed, nullptr, b_from, b_to);
+        return true;
+    }
+
+    lcs_region lcs;
+    bool has_common;
+
+    if (!find_lcs(ctx, a_from, a_to, b_from, b_to, &lcs, &has_common))
+    {
+        if (has_common) return diff_range_myers(ctx->diff, a_from, a_to, b_from, b_to, id_count);
+
+        mark_changed(ctx->diff->a.changed, nullptr, a_from, a_to);
+        mark_changed(ctx->diff->b.changed, nullptr, b_from, b_to);
+        return true;
+    }
+
+    return diff_range_histogram(ctx, a_from, lcs.begin_a, b_from, lcs.begin_b, id_count)
+           && diff_range_histogram(ctx, lcs.end_a, a_to, lcs.end_b, b_to, id_count);
+}
+
+static bool diff_range_with_histogram(const line_diff *diff, const size_t a_from, const size_t a_to, const size_t b_from, const size_t b_to, const uint32_t id_count)
+{
+    histogram_ctx ctx = {
+        .diff = diff,
+        .counts = calloc(id_count + 1, sizeof(uint32_t)),
+        .heads = malloc((id_count + 1) * sizeof(size_t)),
+        .next = malloc((diff->a.count + 1) * sizeof(size_t)),
+    };
+
+    validate(ctx.counts && ctx.heads && ctx.next, "Failed to allocate memory.");
+
+    for (size_t i = 0; i <= id_count; i++) ctx.heads[i] = SIZE_MAX;
+
+    validate(diff_range_histogram(&ctx, a_from, a_to, b_from, b_to, id_count), "Histogram diff failed.");
+
+    free(ctx.counts);
+    free(ctx.heads);
+    free(ctx.next);
+
+    return true;
+
+error:
+    if (ctx.counts) free(ctx.counts);
+    if (ctx.heads) free(ctx.heads);
+    if (ctx.next) free(ctx.next);
+
+    return false;
+}
+
+static bool is_changed(const line_file *file, const size_t i)
+{
+    return i < file->count && file->changed[i];
+}
+
+static void first_group(const line_file *file, change_group *group)
+{
+    group->start = group->end = 0;
+    while (is_changed(file, group->end)) group->end++;
+}
+
+static bool next_group(const line_file *file, change_group *group)
+{
+    if (group->end == file->count) return false;
+
+    group->start = group->end + 1;
+    for (group->end = group->start; is_changed(file, group->end); group->end++);
+
+    return true;
+}
+
+static bool previous_group(const line_file *file, change_group *group)
+{
+    if (group->start == 0) return false;
+
+    group->end = group->start - 1;
+    for (group->start = group->end; group->start > 0 && is_changed(file, group->start - 1); group->start--);
+
+    return true;
+}
+
+// Sliding may run into a neighbouring group, which then joins this one
+static bool slide_group_down(const line_file *file, change_group *group)
+{
+    if (group->end >= file->count || file->ids[group->start] != file->ids[group->end]) return false;
+
+    file->changed[group->start++] = false;
+    file->changed[group->end++] = true;
+    while (is_changed(file, group->end)) group->end++;
+
+    return true;
+}
+
+static bool slide_group_up(const line_file *file, change_group *group)
+{
+    if (group->start == 0 || file->ids[group->start - 1] != file->ids[group->end - 1]) return false;
+
+    file->changed[--group->start] = true;
+    file->changed[--group->end] = false;
+    while (group->start > 0 && is_changed(file, group->start - 1)) group->start--;
+
+    return true;
+}
+
+// Moves every group of changed lines as far down as the content allows,
+// unless it can line up with a change in the other file, so equivalent
+// edits always come out the same way. This is git's compaction without
+// the indent heuristic.
+static void compact_changes(const line_file *file, const line_file *other)
+{
+    change_group group;
+    change_group other_group;
+    first_group(file, &group);
+    first_group(other, &other_group);
+
+    do
+    {
+        if (group.end == group.start) continue;
+
+        size_t earliest_end;
+        bool has_other_match;
+        size_t group_size;
+
+        do
+        {
+            group_size = group.end - group.start;
+            has_other_match = false;
+
+            while (slide_group_up(file, &group)) previous_group(other, &other_group);
+
+            earliest_end = group.end;
+            if (other_group.end > other_group.start) has_other_match = true;
+
+            while (slide_group_down(file, &group))
+            {
+                next_group(other, &other_group);
+                if (other_group.end > other_group.start) has_other_match = true;
+            }
+        }
+        while (group_size != group.end - group.start);
+
+        if (group.end != earliest_end && has_other_match)
+        {
+            while (other_group.end == other_group.start)
+            {
+                slide_group_up(file, &group);
+                previous_group(other, &other_group);
+            }
+        }
+    }
+    while (next_group(file, &group) && next_group(other, &other_group));
+}
+
+bool compute_line_diff(
+    line_diff *diff,
+    const char *a_data,
+    const size_t a_size,
+    const char *b_data,
+    const size_t b_size,
+    const diff_algorithm algorithm)
+{
+    *diff = (line_diff){ };
+
+    validate(split_lines(&diff->a, a_data, a_size), "Failed to split lines.");
+    validate(split_lines(&diff->b, b_data, b_size), "Failed to split lines.");
+
+    uint32_t id_count;
+    validate(intern_lines(diff, &id_count), "Failed to index lines.");
+
+    // The unchanged head and tail never reach the algorithms
+    size_t a_from = 0;
+    size_t b_from = 0;
+    size_t a_to = diff->a.count;
+    size_t b_to = diff->b.count;
+
+    while (a_from < a_to && b_from < b_to && diff->a.ids[a_from] == diff->b.ids[b_from])
+    {
+        a_from++;
+        b_from++;
+    }
+
+    while (a_from < a_to && b_from < b_to && diff->a.ids[a_to - 1] == diff->b.ids[b_to - 1])
+    {
+        a_to--;
+        b_to--;
+    }
+
+    const bool result = algorithm == DIFF_ALGORITHM_HISTOGRAM
+        ? diff_range_with_histogram(diff, a_from, a_to, b_from, b_to, id_count)
+        : diff_range_myers(diff, a_from, a_to, b_from, b_to, id_count);
+    validate(result, "Failed to diff lines.");
+
+    compact_changes(&diff->a, &diff->b);
+    compact_changes(&diff->b, &diff->a);
+
+    return true;
+
+error:
+    release_line_diff(diff);
+
+    return false;
+}
+
+static void release_line_file(line_file *file)
+{
+    if (file->lines) free(file->lines);
+    if (file->ids) free(file->ids);
+    if (file->changed) free(file->changed);
+
+    *file = (line_file){ };
+}
+
+void release_line_diff(line_diff *diff)
+{
+    release_line_file(&diff->a);
+    release_line_file(&diff->b);
+}
+
+bool is_binary_content(const char *data, const size_t size)
+{
+    return memchr(data, '\0', size < BINARY_CHECK_SIZE ? size : BINARY_CHECK_SIZE) != nullptr;
+}
+
+bool collect_change_regions(const line_diff *diff, change_region **regions, size_t *count)
+{
+    size_t capacity = 16;
+    *regions = malloc(capacity * sizeof(change_region));
+    validate(*regions, "Failed to allocate memory.");
+
+    *count = 0;
+
+    // Unchanged lines pair up one to one, in order
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < diff->a.count || j < diff->b.count)
+    {
+        const bool is_a_changed = i < diff->a.count && diff->a.changed[i];
+        const bool is_b_changed = j < diff->b.count && diff->b.changed[j];
+
+        if (!is_a_changed && !is_b_changed)
+        {
+            i++;
+            j++;
+            continue;
+        }
+
+        change_region region = { .a_start = i, .b_start = j };
+        while (i < diff->a.count && diff->a.changed[i]) i++;
+        while (j < diff->b.count && diff->b.changed[j]) j++;
+        region.a_end = i;
+        region.b_end = j;
+
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            change_region *grown = realloc(*regions, capacity * sizeof(change_region));
+            validate(grown, "Failed to allocate memory.");
+            *regions = grown;
+        }
+
+        (*regions)[(*count)++] = region;
+    }
+
+    return true;
+
+error:
+    if (*regions) free(*regions);
+    *regions = nullptr;
+
+    return false;
+}
+
+static void write_line(FILE *out, const char prefix, const diff_line *line)
+{
+    fputc(prefix, out);
+    fwrite(line->start, 1, line->len, out);
+
+    if (line->len == 0 || line->start[line->len - 1] != '\n')
+    {
+        fputs("\n\\ No newline at end of file\n", out);
+    }
+}
+
+static void write_range(FILE *out, const size_t start, const size_t count)
+{
+    if (count == 1)
+    {
+        fprintf(out, "%zu", start + 1);
+    }
+    else
+    {
+        // An empty range names the line before it
+        fprintf(out, "%zu,%zu", count ? start + 1 : start, count);
+    }
+}
+
+// Like git's default funcname: the closest line above the hunk that starts
+// with a letter, '_' or '$'
+static void write_funcname(FILE *out, const line_file *file, const size_t hunk_start)
+{
+    for (size_t i = hunk_start; i-- > 0;)
+    {
+        const diff_line *line = &file->lines[i];
+        if (!line->len) continue;
+
+        const unsigned char first = line->start[0];
+        if (!isalpha(first) && first != '_' && first != '$') continue;
+
+        size_t len = line->len < FUNCNAME_MAX_LENGTH ? line->len : FUNCNAME_MAX_LENGTH;
+        while (len && isspace((unsigned char)line->start[len - 1])) len--;
+
+        fputc(' ', out);
+        fwrite(line->start, 1, len, out);
+        return;
+    }
+}
+
+bool write_unified_diff(FILE *out, const line_diff *diff, const unsigned int context)
+{
+    change_region *regions = nullptr;
+    size_t region_count;
+    validate(collect_change_regions(diff, &regions, &region_count), "Failed to collect changes.");
+
+    size_t first = 0;
+    while (first < region_count)
+    {
+        // Regions closer than two contexts apart share a hunk
+        size_t last = first;
+        while (last + 1 < region_count && regions[last + 1].a_start - regions[last].a_end <= 2 * (size_t)context) last++;
+
+        const size_t lead = regions[first].a_start < context ? regions[first].a_start : context;
+        const size_t a_tail_room = diff->a.count - regions[last].a_end;
+        const size_t trail = a_tail_room < context ? a_tail_room : context;
+
+        const size_t a_start = regions[first].a_start - lead;
+        const size_t b_start = regions[first].b_start - lead;
+        const size_t a_end = regions[last].a_end + trail;
+        const size_t b_end = regions[last].b_end + trail;
+
+        fputs("@@ -", out);
+        write_range(out, a_start, a_end - a_start);
+        fputs(" +", out);
+        write_range(out, b_start, b_end - b_start);
+        fputs(" @@", out);
+        write_funcname(out, &diff->a, a_start);
+        fputc('\n', out);
+
+        size_t a_pos = a_start;
+        for (size_t r = first; r <= last; r++)
+        {
+            const change_region *region = &regions[r];
+
+            for (; a_pos < region->a_start; a_pos++) write_line(out, ' ', &diff->a.lines[a_pos]);
+            for (size_t i = region->a_start; i < region->a_end; i++) write_line(out, '-', &diff->a.lines[i]);
+            for (size_t i = region->b_start; i < region->b_end; i++) write_line(out, '+', &diff->b.lines[i]);
+
+            a_pos = region->a_end;
+        }
+
+        for (; a_pos < a_end; a_pos++) write_line(out, ' ', &diff->a.lines[a_pos]);
+
+        first = last + 1;
+    }
+
+    free(regions);
+
+    return ferror(out) == 0;
+
+error:
+    return false;
+}
@@ -0,0 +1,68 @@
+#ifndef LINE_DIFF_H
+#define LINE_DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DEFAULT_DIFF_CONTEXT 3
+
+typedef enum diff_algorithm
+{
+    DIFF_ALGORITHM_MYERS,
+    DIFF_ALGORITHM_HISTOGRAM,
+} diff_algorithm;
+
+typedef struct diff_line
+{
+    const char *start;
+    size_t len;
+} diff_line;
+
+// Lines point into the caller's buffer, which has to outlive the diff.
+// Equal lines share an id, and changed[] is the result of the diff.
+typedef struct line_file
+{
+    const char *data;
+    size_t size;
+    diff_line *lines;
+    uint32_t *ids;
+    bool *changed;
+    size_t count;
+} line_file;
+
+typedef struct line_diff
+{
+    line_file a;
+    line_file b;
+} line_diff;
+
+// Lines [a_start, a_end) were replaced by [b_start, b_end)
+typedef struct change_region
+{
+    size_t a_start;
+    size_t a_end;
+    size_t b_start;
+    size_t b_end;
+} change_region;
+
+bool compute_line_diff(
+    line_diff *diff,
+    const char *a_data,
+    size_t a_size,
+    const char *b_data,
+    size_t b_size,
+    diff_algorithm algorithm);
+
+void release_line_diff(line_diff *diff);
+
+// The changed lines of a computed diff as regions, in order. The caller
+// frees the array.
+bool collect_change_regions(const line_diff *diff, change_region **regions, size_t *count);
+
+bool is_binary_content(const char *data, size_t size);
+
+// Writes the hunks of a computed diff, without file headers
+bool write_unified_diff(FILE *out, const line_diff *diff, unsigned int context);
+
+#endif //LINE_DIFF_H
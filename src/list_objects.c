@@ -0,0 +1,599 @@
+#include "list_objects.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "oid_map.h"
+#include "pack_bitmap.h"
+#include "tree_walk.h"
+
+// Tags and other objects named as wants are listed while peeling, apart
+// from the walk's own result
+typedef struct list_objects_state
+{
+    object_list *result;
+    object_list named;
+} list_objects_state;
+
+void object_list_destroy(object_list *list)
+{
+    if (list->items) free(list->items);
+
+    *list = (object_list){ };
+}
+
+bool object_list_append(object_list *list, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type)
+{
+    if (list->count == list->capacity)
+    {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+
+        listed_object *items = realloc(list->items, capacity * sizeof(listed_object));
+        validate(items, "Failed to allocate memory.");
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    listed_object *item = &list->items[list->count++];
+    memcpy(item->hash, hash, SHA_DIGEST_LENGTH);
+    item->type = type;
+    item->name_hash = 0;
+
+    return true;
+
+error:
+    return false;
+}
+
+// The content is only needed for tags; for anything else the header is read
+static object_type read_object_type(const unsigned char hash[SHA_DIGEST_LENGTH], char **content)
+{
+    *content = nullptr;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    (void)get_object_content(hex, content);
+    if (!*content) return OBJ_NONE;
+
+    char type_name[16];
+    get_object_type(type_name, *content);
+
+    return object_type_from_name(type_name);
+}
+
+unsigned char *peel_tag(const unsigned char hash[SHA_DIGEST_LENGTH], unsigned char target[SHA_DIGEST_LENGTH])
+{
+    char *content = nullptr;
+
+    if (read_object_type(hash, &content) != OBJ_TAG) goto error;
+
+    const char *body = &content[get_header_size(content) + 1];
+    validate(strncmp(body, "object ", 7) == 0, "Malformed tag.");
+    validate(hash_hex_to_bytes(target, &body[7]), "Malformed tag.");
+
+    free(content);
+
+    return target;
+
+error:
+    if (content) free(content);
+
+    return nullptr;
+}
+
+bool init_object_walk(object_walk *walk)
+{
+    *walk = (object_walk){ .max_count = -1 };
+
+    commit_list_init(&walk->wants);
+    commit_list_init(&walk->haves);
+    commit_list_init(&walk->shown);
+    commit_list_init(&walk->boundary);
+
+    return oid_map_init(&walk->seen_objects, 1024);
+}
+
+void release_object_walk(object_walk *walk)
+{
+    if (walk->flags) free(walk->flags);
+
+    commit_list_destroy(&walk->wants);
+    commit_list_destroy(&walk->haves);
+    commit_list_destroy(&walk->shown);
+    commit_list_destroy(&walk->boundary);
+    if (walk->seen_objects.entries) oid_map_destroy(&walk->seen_objects);
+
+    walk->flags = nullptr;
+    walk->flags_capacity = 0;
+}
+
+static uint8_t *get_flags(object_walk *walk, const commit *commit)
+{
+    if (commit->index >= walk->flags_capacity)
+    {
+        size_t capacity = walk->flags_capacity ? walk->flags_capacity : 1024;
+        while (capacity <= commit->index) capacity *= 2;
+
+        uint8_t *grown = realloc(walk->flags, capacity);
+        validate(grown, "Failed to allocate memory.");
+
+        memset(&grown[walk->flags_capacity], 0, capacity - walk->flags_capacity);
+        walk->flags = grown;
+        walk->flags_capacity = capacity;
+    }
+
+    return &walk->flags[commit->index];
+
+error:
+    return nullptr;
+}
+
+uint8_t get_object_walk_flags(const object_walk *walk, const commit *commit)
+{
+    return commit->index < walk->flags_capacity ? walk->flags[commit->index] : 0;
+}
+
+static uint32_t get_parent_count(const object_walk *walk, const commit *commit)
+{
+    return walk->shallow && oid_map_contains(walk->shallow, commit->hash) ? 0 : commit->parent_count;
+}
+
+static bool queue_start(object_walk *walk, commit_queue *queue, commit *commit, const uint8_t new_flags)
+{
+    uint8_t *flags = get_flags(walk, commit);
+    validate(flags, "Failed to grow flags.");
+
+    const bool is_seen = *flags & WALK_SEEN;
+    *flags |= WALK_SEEN | new_flags;
+
+    if (!is_seen) validate(commit_queue_put(queue, commit), "Failed to queue commit.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// A commit found uninteresting after it was walked passes that on to the
+// ancestors it already queued or showed
+static bool mark_parents_uninteresting(object_walk *walk, commit *commit)
+{
+    commit_list stack;
+    commit_list_init(&stack);
+
+    validate(commit_list_append(&stack, commit), "Failed to add commit.");
+
+    while (stack.count)
+    {
+        const struct commit *current = stack.items[--stack.count];
+
+        for (uint32_t i = 0; i < get_parent_count(walk, current); i++)
+        {
+            struct commit *parent = current->parents[i];
+
+            uint8_t *flags = get_flags(walk, parent);
+            validate(flags, "Failed to grow flags.");
+
+            if (*flags & WALK_UNINTERESTING) continue;
+
+            *flags |= WALK_UNINTERESTING;
+
+            // Parents of unparsed commits are marked once they are walked
+            if (parent->is_parsed) validate(commit_list_append(&stack, parent), "Failed to add commit.");
+        }
+    }
+
+    commit_list_destroy(&stack);
+
+    return true;
+
+error:
+    commit_list_destroy(&stack);
+
+    return false;
+}
+
+static bool is_everybody_uninteresting(const object_walk *walk, const commit_queue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        if (!(get_object_walk_flags(walk, queue->commits[i]) & WALK_UNINTERESTING)) return false;
+    }
+
+    return true;
+}
+
+static bool has_enough_shown(const object_walk *walk)
+{
+    // Commits shown early may turn out uninteresting when there are haves
+    return walk->max_count >= 0 && !walk->haves.count && walk->shown.count >= (size_t)walk->max_count;
+}
+
+// Newest first, until only uninteresting commits are left to walk.
+// Whatever turned out uninteresting on the way is dropped at the end.
+bool walk_commits(object_walk *walk)
+{
+    commit_queue queue;
+    commit_queue_init(&queue);
+
+    for (size_t i = 0; i < walk->haves.count; i++)
+    {
+        validate(parse_commit(walk->haves.items[i]), "Failed to parse commit.");
+        validate(queue_start(walk, &queue, walk->haves.items[i], WALK_UNINTERESTING | WALK_BOTTOM), "Failed to queue commit.");
+    }
+
+    for (size_t i = 0; i < walk->wants.count; i++)
+    {
+        validate(parse_commit(walk->wants.items[i]), "Failed to parse commit.");
+        validate(queue_start(walk, &queue, walk->wants.items[i], 0), "Failed to queue commit.");
+    }
+
+    while (queue.count && !is_everybody_uninteresting(walk, &queue) && !has_enough_shown(walk))
+    {
+        commit *commit = commit_queue_get(&queue);
+        const bool is_uninteresting = get_object_walk_flags(walk, commit) & WALK_UNINTERESTING;
+        struct commit *followed = nullptr;
+
+        if (is_uninteresting)
+        {
+            validate(mark_parents_uninteresting(walk, commit), "Failed to mark commits.");
+            validate(commit_list_append(&walk->boundary, commit), "Failed to add commit.");
+        }
+        else
+        {
+            bool is_treesame = false;
+            if (walk->simplify) validate(walk->simplify(walk, commit, &is_treesame, &followed), "Failed to simplify commit.");
+
+            if (!is_treesame) validate(commit_list_append(&walk->shown, commit), "Failed to add commit.");
+        }
+
+        for (uint32_t i = 0; i < get_parent_count(walk, commit); i++)
+        {
+            struct commit *parent = commit->parents[i];
+            if (followed && parent != followed) continue;
+
+            validate(parse_commit(parent), "Failed to parse commit.");
+            validate(queue_start(walk, &queue, parent, is_uninteresting ? WALK_UNINTERESTING : 0), "Failed to queue commit.");
+        }
+    }
+
+    // Uninteresting commits still queued bound the walk as well
+    for (size_t i = 0; i < queue.count; i++)
+    {
+        if (!(get_object_walk_flags(walk, queue.commits[i]) & WALK_UNINTERESTING)) continue;
+
+        validate(commit_list_append(&walk->boundary, queue.commits[i]), "Failed to add commit.");
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < walk->shown.count; i++)
+    {
+        if (walk->max_count >= 0 && kept == (size_t)walk->max_count) break;
+        if (!(get_object_walk_flags(walk, walk->shown.items[i]) & WALK_UNINTERESTING)) walk->shown.items[kept++] = walk->shown.items[i];
+    }
+
+    walk->shown.count = kept;
+
+    commit_queue_destroy(&queue);
+
+    return true;
+
+error:
+    commit_queue_destroy(&queue);
+
+    return false;
+}
+
+bool walk_tree_objects(
+    object_walk *walk,
+    const unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    char *path,
+    const size_t path_len,
+    const bool is_hidden)
+{
+    tree_desc desc;
+    git_tree_node node = { };
+
+    validate(init_tree_desc(&desc, tree_hash), "Failed to read tree.");
+
+    while (tree_desc_next(&desc, &node))
+    {
+        const unsigned int mode = get_tree_node_mode(&node);
+        if ((mode & 0170000) == TREE_MODE_GITLINK) continue;
+        if (oid_map_contains(&walk->seen_objects, node.hash)) continue;
+
+        validate(oid_map_put(&walk->seen_objects, node.hash, 0), "Failed to mark object.");
+
+        const size_t name_len = strlen(node.name);
+        validate(path_len + name_len + 2 < PATH_MAX, "Path too long.");
+
+        if (path_len) path[path_len] = '/';
+        memcpy(&path[path_len + (path_len ? 1 : 0)], node.name, name_len + 1);
+        const size_t entry_path_len = path_len + (path_len ? 1 : 0) + name_len;
+
+        const bool is_tree = is_tree_mode(mode);
+        const bool is_filtered = !is_tree && walk->filter == LIST_FILTER_BLOB_NONE;
+
+        if (!is_hidden && !is_filtered)
+        {
+            validate(walk->show_object(walk, node.hash, is_tree ? OBJ_TREE : OBJ_BLOB, path), "Failed to show object.");
+        }
+
+        if (is_tree)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            memcpy(hash, node.hash, SHA_DIGEST_LENGTH);
+
+            validate(walk_tree_objects(walk, hash, path, entry_path_len, is_hidden), "Failed to walk tree.");
+        }
+
+        path[path_len] = '\0';
+    }
+
+    clear_git_tree_node(&node);
+    release_tree_desc(&desc);
+
+    return true;
+
+error:
+    clear_git_tree_node(&node);
+    release_tree_desc(&desc);
+
+    return false;
+}
+
+bool walk_commit_trees(object_walk *walk)
+{
+    char path[PATH_MAX] = "";
+
+    // Everything under a boundary tree is there on the other side already
+    for (size_t i = 0; i < walk->boundary.count; i++)
+    {
+        const commit *commit = walk->boundary.items[i];
+        if (oid_map_contains(&walk->seen_objects, commit->tree_hash)) continue;
+
+        validate(oid_map_put(&walk->seen_objects, commit->tree_hash, 0), "Failed to mark object.");
+        validate(walk_tree_objects(walk, commit->tree_hash, path, 0, true), "Failed to walk tree.");
+    }
+
+    for (size_t i = 0; i < walk->shown.count; i++)
+    {
+        const commit *commit = walk->shown.items[i];
+        if (oid_map_contains(&walk->seen_objects, commit->tree_hash)) continue;
+
+        validate(oid_map_put(&walk->seen_objects, commit->tree_hash, 0), "Failed to mark object.");
+        validate(walk->show_object(walk, commit->tree_hash, OBJ_TREE, ""), "Failed to show object.");
+        validate(walk_tree_objects(walk, commit->tree_hash, path, 0, false), "Failed to walk tree.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Tags are listed as they are peeled, down to the commit they name
+static bool add_want(object_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    list_objects_state *state = walk->data;
+
+    unsigned char current[SHA_DIGEST_LENGTH];
+    memcpy(current, hash, SHA_DIGEST_LENGTH);
+
+    while (true)
+    {
+        char *content;
+        const object_type type = read_object_type(current, &content);
+        validate(type != OBJ_NONE, "Missing object wanted.");
+        free(content);
+
+        if (oid_map_contains(&walk->seen_objects, current)) return true;
+
+        if (type == OBJ_COMMIT)
+        {
+            commit *commit = lookup_commit(current);
+            validate(commit && parse_commit(commit), "Failed to parse commit.");
+
+            return commit_list_append(&walk->wants, commit);
+        }
+
+        validate(oid_map_put(&walk->seen_objects, current, 0), "Failed to mark object.");
+        validate(object_list_append(&state->named, current, type), "Failed to list object.");
+
+        if (type != OBJ_TAG) return true;
+
+        validate(peel_tag(current, current), "Failed to peel tag.");
+    }
+
+error:
+    return false;
+}
+
+static bool add_have(object_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    unsigned char target[SHA_DIGEST_LENGTH];
+    const unsigned char *current = peel_tag(hash, target) ? target : hash;
+
+    char *content;
+    const object_type type = read_object_type(current, &content);
+    if (content) free(content);
+
+    if (type != OBJ_COMMIT) return true;
+
+    commit *commit = lookup_commit(current);
+    validate(commit && parse_commit(commit), "Failed to parse commit.");
+
+    return commit_list_append(&walk->haves, commit);
+
+error:
+    return false;
+}
+
+// Git's pack name hash: whitespace is skipped and later characters weigh
+// most, so files with the same ending sort together
+static uint32_t get_name_hash(const char *name)
+{
+    uint32_t hash = 0;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+    {
+        if (isspace(*c)) continue;
+
+        hash = (hash >> 2) + ((uint32_t)*c << 24);
+    }
+
+    return hash;
+}
+
+static bool list_object(object_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, const char *path)
+{
+    object_list *result = ((list_objects_state *)walk->data)->result;
+
+    validate(object_list_append(result, hash, type), "Failed to list object.");
+
+    const char *name = strrchr(path, '/');
+    result->items[result->count - 1].name_hash = get_name_hash(name ? name + 1 : path);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool list_bitmap_objects(const pack_bitmap_index *index, const bitmap *reached, const bitmap *type_bitmap, const object_type type, object_list *result)
+{
+    for (size_t pos = 0; bitmap_next_set(reached, &pos); pos++)
+    {
+        if (!bitmap_get(type_bitmap, pos)) continue;
+
+        validate(object_list_append(result, get_bitmap_object_hash(index, (uint32_t)pos), type), "Failed to list object.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Reachability as set operations on the pack's bitmap. Returns false,
+// with nothing listed, when there is no bitmap or it does not cover the
+// request; trees named directly always take the walk.
+static bool try_list_with_bitmap(const object_walk *walk, const object_list *named, object_list *result)
+{
+    bitmap reached = { };
+
+    pack_bitmap_index *index = get_pack_bitmap_index();
+    if (!index) return false;
+
+    for (size_t i = 0; i < named->count; i++)
+    {
+        if (named->items[i].type == OBJ_TREE) return false;
+    }
+
+    if (!get_reachable_bitmap(index, walk->wants.items, walk->wants.count, walk->haves.items, walk->haves.count, &reached)) return false;
+
+    if (walk->filter == LIST_FILTER_BLOB_NONE) bitmap_and_not(&reached, &index->blobs);
+
+    // Tags and blobs named directly are listed whatever the filter
+    for (size_t i = 0; i < named->count; i++)
+    {
+        uint32_t position;
+        if (!find_bitmap_position(index, named->items[i].hash, &position) || !bitmap_set(&reached, position))
+        {
+            bitmap_release(&reached);
+            return false;
+        }
+    }
+
+    if (!list_bitmap_objects(index, &reached, &index->commits, OBJ_COMMIT, result)
+        || !list_bitmap_objects(index, &reached, &index->tags, OBJ_TAG, result)
+        || !list_bitmap_objects(index, &reached, &index->trees, OBJ_TREE, result)
+        || !list_bitmap_objects(index, &reached, &index->blobs, OBJ_BLOB, result))
+    {
+        object_list_destroy(result);
+        bitmap_release(&reached);
+        return false;
+    }
+
+    bitmap_release(&reached);
+
+    return true;
+}
+
+bool list_objects(
+    const unsigned char (*wants)[SHA_DIGEST_LENGTH],
+    const size_t want_count,
+    const unsigned char (*haves)[SHA_DIGEST_LENGTH],
+    const size_t have_count,
+    const list_objects_options *options,
+    object_list *result)
+{
+    object_walk walk;
+    list_objects_state state = { .result = result };
+    *result = (object_list){ };
+
+    validate(init_object_walk(&walk), "Failed to allocate memory.");
+
+    walk.filter = options->filter;
+    walk.shallow = options->shallow;
+    walk.show_object = list_object;
+    walk.data = &state;
+
+    for (size_t i = 0; i < want_count; i++) validate(add_want(&walk, wants[i]), "Failed to add want.");
+    for (size_t i = 0; i < have_count; i++) validate(add_have(&walk, haves[i]), "Failed to add have.");
+
+    // A shallow boundary cuts history the bitmaps do not know about
+    if (options->use_bitmap_index && !options->shallow && try_list_with_bitmap(&walk, &state.named, result))
+    {
+        object_list_destroy(&state.named);
+        release_object_walk(&walk);
+
+        return true;
+    }
+
+    validate(walk_commits(&walk), "Failed to walk commits.");
+
+    for (size_t i = 0; i < walk.shown.count; i++)
+    {
+        validate(object_list_append(result, walk.shown.items[i]->hash, OBJ_COMMIT), "Failed to list object.");
+    }
+
+    // Tags and other objects named directly go after the commits
+    for (size_t i = 0; i < state.named.count; i++)
+    {
+        validate(object_list_append(result, state.named.items[i].hash, state.named.items[i].type), "Failed to list object.");
+    }
+
+    validate(walk_commit_trees(&walk), "Failed to walk trees.");
+
+    // Trees named directly go last, so that what the haves cover is hidden
+    char path[PATH_MAX] = "";
+
+    for (size_t i = 0; i < state.named.count; i++)
+    {
+        if (state.named.items[i].type != OBJ_TREE) continue;
+
+        validate(walk_tree_objects(&walk, state.named.items[i].hash, path, 0, false), "Failed to walk tree.");
+    }
+
+    object_list_destroy(&state.named);
+    release_object_walk(&walk);
+
+    return true;
+
+error:
+    object_list_destroy(&state.named);
+    object_list_destroy(result);
+    release_object_walk(&walk);
+
+    return false;
+}
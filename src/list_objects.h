@@ -0,0 +1,146 @@
+#ifndef LIST_OBJECTS_H
+#define LIST_OBJECTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "oid_map.h"
+#include "packfile.h"
+
+// name_hash sums up the last characters of the path an object was met
+// at, so that a packer can try versions of the same file against each
+// other; 0 when the object was not met in a tree
+typedef struct listed_object
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    object_type type;
+    uint32_t name_hash;
+} listed_object;
+
+typedef struct object_list
+{
+    listed_object *items;
+    size_t count;
+    size_t capacity;
+} object_list;
+
+// What a partial clone leaves out. Objects named as wants are always
+// listed, so a missing blob can be asked for by name.
+typedef enum list_filter
+{
+    LIST_FILTER_NONE,
+    LIST_FILTER_BLOB_NONE,
+} list_filter;
+
+typedef struct list_objects_options
+{
+    list_filter filter;
+
+    // Commits walked as if they had no parents, the boundary of a shallow
+    // history on either side; may be nullptr
+    const oid_map *shallow;
+
+    // Takes reachability from the pack's bitmap when it covers the
+    // request. Such objects have no name hash, so a packer looking for
+    // deltas is better off with the walk.
+    bool use_bitmap_index;
+} list_objects_options;
+
+// Flags the walk keeps per commit. Bottoms are the commits named as haves.
+#define WALK_SEEN (1u << 0)
+#define WALK_UNINTERESTING (1u << 1)
+#define WALK_BOTTOM (1u << 2)
+
+typedef struct object_walk object_walk;
+
+// Called for each interesting commit. A treesame commit is not shown, and
+// when *followed is set the walk goes on through that parent alone.
+typedef bool (*simplify_commit_fn)(object_walk *walk, const commit *commit, bool *is_treesame, struct commit **followed);
+
+// Called for each tree and blob shown, with the path it was met at; root
+// trees have an empty path
+typedef bool (*show_object_fn)(object_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH], object_type type, const char *path);
+
+// The commit and object walk behind rev-list, upload-pack and repack.
+// Commits reachable from wants and not from haves are shown newest first;
+// the haves and the uninteresting commits met on the way are the boundary,
+// whose trees hide what the other side has.
+struct object_walk
+{
+    // Parsed commits, filled in by the caller
+    commit_list wants;
+    commit_list haves;
+
+    list_filter filter;
+
+    // Commits walked as if they had no parents; may be nullptr
+    const oid_map *shallow;
+
+    // How many commits to show at most, -1 for all of them
+    long max_count;
+
+    // History simplification; nullptr shows every interesting commit
+    simplify_commit_fn simplify;
+
+    show_object_fn show_object;
+
+    // For the callbacks
+    void *data;
+
+    commit_list shown;
+    commit_list boundary;
+
+    // Objects already shown or hidden
+    oid_map seen_objects;
+
+    // Per commit flags, indexed by commit->index
+    uint8_t *flags;
+    size_t flags_capacity;
+};
+
+bool init_object_walk(object_walk *walk);
+
+void release_object_walk(object_walk *walk);
+
+uint8_t get_object_walk_flags(const object_walk *walk, const commit *commit);
+
+// Fills shown and boundary
+bool walk_commits(object_walk *walk);
+
+// Shows a tree and everything below it not seen yet, unless is_hidden is
+// set, in which case it is only marked seen. path holds PATH_MAX bytes
+// and starts with the tree's own path, path_len long.
+bool walk_tree_objects(
+    object_walk *walk,
+    const unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    char *path,
+    size_t path_len,
+    bool is_hidden);
+
+// Hides the boundary trees, then shows the trees of the shown commits
+bool walk_commit_trees(object_walk *walk);
+
+void object_list_destroy(object_list *list);
+
+bool object_list_append(object_list *list, const unsigned char hash[SHA_DIGEST_LENGTH], object_type type);
+
+// Everything reachable from wants that is not reachable from haves, the
+// objects a pack has to carry to bring the other side up to date. Wants
+// may be tags, which are peeled and sent along; haves that are missing
+// here are ignored. Commits come first, newest first, then tags, then
+// trees and blobs in the order they are met.
+bool list_objects(
+    const unsigned char (*wants)[SHA_DIGEST_LENGTH],
+    size_t want_count,
+    const unsigned char (*haves)[SHA_DIGEST_LENGTH],
+    size_t have_count,
+    const list_objects_options *options,
+    object_list *result);
+
+// Reads an annotated tag's target, nullptr if the object is not a tag
+unsigned char *peel_tag(const unsigned char hash[SHA_DIGEST_LENGTH], unsigned char target[SHA_DIGEST_LENGTH]);
+
+#endif //LIST_OBJECTS_H
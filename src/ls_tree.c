@@ -8,6 +8,9 @@
 #include "debug_helpers.h"
 #include "git_dir_helpers.h"
 #include "git_obj_helpers.h"
+#include "refs.h"
+#include "trace.h"
+#include "tree_walk.h"
 
 #define GIT_OBJ_HEADER_SIZE 64
 
@@ -55,100 +58,38 @@ static bool is_expected_obj_type(const char *obj_content, const char *expected,
 }
 
 
-static void destroy_git_tree_node(git_tree_node *node)
+static void print_tree_node_name_only(const git_tree_node *node)
 {
     if (!node) return;
 
-    if (node->mode) free(node->mode);
-    if (node->name) free(node->name);
-    if (node->hash) free(node->hash);
-
-    free(node);
+    printf("%s", node->name);
+    putchar('\n');
 }
 
-static size_t try_set_node(git_tree_node *node, const char *obj_content, const size_t start)
+// The type comes from the mode, as git's ls-tree does: reading each entry
+// would cost a lookup per entry, and in a partial clone a fetch per blob
+static const char *get_tree_entry_type(const git_tree_node *node)
 {
-    size_t curr_pos = start;
-    size_t elem_start = start;
-
-    while (obj_content[curr_pos] != ' ') curr_pos++;
-
-    size_t elem_len = curr_pos - elem_start;
-    node->mode = malloc(elem_len + 1);
-    validate(node->mode, "Failed to allocate memory.");
-
-    memcpy(node->mode, &obj_content[elem_start], elem_len);
-    node->mode[elem_len] = '\0';
-    elem_start = ++curr_pos;
-
-    while (obj_content[curr_pos] != '\0') curr_pos++;
-
-    elem_len = curr_pos - elem_start;
-    node->name = malloc(elem_len + 1);
-    validate(node->name, "Failed to allocate memory.");
-
-    memcpy(node->name, &obj_content[elem_start], elem_len);
-    node->name[elem_len] = '\0';
-    elem_start = ++curr_pos;
-
-    node->hash = malloc(elem_len);
-    validate(node->hash, "Failed to allocate memory.");
+    const unsigned int mode = get_tree_node_mode(node) & 0170000;
 
-    elem_len = 20;
-    memcpy(node->hash, &obj_content[elem_start], elem_len);
+    if (mode == TREE_MODE_DIR) return "tree";
+    if (mode == TREE_MODE_GITLINK) return "commit";
 
-    curr_pos += 20;
-
-    return curr_pos;
-
-error:
-    return 0;
-}
-
-static void print_tree_node_name_only(const git_tree_node *node)
-{
-    if (!node) return;
-
-    printf("%s", node->name);
-    putchar('\n');
+    return "blob";
 }
 
 static void print_tree_node_full(const git_tree_node *node)
 {
     if (!node) return;
 
-    char hash_hex[SHA_HEX_LENGTH];
+    char hash_hex[SHA_HEX_LENGTH + 1];
     hash_bytes_to_hex(hash_hex, node->hash);
-
-    char *inflated_buffer = nullptr;
-
-    (void)get_object_content(hash_hex, &inflated_buffer);
-    validate(inflated_buffer, "Failed to obtain object content.");
-
-    char obj_type[16];
-    get_object_type(obj_type, inflated_buffer);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
 
     const size_t leading_zeros = 6 - strlen(node->mode);
     for (size_t i = 0; i < leading_zeros; i++) putchar('0');
 
-    printf("%s", node->mode);
-    putchar(' ');
-
-    printf("%s", obj_type);
-    putchar(' ');
-
-    printf("%s", hash_hex);
-    putchar(' ');
-
-    printf("%s", node->name);
-    putchar('\n');
-
-    free(inflated_buffer);
-
-    return;
-
-error:
-    if (inflated_buffer) free(inflated_buffer);
+    printf("%s %s %s %s\n", node->mode, get_tree_entry_type(node), hash_hex, node->name);
 }
 
 static void print_tree_content(const char *inflated_buffer, const size_t inflated_buffer_size, const bool name_only)
@@ -156,13 +97,13 @@ static void print_tree_content(const char *inflated_buffer, const size_t inflate
     size_t curr_pos = get_header_size(inflated_buffer);
     curr_pos++;
 
-    git_tree_node *node;
+    git_tree_node *node = nullptr;
     while (curr_pos < inflated_buffer_size)
     {
         node = malloc(sizeof(git_tree_node));
         validate(node, "Failed to allocate memory.");
 
-        curr_pos = try_set_node(node, inflated_buffer, curr_pos);
+        curr_pos = try_set_node(node, inflated_buffer, inflated_buffer_size, curr_pos);
         validate(curr_pos, "Failed to read git tree node.");
 
         if (name_only)
@@ -187,16 +128,20 @@ int ls_tree(const int argc, char *argv[])
 {
     validate(try_resolve_ls_tree_opts(argc, argv), "Failed to resolve options.");
 
-    const char *tree_hash = argv[argc - 1];
     char *inflated_buffer = nullptr;
 
+    char tree_hash[SHA_HEX_LENGTH + 1];
+    validate(resolve_tree_hex(argv[argc - 1], tree_hash), "Not a tree object '%s'.", argv[argc - 1]);
+
     const size_t inflated_buffer_size = get_object_content(tree_hash, &inflated_buffer);
     validate(inflated_buffer, "Failed to obtain object content.");
 
     const char *expected = "tree";
     validate(is_expected_obj_type(inflated_buffer, expected, 4), "Expected %s object type.", expected);
 
+    trace_region_enter("ls-tree", "output");
     print_tree_content(inflated_buffer, inflated_buffer_size, name_only_opt);
+    trace_region_leave("ls-tree", "output");
 
     free(inflated_buffer);
 
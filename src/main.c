@@ -4,10 +4,31 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "blame.h"
 #include "cat_file.h"
 #include "commit_tree.h"
+#include "diff.h"
+#include "diff_tree.h"
+#include "fast_import.h"
+#include "fetch.h"
+#include "fsck.h"
+#include "fsmonitor_daemon.h"
+#include "gc.h"
 #include "hash_object.h"
+#include "index_pack.h"
 #include "ls_tree.h"
+#include "merge_base.h"
+#include "merge_tree.h"
+#include "multi_pack_index.h"
+#include "read_tree.h"
+#include "repack.h"
+#include "rev_list.h"
+#include "sparse_checkout.h"
+#include "trace.h"
+#include "update_ref.h"
+#include "upload_pack.h"
+#include "write_bitmap.h"
+#include "write_commit_graph.h"
 #include "write_tree.h"
 
 int init(void)
@@ -38,12 +59,8 @@ int init(void)
     return 0;
 }
 
-int main(const int argc, char *argv[])
+static int run_command(const int argc, char *argv[])
 {
-    // Disable output buffering
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
-
     if (argc < 2)
     {
         fprintf(stderr, "Usage: ./your_program.sh <command> [<args>]\n");
@@ -82,6 +99,117 @@ int main(const int argc, char *argv[])
         return commit_tree(argc, argv);
     }
 
+    if (strcmp(command, "diff") == 0)
+    {
+        return diff(argc, argv);
+    }
+
+    if (strcmp(command, "diff-tree") == 0)
+    {
+        return diff_tree(argc, argv);
+    }
+
+    if (strcmp(command, "merge-base") == 0)
+    {
+        return merge_base(argc, argv);
+    }
+
+    if (strcmp(command, "merge-tree") == 0)
+    {
+        return merge_tree(argc, argv);
+    }
+
+    if (strcmp(command, "rev-list") == 0)
+    {
+        return rev_list(argc, argv);
+    }
+
+    if (strcmp(command, "write-bitmap") == 0)
+    {
+        return write_bitmap(argc, argv);
+    }
+
+    if (strcmp(command, "blame") == 0)
+    {
+        return blame(argc, argv);
+    }
+
+    if (strcmp(command, "write-commit-graph") == 0)
+    {
+        return write_commit_graph(argc, argv);
+    }
+
+    if (strcmp(command, "multi-pack-index") == 0)
+    {
+        return multi_pack_index(argc, argv);
+    }
+
+    if (strcmp(command, "update-ref") == 0)
+    {
+        return update_ref(argc, argv);
+    }
+
+    if (strcmp(command, "fast-import") == 0)
+    {
+        return fast_import(argc, argv);
+    }
+
+    if (strcmp(command, "read-tree") == 0)
+    {
+        return read_tree(argc, argv);
+    }
+
+    if (strcmp(command, "sparse-checkout") == 0)
+    {
+        return sparse_checkout(argc, argv);
+    }
+
+    if (strcmp(command, "fsmonitor--daemon") == 0)
+    {
+        return fsmonitor_daemon(argc, argv);
+    }
+
+    if (strcmp(command, "index-pack") == 0)
+    {
+        return index_pack(argc, argv);
+    }
+
+    if (strcmp(command, "upload-pack") == 0)
+    {
+        return upload_pack(argc, argv);
+    }
+
+    if (strcmp(command, "fetch") == 0)
+    {
+        return fetch(argc, argv);
+    }
+
+    if (strcmp(command, "repack") == 0)
+    {
+        return repack(argc, argv);
+    }
+
+    if (strcmp(command, "gc") == 0)
+    {
+        return gc(argc, argv);
+    }
+
+    if (strcmp(command, "fsck") == 0)
+    {
+        return fsck(argc, argv);
+    }
+
     fprintf(stderr, "Unknown command %s\n", command);
     return 1;
 }
+
+int main(const int argc, char *argv[])
+{
+    // Disable output buffering
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+
+    trace_start(argc, argv);
+
+    return trace_exit(run_command(argc, argv));
+}
@@ -0,0 +1,121 @@
+#include "merge_base.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+
+bool all_opt = false;
+bool octopus_opt = false;
+
+static bool try_resolve_merge_base_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "all", no_argument, nullptr, 'a' },
+        { "octopus", no_argument, nullptr, 'o' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                all_opt = true;
+                break;
+            case 'o':
+                octopus_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static commit *lookup_commit_reference(const char *name)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    validate(resolve_commit_hex(name, hex), "Not a valid commit name '%s'.", name);
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    hash_hex_to_bytes(hash, hex);
+
+    return lookup_commit(hash);
+
+error:
+    return nullptr;
+}
+
+// merge-base [-a | --all] <commit> <commit>...
+// merge-base [-a | --all] --octopus <commit>...
+int merge_base(const int argc, char *argv[])
+{
+    commit **commits = nullptr;
+    commit_list bases;
+    commit_list_init(&bases);
+
+    validate(try_resolve_merge_base_opts(argc, argv), "Failed to resolve options.");
+
+    const command_args args = get_command_args(argc, argv);
+    validate(args.count >= (octopus_opt ? 1 : 2), "Usage: merge-base [--all] [--octopus] <commit> <commit>...");
+
+    commits = malloc(args.count * sizeof(commit *));
+    validate(commits, "Failed to allocate memory.");
+
+    for (int i = 0; i < args.count; i++)
+    {
+        commits[i] = lookup_commit_reference(args.argv[i]);
+        validate(commits[i], "Failed to look up commit '%s'.", args.argv[i]);
+    }
+
+    if (octopus_opt)
+    {
+        validate(get_octopus_merge_bases(commits, args.count, &bases), "Failed to find merge bases.");
+        validate(reduce_heads(&bases), "Failed to reduce merge bases.");
+    }
+    else
+    {
+        // The first commit against all others, as if they were merged already
+        validate(get_merge_bases(commits[0], args.count - 1, &commits[1], &bases), "Failed to find merge bases.");
+    }
+
+    const int exit_code = bases.count ? 0 : 1;
+
+    for (size_t i = 0; i < bases.count; i++)
+    {
+        char hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hex, bases.items[i]->hash);
+        hex[SHA_HEX_LENGTH] = '\0';
+
+        printf("%s\n", hex);
+
+        if (!all_opt) break;
+    }
+
+    commit_list_destroy(&bases);
+    free(commits);
+
+    return exit_code;
+
+error:
+    commit_list_destroy(&bases);
+    if (commits) free(commits);
+
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef MERGE_BASE_H
+#define MERGE_BASE_H
+
+int merge_base(int argc, char *argv[]);
+
+#endif //MERGE_BASE_H
@@ -0,0 +1,403 @@
+#include "merge_file.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "line_diff.h"
+
+#define NOT_MAPPED SIZE_MAX
+#define MAX_LINES_BETWEEN_CONFLICTS 3
+
+// A run of base lines changed on at least one side, together with what
+// each side has in its place
+typedef struct merge_chunk
+{
+    size_t base_start;
+    size_t base_end;
+    size_t ours_start;
+    size_t ours_end;
+    size_t theirs_start;
+    size_t theirs_end;
+} merge_chunk;
+
+typedef enum merge_hunk_kind
+{
+    HUNK_OURS,
+    HUNK_THEIRS,
+    HUNK_CONFLICT,
+} merge_hunk_kind;
+
+// What replaces ours[ours_start, ours_end) in the result. Lines between
+// hunks are the same on all three sides.
+typedef struct merge_hunk
+{
+    merge_hunk_kind kind;
+    size_t ours_start;
+    size_t ours_end;
+    size_t theirs_start;
+    size_t theirs_end;
+} merge_hunk;
+
+typedef struct merge_hunks
+{
+    merge_hunk *items;
+    size_t count;
+    size_t capacity;
+} merge_hunks;
+
+// For every base line, the line it stayed on the other side of the diff,
+// or NOT_MAPPED when it was changed
+static size_t *map_unchanged_lines(const line_diff *diff)
+{
+    size_t *map = malloc((diff->a.count + 1) * sizeof(size_t));
+    validate(map, "Failed to allocate memory.");
+
+    size_t j = 0;
+
+    for (size_t i = 0; i < diff->a.count; i++)
+    {
+        if (diff->a.changed[i])
+        {
+            map[i] = NOT_MAPPED;
+            continue;
+        }
+
+        while (diff->b.changed[j]) j++;
+        map[i] = j++;
+    }
+
+    return map;
+
+error:
+    return nullptr;
+}
+
+static bool is_side_unchanged(const size_t *map, const merge_chunk *chunk, const size_t side_start, const size_t side_end)
+{
+    if (side_end - side_start != chunk->base_end - chunk->base_start) return false;
+
+    for (size_t i = chunk->base_start; i < chunk->base_end; i++)
+    {
+        if (map[i] != side_start + (i - chunk->base_start)) return false;
+    }
+
+    return true;
+}
+
+static bool are_lines_equal(const diff_line *a, const diff_line *b)
+{
+    return a->len == b->len && memcmp(a->start, b->start, a->len) == 0;
+}
+
+static void write_lines(FILE *out, const line_file *file, const size_t start, const size_t end, const bool is_terminated)
+{
+    for (size_t i = start; i < end; i++)
+    {
+        const diff_line *line = &file->lines[i];
+        fwrite(line->start, 1, line->len, out);
+
+        // Lines inside a conflict must not run into the next marker
+        if (is_terminated && (line->len == 0 || line->start[line->len - 1] != '\n')) fputc('\n', out);
+    }
+}
+
+static void write_marker(FILE *out, const char marker, const char *label)
+{
+    for (int i = 0; i < CONFLICT_MARKER_SIZE; i++) fputc(marker, out);
+
+    if (label) fprintf(out, " %s", label);
+    fputc('\n', out);
+}
+
+static bool add_hunk(merge_hunks *hunks, const merge_hunk *hunk)
+{
+    if (hunks->count == hunks->capacity)
+    {
+        const size_t capacity = hunks->capacity ? hunks->capacity * 2 : 16;
+
+        merge_hunk *items = realloc(hunks->items, capacity * sizeof(merge_hunk));
+        validate(items, "Failed to allocate memory.");
+
+        hunks->items = items;
+        hunks->capacity = capacity;
+    }
+
+    hunks->items[hunks->count++] = *hunk;
+
+    return true;
+
+error:
+    return false;
+}
+
+static const char *get_range_start(const line_file *file, const size_t start)
+{
+    return start < file->count ? file->lines[start].start : file->data + file->size;
+}
+
+// Diffs the two sides of a conflict against each other: what they agree on
+// moves out of it, and the conflict may split in several
+static bool refine_conflict(const line_file *ours, const line_file *theirs, const merge_hunk *hunk, merge_hunks *refined)
+{
+    line_diff diff = { };
+    change_region *regions = nullptr;
+
+    if (hunk->ours_start == hunk->ours_end || hunk->theirs_start == hunk->theirs_end) return add_hunk(refined, hunk);
+
+    const char *ours_data = get_range_start(ours, hunk->ours_start);
+    const char *theirs_data = get_range_start(theirs, hunk->theirs_start);
+
+    validate(compute_line_diff(
+                 &diff,
+                 ours_data,
+                 get_range_start(ours, hunk->ours_end) - ours_data,
+                 theirs_data,
+                 get_range_start(theirs, hunk->theirs_end) - theirs_data,
+                 DIFF_ALGORITHM_MYERS),
+             "Failed to diff conflict sides.");
+
+    size_t region_count;
+    validate(collect_change_regions(&diff, &regions, &region_count), "Failed to collect changes.");
+
+    if (!region_count)
+    {
+        const merge_hunk same = { .kind = HUNK_OURS, .ours_start = hunk->ours_start, .ours_end = hunk->ours_end };
+        validate(add_hunk(refined, &same), "Failed to add hunk.");
+    }
+
+    for (size_t i = 0; i < region_count; i++)
+    {
+        const merge_hunk part = {
+            .kind = HUNK_CONFLICT,
+            .ours_start = hunk->ours_start + regions[i].a_start,
+            .ours_end = hunk->ours_start + regions[i].a_end,
+            .theirs_start = hunk->theirs_start + regions[i].b_start,
+            .theirs_end = hunk->theirs_start + regions[i].b_end,
+        };
+
+        validate(add_hunk(refined, &part), "Failed to add hunk.");
+    }
+
+    free(regions);
+    release_line_diff(&diff);
+
+    return true;
+
+error:
+    if (regions) free(regions);
+    release_line_diff(&diff);
+
+    return false;
+}
+
+// Like git's zealous merge: refine every conflict, then join conflicts that
+// only have up to three unchanged lines between them
+static bool simplify_conflicts(const line_file *ours, const line_file *theirs, merge_hunks *hunks)
+{
+    merge_hunks refined = { };
+
+    for (size_t i = 0; i < hunks->count; i++)
+    {
+        const merge_hunk *hunk = &hunks->items[i];
+
+        const bool result = hunk->kind == HUNK_CONFLICT
+            ? refine_conflict(ours, theirs, hunk, &refined)
+            : add_hunk(&refined, hunk);
+        validate(result, "Failed to refine conflicts.");
+    }
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < refined.count; i++)
+    {
+        merge_hunk *previous = kept ? &refined.items[kept - 1] : nullptr;
+        const merge_hunk *hunk = &refined.items[i];
+
+        if (previous && previous->kind == HUNK_CONFLICT && hunk->kind == HUNK_CONFLICT
+            && hunk->ours_start - previous->ours_end <= MAX_LINES_BETWEEN_CONFLICTS)
+        {
+            previous->ours_end = hunk->ours_end;
+            previous->theirs_end = hunk->theirs_end;
+            continue;
+        }
+
+        refined.items[kept++] = *hunk;
+    }
+
+    refined.count = kept;
+
+    if (hunks->items) free(hunks->items);
+    *hunks = refined;
+
+    return true;
+
+error:
+    if (refined.items) free(refined.items);
+
+    return false;
+}
+
+static bool write_hunks(FILE *out, const line_file *ours, const line_file *theirs, const merge_hunks *hunks, const merge_file_input *ours_input, const merge_file_input *theirs_input)
+{
+    size_t ours_pos = 0;
+
+    for (size_t i = 0; i < hunks->count; i++)
+    {
+        const merge_hunk *hunk = &hunks->items[i];
+
+        write_lines(out, ours, ours_pos, hunk->ours_start, false);
+
+        switch (hunk->kind)
+        {
+            case HUNK_OURS:
+                write_lines(out, ours, hunk->ours_start, hunk->ours_end, false);
+                break;
+            case HUNK_THEIRS:
+                write_lines(out, theirs, hunk->theirs_start, hunk->theirs_end, false);
+                break;
+            case HUNK_CONFLICT:
+                write_marker(out, '<', ours_input->label);
+                write_lines(out, ours, hunk->ours_start, hunk->ours_end, true);
+                write_marker(out, '=', nullptr);
+                write_lines(out, theirs, hunk->theirs_start, hunk->theirs_end, true);
+                write_marker(out, '>', theirs_input->label);
+                break;
+        }
+
+        ours_pos = hunk->ours_end;
+    }
+
+    write_lines(out, ours, ours_pos, ours->count, false);
+
+    return ferror(out) == 0;
+}
+
+static bool is_same_content(const line_file *ours, const line_file *theirs, const merge_chunk *chunk)
+{
+    if (chunk->ours_end - chunk->ours_start != chunk->theirs_end - chunk->theirs_start) return false;
+
+    for (size_t i = 0; i < chunk->ours_end - chunk->ours_start; i++)
+    {
+        if (!are_lines_equal(&ours->lines[chunk->ours_start + i], &theirs->lines[chunk->theirs_start + i])) return false;
+    }
+
+    return true;
+}
+
+bool merge_file(
+    const merge_file_input *base,
+    const merge_file_input *ours,
+    const merge_file_input *theirs,
+    buffer *result,
+    bool *is_clean)
+{
+    line_diff ours_diff = { };
+    line_diff theirs_diff = { };
+    size_t *ours_map = nullptr;
+    size_t *theirs_map = nullptr;
+    merge_hunks hunks = { };
+    FILE *out = nullptr;
+
+    *result = (buffer){ };
+    *is_clean = true;
+
+    validate(compute_line_diff(&ours_diff, base->data, base->size, ours->data, ours->size, DIFF_ALGORITHM_MYERS), "Failed to diff ours.");
+    validate(compute_line_diff(&theirs_diff, base->data, base->size, theirs->data, theirs->size, DIFF_ALGORITHM_MYERS), "Failed to diff theirs.");
+
+    ours_map = map_unchanged_lines(&ours_diff);
+    theirs_map = map_unchanged_lines(&theirs_diff);
+    validate(ours_map && theirs_map, "Failed to map base lines.");
+
+    const line_file *base_lines = &ours_diff.a;
+    const line_file *ours_lines = &ours_diff.b;
+    const line_file *theirs_lines = &theirs_diff.b;
+
+    size_t i = 0;
+    size_t ours_pos = 0;
+    size_t theirs_pos = 0;
+
+    while (i < base_lines->count || ours_pos < ours_lines->count || theirs_pos < theirs_lines->count)
+    {
+        // Base lines both sides kept where they were
+        if (i < base_lines->count && ours_map[i] == ours_pos && theirs_map[i] == theirs_pos)
+        {
+            i++;
+            ours_pos++;
+            theirs_pos++;
+            continue;
+        }
+
+        size_t k = i;
+        while (k < base_lines->count && (ours_map[k] == NOT_MAPPED || theirs_map[k] == NOT_MAPPED)) k++;
+
+        const merge_chunk chunk = {
+            .base_start = i,
+            .base_end = k,
+            .ours_start = ours_pos,
+            .ours_end = k < base_lines->count ? ours_map[k] : ours_lines->count,
+            .theirs_start = theirs_pos,
+            .theirs_end = k < base_lines->count ? theirs_map[k] : theirs_lines->count,
+        };
+
+        merge_hunk hunk = {
+            .kind = HUNK_CONFLICT,
+            .ours_start = chunk.ours_start,
+            .ours_end = chunk.ours_end,
+            .theirs_start = chunk.theirs_start,
+            .theirs_end = chunk.theirs_end,
+        };
+
+        if (is_side_unchanged(ours_map, &chunk, chunk.ours_start, chunk.ours_end))
+        {
+            hunk.kind = HUNK_THEIRS;
+        }
+        else if (is_side_unchanged(theirs_map, &chunk, chunk.theirs_start, chunk.theirs_end)
+                 || is_same_content(ours_lines, theirs_lines, &chunk))
+        {
+            hunk.kind = HUNK_OURS;
+        }
+
+        validate(add_hunk(&hunks, &hunk), "Failed to add hunk.");
+
+        i = chunk.base_end;
+        ours_pos = chunk.ours_end;
+        theirs_pos = chunk.theirs_end;
+    }
+
+    validate(simplify_conflicts(ours_lines, theirs_lines, &hunks), "Failed to simplify conflicts.");
+
+    for (size_t j = 0; j < hunks.count; j++)
+    {
+        if (hunks.items[j].kind == HUNK_CONFLICT) *is_clean = false;
+    }
+
+    out = open_memstream(&result->data, &result->size);
+    validate(out, "Failed to allocate memory.");
+
+    validate(write_hunks(out, ours_lines, theirs_lines, &hunks, ours, theirs), "Failed to write merge result.");
+    validate(fclose(out) == 0, "Failed to write merge result.");
+    out = nullptr;
+
+    free(hunks.items);
+    free(ours_map);
+    free(theirs_map);
+    release_line_diff(&ours_diff);
+    release_line_diff(&theirs_diff);
+
+    return true;
+
+error:
+    if (out) fclose(out);
+    if (result->data) free(result->data);
+    *result = (buffer){ };
+    if (hunks.items) free(hunks.items);
+    if (ours_map) free(ours_map);
+    if (theirs_map) free(theirs_map);
+    release_line_diff(&ours_diff);
+    release_line_diff(&theirs_diff);
+
+    return false;
+}
@@ -0,0 +1,27 @@
+#ifndef MERGE_FILE_H
+#define MERGE_FILE_H
+
+#include <stddef.h>
+
+#include "git_obj_helpers.h"
+
+#define CONFLICT_MARKER_SIZE 7
+
+typedef struct merge_file_input
+{
+    const char *data;
+    size_t size;
+    const char *label;
+} merge_file_input;
+
+// Three-way line merge of ours and theirs against base. Changes made on one
+// side only are taken as they are, equal changes once; everything else
+// becomes a conflict between <<<<<<< and >>>>>>> markers in result.
+bool merge_file(
+    const merge_file_input *base,
+    const merge_file_input *ours,
+    const merge_file_input *theirs,
+    buffer *result,
+    bool *is_clean);
+
+#endif //MERGE_FILE_H
@@ -0,0 +1,199 @@
+#include "merge_tree.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+#include "tree_merge.h"
+
+bool write_tree_opt = false;
+bool conflicts_name_only_opt = false;
+const char *merge_base_opt = nullptr;
+
+static bool try_resolve_merge_tree_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "write-tree", no_argument, nullptr, 'w' },
+        { "name-only", no_argument, nullptr, 'n' },
+        { "merge-base", required_argument, nullptr, 'b' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                write_tree_opt = true;
+                break;
+            case 'n':
+                conflicts_name_only_opt = true;
+                break;
+            case 'b':
+                merge_base_opt = optarg;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool resolve_tree(const char *name, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    validate(resolve_tree_hex(name, hex), "Not a tree-ish '%s'.", name);
+
+    hash_hex_to_bytes(hash, hex);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Without an explicit base, both sides have to be commits. Of several merge
+// bases the newest is used; no virtual base is built from them.
+static bool find_merge_base_tree(const char *ours_name, const char *theirs_name, unsigned char tree_hash[SHA_DIGEST_LENGTH], bool *has_base)
+{
+    commit_list bases;
+    commit_list_init(&bases);
+
+    char ours_hex[SHA_HEX_LENGTH + 1];
+    char theirs_hex[SHA_HEX_LENGTH + 1];
+    validate(resolve_commit_hex(ours_name, ours_hex), "Not a commit '%s'.", ours_name);
+    validate(resolve_commit_hex(theirs_name, theirs_hex), "Not a commit '%s'.", theirs_name);
+
+    unsigned char ours_hash[SHA_DIGEST_LENGTH];
+    unsigned char theirs_hash[SHA_DIGEST_LENGTH];
+    hash_hex_to_bytes(ours_hash, ours_hex);
+    hash_hex_to_bytes(theirs_hash, theirs_hex);
+
+    commit *ours = lookup_commit(ours_hash);
+    commit *theirs = lookup_commit(theirs_hash);
+    validate(ours && theirs, "Failed to look up commits.");
+
+    validate(get_merge_bases(ours, 1, &theirs, &bases), "Failed to find merge bases.");
+
+    *has_base = bases.count > 0;
+
+    if (*has_base)
+    {
+        validate(parse_commit(bases.items[0]), "Failed to parse merge base.");
+        memcpy(tree_hash, bases.items[0]->tree_hash, SHA_DIGEST_LENGTH);
+    }
+
+    commit_list_destroy(&bases);
+
+    return true;
+
+error:
+    commit_list_destroy(&bases);
+
+    return false;
+}
+
+static void print_conflicts(const merge_result *result)
+{
+    for (size_t i = 0; i < result->conflict_count; i++)
+    {
+        const merge_conflict *conflict = &result->conflicts[i];
+
+        if (conflicts_name_only_opt)
+        {
+            printf("%s\n", conflict->path);
+            continue;
+        }
+
+        for (int stage = 0; stage < 3; stage++)
+        {
+            if (!conflict->stages[stage].is_present) continue;
+
+            char hex[SHA_HEX_LENGTH + 1];
+            hash_bytes_to_hex(hex, conflict->stages[stage].hash);
+            hex[SHA_HEX_LENGTH] = '\0';
+
+            printf("%06o %s %d\t%s\n", conflict->stages[stage].mode, hex, stage + 1, conflict->path);
+        }
+    }
+}
+
+// merge-tree --write-tree [--name-only] [--merge-base=<tree-ish>] <ours> <theirs>
+// merge-tree --write-tree [--name-only] <base-tree-ish> <ours> <theirs>
+int merge_tree(const int argc, char *argv[])
+{
+    merge_result result = { };
+
+    validate(try_resolve_merge_tree_opts(argc, argv), "Failed to resolve options.");
+
+    const command_args args = get_command_args(argc, argv);
+    validate(write_tree_opt && (args.count == 2 || (args.count == 3 && !merge_base_opt)),
+             "Usage: merge-tree --write-tree [--name-only] [--merge-base=<tree-ish>] [<base>] <ours> <theirs>");
+
+    const char *ours_name = args.argv[args.count - 2];
+    const char *theirs_name = args.argv[args.count - 1];
+    const char *base_name = args.count == 3 ? args.argv[0] : merge_base_opt;
+
+    unsigned char base_tree[SHA_DIGEST_LENGTH];
+    unsigned char ours_tree[SHA_DIGEST_LENGTH];
+    unsigned char theirs_tree[SHA_DIGEST_LENGTH];
+    bool has_base = true;
+
+    if (base_name)
+    {
+        validate(resolve_tree(base_name, base_tree), "Failed to resolve merge base.");
+    }
+    else
+    {
+        validate(find_merge_base_tree(ours_name, theirs_name, base_tree, &has_base), "Failed to find a merge base.");
+    }
+
+    validate(resolve_tree(ours_name, ours_tree), "Failed to resolve '%s'.", ours_name);
+    validate(resolve_tree(theirs_name, theirs_tree), "Failed to resolve '%s'.", theirs_name);
+
+    const tree_merge_opts opts = {
+        .ours_label = ours_name,
+        .theirs_label = theirs_name,
+    };
+
+    validate(merge_tree_hashes(has_base ? base_tree : nullptr, ours_tree, theirs_tree, &opts, &result), "Failed to merge trees.");
+
+    char tree_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(tree_hex, result.tree_hash);
+    tree_hex[SHA_HEX_LENGTH] = '\0';
+
+    printf("%s\n", tree_hex);
+
+    const bool is_clean = result.conflict_count == 0;
+
+    if (!is_clean)
+    {
+        print_conflicts(&result);
+        printf("\n");
+        fwrite(result.messages, 1, result.messages_size, stdout);
+    }
+
+    release_merge_result(&result);
+
+    return is_clean ? 0 : 1;
+
+error:
+    release_merge_result(&result);
+
+    return 128;
+}
@@ -0,0 +1,6 @@
+#ifndef MERGE_TREE_H
+#define MERGE_TREE_H
+
+int merge_tree(int argc, char *argv[]);
+
+#endif //MERGE_TREE_H
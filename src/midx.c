@@ -0,0 +1,522 @@
+#include "midx.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+
+static midx_file midx = { };
+static bool is_midx_prepared = false;
+static bool has_midx = false;
+
+typedef struct midx_pack
+{
+    packed_git *pack;
+    char idx_name[PATH_MAX];
+    time_t mtime;
+} midx_pack;
+
+typedef struct midx_entry
+{
+    const unsigned char *hash;
+    uint32_t pack_id;
+    uint64_t offset;
+} midx_entry;
+
+// A position in one pack's .idx during the merge of all of them
+typedef struct pack_cursor
+{
+    const midx_pack *pack;
+    uint32_t pack_id;
+    uint32_t position;
+} pack_cursor;
+
+// The .idx file name of a pack, which is how the pack names chunk refers to it
+static bool get_pack_idx_name(const packed_git *pack, char name[PATH_MAX])
+{
+    const char *slash = strrchr(pack->pack_path, '/');
+    const char *base = slash ? slash + 1 : pack->pack_path;
+
+    const size_t len = strlen(base);
+    validate(len > 5 && strcmp(&base[len - 5], ".pack") == 0, "Invalid pack path '%s'.", pack->pack_path);
+
+    memcpy(name, base, len - 5);
+    strcpy(&name[len - 5], ".idx");
+
+    return true;
+
+error:
+    return false;
+}
+
+static packed_git *find_pack_by_idx_name(const char *idx_name)
+{
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        char name[PATH_MAX];
+        if (get_pack_idx_name(pack, name) && strcmp(name, idx_name) == 0) return pack;
+    }
+
+    return nullptr;
+}
+
+static bool resolve_midx_packs(const unsigned char *names, const size_t names_size)
+{
+    midx.packs = calloc(midx.pack_count, sizeof(packed_git *));
+    validate(midx.packs, "Failed to allocate memory.");
+
+    const char *name = (const char *)names;
+    const char *end = (const char *)&names[names_size];
+
+    for (uint32_t i = 0; i < midx.pack_count; i++)
+    {
+        const size_t len = strnlen(name, end - name);
+        validate(len > 0 && len < (size_t)(end - name), "Malformed multi-pack-index pack names.");
+
+        midx.packs[i] = find_pack_by_idx_name(name);
+        validate(midx.packs[i], "Multi-pack-index refers to missing pack '%s'.", name);
+
+        name += len + 1;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool parse_multi_pack_index(const unsigned char *data, const size_t size)
+{
+    size_t names_size = 0;
+
+    validate(size >= MIDX_HEADER_SIZE + SHA_DIGEST_LENGTH, "Multi-pack-index file is too small.");
+    validate(memcmp(data, MIDX_SIGNATURE, 4) == 0, "Multi-pack-index signature mismatch.");
+    validate(data[4] == MIDX_VERSION, "Unsupported multi-pack-index version %d.", data[4]);
+    validate(data[5] == MIDX_HASH_VERSION, "Unsupported multi-pack-index hash version %d.", data[5]);
+    validate(data[7] == 0, "Incremental multi-pack-index chains are not supported.");
+
+    const uint8_t chunk_count = data[6];
+    const size_t table_end = MIDX_HEADER_SIZE + ((size_t)chunk_count + 1) * MIDX_CHUNK_ENTRY_SIZE;
+    validate(table_end <= size - SHA_DIGEST_LENGTH, "Multi-pack-index chunk table is truncated.");
+
+    midx = (midx_file){ .data = data, .size = size, .pack_count = get_be32(&data[8]) };
+
+    size_t lookup_size = 0;
+    size_t offsets_size = 0;
+
+    for (uint8_t i = 0; i < chunk_count; i++)
+    {
+        const unsigned char *entry = &data[MIDX_HEADER_SIZE + (size_t)i * MIDX_CHUNK_ENTRY_SIZE];
+        const uint32_t chunk_id = get_be32(entry);
+        const uint64_t offset = get_be64(&entry[4]);
+        const uint64_t next_offset = get_be64(&entry[4 + MIDX_CHUNK_ENTRY_SIZE]);
+
+        validate(offset >= table_end && offset <= next_offset && next_offset <= size - SHA_DIGEST_LENGTH,
+                 "Multi-pack-index chunk %08x is out of bounds.", chunk_id);
+
+        const size_t chunk_size = next_offset - offset;
+
+        switch (chunk_id)
+        {
+            case MIDX_CHUNK_ID_PACK_NAMES:
+                midx.pack_names = &data[offset];
+                names_size = chunk_size;
+                break;
+            case MIDX_CHUNK_ID_OID_FANOUT:
+                validate(chunk_size == PACK_FANOUT_SIZE, "Malformed multi-pack-index fanout.");
+                midx.oid_fanout = &data[offset];
+                midx.object_count = get_be32(&midx.oid_fanout[255 * 4]);
+                break;
+            case MIDX_CHUNK_ID_OID_LOOKUP:
+                midx.oid_lookup = &data[offset];
+                lookup_size = chunk_size;
+                break;
+            case MIDX_CHUNK_ID_OBJECT_OFFSETS:
+                midx.object_offsets = &data[offset];
+                offsets_size = chunk_size;
+                break;
+            case MIDX_CHUNK_ID_LARGE_OFFSETS:
+                midx.large_offsets = &data[offset];
+                midx.large_offset_count = chunk_size / 8;
+                break;
+            default:
+                break;
+        }
+    }
+
+    validate(midx.pack_names && midx.oid_fanout && midx.oid_lookup && midx.object_offsets,
+             "Multi-pack-index is missing required chunks.");
+    validate(lookup_size == (size_t)midx.object_count * SHA_DIGEST_LENGTH
+             && offsets_size == (size_t)midx.object_count * MIDX_OFFSET_SIZE,
+             "Multi-pack-index chunks disagree on the object count.");
+
+    validate(resolve_midx_packs(midx.pack_names, names_size), "Failed to resolve multi-pack-index packs.");
+
+    // Lookups only fall back to probing the packs the index does not cover
+    for (uint32_t i = 0; i < midx.pack_count; i++) midx.packs[i]->is_in_midx = true;
+
+    return true;
+
+error:
+    if (midx.packs) free(midx.packs);
+    midx = (midx_file){ };
+
+    return false;
+}
+
+static void prepare_multi_pack_index(void)
+{
+    is_midx_prepared = true;
+
+    char path[PATH_MAX];
+    if (!get_git_path(path, PATH_MAX, "objects/pack/multi-pack-index")) return;
+
+    size_t size = 0;
+    const unsigned char *data = map_file(path, &size);
+    if (!data) return;
+
+    if (!parse_multi_pack_index(data, size))
+    {
+        munmap((void *)data, size);
+        return;
+    }
+
+    has_midx = true;
+}
+
+const midx_file *get_multi_pack_index(void)
+{
+    if (!is_midx_prepared) prepare_multi_pack_index();
+
+    return has_midx ? &midx : nullptr;
+}
+
+void reprepare_multi_pack_index(void)
+{
+    if (has_midx)
+    {
+        for (uint32_t i = 0; i < midx.pack_count; i++) midx.packs[i]->is_in_midx = false;
+
+        munmap((void *)midx.data, midx.size);
+        free(midx.packs);
+    }
+
+    midx = (midx_file){ };
+    has_midx = false;
+    is_midx_prepared = false;
+}
+
+bool find_midx_entry(const unsigned char hash[SHA_DIGEST_LENGTH], packed_git **pack, uint64_t *offset)
+{
+    const midx_file *m = get_multi_pack_index();
+    if (!m) return false;
+
+    uint32_t lo = hash[0] == 0 ? 0 : get_be32(&m->oid_fanout[(hash[0] - 1) * 4]);
+    uint32_t hi = get_be32(&m->oid_fanout[hash[0] * 4]);
+
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(&m->oid_lookup[(size_t)mid * SHA_DIGEST_LENGTH], hash, SHA_DIGEST_LENGTH);
+
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+            continue;
+        }
+
+        if (cmp > 0)
+        {
+            hi = mid;
+            continue;
+        }
+
+        const unsigned char *entry = &m->object_offsets[(size_t)mid * MIDX_OFFSET_SIZE];
+        const uint32_t pack_id = get_be32(entry);
+        const uint32_t pack_offset = get_be32(&entry[4]);
+
+        if (pack_id >= m->pack_count) return false;
+
+        if (pack_offset & MIDX_LARGE_OFFSET_NEEDED)
+        {
+            const uint32_t large_index = pack_offset & ~MIDX_LARGE_OFFSET_NEEDED;
+            if (large_index >= m->large_offset_count) return false;
+
+            *offset = get_be64(&m->large_offsets[(size_t)large_index * 8]);
+        }
+        else
+        {
+            *offset = pack_offset;
+        }
+
+        *pack = m->packs[pack_id];
+
+        return true;
+    }
+
+    return false;
+}
+
+static int compare_midx_packs(const void *a, const void *b)
+{
+    return strcmp(((const midx_pack *)a)->idx_name, ((const midx_pack *)b)->idx_name);
+}
+
+// Orders by oid, then puts the copy that wins first: the newest pack, and
+// the first one by name among equally new ones
+static bool cursor_precedes(const pack_cursor *a, const pack_cursor *b)
+{
+    const int cmp = memcmp(
+        get_pack_idx_hash(a->pack->pack, a->position),
+        get_pack_idx_hash(b->pack->pack, b->position),
+        SHA_DIGEST_LENGTH);
+
+    if (cmp != 0) return cmp < 0;
+    if (a->pack->mtime != b->pack->mtime) return a->pack->mtime > b->pack->mtime;
+
+    return a->pack_id < b->pack_id;
+}
+
+static void sift_down(pack_cursor *heap, const size_t count, size_t i)
+{
+    while (true)
+    {
+        const size_t left = 2 * i + 1;
+        const size_t right = left + 1;
+        size_t first = i;
+
+        if (left < count && cursor_precedes(&heap[left], &heap[first])) first = left;
+        if (right < count && cursor_precedes(&heap[right], &heap[first])) first = right;
+        if (first == i) return;
+
+        const pack_cursor tmp = heap[i];
+        heap[i] = heap[first];
+        heap[first] = tmp;
+        i = first;
+    }
+}
+
+// Every .idx is already sorted, so a k-way merge yields the combined oid
+// table without sorting it again. Duplicates keep their first copy.
+static bool merge_pack_entries(const midx_pack *packs, const uint32_t pack_count, midx_entry **entries, uint32_t *entry_count)
+{
+    pack_cursor *heap = malloc((pack_count ? pack_count : 1) * sizeof(pack_cursor));
+    size_t heap_count = 0;
+    size_t total = 0;
+
+    *entries = nullptr;
+    *entry_count = 0;
+
+    validate(heap, "Failed to allocate memory.");
+
+    for (uint32_t i = 0; i < pack_count; i++)
+    {
+        total += packs[i].pack->object_count;
+        if (packs[i].pack->object_count) heap[heap_count++] = (pack_cursor){ .pack = &packs[i], .pack_id = i };
+    }
+
+    validate(total <= UINT32_MAX, "Too many objects for a multi-pack-index.");
+
+    *entries = malloc((total ? total : 1) * sizeof(midx_entry));
+    validate(*entries, "Failed to allocate memory.");
+
+    for (size_t i = heap_count; i-- > 0;) sift_down(heap, heap_count, i);
+
+    while (heap_count > 0)
+    {
+        pack_cursor *top = &heap[0];
+        const packed_git *pack = top->pack->pack;
+        const unsigned char *hash = get_pack_idx_hash(pack, top->position);
+
+        if (*entry_count == 0 || memcmp((*entries)[*entry_count - 1].hash, hash, SHA_DIGEST_LENGTH) != 0)
+        {
+            (*entries)[(*entry_count)++] = (midx_entry){
+                .hash = hash,
+                .pack_id = top->pack_id,
+                .offset = get_pack_idx_offset(pack, top->position),
+            };
+        }
+
+        if (++top->position == pack->object_count) heap[0] = heap[--heap_count];
+
+        sift_down(heap, heap_count, 0);
+    }
+
+    free(heap);
+
+    return true;
+
+error:
+    if (heap) free(heap);
+    if (*entries) free(*entries);
+    *entries = nullptr;
+
+    return false;
+}
+
+static bool serialize_multi_pack_index(
+    const midx_pack *packs,
+    const uint32_t pack_count,
+    const midx_entry *entries,
+    const uint32_t entry_count,
+    buffer *out)
+{
+    *out = (buffer){ };
+
+    size_t names_size = 0;
+    for (uint32_t i = 0; i < pack_count; i++) names_size += strlen(packs[i].idx_name) + 1;
+    names_size = (names_size + 3) & ~(size_t)3;
+
+    uint32_t large_offset_count = 0;
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        if (entries[i].offset >= MIDX_LARGE_OFFSET_NEEDED) large_offset_count++;
+    }
+
+    const uint32_t chunk_ids[] = {
+        MIDX_CHUNK_ID_PACK_NAMES,
+        MIDX_CHUNK_ID_OID_FANOUT,
+        MIDX_CHUNK_ID_OID_LOOKUP,
+        MIDX_CHUNK_ID_OBJECT_OFFSETS,
+        MIDX_CHUNK_ID_LARGE_OFFSETS,
+    };
+    const size_t chunk_sizes[] = {
+        names_size,
+        PACK_FANOUT_SIZE,
+        (size_t)entry_count * SHA_DIGEST_LENGTH,
+        (size_t)entry_count * MIDX_OFFSET_SIZE,
+        (size_t)large_offset_count * 8,
+    };
+    const uint8_t chunk_count = large_offset_count ? 5 : 4;
+
+    size_t chunk_offsets[6];
+    chunk_offsets[0] = MIDX_HEADER_SIZE + ((size_t)chunk_count + 1) * MIDX_CHUNK_ENTRY_SIZE;
+    for (uint8_t i = 0; i < chunk_count; i++) chunk_offsets[i + 1] = chunk_offsets[i] + chunk_sizes[i];
+
+    out->size = chunk_offsets[chunk_count] + SHA_DIGEST_LENGTH;
+    out->data = calloc(1, out->size);
+    validate(out->data, "Failed to allocate memory.");
+
+    unsigned char *data = (unsigned char *)out->data;
+
+    memcpy(data, MIDX_SIGNATURE, 4);
+    data[4] = MIDX_VERSION;
+    data[5] = MIDX_HASH_VERSION;
+    data[6] = chunk_count;
+    data[7] = 0;
+    put_be32(&data[8], pack_count);
+
+    for (uint8_t i = 0; i <= chunk_count; i++)
+    {
+        unsigned char *entry = &data[MIDX_HEADER_SIZE + (size_t)i * MIDX_CHUNK_ENTRY_SIZE];
+        put_be32(entry, i < chunk_count ? chunk_ids[i] : 0);
+        put_be64(&entry[4], chunk_offsets[i]);
+    }
+
+    char *names = (char *)&data[chunk_offsets[0]];
+    for (uint32_t i = 0; i < pack_count; i++)
+    {
+        const size_t len = strlen(packs[i].idx_name) + 1;
+        memcpy(names, packs[i].idx_name, len);
+        names += len;
+    }
+
+    unsigned char *fanout = &data[chunk_offsets[1]];
+    unsigned char *lookup = &data[chunk_offsets[2]];
+    unsigned char *offsets = &data[chunk_offsets[3]];
+    unsigned char *large_offsets = &data[chunk_offsets[4]];
+    uint32_t counts[256] = { };
+    uint32_t large_index = 0;
+
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        const midx_entry *entry = &entries[i];
+
+        counts[entry->hash[0]]++;
+        memcpy(&lookup[(size_t)i * SHA_DIGEST_LENGTH], entry->hash, SHA_DIGEST_LENGTH);
+        put_be32(&offsets[(size_t)i * MIDX_OFFSET_SIZE], entry->pack_id);
+
+        if (entry->offset >= MIDX_LARGE_OFFSET_NEEDED)
+        {
+            put_be32(&offsets[(size_t)i * MIDX_OFFSET_SIZE + 4], MIDX_LARGE_OFFSET_NEEDED | large_index);
+            put_be64(&large_offsets[(size_t)large_index++ * 8], entry->offset);
+        }
+        else
+        {
+            put_be32(&offsets[(size_t)i * MIDX_OFFSET_SIZE + 4], (uint32_t)entry->offset);
+        }
+    }
+
+    uint32_t cumulative = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        cumulative += counts[i];
+        put_be32(&fanout[i * 4], cumulative);
+    }
+
+    SHA1(data, out->size - SHA_DIGEST_LENGTH, &data[out->size - SHA_DIGEST_LENGTH]);
+
+    return true;
+
+error:
+    *out = (buffer){ };
+
+    return false;
+}
+
+bool write_multi_pack_index(void)
+{
+    midx_pack *packs = nullptr;
+    midx_entry *entries = nullptr;
+    uint32_t entry_count = 0;
+    buffer content = { };
+
+    uint32_t pack_count = 0;
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next) pack_count++;
+
+    validate(pack_count > 0, "The repository has no packs to index.");
+
+    packs = calloc(pack_count, sizeof(midx_pack));
+    validate(packs, "Failed to allocate memory.");
+
+    uint32_t i = 0;
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next, i++)
+    {
+        struct stat st;
+        validate(stat(pack->pack_path, &st) == 0, "Failed to stat '%s'.", pack->pack_path);
+
+        packs[i].pack = pack;
+        packs[i].mtime = st.st_mtime;
+        validate(get_pack_idx_name(pack, packs[i].idx_name), "Failed to name pack index.");
+    }
+
+    qsort(packs, pack_count, sizeof(midx_pack), compare_midx_packs);
+
+    validate(merge_pack_entries(packs, pack_count, &entries, &entry_count), "Failed to merge pack indexes.");
+    validate(serialize_multi_pack_index(packs, pack_count, entries, entry_count, &content), "Failed to serialize multi-pack-index.");
+
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, "objects/pack/multi-pack-index"), "Failed to resolve multi-pack-index path.");
+    validate(replace_file_atomically(path, (const unsigned char *)content.data, content.size), "Failed to write '%s'.", path);
+
+    free(content.data);
+    free(entries);
+    free(packs);
+
+    reprepare_packed_git();
+
+    return true;
+
+error:
+    if (content.data) free(content.data);
+    if (entries) free(entries);
+    if (packs) free(packs);
+
+    return false;
+}
@@ -0,0 +1,56 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#include "packfile.h"
+
+#define MIDX_SIGNATURE "MIDX"
+#define MIDX_VERSION 1
+#define MIDX_HASH_VERSION 1
+#define MIDX_HEADER_SIZE 12
+#define MIDX_CHUNK_ENTRY_SIZE 12
+#define MIDX_OFFSET_SIZE 8
+
+#define MIDX_CHUNK_ID_PACK_NAMES 0x504e414d // "PNAM"
+#define MIDX_CHUNK_ID_OID_FANOUT 0x4f494446 // "OIDF"
+#define MIDX_CHUNK_ID_OID_LOOKUP 0x4f49444c // "OIDL"
+#define MIDX_CHUNK_ID_OBJECT_OFFSETS 0x4f4f4646 // "OOFF"
+#define MIDX_CHUNK_ID_LARGE_OFFSETS 0x4c4f4646 // "LOFF"
+
+#define MIDX_LARGE_OFFSET_NEEDED 0x80000000
+
+// .git/objects/pack/multi-pack-index: one fan-out and sorted oid table over
+// several packs, each oid mapped to the pack and offset to read it from
+typedef struct midx_file
+{
+    const unsigned char *data;
+    size_t size;
+    uint32_t pack_count;
+    uint32_t object_count;
+    const unsigned char *pack_names;
+    const unsigned char *oid_fanout;
+    const unsigned char *oid_lookup;
+    const unsigned char *object_offsets;
+    const unsigned char *large_offsets;
+    size_t large_offset_count;
+
+    // By pack id, in the order of the pack names chunk
+    packed_git **packs;
+} midx_file;
+
+// nullptr when there is no multi-pack-index, it is invalid, or a pack it
+// names is gone
+const midx_file *get_multi_pack_index(void);
+
+void reprepare_multi_pack_index(void);
+
+bool find_midx_entry(const unsigned char hash[SHA_DIGEST_LENGTH], packed_git **pack, uint64_t *offset);
+
+// Writes a multi-pack-index over every pack in the repository. Objects in
+// several packs are taken from the most recently modified one.
+bool write_multi_pack_index(void);
+
+#endif //MIDX_H
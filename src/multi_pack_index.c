@@ -0,0 +1,18 @@
+#include "multi_pack_index.h"
+
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "midx.h"
+
+// multi-pack-index write
+int multi_pack_index(const int argc, char *argv[])
+{
+    validate(argc == 3 && strcmp(argv[2], "write") == 0, "Usage: multi-pack-index write");
+    validate(write_multi_pack_index(), "Failed to write multi-pack-index.");
+
+    return 0;
+
+error:
+    return 1;
+}
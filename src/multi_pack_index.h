@@ -0,0 +1,6 @@
+#ifndef MULTI_PACK_INDEX_H
+#define MULTI_PACK_INDEX_H
+
+int multi_pack_index(int argc, char *argv[]);
+
+#endif //MULTI_PACK_INDEX_H
@@ -0,0 +1,283 @@
+#include "object_filter.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "midx.h"
+#include "oid_map.h"
+#include "packfile.h"
+#include "trace.h"
+
+// 512-bit blocks keep every probe of a lookup within one cache line
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+#define BLOOM_BITS_PER_OBJECT 10
+#define BLOOM_PROBES 7
+#define BLOOM_MIN_BLOCKS 64
+
+#define RECENT_SLOTS 4096
+
+typedef struct recent_slot
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    bool is_used;
+} recent_slot;
+
+typedef struct object_filter
+{
+    // Packed objects; nullptr when it could not be allocated, which makes
+    // every packed lookup go to the pack indexes
+    uint64_t *blocks;
+    size_t block_count;
+
+    // Loose objects, listed one fan-out directory at a time
+    oid_map loose;
+    bool is_fanout_loaded[256];
+
+    recent_slot recent[RECENT_SLOTS];
+} object_filter;
+
+// The Bloom blocks, the pack list and the multi-pack-index are loaded once
+// under the lock and only read afterwards, so pack lookups run unlocked. The
+// lock covers the loose map, the loaded fan-outs and the recent hits.
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static object_filter filter = { };
+static atomic_bool is_filter_prepared = false;
+
+// Oids are uniformly distributed, so their bytes serve as the hash bits.
+// Bytes 0-7 already pick oid_map slots; the filter uses the ones after.
+static uint64_t *get_bloom_block(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    uint64_t key;
+    memcpy(&key, &hash[4], sizeof(key));
+
+    return &filter.blocks[(key & (filter.block_count - 1)) * BLOOM_BLOCK_WORDS];
+}
+
+static uint64_t get_bloom_bits(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    uint64_t bits;
+    memcpy(&bits, &hash[12], sizeof(bits));
+
+    return bits;
+}
+
+static void bloom_add(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    uint64_t *block = get_bloom_block(hash);
+    uint64_t bits = get_bloom_bits(hash);
+
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9)
+    {
+        const uint32_t pos = bits % BLOOM_BLOCK_BITS;
+        block[pos / 64] |= 1ULL << (pos % 64);
+    }
+}
+
+static bool bloom_may_contain(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (!filter.blocks) return true;
+
+    const uint64_t *block = get_bloom_block(hash);
+    uint64_t bits = get_bloom_bits(hash);
+
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9)
+    {
+        const uint32_t pos = bits % BLOOM_BLOCK_BITS;
+        if (!(block[pos / 64] >> (pos % 64) & 1)) return false;
+    }
+
+    return true;
+}
+
+static void load_object_filter(void)
+{
+    (void)get_multi_pack_index();
+    (void)oid_map_init(&filter.loose, 64);
+
+    size_t object_count = 0;
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next) object_count += pack->object_count;
+
+    const size_t wanted_blocks = object_count * BLOOM_BITS_PER_OBJECT / BLOOM_BLOCK_BITS + 1;
+    size_t block_count = BLOOM_MIN_BLOCKS;
+    while (block_count < wanted_blocks) block_count *= 2;
+
+    filter.blocks = calloc(block_count * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+    if (!filter.blocks) return;
+
+    filter.block_count = block_count;
+
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        for (uint32_t i = 0; i < pack->object_count; i++) bloom_add(get_pack_idx_hash(pack, i));
+    }
+}
+
+static void prepare_object_filter(void)
+{
+    if (atomic_load_explicit(&is_filter_prepared, memory_order_acquire)) return;
+
+    pthread_mutex_lock(&filter_lock);
+
+    if (!atomic_load_explicit(&is_filter_prepared, memory_order_relaxed))
+    {
+        load_object_filter();
+        atomic_store_explicit(&is_filter_prepared, true, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&filter_lock);
+}
+
+// One readdir of objects/xx answers every later question about oids
+// starting with xx, where probing each candidate path costs a syscall. The
+// directory is read without the lock; a racing thread at worst lists the
+// same fan-out twice, and only the first listing is kept.
+static bool load_loose_fanout(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    const unsigned char first_byte = hash[0];
+    unsigned char (*hashes)[SHA_DIGEST_LENGTH] = nullptr;
+    size_t hash_count = 0;
+    size_t hash_capacity = 0;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    (void)snprintf(hash_hex, sizeof(hash_hex), "%02x", first_byte);
+
+    char dir_path[PATH_MAX];
+    char subdir[16];
+    (void)snprintf(subdir, sizeof(subdir), "objects/%02x", first_byte);
+
+    DIR *dir = get_git_path(dir_path, PATH_MAX, subdir) ? opendir(dir_path) : nullptr;
+
+    if (dir)
+    {
+        const struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (strlen(entry->d_name) != SHA_HEX_LENGTH - 2) continue;
+
+            memcpy(&hash_hex[2], entry->d_name, SHA_HEX_LENGTH - 2);
+            hash_hex[SHA_HEX_LENGTH] = '\0';
+
+            if (hash_count == hash_capacity)
+            {
+                const size_t capacity = hash_capacity ? hash_capacity * 2 : 64;
+                void *grown = realloc(hashes, capacity * SHA_DIGEST_LENGTH);
+                if (!grown) break;
+
+                hashes = grown;
+                hash_capacity = capacity;
+            }
+
+            if (hash_hex_to_bytes(hashes[hash_count], hash_hex)) hash_count++;
+        }
+
+        closedir(dir);
+    }
+
+    pthread_mutex_lock(&filter_lock);
+
+    if (!filter.is_fanout_loaded[first_byte])
+    {
+        filter.is_fanout_loaded[first_byte] = true;
+
+        if (filter.loose.entries)
+        {
+            for (size_t i = 0; i < hash_count; i++) (void)oid_map_put(&filter.loose, hashes[i], 0);
+        }
+    }
+
+    const bool is_found = filter.loose.entries && oid_map_contains(&filter.loose, hash);
+
+    pthread_mutex_unlock(&filter_lock);
+
+    if (hashes) free(hashes);
+
+    return is_found;
+}
+
+static recent_slot *get_recent_slot(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    const uint32_t key = (uint32_t)hash[16] << 8 | hash[17];
+
+    return &filter.recent[key % RECENT_SLOTS];
+}
+
+static void remember_recent(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    recent_slot *slot = get_recent_slot(hash);
+
+    memcpy(slot->hash, hash, SHA_DIGEST_LENGTH);
+    slot->is_used = true;
+}
+
+bool has_object(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    prepare_object_filter();
+
+    pthread_mutex_lock(&filter_lock);
+
+    const recent_slot *slot = get_recent_slot(hash);
+    bool is_found = slot->is_used && memcmp(slot->hash, hash, SHA_DIGEST_LENGTH) == 0;
+    const bool is_fanout_loaded = filter.is_fanout_loaded[hash[0]];
+
+    if (is_found)
+    {
+        trace_counter_add(TRACE_COUNTER_CACHE_HITS, 1);
+    }
+    else if (is_fanout_loaded)
+    {
+        is_found = filter.loose.entries && oid_map_contains(&filter.loose, hash);
+    }
+
+    pthread_mutex_unlock(&filter_lock);
+
+    if (!is_found && !is_fanout_loaded) is_found = load_loose_fanout(hash);
+
+    if (!is_found && bloom_may_contain(hash))
+    {
+        packed_git *pack;
+        uint64_t offset;
+        is_found = find_pack_entry(hash, &pack, &offset);
+    }
+
+    if (is_found)
+    {
+        pthread_mutex_lock(&filter_lock);
+        remember_recent(hash);
+        pthread_mutex_unlock(&filter_lock);
+    }
+
+    return is_found;
+}
+
+void note_object_written(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    prepare_object_filter();
+
+    pthread_mutex_lock(&filter_lock);
+
+    if (filter.loose.entries) (void)oid_map_put(&filter.loose, hash, 0);
+    remember_recent(hash);
+
+    pthread_mutex_unlock(&filter_lock);
+}
+
+void reprepare_object_filter(void)
+{
+    pthread_mutex_lock(&filter_lock);
+
+    if (filter.blocks) free(filter.blocks);
+    if (filter.loose.entries) oid_map_destroy(&filter.loose);
+
+    filter = (object_filter){ };
+    atomic_store(&is_filter_prepared, false);
+
+    pthread_mutex_unlock(&filter_lock);
+}
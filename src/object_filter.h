@@ -0,0 +1,20 @@
+#ifndef OBJECT_FILTER_H
+#define OBJECT_FILTER_H
+
+#include <openssl/sha.h>
+
+// Whether the repository has an object, loose or packed, answered from
+// memory where possible: a blocked Bloom filter over the packed objects
+// rules out new content, a set of recent hits catches repeated content, and
+// each loose fan-out directory is listed once instead of probed per object.
+// Safe to call from several threads.
+bool has_object(const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Records an object this process has just stored
+void note_object_written(const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Drops everything cached, for when packs were added or removed. Must not
+// run while other threads look objects up.
+void reprepare_object_filter(void);
+
+#endif //OBJECT_FILTER_H
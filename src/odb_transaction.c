@@ -0,0 +1,316 @@
+#include "odb_transaction.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "trace.h"
+
+typedef struct pending_object
+{
+    char *tmp_path;
+    char *final_path;
+} pending_object;
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pending_object *pending_objects = nullptr;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+static bool is_exit_handler_registered = false;
+
+static pthread_once_t fsync_mode_once = PTHREAD_ONCE_INIT;
+static fsync_mode configured_fsync_mode = FSYNC_NONE;
+
+static void resolve_fsync_mode(void)
+{
+    const char *value = get_config_value("core.fsync");
+
+    if (value && strcasecmp(value, "batch") == 0)
+    {
+        configured_fsync_mode = FSYNC_BATCH;
+    }
+    else if (value && (strcasecmp(value, "object") == 0 || get_config_bool("core.fsync", false)))
+    {
+        configured_fsync_mode = FSYNC_OBJECT;
+    }
+}
+
+// Object writers ask from several threads, so the mode is resolved once
+fsync_mode get_fsync_mode(void)
+{
+    pthread_once(&fsync_mode_once, resolve_fsync_mode);
+
+    return configured_fsync_mode;
+}
+
+bool fsync_directory(const char *dir_path)
+{
+    // open, fsync and close
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 3);
+
+    const int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    validate(fd != -1, "Failed to open '%s'.", dir_path);
+
+    const int result = fsync(fd);
+    close(fd);
+    validate(result == 0, "Failed to fsync '%s'.", dir_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool fsync_parent_dir(const char *path)
+{
+    char dir_path[PATH_MAX];
+    (void)snprintf(dir_path, PATH_MAX, "%s", path);
+
+    char *slash = strrchr(dir_path, '/');
+    if (slash) *slash = '\0';
+
+    return fsync_directory(dir_path);
+}
+
+// Moves a fully written temporary object into place. link() fails instead of
+// replacing an existing file, so a present object is never overwritten and
+// racing writers of the same object both succeed.
+static bool move_into_place(const char *tmp_path, const char *final_path)
+{
+    bool result = true;
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+
+    if (link(tmp_path, final_path) != 0 && errno != EEXIST)
+    {
+        // Filesystems without hard links
+        trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+        result = access(final_path, F_OK) == 0;
+
+        if (!result)
+        {
+            trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+            result = rename(tmp_path, final_path) == 0;
+        }
+    }
+
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+    (void)unlink(tmp_path);
+    errno = 0;
+
+    return result;
+}
+
+static void end_odb_transaction_at_exit(void)
+{
+    (void)end_odb_transaction();
+}
+
+static bool add_pending_object(const char *tmp_path, const char *final_path)
+{
+    pthread_mutex_lock(&pending_lock);
+
+    if (pending_count == pending_capacity)
+    {
+        const size_t capacity = pending_capacity ? pending_capacity * 2 : 256;
+        pending_object *objects = realloc(pending_objects, capacity * sizeof(pending_object));
+
+        if (!objects)
+        {
+            pthread_mutex_unlock(&pending_lock);
+            validate(false, "Failed to allocate memory.");
+        }
+
+        pending_objects = objects;
+        pending_capacity = capacity;
+    }
+
+    pending_object *object = &pending_objects[pending_count];
+    object->tmp_path = strdup(tmp_path);
+    object->final_path = strdup(final_path);
+
+    if (!object->tmp_path || !object->final_path)
+    {
+        if (object->tmp_path) free(object->tmp_path);
+        if (object->final_path) free(object->final_path);
+        pthread_mutex_unlock(&pending_lock);
+        validate(false, "Failed to allocate memory.");
+    }
+
+    pending_count++;
+
+    if (!is_exit_handler_registered)
+    {
+        is_exit_handler_registered = true;
+        atexit(end_odb_transaction_at_exit);
+    }
+
+    pthread_mutex_unlock(&pending_lock);
+
+    return true;
+
+error:
+    return false;
+}
+
+bool finalize_object_file(const char *tmp_path, const char *final_path)
+{
+    switch (get_fsync_mode())
+    {
+        case FSYNC_BATCH:
+            return add_pending_object(tmp_path, final_path);
+        case FSYNC_OBJECT:
+            validate(move_into_place(tmp_path, final_path), "Failed to move object to '%s'.", final_path);
+            return fsync_parent_dir(final_path);
+        case FSYNC_NONE:
+        default:
+            return move_into_place(tmp_path, final_path);
+    }
+
+error:
+    return false;
+}
+
+bool replace_file_atomically(const char *final_path, const unsigned char *data, const size_t size)
+{
+    char dir_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int fd = -1;
+
+    (void)snprintf(dir_path, PATH_MAX, "%s", final_path);
+
+    char *slash = strrchr(dir_path, '/');
+    validate(slash, "Invalid path '%s'.", final_path);
+    *slash = '\0';
+
+    const int tmp_path_len = snprintf(tmp_path, PATH_MAX, "%s/tmp_file_XXXXXX", dir_path);
+    validate(tmp_path_len < PATH_MAX, "Path too long '%s'.", final_path);
+
+    fd = mkstemp(tmp_path);
+    validate(fd != -1, "Failed to create temporary file '%s'.", tmp_path);
+
+    for (size_t written = 0; written < size;)
+    {
+        const ssize_t result = write(fd, &data[written], size - written);
+        validate(result > 0, "Failed to write '%s'.", tmp_path);
+        written += result;
+    }
+
+    validate(get_fsync_mode() == FSYNC_NONE || fsync(fd) == 0, "Failed to fsync '%s'.", tmp_path);
+    validate(close(fd) == 0, "Failed to close '%s'.", tmp_path);
+    fd = -1;
+
+    (void)chmod(tmp_path, 0444);
+    validate(rename(tmp_path, final_path) == 0, "Failed to move '%s' into place.", final_path);
+    validate(get_fsync_mode() == FSYNC_NONE || fsync_directory(dir_path), "Failed to fsync '%s'.", dir_path);
+
+    return true;
+
+error:
+    if (fd != -1) close(fd);
+    (void)unlink(tmp_path);
+
+    return false;
+}
+
+bool replace_locked_file(const char *final_path, const unsigned char *data, const size_t size)
+{
+    char lock_path[PATH_MAX + 8];
+    lock_path[0] = '\0';
+    int lock_fd = -1;
+
+    (void)snprintf(lock_path, sizeof(lock_path), "%s.lock", final_path);
+
+    lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (lock_fd == -1) lock_path[0] = '\0';
+    validate(lock_fd != -1, "Unable to lock '%s'. Another process may be updating it.", final_path);
+
+    for (size_t written = 0; written < size;)
+    {
+        const ssize_t result = write(lock_fd, &data[written], size - written);
+        validate(result > 0, "Failed to write '%s'.", lock_path);
+        written += result;
+    }
+
+    validate(get_fsync_mode() == FSYNC_NONE || fsync(lock_fd) == 0, "Failed to fsync '%s'.", lock_path);
+
+    const int close_result = close(lock_fd);
+    lock_fd = -1;
+    validate(close_result == 0, "Failed to write '%s'.", lock_path);
+
+    validate(rename(lock_path, final_path) == 0, "Failed to move '%s' into place.", final_path);
+
+    return true;
+
+error:
+    if (lock_fd != -1) close(lock_fd);
+    if (lock_path[0]) (void)unlink(lock_path);
+
+    return false;
+}
+
+static bool sync_object_filesystem(void)
+{
+    char objects_path[PATH_MAX];
+    validate(get_git_path(objects_path, PATH_MAX, "objects"), "Failed to resolve objects directory.");
+
+    // open, syncfs and close
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 3);
+
+    const int fd = open(objects_path, O_RDONLY | O_DIRECTORY);
+    validate(fd != -1, "Failed to open '%s'.", objects_path);
+
+    const int result = syncfs(fd);
+    close(fd);
+    validate(result == 0, "Failed to sync '%s'.", objects_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Publishes the objects written in batch mode: one syncfs() makes their
+// content durable before any of them gets its final name, and a second one
+// persists the new directory entries.
+bool end_odb_transaction(void)
+{
+    bool result = true;
+
+    pthread_mutex_lock(&pending_lock);
+
+    if (pending_count > 0)
+    {
+        result = sync_object_filesystem();
+
+        for (size_t i = 0; i < pending_count; i++)
+        {
+            if (result)
+            {
+                result = move_into_place(pending_objects[i].tmp_path, pending_objects[i].final_path);
+            }
+            else
+            {
+                trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
+                (void)unlink(pending_objects[i].tmp_path);
+            }
+
+            free(pending_objects[i].tmp_path);
+            free(pending_objects[i].final_path);
+        }
+
+        result = result && sync_object_filesystem();
+        pending_count = 0;
+    }
+
+    pthread_mutex_unlock(&pending_lock);
+
+    return result;
+}
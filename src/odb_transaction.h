@@ -0,0 +1,32 @@
+#ifndef ODB_TRANSACTION_H
+#define ODB_TRANSACTION_H
+
+// core.fsync:
+//   none   - (default) rely on the OS to write objects back eventually
+//   object - fsync every object file and its fan-out directory
+//   batch  - keep new objects under temporary names and make them durable
+//            with a single syncfs() when the command finishes
+typedef enum fsync_mode
+{
+    FSYNC_NONE,
+    FSYNC_OBJECT,
+    FSYNC_BATCH,
+} fsync_mode;
+
+fsync_mode get_fsync_mode(void);
+
+bool fsync_directory(const char *dir_path);
+
+bool finalize_object_file(const char *tmp_path, const char *final_path);
+
+// Writes a whole file under a temporary name next to final_path and renames
+// it over, so readers see either the old file or the complete new one
+bool replace_file_atomically(const char *final_path, const unsigned char *data, size_t size);
+
+// Same, through final_path.lock the way git locks files it rewrites, so that
+// it fails instead of racing another writer holding the lock
+bool replace_locked_file(const char *final_path, const unsigned char *data, size_t size);
+
+bool end_odb_transaction(void);
+
+#endif //ODB_TRANSACTION_H
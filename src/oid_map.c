@@ -0,0 +1,122 @@
+#include "oid_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+
+#define OID_MAP_MIN_CAPACITY 64
+
+static size_t get_slot(const unsigned char hash[SHA_DIGEST_LENGTH], const size_t capacity)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+
+    return key & (capacity - 1);
+}
+
+static oid_map_entry *find_entry(const oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    size_t slot = get_slot(hash, map->capacity);
+
+    while (map->entries[slot].is_used)
+    {
+        if (memcmp(map->entries[slot].hash, hash, SHA_DIGEST_LENGTH) == 0) break;
+
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    return &map->entries[slot];
+}
+
+static bool resize(oid_map *map, const size_t capacity)
+{
+    oid_map_entry *old_entries = map->entries;
+    const size_t old_capacity = map->capacity;
+
+    map->entries = calloc(capacity, sizeof(oid_map_entry));
+    validate(map->entries, "Failed to allocate memory.");
+    map->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_entries[i].is_used)
+        {
+            *find_entry(map, old_entries[i].hash) = old_entries[i];
+        }
+    }
+
+    if (old_entries) free(old_entries);
+
+    return true;
+
+error:
+    map->entries = old_entries;
+    map->capacity = old_capacity;
+
+    return false;
+}
+
+bool oid_map_init(oid_map *map, const size_t expected_count)
+{
+    map->entries = nullptr;
+    map->count = 0;
+    map->capacity = 0;
+
+    // Keep the load factor under 1/2
+    size_t capacity = OID_MAP_MIN_CAPACITY;
+    while (capacity < expected_count * 2) capacity *= 2;
+
+    return resize(map, capacity);
+}
+
+void oid_map_destroy(oid_map *map)
+{
+    if (map->entries) free(map->entries);
+
+    map->entries = nullptr;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+bool oid_map_put(oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH], const uint64_t value)
+{
+    if ((map->count + 1) * 2 > map->capacity)
+    {
+        validate(resize(map, map->capacity * 2), "Failed to grow oid map.");
+    }
+
+    oid_map_entry *entry = find_entry(map, hash);
+
+    if (!entry->is_used)
+    {
+        memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+        entry->is_used = true;
+        map->count++;
+    }
+
+    entry->value = value;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool oid_map_get(const oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH], uint64_t *value)
+{
+    if (map->capacity == 0) return false;
+
+    const oid_map_entry *entry = find_entry(map, hash);
+
+    if (!entry->is_used) return false;
+
+    if (value) *value = entry->value;
+
+    return true;
+}
+
+bool oid_map_contains(const oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    return oid_map_get(map, hash, nullptr);
+}
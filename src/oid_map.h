@@ -0,0 +1,34 @@
+#ifndef OID_MAP_H
+#define OID_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+// Open addressing hash table keyed by raw object ids. Oids are uniformly
+// distributed already, so their leading bytes serve directly as the hash.
+typedef struct oid_map_entry
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    bool is_used;
+    uint64_t value;
+} oid_map_entry;
+
+typedef struct oid_map
+{
+    oid_map_entry *entries;
+    size_t count;
+    size_t capacity;
+} oid_map;
+
+bool oid_map_init(oid_map *map, size_t expected_count);
+
+void oid_map_destroy(oid_map *map);
+
+bool oid_map_put(oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH], uint64_t value);
+
+bool oid_map_get(const oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH], uint64_t *value);
+
+bool oid_map_contains(const oid_map *map, const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+#endif //OID_MAP_H
@@ -0,0 +1,897 @@
+#include "pack_bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+#include "tree_walk.h"
+
+// Recent history gets a bitmap for every commit, older history sparser
+// ones, spaced the way git spaces them
+#define BITMAP_MUST_REGION 100
+#define BITMAP_MIN_REGION 20000
+#define BITMAP_MIN_SPACING 100
+#define BITMAP_MAX_SPACING 5000
+
+typedef enum walk_status
+{
+    WALK_OK,
+    WALK_NOT_COVERED,
+    WALK_ERROR,
+} walk_status;
+
+// ORs the stored bitmap of commit into dest, if there is one
+typedef bool (*apply_stored_fn)(void *data, const commit *commit, bitmap *dest, bool *is_applied);
+
+// Sets the bits of every object reachable from some roots. Objects already
+// in result or in seen are not descended into: their closure is covered.
+typedef struct bitmap_walk
+{
+    packed_git *pack;
+
+    // Where objects outside the pack go; without it they end the walk
+    pack_bitmap_index *extend_into;
+
+    bitmap *result;
+    const bitmap *seen;
+    apply_stored_fn apply_stored;
+    void *data;
+} bitmap_walk;
+
+typedef struct dfs_frame
+{
+    commit *commit;
+    uint32_t next_parent;
+} dfs_frame;
+
+typedef struct selected_bitmap
+{
+    commit *commit;
+    ewah_bitmap bitmap;
+} selected_bitmap;
+
+typedef struct bitmap_writer
+{
+    selected_bitmap *selected;
+    size_t selected_count;
+
+    // Commit oid to its slot in selected, once that bitmap is built
+    oid_map done;
+} bitmap_writer;
+
+static pack_bitmap_index *bitmap_index = nullptr;
+static bool is_bitmap_index_prepared = false;
+
+static bool find_pack_position(const packed_git *pack, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *position)
+{
+    uint32_t idx_position;
+    if (!find_pack_idx_position(pack, hash, &idx_position)) return false;
+
+    *position = pack->pack_positions[idx_position];
+
+    return true;
+}
+
+static bool is_walked(const bitmap_walk *walk, const uint32_t position)
+{
+    return bitmap_get(walk->result, position) || (walk->seen && bitmap_get(walk->seen, position));
+}
+
+static uint64_t get_pack_position_offset(const packed_git *pack, const uint32_t position)
+{
+    return get_pack_idx_offset(pack, pack->revindex[position]);
+}
+
+static bitmap *get_type_bitmap(pack_bitmap_index *index, const object_type type)
+{
+    switch (type)
+    {
+        case OBJ_COMMIT:
+            return &index->commits;
+        case OBJ_TREE:
+            return &index->trees;
+        case OBJ_BLOB:
+            return &index->blobs;
+        case OBJ_TAG:
+            return &index->tags;
+        default:
+            return nullptr;
+    }
+}
+
+static bool add_extended_object(pack_bitmap_index *index, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, uint32_t *position)
+{
+    extended_index *extended = &index->extended;
+
+    if (extended->count == extended->capacity)
+    {
+        const uint32_t capacity = extended->capacity ? extended->capacity * 2 : 64;
+
+        unsigned char (*hashes)[SHA_DIGEST_LENGTH] = realloc(extended->hashes, (size_t)capacity * SHA_DIGEST_LENGTH);
+        validate(hashes, "Failed to allocate memory.");
+
+        extended->hashes = hashes;
+        extended->capacity = capacity;
+    }
+
+    if (!extended->positions.entries) validate(oid_map_init(&extended->positions, 64), "Failed to allocate memory.");
+
+    *position = index->pack->object_count + extended->count;
+
+    memcpy(extended->hashes[extended->count], hash, SHA_DIGEST_LENGTH);
+    validate(oid_map_put(&extended->positions, hash, *position), "Failed to index object.");
+    validate(bitmap_set(get_type_bitmap(index, type), *position), "Failed to set bit.");
+    extended->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static walk_status find_walk_position(const bitmap_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, uint32_t *position)
+{
+    if (find_pack_position(walk->pack, hash, position)) return WALK_OK;
+    if (!walk->extend_into) return WALK_NOT_COVERED;
+
+    uint64_t value;
+    if (walk->extend_into->extended.positions.entries && oid_map_get(&walk->extend_into->extended.positions, hash, &value))
+    {
+        *position = (uint32_t)value;
+        return WALK_OK;
+    }
+
+    return add_extended_object(walk->extend_into, hash, type, position) ? WALK_OK : WALK_ERROR;
+}
+
+// Returns the tree entries without any object header
+static char *read_tree_content(const bitmap_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH], const uint32_t position, size_t *start, size_t *size)
+{
+    char *content = nullptr;
+    *start = 0;
+
+    if (position < walk->pack->object_count)
+    {
+        object_type type;
+        *size = read_packed_object(walk->pack, get_pack_position_offset(walk->pack, position), &type, &content);
+        validate(content && type == OBJ_TREE, "Failed to read tree at pack position %u.", position);
+
+        return content;
+    }
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    *size = get_object_content(hex, &content);
+    validate(content && strncmp(content, "tree ", 5) == 0, "Failed to read tree %s.", hex);
+
+    *start = get_header_size(content) + 1;
+
+    return content;
+
+error:
+    if (content) free(content);
+
+    return nullptr;
+}
+
+// Trees are parsed in place: the walk only needs modes and oids
+static walk_status walk_tree(bitmap_walk *walk, const unsigned char hash[SHA_DIGEST_LENGTH], const uint32_t position)
+{
+    walk_status status = WALK_ERROR;
+
+    size_t pos;
+    size_t size;
+    char *content = read_tree_content(walk, hash, position, &pos, &size);
+    validate(content, "Failed to read tree.");
+
+    while (pos < size)
+    {
+        unsigned int mode = 0;
+        while (pos < size && content[pos] != ' ') mode = mode << 3 | (content[pos++] - '0');
+
+        const char *name_end = memchr(&content[pos], '\0', size - pos);
+        validate(name_end && (size_t)(name_end - content) + 1 + SHA_DIGEST_LENGTH <= size, "Truncated tree entry.");
+
+        const unsigned char *entry_hash = (const unsigned char *)name_end + 1;
+        pos = (size_t)(name_end - content) + 1 + SHA_DIGEST_LENGTH;
+
+        // Submodule commits live in another repository
+        if ((mode & 0170000) == TREE_MODE_GITLINK) continue;
+
+        uint32_t entry_position;
+        status = find_walk_position(walk, entry_hash, is_tree_mode(mode) ? OBJ_TREE : OBJ_BLOB, &entry_position);
+        if (status != WALK_OK) goto error;
+
+        if (is_walked(walk, entry_position)) continue;
+
+        status = WALK_ERROR;
+        validate(bitmap_set(walk->result, entry_position), "Failed to set bit.");
+
+        if (is_tree_mode(mode))
+        {
+            status = walk_tree(walk, entry_hash, entry_position);
+            if (status != WALK_OK) goto error;
+        }
+    }
+
+    free(content);
+
+    return WALK_OK;
+
+error:
+    if (content) free(content);
+
+    return status;
+}
+
+// Commits first, so trees are only walked for commits no stored bitmap
+// covers, and with everything those bitmaps bring in already marked
+static walk_status walk_reachable(bitmap_walk *walk, commit **roots, const size_t root_count)
+{
+    walk_status status = WALK_ERROR;
+    commit_list stack;
+    commit_list pending;
+    commit_list_init(&stack);
+    commit_list_init(&pending);
+
+    for (size_t i = 0; i < root_count; i++) validate(commit_list_append(&stack, roots[i]), "Failed to add commit.");
+
+    while (stack.count)
+    {
+        commit *commit = stack.items[--stack.count];
+
+        uint32_t position;
+        status = find_walk_position(walk, commit->hash, OBJ_COMMIT, &position);
+        if (status != WALK_OK) goto error;
+
+        status = WALK_ERROR;
+        if (is_walked(walk, position)) continue;
+
+        bool is_applied = false;
+        validate(walk->apply_stored(walk->data, commit, walk->result, &is_applied), "Failed to apply bitmap.");
+        if (is_applied) continue;
+
+        validate(bitmap_set(walk->result, position), "Failed to set bit.");
+        validate(parse_commit(commit), "Failed to parse commit.");
+        validate(commit_list_append(&pending, commit), "Failed to add commit.");
+
+        for (uint32_t i = 0; i < commit->parent_count; i++)
+        {
+            validate(commit_list_append(&stack, commit->parents[i]), "Failed to add commit.");
+        }
+    }
+
+    for (size_t i = 0; i < pending.count; i++)
+    {
+        const unsigned char *tree_hash = pending.items[i]->tree_hash;
+
+        uint32_t position;
+        status = find_walk_position(walk, tree_hash, OBJ_TREE, &position);
+        if (status != WALK_OK) goto error;
+
+        status = WALK_ERROR;
+        if (is_walked(walk, position)) continue;
+
+        validate(bitmap_set(walk->result, position), "Failed to set bit.");
+
+        status = walk_tree(walk, tree_hash, position);
+        if (status != WALK_OK) goto error;
+    }
+
+    commit_list_destroy(&stack);
+    commit_list_destroy(&pending);
+
+    return WALK_OK;
+
+error:
+    commit_list_destroy(&stack);
+    commit_list_destroy(&pending);
+
+    return status;
+}
+
+static bool read_type_bitmap(const unsigned char **pos, const unsigned char *end, bitmap *type_bitmap)
+{
+    ewah_bitmap ewah;
+
+    const size_t size = ewah_read(&ewah, *pos, end - *pos);
+    validate(size, "Corrupt type bitmap.");
+
+    *type_bitmap = (bitmap){ };
+    const bool result = bitmap_or_ewah(type_bitmap, &ewah);
+    ewah_release(&ewah);
+    validate(result, "Failed to inflate type bitmap.");
+
+    *pos += size;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_bitmap_index(pack_bitmap_index *index)
+{
+    bitmap_release(&index->commits);
+    bitmap_release(&index->trees);
+    bitmap_release(&index->blobs);
+    bitmap_release(&index->tags);
+
+    for (uint32_t i = 0; index->entries && i < index->entry_count; i++) ewah_release(&index->entries[i].bitmap);
+
+    if (index->entries) free(index->entries);
+    if (index->entry_map.entries) oid_map_destroy(&index->entry_map);
+    if (index->extended.hashes) free(index->extended.hashes);
+    if (index->extended.positions.entries) oid_map_destroy(&index->extended.positions);
+    free(index);
+}
+
+// Header: "BITM", be16 version, be16 options, be32 entry count and the
+// pack checksum; then the commit, tree, blob and tag type bitmaps, and
+// the entries, each a be32 .idx position, XOR offset, flags and bitmap
+static pack_bitmap_index *load_bitmap_index(packed_git *pack)
+{
+    pack_bitmap_index *index = nullptr;
+
+    char path[PATH_MAX];
+    const size_t path_len = strlen(pack->pack_path);
+    validate(path_len > 5 && path_len + 2 < PATH_MAX, "Invalid pack path '%s'.", pack->pack_path);
+
+    memcpy(path, pack->pack_path, path_len - 5);
+    strcpy(&path[path_len - 5], ".bitmap");
+
+    size_t size;
+    const unsigned char *data = map_file(path, &size);
+    if (!data) return nullptr;
+
+    index = calloc(1, sizeof(pack_bitmap_index));
+    validate(index, "Failed to allocate memory.");
+
+    index->pack = pack;
+    index->data = data;
+    index->size = size;
+
+    validate(
+        size >= BITMAP_HEADER_SIZE + SHA_DIGEST_LENGTH
+        && memcmp(data, BITMAP_SIGNATURE, 4) == 0
+        && (data[4] << 8 | data[5]) == BITMAP_VERSION
+        && ((data[6] << 8 | data[7]) & BITMAP_OPT_FULL_DAG),
+        "Unsupported bitmap index '%s'.", path);
+
+    validate(memcmp(&data[12], get_pack_checksum(pack), SHA_DIGEST_LENGTH) == 0, "Bitmap '%s' does not match its pack.", path);
+
+    index->entry_count = get_be32(&data[8]);
+
+    const unsigned char *pos = &data[BITMAP_HEADER_SIZE];
+    const unsigned char *end = &data[size - SHA_DIGEST_LENGTH];
+
+    validate(
+        read_type_bitmap(&pos, end, &index->commits)
+        && read_type_bitmap(&pos, end, &index->trees)
+        && read_type_bitmap(&pos, end, &index->blobs)
+        && read_type_bitmap(&pos, end, &index->tags),
+        "Failed to read type bitmaps from '%s'.", path);
+
+    index->entries = calloc(index->entry_count ? index->entry_count : 1, sizeof(stored_bitmap));
+    validate(index->entries, "Failed to allocate memory.");
+    validate(oid_map_init(&index->entry_map, index->entry_count), "Failed to allocate memory.");
+
+    for (uint32_t i = 0; i < index->entry_count; i++)
+    {
+        stored_bitmap *entry = &index->entries[i];
+
+        validate(end - pos >= BITMAP_ENTRY_HEADER_SIZE, "Truncated bitmap entry in '%s'.", path);
+
+        entry->commit_position = get_be32(pos);
+        entry->xor_offset = pos[4];
+        entry->flags = pos[5];
+        pos += BITMAP_ENTRY_HEADER_SIZE;
+
+        validate(entry->commit_position < pack->object_count, "Bitmap entry out of range in '%s'.", path);
+        validate(entry->xor_offset <= MAX_BITMAP_XOR_OFFSET && entry->xor_offset <= i, "Invalid XOR offset in '%s'.", path);
+
+        const size_t bitmap_size = ewah_read(&entry->bitmap, pos, end - pos);
+        validate(bitmap_size, "Corrupt bitmap entry in '%s'.", path);
+        pos += bitmap_size;
+
+        validate(oid_map_put(&index->entry_map, get_pack_idx_hash(pack, entry->commit_position), i), "Failed to index bitmap entry.");
+    }
+
+    validate(load_pack_revindex(pack), "Failed to build pack reverse index.");
+
+    return index;
+
+error:
+    if (index) release_bitmap_index(index);
+
+    return nullptr;
+}
+
+pack_bitmap_index *get_pack_bitmap_index(void)
+{
+    if (is_bitmap_index_prepared) return bitmap_index;
+
+    is_bitmap_index_prepared = true;
+
+    for (packed_git *pack = get_packed_git_list(); pack && !bitmap_index; pack = pack->next)
+    {
+        bitmap_index = load_bitmap_index(pack);
+    }
+
+    return bitmap_index;
+}
+
+// Entries may be stored XOR'ed with an earlier one, and that one with
+// another; XOR'ing the whole chain together gives the bitmap
+static bool apply_stored_entry(const pack_bitmap_index *index, const uint32_t entry, bitmap *dest)
+{
+    if (!index->entries[entry].xor_offset) return bitmap_or_ewah(dest, &index->entries[entry].bitmap);
+
+    bitmap xored = { };
+
+    for (uint32_t i = entry;; i -= index->entries[i].xor_offset)
+    {
+        validate(bitmap_xor_ewah(&xored, &index->entries[i].bitmap), "Failed to inflate bitmap.");
+
+        if (!index->entries[i].xor_offset) break;
+    }
+
+    validate(bitmap_or(dest, &xored), "Failed to combine bitmaps.");
+    bitmap_release(&xored);
+
+    return true;
+
+error:
+    bitmap_release(&xored);
+
+    return false;
+}
+
+static bool apply_index_bitmap(void *data, const commit *commit, bitmap *dest, bool *is_applied)
+{
+    const pack_bitmap_index *index = data;
+
+    uint64_t entry;
+    *is_applied = oid_map_get(&index->entry_map, commit->hash, &entry);
+
+    return !*is_applied || apply_stored_entry(index, (uint32_t)entry, dest);
+}
+
+bool get_reachable_bitmap(
+    pack_bitmap_index *index,
+    commit **wants,
+    const size_t want_count,
+    commit **haves,
+    const size_t have_count,
+    bitmap *result)
+{
+    bitmap have_bitmap = { };
+
+    validate(bitmap_init(result, index->pack->object_count), "Failed to allocate bitmap.");
+
+    bitmap_walk walk = {
+        .pack = index->pack,
+        .extend_into = index,
+        .result = &have_bitmap,
+        .apply_stored = apply_index_bitmap,
+        .data = index,
+    };
+
+    walk_status status = walk_reachable(&walk, haves, have_count);
+
+    // Haves are walked first so the wants walk stops where they begin
+    if (status == WALK_OK)
+    {
+        walk.result = result;
+        walk.seen = &have_bitmap;
+        status = walk_reachable(&walk, wants, want_count);
+    }
+
+    validate(status != WALK_ERROR, "Failed to walk reachable objects.");
+
+    if (status == WALK_NOT_COVERED)
+    {
+        bitmap_release(&have_bitmap);
+        bitmap_release(result);
+        return false;
+    }
+
+    bitmap_and_not(result, &have_bitmap);
+    bitmap_release(&have_bitmap);
+
+    return true;
+
+error:
+    bitmap_release(&have_bitmap);
+    bitmap_release(result);
+
+    return false;
+}
+
+bool find_bitmap_position(const pack_bitmap_index *index, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *pack_position)
+{
+    if (find_pack_position(index->pack, hash, pack_position)) return true;
+    if (!index->extended.positions.entries) return false;
+
+    uint64_t value;
+    if (!oid_map_get(&index->extended.positions, hash, &value)) return false;
+
+    *pack_position = (uint32_t)value;
+
+    return true;
+}
+
+const unsigned char *get_bitmap_object_hash(const pack_bitmap_index *index, const uint32_t pack_position)
+{
+    if (pack_position >= index->pack->object_count) return index->extended.hashes[pack_position - index->pack->object_count];
+
+    return get_pack_idx_hash(index->pack, index->pack->revindex[pack_position]);
+}
+
+static bool build_type_bitmaps(packed_git *pack, bitmap types[4])
+{
+    for (int i = 0; i < 4; i++) validate(bitmap_init(&types[i], pack->object_count), "Failed to allocate bitmap.");
+
+    for (uint32_t position = 0; position < pack->object_count; position++)
+    {
+        const object_type type = get_packed_object_type(pack, get_pack_position_offset(pack, position));
+        validate(type >= OBJ_COMMIT && type <= OBJ_TAG, "Failed to read object type at pack position %u.", position);
+
+        validate(bitmap_set(&types[type - OBJ_COMMIT], position), "Failed to set bit.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool prepare_commit(const packed_git *pack, const bitmap *commit_types, commit *commit)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, commit->hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    uint32_t position;
+    validate(find_pack_position(pack, commit->hash, &position) && bitmap_get(commit_types, position),
+             "Commit %s is not in the pack.", hex);
+    validate(parse_commit(commit), "Failed to parse commit %s.", hex);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool push_frame(dfs_frame **frames, size_t *depth, size_t *capacity, commit *commit)
+{
+    if (*depth == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+
+        dfs_frame *grown = realloc(*frames, *capacity * sizeof(dfs_frame));
+        validate(grown, "Failed to allocate memory.");
+        *frames = grown;
+    }
+
+    (*frames)[(*depth)++] = (dfs_frame){ .commit = commit };
+
+    return true;
+
+error:
+    return false;
+}
+
+// Orders the commits reachable from tips so that parents come before
+// their children
+static bool collect_commits(const packed_git *pack, const bitmap *commit_types, commit **tips, const size_t tip_count, commit_list *ordered)
+{
+    oid_map visited = { };
+    dfs_frame *frames = nullptr;
+    size_t depth = 0;
+    size_t capacity = 0;
+
+    validate(oid_map_init(&visited, 1024), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < tip_count; i++)
+    {
+        if (oid_map_contains(&visited, tips[i]->hash)) continue;
+
+        validate(oid_map_put(&visited, tips[i]->hash, 0), "Failed to mark commit.");
+        validate(prepare_commit(pack, commit_types, tips[i]), "Failed to prepare commit.");
+        validate(push_frame(&frames, &depth, &capacity, tips[i]), "Failed to add commit.");
+
+        while (depth)
+        {
+            dfs_frame *frame = &frames[depth - 1];
+
+            if (frame->next_parent == frame->commit->parent_count)
+            {
+                validate(commit_list_append(ordered, frame->commit), "Failed to add commit.");
+                depth--;
+                continue;
+            }
+
+            commit *parent = frame->commit->parents[frame->next_parent++];
+            if (oid_map_contains(&visited, parent->hash)) continue;
+
+            validate(oid_map_put(&visited, parent->hash, 0), "Failed to mark commit.");
+            validate(prepare_commit(pack, commit_types, parent), "Failed to prepare commit.");
+            validate(push_frame(&frames, &depth, &capacity, parent), "Failed to add commit.");
+        }
+    }
+
+    oid_map_destroy(&visited);
+    if (frames) free(frames);
+
+    return true;
+
+error:
+    if (visited.entries) oid_map_destroy(&visited);
+    if (frames) free(frames);
+
+    return false;
+}
+
+static size_t get_selection_spacing(const size_t rank)
+{
+    if (rank <= BITMAP_MUST_REGION) return 0;
+
+    if (rank <= BITMAP_MIN_REGION)
+    {
+        const size_t offset = rank - BITMAP_MUST_REGION;
+        return offset < BITMAP_MIN_SPACING ? offset : BITMAP_MIN_SPACING;
+    }
+
+    const size_t offset = rank - BITMAP_MIN_REGION;
+    const size_t spacing = offset < BITMAP_MAX_SPACING ? offset : BITMAP_MAX_SPACING;
+
+    return spacing > BITMAP_MIN_SPACING ? spacing : BITMAP_MIN_SPACING;
+}
+
+static int compare_commits_by_date_desc(const void *a, const void *b)
+{
+    const commit *commit_a = *(commit *const *)a;
+    const commit *commit_b = *(commit *const *)b;
+
+    return (commit_a->date < commit_b->date) - (commit_a->date > commit_b->date);
+}
+
+// Every tip, then commits picked newest first with growing gaps
+static bool select_commits(const commit_list *ordered, commit **tips, const size_t tip_count, oid_map *selected)
+{
+    commit **by_date = malloc((ordered->count ? ordered->count : 1) * sizeof(commit *));
+    validate(by_date, "Failed to allocate memory.");
+
+    memcpy(by_date, ordered->items, ordered->count * sizeof(commit *));
+    qsort(by_date, ordered->count, sizeof(commit *), compare_commits_by_date_desc);
+
+    for (size_t i = 0; i < tip_count; i++) validate(oid_map_put(selected, tips[i]->hash, 0), "Failed to select commit.");
+
+    for (size_t i = 0; i < ordered->count; i += get_selection_spacing(i) + 1)
+    {
+        validate(oid_map_put(selected, by_date[i]->hash, 0), "Failed to select commit.");
+    }
+
+    free(by_date);
+
+    return true;
+
+error:
+    if (by_date) free(by_date);
+
+    return false;
+}
+
+static bool apply_writer_bitmap(void *data, const commit *commit, bitmap *dest, bool *is_applied)
+{
+    const bitmap_writer *writer = data;
+
+    uint64_t slot;
+    *is_applied = oid_map_get(&writer->done, commit->hash, &slot);
+
+    return !*is_applied || bitmap_or_ewah(dest, &writer->selected[slot].bitmap);
+}
+
+// Selected commits are handled parents first, so each walk stops at the
+// bitmaps of the selected commits below it
+static bool build_selected_bitmaps(packed_git *pack, const commit_list *ordered, const oid_map *selected, bitmap_writer *writer)
+{
+    bitmap work = { };
+
+    writer->selected = calloc(selected->count ? selected->count : 1, sizeof(selected_bitmap));
+    validate(writer->selected, "Failed to allocate memory.");
+    validate(oid_map_init(&writer->done, selected->count), "Failed to allocate memory.");
+    validate(bitmap_init(&work, pack->object_count), "Failed to allocate bitmap.");
+
+    bitmap_walk walk = {
+        .pack = pack,
+        .result = &work,
+        .apply_stored = apply_writer_bitmap,
+        .data = writer,
+    };
+
+    for (size_t i = 0; i < ordered->count; i++)
+    {
+        commit *commit = ordered->items[i];
+        if (!oid_map_contains(selected, commit->hash)) continue;
+
+        bitmap_clear(&work);
+
+        const walk_status status = walk_reachable(&walk, &commit, 1);
+        validate(status != WALK_NOT_COVERED, "Not every object reachable from the selected commits is in the pack.");
+        validate(status == WALK_OK, "Failed to walk reachable objects.");
+
+        selected_bitmap *slot = &writer->selected[writer->selected_count];
+        validate(ewah_from_bitmap(&slot->bitmap, &work), "Failed to compress bitmap.");
+        slot->commit = commit;
+
+        validate(oid_map_put(&writer->done, commit->hash, writer->selected_count), "Failed to store bitmap.");
+        writer->selected_count++;
+    }
+
+    bitmap_release(&work);
+
+    return true;
+
+error:
+    bitmap_release(&work);
+
+    return false;
+}
+
+static bool append_ewah(buffer *out, size_t *capacity, const ewah_bitmap *ewah, const unsigned char *header, const size_t header_size)
+{
+    const size_t size = header_size + ewah_serialized_size(ewah);
+
+    if (out->size + size > *capacity)
+    {
+        while (out->size + size > *capacity) *capacity = *capacity ? *capacity * 2 : 4096;
+
+        char *grown = realloc(out->data, *capacity);
+        validate(grown, "Failed to allocate memory.");
+        out->data = grown;
+    }
+
+    memcpy(&out->data[out->size], header, header_size);
+    ewah_serialize(ewah, (unsigned char *)&out->data[out->size + header_size]);
+    out->size += size;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool serialize_bitmap_index(const packed_git *pack, const bitmap types[4], const bitmap_writer *writer, buffer *out)
+{
+    size_t capacity = 0;
+    ewah_bitmap ewah = { };
+
+    *out = (buffer){ };
+
+    unsigned char header[BITMAP_HEADER_SIZE];
+    memcpy(header, BITMAP_SIGNATURE, 4);
+    header[4] = 0;
+    header[5] = BITMAP_VERSION;
+    header[6] = 0;
+    header[7] = BITMAP_OPT_FULL_DAG;
+    put_be32(&header[8], (uint32_t)writer->selected_count);
+    memcpy(&header[12], get_pack_checksum(pack), SHA_DIGEST_LENGTH);
+
+    for (int i = 0; i < 4; i++)
+    {
+        validate(ewah_from_bitmap(&ewah, &types[i]), "Failed to compress type bitmap.");
+        validate(append_ewah(out, &capacity, &ewah, header, i == 0 ? BITMAP_HEADER_SIZE : 0), "Failed to serialize bitmap.");
+        ewah_release(&ewah);
+    }
+
+    for (size_t i = 0; i < writer->selected_count; i++)
+    {
+        const selected_bitmap *selected = &writer->selected[i];
+
+        uint32_t position;
+        validate(find_pack_position(pack, selected->commit->hash, &position), "Selected commit is not in the pack.");
+
+        unsigned char entry_header[BITMAP_ENTRY_HEADER_SIZE];
+        put_be32(entry_header, pack->revindex[position]);
+        entry_header[4] = 0;
+        entry_header[5] = 0;
+
+        validate(append_ewah(out, &capacity, &selected->bitmap, entry_header, BITMAP_ENTRY_HEADER_SIZE), "Failed to serialize bitmap.");
+    }
+
+    char *grown = realloc(out->data, out->size + SHA_DIGEST_LENGTH);
+    validate(grown, "Failed to allocate memory.");
+    out->data = grown;
+
+    SHA1((unsigned char *)out->data, out->size, (unsigned char *)&out->data[out->size]);
+    out->size += SHA_DIGEST_LENGTH;
+
+    return true;
+
+error:
+    ewah_release(&ewah);
+    if (out->data) free(out->data);
+    *out = (buffer){ };
+
+    return false;
+}
+
+static bool write_bitmap_file(const packed_git *pack, const buffer *content)
+{
+    char bitmap_path[PATH_MAX];
+
+    const size_t path_len = strlen(pack->pack_path);
+    validate(path_len > 5 && path_len + 2 < PATH_MAX, "Invalid pack path '%s'.", pack->pack_path);
+    memcpy(bitmap_path, pack->pack_path, path_len - 5);
+    strcpy(&bitmap_path[path_len - 5], ".bitmap");
+
+    return replace_file_atomically(bitmap_path, (const unsigned char *)content->data, content->size);
+
+error:
+    return false;
+}
+
+bool write_pack_bitmap(packed_git *pack, const unsigned char (*tips)[SHA_DIGEST_LENGTH], const size_t tip_count)
+{
+    bitmap types[4] = { };
+    commit **tip_commits = malloc((tip_count ? tip_count : 1) * sizeof(commit *));
+    size_t tip_commit_count = 0;
+    commit_list ordered;
+    commit_list_init(&ordered);
+    oid_map selected = { };
+    bitmap_writer writer = { };
+    buffer content = { };
+
+    validate(tip_commits, "Failed to allocate memory.");
+    validate(load_pack_revindex(pack), "Failed to build pack reverse index.");
+    validate(build_type_bitmaps(pack, types), "Failed to classify pack objects.");
+
+    // Annotated tags and other non-commit tips do not get bitmaps
+    for (size_t i = 0; i < tip_count; i++)
+    {
+        uint32_t position;
+        if (!find_pack_position(pack, tips[i], &position) || !bitmap_get(&types[OBJ_COMMIT - OBJ_COMMIT], position)) continue;
+
+        tip_commits[tip_commit_count] = lookup_commit(tips[i]);
+        validate(tip_commits[tip_commit_count], "Failed to look up commit.");
+        tip_commit_count++;
+    }
+
+    validate(collect_commits(pack, &types[OBJ_COMMIT - OBJ_COMMIT], tip_commits, tip_commit_count, &ordered), "Failed to collect commits.");
+    validate(oid_map_init(&selected, 1024), "Failed to allocate memory.");
+    validate(select_commits(&ordered, tip_commits, tip_commit_count, &selected), "Failed to select commits.");
+    validate(build_selected_bitmaps(pack, &ordered, &selected, &writer), "Failed to build bitmaps.");
+    validate(serialize_bitmap_index(pack, types, &writer, &content), "Failed to serialize bitmaps.");
+    validate(write_bitmap_file(pack, &content), "Failed to write bitmap.");
+
+    free(content.data);
+    for (size_t i = 0; i < writer.selected_count; i++) ewah_release(&writer.selected[i].bitmap);
+    free(writer.selected);
+    oid_map_destroy(&writer.done);
+    oid_map_destroy(&selected);
+    commit_list_destroy(&ordered);
+    for (int i = 0; i < 4; i++) bitmap_release(&types[i]);
+    free(tip_commits);
+
+    return true;
+
+error:
+    if (content.data) free(content.data);
+    for (size_t i = 0; i < writer.selected_count; i++) ewah_release(&writer.selected[i].bitmap);
+    if (writer.selected) free(writer.selected);
+    if (writer.done.entries) oid_map_destroy(&writer.done);
+    if (selected.entries) oid_map_destroy(&selected);
+    commit_list_destroy(&ordered);
+    for (int i = 0; i < 4; i++) bitmap_release(&types[i]);
+    if (tip_commits) free(tip_commits);
+
+    return false;
+}
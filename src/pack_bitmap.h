@@ -0,0 +1,88 @@
+#ifndef PACK_BITMAP_H
+#define PACK_BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#include "commit.h"
+#include "ewah.h"
+#include "oid_map.h"
+#include "packfile.h"
+
+#define BITMAP_SIGNATURE "BITM"
+#define BITMAP_VERSION 1
+#define BITMAP_HEADER_SIZE (12 + SHA_DIGEST_LENGTH)
+#define BITMAP_ENTRY_HEADER_SIZE 6
+
+#define BITMAP_OPT_FULL_DAG 0x1
+#define BITMAP_OPT_HASH_CACHE 0x4
+
+// Deepest chain of XOR'ed entries accepted when reading
+#define MAX_BITMAP_XOR_OFFSET 160
+
+typedef struct stored_bitmap
+{
+    uint32_t commit_position;
+    uint8_t xor_offset;
+    uint8_t flags;
+    ewah_bitmap bitmap;
+} stored_bitmap;
+
+// Objects a walk reached that are not in the pack, such as loose objects
+// written since. They get positions after the pack's objects.
+typedef struct extended_index
+{
+    unsigned char (*hashes)[SHA_DIGEST_LENGTH];
+    uint32_t count;
+    uint32_t capacity;
+    oid_map positions;
+} extended_index;
+
+// A pack's .bitmap: the objects reachable from selected commits, as bits
+// in pack order (by offset). Type bitmaps tell commits, trees, blobs and
+// tags apart.
+typedef struct pack_bitmap_index
+{
+    packed_git *pack;
+    const unsigned char *data;
+    size_t size;
+
+    bitmap commits;
+    bitmap trees;
+    bitmap blobs;
+    bitmap tags;
+
+    stored_bitmap *entries;
+    uint32_t entry_count;
+
+    // Commit oid to entry index
+    oid_map entry_map;
+
+    extended_index extended;
+} pack_bitmap_index;
+
+// The first pack that has a readable .bitmap, loaded on first use;
+// nullptr when there is none
+pack_bitmap_index *get_pack_bitmap_index(void);
+
+// Objects reachable from wants but not from haves. Objects outside the
+// pack are walked the regular way and added to the extended index.
+bool get_reachable_bitmap(
+    pack_bitmap_index *index,
+    commit **wants,
+    size_t want_count,
+    commit **haves,
+    size_t have_count,
+    bitmap *result);
+
+bool find_bitmap_position(const pack_bitmap_index *index, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *pack_position);
+
+// Positions past the pack's objects belong to the extended index
+const unsigned char *get_bitmap_object_hash(const pack_bitmap_index *index, uint32_t pack_position);
+
+// Writes <pack>.bitmap for every commit reachable from tips, all of which
+// has to be in pack. Tips that are not commits are skipped.
+bool write_pack_bitmap(packed_git *pack, const unsigned char (*tips)[SHA_DIGEST_LENGTH], size_t tip_count);
+
+#endif //PACK_BITMAP_H
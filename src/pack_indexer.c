@@ -0,0 +1,906 @@
+#include "pack_indexer.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "object_filter.h"
+#include "odb_transaction.h"
+#include "thread_pool.h"
+
+#define PACK_INDEXER_BUFFER_SIZE (1024 * 1024)
+
+// Deltas by the base they need, sorted so the children of a base are
+// found with a binary search
+typedef struct ofs_delta_link
+{
+    uint64_t base_offset;
+    uint32_t position;
+} ofs_delta_link;
+
+typedef struct ref_delta_link
+{
+    unsigned char base_hash[SHA_DIGEST_LENGTH];
+    uint32_t position;
+} ref_delta_link;
+
+// A whole object with deltas against it; its delta tree is resolved by a
+// single worker
+typedef struct delta_root
+{
+    uint32_t position;
+    bool is_resolved;
+} delta_root;
+
+typedef struct delta_links
+{
+    const unsigned char *pack_data;
+    size_t pack_size;
+
+    ofs_delta_link *ofs;
+    size_t ofs_count;
+    ref_delta_link *ref;
+    size_t ref_count;
+
+    delta_root *roots;
+    size_t root_count;
+
+    // A base that appears twice in the pack must not have its deltas
+    // resolved twice, by two workers at once
+    atomic_bool *is_claimed;
+    atomic_size_t resolved_count;
+} delta_links;
+
+typedef struct resolve_job
+{
+    pack_indexer *indexer;
+    delta_links *links;
+} resolve_job;
+
+static bool is_delta_type(const object_type type)
+{
+    return type == OBJ_OFS_DELTA || type == OBJ_REF_DELTA;
+}
+
+bool pack_indexer_open(pack_indexer *indexer)
+{
+    *indexer = (pack_indexer){ .stage = INDEXER_PACK_HEADER, .workers = get_worker_count("pack.threads") };
+
+    char pack_dir_path[PATH_MAX];
+    validate(get_git_path(pack_dir_path, PATH_MAX, "objects/pack"), "Failed to resolve pack directory.");
+
+    if (!dir_exists(pack_dir_path))
+    {
+        validate(mkdir(pack_dir_path, 0755) == 0 || errno == EEXIST, "Failed to create '%s'.", pack_dir_path);
+    }
+
+    const int tmp_path_len = snprintf(indexer->tmp_pack_path, PATH_MAX, "%s/tmp_pack_XXXXXX", pack_dir_path);
+    validate(tmp_path_len < PATH_MAX, "Path too long '%s'.", pack_dir_path);
+
+    const int fd = mkstemp(indexer->tmp_pack_path);
+    validate(fd != -1, "Failed to create temporary pack '%s'.", indexer->tmp_pack_path);
+
+    indexer->pack_file = fdopen(fd, "w");
+    validate(indexer->pack_file, "Failed to open temporary pack.");
+    (void)setvbuf(indexer->pack_file, nullptr, _IOFBF, PACK_INDEXER_BUFFER_SIZE);
+
+    validate(sha1_init(&indexer->pack_ctx), "Failed to initialize hashing.");
+
+    return true;
+
+error:
+    pack_indexer_abort(indexer);
+
+    return false;
+}
+
+void pack_indexer_abort(pack_indexer *indexer)
+{
+    if (indexer->pack_file)
+    {
+        fclose(indexer->pack_file);
+        unlink(indexer->tmp_pack_path);
+    }
+
+    if (indexer->is_inflating) (void)inflateEnd(&indexer->zstream);
+    if (indexer->pack_ctx.md_ctx) sha1_final(&indexer->pack_ctx, (unsigned char[SHA_DIGEST_LENGTH]){ });
+    if (indexer->object_ctx.md_ctx) sha1_final(&indexer->object_ctx, (unsigned char[SHA_DIGEST_LENGTH]){ });
+
+    if (indexer->entries) free(indexer->entries);
+    if (indexer->objects) free(indexer->objects);
+
+    *indexer = (pack_indexer){ };
+}
+
+// Everything before the trailer is written out and hashed as it passes;
+// bytes of an object also go into its CRC for the .idx. A pack that is
+// already on disk is only read.
+static bool consume(pack_indexer *indexer, const unsigned char *data, const size_t size)
+{
+    if (indexer->pack_file) validate(fwrite(data, 1, size, indexer->pack_file) == size, "Failed to write pack.");
+    sha1_update(&indexer->pack_ctx, data, size);
+
+    if (indexer->stage == INDEXER_OBJECT_HEADER || indexer->stage == INDEXER_OBJECT_DATA)
+    {
+        pack_index_entry *entry = &indexer->entries[indexer->count];
+        entry->crc32 = crc32(entry->crc32, data, (uInt)size);
+    }
+
+    indexer->offset += size;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool grow_objects(pack_indexer *indexer)
+{
+    // The count in the header is not trusted for the allocation up front
+    uint64_t capacity = indexer->capacity ? (uint64_t)indexer->capacity * 2 : 1024;
+    if (capacity > indexer->object_count) capacity = indexer->object_count;
+
+    pack_index_entry *entries = realloc(indexer->entries, capacity * sizeof(pack_index_entry));
+    validate(entries, "Failed to allocate memory.");
+    indexer->entries = entries;
+
+    indexed_object *objects = realloc(indexer->objects, capacity * sizeof(indexed_object));
+    validate(objects, "Failed to allocate memory.");
+    indexer->objects = objects;
+
+    indexer->capacity = (uint32_t)capacity;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool feed_pack_header(pack_indexer *indexer, const unsigned char *data, const size_t size, size_t *used)
+{
+    *used = PACK_HEADER_SIZE - indexer->pending_len;
+    if (*used > size) *used = size;
+
+    memcpy(&indexer->pending[indexer->pending_len], data, *used);
+    indexer->pending_len += *used;
+    validate(consume(indexer, data, *used), "Failed to write pack header.");
+
+    if (indexer->pending_len < PACK_HEADER_SIZE) return true;
+
+    const unsigned char *header = indexer->pending;
+    validate(memcmp(header, PACK_SIGNATURE, 4) == 0, "Not a pack stream.");
+    validate(get_be32(&header[4]) == PACK_VERSION || get_be32(&header[4]) == 3, "Unsupported pack version %u.", get_be32(&header[4]));
+
+    indexer->object_count = get_be32(&header[8]);
+    indexer->pending_len = 0;
+    indexer->stage = indexer->object_count ? INDEXER_OBJECT_HEADER : INDEXER_TRAILER;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Parses the object header gathered in pending. Returns false while it is
+// still incomplete, setting *is_valid to false if it can never be complete.
+static bool parse_object_header(pack_indexer *indexer, indexed_object *object, bool *is_valid)
+{
+    const unsigned char *pos = indexer->pending;
+    const unsigned char *end = &indexer->pending[indexer->pending_len];
+    *is_valid = true;
+
+    unsigned char c = *pos++;
+    object->stored_type = (c >> 4) & 0x07;
+    object->size = c & 0x0f;
+    int shift = 4;
+
+    while (c & 0x80)
+    {
+        if (pos == end) return false;
+
+        c = *pos++;
+        if (shift > 57) *is_valid = false;
+        object->size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    if (object->stored_type == OBJ_OFS_DELTA)
+    {
+        if (pos == end) return false;
+
+        c = *pos++;
+        uint64_t base_distance = c & 0x7f;
+
+        while (c & 0x80)
+        {
+            if (pos == end) return false;
+
+            c = *pos++;
+            base_distance = ((base_distance + 1) << 7) | (c & 0x7f);
+        }
+
+        const uint64_t offset = indexer->entries[indexer->count].offset;
+        if (base_distance == 0 || base_distance > offset) *is_valid = false;
+
+        object->base_offset = offset - base_distance;
+    }
+    else if (object->stored_type == OBJ_REF_DELTA)
+    {
+        if (end - pos < SHA_DIGEST_LENGTH) return false;
+
+        memcpy(object->base_hash, pos, SHA_DIGEST_LENGTH);
+    }
+    else if (object->stored_type < OBJ_COMMIT || object->stored_type > OBJ_TAG)
+    {
+        *is_valid = false;
+    }
+
+    return *is_valid;
+}
+
+static bool start_object_data(pack_indexer *indexer, indexed_object *object)
+{
+    object->data_offset = indexer->offset;
+    object->type = is_delta_type(object->stored_type) ? OBJ_NONE : object->stored_type;
+
+    indexer->zstream = (z_stream){ .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    validate(inflateInit(&indexer->zstream) == Z_OK, "Failed to initialize inflate.");
+    indexer->is_inflating = true;
+    indexer->inflated_size = 0;
+
+    if (object->type != OBJ_NONE)
+    {
+        char header[32];
+        const int header_size = snprintf(header, sizeof(header), "%s %zu", object_type_name(object->type), object->size) + 1;
+
+        validate(sha1_init(&indexer->object_ctx), "Failed to initialize hashing.");
+        sha1_update(&indexer->object_ctx, header, header_size);
+    }
+
+    indexer->stage = INDEXER_OBJECT_DATA;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Headers are short, so they are gathered a byte at a time
+static bool feed_object_header(pack_indexer *indexer, const unsigned char *data, const size_t size, size_t *used)
+{
+    *used = 0;
+
+    if (indexer->pending_len == 0)
+    {
+        if (indexer->count == indexer->capacity) validate(grow_objects(indexer), "Failed to grow object list.");
+
+        pack_index_entry *entry = &indexer->entries[indexer->count];
+        *entry = (pack_index_entry){ .offset = indexer->offset, .crc32 = crc32(0L, Z_NULL, 0) };
+        indexer->objects[indexer->count] = (indexed_object){ };
+    }
+
+    indexed_object *object = &indexer->objects[indexer->count];
+
+    while (*used < size)
+    {
+        validate(indexer->pending_len < sizeof(indexer->pending), "Malformed object header.");
+
+        indexer->pending[indexer->pending_len++] = data[*used];
+        validate(consume(indexer, &data[(*used)++], 1), "Failed to write object header.");
+
+        bool is_valid;
+        if (parse_object_header(indexer, object, &is_valid))
+        {
+            indexer->pending_len = 0;
+            return start_object_data(indexer, object);
+        }
+
+        validate(is_valid, "Malformed header of object %u.", indexer->count);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool finish_object(pack_indexer *indexer)
+{
+    indexed_object *object = &indexer->objects[indexer->count];
+
+    (void)inflateEnd(&indexer->zstream);
+    indexer->is_inflating = false;
+
+    validate(indexer->inflated_size == object->size, "Size mismatch in object %u.", indexer->count);
+
+    if (object->type != OBJ_NONE) sha1_final(&indexer->object_ctx, indexer->entries[indexer->count].hash);
+
+    indexer->count++;
+    indexer->stage = indexer->count == indexer->object_count ? INDEXER_TRAILER : INDEXER_OBJECT_HEADER;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Whole objects are hashed straight from the inflated output, which is
+// then dropped; deltas are only inflated to find where they end
+static bool feed_object_data(pack_indexer *indexer, const unsigned char *data, const size_t size, size_t *used)
+{
+    const indexed_object *object = &indexer->objects[indexer->count];
+    z_stream *zstream = &indexer->zstream;
+
+    zstream->next_in = (unsigned char *)data;
+    zstream->avail_in = size > UINT32_MAX ? UINT32_MAX : (uInt)size;
+
+    int ret;
+    do
+    {
+        unsigned char out[CHUNK];
+        zstream->next_out = out;
+        zstream->avail_out = CHUNK;
+
+        ret = inflate(zstream, Z_NO_FLUSH);
+        validate(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR, "Corrupt data in object %u.", indexer->count);
+
+        const size_t produced = CHUNK - zstream->avail_out;
+        indexer->inflated_size += produced;
+        validate(indexer->inflated_size <= object->size, "Size mismatch in object %u.", indexer->count);
+
+        if (object->type != OBJ_NONE) sha1_update(&indexer->object_ctx, out, produced);
+
+    } while (ret == Z_OK && (zstream->avail_in > 0 || zstream->avail_out == 0));
+
+    *used = (size > UINT32_MAX ? UINT32_MAX : size) - zstream->avail_in;
+    validate(consume(indexer, data, *used), "Failed to write object data.");
+
+    if (ret == Z_STREAM_END) validate(finish_object(indexer), "Failed to finish object.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool feed_trailer(pack_indexer *indexer, const unsigned char *data, const size_t size, size_t *used)
+{
+    *used = SHA_DIGEST_LENGTH - indexer->pending_len;
+    if (*used > size) *used = size;
+
+    memcpy(&indexer->pending[indexer->pending_len], data, *used);
+    indexer->pending_len += *used;
+    if (indexer->pack_file) validate(fwrite(data, 1, *used, indexer->pack_file) == *used, "Failed to write pack trailer.");
+
+    if (indexer->pending_len == SHA_DIGEST_LENGTH) indexer->stage = INDEXER_DONE;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool pack_indexer_feed(pack_indexer *indexer, const unsigned char *data, size_t size)
+{
+    while (size)
+    {
+        size_t used;
+
+        switch (indexer->stage)
+        {
+            case INDEXER_PACK_HEADER:
+                validate(feed_pack_header(indexer, data, size, &used), "Failed to read pack header.");
+                break;
+            case INDEXER_OBJECT_HEADER:
+                validate(feed_object_header(indexer, data, size, &used), "Failed to read object header.");
+                break;
+            case INDEXER_OBJECT_DATA:
+                validate(feed_object_data(indexer, data, size, &used), "Failed to read object data.");
+                break;
+            case INDEXER_TRAILER:
+                validate(feed_trailer(indexer, data, size, &used), "Failed to read pack trailer.");
+                break;
+            default:
+                validate(false, "Unexpected data after the end of the pack.");
+        }
+
+        data += used;
+        size -= used;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static int compare_ofs_links(const void *a, const void *b)
+{
+    const uint64_t offset1 = ((const ofs_delta_link *)a)->base_offset;
+    const uint64_t offset2 = ((const ofs_delta_link *)b)->base_offset;
+
+    return (offset1 > offset2) - (offset1 < offset2);
+}
+
+static int compare_ref_links(const void *a, const void *b)
+{
+    return memcmp(((const ref_delta_link *)a)->base_hash, ((const ref_delta_link *)b)->base_hash, SHA_DIGEST_LENGTH);
+}
+
+static bool collect_delta_links(const pack_indexer *indexer, delta_links *links)
+{
+    for (uint32_t i = 0; i < indexer->count; i++)
+    {
+        const object_type type = indexer->objects[i].stored_type;
+        links->ofs_count += type == OBJ_OFS_DELTA;
+        links->ref_count += type == OBJ_REF_DELTA;
+    }
+
+    links->ofs = malloc((links->ofs_count + 1) * sizeof(ofs_delta_link));
+    links->ref = malloc((links->ref_count + 1) * sizeof(ref_delta_link));
+    validate(links->ofs && links->ref, "Failed to allocate memory.");
+
+    size_t ofs_count = 0;
+    size_t ref_count = 0;
+
+    for (uint32_t i = 0; i < indexer->count; i++)
+    {
+        const indexed_object *object = &indexer->objects[i];
+
+        if (object->stored_type == OBJ_OFS_DELTA)
+        {
+            links->ofs[ofs_count++] = (ofs_delta_link){ .base_offset = object->base_offset, .position = i };
+        }
+        else if (object->stored_type == OBJ_REF_DELTA)
+        {
+            ref_delta_link *link = &links->ref[ref_count++];
+            memcpy(link->base_hash, object->base_hash, SHA_DIGEST_LENGTH);
+            link->position = i;
+        }
+    }
+
+    qsort(links->ofs, links->ofs_count, sizeof(ofs_delta_link), compare_ofs_links);
+    qsort(links->ref, links->ref_count, sizeof(ref_delta_link), compare_ref_links);
+
+    links->is_claimed = calloc(indexer->count + 1, sizeof(atomic_bool));
+    validate(links->is_claimed, "Failed to allocate memory.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_delta_links(delta_links *links)
+{
+    if (links->pack_data) munmap((void *)links->pack_data, links->pack_size);
+    if (links->ofs) free(links->ofs);
+    if (links->ref) free(links->ref);
+    if (links->roots) free(links->roots);
+    if (links->is_claimed) free(links->is_claimed);
+
+    *links = (delta_links){ };
+}
+
+static size_t find_first_ofs_child(const delta_links *links, const uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = links->ofs_count;
+
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+
+        if (links->ofs[mid].base_offset < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static size_t find_first_ref_child(const delta_links *links, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    size_t low = 0;
+    size_t high = links->ref_count;
+
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+
+        if (memcmp(links->ref[mid].base_hash, hash, SHA_DIGEST_LENGTH) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static bool has_delta_children(const pack_indexer *indexer, const delta_links *links, const uint32_t position)
+{
+    const uint64_t offset = indexer->entries[position].offset;
+    const size_t ofs = find_first_ofs_child(links, offset);
+    if (ofs < links->ofs_count && links->ofs[ofs].base_offset == offset) return true;
+
+    const unsigned char *hash = indexer->entries[position].hash;
+    const size_t ref = find_first_ref_child(links, hash);
+
+    return ref < links->ref_count && memcmp(links->ref[ref].base_hash, hash, SHA_DIGEST_LENGTH) == 0;
+}
+
+static char *inflate_indexed_object(const pack_indexer *indexer, const delta_links *links, const uint32_t position)
+{
+    const indexed_object *object = &indexer->objects[position];
+    const size_t pack_end = links->pack_size - SHA_DIGEST_LENGTH;
+
+    char *data = malloc(object->size + 1);
+    validate(data, "Failed to allocate memory.");
+    data[object->size] = '\0';
+
+    if (!inflate_to_buffer(&links->pack_data[object->data_offset], pack_end - object->data_offset, data, object->size))
+    {
+        free(data);
+        validate(false, "Failed to inflate object %u.", position);
+    }
+
+    return data;
+
+error:
+    return nullptr;
+}
+
+static bool resolve_delta(
+    pack_indexer *indexer,
+    delta_links *links,
+    uint32_t position,
+    uint32_t base_position,
+    char *base_data,
+    size_t base_size,
+    bool is_last_child);
+
+static size_t count_ofs_children(const delta_links *links, const size_t first, const uint64_t offset)
+{
+    size_t end = first;
+    while (end < links->ofs_count && links->ofs[end].base_offset == offset) end++;
+
+    return end - first;
+}
+
+static size_t count_ref_children(const delta_links *links, const size_t first, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    size_t end = first;
+    while (end < links->ref_count && memcmp(links->ref[end].base_hash, hash, SHA_DIGEST_LENGTH) == 0) end++;
+
+    return end - first;
+}
+
+// Takes ownership of base_data, which is freed as soon as the last child
+// has been applied against it, before that child's own subtree is walked;
+// a chain holds only the bases that still have children waiting
+static bool resolve_children(
+    pack_indexer *indexer,
+    delta_links *links,
+    const uint32_t base_position,
+    char *base_data,
+    const size_t base_size)
+{
+    const uint64_t offset = indexer->entries[base_position].offset;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    memcpy(hash, indexer->entries[base_position].hash, SHA_DIGEST_LENGTH);
+
+    const size_t first_ofs = find_first_ofs_child(links, offset);
+    const size_t ofs_children = count_ofs_children(links, first_ofs, offset);
+    const size_t first_ref = find_first_ref_child(links, hash);
+    const size_t ref_children = count_ref_children(links, first_ref, hash);
+
+    size_t remaining = ofs_children + ref_children;
+
+    for (size_t i = first_ofs; i < first_ofs + ofs_children; i++)
+    {
+        const bool is_last = --remaining == 0;
+        const bool is_resolved = resolve_delta(indexer, links, links->ofs[i].position, base_position, base_data, base_size, is_last);
+
+        if (is_last) base_data = nullptr;
+        validate(is_resolved, "Failed to resolve delta.");
+    }
+
+    for (size_t i = first_ref; i < first_ref + ref_children; i++)
+    {
+        const bool is_last = --remaining == 0;
+        const bool is_resolved = resolve_delta(indexer, links, links->ref[i].position, base_position, base_data, base_size, is_last);
+
+        if (is_last) base_data = nullptr;
+        validate(is_resolved, "Failed to resolve delta.");
+    }
+
+    if (base_data) free(base_data);
+
+    return true;
+
+error:
+    if (base_data) free(base_data);
+
+    return false;
+}
+
+// A delta's result is hashed for its name, then serves as the base of its
+// own children before it is dropped. The base is freed here when this is
+// its last child.
+static bool resolve_delta(
+    pack_indexer *indexer,
+    delta_links *links,
+    const uint32_t position,
+    const uint32_t base_position,
+    char *base_data,
+    const size_t base_size,
+    const bool is_last_child)
+{
+    char *delta = nullptr;
+    char *result = nullptr;
+
+    indexed_object *object = &indexer->objects[position];
+
+    if (atomic_exchange(&links->is_claimed[position], true))
+    {
+        if (is_last_child) free(base_data);
+        return true;
+    }
+
+    delta = inflate_indexed_object(indexer, links, position);
+    validate(delta, "Failed to read delta.");
+
+    const size_t result_size = apply_delta((const unsigned char *)base_data, base_size, (unsigned char *)delta, object->size, &result);
+    validate(result, "Failed to apply delta of object %u.", position);
+
+    free(delta);
+    delta = nullptr;
+
+    if (is_last_child) free(base_data);
+    base_data = nullptr;
+
+    object->type = indexer->objects[base_position].type;
+
+    char header[32];
+    const int header_size = snprintf(header, sizeof(header), "%s %zu", object_type_name(object->type), result_size) + 1;
+
+    sha1_ctx ctx;
+    validate(sha1_init(&ctx), "Failed to initialize hashing.");
+    sha1_update(&ctx, header, header_size);
+    sha1_update(&ctx, result, result_size);
+    sha1_final(&ctx, indexer->entries[position].hash);
+
+    atomic_fetch_add(&links->resolved_count, 1);
+
+    return resolve_children(indexer, links, position, result, result_size);
+
+error:
+    if (is_last_child && base_data) free(base_data);
+    if (delta) free(delta);
+    if (result) free(result);
+
+    return false;
+}
+
+static void resolve_root_task(void *ctx, const size_t index)
+{
+    const resolve_job *job = ctx;
+    delta_root *root = &job->links->roots[index];
+
+    char *data = inflate_indexed_object(job->indexer, job->links, root->position);
+
+    root->is_resolved = data && resolve_children(job->indexer, job->links, root->position, data, job->indexer->objects[root->position].size);
+}
+
+static bool collect_delta_roots(const pack_indexer *indexer, delta_links *links)
+{
+    links->roots = malloc((indexer->count + 1) * sizeof(delta_root));
+    validate(links->roots, "Failed to allocate memory.");
+
+    for (uint32_t i = 0; i < indexer->count; i++)
+    {
+        if (is_delta_type(indexer->objects[i].stored_type) || !has_delta_children(indexer, links, i)) continue;
+
+        links->roots[links->root_count++] = (delta_root){ .position = i };
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Whole objects were named during the pass over the stream. Each one with
+// deltas against it is inflated again, from the finished pack, and its
+// delta tree resolved depth first; trees are independent, so the workers
+// take one at a time.
+static bool resolve_deltas(pack_indexer *indexer, delta_links *links)
+{
+    validate(collect_delta_links(indexer, links), "Failed to collect deltas.");
+
+    const size_t delta_count = links->ofs_count + links->ref_count;
+    if (delta_count == 0) return true;
+
+    validate(collect_delta_roots(indexer, links), "Failed to collect delta bases.");
+
+    run_parallel(links->root_count, indexer->workers, resolve_root_task, &(resolve_job){ .indexer = indexer, .links = links });
+
+    for (size_t i = 0; i < links->root_count; i++)
+    {
+        validate(links->roots[i].is_resolved, "Failed to resolve deltas against object %u.", links->roots[i].position);
+    }
+
+    const size_t resolved_count = atomic_load(&links->resolved_count);
+    validate(resolved_count == delta_count, "%zu deltas have no base in the pack.", delta_count - resolved_count);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool check_trailer(pack_indexer *indexer, unsigned char pack_hash[SHA_DIGEST_LENGTH])
+{
+    validate(indexer->stage == INDEXER_DONE, "Pack stream ended early.");
+
+    sha1_final(&indexer->pack_ctx, pack_hash);
+    validate(memcmp(pack_hash, indexer->pending, SHA_DIGEST_LENGTH) == 0, "Pack checksum mismatch.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool pack_indexer_finish(pack_indexer *indexer, char *pack_hash_hex)
+{
+    delta_links links = { };
+    pack_hash_hex[0] = '\0';
+
+    unsigned char pack_hash[SHA_DIGEST_LENGTH];
+    validate(check_trailer(indexer, pack_hash), "Failed to verify the pack.");
+
+    validate(fflush(indexer->pack_file) == 0, "Failed to write pack.");
+    validate(get_fsync_mode() == FSYNC_NONE || fsync(fileno(indexer->pack_file)) == 0, "Failed to fsync pack.");
+
+    links.pack_data = map_file(indexer->tmp_pack_path, &links.pack_size);
+    validate(links.pack_data, "Failed to map '%s'.", indexer->tmp_pack_path);
+
+    validate(resolve_deltas(indexer, &links), "Failed to resolve deltas.");
+
+    const int close_result = fclose(indexer->pack_file);
+    indexer->pack_file = nullptr;
+    validate(close_result == 0, "Failed to write pack.");
+
+    validate(install_pack(indexer->tmp_pack_path, indexer->entries, indexer->count, pack_hash), "Failed to install pack.");
+
+    hash_bytes_to_hex(pack_hash_hex, pack_hash);
+    pack_hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    release_delta_links(&links);
+    pack_indexer_abort(indexer);
+
+    reprepare_packed_git();
+    reprepare_object_filter();
+
+    return true;
+
+error:
+    release_delta_links(&links);
+
+    if (!indexer->pack_file) (void)unlink(indexer->tmp_pack_path);
+    pack_indexer_abort(indexer);
+
+    return false;
+}
+
+bool pack_indexer_index_file(const char *pack_path, const char *idx_path, const unsigned workers, char *pack_hash_hex)
+{
+    pack_indexer indexer = { .stage = INDEXER_PACK_HEADER, .workers = workers };
+    delta_links links = { };
+    pack_hash_hex[0] = '\0';
+
+    links.pack_data = map_file(pack_path, &links.pack_size);
+    validate(links.pack_data, "Failed to map '%s'.", pack_path);
+
+    validate(sha1_init(&indexer.pack_ctx), "Failed to initialize hashing.");
+    validate(pack_indexer_feed(&indexer, links.pack_data, links.pack_size), "Failed to read '%s'.", pack_path);
+
+    unsigned char pack_hash[SHA_DIGEST_LENGTH];
+    validate(check_trailer(&indexer, pack_hash), "Failed to verify '%s'.", pack_path);
+
+    validate(resolve_deltas(&indexer, &links), "Failed to resolve deltas.");
+    validate(write_pack_index(idx_path, indexer.entries, indexer.count, pack_hash), "Failed to write '%s'.", idx_path);
+
+    hash_bytes_to_hex(pack_hash_hex, pack_hash);
+    pack_hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    release_delta_links(&links);
+    pack_indexer_abort(&indexer);
+
+    return true;
+
+error:
+    release_delta_links(&links);
+    pack_indexer_abort(&indexer);
+
+    return false;
+}
+
+// Every object the pass found must be in the .idx under the name it hashed
+// to, at its offset and with its CRC; with the counts equal, that makes the
+// two the same set
+static bool check_pack_index(const packed_git *pack, const pack_indexer *indexer, const unsigned char pack_hash[SHA_DIGEST_LENGTH])
+{
+    validate(
+        indexer->count == pack->object_count,
+        "'%s' has %u objects, its index %u.", pack->pack_path, indexer->count, pack->object_count);
+    validate(memcmp(get_pack_checksum(pack), pack_hash, SHA_DIGEST_LENGTH) == 0, "The index of '%s' is for another pack.", pack->pack_path);
+
+    unsigned char idx_hash[SHA_DIGEST_LENGTH];
+    SHA1(pack->idx_data, pack->idx_size - SHA_DIGEST_LENGTH, idx_hash);
+    validate(
+        memcmp(idx_hash, &pack->idx_data[pack->idx_size - SHA_DIGEST_LENGTH], SHA_DIGEST_LENGTH) == 0,
+        "Index checksum mismatch for '%s'.", pack->pack_path);
+
+    const unsigned char *crcs = &pack->idx_data[
+        PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + (size_t)pack->object_count * SHA_DIGEST_LENGTH];
+
+    for (uint32_t i = 0; i < indexer->count; i++)
+    {
+        const pack_index_entry *entry = &indexer->entries[i];
+
+        char hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hex, entry->hash);
+        hex[SHA_HEX_LENGTH] = '\0';
+
+        uint32_t position;
+        validate(find_pack_idx_position(pack, entry->hash, &position), "Object %s of '%s' is not in its index.", hex, pack->pack_path);
+        validate(
+            get_pack_idx_offset(pack, position) == entry->offset && get_be32(&crcs[(size_t)position * 4]) == entry->crc32,
+            "Object %s of '%s' does not match its index entry.", hex, pack->pack_path);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+bool pack_indexer_verify_pack(const packed_git *pack, const unsigned workers)
+{
+    pack_indexer indexer = { .stage = INDEXER_PACK_HEADER, .workers = workers };
+    delta_links links = { };
+
+    links.pack_data = map_file(pack->pack_path, &links.pack_size);
+    validate(links.pack_data, "Failed to map '%s'.", pack->pack_path);
+
+    validate(sha1_init(&indexer.pack_ctx), "Failed to initialize hashing.");
+    validate(pack_indexer_feed(&indexer, links.pack_data, links.pack_size), "Failed to read '%s'.", pack->pack_path);
+
+    unsigned char pack_hash[SHA_DIGEST_LENGTH];
+    validate(check_trailer(&indexer, pack_hash), "Failed to verify '%s'.", pack->pack_path);
+
+    validate(resolve_deltas(&indexer, &links), "Failed to resolve deltas of '%s'.", pack->pack_path);
+    validate(check_pack_index(pack, &indexer, pack_hash), "Failed to verify the index of '%s'.", pack->pack_path);
+
+    release_delta_links(&links);
+    pack_indexer_abort(&indexer);
+
+    return true;
+
+error:
+    release_delta_links(&links);
+    pack_indexer_abort(&indexer);
+
+    return false;
+}
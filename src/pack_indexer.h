@@ -0,0 +1,88 @@
+#ifndef PACK_INDEXER_H
+#define PACK_INDEXER_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+
+#include "pack_writer.h"
+#include "packfile.h"
+#include "sha1.h"
+
+// What the pass over the stream learns about each object. Deltas only get
+// their oid and type once they are resolved against their base.
+typedef struct indexed_object
+{
+    object_type type;
+    object_type stored_type;
+    uint64_t data_offset;
+    size_t size;
+
+    uint64_t base_offset;
+    unsigned char base_hash[SHA_DIGEST_LENGTH];
+} indexed_object;
+
+typedef enum indexer_stage
+{
+    INDEXER_PACK_HEADER,
+    INDEXER_OBJECT_HEADER,
+    INDEXER_OBJECT_DATA,
+    INDEXER_TRAILER,
+    INDEXER_DONE,
+} indexer_stage;
+
+// Builds a pack and its .idx from a pack stream fed in pieces of any size,
+// as they come off the wire. Each object is inflated, and whole objects
+// hashed, while the stream is still arriving; only deltas wait for the end,
+// when their bases are known, and are then resolved by worker threads.
+typedef struct pack_indexer
+{
+    // nullptr when indexing a pack that is already on disk
+    FILE *pack_file;
+    char tmp_pack_path[PATH_MAX];
+    sha1_ctx pack_ctx;
+    uint64_t offset;
+
+    indexer_stage stage;
+    uint32_t object_count;
+
+    // Entries and objects line up, in pack order
+    pack_index_entry *entries;
+    indexed_object *objects;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Pack header, object header or trailer bytes seen so far
+    unsigned char pending[PACK_HEADER_SIZE + SHA_DIGEST_LENGTH];
+    size_t pending_len;
+
+    z_stream zstream;
+    bool is_inflating;
+    sha1_ctx object_ctx;
+    size_t inflated_size;
+
+    unsigned workers;
+} pack_indexer;
+
+bool pack_indexer_open(pack_indexer *indexer);
+
+bool pack_indexer_feed(pack_indexer *indexer, const unsigned char *data, size_t size);
+
+// Checks the trailer, resolves deltas, and moves the pack and its .idx
+// into objects/pack
+bool pack_indexer_finish(pack_indexer *indexer, char *pack_hash_hex);
+
+void pack_indexer_abort(pack_indexer *indexer);
+
+// Writes idx_path for a pack file that is already complete, in one
+// sequential pass over it and a parallel one over its deltas
+bool pack_indexer_index_file(const char *pack_path, const char *idx_path, unsigned workers, char *pack_hash_hex);
+
+// Indexes a pack in objects/pack again, in memory, and checks the result
+// against its .idx: every object must hash to the name the .idx gives it at
+// its offset, and both checksums must hold
+bool pack_indexer_verify_pack(const packed_git *pack, unsigned workers);
+
+#endif //PACK_INDEXER_H
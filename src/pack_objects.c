@@ -0,0 +1,410 @@
+#include "pack_objects.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "delta.h"
+#include "git_obj_helpers.h"
+#include "pack_writer.h"
+#include "packfile.h"
+#include "thread_pool.h"
+
+// Smaller objects are not worth a delta, and larger ones are not held in
+// memory to look for one
+#define MIN_DELTA_OBJECT_SIZE 50
+#define MAX_DELTA_OBJECT_SIZE (512 * 1024 * 1024)
+
+// Deltas found are kept for writing up to this many bytes in total; the
+// rest are computed again when their object is written
+#define DELTA_CACHE_SIZE (256 * 1024 * 1024)
+
+#define NO_DELTA_BASE SIZE_MAX
+
+typedef struct pack_entry
+{
+    const listed_object *object;
+    size_t size;
+
+    size_t base;
+    unsigned depth;
+    unsigned char *delta;
+    size_t delta_size;
+
+    bool is_written;
+} pack_entry;
+
+// An object in the window, its content loaded and, once it is first tried
+// as a base, indexed
+typedef struct window_slot
+{
+    size_t entry;
+    char *content;
+    const unsigned char *data;
+    delta_index index;
+    bool is_indexed;
+} window_slot;
+
+typedef struct delta_search
+{
+    pack_entry *entries;
+    pack_entry **sorted;
+    size_t count;
+    const pack_options *options;
+
+    // Run r covers sorted[run_starts[r]] up to the start of the next
+    size_t *run_starts;
+    bool *is_run_done;
+    size_t run_count;
+
+    atomic_size_t cached_bytes;
+} delta_search;
+
+static int compare_pack_entries(const void *a, const void *b)
+{
+    const pack_entry *one = *(pack_entry *const *)a;
+    const pack_entry *two = *(pack_entry *const *)b;
+
+    if (one->object->type != two->object->type) return one->object->type < two->object->type ? -1 : 1;
+    if (one->object->name_hash != two->object->name_hash) return one->object->name_hash < two->object->name_hash ? -1 : 1;
+    if (one->size != two->size) return one->size > two->size ? -1 : 1;
+
+    // Keeps the order, and so the pack, the same from run to run
+    return one < two ? -1 : one > two;
+}
+
+static char *read_object_data(const unsigned char hash[SHA_DIGEST_LENGTH], const size_t size, const unsigned char **data)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    char *content = nullptr;
+    const size_t content_size = get_object_content(hex, &content);
+    validate(content, "Failed to read object %s.", hex);
+
+    const size_t header_size = get_header_size(content) + 1;
+    validate(content_size - header_size == size, "Object %s changed size.", hex);
+
+    *data = (const unsigned char *)&content[header_size];
+
+    return content;
+
+error:
+    if (content) free(content);
+
+    return nullptr;
+}
+
+static void release_window_slot(window_slot *slot)
+{
+    if (slot->content) free(slot->content);
+    if (slot->is_indexed) release_delta_index(&slot->index);
+
+    *slot = (window_slot){ };
+}
+
+// Bases deep in a chain have to save more to be chosen, so that chains
+// stay short where they can
+static void try_delta(
+    const delta_search *search,
+    const pack_entry *target,
+    const unsigned char *data,
+    window_slot *slot,
+    size_t *best_base,
+    unsigned char **best_delta,
+    size_t *best_size)
+{
+    const pack_entry *base = &search->entries[slot->entry];
+    const unsigned max_depth = search->options->depth;
+
+    if (base->object->type != target->object->type || base->depth >= max_depth) return;
+    if (base->size < target->size / 32) return;
+
+    size_t max_size = *best_delta ? *best_size - 1 : target->size / 2 - 20;
+    max_size = max_size * (max_depth - base->depth) / max_depth;
+
+    const size_t size_difference = base->size < target->size ? target->size - base->size : 0;
+    if (size_difference >= max_size) return;
+
+    if (!slot->is_indexed)
+    {
+        if (!create_delta_index(&slot->index, slot->data, base->size)) return;
+        slot->is_indexed = true;
+    }
+
+    unsigned char *delta;
+    const size_t delta_size = create_delta(&slot->index, data, target->size, max_size, &delta);
+    if (!delta_size) return;
+
+    if (*best_delta) free(*best_delta);
+
+    *best_base = slot->entry;
+    *best_delta = delta;
+    *best_size = delta_size;
+}
+
+static void record_delta(delta_search *search, pack_entry *entry, const size_t base, unsigned char *delta, const size_t delta_size)
+{
+    entry->base = base;
+    entry->depth = search->entries[base].depth + 1;
+    entry->delta_size = delta_size;
+    entry->delta = delta;
+
+    if (atomic_fetch_add(&search->cached_bytes, delta_size) + delta_size > DELTA_CACHE_SIZE)
+    {
+        atomic_fetch_sub(&search->cached_bytes, delta_size);
+
+        free(delta);
+        entry->delta = nullptr;
+    }
+}
+
+static bool search_run(delta_search *search, const size_t start, const size_t end)
+{
+    const size_t window = search->options->window;
+    size_t slot_count = 0;
+    size_t next_slot = 0;
+
+    window_slot *slots = calloc(window, sizeof(window_slot));
+    validate(slots, "Failed to allocate memory.");
+
+    for (size_t i = start; i < end; i++)
+    {
+        pack_entry *entry = search->sorted[i];
+        if (entry->size < MIN_DELTA_OBJECT_SIZE || entry->size > MAX_DELTA_OBJECT_SIZE) continue;
+
+        window_slot slot = { .entry = (size_t)(entry - search->entries) };
+        slot.content = read_object_data(entry->object->hash, entry->size, &slot.data);
+        validate(slot.content, "Failed to read object.");
+
+        size_t best_base = NO_DELTA_BASE;
+        unsigned char *best_delta = nullptr;
+        size_t best_size = 0;
+
+        // Most recent first: the closest in size and name
+        for (size_t k = 0; k < slot_count; k++)
+        {
+            window_slot *candidate = &slots[(next_slot + window - 1 - k) % window];
+            try_delta(search, entry, slot.data, candidate, &best_base, &best_delta, &best_size);
+        }
+
+        if (best_delta) record_delta(search, entry, best_base, best_delta, best_size);
+
+        if (slot_count == window) release_window_slot(&slots[next_slot]);
+        else slot_count++;
+
+        slots[next_slot] = slot;
+        next_slot = (next_slot + 1) % window;
+    }
+
+    for (size_t i = 0; i < window; i++) release_window_slot(&slots[i]);
+    free(slots);
+
+    return true;
+
+error:
+    if (slots)
+    {
+        for (size_t i = 0; i < window; i++) release_window_slot(&slots[i]);
+        free(slots);
+    }
+
+    return false;
+}
+
+static void search_run_task(void *ctx, const size_t run)
+{
+    delta_search *search = ctx;
+    const size_t end = run + 1 < search->run_count ? search->run_starts[run + 1] : search->count;
+
+    search->is_run_done[run] = search_run(search, search->run_starts[run], end);
+}
+
+// Runs are cut where the name hash changes, so that versions of one file
+// stay together; each needs a few windows' worth of objects to pay off
+static bool plan_runs(delta_search *search)
+{
+    const size_t min_run_size = 2 * (size_t)search->options->window;
+
+    search->run_count = search->options->workers ? search->options->workers : 1;
+    while (search->run_count > 1 && search->count / search->run_count < min_run_size) search->run_count--;
+
+    search->run_starts = malloc(search->run_count * sizeof(size_t));
+    search->is_run_done = calloc(search->run_count, sizeof(bool));
+    validate(search->run_starts && search->is_run_done, "Failed to allocate memory.");
+
+    search->run_starts[0] = 0;
+
+    for (size_t run = 1; run < search->run_count; run++)
+    {
+        size_t start = run * search->count / search->run_count;
+        if (start < search->run_starts[run - 1]) start = search->run_starts[run - 1];
+
+        while (start < search->count && start > 0 &&
+               search->sorted[start]->object->type == search->sorted[start - 1]->object->type &&
+               search->sorted[start]->object->name_hash == search->sorted[start - 1]->object->name_hash)
+        {
+            start++;
+        }
+
+        search->run_starts[run] = start;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool find_deltas(delta_search *search)
+{
+    search->sorted = malloc(search->count * sizeof(pack_entry *));
+    validate(search->sorted, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < search->count; i++) search->sorted[i] = &search->entries[i];
+    qsort(search->sorted, search->count, sizeof(pack_entry *), compare_pack_entries);
+
+    validate(plan_runs(search), "Failed to plan delta search.");
+
+    prepare_packed_git_for_threads();
+    run_parallel(search->run_count, search->options->workers, search_run_task, search);
+
+    for (size_t run = 0; run < search->run_count; run++)
+    {
+        validate(search->is_run_done[run], "Failed to search for deltas.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Deltas that did not fit the cache are computed again, with no limit on
+// their size as they were already found to pay off
+static bool write_entry(pack_writer *writer, const delta_search *search, pack_entry *entry)
+{
+    char *content = nullptr;
+    char *base_content = nullptr;
+    delta_index index = { };
+
+    if (entry->is_written) return true;
+
+    const unsigned char *data;
+    content = read_object_data(entry->object->hash, entry->size, &data);
+    validate(content, "Failed to read object.");
+
+    if (entry->base == NO_DELTA_BASE)
+    {
+        validate(
+            pack_writer_add_buffer(writer, entry->object->hash, entry->object->type, (const char *)data, entry->size),
+            "Failed to pack object.");
+    }
+    else
+    {
+        pack_entry *base = &search->entries[entry->base];
+        validate(write_entry(writer, search, base), "Failed to pack delta base.");
+
+        if (!entry->delta)
+        {
+            const unsigned char *base_data;
+            base_content = read_object_data(base->object->hash, base->size, &base_data);
+            validate(base_content, "Failed to read delta base.");
+
+            validate(create_delta_index(&index, base_data, base->size), "Failed to index delta base.");
+            entry->delta_size = create_delta(&index, data, entry->size, SIZE_MAX, &entry->delta);
+            validate(entry->delta_size, "Failed to compute delta.");
+        }
+
+        validate(
+            pack_writer_add_delta(writer, entry->object->hash, base->object->hash, entry->delta, entry->delta_size),
+            "Failed to pack delta.");
+    }
+
+    entry->is_written = true;
+
+    if (entry->delta) free(entry->delta);
+    entry->delta = nullptr;
+
+    release_delta_index(&index);
+    if (base_content) free(base_content);
+    free(content);
+
+    return true;
+
+error:
+    release_delta_index(&index);
+    if (base_content) free(base_content);
+    if (content) free(content);
+
+    return false;
+}
+
+static void release_delta_search(delta_search *search)
+{
+    if (search->entries)
+    {
+        for (size_t i = 0; i < search->count; i++)
+        {
+            if (search->entries[i].delta) free(search->entries[i].delta);
+        }
+
+        free(search->entries);
+    }
+
+    if (search->sorted) free(search->sorted);
+    if (search->run_starts) free(search->run_starts);
+    if (search->is_run_done) free(search->is_run_done);
+}
+
+bool pack_objects(const listed_object *objects, const size_t count, const pack_options *options, char *pack_hash_hex, size_t *delta_count)
+{
+    pack_writer writer = { };
+    bool is_writing = false;
+
+    delta_search search = { .count = count, .options = options };
+    atomic_init(&search.cached_bytes, 0);
+
+    pack_hash_hex[0] = '\0';
+    *delta_count = 0;
+
+    if (!count) return true;
+
+    search.entries = calloc(count, sizeof(pack_entry));
+    validate(search.entries, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pack_entry *entry = &search.entries[i];
+        *entry = (pack_entry){ .object = &objects[i], .base = NO_DELTA_BASE };
+
+        validate(get_object_size(objects[i].hash, &entry->size), "Failed to read object size.");
+    }
+
+    if (options->window && options->depth) validate(find_deltas(&search), "Failed to find deltas.");
+
+    validate(pack_writer_open(&writer), "Failed to start pack.");
+    is_writing = true;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        validate(write_entry(&writer, &search, &search.entries[i]), "Failed to write pack.");
+        if (search.entries[i].base != NO_DELTA_BASE) (*delta_count)++;
+    }
+
+    is_writing = false;
+    validate(pack_writer_finish(&writer, pack_hash_hex), "Failed to finish pack.");
+
+    release_delta_search(&search);
+
+    return true;
+
+error:
+    if (is_writing) pack_writer_abort(&writer);
+    release_delta_search(&search);
+
+    return false;
+}
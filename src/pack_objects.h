@@ -0,0 +1,28 @@
+#ifndef PACK_OBJECTS_H
+#define PACK_OBJECTS_H
+
+#include <stddef.h>
+
+#include "list_objects.h"
+
+#define DEFAULT_PACK_WINDOW 10
+#define DEFAULT_PACK_DEPTH 50
+
+typedef struct pack_options
+{
+    // How many of the objects sorted before one are tried as its delta
+    // base, 0 for a pack without deltas; and how long chains may grow
+    unsigned window;
+    unsigned depth;
+    unsigned workers;
+} pack_options;
+
+// Writes objects into a new pack under objects/pack, in their order, with
+// each delta base ahead of the deltas against it. Delta bases are searched
+// the way git does: objects are sorted by type, name hash and decreasing
+// size, and each is tried against the ones in a window before it. The
+// sorted list is cut into one run per worker. pack_hash_hex is left empty
+// when there is nothing to pack.
+bool pack_objects(const listed_object *objects, size_t count, const pack_options *options, char *pack_hash_hex, size_t *delta_count);
+
+#endif //PACK_OBJECTS_H
@@ -0,0 +1,494 @@
+#include "pack_writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+#include "sha1.h"
+#include "trace.h"
+
+#define PACK_WRITE_BUFFER_SIZE (1024 * 1024)
+
+bool pack_writer_open(pack_writer *writer)
+{
+    writer->pack_file = nullptr;
+    writer->offset = 0;
+    writer->entries = nullptr;
+    writer->count = 0;
+    writer->capacity = 0;
+
+    validate(oid_map_init(&writer->written, 1024), "Failed to allocate memory.");
+
+    char pack_dir_path[PATH_MAX];
+    validate(get_git_path(pack_dir_path, PATH_MAX, "objects/pack"), "Failed to resolve pack directory.");
+
+    if (!dir_exists(pack_dir_path))
+    {
+        validate(mkdir(pack_dir_path, 0755) == 0 || errno == EEXIST, "Failed to create '%s'.", pack_dir_path);
+    }
+
+    const int tmp_path_len = snprintf(writer->tmp_pack_path, PATH_MAX, "%s/tmp_pack_XXXXXX", pack_dir_path);
+    validate(tmp_path_len < PATH_MAX, "Path too long '%s'.", pack_dir_path);
+
+    const int fd = mkstemp(writer->tmp_pack_path);
+    validate(fd != -1, "Failed to create temporary pack '%s'.", writer->tmp_pack_path);
+
+    writer->pack_file = fdopen(fd, "w+");
+    validate(writer->pack_file, "Failed to open temporary pack.");
+    (void)setvbuf(writer->pack_file, nullptr, _IOFBF, PACK_WRITE_BUFFER_SIZE);
+
+    // The object count is patched in once the pack is finished
+    unsigned char header[PACK_HEADER_SIZE];
+    memcpy(header, PACK_SIGNATURE, 4);
+    put_be32(&header[4], PACK_VERSION);
+    put_be32(&header[8], 0);
+
+    validate(fwrite(header, 1, PACK_HEADER_SIZE, writer->pack_file) == PACK_HEADER_SIZE, "Failed to write pack header.");
+    writer->offset = PACK_HEADER_SIZE;
+
+    return true;
+
+error:
+    pack_writer_abort(writer);
+
+    return false;
+}
+
+void pack_writer_abort(pack_writer *writer)
+{
+    if (writer->pack_file)
+    {
+        fclose(writer->pack_file);
+        unlink(writer->tmp_pack_path);
+    }
+
+    if (writer->entries) free(writer->entries);
+    oid_map_destroy(&writer->written);
+
+    writer->pack_file = nullptr;
+    writer->entries = nullptr;
+    writer->count = 0;
+}
+
+static pack_index_entry *add_index_entry(pack_writer *writer, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (writer->count == writer->capacity)
+    {
+        const size_t capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        pack_index_entry *entries = realloc(writer->entries, capacity * sizeof(pack_index_entry));
+        validate(entries, "Failed to allocate memory.");
+
+        writer->entries = entries;
+        writer->capacity = capacity;
+    }
+
+    validate(oid_map_put(&writer->written, hash, writer->count), "Failed to record packed object.");
+
+    pack_index_entry *entry = &writer->entries[writer->count++];
+    memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+    entry->offset = writer->offset;
+    entry->crc32 = crc32(0L, Z_NULL, 0);
+
+    return entry;
+
+error:
+    return nullptr;
+}
+
+static bool write_to_pack(pack_writer *writer, pack_index_entry *entry, const unsigned char *data, const size_t size)
+{
+    validate(fwrite(data, 1, size, writer->pack_file) == size, "Failed to write to pack.");
+
+    entry->crc32 = crc32(entry->crc32, data, (uInt)size);
+    writer->offset += size;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool deflate_into_pack(
+    pack_writer *writer,
+    pack_index_entry *entry,
+    z_stream *defstream,
+    const unsigned char *in,
+    const size_t in_size,
+    const int flush)
+{
+    defstream->next_in = (unsigned char *)in;
+    defstream->avail_in = (uInt)in_size;
+
+    trace_timer_start(TRACE_TIMER_DEFLATE);
+
+    int ret;
+    do
+    {
+        unsigned char out[CHUNK];
+        defstream->avail_out = CHUNK;
+        defstream->next_out = out;
+
+        ret = deflate(defstream, flush);
+        validate(ret != Z_STREAM_ERROR, "Failed to deflate object.");
+
+        validate(write_to_pack(writer, entry, out, CHUNK - defstream->avail_out), "Failed to write object.");
+        trace_counter_add(TRACE_COUNTER_BYTES_OUT, CHUNK - defstream->avail_out);
+
+    } while (defstream->avail_out == 0);
+
+    trace_timer_stop(TRACE_TIMER_DEFLATE);
+
+    return flush != Z_FINISH || ret == Z_STREAM_END;
+
+error:
+    trace_timer_stop(TRACE_TIMER_DEFLATE);
+
+    return false;
+}
+
+static pack_index_entry *begin_pack_entry(
+    pack_writer *writer,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const object_type type,
+    const size_t size)
+{
+    pack_index_entry *entry = add_index_entry(writer, hash);
+    validate(entry, "Failed to add pack entry.");
+
+    unsigned char header[16];
+    const size_t header_size = encode_pack_object_header(header, type, size);
+    validate(write_to_pack(writer, entry, header, header_size), "Failed to write object header.");
+
+    trace_counter_add(TRACE_COUNTER_OBJECTS_WRITTEN, 1);
+
+    return entry;
+
+error:
+    return nullptr;
+}
+
+bool pack_writer_add_buffer(
+    pack_writer *writer,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const object_type type,
+    const char *data,
+    const size_t size)
+{
+    if (oid_map_contains(&writer->written, hash)) return true;
+
+    z_stream defstream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    validate(deflateInit(&defstream, Z_DEFAULT_COMPRESSION) == Z_OK, "Failed to initialize deflate.");
+
+    pack_index_entry *entry = begin_pack_entry(writer, hash, type, size);
+    validate(entry, "Failed to start pack entry.");
+
+    validate(
+        deflate_into_pack(writer, entry, &defstream, (const unsigned char *)data, size, Z_FINISH),
+        "Failed to write object data.");
+
+    (void)deflateEnd(&defstream);
+
+    return true;
+
+error:
+    (void)deflateEnd(&defstream);
+
+    return false;
+}
+
+// The base is named by how far back it starts, in git's variable-length
+// encoding where each continuation byte also adds one
+bool pack_writer_add_delta(
+    pack_writer *writer,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const unsigned char base_hash[SHA_DIGEST_LENGTH],
+    const unsigned char *delta,
+    const size_t delta_size)
+{
+    if (oid_map_contains(&writer->written, hash)) return true;
+
+    uint64_t base_index;
+    validate(oid_map_get(&writer->written, base_hash, &base_index), "Delta base is not in the pack.");
+
+    z_stream defstream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    validate(deflateInit(&defstream, Z_DEFAULT_COMPRESSION) == Z_OK, "Failed to initialize deflate.");
+
+    uint64_t distance = writer->offset - writer->entries[base_index].offset;
+
+    pack_index_entry *entry = begin_pack_entry(writer, hash, OBJ_OFS_DELTA, delta_size);
+    if (!entry) (void)deflateEnd(&defstream);
+    validate(entry, "Failed to start pack entry.");
+
+    unsigned char offset[16];
+    size_t pos = sizeof(offset) - 1;
+    offset[pos] = distance & 0x7f;
+    while (distance >>= 7) offset[--pos] = 0x80 | (--distance & 0x7f);
+
+    const bool is_written =
+        write_to_pack(writer, entry, &offset[pos], sizeof(offset) - pos) &&
+        deflate_into_pack(writer, entry, &defstream, delta, delta_size, Z_FINISH);
+
+    (void)deflateEnd(&defstream);
+    validate(is_written, "Failed to write delta data.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool pack_writer_add_object(pack_writer *writer, const unsigned char hash[SHA_DIGEST_LENGTH], FILE *object_data)
+{
+    if (oid_map_contains(&writer->written, hash)) return true;
+
+    z_stream defstream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    validate(deflateInit(&defstream, Z_DEFAULT_COMPRESSION) == Z_OK, "Failed to initialize deflate.");
+
+    // Object streams start with the loose object header: "<type> <size>\0"
+    char header[32];
+    size_t header_len = 0;
+    int c;
+
+    while ((c = fgetc(object_data)) != EOF && c != '\0' && header_len < sizeof(header) - 1)
+    {
+        header[header_len++] = (char)c;
+    }
+
+    header[header_len] = '\0';
+    validate(c == '\0', "Malformed object header.");
+
+    char *size_start = strchr(header, ' ');
+    validate(size_start, "Malformed object header.");
+    *size_start++ = '\0';
+
+    const object_type type = object_type_from_name(header);
+    validate(type != OBJ_NONE, "Unknown object type '%s'.", header);
+
+    pack_index_entry *entry = begin_pack_entry(writer, hash, type, strtoull(size_start, nullptr, 10));
+    validate(entry, "Failed to start pack entry.");
+
+    int flush;
+    do
+    {
+        unsigned char in[CHUNK];
+        const size_t n = fread(in, 1, CHUNK, object_data);
+        validate(ferror(object_data) == 0, "Failed to read object data.");
+
+        flush = feof(object_data) ? Z_FINISH : Z_NO_FLUSH;
+        validate(deflate_into_pack(writer, entry, &defstream, in, n, flush), "Failed to write object data.");
+
+    } while (flush != Z_FINISH);
+
+    (void)deflateEnd(&defstream);
+
+    return true;
+
+error:
+    (void)deflateEnd(&defstream);
+
+    return false;
+}
+
+static int compare_index_entries(const void *a, const void *b)
+{
+    return memcmp(((const pack_index_entry *)a)->hash, ((const pack_index_entry *)b)->hash, SHA_DIGEST_LENGTH);
+}
+
+static bool write_hashed(FILE *file, const sha1_ctx *ctx, const void *data, const size_t size)
+{
+    sha1_update(ctx, data, size);
+
+    return fwrite(data, 1, size, file) == size;
+}
+
+bool write_pack_index(
+    const char *idx_path,
+    pack_index_entry *entries,
+    const size_t count,
+    const unsigned char pack_hash[SHA_DIGEST_LENGTH])
+{
+    qsort(entries, count, sizeof(pack_index_entry), compare_index_entries);
+
+    sha1_ctx ctx;
+    validate(sha1_init(&ctx), "Failed to initialize hashing.");
+
+    FILE *idx_file = fopen(idx_path, "w");
+    if (!idx_file) sha1_final(&ctx, (unsigned char[SHA_DIGEST_LENGTH]){ 0 });
+    validate(idx_file, "Failed to open '%s'.", idx_path);
+    (void)setvbuf(idx_file, nullptr, _IOFBF, PACK_WRITE_BUFFER_SIZE);
+
+    unsigned char word[8];
+    bool result = write_hashed(idx_file, &ctx, PACK_IDX_SIGNATURE, 4);
+    put_be32(word, PACK_IDX_VERSION);
+    result = result && write_hashed(idx_file, &ctx, word, 4);
+
+    size_t position = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        while (position < count && entries[position].hash[0] == i) position++;
+
+        put_be32(word, (uint32_t)position);
+        result = result && write_hashed(idx_file, &ctx, word, 4);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        result = result && write_hashed(idx_file, &ctx, entries[i].hash, SHA_DIGEST_LENGTH);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        put_be32(word, entries[i].crc32);
+        result = result && write_hashed(idx_file, &ctx, word, 4);
+    }
+
+    uint32_t large_offsets = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const bool is_large = entries[i].offset >= 0x80000000;
+        put_be32(word, is_large ? 0x80000000 | large_offsets++ : (uint32_t)entries[i].offset);
+        result = result && write_hashed(idx_file, &ctx, word, 4);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (entries[i].offset < 0x80000000) continue;
+
+        put_be64(word, entries[i].offset);
+        result = result && write_hashed(idx_file, &ctx, word, 8);
+    }
+
+    result = result && write_hashed(idx_file, &ctx, pack_hash, SHA_DIGEST_LENGTH);
+
+    unsigned char idx_hash[SHA_DIGEST_LENGTH];
+    sha1_final(&ctx, idx_hash);
+    result = result && fwrite(idx_hash, 1, SHA_DIGEST_LENGTH, idx_file) == SHA_DIGEST_LENGTH;
+    result = result && fflush(idx_file) == 0;
+    result = result && (get_fsync_mode() == FSYNC_NONE || fsync(fileno(idx_file)) == 0);
+
+    result = fclose(idx_file) == 0 && result;
+    validate(result, "Failed to write '%s'.", idx_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// The header count is only known at the end, so the checksum has to be
+// computed over the finished file in a second pass
+static bool finalize_pack_file(pack_writer *writer, unsigned char pack_hash[SHA_DIGEST_LENGTH])
+{
+    unsigned char count[4];
+    put_be32(count, (uint32_t)writer->count);
+
+    validate(fflush(writer->pack_file) == 0, "Failed to write pack.");
+    validate(pwrite(fileno(writer->pack_file), count, 4, 8) == 4, "Failed to update pack header.");
+    validate(fseeko(writer->pack_file, 0, SEEK_SET) == 0, "Failed to rewind pack.");
+
+    sha1_ctx ctx;
+    validate(sha1_init(&ctx), "Failed to initialize hashing.");
+
+    unsigned char chunk[CHUNK];
+    size_t n;
+    while ((n = fread(chunk, 1, CHUNK, writer->pack_file)) > 0)
+    {
+        sha1_update(&ctx, chunk, n);
+    }
+
+    sha1_final(&ctx, pack_hash);
+    validate(ferror(writer->pack_file) == 0, "Failed to read back pack.");
+
+    validate(fseeko(writer->pack_file, 0, SEEK_END) == 0, "Failed to seek pack.");
+    validate(fwrite(pack_hash, 1, SHA_DIGEST_LENGTH, writer->pack_file) == SHA_DIGEST_LENGTH, "Failed to write pack trailer.");
+    validate(fflush(writer->pack_file) == 0, "Failed to write pack.");
+    validate(get_fsync_mode() == FSYNC_NONE || fsync(fileno(writer->pack_file)) == 0, "Failed to fsync pack.");
+
+    const int close_result = fclose(writer->pack_file);
+    writer->pack_file = nullptr;
+    validate(close_result == 0, "Failed to write pack.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool install_pack(
+    const char *tmp_pack_path,
+    pack_index_entry *entries,
+    const size_t count,
+    const unsigned char pack_hash[SHA_DIGEST_LENGTH])
+{
+    char pack_hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(pack_hash_hex, pack_hash);
+    pack_hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    char tmp_idx_path[PATH_MAX + 4];
+    (void)snprintf(tmp_idx_path, sizeof(tmp_idx_path), "%s.idx", tmp_pack_path);
+
+    char pack_dir_path[PATH_MAX];
+    validate(get_git_path(pack_dir_path, PATH_MAX, "objects/pack"), "Failed to resolve pack directory.");
+
+    validate(write_pack_index(tmp_idx_path, entries, count, pack_hash), "Failed to write pack index.");
+
+    char pack_path[PATH_MAX + 64];
+    char idx_path[PATH_MAX + 64];
+    (void)snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", pack_dir_path, pack_hash_hex);
+    (void)snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", pack_dir_path, pack_hash_hex);
+
+    (void)chmod(tmp_pack_path, 0444);
+    (void)chmod(tmp_idx_path, 0444);
+
+    // Readers discover packs through their .idx, so the pack goes in place first
+    validate(rename(tmp_pack_path, pack_path) == 0, "Failed to move pack to '%s'.", pack_path);
+    validate(rename(tmp_idx_path, idx_path) == 0, "Failed to move pack index to '%s'.", idx_path);
+    validate(get_fsync_mode() == FSYNC_NONE || fsync_directory(pack_dir_path), "Failed to fsync '%s'.", pack_dir_path);
+
+    return true;
+
+error:
+    (void)unlink(tmp_idx_path);
+
+    return false;
+}
+
+bool pack_writer_finish(pack_writer *writer, char *pack_hash_hex)
+{
+    pack_hash_hex[0] = '\0';
+
+    if (writer->count == 0)
+    {
+        pack_writer_abort(writer);
+        return true;
+    }
+
+    unsigned char pack_hash[SHA_DIGEST_LENGTH];
+    validate(finalize_pack_file(writer, pack_hash), "Failed to finish pack.");
+
+    hash_bytes_to_hex(pack_hash_hex, pack_hash);
+
+    validate(
+        install_pack(writer->tmp_pack_path, writer->entries, writer->count, pack_hash),
+        "Failed to install pack '%s'.", pack_hash_hex);
+
+    free(writer->entries);
+    writer->entries = nullptr;
+    oid_map_destroy(&writer->written);
+
+    reprepare_packed_git();
+
+    return true;
+
+error:
+    pack_writer_abort(writer);
+
+    return false;
+}
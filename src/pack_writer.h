@@ -0,0 +1,72 @@
+#ifndef PACK_WRITER_H
+#define PACK_WRITER_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <openssl/sha.h>
+
+#include "oid_map.h"
+#include "packfile.h"
+
+typedef struct pack_index_entry
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    uint64_t offset;
+    uint32_t crc32;
+} pack_index_entry;
+
+// Streams objects into a single pack under objects/pack. Objects already
+// added are skipped, and the .idx is written when the pack is finished.
+typedef struct pack_writer
+{
+    FILE *pack_file;
+    char tmp_pack_path[PATH_MAX];
+    uint64_t offset;
+
+    pack_index_entry *entries;
+    size_t count;
+    size_t capacity;
+
+    oid_map written;
+} pack_writer;
+
+bool pack_writer_open(pack_writer *writer);
+
+bool pack_writer_add_object(pack_writer *writer, const unsigned char hash[SHA_DIGEST_LENGTH], FILE *object_data);
+
+bool pack_writer_add_buffer(
+    pack_writer *writer,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    object_type type,
+    const char *data,
+    size_t size);
+
+// Stored as an offset delta against base_hash, which has to be in the
+// pack already
+bool pack_writer_add_delta(
+    pack_writer *writer,
+    const unsigned char hash[SHA_DIGEST_LENGTH],
+    const unsigned char base_hash[SHA_DIGEST_LENGTH],
+    const unsigned char *delta,
+    size_t delta_size);
+
+bool pack_writer_finish(pack_writer *writer, char *pack_hash_hex);
+
+void pack_writer_abort(pack_writer *writer);
+
+bool write_pack_index(
+    const char *idx_path,
+    pack_index_entry *entries,
+    size_t count,
+    const unsigned char pack_hash[SHA_DIGEST_LENGTH]);
+
+// Writes the .idx for a finished pack and moves both into objects/pack
+// under the pack's name
+bool install_pack(
+    const char *tmp_pack_path,
+    pack_index_entry *entries,
+    size_t count,
+    const unsigned char pack_hash[SHA_DIGEST_LENGTH]);
+
+#endif //PACK_WRITER_H
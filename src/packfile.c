@@ -0,0 +1,713 @@
+#include "packfile.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "midx.h"
+#include "object_filter.h"
+#include "trace.h"
+
+static packed_git *packed_git_list = nullptr;
+static bool is_packed_git_prepared = false;
+
+static const char *object_type_names[] = {
+    [OBJ_NONE] = nullptr,
+    [OBJ_COMMIT] = "commit",
+    [OBJ_TREE] = "tree",
+    [OBJ_BLOB] = "blob",
+    [OBJ_TAG] = "tag",
+    [5] = nullptr,
+    [OBJ_OFS_DELTA] = "ofs-delta",
+    [OBJ_REF_DELTA] = "ref-delta",
+};
+
+const char *object_type_name(const object_type type)
+{
+    if (type < OBJ_NONE || type > OBJ_REF_DELTA) return nullptr;
+
+    return object_type_names[type];
+}
+
+object_type object_type_from_name(const char *name)
+{
+    for (int type = OBJ_COMMIT; type <= OBJ_TAG; type++)
+    {
+        if (strcmp(object_type_names[type], name) == 0) return type;
+    }
+
+    return OBJ_NONE;
+}
+
+size_t encode_pack_object_header(unsigned char *header, const object_type type, uint64_t size)
+{
+    size_t n = 0;
+
+    unsigned char c = (unsigned char)(type << 4 | (size & 0x0f));
+    size >>= 4;
+
+    while (size)
+    {
+        header[n++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+
+    header[n++] = c;
+
+    return n;
+}
+
+uint32_t get_be32(const unsigned char *data)
+{
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+uint64_t get_be64(const unsigned char *data)
+{
+    return (uint64_t)get_be32(data) << 32 | get_be32(&data[4]);
+}
+
+void put_be32(unsigned char *data, const uint32_t value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+void put_be64(unsigned char *data, const uint64_t value)
+{
+    put_be32(data, value >> 32);
+    put_be32(&data[4], (uint32_t)value);
+}
+
+static packed_git *open_packed_git(const char *idx_path)
+{
+    packed_git *pack = calloc(1, sizeof(packed_git));
+    validate(pack, "Failed to allocate memory.");
+
+    const size_t path_len = strlen(idx_path);
+    validate(path_len > 4 && path_len < PATH_MAX, "Invalid pack index path '%s'.", idx_path);
+
+    memcpy(pack->pack_path, idx_path, path_len - 4);
+    strcpy(&pack->pack_path[path_len - 4], ".pack");
+
+    pack->idx_data = map_file(idx_path, &pack->idx_size);
+    validate(pack->idx_data, "Failed to map '%s'.", idx_path);
+
+    validate(
+        pack->idx_size >= PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + 2 * SHA_DIGEST_LENGTH
+        && memcmp(pack->idx_data, PACK_IDX_SIGNATURE, 4) == 0
+        && get_be32(&pack->idx_data[4]) == PACK_IDX_VERSION,
+        "Unsupported pack index '%s'.", idx_path);
+
+    pack->object_count = get_be32(&pack->idx_data[PACK_IDX_HEADER_SIZE + 255 * 4]);
+
+    return pack;
+
+error:
+    if (pack && pack->idx_data) munmap((void *)pack->idx_data, pack->idx_size);
+    if (pack) free(pack);
+
+    return nullptr;
+}
+
+static void prepare_packed_git(void)
+{
+    is_packed_git_prepared = true;
+
+    char pack_dir_path[PATH_MAX];
+    if (!get_git_path(pack_dir_path, PATH_MAX, "objects/pack")) return;
+
+    DIR *pack_dir = opendir(pack_dir_path);
+    if (!pack_dir) return;
+
+    const struct dirent *entry;
+    while ((entry = readdir(pack_dir)) != nullptr)
+    {
+        const size_t name_len = strlen(entry->d_name);
+
+        if (name_len < 5 || strcmp(&entry->d_name[name_len - 4], ".idx") != 0) continue;
+
+        char idx_path[PATH_MAX];
+        if (snprintf(idx_path, PATH_MAX, "%s/%s", pack_dir_path, entry->d_name) >= PATH_MAX) continue;
+
+        packed_git *pack = open_packed_git(idx_path);
+        if (!pack) continue;
+
+        pack->next = packed_git_list;
+        packed_git_list = pack;
+    }
+
+    closedir(pack_dir);
+}
+
+packed_git *get_packed_git_list(void)
+{
+    if (!is_packed_git_prepared) prepare_packed_git();
+
+    return packed_git_list;
+}
+
+void reprepare_packed_git(void)
+{
+    reprepare_multi_pack_index();
+    reprepare_object_filter();
+
+    while (packed_git_list)
+    {
+        packed_git *pack = packed_git_list;
+        packed_git_list = pack->next;
+
+        munmap((void *)pack->idx_data, pack->idx_size);
+        if (pack->pack_data) munmap((void *)pack->pack_data, pack->pack_size);
+        if (pack->revindex) free(pack->revindex);
+        if (pack->pack_positions) free(pack->pack_positions);
+        free(pack);
+    }
+
+    is_packed_git_prepared = false;
+}
+
+const unsigned char *get_pack_idx_hash(const packed_git *pack, const uint32_t n)
+{
+    return &pack->idx_data[PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + (size_t)n * SHA_DIGEST_LENGTH];
+}
+
+uint64_t get_pack_idx_offset(const packed_git *pack, const uint32_t n)
+{
+    const unsigned char *offsets = &pack->idx_data[
+        PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE + (size_t)pack->object_count * (SHA_DIGEST_LENGTH + 4)];
+
+    const uint32_t offset = get_be32(&offsets[(size_t)n * 4]);
+
+    // Offsets beyond 2 GiB live in a separate table of 64-bit entries
+    if (!(offset & 0x80000000)) return offset;
+
+    const unsigned char *large_offsets = &offsets[(size_t)pack->object_count * 4];
+
+    return get_be64(&large_offsets[(size_t)(offset & 0x7fffffff) * 8]);
+}
+
+bool find_pack_idx_position(const packed_git *pack, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *position)
+{
+    const unsigned char *fanout = &pack->idx_data[PACK_IDX_HEADER_SIZE];
+
+    uint32_t lo = hash[0] == 0 ? 0 : get_be32(&fanout[(hash[0] - 1) * 4]);
+    uint32_t hi = get_be32(&fanout[hash[0] * 4]);
+
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(get_pack_idx_hash(pack, mid), hash, SHA_DIGEST_LENGTH);
+
+        if (cmp == 0)
+        {
+            *position = mid;
+            return true;
+        }
+
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
+
+// The .idx ends with the pack checksum followed by its own
+const unsigned char *get_pack_checksum(const packed_git *pack)
+{
+    return &pack->idx_data[pack->idx_size - 2 * SHA_DIGEST_LENGTH];
+}
+
+// Sorts idx positions by offset, one byte of the offset per pass
+static bool sort_by_offset(const packed_git *pack, uint32_t *positions)
+{
+    const uint32_t count = pack->object_count;
+
+    uint64_t *offsets = malloc((size_t)count * sizeof(uint64_t));
+    uint32_t *scratch = malloc((size_t)count * sizeof(uint32_t));
+    validate(offsets && scratch, "Failed to allocate memory.");
+
+    uint64_t max_offset = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        offsets[i] = get_pack_idx_offset(pack, i);
+        if (offsets[i] > max_offset) max_offset = offsets[i];
+        positions[i] = i;
+    }
+
+    for (int shift = 0; shift < 64 && max_offset >> shift; shift += 8)
+    {
+        size_t buckets[257] = { };
+
+        for (uint32_t i = 0; i < count; i++) buckets[((offsets[positions[i]] >> shift) & 0xff) + 1]++;
+        for (int b = 1; b < 257; b++) buckets[b] += buckets[b - 1];
+        for (uint32_t i = 0; i < count; i++) scratch[buckets[(offsets[positions[i]] >> shift) & 0xff]++] = positions[i];
+
+        memcpy(positions, scratch, (size_t)count * sizeof(uint32_t));
+    }
+
+    free(offsets);
+    free(scratch);
+
+    return true;
+
+error:
+    if (offsets) free(offsets);
+    if (scratch) free(scratch);
+
+    return false;
+}
+
+bool load_pack_revindex(packed_git *pack)
+{
+    if (pack->revindex) return true;
+
+    uint32_t *revindex = malloc(((size_t)pack->object_count + 1) * sizeof(uint32_t));
+    uint32_t *pack_positions = malloc(((size_t)pack->object_count + 1) * sizeof(uint32_t));
+    validate(revindex && pack_positions, "Failed to allocate memory.");
+
+    validate(sort_by_offset(pack, revindex), "Failed to sort pack offsets.");
+
+    for (uint32_t i = 0; i < pack->object_count; i++) pack_positions[revindex[i]] = i;
+
+    pack->revindex = revindex;
+    pack->pack_positions = pack_positions;
+
+    return true;
+
+error:
+    if (revindex) free(revindex);
+    if (pack_positions) free(pack_positions);
+
+    return false;
+}
+
+// One lookup in the multi-pack-index replaces probing each pack it covers
+bool find_pack_entry(const unsigned char hash[SHA_DIGEST_LENGTH], packed_git **pack, uint64_t *offset)
+{
+    if (find_midx_entry(hash, pack, offset)) return true;
+
+    for (packed_git *p = get_packed_git_list(); p; p = p->next)
+    {
+        uint32_t position;
+
+        if (p->is_in_midx) continue;
+
+        if (find_pack_idx_position(p, hash, &position))
+        {
+            *pack = p;
+            *offset = get_pack_idx_offset(p, position);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ensure_pack_mapped(packed_git *pack)
+{
+    if (pack->pack_data) return true;
+
+    pack->pack_data = map_file(pack->pack_path, &pack->pack_size);
+    validate(pack->pack_data, "Failed to map '%s'.", pack->pack_path);
+    validate(
+        pack->pack_size >= PACK_HEADER_SIZE + SHA_DIGEST_LENGTH
+        && memcmp(pack->pack_data, PACK_SIGNATURE, 4) == 0,
+        "Invalid pack file '%s'.", pack->pack_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Packs are otherwise mapped on first use, which is not safe to race on.
+// Commands that read objects from several threads call this first.
+void prepare_packed_git_for_threads(void)
+{
+    (void)get_repository_root();
+    (void)get_multi_pack_index();
+
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        (void)ensure_pack_mapped(pack);
+    }
+}
+
+static size_t read_delta_size(const unsigned char **delta, const unsigned char *delta_end)
+{
+    size_t size = 0;
+    int shift = 0;
+
+    while (*delta < delta_end)
+    {
+        const unsigned char c = *(*delta)++;
+        size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+
+        if (!(c & 0x80)) break;
+    }
+
+    return size;
+}
+
+size_t apply_delta(
+    const unsigned char *base,
+    const size_t base_size,
+    const unsigned char *delta,
+    const size_t delta_size,
+    char **result)
+{
+    *result = nullptr;
+
+    const unsigned char *delta_end = delta + delta_size;
+
+    const size_t expected_base_size = read_delta_size(&delta, delta_end);
+    validate(expected_base_size == base_size, "Delta base size mismatch.");
+
+    const size_t result_size = read_delta_size(&delta, delta_end);
+
+    *result = malloc(result_size + 1);
+    validate(*result, "Failed to allocate memory.");
+
+    char *out = *result;
+    const char *out_end = out + result_size;
+
+    while (delta < delta_end)
+    {
+        const unsigned char op = *delta++;
+
+        if (op & 0x80)
+        {
+            size_t copy_offset = 0;
+            size_t copy_size = 0;
+
+            for (int i = 0; i < 4; i++)
+            {
+                if (op & (1 << i)) copy_offset |= (size_t)*delta++ << (8 * i);
+            }
+
+            for (int i = 0; i < 3; i++)
+            {
+                if (op & (0x10 << i)) copy_size |= (size_t)*delta++ << (8 * i);
+            }
+
+            if (copy_size == 0) copy_size = 0x10000;
+
+            validate(
+                copy_offset + copy_size <= base_size && out + copy_size <= out_end,
+                "Delta copy out of bounds.");
+
+            memcpy(out, &base[copy_offset], copy_size);
+            out += copy_size;
+        }
+        else
+        {
+            validate(op != 0 && delta + op <= delta_end && out + op <= out_end, "Invalid delta instruction.");
+
+            memcpy(out, delta, op);
+            out += op;
+            delta += op;
+        }
+    }
+
+    validate(out == out_end, "Delta result size mismatch.");
+    (*result)[result_size] = '\0';
+
+    return result_size;
+
+error:
+    if (*result) free(*result);
+    *result = nullptr;
+
+    return 0;
+}
+
+bool inflate_to_buffer(const unsigned char *source, const size_t source_size, char *dest, const size_t dest_size)
+{
+    z_stream infstream = {
+        .zalloc = Z_NULL,
+        .zfree = Z_NULL,
+        .opaque = Z_NULL,
+        .next_in = (unsigned char *)source,
+        .avail_in = source_size > UINT32_MAX ? UINT32_MAX : (uInt)source_size,
+        .next_out = (unsigned char *)dest,
+        .avail_out = (uInt)dest_size,
+    };
+
+    trace_timer_start(TRACE_TIMER_INFLATE);
+    validate(inflateInit(&infstream) == Z_OK, "Failed to initialize inflate.");
+
+    // An empty output buffer still has to consume the (tiny) zlib stream
+    unsigned char scratch;
+    if (dest_size == 0)
+    {
+        infstream.next_out = &scratch;
+        infstream.avail_out = 1;
+    }
+
+    const int ret = inflate(&infstream, Z_FINISH);
+    const bool result = ret == Z_STREAM_END && infstream.total_out == dest_size;
+
+    trace_counter_add(TRACE_COUNTER_BYTES_IN, infstream.total_in);
+
+    (void)inflateEnd(&infstream);
+    validate(result, "Failed to inflate packed object with Z error code: %d.", ret);
+
+    trace_timer_stop(TRACE_TIMER_INFLATE);
+
+    return true;
+
+error:
+    trace_timer_stop(TRACE_TIMER_INFLATE);
+
+    return false;
+}
+
+size_t read_packed_object(packed_git *pack, const uint64_t offset, object_type *type, char **data)
+{
+    *data = nullptr;
+    char *base = nullptr;
+    char *delta = nullptr;
+
+    validate(ensure_pack_mapped(pack), "Failed to open pack.");
+    validate(offset < pack->pack_size, "Pack offset out of bounds.");
+
+    const unsigned char *pos = &pack->pack_data[offset];
+    const unsigned char *pack_end = &pack->pack_data[pack->pack_size - SHA_DIGEST_LENGTH];
+
+    unsigned char c = *pos++;
+    *type = (c >> 4) & 0x07;
+    size_t size = c & 0x0f;
+    int shift = 4;
+
+    while (c & 0x80)
+    {
+        validate(pos < pack_end, "Truncated pack object header.");
+        c = *pos++;
+        size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    object_type base_type = OBJ_NONE;
+    size_t base_size = 0;
+
+    if (*type == OBJ_OFS_DELTA)
+    {
+        c = *pos++;
+        uint64_t base_distance = c & 0x7f;
+
+        while (c & 0x80)
+        {
+            c = *pos++;
+            base_distance = ((base_distance + 1) << 7) | (c & 0x7f);
+        }
+
+        validate(base_distance <= offset, "Invalid delta base offset.");
+        base_size = read_packed_object(pack, offset - base_distance, &base_type, &base);
+    }
+    else if (*type == OBJ_REF_DELTA)
+    {
+        packed_git *base_pack;
+        uint64_t base_offset;
+        validate(find_pack_entry(pos, &base_pack, &base_offset), "Delta base object is missing.");
+
+        pos += SHA_DIGEST_LENGTH;
+        base_size = read_packed_object(base_pack, base_offset, &base_type, &base);
+    }
+    else
+    {
+        validate(*type >= OBJ_COMMIT && *type <= OBJ_TAG, "Unknown packed object type %d.", *type);
+    }
+
+    char *inflated = malloc(size + 1);
+    validate(inflated, "Failed to allocate memory.");
+    inflated[size] = '\0';
+
+    if (!inflate_to_buffer(pos, pack_end - pos, inflated, size))
+    {
+        free(inflated);
+        validate(false, "Failed to read packed object at offset %lu.", offset);
+    }
+
+    if (*type != OBJ_OFS_DELTA && *type != OBJ_REF_DELTA)
+    {
+        *data = inflated;
+        return size;
+    }
+
+    delta = inflated;
+    validate(base, "Failed to read delta base object.");
+
+    size = apply_delta((unsigned char *)base, base_size, (unsigned char *)delta, size, data);
+    validate(*data, "Failed to apply delta.");
+
+    *type = base_type;
+
+    free(base);
+    free(delta);
+
+    return size;
+
+error:
+    if (base) free(base);
+    if (delta) free(delta);
+
+    return 0;
+}
+
+object_type get_packed_object_type(packed_git *pack, uint64_t offset)
+{
+    validate(ensure_pack_mapped(pack), "Failed to open pack.");
+
+    const unsigned char *pack_end = &pack->pack_data[pack->pack_size - SHA_DIGEST_LENGTH];
+
+    while (true)
+    {
+        validate(offset < pack->pack_size - SHA_DIGEST_LENGTH, "Pack offset out of bounds.");
+
+        const unsigned char *pos = &pack->pack_data[offset];
+        unsigned char c = *pos++;
+        const object_type type = (c >> 4) & 0x07;
+
+        while (c & 0x80)
+        {
+            validate(pos < pack_end, "Truncated pack object header.");
+            c = *pos++;
+        }
+
+        if (type == OBJ_OFS_DELTA)
+        {
+            c = *pos++;
+            uint64_t base_distance = c & 0x7f;
+
+            while (c & 0x80)
+            {
+                validate(pos < pack_end, "Truncated delta base offset.");
+                c = *pos++;
+                base_distance = ((base_distance + 1) << 7) | (c & 0x7f);
+            }
+
+            validate(base_distance <= offset, "Invalid delta base offset.");
+            offset -= base_distance;
+        }
+        else if (type == OBJ_REF_DELTA)
+        {
+            validate(pos + SHA_DIGEST_LENGTH <= pack_end, "Truncated delta base.");
+            validate(find_pack_entry(pos, &pack, &offset), "Delta base object is missing.");
+            validate(ensure_pack_mapped(pack), "Failed to open pack.");
+            pack_end = &pack->pack_data[pack->pack_size - SHA_DIGEST_LENGTH];
+        }
+        else
+        {
+            validate(type >= OBJ_COMMIT && type <= OBJ_TAG, "Unknown packed object type %d.", type);
+            return type;
+        }
+    }
+
+error:
+    return OBJ_NONE;
+}
+
+bool get_packed_object_size(packed_git *pack, const uint64_t offset, size_t *size)
+{
+    validate(ensure_pack_mapped(pack), "Failed to open pack.");
+    validate(offset < pack->pack_size - SHA_DIGEST_LENGTH, "Pack offset out of bounds.");
+
+    const unsigned char *pos = &pack->pack_data[offset];
+    const unsigned char *pack_end = &pack->pack_data[pack->pack_size - SHA_DIGEST_LENGTH];
+
+    unsigned char c = *pos++;
+    const object_type type = (c >> 4) & 0x07;
+    *size = c & 0x0f;
+    int shift = 4;
+
+    while (c & 0x80)
+    {
+        validate(pos < pack_end, "Truncated pack object header.");
+        c = *pos++;
+        *size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    if (type == OBJ_OFS_DELTA)
+    {
+        do
+        {
+            validate(pos < pack_end, "Truncated delta base offset.");
+        } while (*pos++ & 0x80);
+    }
+    else if (type == OBJ_REF_DELTA)
+    {
+        pos += SHA_DIGEST_LENGTH;
+    }
+    else
+    {
+        return true;
+    }
+
+    validate(pos < pack_end, "Truncated delta.");
+
+    // Base size, then result size, at most ten bytes each
+    unsigned char delta_header[20];
+    const size_t header_size = inflate_prefix(pos, pack_end - pos, delta_header, sizeof(delta_header));
+
+    const unsigned char *delta = delta_header;
+    (void)read_delta_size(&delta, &delta_header[header_size]);
+    validate(delta < &delta_header[header_size], "Truncated delta header.");
+    *size = read_delta_size(&delta, &delta_header[header_size]);
+
+    return true;
+
+error:
+    return false;
+}
+
+size_t get_packed_object_content(const unsigned char hash[SHA_DIGEST_LENGTH], char **inflated_buffer)
+{
+    *inflated_buffer = nullptr;
+    char *data = nullptr;
+
+    packed_git *pack;
+    uint64_t offset;
+    if (!find_pack_entry(hash, &pack, &offset)) return 0;
+
+    object_type type;
+    const size_t size = read_packed_object(pack, offset, &type, &data);
+    validate(data, "Failed to read packed object.");
+
+    // Same layout as an inflated loose object: "<type> <size>\0<content>"
+    char header[32];
+    const int header_size = snprintf(header, sizeof(header), "%s %zu", object_type_name(type), size) + 1;
+
+    *inflated_buffer = malloc(header_size + size + 1);
+    validate(*inflated_buffer, "Failed to allocate memory.");
+
+    memcpy(*inflated_buffer, header, header_size);
+    memcpy(&(*inflated_buffer)[header_size], data, size);
+    (*inflated_buffer)[header_size + size] = '\0';
+
+    free(data);
+
+    trace_counter_add(TRACE_COUNTER_OBJECTS_READ, 1);
+
+    return header_size + size;
+
+error:
+    if (data) free(data);
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef PACKFILE_H
+#define PACKFILE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#define PACK_SIGNATURE "PACK"
+#define PACK_VERSION 2
+#define PACK_HEADER_SIZE 12
+#define PACK_IDX_SIGNATURE "\377tOc"
+#define PACK_IDX_VERSION 2
+#define PACK_IDX_HEADER_SIZE 8
+#define PACK_FANOUT_SIZE (256 * 4)
+
+typedef enum object_type
+{
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+} object_type;
+
+// A pack and its .idx, both mapped into memory on first use
+typedef struct packed_git
+{
+    char pack_path[PATH_MAX];
+    const unsigned char *idx_data;
+    size_t idx_size;
+    const unsigned char *pack_data;
+    size_t pack_size;
+    uint32_t object_count;
+
+    // Pack order (by offset) to .idx position and back, built on demand
+    uint32_t *revindex;
+    uint32_t *pack_positions;
+
+    // Set while the multi-pack-index covers this pack
+    bool is_in_midx;
+
+    struct packed_git *next;
+} packed_git;
+
+const char *object_type_name(object_type type);
+
+object_type object_type_from_name(const char *name);
+
+size_t encode_pack_object_header(unsigned char *header, object_type type, uint64_t size);
+
+uint32_t get_be32(const unsigned char *data);
+
+uint64_t get_be64(const unsigned char *data);
+
+void put_be32(unsigned char *data, uint32_t value);
+
+void put_be64(unsigned char *data, uint64_t value);
+
+packed_git *get_packed_git_list(void);
+
+void reprepare_packed_git(void);
+
+void prepare_packed_git_for_threads(void);
+
+const unsigned char *get_pack_idx_hash(const packed_git *pack, uint32_t n);
+
+uint64_t get_pack_idx_offset(const packed_git *pack, uint32_t n);
+
+bool find_pack_idx_position(const packed_git *pack, const unsigned char hash[SHA_DIGEST_LENGTH], uint32_t *position);
+
+const unsigned char *get_pack_checksum(const packed_git *pack);
+
+bool load_pack_revindex(packed_git *pack);
+
+bool find_pack_entry(const unsigned char hash[SHA_DIGEST_LENGTH], packed_git **pack, uint64_t *offset);
+
+size_t apply_delta(const unsigned char *base, size_t base_size, const unsigned char *delta, size_t delta_size, char **result);
+
+// Inflates a whole zlib stream that is known to produce dest_size bytes
+bool inflate_to_buffer(const unsigned char *source, size_t source_size, char *dest, size_t dest_size);
+
+size_t read_packed_object(packed_git *pack, uint64_t offset, object_type *type, char **data);
+
+// The type an object resolves to, following delta chains through their
+// headers only
+object_type get_packed_object_type(packed_git *pack, uint64_t offset);
+
+// The size of an object's content, read from headers without inflating the
+// content; a delta starts with the size of its result
+bool get_packed_object_size(packed_git *pack, uint64_t offset, size_t *size);
+
+size_t get_packed_object_content(const unsigned char hash[SHA_DIGEST_LENGTH], char **inflated_buffer);
+
+#endif //PACKFILE_H
@@ -0,0 +1,266 @@
+#include "pkt_line.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug_helpers.h"
+
+void init_pkt_reader(pkt_reader *reader, const int fd)
+{
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->line[0] = '\0';
+    reader->line_len = 0;
+}
+
+static bool fill_buffer(pkt_reader *reader)
+{
+    if (reader->start == reader->end) reader->start = reader->end = 0;
+
+    ssize_t n;
+    do
+    {
+        n = read(reader->fd, &reader->buffer[reader->end], PKT_READ_BUFFER_SIZE - reader->end);
+    } while (n < 0 && errno == EINTR);
+
+    validate(n >= 0, "Failed to read from the remote.");
+    reader->end += n;
+
+    return n > 0;
+
+error:
+    return false;
+}
+
+bool read_raw(pkt_reader *reader, void *data, const size_t size, const bool allow_short, size_t *read_size)
+{
+    unsigned char *out = data;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        if (reader->start == reader->end)
+        {
+            // Large reads skip the buffer
+            if (size - done >= PKT_READ_BUFFER_SIZE)
+            {
+                const ssize_t n = read(reader->fd, &out[done], size - done);
+                if (n < 0 && errno == EINTR) continue;
+
+                validate(n >= 0, "Failed to read from the remote.");
+                if (n == 0) break;
+
+                done += n;
+                continue;
+            }
+
+            if (!fill_buffer(reader)) break;
+        }
+
+        size_t n = reader->end - reader->start;
+        if (n > size - done) n = size - done;
+
+        memcpy(&out[done], &reader->buffer[reader->start], n);
+        reader->start += n;
+        done += n;
+    }
+
+    if (read_size) *read_size = done;
+    validate(done == size || allow_short, "Unexpected end of stream from the remote.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool read_raw_line(pkt_reader *reader)
+{
+    size_t len = 0;
+
+    while (true)
+    {
+        if (reader->start == reader->end) validate(fill_buffer(reader), "Unexpected end of stream from the remote.");
+
+        const unsigned char c = reader->buffer[reader->start++];
+        if (c == '\n') break;
+
+        validate(len < LARGE_PACKET_MAX, "Line from the remote too long.");
+        reader->line[len++] = (char)c;
+    }
+
+    if (len && reader->line[len - 1] == '\r') len--;
+
+    reader->line[len] = '\0';
+    reader->line_len = len;
+
+    return true;
+
+error:
+    return false;
+}
+
+static int hex_value(const char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+bool read_pkt_line(pkt_reader *reader, pkt_type *type)
+{
+    char length_hex[PKT_LENGTH_SIZE];
+    size_t read_size;
+    validate(read_raw(reader, length_hex, PKT_LENGTH_SIZE, true, &read_size), "Failed to read packet length.");
+
+    reader->line[0] = '\0';
+    reader->line_len = 0;
+
+    if (read_size == 0)
+    {
+        *type = PKT_EOF;
+        return true;
+    }
+
+    validate(read_size == PKT_LENGTH_SIZE, "Truncated packet length.");
+
+    size_t length = 0;
+    for (int i = 0; i < PKT_LENGTH_SIZE; i++)
+    {
+        const int digit = hex_value(length_hex[i]);
+        validate(digit >= 0, "Malformed packet length '%.4s'.", length_hex);
+
+        length = length << 4 | digit;
+    }
+
+    switch (length)
+    {
+        case 0:
+            *type = PKT_FLUSH;
+            return true;
+        case 1:
+            *type = PKT_DELIM;
+            return true;
+        case 2:
+            *type = PKT_RESPONSE_END;
+            return true;
+        default:
+            break;
+    }
+
+    validate(length > PKT_LENGTH_SIZE && length <= LARGE_PACKET_MAX, "Invalid packet length %zu.", length);
+
+    reader->line_len = length - PKT_LENGTH_SIZE;
+    validate(read_raw(reader, reader->line, reader->line_len, false, nullptr), "Failed to read packet.");
+    reader->line[reader->line_len] = '\0';
+
+    *type = PKT_DATA;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool read_pkt_data(pkt_reader *reader)
+{
+    pkt_type type;
+    validate(read_pkt_line(reader, &type), "Failed to read packet.");
+    validate(type == PKT_DATA, "Expected a data packet from the remote.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool write_pkt_line(FILE *out, const void *data, const size_t size)
+{
+    validate(size <= LARGE_PACKET_DATA_MAX, "Packet too large.");
+
+    char length_hex[PKT_LENGTH_SIZE + 1];
+    (void)snprintf(length_hex, sizeof(length_hex), "%04zx", size + PKT_LENGTH_SIZE);
+
+    validate(fwrite(length_hex, 1, PKT_LENGTH_SIZE, out) == PKT_LENGTH_SIZE, "Failed to write packet.");
+    validate(fwrite(data, 1, size, out) == size, "Failed to write packet.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool write_pkt_linef(FILE *out, const char *format, ...)
+{
+    char line[LARGE_PACKET_DATA_MAX + 1];
+
+    va_list args;
+    va_start(args, format);
+    const int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    validate(len >= 0 && len <= LARGE_PACKET_DATA_MAX, "Packet too large.");
+
+    return write_pkt_line(out, line, len);
+
+error:
+    return false;
+}
+
+bool write_pkt_flush(FILE *out)
+{
+    return fwrite("0000", 1, PKT_LENGTH_SIZE, out) == PKT_LENGTH_SIZE;
+}
+
+bool write_pkt_delim(FILE *out)
+{
+    return fwrite("0001", 1, PKT_LENGTH_SIZE, out) == PKT_LENGTH_SIZE;
+}
+
+bool write_sideband(FILE *out, const int channel, const void *data, size_t size)
+{
+    const unsigned char *pos = data;
+    unsigned char packet[LARGE_PACKET_DATA_MAX];
+    packet[0] = (unsigned char)channel;
+
+    while (size)
+    {
+        const size_t n = size < LARGE_PACKET_DATA_MAX - 1 ? size : LARGE_PACKET_DATA_MAX - 1;
+
+        memcpy(&packet[1], pos, n);
+        validate(write_pkt_line(out, packet, n + 1), "Failed to write side-band packet.");
+
+        pos += n;
+        size -= n;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+bool write_all(const int fd, const void *data, size_t size)
+{
+    const unsigned char *pos = data;
+
+    while (size)
+    {
+        const ssize_t n = write(fd, pos, size);
+        if (n < 0 && errno == EINTR) continue;
+
+        validate(n > 0, "Failed to write to the remote.");
+
+        pos += n;
+        size -= n;
+    }
+
+    return true;
+
+error:
+    return false;
+}
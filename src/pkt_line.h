@@ -0,0 +1,77 @@
+#ifndef PKT_LINE_H
+#define PKT_LINE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Every pkt-line starts with its total length as four hex digits. Lengths
+// below 4 are special packets that carry no data.
+#define PKT_LENGTH_SIZE 4
+#define LARGE_PACKET_MAX 65520
+#define LARGE_PACKET_DATA_MAX (LARGE_PACKET_MAX - PKT_LENGTH_SIZE)
+
+// Side-band channels inside a packfile section
+#define SIDEBAND_PACK_DATA 1
+#define SIDEBAND_PROGRESS 2
+#define SIDEBAND_ERROR 3
+
+#define PKT_READ_BUFFER_SIZE (64 * 1024)
+
+// Sent as agent= in capabilities and as the HTTP User-Agent
+#define GIT_AGENT "codecrafters-git"
+
+typedef enum pkt_type
+{
+    PKT_EOF,
+    PKT_FLUSH,
+    PKT_DELIM,
+    PKT_RESPONSE_END,
+    PKT_DATA,
+} pkt_type;
+
+// Buffered reads from a pipe or socket, shared between raw lines (as in
+// HTTP headers) and pkt-lines
+typedef struct pkt_reader
+{
+    int fd;
+    unsigned char buffer[PKT_READ_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+
+    // The last packet read, NUL terminated
+    char line[LARGE_PACKET_MAX + 1];
+    size_t line_len;
+} pkt_reader;
+
+void init_pkt_reader(pkt_reader *reader, int fd);
+
+// Reads the next packet into reader->line. A trailing newline is kept;
+// PKT_EOF means the stream ended cleanly between packets.
+bool read_pkt_line(pkt_reader *reader, pkt_type *type);
+
+// Same, but anything other than a data packet is an error
+bool read_pkt_data(pkt_reader *reader);
+
+// Reads exactly size bytes, or up to the end of the stream when
+// allow_short is set; the count read ends up in *read_size
+bool read_raw(pkt_reader *reader, void *data, size_t size, bool allow_short, size_t *read_size);
+
+// Reads a line ending in "\n" or "\r\n" into reader->line, without it
+bool read_raw_line(pkt_reader *reader);
+
+bool write_pkt_line(FILE *out, const void *data, size_t size);
+
+__attribute__((format(printf, 2, 3)))
+bool write_pkt_linef(FILE *out, const char *format, ...);
+
+bool write_pkt_flush(FILE *out);
+
+bool write_pkt_delim(FILE *out);
+
+// Splits data into side-band packets on the given channel
+bool write_sideband(FILE *out, int channel, const void *data, size_t size);
+
+// Writes all of size bytes to fd, retrying short writes
+bool write_all(int fd, const void *data, size_t size);
+
+#endif //PKT_LINE_H
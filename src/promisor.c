@@ -0,0 +1,78 @@
+#include "promisor.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "fetch.h"
+#include "object_filter.h"
+#include "oid_map.h"
+
+// Misses from several threads at once go to the remote one at a time
+static pthread_mutex_t promisor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *get_promisor_remote(void)
+{
+    return get_config_value("extensions.partialClone");
+}
+
+static bool fetch_from_promisor(const unsigned char (*hashes)[SHA_DIGEST_LENGTH], const size_t count)
+{
+    // Reading objects while fetching must not fetch again
+    static _Thread_local bool is_fetching = false;
+
+    const char *remote_name = get_promisor_remote();
+    if (!remote_name || is_fetching || count == 0) return false;
+
+    pthread_mutex_lock(&promisor_lock);
+    is_fetching = true;
+
+    const bool result = fetch_missing_objects(remote_name, hashes, count);
+
+    is_fetching = false;
+    pthread_mutex_unlock(&promisor_lock);
+
+    return result;
+}
+
+bool prefetch_missing_objects(const unsigned char (*hashes)[SHA_DIGEST_LENGTH], const size_t count)
+{
+    if (!get_promisor_remote()) return true;
+
+    oid_map seen = { };
+    unsigned char (*missing)[SHA_DIGEST_LENGTH] = malloc((count ? count : 1) * SHA_DIGEST_LENGTH);
+    validate(missing, "Failed to allocate memory.");
+    validate(oid_map_init(&seen, count), "Failed to allocate memory.");
+
+    size_t missing_count = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // The same blob often sits at several paths
+        if (has_object(hashes[i]) || oid_map_contains(&seen, hashes[i])) continue;
+
+        validate(oid_map_put(&seen, hashes[i], 0), "Failed to mark object.");
+        memcpy(missing[missing_count++], hashes[i], SHA_DIGEST_LENGTH);
+    }
+
+    const bool result = missing_count == 0 || fetch_from_promisor((const unsigned char (*)[SHA_DIGEST_LENGTH])missing, missing_count);
+    validate(result, "Failed to fetch %zu missing objects from the promisor remote.", missing_count);
+
+    oid_map_destroy(&seen);
+    free(missing);
+
+    return true;
+
+error:
+    oid_map_destroy(&seen);
+    if (missing) free(missing);
+
+    return false;
+}
+
+bool fetch_promised_object(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    return fetch_from_promisor((const unsigned char (*)[SHA_DIGEST_LENGTH])hash, 1);
+}
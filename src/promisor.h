@@ -0,0 +1,21 @@
+#ifndef PROMISOR_H
+#define PROMISOR_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+// The remote named by extensions.partialClone, nullptr in a full clone.
+// Objects a filtered fetch left out are promised by it.
+const char *get_promisor_remote(void);
+
+// Fetches those of the objects that are missing here from the promisor
+// remote, all in one request; a no-op outside a partial clone. Callers
+// about to read many objects, or to read them from worker threads, fetch
+// them up front through this rather than one at a time on first access.
+bool prefetch_missing_objects(const unsigned char (*hashes)[SHA_DIGEST_LENGTH], size_t count);
+
+// Fetches a single object on first access, when reading it found it
+// missing
+bool fetch_promised_object(const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+#endif //PROMISOR_H
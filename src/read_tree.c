@@ -0,0 +1,60 @@
+#include "read_tree.h"
+
+#include <getopt.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+#include "unpack_tree.h"
+
+bool update_worktree_opt = false;
+
+static bool try_resolve_read_tree_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "u", nullptr, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                update_worktree_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 2 == argc, "Usage: read-tree [-u] <tree-ish>");
+
+    return true;
+
+error:
+    return false;
+}
+
+// read-tree [-u] <tree-ish>
+// Replaces the index with the entries of the tree. With -u the files are
+// written to the worktree as well, and their stat data recorded, so the
+// result is a clean checkout.
+int read_tree(const int argc, char *argv[])
+{
+    validate(try_resolve_read_tree_opts(argc, argv), "Failed to resolve options.");
+
+    const char *name = argv[argc - 1];
+
+    char tree_hex[SHA_HEX_LENGTH + 1];
+    unsigned char tree_hash[SHA_DIGEST_LENGTH];
+    validate(resolve_tree_hex(name, tree_hex), "Not a tree object '%s'.", name);
+    validate(hash_hex_to_bytes(tree_hash, tree_hex), "Malformed object name '%s'.", tree_hex);
+
+    validate(unpack_tree(tree_hash, update_worktree_opt), "Failed to read tree '%s'.", name);
+
+    return 0;
+
+error:
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef READ_TREE_H
+#define READ_TREE_H
+
+int read_tree(int argc, char *argv[]);
+
+#endif //READ_TREE_H
@@ -0,0 +1,853 @@
+#include "refs.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "object_filter.h"
+#include "odb_transaction.h"
+
+#define PACKED_REFS_HEADER "# pack-refs with:"
+#define PACKED_REF_MIN_LENGTH (SHA_HEX_LENGTH + 2)
+
+typedef enum loose_ref_kind
+{
+    LOOSE_REF_MISSING,
+    LOOSE_REF_DIRECT,
+    LOOSE_REF_SYMBOLIC,
+    LOOSE_REF_BROKEN,
+} loose_ref_kind;
+
+typedef struct ref_entry
+{
+    char *name;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    bool is_loose;
+} ref_entry;
+
+typedef struct ref_list
+{
+    ref_entry *items;
+    size_t count;
+    size_t capacity;
+} ref_list;
+
+typedef struct packed_ref_name
+{
+    const char *record;
+    const char *name;
+    size_t name_len;
+} packed_ref_name;
+
+// packed-refs stays mapped for the lifetime of the command. Files written
+// by git carry the "sorted" trait and are searched in place; anything else
+// gets a sorted index of its records built once.
+typedef struct packed_refs
+{
+    const char *data;
+    size_t size;
+    const char *records;
+
+    packed_ref_name *index;
+    size_t index_count;
+} packed_refs;
+
+static packed_refs packed = { };
+static bool is_packed_refs_prepared = false;
+
+static bool is_hex_oid(const char *str, const size_t len)
+{
+    if (len < SHA_HEX_LENGTH) return false;
+
+    for (size_t i = 0; i < SHA_HEX_LENGTH; i++)
+    {
+        if (!isxdigit((unsigned char)str[i])) return false;
+    }
+
+    return true;
+}
+
+static bool is_null_hash(const unsigned char *hash)
+{
+    for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++)
+    {
+        if (hash[i]) return false;
+    }
+
+    return true;
+}
+
+bool check_refname_format(const char *refname)
+{
+    const size_t len = strlen(refname);
+
+    if (len == 0 || refname[len - 1] == '/' || refname[len - 1] == '.') return false;
+    if (len >= 5 && strcmp(&refname[len - 5], ".lock") == 0) return false;
+    if (strcmp(refname, "@") == 0) return false;
+
+    const char *component = refname;
+
+    for (const char *p = refname; *p; p++)
+    {
+        const unsigned char c = *p;
+
+        if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c)) return false;
+        if (c == '.' && p[1] == '.') return false;
+        if (c == '@' && p[1] == '{') return false;
+
+        if (c == '/')
+        {
+            // Empty components, as in "//" or a leading slash
+            if (p == component) return false;
+            component = p + 1;
+        }
+        else if (c == '.' && p == component)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static loose_ref_kind read_loose_ref(const char *refname, unsigned char hash[SHA_DIGEST_LENGTH], char target[PATH_MAX])
+{
+    char path[PATH_MAX];
+    if (!get_git_path(path, PATH_MAX, refname)) return LOOSE_REF_BROKEN;
+
+    FILE *ref_file = fopen(path, "r");
+    if (!ref_file)
+    {
+        const bool is_missing = errno == ENOENT || errno == ENOTDIR;
+        errno = 0;
+
+        return is_missing ? LOOSE_REF_MISSING : LOOSE_REF_BROKEN;
+    }
+
+    char line[PATH_MAX + 8];
+    errno = 0;
+    const bool has_line = fgets(line, sizeof(line), ref_file) != nullptr;
+
+    // A directory such as refs/heads opens fine but cannot be read
+    const bool is_dir = errno == EISDIR;
+    errno = 0;
+    fclose(ref_file);
+
+    if (!has_line) return is_dir ? LOOSE_REF_MISSING : LOOSE_REF_BROKEN;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "ref:", 4) == 0)
+    {
+        const char *symref_target = &line[4];
+        while (*symref_target == ' ' || *symref_target == '\t') symref_target++;
+
+        if (!check_refname_format(symref_target)) return LOOSE_REF_BROKEN;
+
+        if (snprintf(target, PATH_MAX, "%s", symref_target) >= PATH_MAX) return LOOSE_REF_BROKEN;
+        return LOOSE_REF_SYMBOLIC;
+    }
+
+    if (!is_hex_oid(line, strlen(line))) return LOOSE_REF_BROKEN;
+
+    hash_hex_to_bytes(hash, line);
+    return LOOSE_REF_DIRECT;
+}
+
+static int compare_packed_ref_names(const void *a, const void *b)
+{
+    const packed_ref_name *name_a = a;
+    const packed_ref_name *name_b = b;
+
+    const size_t len = name_a->name_len < name_b->name_len ? name_a->name_len : name_b->name_len;
+    const int result = memcmp(name_a->name, name_b->name, len);
+    if (result) return result;
+
+    return (name_a->name_len > name_b->name_len) - (name_a->name_len < name_b->name_len);
+}
+
+static const char *next_line(const char *line, const char *end)
+{
+    const char *eol = memchr(line, '\n', end - line);
+    return eol ? eol + 1 : end;
+}
+
+static bool is_valid_record(const char *record, const char *end)
+{
+    return end - record >= PACKED_REF_MIN_LENGTH &&
+           record[SHA_HEX_LENGTH] == ' ' &&
+           is_hex_oid(record, SHA_HEX_LENGTH);
+}
+
+static size_t get_record_name_len(const char *record, const char *end)
+{
+    const char *name = &record[SHA_HEX_LENGTH + 1];
+    const char *eol = memchr(name, '\n', end - name);
+
+    return (eol ? eol : end) - name;
+}
+
+static bool build_packed_refs_index(void)
+{
+    const char *end = packed.data + packed.size;
+
+    size_t capacity = 0;
+    for (const char *line = packed.records; line < end; line = next_line(line, end))
+    {
+        if (*line != '^') capacity++;
+    }
+
+    packed.index = malloc((capacity ? capacity : 1) * sizeof(packed_ref_name));
+    validate(packed.index, "Failed to allocate memory.");
+
+    for (const char *line = packed.records; line < end; line = next_line(line, end))
+    {
+        if (*line == '^') continue;
+        validate(is_valid_record(line, end), "Corrupt packed-refs.");
+
+        packed_ref_name *entry = &packed.index[packed.index_count++];
+        entry->record = line;
+        entry->name = &line[SHA_HEX_LENGTH + 1];
+        entry->name_len = get_record_name_len(line, end);
+    }
+
+    qsort(packed.index, packed.index_count, sizeof(packed_ref_name), compare_packed_ref_names);
+
+    return true;
+
+error:
+    if (packed.index) free(packed.index);
+    packed.index = nullptr;
+    packed.index_count = 0;
+
+    return false;
+}
+
+static bool has_sorted_trait(const char *header, const size_t header_len)
+{
+    const char *trait = " sorted";
+    const size_t trait_len = strlen(trait);
+
+    for (size_t i = 0; i + trait_len <= header_len; i++)
+    {
+        if (memcmp(&header[i], trait, trait_len) != 0) continue;
+        if (i + trait_len == header_len || header[i + trait_len] == ' ') return true;
+    }
+
+    return false;
+}
+
+static void prepare_packed_refs(void)
+{
+    is_packed_refs_prepared = true;
+
+    char path[PATH_MAX];
+    if (!get_git_path(path, PATH_MAX, "packed-refs")) return;
+
+    packed.data = (const char *)map_file(path, &packed.size);
+    if (!packed.data) return;
+
+    const char *end = packed.data + packed.size;
+    packed.records = packed.data;
+
+    bool is_sorted = false;
+    const size_t header_prefix_len = strlen(PACKED_REFS_HEADER);
+
+    if (packed.size >= header_prefix_len && memcmp(packed.data, PACKED_REFS_HEADER, header_prefix_len) == 0)
+    {
+        packed.records = next_line(packed.data, end);
+
+        size_t header_len = packed.records - packed.data;
+        if (header_len && packed.data[header_len - 1] == '\n') header_len--;
+
+        is_sorted = has_sorted_trait(packed.data, header_len);
+    }
+
+    if (!is_sorted)
+    {
+        (void)build_packed_refs_index();
+    }
+}
+
+void reprepare_packed_refs(void)
+{
+    if (packed.data) munmap((void *)packed.data, packed.size);
+    if (packed.index) free(packed.index);
+
+    packed = (packed_refs){ };
+    is_packed_refs_prepared = false;
+}
+
+// Compares the record's name with refname the way strcmp() would
+static int compare_record_name(const char *record, const char *end, const char *refname)
+{
+    const char *name = &record[SHA_HEX_LENGTH + 1];
+
+    while (name < end && *name != '\n' && *refname)
+    {
+        if (*name != *refname) return (unsigned char)*name - (unsigned char)*refname;
+
+        name++;
+        refname++;
+    }
+
+    const bool is_name_end = name >= end || *name == '\n';
+    if (is_name_end && !*refname) return 0;
+
+    return is_name_end ? -1 : 1;
+}
+
+// Backs up from p to the start of the record containing it. Peeled "^"
+// lines belong to the record above them.
+static const char *find_record_start(const char *lo, const char *p)
+{
+    while (p > lo && p[-1] != '\n') p--;
+
+    while (p > lo && *p == '^')
+    {
+        p--;
+        while (p > lo && p[-1] != '\n') p--;
+    }
+
+    return p;
+}
+
+static const char *next_record(const char *record, const char *end)
+{
+    const char *line = next_line(record, end);
+    while (line < end && *line == '^') line = next_line(line, end);
+
+    return line;
+}
+
+static const char *find_packed_record(const char *refname)
+{
+    if (!is_packed_refs_prepared) prepare_packed_refs();
+    if (!packed.data) return nullptr;
+
+    const char *end = packed.data + packed.size;
+
+    if (packed.index)
+    {
+        const packed_ref_name key = { .name = refname, .name_len = strlen(refname) };
+        const packed_ref_name *found = bsearch(
+            &key,
+            packed.index,
+            packed.index_count,
+            sizeof(packed_ref_name),
+            compare_packed_ref_names);
+
+        return found ? found->record : nullptr;
+    }
+
+    const char *lo = packed.records;
+    const char *hi = end;
+
+    while (lo < hi)
+    {
+        const char *record = find_record_start(lo, lo + (hi - lo) / 2);
+        validate(is_valid_record(record, end), "Corrupt packed-refs.");
+
+        const int cmp = compare_record_name(record, end, refname);
+        if (cmp == 0) return record;
+
+        if (cmp < 0)
+        {
+            lo = next_record(record, end);
+        }
+        else
+        {
+            hi = record;
+        }
+    }
+
+    return nullptr;
+
+error:
+    return nullptr;
+}
+
+bool resolve_ref(const char *refname, char resolved_name[PATH_MAX], unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    char current[PATH_MAX];
+    (void)snprintf(current, PATH_MAX, "%s", refname);
+
+    for (int depth = 0; depth <= MAX_SYMREF_DEPTH; depth++)
+    {
+        validate(check_refname_format(current), "Invalid ref name '%s'.", current);
+
+        if (resolved_name) (void)snprintf(resolved_name, PATH_MAX, "%s", current);
+
+        char target[PATH_MAX];
+        const loose_ref_kind kind = read_loose_ref(current, hash, target);
+
+        if (kind == LOOSE_REF_DIRECT) return true;
+
+        validate(kind != LOOSE_REF_BROKEN, "Broken ref '%s'.", current);
+
+        if (kind == LOOSE_REF_MISSING)
+        {
+            const char *record = find_packed_record(current);
+            if (!record) return false;
+
+            hash_hex_to_bytes(hash, record);
+            return true;
+        }
+
+        (void)snprintf(current, PATH_MAX, "%s", target);
+    }
+
+    validate(false, "Symbolic ref '%s' nests too deeply.", refname);
+
+error:
+    return false;
+}
+
+// HEAD, FETCH_HEAD, ORIG_HEAD and friends
+static bool is_pseudo_ref(const char *name)
+{
+    for (const char *p = name; *p; p++)
+    {
+        if (!isupper((unsigned char)*p) && *p != '_') return false;
+    }
+
+    return *name;
+}
+
+bool resolve_revision(const char *name, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    const size_t name_len = strlen(name);
+
+    if (name_len == SHA_HEX_LENGTH && is_hex_oid(name, name_len))
+    {
+        hash_hex_to_bytes(hash, name);
+        return true;
+    }
+
+    static const char *rules[] = {
+        "%s",
+        "refs/%s",
+        "refs/tags/%s",
+        "refs/heads/%s",
+        "refs/remotes/%s",
+        "refs/remotes/%s/HEAD",
+    };
+
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++)
+    {
+        if (i == 0 && !is_pseudo_ref(name) && strncmp(name, "refs/", 5) != 0) continue;
+
+        char candidate[PATH_MAX];
+        const int size = snprintf(candidate, PATH_MAX, rules[i], name);
+        if (size >= PATH_MAX || !check_refname_format(candidate)) continue;
+
+        if (resolve_ref(candidate, nullptr, hash)) return true;
+    }
+
+    validate(false, "Not a valid object name '%s'.", name);
+
+error:
+    return false;
+}
+
+char *resolve_revision_hex(const char *name, char *hash_hex)
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    if (!resolve_revision(name, hash)) return nullptr;
+
+    hash_bytes_to_hex(hash_hex, hash);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    return hash_hex;
+}
+
+// Tags point at their object and commits at their tree, both on a header
+// line, so peeling is a matter of following those until target_type shows up
+static char *peel_revision_hex(const char *name, char *hash_hex, const char *target_type)
+{
+    char *content = nullptr;
+
+    validate(resolve_revision_hex(name, hash_hex), "Not a valid object name '%s'.", name);
+
+    for (int depth = 0; depth <= MAX_SYMREF_DEPTH; depth++)
+    {
+        (void)get_object_content(hash_hex, &content);
+        validate(content, "Failed to obtain object content.");
+
+        char obj_type[16];
+        get_object_type(obj_type, content);
+
+        if (strcmp(obj_type, target_type) == 0)
+        {
+            free(content);
+            return hash_hex;
+        }
+
+        const bool is_tag = strcmp(obj_type, "tag") == 0;
+        const bool is_peelable_commit = strcmp(obj_type, "commit") == 0 && strcmp(target_type, "tree") == 0;
+        validate(is_tag || is_peelable_commit, "'%s' is not a %s-ish.", name, target_type);
+
+        const char *header_line = is_tag ? "object " : "tree ";
+        const size_t header_line_len = strlen(header_line);
+        const char *body = &content[get_header_size(content) + 1];
+
+        validate(strncmp(body, header_line, header_line_len) == 0, "Malformed %s '%s'.", obj_type, hash_hex);
+        validate(is_hex_oid(&body[header_line_len], strlen(&body[header_line_len])), "Malformed %s '%s'.", obj_type, hash_hex);
+
+        memcpy(hash_hex, &body[header_line_len], SHA_HEX_LENGTH);
+        hash_hex[SHA_HEX_LENGTH] = '\0';
+
+        free(content);
+        content = nullptr;
+    }
+
+    validate(false, "'%s' is not a %s-ish.", name, target_type);
+
+error:
+    if (content) free(content);
+
+    return nullptr;
+}
+
+char *resolve_tree_hex(const char *name, char *tree_hex)
+{
+    return peel_revision_hex(name, tree_hex, "tree");
+}
+
+char *resolve_commit_hex(const char *name, char *commit_hex)
+{
+    return peel_revision_hex(name, commit_hex, "commit");
+}
+
+static bool add_ref_entry(ref_list *refs, const char *name, const size_t name_len, const unsigned char hash[SHA_DIGEST_LENGTH], const bool is_loose)
+{
+    if (refs->count == refs->capacity)
+    {
+        const size_t capacity = refs->capacity ? refs->capacity * 2 : 64;
+
+        ref_entry *items = realloc(refs->items, capacity * sizeof(ref_entry));
+        validate(items, "Failed to allocate memory.");
+
+        refs->items = items;
+        refs->capacity = capacity;
+    }
+
+    ref_entry *entry = &refs->items[refs->count];
+    entry->name = strndup(name, name_len);
+    validate(entry->name, "Failed to allocate memory.");
+
+    memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+    entry->is_loose = is_loose;
+    refs->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Symbolic refs under refs/ are resolved; broken ones are skipped like git
+// skips them
+static bool collect_loose_refs(ref_list *refs, char refname[PATH_MAX])
+{
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, refname), "Failed to resolve '%s'.", refname);
+
+    DIR *dir = opendir(path);
+    if (!dir) return true;
+
+    const size_t refname_len = strlen(refname);
+    bool result = true;
+    const struct dirent *entry;
+
+    while (result && (entry = readdir(dir)) != nullptr)
+    {
+        if (entry->d_name[0] == '.') continue;
+        if (refname_len + 1 + strlen(entry->d_name) >= PATH_MAX) continue;
+
+        (void)snprintf(&refname[refname_len], PATH_MAX - refname_len, "/%s", entry->d_name);
+
+        struct stat st;
+        char entry_path[PATH_MAX];
+        if (!get_git_path(entry_path, PATH_MAX, refname) || stat(entry_path, &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            result = collect_loose_refs(refs, refname);
+        }
+        else if (check_refname_format(refname))
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            if (resolve_ref(refname, nullptr, hash)) result = add_ref_entry(refs, refname, strlen(refname), hash, true);
+        }
+
+        refname[refname_len] = '\0';
+    }
+
+    closedir(dir);
+    refname[refname_len] = '\0';
+
+    return result;
+
+error:
+    return false;
+}
+
+static bool collect_packed_refs(ref_list *refs)
+{
+    if (!is_packed_refs_prepared) prepare_packed_refs();
+    if (!packed.data) return true;
+
+    const char *end = packed.data + packed.size;
+
+    for (const char *line = packed.records; line < end; line = next_line(line, end))
+    {
+        if (*line == '^') continue;
+        validate(is_valid_record(line, end), "Corrupt packed-refs.");
+
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        hash_hex_to_bytes(hash, line);
+
+        validate(add_ref_entry(refs, &line[SHA_HEX_LENGTH + 1], get_record_name_len(line, end), hash, false), "Failed to add ref.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// By name, with a loose ref ahead of the packed ref it shadows
+static int compare_ref_entries(const void *a, const void *b)
+{
+    const ref_entry *entry_a = a;
+    const ref_entry *entry_b = b;
+
+    const int result = strcmp(entry_a->name, entry_b->name);
+    if (result) return result;
+
+    return (int)entry_b->is_loose - (int)entry_a->is_loose;
+}
+
+bool for_each_ref(const each_ref_fn fn, void *data)
+{
+    ref_list refs = { };
+    bool result = true;
+
+    char refname[PATH_MAX] = "refs";
+    validate(collect_loose_refs(&refs, refname), "Failed to read loose refs.");
+    validate(collect_packed_refs(&refs), "Failed to read packed refs.");
+
+    qsort(refs.items, refs.count, sizeof(ref_entry), compare_ref_entries);
+
+    for (size_t i = 0; i < refs.count && result; i++)
+    {
+        if (i > 0 && strcmp(refs.items[i].name, refs.items[i - 1].name) == 0) continue;
+
+        result = fn(refs.items[i].name, refs.items[i].hash, data);
+    }
+
+    for (size_t i = 0; i < refs.count; i++) free(refs.items[i].name);
+    if (refs.items) free(refs.items);
+
+    return result;
+
+error:
+    for (size_t i = 0; i < refs.count; i++) free(refs.items[i].name);
+    if (refs.items) free(refs.items);
+
+    return false;
+}
+
+static bool create_leading_dirs(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        const int result = mkdir(path, 0755);
+        const bool is_created = result == 0 || errno == EEXIST;
+        *slash = '/';
+
+        validate(is_created, "Failed to create directory for '%s'.", path);
+    }
+
+    errno = 0;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Writes packed-refs without refname's record, through packed-refs.lock
+static bool remove_packed_ref(const char *refname)
+{
+    char lock_path[PATH_MAX];
+    lock_path[0] = '\0';
+    FILE *lock_file = nullptr;
+
+    const char *record = find_packed_record(refname);
+    if (!record) return true;
+
+    const char *end = packed.data + packed.size;
+    const char *rest = next_record(record, end);
+
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, "packed-refs"), "Not a git repository.");
+    validate(get_git_path(lock_path, PATH_MAX, "packed-refs.lock"), "Not a git repository.");
+
+    const int lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (lock_fd == -1) lock_path[0] = '\0';
+    validate(lock_fd != -1, "Unable to lock packed-refs. Another process may be updating it.");
+
+    lock_file = fdopen(lock_fd, "w");
+    if (!lock_file) close(lock_fd);
+    validate(lock_file, "Failed to open '%s'.", lock_path);
+
+    const size_t head_len = record - packed.data;
+    const size_t tail_len = end - rest;
+
+    validate(fwrite(packed.data, 1, head_len, lock_file) == head_len, "Failed to write '%s'.", lock_path);
+    validate(fwrite(rest, 1, tail_len, lock_file) == tail_len, "Failed to write '%s'.", lock_path);
+    validate(fflush(lock_file) == 0, "Failed to write '%s'.", lock_path);
+    validate(get_fsync_mode() == FSYNC_NONE || fsync(lock_fd) == 0, "Failed to fsync '%s'.", lock_path);
+
+    const int close_result = fclose(lock_file);
+    lock_file = nullptr;
+    validate(close_result == 0, "Failed to write '%s'.", lock_path);
+
+    validate(rename(lock_path, path) == 0, "Failed to update packed-refs.");
+
+    reprepare_packed_refs();
+
+    return true;
+
+error:
+    if (lock_file) fclose(lock_file);
+    if (lock_path[0]) (void)unlink(lock_path);
+
+    return false;
+}
+
+static bool is_expected_value(const char *refname, const unsigned char *old_hash)
+{
+    if (!old_hash) return true;
+
+    unsigned char current[SHA_DIGEST_LENGTH];
+    const bool exists = resolve_ref(refname, nullptr, current);
+
+    if (is_null_hash(old_hash)) return !exists;
+
+    return exists && memcmp(current, old_hash, SHA_DIGEST_LENGTH) == 0;
+}
+
+static bool write_ref(
+    const char *refname,
+    const unsigned char *new_hash,
+    const unsigned char *old_hash,
+    const bool no_deref)
+{
+    char lock_path[PATH_MAX + 8];
+    lock_path[0] = '\0';
+    int lock_fd = -1;
+
+    validate(check_refname_format(refname), "Invalid ref name '%s'.", refname);
+
+    // Symbolic refs such as HEAD are updated through the ref they point to
+    char target[PATH_MAX];
+    unsigned char current[SHA_DIGEST_LENGTH];
+
+    if (no_deref)
+    {
+        (void)snprintf(target, PATH_MAX, "%s", refname);
+    }
+    else
+    {
+        (void)resolve_ref(refname, target, current);
+    }
+
+    // A ref never points at an object the repository does not have, and a
+    // branch only ever at a commit
+    if (new_hash)
+    {
+        char hash_hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hash_hex, new_hash);
+        validate(has_object(new_hash), "Trying to write ref '%s' with nonexistent object %s.", target, hash_hex);
+
+        object_type type;
+        size_t size;
+        validate(
+            strncmp(target, "refs/heads/", 11) != 0 || (get_object_info(new_hash, &type, &size) && type == OBJ_COMMIT),
+            "Trying to write non-commit object %s to branch '%s'.", hash_hex, target);
+    }
+
+    char ref_path[PATH_MAX];
+    validate(get_git_path(ref_path, PATH_MAX, target), "Not a git repository.");
+    validate(create_leading_dirs(ref_path), "Failed to create directories for '%s'.", target);
+
+    (void)snprintf(lock_path, sizeof(lock_path), "%s.lock", ref_path);
+
+    lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (lock_fd == -1) lock_path[0] = '\0';
+    validate(lock_fd != -1, "Unable to lock '%s'. Another process may be updating it.", target);
+
+    // Checked under the lock, so a concurrent update cannot slip in between
+    validate(is_expected_value(target, old_hash), "Ref '%s' is not at the expected value.", target);
+
+    if (new_hash)
+    {
+        char line[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(line, new_hash);
+        line[SHA_HEX_LENGTH] = '\n';
+
+        validate(write(lock_fd, line, sizeof(line)) == sizeof(line), "Failed to write '%s'.", lock_path);
+        validate(get_fsync_mode() == FSYNC_NONE || fsync(lock_fd) == 0, "Failed to fsync '%s'.", lock_path);
+
+        const int close_result = close(lock_fd);
+        lock_fd = -1;
+        validate(close_result == 0, "Failed to write '%s'.", lock_path);
+
+        validate(rename(lock_path, ref_path) == 0, "Failed to update ref '%s'.", target);
+
+        return true;
+    }
+
+    // The packed copy goes first, so a crash cannot bring an old value back
+    validate(remove_packed_ref(target), "Failed to remove '%s' from packed-refs.", target);
+    validate(unlink(ref_path) == 0 || errno == ENOENT, "Failed to delete ref '%s'.", target);
+
+    close(lock_fd);
+    (void)unlink(lock_path);
+    errno = 0;
+
+    return true;
+
+error:
+    if (lock_fd != -1) close(lock_fd);
+    if (lock_path[0]) (void)unlink(lock_path);
+
+    return false;
+}
+
+bool set_ref(
+    const char *refname,
+    const unsigned char new_hash[SHA_DIGEST_LENGTH],
+    const unsigned char *old_hash,
+    const bool no_deref)
+{
+    return write_ref(refname, new_hash, old_hash, no_deref);
+}
+
+bool delete_ref(const char *refname, const unsigned char *old_hash, const bool no_deref)
+{
+    return write_ref(refname, nullptr, old_hash, no_deref);
+}
@@ -0,0 +1,52 @@
+#ifndef REFS_H
+#define REFS_H
+
+#include <limits.h>
+#include <openssl/sha.h>
+
+#define MAX_SYMREF_DEPTH 5
+
+bool check_refname_format(const char *refname);
+
+// Follows symbolic refs and falls back from loose refs to packed-refs.
+// resolved_name receives the last ref in the chain, even when that ref
+// does not exist yet (e.g. HEAD pointing to an unborn branch).
+bool resolve_ref(const char *refname, char resolved_name[PATH_MAX], unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Accepts a full hex oid or a ref name, which is expanded the way git does:
+// <name>, refs/<name>, refs/tags/<name>, refs/heads/<name>, refs/remotes/<name>
+bool resolve_revision(const char *name, unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// Same as above, writing the oid as a NUL terminated hex string
+char *resolve_revision_hex(const char *name, char *hash_hex);
+
+// Resolves name and peels tags and commits down to a tree oid
+char *resolve_tree_hex(const char *name, char *tree_hex);
+
+// Resolves name and peels tags down to a commit oid
+char *resolve_commit_hex(const char *name, char *commit_hex);
+
+// Atomically points refname at new_hash, writing it through refname.lock.
+// Symbolic refs are followed unless no_deref is set. With old_hash given,
+// the update only happens while the ref still has that value; an all-zero
+// old_hash requires the ref to be absent.
+bool set_ref(
+    const char *refname,
+    const unsigned char new_hash[SHA_DIGEST_LENGTH],
+    const unsigned char *old_hash,
+    bool no_deref);
+
+// Removes the loose ref and its packed-refs entry, under the same locking
+// and old value rules as set_ref()
+bool delete_ref(const char *refname, const unsigned char *old_hash, bool no_deref);
+
+// Called once per ref; returning false stops the iteration
+typedef bool (*each_ref_fn)(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data);
+
+// Visits every ref under refs/, loose and packed, in name order. Returns
+// false on errors or when fn stopped the iteration.
+bool for_each_ref(each_ref_fn fn, void *data);
+
+void reprepare_packed_refs(void);
+
+#endif //REFS_H
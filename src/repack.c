@@ -0,0 +1,707 @@
+#include "repack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "index_file.h"
+#include "list_objects.h"
+#include "midx.h"
+#include "object_filter.h"
+#include "oid_map.h"
+#include "pack_bitmap.h"
+#include "packfile.h"
+#include "promisor.h"
+#include "refs.h"
+#include "thread_pool.h"
+
+bool repack_all_opt = false;
+bool repack_delete_opt = false;
+bool write_bitmap_index_opt = false;
+long geometric_opt = 0;
+long pack_window_opt = -1;
+long pack_depth_opt = -1;
+
+// A .keep file next to a pack keeps it out of every repack. Writing a pack
+// prepares the pack list again, so pack is only good until then and the
+// path is kept apart.
+typedef struct existing_pack
+{
+    packed_git *pack;
+    char pack_path[PATH_MAX];
+    struct timespec mtime;
+    bool is_kept;
+    bool is_promisor;
+    bool is_dropped;
+} existing_pack;
+
+typedef struct repack_state
+{
+    const repack_options *options;
+
+    existing_pack *packs;
+    size_t pack_count;
+
+    // What the reachability walk starts from: refs, HEAD and the index
+    unsigned char (*tips)[SHA_DIGEST_LENGTH];
+    size_t tip_count;
+    size_t tip_capacity;
+
+    object_list objects;
+    object_list cruft;
+    struct timespec cruft_mtime;
+    oid_map listed;
+    oid_map reachable;
+
+    char pack_hash_hex[SHA_HEX_LENGTH + 1];
+    char cruft_hash_hex[SHA_HEX_LENGTH + 1];
+} repack_state;
+
+static bool parse_count_arg(const char *arg, long *value, const long min)
+{
+    char *end;
+    *value = strtol(arg, &end, 10);
+    validate(*end == '\0' && *value >= min, "Invalid number '%s'.", arg);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool try_resolve_repack_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "write-bitmap-index", no_argument, nullptr, 'b' },
+        { "geometric", required_argument, nullptr, 'g' },
+        { "window", required_argument, nullptr, 'w' },
+        { "depth", required_argument, nullptr, 'D' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "adb", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                repack_all_opt = true;
+                break;
+            case 'd':
+                repack_delete_opt = true;
+                break;
+            case 'b':
+                write_bitmap_index_opt = true;
+                break;
+            case 'g':
+                validate(parse_count_arg(optarg, &geometric_opt, 2), "Invalid geometric factor.");
+                break;
+            case 'w':
+                validate(parse_count_arg(optarg, &pack_window_opt, 0), "Invalid window.");
+                break;
+            case 'D':
+                validate(parse_count_arg(optarg, &pack_depth_opt, 0), "Invalid depth.");
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 1 == argc, "Usage: repack [-a] [-d] [-b] [--geometric=<factor>] [--window=<n>] [--depth=<n>]");
+    validate(!repack_all_opt || !geometric_opt, "-a and --geometric cannot be used together.");
+
+    return true;
+
+error:
+    return false;
+}
+
+void init_repack_options(repack_options *options)
+{
+    *options = (repack_options){
+        .is_write_bitmap = get_config_bool("repack.writeBitmaps", false),
+        .pack = {
+            .window = (unsigned)get_config_long("pack.window", DEFAULT_PACK_WINDOW),
+            .depth = (unsigned)get_config_long("pack.depth", DEFAULT_PACK_DEPTH),
+            .workers = get_worker_count("pack.threads"),
+        },
+    };
+}
+
+static void get_pack_sibling_path(const char *pack_path, const char *extension, char *path, const size_t path_len)
+{
+    const size_t stem_len = strlen(pack_path) - strlen(".pack");
+
+    (void)snprintf(path, path_len, "%.*s%s", (int)stem_len, pack_path, extension);
+}
+
+static bool has_pack_sibling(const char *pack_path, const char *extension)
+{
+    char path[PATH_MAX + 16];
+    get_pack_sibling_path(pack_path, extension, path, sizeof(path));
+
+    return access(path, F_OK) == 0;
+}
+
+static bool collect_packs(repack_state *state)
+{
+    size_t capacity = 0;
+    for (const packed_git *pack = get_packed_git_list(); pack; pack = pack->next) capacity++;
+
+    state->packs = calloc(capacity ? capacity : 1, sizeof(existing_pack));
+    validate(state->packs, "Failed to allocate memory.");
+
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        struct stat fs;
+        validate(stat(pack->pack_path, &fs) == 0, "Failed to stat '%s'.", pack->pack_path);
+
+        existing_pack *existing = &state->packs[state->pack_count++];
+        *existing = (existing_pack){
+            .pack = pack,
+            .mtime = fs.st_mtim,
+            .is_kept = has_pack_sibling(pack->pack_path, ".keep"),
+            .is_promisor = has_pack_sibling(pack->pack_path, ".promisor"),
+        };
+
+        (void)snprintf(existing->pack_path, PATH_MAX, "%s", pack->pack_path);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Whether a pack that stays after the repack has the object
+static bool is_in_remaining_pack(const repack_state *state, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    for (size_t i = 0; i < state->pack_count; i++)
+    {
+        if (state->packs[i].is_dropped) continue;
+
+        uint32_t position;
+        if (find_pack_idx_position(state->packs[i].pack, hash, &position)) return true;
+    }
+
+    return false;
+}
+
+static bool add_tip(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    (void)refname;
+    repack_state *state = data;
+
+    // A partial clone may lack what it was promised
+    if (!has_object(hash)) return true;
+
+    if (state->tip_count == state->tip_capacity)
+    {
+        const size_t capacity = state->tip_capacity ? state->tip_capacity * 2 : 64;
+
+        unsigned char (*tips)[SHA_DIGEST_LENGTH] = realloc(state->tips, capacity * SHA_DIGEST_LENGTH);
+        validate(tips, "Failed to allocate memory.");
+
+        state->tips = tips;
+        state->tip_capacity = capacity;
+    }
+
+    memcpy(state->tips[state->tip_count++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Staged content is reachable too, though no commit has it yet
+static bool collect_tips(repack_state *state)
+{
+    index_state index = { };
+
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+    if (resolve_ref("HEAD", nullptr, head_hash)) validate(add_tip("HEAD", head_hash, state), "Failed to add HEAD.");
+
+    validate(for_each_ref(add_tip, state), "Failed to read refs.");
+    validate(read_index(&index), "Failed to read the index.");
+
+    for (size_t i = 0; i < index.count; i++)
+    {
+        if ((index.entries[i].mode & 0170000) == 0160000) continue;
+
+        validate(add_tip(index.entries[i].path, index.entries[i].hash, state), "Failed to add index entry.");
+    }
+
+    release_index(&index);
+
+    return true;
+
+error:
+    release_index(&index);
+
+    return false;
+}
+
+static bool add_listed_object(repack_state *state, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, const uint32_t name_hash)
+{
+    if (oid_map_contains(&state->listed, hash)) return true;
+
+    validate(oid_map_put(&state->listed, hash, 0), "Failed to allocate memory.");
+    validate(object_list_append(&state->objects, hash, type), "Failed to list object.");
+    state->objects.items[state->objects.count - 1].name_hash = name_hash;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Everything reachable goes into the new pack, save for what kept packs
+// have and what a partial clone was never sent
+static bool collect_reachable_objects(repack_state *state)
+{
+    object_list reachable = { };
+    const list_objects_options list_options = { .filter = LIST_FILTER_NONE };
+
+    validate(collect_tips(state), "Failed to collect tips.");
+    validate(list_objects(state->tips, state->tip_count, nullptr, 0, &list_options, &reachable), "Failed to list reachable objects.");
+    validate(oid_map_init(&state->reachable, reachable.count), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state->pack_count; i++) state->packs[i].is_dropped = !state->packs[i].is_kept;
+
+    for (size_t i = 0; i < reachable.count; i++)
+    {
+        const listed_object *object = &reachable.items[i];
+        validate(oid_map_put(&state->reachable, object->hash, 0), "Failed to allocate memory.");
+
+        if (!has_object(object->hash) || is_in_remaining_pack(state, object->hash)) continue;
+
+        validate(add_listed_object(state, object->hash, object->type, object->name_hash), "Failed to list object.");
+    }
+
+    object_list_destroy(&reachable);
+
+    return true;
+
+error:
+    object_list_destroy(&reachable);
+
+    return false;
+}
+
+static int compare_pack_sizes(const void *a, const void *b)
+{
+    const uint32_t one = (*(existing_pack *const *)a)->pack->object_count;
+    const uint32_t two = (*(existing_pack *const *)b)->pack->object_count;
+
+    return one < two ? -1 : one > two;
+}
+
+// Finds the first pack, smallest first, from which on every pack has at
+// least factor times the objects of the one before; the packs below are
+// rolled up, together with any pack the roll-up grows past
+static bool plan_geometric_repack(repack_state *state)
+{
+    existing_pack **sorted = malloc((state->pack_count + 1) * sizeof(existing_pack *));
+    validate(sorted, "Failed to allocate memory.");
+
+    size_t count = 0;
+    for (size_t i = 0; i < state->pack_count; i++)
+    {
+        if (!state->packs[i].is_kept) sorted[count++] = &state->packs[i];
+    }
+
+    qsort(sorted, count, sizeof(existing_pack *), compare_pack_sizes);
+
+    const uint64_t factor = (uint64_t)state->options->geometric_factor;
+
+    size_t split = count;
+    while (split > 1 && sorted[split - 1]->pack->object_count >= factor * sorted[split - 2]->pack->object_count) split--;
+    if (split == 1) split = 0;
+
+    uint64_t rolled_up_count = 0;
+    for (size_t i = 0; i < split; i++) rolled_up_count += sorted[i]->pack->object_count;
+
+    while (split < count && sorted[split]->pack->object_count < factor * rolled_up_count)
+    {
+        rolled_up_count += sorted[split++]->pack->object_count;
+    }
+
+    for (size_t i = 0; i < split; i++) sorted[i]->is_dropped = true;
+
+    free(sorted);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_pack_objects(repack_state *state, packed_git *pack)
+{
+    for (uint32_t i = 0; i < pack->object_count; i++)
+    {
+        const unsigned char *hash = get_pack_idx_hash(pack, i);
+
+        const object_type type = get_packed_object_type(pack, get_pack_idx_offset(pack, i));
+        validate(type != OBJ_NONE, "Failed to read an object of '%s'.", pack->pack_path);
+
+        validate(add_listed_object(state, hash, type, 0), "Failed to list object.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_loose_object(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path, void *data)
+{
+    (void)path;
+    repack_state *state = data;
+
+    if (oid_map_contains(&state->listed, hash) || is_in_remaining_pack(state, hash)) return true;
+
+    object_type type;
+    size_t size;
+    validate(get_object_info(hash, &type, &size), "Failed to read loose object.");
+
+    return add_listed_object(state, hash, type, 0);
+
+error:
+    return false;
+}
+
+static bool collect_unreachable_objects(repack_state *state, const time_t since)
+{
+    oid_map listed = { };
+    validate(oid_map_init(&listed, 1024), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state->pack_count; i++)
+    {
+        const existing_pack *existing = &state->packs[i];
+        if (!existing->is_dropped || existing->mtime.tv_sec <= since) continue;
+
+        packed_git *pack = existing->pack;
+
+        for (uint32_t n = 0; n < pack->object_count; n++)
+        {
+            const unsigned char *hash = get_pack_idx_hash(pack, n);
+            if (oid_map_contains(&state->reachable, hash) || oid_map_contains(&listed, hash)) continue;
+
+            const object_type type = get_packed_object_type(pack, get_pack_idx_offset(pack, n));
+            validate(type != OBJ_NONE, "Failed to read an object of '%s'.", pack->pack_path);
+
+            validate(oid_map_put(&listed, hash, 0) && object_list_append(&state->cruft, hash, type), "Failed to list object.");
+
+            if (existing->mtime.tv_sec > state->cruft_mtime.tv_sec) state->cruft_mtime = existing->mtime;
+        }
+    }
+
+    oid_map_destroy(&listed);
+
+    return true;
+
+error:
+    oid_map_destroy(&listed);
+
+    return false;
+}
+
+// Unreachable objects age with the pack that holds them, so the pack they
+// are kept in takes the time of the newest pack they came from
+static bool write_cruft_pack(repack_state *state)
+{
+    size_t delta_count;
+    validate(
+        pack_objects(state->cruft.items, state->cruft.count, &state->options->pack, state->cruft_hash_hex, &delta_count),
+        "Failed to pack unreachable objects.");
+
+    if (state->cruft_hash_hex[0])
+    {
+        char rel_path[PATH_MAX];
+        char path[PATH_MAX];
+        (void)snprintf(rel_path, sizeof(rel_path), "objects/pack/pack-%s.pack", state->cruft_hash_hex);
+        validate(get_git_path(path, PATH_MAX, rel_path), "Not a git repository.");
+
+        const struct timespec times[2] = { state->cruft_mtime, state->cruft_mtime };
+        validate(utimensat(AT_FDCWD, path, times, 0) == 0, "Failed to set the time of '%s'.", path);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static packed_git *find_pack_by_hash(const char *pack_hash_hex)
+{
+    char name[SHA_HEX_LENGTH + 16];
+    (void)snprintf(name, sizeof(name), "/pack-%s.pack", pack_hash_hex);
+
+    const size_t name_len = strlen(name);
+
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        const size_t path_len = strlen(pack->pack_path);
+        if (path_len >= name_len && strcmp(&pack->pack_path[path_len - name_len], name) == 0) return pack;
+    }
+
+    return nullptr;
+}
+
+static bool mark_promisor_pack(const char *pack_hash_hex)
+{
+    char rel_path[PATH_MAX];
+    char path[PATH_MAX];
+    (void)snprintf(rel_path, sizeof(rel_path), "objects/pack/pack-%s.promisor", pack_hash_hex);
+    validate(get_git_path(path, PATH_MAX, rel_path), "Not a git repository.");
+
+    FILE *file = fopen(path, "w");
+    validate(file && fclose(file) == 0, "Failed to create '%s'.", path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// A repack may write a pack identical to one it replaces; that one stays
+static bool is_new_pack(const repack_state *state, const existing_pack *existing)
+{
+    const char *hashes[] = { state->pack_hash_hex, state->cruft_hash_hex };
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (!hashes[i][0]) continue;
+
+        char name[SHA_HEX_LENGTH + 16];
+        (void)snprintf(name, sizeof(name), "pack-%s.pack", hashes[i]);
+
+        const char *slash = strrchr(existing->pack_path, '/');
+        if (strcmp(slash ? &slash[1] : existing->pack_path, name) == 0) return true;
+    }
+
+    return false;
+}
+
+// The .idx goes first, as readers find packs through it
+static bool remove_dropped_packs(const repack_state *state)
+{
+    static const char *extensions[] = { ".idx", ".bitmap", ".promisor", ".rev", ".pack" };
+
+    for (size_t i = 0; i < state->pack_count; i++)
+    {
+        const existing_pack *existing = &state->packs[i];
+        if (!existing->is_dropped || is_new_pack(state, existing)) continue;
+
+        for (size_t e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++)
+        {
+            char path[PATH_MAX + 16];
+            get_pack_sibling_path(existing->pack_path, extensions[e], path, sizeof(path));
+
+            validate(unlink(path) == 0 || errno == ENOENT, "Failed to remove '%s'.", path);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool remove_packed_loose_object(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path, void *data)
+{
+    (void)data;
+
+    packed_git *pack;
+    uint64_t offset;
+    if (!find_pack_entry(hash, &pack, &offset)) return true;
+
+    validate(unlink(path) == 0 || errno == ENOENT, "Failed to remove '%s'.", path);
+
+    return true;
+
+error:
+    return false;
+}
+
+static void remove_empty_fanout_dirs(void)
+{
+    char objects_path[PATH_MAX];
+    if (!get_git_path(objects_path, PATH_MAX, "objects")) return;
+
+    for (int fanout = 0; fanout < 256; fanout++)
+    {
+        char dir_path[PATH_MAX + 4];
+        (void)snprintf(dir_path, sizeof(dir_path), "%s/%02x", objects_path, fanout);
+
+        (void)rmdir(dir_path);
+    }
+}
+
+static bool has_multi_pack_index(void)
+{
+    char path[PATH_MAX];
+
+    return get_git_path(path, PATH_MAX, "objects/pack/multi-pack-index") && access(path, F_OK) == 0;
+}
+
+// A multi-pack-index naming a removed pack would be ignored from then on,
+// so it is written again over the packs that are left
+static bool update_multi_pack_index(void)
+{
+    if (!get_packed_git_list())
+    {
+        char path[PATH_MAX];
+        validate(get_git_path(path, PATH_MAX, "objects/pack/multi-pack-index"), "Not a git repository.");
+        validate(unlink(path) == 0 || errno == ENOENT, "Failed to remove '%s'.", path);
+
+        reprepare_multi_pack_index();
+
+        return true;
+    }
+
+    return write_multi_pack_index();
+
+error:
+    return false;
+}
+
+static void release_repack_state(repack_state *state)
+{
+    if (state->packs) free(state->packs);
+    if (state->tips) free(state->tips);
+
+    object_list_destroy(&state->objects);
+    object_list_destroy(&state->cruft);
+    oid_map_destroy(&state->listed);
+    oid_map_destroy(&state->reachable);
+}
+
+static bool collect_objects(repack_state *state)
+{
+    const repack_options *options = state->options;
+
+    validate(oid_map_init(&state->listed, 1024), "Failed to allocate memory.");
+
+    if (options->is_all) return collect_reachable_objects(state);
+
+    if (options->geometric_factor) validate(plan_geometric_repack(state), "Failed to plan the repack.");
+
+    for (size_t i = 0; i < state->pack_count; i++)
+    {
+        if (state->packs[i].is_dropped) validate(add_pack_objects(state, state->packs[i].pack), "Failed to list packed objects.");
+    }
+
+    return for_each_loose_object(add_loose_object, state);
+
+error:
+    return false;
+}
+
+bool repack_repository(const repack_options *options)
+{
+    repack_state state = { .options = options };
+    const bool had_multi_pack_index = has_multi_pack_index();
+
+    const bool is_keeping_unreachable = options->is_all && options->is_delete && options->keep_unreachable_since;
+
+    validate(collect_packs(&state), "Failed to list packs.");
+    validate(collect_objects(&state), "Failed to collect objects.");
+
+    if (is_keeping_unreachable)
+    {
+        validate(collect_unreachable_objects(&state, options->keep_unreachable_since), "Failed to collect unreachable objects.");
+    }
+
+    size_t delta_count;
+    validate(
+        pack_objects(state.objects.items, state.objects.count, &options->pack, state.pack_hash_hex, &delta_count),
+        "Failed to write the pack.");
+
+    (void)fprintf(stderr, "Total %zu (delta %zu)\n", state.objects.count, delta_count);
+
+    bool is_promisor = false;
+    for (size_t i = 0; i < state.pack_count; i++) is_promisor = is_promisor || (state.packs[i].is_dropped && state.packs[i].is_promisor);
+
+    if (state.pack_hash_hex[0] && is_promisor) validate(mark_promisor_pack(state.pack_hash_hex), "Failed to mark the pack.");
+
+    if (is_keeping_unreachable) validate(write_cruft_pack(&state), "Failed to keep unreachable objects.");
+
+    // A bitmap has to cover everything reachable, which a partial clone or
+    // objects left in kept packs rule out
+    bool is_complete = options->is_all && !get_promisor_remote();
+    for (size_t i = 0; i < state.pack_count; i++) is_complete = is_complete && !state.packs[i].is_kept;
+
+    if (options->is_write_bitmap && is_complete && state.pack_hash_hex[0])
+    {
+        packed_git *pack = find_pack_by_hash(state.pack_hash_hex);
+        validate(pack, "The new pack is missing.");
+        validate(write_pack_bitmap(pack, state.tips, state.tip_count), "Failed to write the bitmap.");
+    }
+
+    if (options->is_delete)
+    {
+        validate(remove_dropped_packs(&state), "Failed to remove packs.");
+        reprepare_packed_git();
+
+        validate(for_each_loose_object(remove_packed_loose_object, nullptr), "Failed to remove packed loose objects.");
+        remove_empty_fanout_dirs();
+        reprepare_packed_git();
+    }
+
+    if (had_multi_pack_index) validate(update_multi_pack_index(), "Failed to update the multi-pack-index.");
+
+    release_repack_state(&state);
+
+    return true;
+
+error:
+    release_repack_state(&state);
+
+    return false;
+}
+
+// repack [-a] [-d] [-b] [--geometric=<factor>] [--window=<n>] [--depth=<n>]
+// Packs the loose objects into a new pack, with deltas between similar
+// objects. -a packs everything reachable from refs, HEAD and the index
+// into one pack in place of all others, and -b writes its bitmap.
+// --geometric=<factor> rolls up only the smallest packs, so that pack
+// sizes grow by at least factor. -d removes the packs rolled up and the
+// loose objects now packed. Packs with a .keep file are left alone.
+int repack(const int argc, char *argv[])
+{
+    repack_options options;
+    init_repack_options(&options);
+
+    validate(try_resolve_repack_opts(argc, argv), "Failed to resolve options.");
+
+    options.is_all = repack_all_opt;
+    options.is_delete = repack_delete_opt;
+    options.is_write_bitmap = options.is_write_bitmap || write_bitmap_index_opt;
+    options.geometric_factor = geometric_opt;
+
+    if (pack_window_opt >= 0) options.pack.window = (unsigned)pack_window_opt;
+    if (pack_depth_opt >= 0) options.pack.depth = (unsigned)pack_depth_opt;
+
+    validate(repack_repository(&options), "Failed to repack.");
+
+    return 0;
+
+error:
+    return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef REPACK_H
+#define REPACK_H
+
+#include <time.h>
+
+#include "pack_objects.h"
+
+typedef struct repack_options
+{
+    // Every reachable object into one pack, in place of every other pack
+    bool is_all;
+
+    // Removes the packs that were rolled up and loose objects now packed
+    bool is_delete;
+
+    bool is_write_bitmap;
+
+    // Rolls up the smallest packs until each pack has at least factor
+    // times the objects of the next smaller one; 0 when not geometric
+    long geometric_factor;
+
+    // With is_all and is_delete, unreachable objects of removed packs that
+    // were modified after this are kept, in a pack of their own that keeps
+    // the newest of their times; 0 drops them
+    time_t keep_unreachable_since;
+
+    pack_options pack;
+} repack_options;
+
+int repack(int argc, char *argv[]);
+
+// The options repack takes from pack.window, pack.depth and pack.threads
+void init_repack_options(repack_options *options);
+
+bool repack_repository(const repack_options *options);
+
+#endif //REPACK_H
@@ -0,0 +1,516 @@
+#include "rev_list.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "commit.h"
+#include "commit_graph.h"
+#include "commit_reach.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "list_objects.h"
+#include "oid_map.h"
+#include "pack_bitmap.h"
+#include "refs.h"
+#include "tree_walk.h"
+
+#define REV_LIST_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+bool objects_opt = false;
+bool count_opt = false;
+bool use_bitmap_index_opt = false;
+bool all_refs_opt = false;
+long max_count_opt = -1;
+
+typedef struct rev_tag
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    char *name;
+} rev_tag;
+
+typedef struct rev_walk
+{
+    object_walk objects;
+
+    // Tag objects named by refs; they are shown with --objects
+    rev_tag *tags;
+    size_t tag_count;
+    size_t tag_capacity;
+
+    size_t count;
+
+    // Paths after "--"; commits that do not change them are simplified away
+    char **paths;
+    size_t path_count;
+
+    // Changed-path filter keys of each path and its leading directories;
+    // those of path i end at bloom_key_ends[i]
+    bloom_key *bloom_keys;
+    size_t *bloom_key_ends;
+} rev_walk;
+
+static bool try_resolve_rev_list_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "objects", no_argument, nullptr, 'o' },
+        { "count", no_argument, nullptr, 'c' },
+        { "use-bitmap-index", no_argument, nullptr, 'b' },
+        { "all", no_argument, nullptr, 'a' },
+        { "max-count", required_argument, nullptr, 'n' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                objects_opt = true;
+                break;
+            case 'c':
+                count_opt = true;
+                break;
+            case 'b':
+                use_bitmap_index_opt = true;
+                break;
+            case 'a':
+                all_refs_opt = true;
+                break;
+            case 'n':
+                char *end;
+                max_count_opt = strtol(optarg, &end, 10);
+                validate(*optarg && !*end && max_count_opt >= 0, "Invalid count '%s'.", optarg);
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static commit *lookup_commit_reference(const char *name)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    validate(resolve_commit_hex(name, hex), "Not a valid commit name '%s'.", name);
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    hash_hex_to_bytes(hash, hex);
+
+    return lookup_commit(hash);
+
+error:
+    return nullptr;
+}
+
+// Tags are shown under the ref name, shortened the way git does
+static bool add_tag(rev_walk *walk, const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (walk->tag_count == walk->tag_capacity)
+    {
+        const size_t capacity = walk->tag_capacity ? walk->tag_capacity * 2 : 16;
+
+        rev_tag *tags = realloc(walk->tags, capacity * sizeof(rev_tag));
+        validate(tags, "Failed to allocate memory.");
+
+        walk->tags = tags;
+        walk->tag_capacity = capacity;
+    }
+
+    static const char *prefixes[] = { "refs/tags/", "refs/heads/", "refs/remotes/", "refs/" };
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+    {
+        const size_t prefix_len = strlen(prefixes[i]);
+        if (strncmp(refname, prefixes[i], prefix_len) != 0) continue;
+
+        refname += prefix_len;
+        break;
+    }
+
+    rev_tag *tag = &walk->tags[walk->tag_count];
+    tag->name = strdup(refname);
+    validate(tag->name, "Failed to allocate memory.");
+
+    memcpy(tag->hash, hash, SHA_DIGEST_LENGTH);
+    walk->tag_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_ref_want(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    rev_walk *walk = data;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    commit *commit = lookup_commit_reference(hex);
+    validate(commit, "Failed to look up '%s'.", refname);
+    validate(commit_list_append(&walk->objects.wants, commit), "Failed to add commit.");
+
+    // An annotated tag peels to a different oid
+    if (memcmp(commit->hash, hash, SHA_DIGEST_LENGTH) != 0) validate(add_tag(walk, refname, hash), "Failed to add tag.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Bloom keys are only useful when the commit-graph has filters to ask
+static bool prepare_bloom_keys(rev_walk *walk)
+{
+    const commit_graph *graph = get_commit_graph();
+    if (!graph || !graph->bloom_indexes) return true;
+
+    size_t key_count = 0;
+    for (size_t i = 0; i < walk->path_count; i++) key_count += count_bloom_path_keys(walk->paths[i]);
+
+    walk->bloom_keys = malloc(key_count * sizeof(bloom_key));
+    walk->bloom_key_ends = malloc(walk->path_count * sizeof(size_t));
+    validate(walk->bloom_keys && walk->bloom_key_ends, "Failed to allocate memory.");
+
+    size_t key = 0;
+    for (size_t i = 0; i < walk->path_count; i++)
+    {
+        key += fill_bloom_path_keys(walk->paths[i], &graph->bloom_settings, &walk->bloom_keys[key]);
+        walk->bloom_key_ends[i] = key;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// False only when the commit-graph filter of the commit rules out that it
+// changed any of the paths relative to its first parent
+static bool may_change_paths(const rev_walk *walk, const commit *commit)
+{
+    if (!walk->bloom_keys || commit->graph_position == COMMIT_NOT_FROM_GRAPH) return true;
+
+    const commit_graph *graph = get_commit_graph();
+    bloom_filter filter;
+    if (!get_commit_graph_bloom_filter(graph, commit->graph_position, &filter)) return true;
+
+    for (size_t i = 0, key = 0; i < walk->path_count; key = walk->bloom_key_ends[i++])
+    {
+        const size_t key_count = walk->bloom_key_ends[i] - key;
+        if (bloom_filter_may_contain_path(&filter, &walk->bloom_keys[key], key_count, &graph->bloom_settings)) return true;
+    }
+
+    return false;
+}
+
+// A null old tree stands for the empty tree, which root commits compare to
+static bool are_paths_same(const rev_walk *walk, const unsigned char *old_tree, const unsigned char *new_tree, bool *is_same)
+{
+    *is_same = true;
+
+    for (size_t i = 0; *is_same && i < walk->path_count; i++)
+    {
+        unsigned char old_hash[SHA_DIGEST_LENGTH];
+        unsigned char new_hash[SHA_DIGEST_LENGTH];
+        unsigned int old_mode;
+        unsigned int new_mode;
+
+        validate(find_tree_entry(old_tree, walk->paths[i], old_hash, &old_mode), "Failed to read '%s'.", walk->paths[i]);
+        validate(find_tree_entry(new_tree, walk->paths[i], new_hash, &new_mode), "Failed to read '%s'.", walk->paths[i]);
+
+        *is_same = old_mode == new_mode && (!old_mode || memcmp(old_hash, new_hash, SHA_DIGEST_LENGTH) == 0);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Interesting commits and the bottoms of the range, as git counts them
+static bool is_relevant(const rev_walk *walk, const commit *commit)
+{
+    return (get_object_walk_flags(&walk->objects, commit) & (WALK_UNINTERESTING | WALK_BOTTOM)) != WALK_UNINTERESTING;
+}
+
+// git's default history simplification: a commit that has the paths the
+// way one of its relevant parents has them is hidden and the walk goes on
+// through that parent alone. *followed is nullptr when every parent is to
+// be walked.
+static bool simplify_commit(object_walk *objects, const commit *commit, bool *is_treesame, struct commit **followed)
+{
+    const rev_walk *walk = objects->data;
+
+    *is_treesame = false;
+    *followed = nullptr;
+
+    if (!commit->parent_count) return are_paths_same(walk, nullptr, commit->tree_hash, is_treesame);
+
+    size_t relevant_count = 0;
+    bool is_relevant_changed = false;
+    bool is_irrelevant_changed = false;
+
+    for (uint32_t i = 0; i < commit->parent_count; i++)
+    {
+        struct commit *parent = commit->parents[i];
+        validate(parse_commit(parent), "Failed to parse commit.");
+
+        const bool is_parent_relevant = is_relevant(walk, parent);
+        if (is_parent_relevant) relevant_count++;
+
+        // Filters are computed against the first parent only
+        bool is_same = i == 0 && !may_change_paths(walk, commit);
+        if (!is_same) validate(are_paths_same(walk, parent->tree_hash, commit->tree_hash, &is_same), "Failed to compare trees.");
+
+        if (!is_same)
+        {
+            if (is_parent_relevant) is_relevant_changed = true;
+            else is_irrelevant_changed = true;
+
+            continue;
+        }
+
+        if (!is_parent_relevant) continue;
+
+        *is_treesame = true;
+        *followed = parent;
+
+        return true;
+    }
+
+    // Changes against parents from outside the range only count when
+    // there is no parent inside it
+    *is_treesame = relevant_count ? !is_relevant_changed : !is_irrelevant_changed;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void print_hash(const unsigned char hash[SHA_DIGEST_LENGTH], const char *path)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    if (path)
+        printf("%s %s\n", hex, path);
+    else
+        printf("%s\n", hex);
+}
+
+static bool show_object(object_walk *objects, const unsigned char hash[SHA_DIGEST_LENGTH], const object_type type, const char *path)
+{
+    rev_walk *walk = objects->data;
+
+    walk->count++;
+    if (!count_opt) print_hash(hash, path);
+
+    return true;
+}
+
+static bool walk_objects(rev_walk *walk)
+{
+    oid_map *seen_objects = &walk->objects.seen_objects;
+
+    for (size_t i = 0; i < walk->tag_count; i++)
+    {
+        const rev_tag *tag = &walk->tags[i];
+        if (oid_map_contains(seen_objects, tag->hash)) continue;
+
+        validate(oid_map_put(seen_objects, tag->hash, 0), "Failed to mark object.");
+
+        walk->count++;
+        if (!count_opt) print_hash(tag->hash, tag->name);
+    }
+
+    return walk_commit_trees(&walk->objects);
+
+error:
+    return false;
+}
+
+static bool list_without_bitmap(rev_walk *walk)
+{
+    const commit_list *shown = &walk->objects.shown;
+
+    validate(walk_commits(&walk->objects), "Failed to walk commits.");
+
+    walk->count += shown->count;
+
+    if (!count_opt)
+    {
+        for (size_t i = 0; i < shown->count; i++) print_hash(shown->items[i]->hash, nullptr);
+    }
+
+    if (objects_opt) validate(walk_objects(walk), "Failed to walk objects.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static void show_bitmap_objects(const pack_bitmap_index *index, const bitmap *result, const bitmap *type_bitmap)
+{
+    for (size_t pos = 0; bitmap_next_set(result, &pos); pos++)
+    {
+        if (bitmap_get(type_bitmap, pos)) print_hash(get_bitmap_object_hash(index, (uint32_t)pos), nullptr);
+    }
+}
+
+// Reachability as set operations on the pack's bitmaps. Returns false,
+// having printed nothing, when they do not cover the request.
+static bool try_list_with_bitmap(rev_walk *walk)
+{
+    bitmap result = { };
+
+    pack_bitmap_index *index = get_pack_bitmap_index();
+    if (!index) return false;
+
+    const object_walk *objects = &walk->objects;
+    if (!get_reachable_bitmap(index, objects->wants.items, objects->wants.count, objects->haves.items, objects->haves.count, &result)) return false;
+
+    for (size_t i = 0; objects_opt && i < walk->tag_count; i++)
+    {
+        uint32_t position;
+        if (!find_bitmap_position(index, walk->tags[i].hash, &position) || !bitmap_set(&result, position))
+        {
+            bitmap_release(&result);
+            return false;
+        }
+    }
+
+    if (!objects_opt) bitmap_and(&result, &index->commits);
+
+    if (count_opt)
+    {
+        walk->count = bitmap_popcount(&result);
+    }
+    else
+    {
+        show_bitmap_objects(index, &result, &index->commits);
+
+        if (objects_opt)
+        {
+            show_bitmap_objects(index, &result, &index->trees);
+            show_bitmap_objects(index, &result, &index->blobs);
+            show_bitmap_objects(index, &result, &index->tags);
+        }
+    }
+
+    bitmap_release(&result);
+
+    return true;
+}
+
+// Everything after "--" is a path; trailing slashes are dropped
+static bool take_paths(rev_walk *walk, int *argc, char *argv[])
+{
+    for (int i = 1; i < *argc; i++)
+    {
+        if (strcmp(argv[i], "--") != 0) continue;
+
+        walk->paths = &argv[i + 1];
+        walk->path_count = (size_t)(*argc - i - 1);
+        *argc = i;
+        break;
+    }
+
+    for (size_t i = 0; i < walk->path_count; i++)
+    {
+        char *path = walk->paths[i];
+        size_t len = strlen(path);
+
+        while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+        validate(len && path[0] != '/', "Invalid path '%s'.", path);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// rev-list [--objects] [--count] [--use-bitmap-index] [--all] [-n <count>] [<commit>...] [^<commit>...] [-- <path>...]
+int rev_list(int argc, char *argv[])
+{
+    rev_walk walk = { };
+    validate(init_object_walk(&walk.objects), "Failed to allocate memory.");
+
+    // getopt is kept away from the paths, which may look like options
+    validate(take_paths(&walk, &argc, argv), "Failed to resolve paths.");
+    validate(try_resolve_rev_list_opts(argc, argv), "Failed to resolve options.");
+    validate(!objects_opt || !walk.path_count, "--objects cannot be limited to paths.");
+    validate(prepare_bloom_keys(&walk), "Failed to prepare changed-path filter keys.");
+
+    walk.objects.max_count = max_count_opt;
+    walk.objects.simplify = walk.path_count ? simplify_commit : nullptr;
+    walk.objects.show_object = show_object;
+    walk.objects.data = &walk;
+
+    const command_args args = get_command_args(argc, argv);
+
+    for (int i = 0; i < args.count; i++)
+    {
+        const bool is_negative = args.argv[i][0] == '^';
+
+        commit *commit = lookup_commit_reference(is_negative ? &args.argv[i][1] : args.argv[i]);
+        validate(commit, "Failed to look up commit '%s'.", args.argv[i]);
+        validate(commit_list_append(is_negative ? &walk.objects.haves : &walk.objects.wants, commit), "Failed to add commit.");
+    }
+
+    if (all_refs_opt) validate(for_each_ref(add_ref_want, &walk), "Failed to read refs.");
+
+    validate(walk.objects.wants.count, "Usage: rev-list [--objects] [--count] [--use-bitmap-index] [--all] [-n <count>] <commit>... [^<commit>...] [-- <path>...]");
+
+    (void)setvbuf(stdout, nullptr, _IOFBF, REV_LIST_OUTPUT_BUFFER_SIZE);
+
+    // Bitmaps know nothing of paths and list everything at once
+    const bool can_use_bitmap = use_bitmap_index_opt && !walk.path_count && max_count_opt < 0;
+
+    if (!can_use_bitmap || !try_list_with_bitmap(&walk))
+    {
+        validate(list_without_bitmap(&walk), "Failed to list revisions.");
+    }
+
+    if (count_opt) printf("%zu\n", walk.count);
+
+    fflush(stdout);
+
+    release_object_walk(&walk.objects);
+    for (size_t i = 0; i < walk.tag_count; i++) free(walk.tags[i].name);
+    if (walk.tags) free(walk.tags);
+    if (walk.bloom_keys) free(walk.bloom_keys);
+    if (walk.bloom_key_ends) free(walk.bloom_key_ends);
+
+    return 0;
+
+error:
+    fflush(stdout);
+
+    release_object_walk(&walk.objects);
+    for (size_t i = 0; i < walk.tag_count; i++) free(walk.tags[i].name);
+    if (walk.tags) free(walk.tags);
+    if (walk.bloom_keys) free(walk.bloom_keys);
+    if (walk.bloom_key_ends) free(walk.bloom_key_ends);
+
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef REV_LIST_H
+#define REV_LIST_H
+
+int rev_list(int argc, char *argv[]);
+
+#endif //REV_LIST_H
@@ -0,0 +1,36 @@
+#include "sha1.h"
+
+#include "debug_helpers.h"
+#include "trace.h"
+
+bool sha1_init(sha1_ctx *ctx)
+{
+    ctx->md_ctx = EVP_MD_CTX_new();
+    validate(ctx->md_ctx, "Failed to allocate hash context.");
+    validate(EVP_DigestInit_ex(ctx->md_ctx, EVP_sha1(), nullptr) == 1, "Failed to initialize SHA-1.");
+
+    return true;
+
+error:
+    if (ctx->md_ctx) EVP_MD_CTX_free(ctx->md_ctx);
+    ctx->md_ctx = nullptr;
+
+    return false;
+}
+
+void sha1_update(const sha1_ctx *ctx, const void *data, const size_t size)
+{
+    trace_timer_start(TRACE_TIMER_HASH);
+    (void)EVP_DigestUpdate(ctx->md_ctx, data, size);
+    trace_timer_stop(TRACE_TIMER_HASH);
+}
+
+void sha1_final(sha1_ctx *ctx, unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    trace_timer_start(TRACE_TIMER_HASH);
+    (void)EVP_DigestFinal_ex(ctx->md_ctx, hash, nullptr);
+    trace_timer_stop(TRACE_TIMER_HASH);
+
+    EVP_MD_CTX_free(ctx->md_ctx);
+    ctx->md_ctx = nullptr;
+}
@@ -0,0 +1,20 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+// Incremental SHA-1 for data that does not fit the one-shot SHA1() call
+typedef struct sha1_ctx
+{
+    EVP_MD_CTX *md_ctx;
+} sha1_ctx;
+
+bool sha1_init(sha1_ctx *ctx);
+
+void sha1_update(const sha1_ctx *ctx, const void *data, size_t size);
+
+void sha1_final(sha1_ctx *ctx, unsigned char hash[SHA_DIGEST_LENGTH]);
+
+#endif //SHA1_H
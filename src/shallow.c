@@ -0,0 +1,157 @@
+#include "shallow.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "odb_transaction.h"
+#include "oid_map.h"
+
+static bool is_shallow_prepared = false;
+static oid_map shallow_map = { };
+static unsigned char (*shallow_commits)[SHA_DIGEST_LENGTH] = nullptr;
+static size_t shallow_count = 0;
+
+static bool add_shallow_commit(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (oid_map_contains(&shallow_map, hash)) return true;
+
+    // Grown in powers of two
+    if ((shallow_count & (shallow_count - 1)) == 0)
+    {
+        unsigned char (*grown)[SHA_DIGEST_LENGTH] = realloc(shallow_commits, (shallow_count ? shallow_count * 2 : 16) * SHA_DIGEST_LENGTH);
+        validate(grown, "Failed to allocate memory.");
+        shallow_commits = grown;
+    }
+
+    validate(oid_map_put(&shallow_map, hash, 0), "Failed to mark shallow commit.");
+    memcpy(shallow_commits[shallow_count++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_shallow(void)
+{
+    oid_map_destroy(&shallow_map);
+    if (shallow_commits) free(shallow_commits);
+
+    shallow_commits = nullptr;
+    shallow_count = 0;
+    is_shallow_prepared = false;
+}
+
+static void prepare_shallow(void)
+{
+    is_shallow_prepared = true;
+
+    char path[PATH_MAX];
+    if (!get_git_path(path, PATH_MAX, "shallow")) return;
+
+    FILE *file = fopen(path, "r");
+    if (!file) return;
+
+    validate(oid_map_init(&shallow_map, 64), "Failed to allocate memory.");
+
+    char line[SHA_HEX_LENGTH + 8];
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        validate(strlen(line) >= SHA_HEX_LENGTH && hash_hex_to_bytes(hash, line), "Malformed line in '%s'.", path);
+        validate(add_shallow_commit(hash), "Failed to read '%s'.", path);
+    }
+
+    fclose(file);
+
+    return;
+
+error:
+    fclose(file);
+    release_shallow();
+    is_shallow_prepared = true;
+}
+
+bool is_shallow_repository(void)
+{
+    if (!is_shallow_prepared) prepare_shallow();
+
+    return shallow_count > 0;
+}
+
+bool is_shallow_commit(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    return is_shallow_repository() && oid_map_contains(&shallow_map, hash);
+}
+
+const unsigned char (*get_shallow_commits(size_t *count))[SHA_DIGEST_LENGTH]
+{
+    *count = is_shallow_repository() ? shallow_count : 0;
+
+    return (const unsigned char (*)[SHA_DIGEST_LENGTH])shallow_commits;
+}
+
+bool update_shallow_file(
+    const unsigned char (*added)[SHA_DIGEST_LENGTH],
+    const size_t added_count,
+    const unsigned char (*removed)[SHA_DIGEST_LENGTH],
+    const size_t removed_count)
+{
+    char *content = nullptr;
+    size_t content_size = 0;
+    oid_map removed_map = { };
+
+    if (!is_shallow_prepared) prepare_shallow();
+    if (!shallow_map.entries) validate(oid_map_init(&shallow_map, 64), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < added_count; i++) validate(add_shallow_commit(added[i]), "Failed to add shallow commit.");
+
+    validate(oid_map_init(&removed_map, removed_count), "Failed to allocate memory.");
+    for (size_t i = 0; i < removed_count; i++) validate(oid_map_put(&removed_map, removed[i], 0), "Failed to mark commit.");
+
+    FILE *stream = open_memstream(&content, &content_size);
+    validate(stream, "Failed to open memory stream.");
+
+    size_t kept_count = 0;
+
+    for (size_t i = 0; i < shallow_count; i++)
+    {
+        if (oid_map_contains(&removed_map, shallow_commits[i])) continue;
+
+        char hex[SHA_HEX_LENGTH + 1];
+        hash_bytes_to_hex(hex, shallow_commits[i]);
+        hex[SHA_HEX_LENGTH] = '\0';
+
+        fprintf(stream, "%s\n", hex);
+        kept_count++;
+    }
+
+    fclose(stream);
+
+    char path[PATH_MAX];
+    validate(get_git_path(path, PATH_MAX, "shallow"), "Not a git repository.");
+
+    if (kept_count)
+        validate(replace_file_atomically(path, (unsigned char *)content, content_size), "Failed to write '%s'.", path);
+    else
+        validate(unlink(path) == 0 || errno == ENOENT, "Failed to remove '%s'.", path);
+
+    free(content);
+    oid_map_destroy(&removed_map);
+    release_shallow();
+
+    return true;
+
+error:
+    if (content) free(content);
+    oid_map_destroy(&removed_map);
+
+    return false;
+}
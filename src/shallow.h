@@ -0,0 +1,25 @@
+#ifndef SHALLOW_H
+#define SHALLOW_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+// Commits listed in .git/shallow are the boundary of a shallow history:
+// their parents are not in the repository, so commits are parsed as if
+// they had none, and walks stop there.
+bool is_shallow_repository(void);
+
+bool is_shallow_commit(const unsigned char hash[SHA_DIGEST_LENGTH]);
+
+// The shallow commits, in the order of the file
+const unsigned char (*get_shallow_commits(size_t *count))[SHA_DIGEST_LENGTH];
+
+// Adds and removes boundary commits, rewriting .git/shallow atomically;
+// the file goes away once no commit is left in it
+bool update_shallow_file(
+    const unsigned char (*added)[SHA_DIGEST_LENGTH],
+    size_t added_count,
+    const unsigned char (*removed)[SHA_DIGEST_LENGTH],
+    size_t removed_count);
+
+#endif //SHALLOW_H
@@ -0,0 +1,147 @@
+#include "sparse_checkout.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+#include "sparse_cone.h"
+#include "unpack_tree.h"
+
+bool sparse_index_opt = true;
+
+static bool try_resolve_sparse_checkout_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "sparse-index", no_argument, nullptr, 's' },
+        { "no-sparse-index", no_argument, nullptr, 'S' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                sparse_index_opt = true;
+                break;
+            case 'S':
+                sparse_index_opt = false;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 2 <= argc, "Usage: sparse-checkout (set [--[no-]sparse-index] <dir>... | list | disable)");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Brings the index and the worktree in line with the current patterns
+static bool update_sparse_checkout(void)
+{
+    char tree_hex[SHA_HEX_LENGTH + 1];
+    unsigned char tree_hash[SHA_DIGEST_LENGTH];
+    const bool has_head = resolve_tree_hex("HEAD", tree_hex) && hash_hex_to_bytes(tree_hash, tree_hex);
+
+    return reapply_sparse_checkout(has_head ? tree_hash : nullptr);
+}
+
+static bool set_sparse_checkout(char *const *dirs, const size_t count)
+{
+    sparse_cone cone = { };
+
+    validate(init_sparse_cone(&cone, dirs, count), "Failed to build the sparse cone.");
+    validate(write_sparse_cone(&cone), "Failed to write the sparse-checkout patterns.");
+
+    validate(set_config_value("core.sparseCheckout", "true"), "Failed to update config.");
+    validate(set_config_value("core.sparseCheckoutCone", "true"), "Failed to update config.");
+    validate(set_config_value("index.sparse", sparse_index_opt ? "true" : "false"), "Failed to update config.");
+
+    release_sparse_cone(&cone);
+
+    return update_sparse_checkout();
+
+error:
+    release_sparse_cone(&cone);
+
+    return false;
+}
+
+static bool list_sparse_checkout(void)
+{
+    sparse_cone cone = { };
+
+    validate(load_sparse_cone(&cone), "Failed to read the sparse-checkout patterns.");
+    validate(cone.is_enabled, "This worktree is not sparse.");
+
+    for (size_t i = 0; i < cone.recursive_count; i++) printf("%s\n", cone.recursive[i]);
+
+    release_sparse_cone(&cone);
+
+    return true;
+
+error:
+    release_sparse_cone(&cone);
+
+    return false;
+}
+
+static bool disable_sparse_checkout(void)
+{
+    validate(set_config_value("core.sparseCheckout", "false"), "Failed to update config.");
+
+    return update_sparse_checkout();
+
+error:
+    return false;
+}
+
+// sparse-checkout set [--[no-]sparse-index] <dir>...
+// sparse-checkout list
+// sparse-checkout disable
+// Cone mode only: the worktree holds the files at the top level, everything
+// below the given directories, and the files directly inside their
+// ancestors. Other subtrees stay in the index without being checked out.
+int sparse_checkout(const int argc, char *argv[])
+{
+    validate(try_resolve_sparse_checkout_opts(argc, argv), "Failed to resolve options.");
+
+    const char *subcommand = argv[optind + 1];
+    char *const *args = &argv[optind + 2];
+    const size_t arg_count = argc - optind - 2;
+
+    if (strcmp(subcommand, "set") == 0)
+    {
+        validate(set_sparse_checkout(args, arg_count), "Failed to set the sparse-checkout patterns.");
+    }
+    else if (strcmp(subcommand, "list") == 0)
+    {
+        validate(list_sparse_checkout(), "Failed to list the sparse-checkout patterns.");
+    }
+    else if (strcmp(subcommand, "disable") == 0)
+    {
+        validate(disable_sparse_checkout(), "Failed to disable sparse checkout.");
+    }
+    else
+    {
+        validate(false, "Unknown subcommand '%s'.", subcommand);
+    }
+
+    return 0;
+
+error:
+    return 1;
+}
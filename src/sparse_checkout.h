@@ -0,0 +1,6 @@
+#ifndef SPARSE_CHECKOUT_H
+#define SPARSE_CHECKOUT_H
+
+int sparse_checkout(int argc, char *argv[]);
+
+#endif //SPARSE_CHECKOUT_H
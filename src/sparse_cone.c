@@ -0,0 +1,359 @@
+#include "sparse_cone.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "odb_transaction.h"
+
+typedef struct dir_set
+{
+    char **dirs;
+    size_t count;
+    size_t capacity;
+} dir_set;
+
+static bool add_to_dir_set(dir_set *set, const char *dir, const size_t len)
+{
+    if (set->count == set->capacity)
+    {
+        const size_t capacity = set->capacity ? set->capacity * 2 : 16;
+
+        char **dirs = realloc(set->dirs, capacity * sizeof(char *));
+        validate(dirs, "Failed to allocate memory.");
+
+        set->dirs = dirs;
+        set->capacity = capacity;
+    }
+
+    set->dirs[set->count] = strndup(dir, len);
+    validate(set->dirs[set->count], "Failed to allocate memory.");
+    set->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_dir_set(dir_set *set)
+{
+    for (size_t i = 0; i < set->count; i++) free(set->dirs[i]);
+    if (set->dirs) free(set->dirs);
+
+    *set = (dir_set){ };
+}
+
+static int compare_dirs(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void sort_dir_set(dir_set *set)
+{
+    qsort(set->dirs, set->count, sizeof(char *), compare_dirs);
+
+    size_t unique_count = 0;
+
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (unique_count && strcmp(set->dirs[unique_count - 1], set->dirs[i]) == 0)
+        {
+            free(set->dirs[i]);
+            continue;
+        }
+
+        set->dirs[unique_count++] = set->dirs[i];
+    }
+
+    set->count = unique_count;
+}
+
+static bool contains_dir(char *const *dirs, const size_t count, const char *dir)
+{
+    return count && bsearch(&dir, dirs, count, sizeof(char *), compare_dirs);
+}
+
+// Whether dir, or one of the directories above it, is in dirs
+static bool contains_dir_or_ancestor(char *const *dirs, const size_t count, const char *dir, const size_t dir_len)
+{
+    char prefix[PATH_MAX];
+    if (dir_len >= PATH_MAX) return false;
+
+    memcpy(prefix, dir, dir_len);
+    prefix[dir_len] = '\0';
+
+    for (size_t len = 1; len <= dir_len; len++)
+    {
+        if (len < dir_len && dir[len] != '/') continue;
+
+        prefix[len] = '\0';
+        const bool is_found = contains_dir(dirs, count, prefix);
+        if (len < dir_len) prefix[len] = '/';
+
+        if (is_found) return true;
+    }
+
+    return false;
+}
+
+bool init_sparse_cone(sparse_cone *cone, char *const *dirs, const size_t count)
+{
+    dir_set recursive = { };
+    dir_set parents = { };
+    *cone = (sparse_cone){ };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *dir = dirs[i];
+        while (*dir == '/') dir++;
+
+        size_t len = strlen(dir);
+        while (len > 0 && dir[len - 1] == '/') len--;
+
+        if (len) validate(add_to_dir_set(&recursive, dir, len), "Failed to add directory.");
+    }
+
+    sort_dir_set(&recursive);
+
+    // A directory inside another one adds nothing to it
+    size_t kept_count = 0;
+
+    for (size_t i = 0; i < recursive.count; i++)
+    {
+        const char *dir = recursive.dirs[i];
+        const char *slash = strrchr(dir, '/');
+
+        if (slash && contains_dir_or_ancestor(recursive.dirs, kept_count, dir, slash - dir))
+        {
+            free(recursive.dirs[i]);
+            continue;
+        }
+
+        recursive.dirs[kept_count++] = recursive.dirs[i];
+    }
+
+    recursive.count = kept_count;
+
+    for (size_t i = 0; i < recursive.count; i++)
+    {
+        const char *dir = recursive.dirs[i];
+
+        for (const char *slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+            validate(add_to_dir_set(&parents, dir, slash - dir), "Failed to add directory.");
+        }
+    }
+
+    sort_dir_set(&parents);
+
+    *cone = (sparse_cone){
+        .is_enabled = true,
+        .recursive = recursive.dirs,
+        .recursive_count = recursive.count,
+        .parents = parents.dirs,
+        .parent_count = parents.count,
+    };
+
+    return true;
+
+error:
+    release_dir_set(&recursive);
+    release_dir_set(&parents);
+
+    return false;
+}
+
+void release_sparse_cone(sparse_cone *cone)
+{
+    for (size_t i = 0; i < cone->recursive_count; i++) free(cone->recursive[i]);
+    if (cone->recursive) free(cone->recursive);
+
+    for (size_t i = 0; i < cone->parent_count; i++) free(cone->parents[i]);
+    if (cone->parents) free(cone->parents);
+
+    *cone = (sparse_cone){ };
+}
+
+static void unescape_pattern(char *pattern)
+{
+    char *dest = pattern;
+
+    for (const char *c = pattern; *c; c++)
+    {
+        if (*c == '\\' && c[1]) c++;
+        *dest++ = *c;
+    }
+
+    *dest = '\0';
+}
+
+// Cone patterns come as "/*", "!/*/", then "/dir/" for each directory,
+// followed by "!/dir/*/" when only the files directly inside are wanted.
+// Which directories are parents follows from the recursive ones, so only
+// those are kept.
+bool load_sparse_cone(sparse_cone *cone)
+{
+    FILE *patterns_file = nullptr;
+    dir_set dirs = { };
+    dir_set parents = { };
+    *cone = (sparse_cone){ };
+
+    if (!get_config_bool("core.sparseCheckout", false) || !get_config_bool("core.sparseCheckoutCone", false))
+    {
+        return true;
+    }
+
+    char patterns_path[PATH_MAX];
+    validate(get_git_path(patterns_path, PATH_MAX, "info/sparse-checkout"), "Not a git repository.");
+
+    patterns_file = fopen(patterns_path, "r");
+    if (!patterns_file) return init_sparse_cone(cone, nullptr, 0);
+
+    char line[PATH_MAX + 8];
+
+    while (fgets(line, sizeof(line), patterns_file))
+    {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+
+        if (len == 0 || line[0] == '#') continue;
+        if (strcmp(line, "/*") == 0 || strcmp(line, "!/*/") == 0) continue;
+
+        const bool is_parent = line[0] == '!';
+        char *pattern = is_parent ? &line[1] : line;
+        len = strlen(pattern);
+
+        if (is_parent)
+        {
+            validate(len > 4 && strcmp(&pattern[len - 3], "/*/") == 0, "Not a cone pattern: '%s'.", line);
+            len -= 2;
+        }
+
+        validate(pattern[0] == '/' && len > 2 && pattern[len - 1] == '/', "Not a cone pattern: '%s'.", line);
+        pattern[len - 1] = '\0';
+        unescape_pattern(&pattern[1]);
+
+        validate(add_to_dir_set(is_parent ? &parents : &dirs, &pattern[1], strlen(&pattern[1])), "Failed to add directory.");
+    }
+
+    fclose(patterns_file);
+    patterns_file = nullptr;
+
+    sort_dir_set(&parents);
+
+    size_t recursive_count = 0;
+
+    for (size_t i = 0; i < dirs.count; i++)
+    {
+        if (contains_dir(parents.dirs, parents.count, dirs.dirs[i]))
+        {
+            free(dirs.dirs[i]);
+            continue;
+        }
+
+        dirs.dirs[recursive_count++] = dirs.dirs[i];
+    }
+
+    dirs.count = recursive_count;
+
+    validate(init_sparse_cone(cone, dirs.dirs, dirs.count), "Failed to build the sparse cone.");
+
+    release_dir_set(&dirs);
+    release_dir_set(&parents);
+
+    return true;
+
+error:
+    if (patterns_file) fclose(patterns_file);
+    release_dir_set(&dirs);
+    release_dir_set(&parents);
+
+    return false;
+}
+
+cone_match match_cone_dir(const sparse_cone *cone, const char *dir, const size_t dir_len)
+{
+    if (!cone->is_enabled) return CONE_RECURSIVE;
+    if (dir_len == 0) return CONE_PARENT;
+
+    if (contains_dir_or_ancestor(cone->recursive, cone->recursive_count, dir, dir_len)) return CONE_RECURSIVE;
+
+    char path[PATH_MAX];
+    if (dir_len >= PATH_MAX) return CONE_OUTSIDE;
+
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '\0';
+
+    return contains_dir(cone->parents, cone->parent_count, path) ? CONE_PARENT : CONE_OUTSIDE;
+}
+
+bool is_path_in_cone(const sparse_cone *cone, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return !slash || match_cone_dir(cone, path, slash - path) != CONE_OUTSIDE;
+}
+
+static void write_escaped_dir(FILE *file, const char *dir)
+{
+    fputc('/', file);
+
+    for (const char *c = dir; *c; c++)
+    {
+        if (strchr("*?[\\", *c)) fputc('\\', file);
+        fputc(*c, file);
+    }
+
+    fputc('/', file);
+}
+
+// Parents first, then recursive directories, each sorted, as git writes them
+bool write_sparse_cone(const sparse_cone *cone)
+{
+    char *content = nullptr;
+    size_t content_size = 0;
+
+    FILE *stream = open_memstream(&content, &content_size);
+    validate(stream, "Failed to open memory stream.");
+
+    fputs("/*\n!/*/\n", stream);
+
+    for (size_t i = 0; i < cone->parent_count; i++)
+    {
+        write_escaped_dir(stream, cone->parents[i]);
+        fputs("\n!", stream);
+        write_escaped_dir(stream, cone->parents[i]);
+        fputs("*/\n", stream);
+    }
+
+    for (size_t i = 0; i < cone->recursive_count; i++)
+    {
+        write_escaped_dir(stream, cone->recursive[i]);
+        fputc('\n', stream);
+    }
+
+    fclose(stream);
+
+    char info_path[PATH_MAX];
+    char patterns_path[PATH_MAX];
+    validate(get_git_path(info_path, PATH_MAX, "info"), "Not a git repository.");
+    validate(get_git_path(patterns_path, PATH_MAX, "info/sparse-checkout"), "Not a git repository.");
+
+    validate(dir_exists(info_path) || mkdir(info_path, 0777) == 0, "Failed to create '%s'.", info_path);
+    validate(replace_locked_file(patterns_path, (unsigned char *)content, content_size), "Failed to write '%s'.", patterns_path);
+
+    free(content);
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
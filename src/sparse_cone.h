@@ -0,0 +1,45 @@
+#ifndef SPARSE_CONE_H
+#define SPARSE_CONE_H
+
+#include <stddef.h>
+
+// Where a directory stands against the cone. Everything below a recursive
+// directory is checked out; a parent directory is an ancestor of one, of
+// which only the files directly inside are. Files at the top level are
+// always in the cone.
+typedef enum cone_match
+{
+    CONE_OUTSIDE,
+    CONE_PARENT,
+    CONE_RECURSIVE,
+} cone_match;
+
+// Cone-mode sparse-checkout patterns, as directory lists sorted by strcmp
+typedef struct sparse_cone
+{
+    bool is_enabled;
+    char **recursive;
+    size_t recursive_count;
+    char **parents;
+    size_t parent_count;
+} sparse_cone;
+
+// Loads .git/info/sparse-checkout when core.sparseCheckout and
+// core.sparseCheckoutCone are set; otherwise the cone is left disabled and
+// takes in everything
+bool load_sparse_cone(sparse_cone *cone);
+
+// Builds the cone of the given directories, adding their ancestors as parents
+bool init_sparse_cone(sparse_cone *cone, char *const *dirs, size_t count);
+
+void release_sparse_cone(sparse_cone *cone);
+
+// dir is a slash-separated path without a trailing slash; "" is the root
+cone_match match_cone_dir(const sparse_cone *cone, const char *dir, size_t dir_len);
+
+bool is_path_in_cone(const sparse_cone *cone, const char *path);
+
+// Writes the patterns in git's cone format to .git/info/sparse-checkout
+bool write_sparse_cone(const sparse_cone *cone);
+
+#endif //SPARSE_CONE_H
@@ -0,0 +1,111 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define MAX_WORKERS 256
+
+typedef struct parallel_job
+{
+    size_t count;
+    atomic_size_t next;
+    parallel_task task;
+    void *ctx;
+} parallel_job;
+
+unsigned get_worker_count(const char *config_key)
+{
+    long workers = config_key ? get_config_long(config_key, 0) : 0;
+
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    return (unsigned)workers;
+}
+
+static void *run_worker(void *arg)
+{
+    parallel_job *job = arg;
+
+    size_t index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->count)
+    {
+        job->task(job->ctx, index);
+    }
+
+    return nullptr;
+}
+
+// Runs task(ctx, i) for every i in [0, count). Items are handed out one at a
+// time, so slow items do not hold up a whole slice of the range.
+void run_parallel(const size_t count, unsigned workers, const parallel_task task, void *ctx)
+{
+    parallel_job job = {
+        .count = count,
+        .task = task,
+        .ctx = ctx,
+    };
+    atomic_init(&job.next, 0);
+
+    if (workers > count) workers = (unsigned)count;
+
+    pthread_t threads[MAX_WORKERS];
+    unsigned started = 0;
+
+    // The calling thread is one of the workers
+    while (started + 1 < workers)
+    {
+        if (pthread_create(&threads[started], nullptr, run_worker, &job) != 0) break;
+        started++;
+    }
+
+    (void)run_worker(&job);
+
+    for (unsigned i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+void init_byte_budget(byte_budget *budget, const size_t limit)
+{
+    pthread_mutex_init(&budget->lock, nullptr);
+    pthread_cond_init(&budget->released, nullptr);
+    budget->limit = limit;
+    budget->used = 0;
+}
+
+void acquire_bytes(byte_budget *budget, const size_t size)
+{
+    pthread_mutex_lock(&budget->lock);
+
+    while (budget->used > 0 && budget->used + size > budget->limit)
+    {
+        pthread_cond_wait(&budget->released, &budget->lock);
+    }
+
+    budget->used += size;
+
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void release_bytes(byte_budget *budget, const size_t size)
+{
+    pthread_mutex_lock(&budget->lock);
+
+    budget->used -= size;
+    pthread_cond_broadcast(&budget->released);
+
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void destroy_byte_budget(byte_budget *budget)
+{
+    pthread_cond_destroy(&budget->released);
+    pthread_mutex_destroy(&budget->lock);
+}
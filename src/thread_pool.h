@@ -0,0 +1,32 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*parallel_task)(void *ctx, size_t index);
+
+unsigned get_worker_count(const char *config_key);
+
+void run_parallel(size_t count, unsigned workers, parallel_task task, void *ctx);
+
+// Caps the bytes workers hold at once, e.g. inflated objects not yet
+// written out. A request larger than the whole budget still goes through
+// once nothing else is held, so one huge item cannot stall the pool.
+typedef struct byte_budget
+{
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    size_t limit;
+    size_t used;
+} byte_budget;
+
+void init_byte_budget(byte_budget *budget, size_t limit);
+
+void acquire_bytes(byte_budget *budget, size_t size);
+
+void release_bytes(byte_budget *budget, size_t size);
+
+void destroy_byte_budget(byte_budget *budget);
+
+#endif //THREAD_POOL_H
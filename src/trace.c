@@ -0,0 +1,430 @@
+#include "trace.h"
+
+#ifndef NO_TRACE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TRACE_ENV "GIT_TRACE2_EVENT"
+#define TRACE_PARENT_SID_ENV "GIT_TRACE2_PARENT_SID"
+#define TRACE_EVENT_VERSION "3"
+#define MAX_REGION_NESTING 32
+#define SID_SIZE 256
+
+typedef struct trace_name
+{
+    const char *category;
+    const char *name;
+} trace_name;
+
+static const trace_name counter_names[TRACE_COUNTER_COUNT] = {
+    [TRACE_COUNTER_OBJECTS_READ] = { "odb", "objects_read" },
+    [TRACE_COUNTER_OBJECTS_WRITTEN] = { "odb", "objects_written" },
+    [TRACE_COUNTER_BYTES_IN] = { "odb", "bytes_in" },
+    [TRACE_COUNTER_BYTES_OUT] = { "odb", "bytes_out" },
+    [TRACE_COUNTER_SYSCALLS] = { "fs", "syscalls" },
+    [TRACE_COUNTER_CACHE_HITS] = { "odb", "cache_hits" },
+};
+
+static const trace_name timer_names[TRACE_TIMER_COUNT] = {
+    [TRACE_TIMER_INFLATE] = { "zlib", "inflate" },
+    [TRACE_TIMER_DEFLATE] = { "zlib", "deflate" },
+    [TRACE_TIMER_HASH] = { "sha1", "hash" },
+};
+
+typedef struct trace_event
+{
+    FILE *stream;
+    char *data;
+    size_t size;
+} trace_event;
+
+typedef struct timer_summary
+{
+    uint64_t intervals;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} timer_summary;
+
+bool trace_is_enabled = false;
+
+static int trace_fd = -1;
+static bool is_trace_fd_owned = false;
+
+static char sid[SID_SIZE];
+static uint64_t start_ns;
+
+static atomic_uint_fast64_t counters[TRACE_COUNTER_COUNT];
+
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer_summary timers[TRACE_TIMER_COUNT];
+
+static atomic_uint next_thread_number = 1;
+
+static _Thread_local char thread_name[16];
+static _Thread_local uint64_t region_starts[MAX_REGION_NESTING];
+static _Thread_local int region_depth;
+static _Thread_local uint64_t timer_starts[TRACE_TIMER_COUNT];
+static _Thread_local int timer_depths[TRACE_TIMER_COUNT];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static double elapsed_seconds(const uint64_t since_ns)
+{
+    return (double)(now_ns() - since_ns) / 1e9;
+}
+
+static const char *get_thread_name(void)
+{
+    if (!thread_name[0])
+    {
+        (void)snprintf(thread_name, sizeof(thread_name), "th%02u", atomic_fetch_add(&next_thread_number, 1));
+    }
+
+    return thread_name;
+}
+
+// UTC in microseconds, e.g. 2024-01-31T12:34:56.123456Z, or the compact
+// form sids start with
+static void format_utc_time(char *out, const size_t out_size, const bool is_compact)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct tm tm;
+    (void)gmtime_r(&ts.tv_sec, &tm);
+
+    char date[32];
+    (void)strftime(date, sizeof(date), is_compact ? "%Y%m%dT%H%M%S" : "%Y-%m-%dT%H:%M:%S", &tm);
+
+    (void)snprintf(out, out_size, "%s.%06ldZ", date, ts.tv_nsec / 1000);
+}
+
+static void write_json_string(FILE *stream, const char *value)
+{
+    fputc('"', stream);
+
+    for (const unsigned char *c = (const unsigned char *)value; *c; c++)
+    {
+        switch (*c)
+        {
+            case '"':
+                fputs("\\\"", stream);
+                break;
+            case '\\':
+                fputs("\\\\", stream);
+                break;
+            case '\n':
+                fputs("\\n", stream);
+                break;
+            case '\t':
+                fputs("\\t", stream);
+                break;
+            default:
+                if (*c < 0x20) fprintf(stream, "\\u%04x", *c);
+                else fputc(*c, stream);
+        }
+    }
+
+    fputc('"', stream);
+}
+
+static const char *get_base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? &slash[1] : path;
+}
+
+// The fields every event starts with
+static bool begin_event(trace_event *event, const char *name, const char *file, const int line)
+{
+    event->data = nullptr;
+    event->size = 0;
+    event->stream = open_memstream(&event->data, &event->size);
+    if (!event->stream) return false;
+
+    char time[40];
+    format_utc_time(time, sizeof(time), false);
+
+    fprintf(event->stream, "{\"event\":\"%s\",\"sid\":", name);
+    write_json_string(event->stream, sid);
+    fprintf(event->stream, ",\"thread\":\"%s\",\"time\":\"%s\"", get_thread_name(), time);
+
+    if (file)
+    {
+        fputs(",\"file\":", event->stream);
+        write_json_string(event->stream, get_base_name(file));
+        fprintf(event->stream, ",\"line\":%d", line);
+    }
+
+    return true;
+}
+
+// Each event goes out in a single write, so lines from threads and from
+// processes sharing the target never interleave
+static void end_event(trace_event *event)
+{
+    fputs("}\n", event->stream);
+    fclose(event->stream);
+
+    const char *pos = event->data;
+    size_t left = event->size;
+
+    while (left > 0)
+    {
+        const ssize_t written = write(trace_fd, pos, left);
+        if (written <= 0) break;
+
+        pos += written;
+        left -= written;
+    }
+
+    free(event->data);
+}
+
+// Category and name, the fields counter and timer events identify by
+static void write_trace_name(FILE *stream, const trace_name *name)
+{
+    fputs(",\"category\":", stream);
+    write_json_string(stream, name->category);
+    fputs(",\"name\":", stream);
+    write_json_string(stream, name->name);
+}
+
+static bool open_trace_target(const char *target)
+{
+    if (strcmp(target, "1") == 0 || strcasecmp(target, "true") == 0)
+    {
+        trace_fd = STDERR_FILENO;
+        return true;
+    }
+
+    if (target[0] >= '2' && target[0] <= '9' && target[1] == '\0')
+    {
+        trace_fd = target[0] - '0';
+        return true;
+    }
+
+    if (target[0] != '/') return false;
+
+    struct stat fs;
+    char path[PATH_MAX];
+
+    if (stat(target, &fs) == 0 && S_ISDIR(fs.st_mode))
+    {
+        // The sid may name a parent process, only its last part is ours
+        const char *own_sid = strrchr(sid, '/');
+        if (snprintf(path, PATH_MAX, "%s/%s", target, own_sid ? &own_sid[1] : sid) >= PATH_MAX) return false;
+    }
+    else if (snprintf(path, PATH_MAX, "%s", target) >= PATH_MAX)
+    {
+        return false;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    is_trace_fd_owned = trace_fd != -1;
+
+    return is_trace_fd_owned;
+}
+
+// "<parent sid>/<time>-P<pid>", exported so child processes nest under ours
+static void init_sid(void)
+{
+    char time[40];
+    format_utc_time(time, sizeof(time), true);
+
+    const char *parent_sid = getenv(TRACE_PARENT_SID_ENV);
+
+    if (parent_sid && parent_sid[0])
+    {
+        (void)snprintf(sid, SID_SIZE, "%s/%s-P%08x", parent_sid, time, (unsigned)getpid());
+    }
+    else
+    {
+        (void)snprintf(sid, SID_SIZE, "%s-P%08x", time, (unsigned)getpid());
+    }
+
+    (void)setenv(TRACE_PARENT_SID_ENV, sid, 1);
+}
+
+void trace_start(const int argc, char *argv[])
+{
+    const char *target = getenv(TRACE_ENV);
+    if (!target || !target[0] || strcmp(target, "0") == 0 || strcasecmp(target, "false") == 0) return;
+
+    start_ns = now_ns();
+    (void)snprintf(thread_name, sizeof(thread_name), "main");
+    init_sid();
+
+    if (!open_trace_target(target))
+    {
+        fprintf(stderr, "warning: cannot open trace target '%s' from %s\n", target, TRACE_ENV);
+        return;
+    }
+
+    trace_is_enabled = true;
+
+    trace_event event;
+
+    if (begin_event(&event, "version", __FILE__, __LINE__))
+    {
+        fputs(",\"evt\":\"" TRACE_EVENT_VERSION "\",\"exe\":\"codecrafters-git\"", event.stream);
+        end_event(&event);
+    }
+
+    if (begin_event(&event, "start", __FILE__, __LINE__))
+    {
+        fprintf(event.stream, ",\"t_abs\":%.6f,\"argv\":[", elapsed_seconds(start_ns));
+
+        for (int i = 0; i < argc; i++)
+        {
+            if (i > 0) fputc(',', event.stream);
+            write_json_string(event.stream, argv[i]);
+        }
+
+        fputc(']', event.stream);
+        end_event(&event);
+    }
+
+    if (argc > 1 && begin_event(&event, "cmd_name", __FILE__, __LINE__))
+    {
+        fputs(",\"name\":", event.stream);
+        write_json_string(event.stream, argv[1]);
+        fputs(",\"hierarchy\":", event.stream);
+        write_json_string(event.stream, argv[1]);
+        end_event(&event);
+    }
+}
+
+int trace_exit(const int code)
+{
+    if (!trace_is_enabled) return code;
+
+    trace_event event;
+
+    pthread_mutex_lock(&timers_lock);
+
+    for (size_t i = 0; i < TRACE_TIMER_COUNT; i++)
+    {
+        const timer_summary *timer = &timers[i];
+        if (timer->intervals == 0 || !begin_event(&event, "timer", nullptr, 0)) continue;
+
+        write_trace_name(event.stream, &timer_names[i]);
+        fprintf(
+            event.stream,
+            ",\"intervals\":%lu,\"t_total\":%.6f,\"t_min\":%.6f,\"t_max\":%.6f",
+            (unsigned long)timer->intervals,
+            (double)timer->total_ns / 1e9,
+            (double)timer->min_ns / 1e9,
+            (double)timer->max_ns / 1e9);
+        end_event(&event);
+    }
+
+    pthread_mutex_unlock(&timers_lock);
+
+    for (size_t i = 0; i < TRACE_COUNTER_COUNT; i++)
+    {
+        if (!begin_event(&event, "counter", nullptr, 0)) continue;
+
+        write_trace_name(event.stream, &counter_names[i]);
+        fprintf(event.stream, ",\"count\":%lu", (unsigned long)atomic_load_explicit(&counters[i], memory_order_relaxed));
+        end_event(&event);
+    }
+
+    if (begin_event(&event, "exit", __FILE__, __LINE__))
+    {
+        fprintf(event.stream, ",\"t_abs\":%.6f,\"code\":%d", elapsed_seconds(start_ns), code);
+        end_event(&event);
+    }
+
+    trace_is_enabled = false;
+    if (is_trace_fd_owned) (void)close(trace_fd);
+
+    return code;
+}
+
+static void write_region_event(
+    const char *name,
+    const char *file,
+    const int line,
+    const double *t_rel,
+    const char *category,
+    const char *label)
+{
+    trace_event event;
+    if (!begin_event(&event, name, file, line)) return;
+
+    if (t_rel) fprintf(event.stream, ",\"t_rel\":%.6f", *t_rel);
+
+    fprintf(event.stream, ",\"nesting\":%d,\"category\":", region_depth + 1);
+    write_json_string(event.stream, category);
+    fputs(",\"label\":", event.stream);
+    write_json_string(event.stream, label);
+    end_event(&event);
+}
+
+void trace_region_enter_at(const char *file, const int line, const char *category, const char *label)
+{
+    write_region_event("region_enter", file, line, nullptr, category, label);
+
+    if (region_depth < MAX_REGION_NESTING) region_starts[region_depth] = now_ns();
+    region_depth++;
+}
+
+void trace_region_leave_at(const char *file, const int line, const char *category, const char *label)
+{
+    if (region_depth == 0) return;
+
+    region_depth--;
+    const double t_rel = region_depth < MAX_REGION_NESTING ? elapsed_seconds(region_starts[region_depth]) : 0;
+
+    write_region_event("region_leave", file, line, &t_rel, category, label);
+}
+
+void trace_timer_start_at(const trace_timer timer)
+{
+    if (timer_depths[timer]++ == 0) timer_starts[timer] = now_ns();
+}
+
+void trace_timer_stop_at(const trace_timer timer)
+{
+    // A timer started before tracing was enabled has nothing to stop
+    if (timer_depths[timer] == 0 || --timer_depths[timer] > 0) return;
+
+    const uint64_t elapsed = now_ns() - timer_starts[timer];
+
+    pthread_mutex_lock(&timers_lock);
+
+    timer_summary *summary = &timers[timer];
+
+    if (summary->intervals == 0 || elapsed < summary->min_ns) summary->min_ns = elapsed;
+    if (elapsed > summary->max_ns) summary->max_ns = elapsed;
+
+    summary->total_ns += elapsed;
+    summary->intervals++;
+
+    pthread_mutex_unlock(&timers_lock);
+}
+
+void trace_counter_add_to(const trace_counter counter, const uint64_t value)
+{
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+#endif
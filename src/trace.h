@@ -0,0 +1,92 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Events in git's trace2 event format, one JSON object per line. Tracing
+// is enabled by GIT_TRACE2_EVENT: "1" or "true" for stderr, a file
+// descriptor number from 2 to 9, or an absolute path to append to (a
+// directory gets one file per process). Building with NO_TRACE compiles
+// every call site out; otherwise a call site costs one branch on
+// trace_is_enabled while tracing is off.
+
+typedef enum trace_counter
+{
+    TRACE_COUNTER_OBJECTS_READ,
+    TRACE_COUNTER_OBJECTS_WRITTEN,
+
+    // Compressed bytes read from and written to the object store
+    TRACE_COUNTER_BYTES_IN,
+    TRACE_COUNTER_BYTES_OUT,
+
+    // Filesystem calls made directly by the object store and the working
+    // tree scan, counted where they are issued; reads and writes buffered
+    // by stdio are not included
+    TRACE_COUNTER_SYSCALLS,
+
+    // Lookups answered without touching the object store or the working tree
+    TRACE_COUNTER_CACHE_HITS,
+
+    TRACE_COUNTER_COUNT
+} trace_counter;
+
+// Timers aggregate many short intervals into one event at exit, for code
+// too hot to get a region event per call. A timer does not nest with itself:
+// only its outermost interval on a thread is measured.
+typedef enum trace_timer
+{
+    TRACE_TIMER_INFLATE,
+    TRACE_TIMER_DEFLATE,
+    TRACE_TIMER_HASH,
+
+    TRACE_TIMER_COUNT
+} trace_timer;
+
+#ifdef NO_TRACE
+
+#define trace_start(argc, argv) ((void)0)
+#define trace_exit(code) (code)
+#define trace_region_enter(category, label) ((void)0)
+#define trace_region_leave(category, label) ((void)0)
+#define trace_timer_start(timer) ((void)0)
+#define trace_timer_stop(timer) ((void)0)
+#define trace_counter_add(counter, value) ((void)0)
+
+#else
+
+extern bool trace_is_enabled;
+
+#define trace_region_enter(category, label) \
+    do { if (__builtin_expect(trace_is_enabled, 0)) trace_region_enter_at(__FILE__, __LINE__, category, label); } while (0)
+
+#define trace_region_leave(category, label) \
+    do { if (__builtin_expect(trace_is_enabled, 0)) trace_region_leave_at(__FILE__, __LINE__, category, label); } while (0)
+
+#define trace_timer_start(timer) \
+    do { if (__builtin_expect(trace_is_enabled, 0)) trace_timer_start_at(timer); } while (0)
+
+#define trace_timer_stop(timer) \
+    do { if (__builtin_expect(trace_is_enabled, 0)) trace_timer_stop_at(timer); } while (0)
+
+#define trace_counter_add(counter, value) \
+    do { if (__builtin_expect(trace_is_enabled, 0)) trace_counter_add_to(counter, value); } while (0)
+
+// Reads GIT_TRACE2_EVENT and, when tracing, emits the version, start and
+// cmd_name events
+void trace_start(int argc, char *argv[]);
+
+// Emits the timer and counter summaries and the exit event, and returns code
+int trace_exit(int code);
+
+// Regions nest per thread; each leave reports the time since its enter
+void trace_region_enter_at(const char *file, int line, const char *category, const char *label);
+void trace_region_leave_at(const char *file, int line, const char *category, const char *label);
+
+void trace_timer_start_at(trace_timer timer);
+void trace_timer_stop_at(trace_timer timer);
+
+void trace_counter_add_to(trace_counter counter, uint64_t value);
+
+#endif
+
+#endif //TRACE_H
@@ -0,0 +1,335 @@
+#include "transport.h"
+
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "debug_helpers.h"
+
+#define HTTP_SCHEME "http://"
+#define FILE_SCHEME "file://"
+#define UPLOAD_PACK_SERVICE "git-upload-pack"
+
+static bool parse_http_url(transport *remote, const char *url)
+{
+    const char *host = &url[strlen(HTTP_SCHEME)];
+    const size_t host_len = strcspn(host, ":/");
+    validate(host_len && host_len < sizeof(remote->host), "Invalid URL '%s'.", url);
+
+    memcpy(remote->host, host, host_len);
+    remote->host[host_len] = '\0';
+
+    const char *rest = &host[host_len];
+    (void)snprintf(remote->port, sizeof(remote->port), "80");
+
+    if (*rest == ':')
+    {
+        const size_t port_len = strcspn(++rest, "/");
+        validate(port_len && port_len < sizeof(remote->port), "Invalid port in '%s'.", url);
+
+        memcpy(remote->port, rest, port_len);
+        remote->port[port_len] = '\0';
+        rest += port_len;
+    }
+
+    size_t path_len = strlen(rest);
+    while (path_len && rest[path_len - 1] == '/') path_len--;
+    validate(path_len < sizeof(remote->path), "URL too long '%s'.", url);
+
+    memcpy(remote->path, rest, path_len);
+    remote->path[path_len] = '\0';
+
+    return true;
+
+error:
+    return false;
+}
+
+static int connect_to_server(const transport *remote)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addresses = nullptr;
+
+    const int result = getaddrinfo(remote->host, remote->port, &hints, &addresses);
+    validate(result == 0, "Failed to resolve '%s': %s", remote->host, gai_strerror(result));
+
+    int fd = -1;
+
+    for (const struct addrinfo *address = addresses; address && fd == -1; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd == -1) continue;
+
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+    validate(fd != -1, "Failed to connect to %s:%s.", remote->host, remote->port);
+
+    return fd;
+
+error:
+    return -1;
+}
+
+// One connection per request, closed by the server once it has answered,
+// which marks the end of the body. Requests are HTTP/1.0 so that the body
+// does not come chunked.
+static bool send_http_request(
+    transport *remote,
+    const char *method,
+    const char *target,
+    const char *content_type,
+    const char *body,
+    const size_t body_size)
+{
+    char *request = nullptr;
+    size_t request_size = 0;
+
+    if (remote->reader.fd != -1) close(remote->reader.fd);
+    init_pkt_reader(&remote->reader, connect_to_server(remote));
+    validate(remote->reader.fd != -1, "Failed to connect.");
+
+    FILE *stream = open_memstream(&request, &request_size);
+    validate(stream, "Failed to open memory stream.");
+
+    fprintf(stream, "%s %s%s HTTP/1.0\r\n", method, remote->path, target);
+    fprintf(stream, "Host: %s:%s\r\n", remote->host, remote->port);
+    fprintf(stream, "User-Agent: %s\r\n", GIT_AGENT);
+    fprintf(stream, "Git-Protocol: version=2\r\n");
+
+    if (content_type)
+    {
+        fprintf(stream, "Content-Type: application/x-%s-request\r\n", content_type);
+        fprintf(stream, "Accept: application/x-%s-result\r\n", content_type);
+        fprintf(stream, "Content-Length: %zu\r\n", body_size);
+    }
+
+    fprintf(stream, "\r\n");
+    fclose(stream);
+
+    validate(write_all(remote->reader.fd, request, request_size), "Failed to send request.");
+    if (body_size) validate(write_all(remote->reader.fd, body, body_size), "Failed to send request.");
+
+    free(request);
+    request = nullptr;
+
+    validate(read_raw_line(&remote->reader), "Failed to read response.");
+
+    int status = 0;
+    validate(sscanf(remote->reader.line, "HTTP/%*d.%*d %d", &status) == 1, "Malformed response '%s'.", remote->reader.line);
+    validate(status == 200, "Request for %s%s failed: %s", remote->path, target, remote->reader.line);
+
+    do
+    {
+        validate(read_raw_line(&remote->reader), "Failed to read response headers.");
+
+        const char *line = remote->reader.line;
+        validate(strncasecmp(line, "Transfer-Encoding:", 18) != 0, "Chunked responses are not supported.");
+    } while (remote->reader.line_len);
+
+    return true;
+
+error:
+    if (request) free(request);
+
+    return false;
+}
+
+static bool spawn_upload_pack(transport *remote, const char *path, const char *upload_pack_command)
+{
+    int to_child[2] = { -1, -1 };
+    int from_child[2] = { -1, -1 };
+
+    validate(pipe(to_child) == 0 && pipe(from_child) == 0, "Failed to create pipes.");
+
+    remote->pid = fork();
+    validate(remote->pid != -1, "Failed to start upload-pack.");
+
+    if (remote->pid == 0)
+    {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+
+        setenv("GIT_PROTOCOL", "version=2", 1);
+
+        if (upload_pack_command)
+        {
+            char command[PATH_MAX * 2];
+            (void)snprintf(command, sizeof(command), "%s '%s'", upload_pack_command, path);
+            execl("/bin/sh", "sh", "-c", command, (char *)nullptr);
+        }
+        else
+        {
+            execl("/proc/self/exe", "git", "upload-pack", path, (char *)nullptr);
+        }
+
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+
+    remote->to_remote = to_child[1];
+    init_pkt_reader(&remote->reader, from_child[0]);
+
+    // A server that goes away must fail our writes, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    return true;
+
+error:
+    for (int i = 0; i < 2; i++)
+    {
+        if (to_child[i] != -1) close(to_child[i]);
+        if (from_child[i] != -1) close(from_child[i]);
+    }
+
+    return false;
+}
+
+// Smart HTTP servers may put a "# service=" announcement and a flush ahead
+// of the advertisement, the way protocol v0 starts
+static bool read_capabilities(transport *remote)
+{
+    pkt_reader *reader = &remote->reader;
+    size_t len = 0;
+
+    validate(read_pkt_data(reader), "Failed to read the capability advertisement.");
+
+    if (strncmp(reader->line, "# service=", 10) == 0)
+    {
+        pkt_type type;
+        validate(read_pkt_line(reader, &type) && type == PKT_FLUSH, "Malformed service announcement.");
+        validate(read_pkt_data(reader), "Failed to read the capability advertisement.");
+    }
+
+    validate(strcmp(reader->line, "version 2\n") == 0, "The server does not speak protocol v2: '%s'.", reader->line);
+
+    while (true)
+    {
+        pkt_type type;
+        validate(read_pkt_line(reader, &type), "Failed to read the capability advertisement.");
+
+        if (type == PKT_FLUSH) break;
+        validate(type == PKT_DATA, "Malformed capability advertisement.");
+
+        validate(len + reader->line_len + 1 < sizeof(remote->capabilities), "Capability advertisement too long.");
+        memcpy(&remote->capabilities[len], reader->line, reader->line_len);
+        len += reader->line_len;
+
+        if (remote->capabilities[len - 1] != '\n') remote->capabilities[len++] = '\n';
+    }
+
+    remote->capabilities[len] = '\0';
+
+    validate(transport_has_capability(remote, "ls-refs", nullptr), "The server does not support ls-refs.");
+    validate(transport_has_capability(remote, "fetch", nullptr), "The server does not support fetch.");
+
+    return true;
+
+error:
+    return false;
+}
+
+bool transport_connect(transport *remote, const char *url, const char *upload_pack_command)
+{
+    *remote = (transport){ .pid = -1, .to_remote = -1 };
+    init_pkt_reader(&remote->reader, -1);
+
+    if (strncmp(url, HTTP_SCHEME, strlen(HTTP_SCHEME)) == 0)
+    {
+        remote->is_http = true;
+
+        validate(parse_http_url(remote, url), "Invalid URL '%s'.", url);
+        validate(send_http_request(remote, "GET", "/info/refs?service=" UPLOAD_PACK_SERVICE, nullptr, nullptr, 0), "Failed to reach '%s'.", url);
+    }
+    else
+    {
+        validate(strstr(url, "://") == nullptr || strncmp(url, FILE_SCHEME, strlen(FILE_SCHEME)) == 0, "Unsupported URL '%s'.", url);
+
+        const char *path = strncmp(url, FILE_SCHEME, strlen(FILE_SCHEME)) == 0 ? &url[strlen(FILE_SCHEME)] : url;
+        validate(spawn_upload_pack(remote, path, upload_pack_command), "Failed to reach '%s'.", url);
+    }
+
+    validate(read_capabilities(remote), "Failed to read capabilities of '%s'.", url);
+
+    return true;
+
+error:
+    transport_disconnect(remote);
+
+    return false;
+}
+
+bool transport_has_capability(const transport *remote, const char *name, const char *feature)
+{
+    const size_t name_len = strlen(name);
+
+    for (const char *line = remote->capabilities; *line; line = &line[strcspn(line, "\n") + 1])
+    {
+        const size_t line_len = strcspn(line, "\n");
+        if (line_len < name_len || strncmp(line, name, name_len) != 0) continue;
+
+        if (line_len == name_len) return feature == nullptr;
+        if (line[name_len] != '=') continue;
+        if (!feature) return true;
+
+        const size_t feature_len = strlen(feature);
+        const char *value = &line[name_len + 1];
+        const char *end = &line[line_len];
+
+        while (value < end)
+        {
+            const size_t value_len = strcspn(value, " \n");
+            if (value_len == feature_len && strncmp(value, feature, feature_len) == 0) return true;
+
+            value += value_len + 1;
+        }
+    }
+
+    return false;
+}
+
+bool transport_send_request(transport *remote, const char *request, const size_t size)
+{
+    if (remote->is_http)
+    {
+        return send_http_request(remote, "POST", "/" UPLOAD_PACK_SERVICE, UPLOAD_PACK_SERVICE, request, size);
+    }
+
+    return write_all(remote->to_remote, request, size);
+}
+
+void transport_disconnect(transport *remote)
+{
+    if (remote->to_remote != -1)
+    {
+        (void)write_all(remote->to_remote, "0000", PKT_LENGTH_SIZE);
+        close(remote->to_remote);
+    }
+
+    if (remote->reader.fd != -1) close(remote->reader.fd);
+
+    if (remote->pid > 0)
+    {
+        int status;
+        while (waitpid(remote->pid, &status, 0) == -1 && errno == EINTR) { }
+    }
+
+    remote->to_remote = -1;
+    remote->reader.fd = -1;
+    remote->pid = -1;
+}
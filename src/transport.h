@@ -0,0 +1,50 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "pkt_line.h"
+
+#define TRANSPORT_CAPABILITIES_SIZE 4096
+
+// A protocol v2 connection to upload-pack: either a local process talking
+// over pipes, or a smart HTTP endpoint where every request is a POST of
+// its own. Responses are read through reader either way.
+typedef struct transport
+{
+    bool is_http;
+
+    // Local repositories: the child process and the pipe to its stdin
+    pid_t pid;
+    int to_remote;
+
+    // HTTP: where requests go; reader.fd is the socket of the last one
+    char host[256];
+    char port[16];
+    char path[PATH_MAX];
+
+    // The capability advertisement, one per line, without "version 2"
+    char capabilities[TRANSPORT_CAPABILITIES_SIZE];
+
+    pkt_reader reader;
+} transport;
+
+// url is http://host[:port]/path, file://path or a local path. Local
+// repositories are served by upload_pack_command, run through the shell
+// with the path appended, or by this program's own upload-pack when it is
+// nullptr. The capability advertisement is read before returning.
+bool transport_connect(transport *remote, const char *url, const char *upload_pack_command);
+
+// Whether the server advertised name, or name=value with feature among
+// the space-separated values (feature may be nullptr)
+bool transport_has_capability(const transport *remote, const char *name, const char *feature);
+
+// Sends one complete request; the response is then read from
+// remote->reader
+bool transport_send_request(transport *remote, const char *request, size_t size);
+
+void transport_disconnect(transport *remote);
+
+#endif //TRANSPORT_H
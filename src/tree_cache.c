@@ -0,0 +1,191 @@
+#include "tree_cache.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+
+#define TREE_CACHE_FILE "tree-cache"
+
+void init_tree_cache(tree_cache *cache)
+{
+    cache->token = nullptr;
+    cache->entries = nullptr;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+void destroy_tree_cache(tree_cache *cache)
+{
+    if (cache->token) free(cache->token);
+
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        free(cache->entries[i].path);
+    }
+
+    if (cache->entries) free(cache->entries);
+
+    init_tree_cache(cache);
+}
+
+static int compare_tree_cache_entries(const void *a, const void *b)
+{
+    return strcmp(((const tree_cache_entry *)a)->path, ((const tree_cache_entry *)b)->path);
+}
+
+bool add_tree_cache_entry(tree_cache *cache, const char *path, const char *hash_hex)
+{
+    if (cache->count == cache->capacity)
+    {
+        const size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+        tree_cache_entry *entries = realloc(cache->entries, capacity * sizeof(tree_cache_entry));
+        validate(entries, "Failed to allocate memory.");
+
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+
+    tree_cache_entry *entry = &cache->entries[cache->count];
+    entry->path = strdup(path);
+    validate(entry->path, "Failed to allocate memory.");
+
+    memcpy(entry->hash_hex, hash_hex, SHA_HEX_LENGTH);
+    entry->hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    cache->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+bool load_tree_cache(tree_cache *cache)
+{
+    FILE *cache_file = nullptr;
+
+    char cache_path[PATH_MAX];
+    validate(get_git_path(cache_path, PATH_MAX, TREE_CACHE_FILE), "Failed to resolve tree cache path.");
+
+    cache_file = fopen(cache_path, "r");
+    if (!cache_file) return false;
+
+    char line[PATH_MAX + SHA_HEX_LENGTH + 2];
+
+    if (!fgets(line, sizeof(line), cache_file) || strncmp(line, "token ", 6) != 0)
+    {
+        fclose(cache_file);
+        return false;
+    }
+
+    line[strcspn(line, "\n")] = '\0';
+    cache->token = strdup(&line[6]);
+    validate(cache->token, "Failed to allocate memory.");
+
+    while (fgets(line, sizeof(line), cache_file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strlen(line) < SHA_HEX_LENGTH + 1 || line[SHA_HEX_LENGTH] != ' ') continue;
+
+        validate(add_tree_cache_entry(cache, &line[SHA_HEX_LENGTH + 1], line), "Failed to read tree cache.");
+    }
+
+    fclose(cache_file);
+
+    return true;
+
+error:
+    if (cache_file) fclose(cache_file);
+    destroy_tree_cache(cache);
+
+    return false;
+}
+
+bool save_tree_cache(const tree_cache *cache, const char *token)
+{
+    char cache_path[PATH_MAX];
+    validate(get_git_path(cache_path, PATH_MAX, TREE_CACHE_FILE), "Failed to resolve tree cache path.");
+
+    char lock_path[PATH_MAX];
+    const int lock_path_len = snprintf(lock_path, PATH_MAX, "%s.lock", cache_path);
+    validate(lock_path_len < PATH_MAX, "Path too long '%s'.", cache_path);
+
+    qsort(cache->entries, cache->count, sizeof(tree_cache_entry), compare_tree_cache_entries);
+
+    FILE *lock_file = fopen(lock_path, "w");
+    validate(lock_file, "Failed to open '%s'.", lock_path);
+
+    fprintf(lock_file, "token %s\n", token);
+
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        fprintf(lock_file, "%s %s\n", cache->entries[i].hash_hex, cache->entries[i].path);
+    }
+
+    validate(fclose(lock_file) == 0, "Failed to write '%s'.", lock_path);
+    validate(rename(lock_path, cache_path) == 0, "Failed to update '%s'.", cache_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Index of the first entry whose path is not less than 'path'
+static size_t lower_bound(const tree_cache *cache, const char *path)
+{
+    size_t lo = 0;
+    size_t hi = cache->count;
+
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(cache->entries[mid].path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+const tree_cache_entry *find_tree_cache_entry(const tree_cache *cache, const char *path)
+{
+    const size_t i = lower_bound(cache, path);
+
+    if (i < cache->count && strcmp(cache->entries[i].path, path) == 0)
+    {
+        return &cache->entries[i];
+    }
+
+    return nullptr;
+}
+
+bool copy_tree_cache_subtree(tree_cache *dest, const tree_cache *src, const char *path)
+{
+    const tree_cache_entry *self = find_tree_cache_entry(src, path);
+    validate(self, "Tree cache has no entry for '%s'.", path);
+    validate(add_tree_cache_entry(dest, self->path, self->hash_hex), "Failed to copy tree cache entry.");
+
+    // Descendants share the "<path>/" prefix and therefore sit next to each other
+    char prefix[PATH_MAX];
+    const int prefix_len = snprintf(prefix, PATH_MAX, "%s/", path);
+
+    for (size_t i = lower_bound(src, prefix); i < src->count; i++)
+    {
+        if (strncmp(src->entries[i].path, prefix, prefix_len) != 0) break;
+
+        validate(
+            add_tree_cache_entry(dest, src->entries[i].path, src->entries[i].hash_hex),
+            "Failed to copy tree cache entry.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
@@ -0,0 +1,39 @@
+#ifndef TREE_CACHE_H
+#define TREE_CACHE_H
+
+#include <stddef.h>
+
+#include "git_obj_helpers.h"
+
+// Tree oids computed by the last write-tree, keyed by directory path relative
+// to the repository root (the root itself is ""). Entries are kept sorted by
+// path, so a directory and all of its descendants form a contiguous range.
+typedef struct tree_cache_entry
+{
+    char *path;
+    char hash_hex[SHA_HEX_LENGTH + 1];
+} tree_cache_entry;
+
+typedef struct tree_cache
+{
+    char *token;
+    tree_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+} tree_cache;
+
+void init_tree_cache(tree_cache *cache);
+
+void destroy_tree_cache(tree_cache *cache);
+
+bool load_tree_cache(tree_cache *cache);
+
+bool save_tree_cache(const tree_cache *cache, const char *token);
+
+const tree_cache_entry *find_tree_cache_entry(const tree_cache *cache, const char *path);
+
+bool add_tree_cache_entry(tree_cache *cache, const char *path, const char *hash_hex);
+
+bool copy_tree_cache_subtree(tree_cache *dest, const tree_cache *src, const char *path);
+
+#endif //TREE_CACHE_H
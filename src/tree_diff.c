@@ -0,0 +1,211 @@
+#include "tree_diff.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "tree_walk.h"
+
+static bool diff_trees(
+    const unsigned char *old_tree,
+    const unsigned char *new_tree,
+    char *path,
+    size_t base_len,
+    const diff_tree_opts *opts);
+
+// tree_desc_next() also stops on malformed entries, which must not pass
+// for the end of the tree
+static bool next_entry(tree_desc *desc, git_tree_node *node, bool *has_entry)
+{
+    *has_entry = tree_desc_next(desc, node);
+
+    return *has_entry || desc->pos >= desc->size;
+}
+
+static bool append_path(char *path, const size_t base_len, const char *name, size_t *path_len)
+{
+    const size_t name_len = strlen(name);
+    const size_t separator_len = base_len ? 1 : 0;
+
+    validate(base_len + separator_len + name_len < PATH_MAX, "Path too long: '%s/%s'.", path, name);
+
+    if (separator_len) path[base_len] = '/';
+    memcpy(&path[base_len + separator_len], name, name_len + 1);
+
+    *path_len = base_len + separator_len + name_len;
+
+    return true;
+
+error:
+    return false;
+}
+
+// An entry present on one side only: added or deleted, and with -r a
+// subtree is expanded into its blobs
+static bool report_one_side(
+    const git_tree_node *node,
+    const bool is_old,
+    char *path,
+    const size_t base_len,
+    const diff_tree_opts *opts)
+{
+    const unsigned int mode = get_tree_node_mode(node);
+
+    size_t path_len;
+    validate(append_path(path, base_len, node->name, &path_len), "Failed to build path.");
+
+    if (opts->recursive && is_tree_mode(mode))
+    {
+        const bool result = is_old
+            ? diff_trees(node->hash, nullptr, path, path_len, opts)
+            : diff_trees(nullptr, node->hash, path, path_len, opts);
+
+        path[base_len] = '\0';
+        return result;
+    }
+
+    tree_change change = {
+        .status = is_old ? 'D' : 'A',
+        .old_mode = is_old ? mode : 0,
+        .new_mode = is_old ? 0 : mode,
+        .path = path,
+    };
+
+    memset(change.old_hash, 0, SHA_DIGEST_LENGTH);
+    memset(change.new_hash, 0, SHA_DIGEST_LENGTH);
+    memcpy(is_old ? change.old_hash : change.new_hash, node->hash, SHA_DIGEST_LENGTH);
+
+    const bool result = opts->report(&change, opts->ctx);
+    path[base_len] = '\0';
+
+    return result;
+
+error:
+    return false;
+}
+
+static bool report_both_sides(
+    const git_tree_node *old_node,
+    const git_tree_node *new_node,
+    char *path,
+    const size_t base_len,
+    const diff_tree_opts *opts)
+{
+    const unsigned int old_mode = get_tree_node_mode(old_node);
+    const unsigned int new_mode = get_tree_node_mode(new_node);
+
+    // Equal oids mean equal content all the way down
+    if (old_mode == new_mode && memcmp(old_node->hash, new_node->hash, SHA_DIGEST_LENGTH) == 0) return true;
+
+    size_t path_len;
+    validate(append_path(path, base_len, new_node->name, &path_len), "Failed to build path.");
+
+    if (opts->recursive && is_tree_mode(new_mode))
+    {
+        const bool result = diff_trees(old_node->hash, new_node->hash, path, path_len, opts);
+
+        path[base_len] = '\0';
+        return result;
+    }
+
+    tree_change change = {
+        .status = (old_mode & 0170000) == (new_mode & 0170000) ? 'M' : 'T',
+        .old_mode = old_mode,
+        .new_mode = new_mode,
+        .path = path,
+    };
+
+    memcpy(change.old_hash, old_node->hash, SHA_DIGEST_LENGTH);
+    memcpy(change.new_hash, new_node->hash, SHA_DIGEST_LENGTH);
+
+    const bool result = opts->report(&change, opts->ctx);
+    path[base_len] = '\0';
+
+    return result;
+
+error:
+    return false;
+}
+
+static bool diff_trees(
+    const unsigned char *old_tree,
+    const unsigned char *new_tree,
+    char *path,
+    const size_t base_len,
+    const diff_tree_opts *opts)
+{
+    tree_desc old_desc = { };
+    tree_desc new_desc = { };
+    git_tree_node old_node = { };
+    git_tree_node new_node = { };
+
+    validate(init_tree_desc(&old_desc, old_tree), "Failed to read tree.");
+    validate(init_tree_desc(&new_desc, new_tree), "Failed to read tree.");
+
+    bool has_old;
+    bool has_new;
+    validate(next_entry(&old_desc, &old_node, &has_old), "Malformed tree.");
+    validate(next_entry(&new_desc, &new_node, &has_new), "Malformed tree.");
+
+    while (has_old || has_new)
+    {
+        int cmp;
+
+        if (!has_old)
+        {
+            cmp = 1;
+        }
+        else if (!has_new)
+        {
+            cmp = -1;
+        }
+        else
+        {
+            cmp = compare_tree_entry_names(
+                old_node.name,
+                is_tree_mode(get_tree_node_mode(&old_node)),
+                new_node.name,
+                is_tree_mode(get_tree_node_mode(&new_node)));
+        }
+
+        if (cmp < 0)
+        {
+            validate(report_one_side(&old_node, true, path, base_len, opts), "Tree diff stopped.");
+            validate(next_entry(&old_desc, &old_node, &has_old), "Malformed tree.");
+        }
+        else if (cmp > 0)
+        {
+            validate(report_one_side(&new_node, false, path, base_len, opts), "Tree diff stopped.");
+            validate(next_entry(&new_desc, &new_node, &has_new), "Malformed tree.");
+        }
+        else
+        {
+            validate(report_both_sides(&old_node, &new_node, path, base_len, opts), "Tree diff stopped.");
+            validate(next_entry(&old_desc, &old_node, &has_old), "Malformed tree.");
+            validate(next_entry(&new_desc, &new_node, &has_new), "Malformed tree.");
+        }
+    }
+
+    release_tree_desc(&old_desc);
+    release_tree_desc(&new_desc);
+
+    return true;
+
+error:
+    clear_git_tree_node(&old_node);
+    clear_git_tree_node(&new_node);
+    release_tree_desc(&old_desc);
+    release_tree_desc(&new_desc);
+
+    return false;
+}
+
+bool diff_tree_hashes(const unsigned char *old_tree, const unsigned char *new_tree, const diff_tree_opts *opts)
+{
+    if (old_tree && new_tree && memcmp(old_tree, new_tree, SHA_DIGEST_LENGTH) == 0) return true;
+
+    char path[PATH_MAX];
+    path[0] = '\0';
+
+    return diff_trees(old_tree, new_tree, path, 0, opts);
+}
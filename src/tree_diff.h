@@ -0,0 +1,32 @@
+#ifndef TREE_DIFF_H
+#define TREE_DIFF_H
+
+#include <openssl/sha.h>
+
+typedef struct tree_change
+{
+    // 'A'dded, 'D'eleted, 'M'odified or 'T'ype changed
+    char status;
+    unsigned int old_mode;
+    unsigned int new_mode;
+    unsigned char old_hash[SHA_DIGEST_LENGTH];
+    unsigned char new_hash[SHA_DIGEST_LENGTH];
+    const char *path;
+} tree_change;
+
+// Returning false stops the diff
+typedef bool (*tree_change_fn)(const tree_change *change, void *ctx);
+
+typedef struct diff_tree_opts
+{
+    bool recursive;
+    tree_change_fn report;
+    void *ctx;
+} diff_tree_opts;
+
+// Merges the sorted entries of both trees. Entries with equal oids and modes
+// are skipped without reading them, so only subtrees that differ are opened.
+// A null hash stands for the empty tree.
+bool diff_tree_hashes(const unsigned char *old_tree, const unsigned char *new_tree, const diff_tree_opts *opts);
+
+#endif //TREE_DIFF_H
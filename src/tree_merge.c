@@ -0,0 +1,623 @@
+#include "tree_merge.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "line_diff.h"
+#include "merge_file.h"
+#include "tree_walk.h"
+
+#define STAGE_BASE 0
+#define STAGE_OURS 1
+#define STAGE_THEIRS 2
+
+typedef struct merge_ctx
+{
+    const tree_merge_opts *opts;
+    merge_result *result;
+    FILE *messages;
+} merge_ctx;
+
+// An entry of the tree being built, in tree order
+typedef struct merged_entry
+{
+    char *name;
+    unsigned int mode;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    bool is_from_theirs;
+} merged_entry;
+
+typedef struct tree_builder
+{
+    merged_entry *entries;
+    size_t count;
+    size_t capacity;
+} tree_builder;
+
+static bool merge_trees(
+    const unsigned char *base_tree,
+    const unsigned char *ours_tree,
+    const unsigned char *theirs_tree,
+    char *path,
+    size_t base_len,
+    merge_ctx *ctx,
+    unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    bool *is_empty);
+
+static bool next_entry(tree_desc *desc, git_tree_node *node, bool *has_entry)
+{
+    *has_entry = tree_desc_next(desc, node);
+
+    return *has_entry || desc->pos >= desc->size;
+}
+
+static bool append_path(char *path, const size_t base_len, const char *name, size_t *path_len)
+{
+    const size_t name_len = strlen(name);
+    const size_t separator_len = base_len ? 1 : 0;
+
+    validate(base_len + separator_len + name_len < PATH_MAX, "Path too long: '%s/%s'.", path, name);
+
+    if (separator_len) path[base_len] = '/';
+    memcpy(&path[base_len + separator_len], name, name_len + 1);
+
+    *path_len = base_len + separator_len + name_len;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool is_same_entry(const merge_stage_entry *a, const merge_stage_entry *b)
+{
+    if (a->is_present != b->is_present) return false;
+    if (!a->is_present) return true;
+
+    return a->mode == b->mode && memcmp(a->hash, b->hash, SHA_DIGEST_LENGTH) == 0;
+}
+
+// Null stands for the empty tree on both sides
+static bool is_same_tree(const unsigned char *a, const unsigned char *b)
+{
+    if (!a || !b) return a == b;
+
+    return memcmp(a, b, SHA_DIGEST_LENGTH) == 0;
+}
+
+static bool add_entry(tree_builder *builder, const char *name, const unsigned int mode, const unsigned char hash[SHA_DIGEST_LENGTH], const bool is_from_theirs)
+{
+    if (builder->count == builder->capacity)
+    {
+        const size_t capacity = builder->capacity ? builder->capacity * 2 : 16;
+
+        merged_entry *entries = realloc(builder->entries, capacity * sizeof(merged_entry));
+        validate(entries, "Failed to allocate memory.");
+
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+
+    merged_entry *entry = &builder->entries[builder->count];
+    entry->name = strdup(name);
+    validate(entry->name, "Failed to allocate memory.");
+
+    entry->mode = mode;
+    entry->is_from_theirs = is_from_theirs;
+    memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+    builder->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_stage_entry(tree_builder *builder, const char *name, const merge_stage_entry *entry, const bool is_from_theirs)
+{
+    if (!entry->is_present) return true;
+
+    return add_entry(builder, name, entry->mode, entry->hash, is_from_theirs);
+}
+
+static void release_tree_builder(tree_builder *builder)
+{
+    for (size_t i = 0; i < builder->count; i++) free(builder->entries[i].name);
+    if (builder->entries) free(builder->entries);
+
+    *builder = (tree_builder){ };
+}
+
+static bool record_conflict(merge_ctx *ctx, const char *path, const merge_stage_entry stages[3])
+{
+    merge_result *result = ctx->result;
+
+    if (result->conflict_count == result->conflict_capacity)
+    {
+        const size_t capacity = result->conflict_capacity ? result->conflict_capacity * 2 : 8;
+
+        merge_conflict *conflicts = realloc(result->conflicts, capacity * sizeof(merge_conflict));
+        validate(conflicts, "Failed to allocate memory.");
+
+        result->conflicts = conflicts;
+        result->conflict_capacity = capacity;
+    }
+
+    merge_conflict *conflict = &result->conflicts[result->conflict_count];
+    conflict->path = strdup(path);
+    validate(conflict->path, "Failed to allocate memory.");
+
+    memcpy(conflict->stages, stages, sizeof(conflict->stages));
+    result->conflict_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static char *read_blob(const unsigned char hash[SHA_DIGEST_LENGTH], merge_file_input *input)
+{
+    char *content = nullptr;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    const size_t size = get_object_content(hex, &content);
+    validate(content, "Failed to obtain object content.");
+    validate(strncmp(content, "blob ", 5) == 0, "Object '%s' is not a blob.", hex);
+
+    const int header_size = get_header_size(content);
+    input->data = &content[header_size + 1];
+    input->size = size - header_size - 1;
+
+    return content;
+
+error:
+    if (content) free(content);
+
+    return nullptr;
+}
+
+// The side that changed the mode wins; changes on both sides conflict
+static bool merge_modes(const merge_stage_entry stages[3], unsigned int *mode)
+{
+    const unsigned int ours = stages[STAGE_OURS].mode;
+    const unsigned int theirs = stages[STAGE_THEIRS].mode;
+
+    *mode = ours;
+
+    if (ours == theirs) return true;
+    if (!stages[STAGE_BASE].is_present) return false;
+
+    if (stages[STAGE_BASE].mode == ours)
+    {
+        *mode = theirs;
+        return true;
+    }
+
+    return stages[STAGE_BASE].mode == theirs;
+}
+
+// Both sides changed a regular file: merge the lines, and keep the result
+// even when it has conflict markers in it
+static bool merge_blobs(
+    const char *path,
+    const char *name,
+    const merge_stage_entry stages[3],
+    merge_ctx *ctx,
+    tree_builder *builder)
+{
+    char *contents[3] = { };
+    buffer merged = { };
+
+    merge_file_input inputs[3] = {
+        { .data = "", .size = 0, .label = nullptr },
+        { .data = "", .size = 0, .label = ctx->opts->ours_label },
+        { .data = "", .size = 0, .label = ctx->opts->theirs_label },
+    };
+
+    fprintf(ctx->messages, "Auto-merging %s\n", path);
+
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        if (!stages[stage].is_present) continue;
+
+        contents[stage] = read_blob(stages[stage].hash, &inputs[stage]);
+        validate(contents[stage], "Failed to read blob for '%s'.", path);
+    }
+
+    unsigned int mode;
+    const bool is_mode_clean = merge_modes(stages, &mode);
+
+    bool is_content_clean = false;
+    unsigned char merged_hash[SHA_DIGEST_LENGTH];
+
+    const bool is_binary = is_binary_content(inputs[STAGE_BASE].data, inputs[STAGE_BASE].size)
+                           || is_binary_content(inputs[STAGE_OURS].data, inputs[STAGE_OURS].size)
+                           || is_binary_content(inputs[STAGE_THEIRS].data, inputs[STAGE_THEIRS].size);
+
+    if (is_binary)
+    {
+        fprintf(ctx->messages, "warning: Cannot merge binary files: %s (%s vs. %s)\n",
+                path, ctx->opts->ours_label, ctx->opts->theirs_label);
+
+        memcpy(merged_hash, stages[STAGE_OURS].hash, SHA_DIGEST_LENGTH);
+    }
+    else
+    {
+        validate(merge_file(&inputs[STAGE_BASE], &inputs[STAGE_OURS], &inputs[STAGE_THEIRS], &merged, &is_content_clean),
+                 "Failed to merge '%s'.", path);
+
+        char merged_hex[SHA_HEX_LENGTH + 1];
+        validate(write_blob_object_from_buffer(&merged, merged_hex), "Failed to write merged blob for '%s'.", path);
+        hash_hex_to_bytes(merged_hash, merged_hex);
+    }
+
+    validate(add_entry(builder, name, mode, merged_hash, false), "Failed to add tree entry.");
+
+    if (!is_content_clean)
+    {
+        fprintf(ctx->messages, "CONFLICT (%s): Merge conflict in %s\n", stages[STAGE_BASE].is_present ? "content" : "add/add", path);
+    }
+
+    if (!is_mode_clean)
+    {
+        fprintf(ctx->messages, "CONFLICT (mode): %s had its mode changed on both sides\n", path);
+    }
+
+    if (!is_content_clean || !is_mode_clean) validate(record_conflict(ctx, path, stages), "Failed to record conflict.");
+
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        if (contents[stage]) free(contents[stage]);
+    }
+
+    if (merged.data) free(merged.data);
+
+    return true;
+
+error:
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        if (contents[stage]) free(contents[stage]);
+    }
+
+    if (merged.data) free(merged.data);
+
+    return false;
+}
+
+static bool merge_entry(
+    const git_tree_node *nodes[3],
+    char *path,
+    const size_t base_len,
+    merge_ctx *ctx,
+    tree_builder *builder)
+{
+    merge_stage_entry stages[3] = { };
+    const char *name = nullptr;
+    bool is_dir = false;
+
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        if (!nodes[stage]) continue;
+
+        stages[stage].is_present = true;
+        stages[stage].mode = get_tree_node_mode(nodes[stage]);
+        memcpy(stages[stage].hash, nodes[stage]->hash, SHA_DIGEST_LENGTH);
+
+        name = nodes[stage]->name;
+        is_dir = is_tree_mode(stages[stage].mode);
+    }
+
+    // The trivial cases only compare oids
+    if (is_same_entry(&stages[STAGE_OURS], &stages[STAGE_THEIRS]) || is_same_entry(&stages[STAGE_BASE], &stages[STAGE_THEIRS]))
+    {
+        return add_stage_entry(builder, name, &stages[STAGE_OURS], false);
+    }
+
+    if (is_same_entry(&stages[STAGE_BASE], &stages[STAGE_OURS]))
+    {
+        return add_stage_entry(builder, name, &stages[STAGE_THEIRS], true);
+    }
+
+    size_t path_len;
+    validate(append_path(path, base_len, name, &path_len), "Failed to build path.");
+
+    if (is_dir)
+    {
+        unsigned char subtree_hash[SHA_DIGEST_LENGTH];
+        bool is_empty;
+
+        validate(merge_trees(
+                     stages[STAGE_BASE].is_present ? stages[STAGE_BASE].hash : nullptr,
+                     stages[STAGE_OURS].is_present ? stages[STAGE_OURS].hash : nullptr,
+                     stages[STAGE_THEIRS].is_present ? stages[STAGE_THEIRS].hash : nullptr,
+                     path, path_len, ctx, subtree_hash, &is_empty),
+                 "Failed to merge '%s'.", path);
+
+        if (!is_empty) validate(add_entry(builder, name, TREE_MODE_DIR, subtree_hash, false), "Failed to add tree entry.");
+    }
+    else if (!stages[STAGE_OURS].is_present || !stages[STAGE_THEIRS].is_present)
+    {
+        // Modified on one side, deleted on the other: the modified one stays
+        const bool is_deleted_in_ours = !stages[STAGE_OURS].is_present;
+        const char *deleted_in = is_deleted_in_ours ? ctx->opts->ours_label : ctx->opts->theirs_label;
+        const char *modified_in = is_deleted_in_ours ? ctx->opts->theirs_label : ctx->opts->ours_label;
+
+        fprintf(ctx->messages, "CONFLICT (modify/delete): %s deleted in %s and modified in %s.  Version %s of %s left in tree.\n",
+                path, deleted_in, modified_in, modified_in, path);
+
+        validate(add_stage_entry(builder, name, &stages[is_deleted_in_ours ? STAGE_THEIRS : STAGE_OURS], is_deleted_in_ours), "Failed to add tree entry.");
+        validate(record_conflict(ctx, path, stages), "Failed to record conflict.");
+    }
+    else if (S_ISREG(stages[STAGE_OURS].mode) && S_ISREG(stages[STAGE_THEIRS].mode)
+             && (!stages[STAGE_BASE].is_present || S_ISREG(stages[STAGE_BASE].mode)))
+    {
+        validate(merge_blobs(path, name, stages, ctx, builder), "Failed to merge '%s'.", path);
+    }
+    else
+    {
+        // Symlinks, submodules and type changes are not merged; ours stays
+        fprintf(ctx->messages, "CONFLICT (%s): Merge conflict in %s\n",
+                (stages[STAGE_OURS].mode & S_IFMT) == (stages[STAGE_THEIRS].mode & S_IFMT) ? "content" : "distinct types", path);
+
+        validate(add_stage_entry(builder, name, &stages[STAGE_OURS], false), "Failed to add tree entry.");
+        validate(record_conflict(ctx, path, stages), "Failed to record conflict.");
+    }
+
+    path[base_len] = '\0';
+
+    return true;
+
+error:
+    path[base_len] = '\0';
+
+    return false;
+}
+
+static int compare_entry_names(const void *a, const void *b)
+{
+    const merged_entry *const *entry1 = a;
+    const merged_entry *const *entry2 = b;
+
+    return strcmp((*entry1)->name, (*entry2)->name);
+}
+
+// A file on one side and a directory on the other end up as two entries of
+// the same name. The one that came from theirs is dropped.
+static bool resolve_file_directory_conflicts(tree_builder *builder, char *path, const size_t base_len, merge_ctx *ctx)
+{
+    merged_entry **sorted = malloc(builder->count * sizeof(merged_entry *));
+    validate(sorted, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < builder->count; i++) sorted[i] = &builder->entries[i];
+    qsort(sorted, builder->count, sizeof(merged_entry *), compare_entry_names);
+
+    bool has_conflicts = false;
+
+    for (size_t i = 1; i < builder->count; i++)
+    {
+        if (strcmp(sorted[i - 1]->name, sorted[i]->name) != 0) continue;
+
+        merged_entry *dropped = sorted[i]->is_from_theirs ? sorted[i] : sorted[i - 1];
+        merged_entry *file = is_tree_mode(sorted[i]->mode) ? sorted[i - 1] : sorted[i];
+
+        size_t path_len;
+        validate(append_path(path, base_len, dropped->name, &path_len), "Failed to build path.");
+
+        fprintf(ctx->messages, "CONFLICT (file/directory): %s is a file on one side and a directory on the other; %s kept.\n",
+                path, dropped->is_from_theirs ? ctx->opts->ours_label : ctx->opts->theirs_label);
+
+        merge_stage_entry stages[3] = { };
+        merge_stage_entry *stage = &stages[file->is_from_theirs ? STAGE_THEIRS : STAGE_OURS];
+        stage->is_present = true;
+        stage->mode = file->mode;
+        memcpy(stage->hash, file->hash, SHA_DIGEST_LENGTH);
+
+        const bool is_recorded = record_conflict(ctx, path, stages);
+        path[base_len] = '\0';
+        validate(is_recorded, "Failed to record conflict.");
+
+        free(dropped->name);
+        dropped->name = nullptr;
+        has_conflicts = true;
+    }
+
+    free(sorted);
+
+    if (!has_conflicts) return true;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < builder->count; i++)
+    {
+        if (builder->entries[i].name) builder->entries[kept++] = builder->entries[i];
+    }
+
+    builder->count = kept;
+
+    return true;
+
+error:
+    if (sorted) free(sorted);
+
+    return false;
+}
+
+static bool write_merged_tree(const tree_builder *builder, unsigned char tree_hash[SHA_DIGEST_LENGTH])
+{
+    buffer tree_buffer = { };
+
+    FILE *tree_content = open_memstream(&tree_buffer.data, &tree_buffer.size);
+    validate(tree_content, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < builder->count; i++)
+    {
+        const merged_entry *entry = &builder->entries[i];
+
+        fprintf(tree_content, "%o %s", entry->mode, entry->name);
+        fputc('\0', tree_content);
+        fwrite(entry->hash, 1, SHA_DIGEST_LENGTH, tree_content);
+    }
+
+    validate(fclose(tree_content) == 0, "Failed to build tree.");
+
+    char tree_hex[SHA_HEX_LENGTH + 1];
+    validate(write_tree_object(&tree_buffer, tree_hex), "Failed to write tree.");
+    hash_hex_to_bytes(tree_hash, tree_hex);
+
+    free(tree_buffer.data);
+
+    return true;
+
+error:
+    if (tree_buffer.data) free(tree_buffer.data);
+
+    return false;
+}
+
+static int compare_nodes(const git_tree_node *a, const git_tree_node *b)
+{
+    return compare_tree_entry_names(a->name, is_tree_mode(get_tree_node_mode(a)), b->name, is_tree_mode(get_tree_node_mode(b)));
+}
+
+static bool merge_trees(
+    const unsigned char *base_tree,
+    const unsigned char *ours_tree,
+    const unsigned char *theirs_tree,
+    char *path,
+    const size_t base_len,
+    merge_ctx *ctx,
+    unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    bool *is_empty)
+{
+    tree_desc descs[3] = { };
+    git_tree_node nodes[3] = { };
+    bool has_node[3] = { };
+    tree_builder builder = { };
+
+    const unsigned char *trees[3] = { base_tree, ours_tree, theirs_tree };
+
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        validate(init_tree_desc(&descs[stage], trees[stage]), "Failed to read tree.");
+        validate(next_entry(&descs[stage], &nodes[stage], &has_node[stage]), "Malformed tree.");
+    }
+
+    while (has_node[STAGE_BASE] || has_node[STAGE_OURS] || has_node[STAGE_THEIRS])
+    {
+        const git_tree_node *first = nullptr;
+
+        for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+        {
+            if (has_node[stage] && (!first || compare_nodes(&nodes[stage], first) < 0)) first = &nodes[stage];
+        }
+
+        const git_tree_node *matched[3] = { };
+
+        for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+        {
+            if (has_node[stage] && (&nodes[stage] == first || compare_nodes(&nodes[stage], first) == 0)) matched[stage] = &nodes[stage];
+        }
+
+        validate(merge_entry(matched, path, base_len, ctx, &builder), "Tree merge stopped.");
+
+        for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+        {
+            if (matched[stage]) validate(next_entry(&descs[stage], &nodes[stage], &has_node[stage]), "Malformed tree.");
+        }
+    }
+
+    validate(resolve_file_directory_conflicts(&builder, path, base_len, ctx), "Failed to resolve file/directory conflicts.");
+
+    *is_empty = builder.count == 0;
+    if (!*is_empty) validate(write_merged_tree(&builder, tree_hash), "Failed to write merged tree.");
+
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++) release_tree_desc(&descs[stage]);
+    release_tree_builder(&builder);
+
+    return true;
+
+error:
+    for (int stage = STAGE_BASE; stage <= STAGE_THEIRS; stage++)
+    {
+        clear_git_tree_node(&nodes[stage]);
+        release_tree_desc(&descs[stage]);
+    }
+
+    release_tree_builder(&builder);
+
+    return false;
+}
+
+bool merge_tree_hashes(
+    const unsigned char *base_tree,
+    const unsigned char *ours_tree,
+    const unsigned char *theirs_tree,
+    const tree_merge_opts *opts,
+    merge_result *result)
+{
+    *result = (merge_result){ };
+
+    merge_ctx ctx = {
+        .opts = opts,
+        .result = result,
+        .messages = open_memstream(&result->messages, &result->messages_size),
+    };
+
+    validate(ctx.messages, "Failed to allocate memory.");
+
+    // Whole trees that match on two sides decide the merge on their own
+    bool is_trivial = true;
+    const unsigned char *merged_tree = ours_tree;
+
+    if (is_same_tree(base_tree, ours_tree) && !is_same_tree(ours_tree, theirs_tree)) merged_tree = theirs_tree;
+    else if (!is_same_tree(ours_tree, theirs_tree) && !is_same_tree(base_tree, theirs_tree)) is_trivial = false;
+
+    bool is_empty = !merged_tree;
+
+    if (is_trivial && merged_tree)
+    {
+        memcpy(result->tree_hash, merged_tree, SHA_DIGEST_LENGTH);
+    }
+    else if (!is_trivial)
+    {
+        char path[PATH_MAX];
+        path[0] = '\0';
+
+        validate(merge_trees(base_tree, ours_tree, theirs_tree, path, 0, &ctx, result->tree_hash, &is_empty), "Failed to merge trees.");
+    }
+
+    // The top level is written even when nothing is left in it
+    if (is_empty)
+    {
+        const tree_builder empty = { };
+        validate(write_merged_tree(&empty, result->tree_hash), "Failed to write empty tree.");
+    }
+
+    validate(fclose(ctx.messages) == 0, "Failed to collect merge messages.");
+
+    return true;
+
+error:
+    if (ctx.messages) fclose(ctx.messages);
+    release_merge_result(result);
+
+    return false;
+}
+
+void release_merge_result(merge_result *result)
+{
+    for (size_t i = 0; i < result->conflict_count; i++) free(result->conflicts[i].path);
+    if (result->conflicts) free(result->conflicts);
+    if (result->messages) free(result->messages);
+
+    *result = (merge_result){ };
+}
@@ -0,0 +1,52 @@
+#ifndef TREE_MERGE_H
+#define TREE_MERGE_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+// One side of a conflicted path; stages 1, 2 and 3 are base, ours, theirs
+typedef struct merge_stage_entry
+{
+    bool is_present;
+    unsigned int mode;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} merge_stage_entry;
+
+typedef struct merge_conflict
+{
+    char *path;
+    merge_stage_entry stages[3];
+} merge_conflict;
+
+typedef struct merge_result
+{
+    unsigned char tree_hash[SHA_DIGEST_LENGTH];
+    merge_conflict *conflicts;
+    size_t conflict_count;
+    size_t conflict_capacity;
+
+    // "Auto-merging ..." and "CONFLICT (...) ..." lines, like git prints them
+    char *messages;
+    size_t messages_size;
+} merge_result;
+
+typedef struct tree_merge_opts
+{
+    const char *ours_label;
+    const char *theirs_label;
+} tree_merge_opts;
+
+// Merges ours and theirs against base without an index or worktree. Paths
+// with equal oids on two sides are resolved without being read; only blobs
+// changed on both sides are merged line by line. Conflicted files are
+// written with markers and listed in result. A null hash is the empty tree.
+bool merge_tree_hashes(
+    const unsigned char *base_tree,
+    const unsigned char *ours_tree,
+    const unsigned char *theirs_tree,
+    const tree_merge_opts *opts,
+    merge_result *result);
+
+void release_merge_result(merge_result *result);
+
+#endif //TREE_MERGE_H
@@ -0,0 +1,200 @@
+#include "tree_walk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+
+size_t try_set_node(git_tree_node *node, const char *obj_content, const size_t obj_size, const size_t start)
+{
+    size_t curr_pos = start;
+    size_t elem_start = start;
+
+    node->mode = nullptr;
+    node->name = nullptr;
+    node->hash = nullptr;
+
+    while (curr_pos < obj_size && obj_content[curr_pos] != ' ') curr_pos++;
+    validate(curr_pos < obj_size, "Truncated tree entry.");
+
+    size_t elem_len = curr_pos - elem_start;
+    node->mode = malloc(elem_len + 1);
+    validate(node->mode, "Failed to allocate memory.");
+
+    memcpy(node->mode, &obj_content[elem_start], elem_len);
+    node->mode[elem_len] = '\0';
+    elem_start = ++curr_pos;
+
+    while (curr_pos < obj_size && obj_content[curr_pos] != '\0') curr_pos++;
+    validate(curr_pos < obj_size, "Truncated tree entry.");
+
+    elem_len = curr_pos - elem_start;
+    node->name = malloc(elem_len + 1);
+    validate(node->name, "Failed to allocate memory.");
+
+    memcpy(node->name, &obj_content[elem_start], elem_len);
+    node->name[elem_len] = '\0';
+    elem_start = ++curr_pos;
+
+    validate(curr_pos + SHA_DIGEST_LENGTH <= obj_size, "Truncated tree entry.");
+
+    node->hash = malloc(SHA_DIGEST_LENGTH);
+    validate(node->hash, "Failed to allocate memory.");
+
+    memcpy(node->hash, &obj_content[elem_start], SHA_DIGEST_LENGTH);
+
+    curr_pos += SHA_DIGEST_LENGTH;
+
+    return curr_pos;
+
+error:
+    clear_git_tree_node(node);
+
+    return 0;
+}
+
+void clear_git_tree_node(git_tree_node *node)
+{
+    if (node->mode) free(node->mode);
+    if (node->name) free(node->name);
+    if (node->hash) free(node->hash);
+
+    node->mode = nullptr;
+    node->name = nullptr;
+    node->hash = nullptr;
+}
+
+void destroy_git_tree_node(git_tree_node *node)
+{
+    if (!node) return;
+
+    clear_git_tree_node(node);
+    free(node);
+}
+
+unsigned int get_tree_node_mode(const git_tree_node *node)
+{
+    return (unsigned int)strtoul(node->mode, nullptr, 8);
+}
+
+bool is_tree_mode(const unsigned int mode)
+{
+    return (mode & 0170000) == TREE_MODE_DIR;
+}
+
+bool init_tree_desc(tree_desc *desc, const unsigned char *tree_hash)
+{
+    desc->content = nullptr;
+    desc->size = 0;
+    desc->pos = 0;
+
+    if (!tree_hash) return true;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, tree_hash);
+    hash_hex[SHA_HEX_LENGTH] = '\0';
+
+    desc->size = get_object_content(hash_hex, &desc->content);
+    validate(desc->content, "Failed to obtain object content.");
+    validate(strncmp(desc->content, "tree ", 5) == 0, "Object '%s' is not a tree.", hash_hex);
+
+    desc->pos = get_header_size(desc->content) + 1;
+
+    return true;
+
+error:
+    release_tree_desc(desc);
+
+    return false;
+}
+
+bool tree_desc_next(tree_desc *desc, git_tree_node *node)
+{
+    clear_git_tree_node(node);
+
+    if (!desc->content || desc->pos >= desc->size) return false;
+
+    const size_t next_pos = try_set_node(node, desc->content, desc->size, desc->pos);
+    if (!next_pos) return false;
+
+    desc->pos = next_pos;
+
+    return true;
+}
+
+void release_tree_desc(tree_desc *desc)
+{
+    if (desc->content) free(desc->content);
+
+    desc->content = nullptr;
+    desc->size = 0;
+    desc->pos = 0;
+}
+
+int compare_tree_entry_names(const char *name1, const bool is_dir1, const char *name2, const bool is_dir2)
+{
+    const size_t len1 = strlen(name1);
+    const size_t len2 = strlen(name2);
+    const size_t len = len1 < len2 ? len1 : len2;
+
+    const int result = memcmp(name1, name2, len);
+    if (result) return result;
+
+    const unsigned char c1 = len < len1 ? name1[len] : is_dir1 ? '/' : '\0';
+    const unsigned char c2 = len < len2 ? name2[len] : is_dir2 ? '/' : '\0';
+
+    return (c1 > c2) - (c1 < c2);
+}
+
+bool find_tree_entry(const unsigned char *tree_hash, const char *path, unsigned char hash[SHA_DIGEST_LENGTH], unsigned int *mode)
+{
+    tree_desc desc = { };
+    git_tree_node node = { };
+    unsigned char current[SHA_DIGEST_LENGTH];
+
+    *mode = 0;
+    if (!tree_hash) return true;
+
+    memcpy(current, tree_hash, SHA_DIGEST_LENGTH);
+
+    while (*path)
+    {
+        const char *slash = strchr(path, '/');
+        const size_t name_len = slash ? (size_t)(slash - path) : strlen(path);
+
+        validate(init_tree_desc(&desc, current), "Failed to read tree.");
+
+        unsigned int entry_mode = 0;
+        while (tree_desc_next(&desc, &node))
+        {
+            if (strlen(node.name) != name_len || memcmp(node.name, path, name_len) != 0) continue;
+
+            entry_mode = get_tree_node_mode(&node);
+            memcpy(current, node.hash, SHA_DIGEST_LENGTH);
+            break;
+        }
+
+        clear_git_tree_node(&node);
+        release_tree_desc(&desc);
+
+        path += name_len;
+        while (*path == '/') path++;
+
+        // Missing, or a file where the path goes on below it
+        if (!entry_mode || (*path && !is_tree_mode(entry_mode))) return true;
+
+        if (!*path)
+        {
+            memcpy(hash, current, SHA_DIGEST_LENGTH);
+            *mode = entry_mode;
+        }
+    }
+
+    return true;
+
+error:
+    clear_git_tree_node(&node);
+    release_tree_desc(&desc);
+
+    return false;
+}
@@ -0,0 +1,50 @@
+#ifndef TREE_WALK_H
+#define TREE_WALK_H
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+#include "git_obj_helpers.h"
+
+#define TREE_MODE_DIR 0040000
+#define TREE_MODE_FILE 0100644
+#define TREE_MODE_EXECUTABLE 0100755
+#define TREE_MODE_SYMLINK 0120000
+#define TREE_MODE_GITLINK 0160000
+
+// Iterates over the entries of a tree object in their stored order
+typedef struct tree_desc
+{
+    char *content;
+    size_t size;
+    size_t pos;
+} tree_desc;
+
+size_t try_set_node(git_tree_node *node, const char *obj_content, size_t obj_size, size_t start);
+
+void clear_git_tree_node(git_tree_node *node);
+
+void destroy_git_tree_node(git_tree_node *node);
+
+unsigned int get_tree_node_mode(const git_tree_node *node);
+
+bool is_tree_mode(unsigned int mode);
+
+// A null hash opens an empty tree
+bool init_tree_desc(tree_desc *desc, const unsigned char *tree_hash);
+
+// Fills node with the next entry, releasing the previous contents of node.
+// Returns false at the end of the tree or on a malformed entry.
+bool tree_desc_next(tree_desc *desc, git_tree_node *node);
+
+void release_tree_desc(tree_desc *desc);
+
+// Orders entries the way git sorts trees: directories compare as if
+// their name ended with '/'
+int compare_tree_entry_names(const char *name1, bool is_dir1, const char *name2, bool is_dir2);
+
+// Looks up the entry at a slash-separated path below a tree. *mode is 0
+// when there is none; false is returned only when a tree cannot be read.
+bool find_tree_entry(const unsigned char *tree_hash, const char *path, unsigned char hash[SHA_DIGEST_LENGTH], unsigned int *mode);
+
+#endif //TREE_WALK_H
@@ -0,0 +1,661 @@
+#include "unpack_tree.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "git_obj_helpers.h"
+#include "index_file.h"
+#include "packfile.h"
+#include "promisor.h"
+#include "sparse_cone.h"
+#include "thread_pool.h"
+#include "tree_walk.h"
+
+#define CHECKOUT_DEFAULT_INFLIGHT_BYTES (64L * 1024 * 1024)
+
+typedef struct dir_list
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+} dir_list;
+
+typedef struct checkout_state
+{
+    index_state index;
+    index_state old_index;
+    sparse_cone cone;
+    bool is_sparse_index;
+    bool update_worktree;
+    dir_list dirs;
+    const char *root;
+    byte_budget budget;
+    bool *is_checked_out;
+} checkout_state;
+
+static bool add_dir(dir_list *dirs, const char *path, const size_t path_len)
+{
+    if (dirs->count == dirs->capacity)
+    {
+        const size_t capacity = dirs->capacity ? dirs->capacity * 2 : 64;
+
+        char **paths = realloc(dirs->paths, capacity * sizeof(char *));
+        validate(paths, "Failed to allocate memory.");
+
+        dirs->paths = paths;
+        dirs->capacity = capacity;
+    }
+
+    dirs->paths[dirs->count] = strndup(path, path_len);
+    validate(dirs->paths[dirs->count], "Failed to allocate memory.");
+    dirs->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Lists the directories above path that are not listed yet. Paths come in
+// order, so those are the ones that are not above the last one listed.
+static bool add_parent_dirs(dir_list *dirs, const char *path)
+{
+    const char *last = dirs->count ? dirs->paths[dirs->count - 1] : "";
+    const size_t last_len = strlen(last);
+
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        const size_t len = slash - path;
+        if (len <= last_len && strncmp(last, path, len) == 0 && (last[len] == '/' || last[len] == '\0')) continue;
+
+        validate(add_dir(dirs, path, len), "Failed to record directory.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Regular files are recorded as 100644 or 100755 whatever the tree says,
+// as old trees may carry modes like 100664
+static unsigned int canonical_mode(const unsigned int mode)
+{
+    if ((mode & S_IFMT) != S_IFREG) return mode;
+
+    return mode & 0111 ? TREE_MODE_EXECUTABLE : TREE_MODE_FILE;
+}
+
+// A subtree outside the cone becomes "<path>/" in a sparse index, which
+// sorts exactly where its entries would have
+static bool add_sparse_dir_entry(checkout_state *state, char *path, const size_t path_len, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    path[path_len] = '/';
+    path[path_len + 1] = '\0';
+
+    index_entry *entry = add_index_entry(&state->index, path, hash, TREE_MODE_DIR);
+    validate(entry, "Failed to add index entry.");
+
+    entry->is_skip_worktree = true;
+    state->index.is_sparse = true;
+
+    path[path_len] = '\0';
+
+    return true;
+
+error:
+    return false;
+}
+
+// Tree order, with directories compared as if they ended in '/', is the
+// bytewise order of full paths, so entries come out sorted for the index.
+// Directories are listed before anything inside them.
+static bool collect_entries(
+    checkout_state *state,
+    const unsigned char tree_hash[SHA_DIGEST_LENGTH],
+    char *path,
+    const size_t path_len,
+    const bool is_outside_cone)
+{
+    tree_desc desc;
+    git_tree_node node = { };
+
+    validate(init_tree_desc(&desc, tree_hash), "Failed to read tree.");
+
+    while (tree_desc_next(&desc, &node))
+    {
+        const unsigned int mode = get_tree_node_mode(&node);
+
+        const size_t name_len = strlen(node.name);
+        validate(path_len + name_len + 2 < PATH_MAX, "Path too long.");
+
+        if (path_len) path[path_len] = '/';
+        memcpy(&path[path_len + (path_len ? 1 : 0)], node.name, name_len + 1);
+        const size_t entry_path_len = path_len + (path_len ? 1 : 0) + name_len;
+
+        if (is_tree_mode(mode))
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            memcpy(hash, node.hash, SHA_DIGEST_LENGTH);
+
+            const bool is_outside = is_outside_cone || match_cone_dir(&state->cone, path, entry_path_len) == CONE_OUTSIDE;
+
+            if (is_outside && state->is_sparse_index)
+            {
+                validate(add_sparse_dir_entry(state, path, entry_path_len, hash), "Failed to collapse '%s'.", path);
+            }
+            else
+            {
+                if (state->update_worktree && !is_outside) validate(add_dir(&state->dirs, path, entry_path_len), "Failed to record directory.");
+                validate(collect_entries(state, hash, path, entry_path_len, is_outside), "Failed to read tree '%s'.", path);
+            }
+        }
+        else
+        {
+            index_entry *entry = add_index_entry(&state->index, path, node.hash, canonical_mode(mode));
+            validate(entry, "Failed to add index entry.");
+
+            entry->is_skip_worktree = is_outside_cone;
+        }
+
+        path[path_len] = '\0';
+    }
+
+    clear_git_tree_node(&node);
+    release_tree_desc(&desc);
+
+    return true;
+
+error:
+    clear_git_tree_node(&node);
+    release_tree_desc(&desc);
+
+    return false;
+}
+
+// Length of the topmost directory above path that is outside the cone, 0
+// when there is none
+static size_t find_outside_dir(const checkout_state *state, const char *path)
+{
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        if (match_cone_dir(&state->cone, path, slash - path) == CONE_OUTSIDE) return slash - path;
+    }
+
+    return 0;
+}
+
+// Rebuilds the entries from the old index rather than a tree, so staged
+// changes carry over. Sparse directory entries that reach into the cone
+// are expanded from their trees, and ranges of entries outside of it are
+// collapsed into the trees they make up.
+static bool collect_index_entries(checkout_state *state)
+{
+    const index_state *old_index = &state->old_index;
+    char path[PATH_MAX];
+    size_t pos = 0;
+
+    while (pos < old_index->count)
+    {
+        const index_entry *old_entry = &old_index->entries[pos];
+        const size_t outside_len = find_outside_dir(state, old_entry->path);
+
+        const size_t path_len = strlen(old_entry->path);
+        validate(path_len + 2 < PATH_MAX, "Path too long.");
+
+        if (outside_len && state->is_sparse_index)
+        {
+            memcpy(path, old_entry->path, outside_len);
+            path[outside_len] = '\0';
+
+            unsigned char hash[SHA_DIGEST_LENGTH];
+
+            if (is_sparse_dir_entry(old_entry) && path_len == outside_len + 1)
+            {
+                memcpy(hash, old_entry->hash, SHA_DIGEST_LENGTH);
+                pos++;
+            }
+            else
+            {
+                validate(write_index_tree(old_index, old_entry->path, outside_len + 1, &pos, hash), "Failed to write tree '%s'.", path);
+            }
+
+            validate(add_sparse_dir_entry(state, path, outside_len, hash), "Failed to collapse '%s'.", path);
+            continue;
+        }
+
+        if (state->update_worktree && !outside_len) validate(add_parent_dirs(&state->dirs, old_entry->path), "Failed to record directories.");
+
+        if (is_sparse_dir_entry(old_entry))
+        {
+            memcpy(path, old_entry->path, path_len - 1);
+            path[path_len - 1] = '\0';
+
+            validate(collect_entries(state, old_entry->hash, path, path_len - 1, outside_len != 0), "Failed to read tree '%s'.", path);
+        }
+        else
+        {
+            index_entry *entry = add_index_entry(&state->index, old_entry->path, old_entry->hash, old_entry->mode);
+            validate(entry, "Failed to add index entry.");
+
+            entry->stat = old_entry->stat;
+            entry->is_skip_worktree = outside_len != 0;
+        }
+
+        pos++;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool is_checked_out_entry(const index_entry *entry)
+{
+    return !entry->is_skip_worktree && !is_sparse_dir_entry(entry);
+}
+
+// For files whose stat data does not match, as happens to files written in
+// the same instant as the index, or merely touched
+static bool is_worktree_content_unchanged(const index_entry *entry, const char *full_path, const struct stat *fs)
+{
+    if (!S_ISREG(fs->st_mode) || (entry->mode & S_IFMT) != S_IFREG) return false;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    char expected_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(expected_hex, entry->hash);
+
+    return hash_blob_object((char *)full_path, hash_hex) && strcmp(hash_hex, expected_hex) == 0;
+}
+
+static void remove_empty_parents(const checkout_state *state, char *full_path)
+{
+    const size_t root_len = strlen(state->root);
+
+    for (char *slash = strrchr(full_path, '/'); slash && (size_t)(slash - full_path) > root_len; slash = strrchr(full_path, '/'))
+    {
+        *slash = '\0';
+        if (rmdir(full_path) != 0) break;
+    }
+}
+
+// A file the old index had checked out that the new one does not. Local
+// changes are not thrown away; such files stay where they are.
+static bool remove_stale_file(const checkout_state *state, const index_entry *entry)
+{
+    char full_path[PATH_MAX];
+    (void)snprintf(full_path, PATH_MAX, "%s/%s", state->root, entry->path);
+
+    struct stat fs;
+    if (entry->mode == TREE_MODE_GITLINK || lstat(full_path, &fs) != 0) return true;
+
+    if (!is_index_entry_up_to_date(&state->old_index, entry, &fs) && !is_worktree_content_unchanged(entry, full_path, &fs))
+    {
+        fprintf(stderr, "warning: not removing '%s', it has local changes\n", entry->path);
+        return true;
+    }
+
+    validate(unlink(full_path) == 0, "Unable to remove '%s'.", entry->path);
+    remove_empty_parents(state, full_path);
+
+    return true;
+
+error:
+    return false;
+}
+
+// A file checked out before and wanted again. When its entry does not
+// change, it is not rewritten: an untouched file keeps its stat data and a
+// locally modified one keeps the modification. Local changes to a file
+// whose entry does change are never overwritten.
+static bool merge_checked_out_entry(checkout_state *state, const index_entry *old_entry, const size_t pos)
+{
+    index_entry *entry = &state->index.entries[pos];
+
+    char full_path[PATH_MAX];
+    (void)snprintf(full_path, PATH_MAX, "%s/%s", state->root, entry->path);
+
+    struct stat fs;
+    if (lstat(full_path, &fs) != 0) return true;
+
+    const bool is_same_entry = old_entry->mode == entry->mode && memcmp(old_entry->hash, entry->hash, SHA_DIGEST_LENGTH) == 0;
+
+    if (is_index_entry_up_to_date(&state->old_index, old_entry, &fs))
+    {
+        if (is_same_entry) entry->stat = old_entry->stat;
+    }
+    else if (is_worktree_content_unchanged(old_entry, full_path, &fs))
+    {
+        if (is_same_entry) fill_index_stat(&entry->stat, &fs);
+    }
+    else
+    {
+        validate(is_same_entry, "Your local changes to '%s' would be overwritten.", entry->path);
+        entry->stat = old_entry->stat;
+    }
+
+    state->is_checked_out[pos] = is_same_entry;
+
+    return true;
+
+error:
+    return false;
+}
+
+// Walks the old and new entries side by side, then removes the files that
+// are no longer wanted. Nothing is removed if any entry conflicts.
+static bool merge_with_old_index(checkout_state *state)
+{
+    size_t *stale = nullptr;
+    size_t stale_count = 0;
+
+    const index_state *old_index = &state->old_index;
+
+    stale = malloc((old_index->count ? old_index->count : 1) * sizeof(size_t));
+    validate(stale, "Failed to allocate memory.");
+
+    size_t old_pos = 0;
+
+    for (size_t i = 0; i <= state->index.count; i++)
+    {
+        const index_entry *entry = i < state->index.count ? &state->index.entries[i] : nullptr;
+
+        for (; old_pos < old_index->count; old_pos++)
+        {
+            const index_entry *old_entry = &old_index->entries[old_pos];
+            const int cmp = entry ? strcmp(old_entry->path, entry->path) : -1;
+
+            if (cmp > 0) break;
+            if (!is_checked_out_entry(old_entry)) continue;
+
+            if (cmp < 0 || !is_checked_out_entry(entry))
+            {
+                stale[stale_count++] = old_pos;
+                continue;
+            }
+
+            validate(merge_checked_out_entry(state, old_entry, i), "Failed to check out '%s'.", entry->path);
+        }
+    }
+
+    for (size_t i = 0; i < stale_count; i++)
+    {
+        const index_entry *old_entry = &old_index->entries[stale[i]];
+        validate(remove_stale_file(state, old_entry), "Failed to remove '%s'.", old_entry->path);
+    }
+
+    free(stale);
+
+    return true;
+
+error:
+    if (stale) free(stale);
+
+    return false;
+}
+
+static bool create_dirs(const checkout_state *state)
+{
+    for (size_t i = 0; i < state->dirs.count; i++)
+    {
+        char full_path[PATH_MAX];
+        (void)snprintf(full_path, PATH_MAX, "%s/%s", state->root, state->dirs.paths[i]);
+
+        if (mkdir(full_path, 0777) == 0) continue;
+
+        struct stat fs;
+        validate(errno == EEXIST && lstat(full_path, &fs) == 0 && S_ISDIR(fs.st_mode),
+            "'%s' exists and is not a directory.", state->dirs.paths[i]);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_file_content(const int fd, const char *data, const size_t size, const char *path)
+{
+    for (size_t written = 0; written < size;)
+    {
+        const ssize_t result = write(fd, &data[written], size - written);
+        validate(result > 0, "Failed to write '%s'.", path);
+        written += result;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Replaces whatever is at the path with the blob. Files are created with
+// the permissions git expects of 100644 and 100755 entries; the umask
+// applies on top, as it does for git.
+static bool checkout_blob(const index_entry *entry, const char *full_path)
+{
+    char *content = nullptr;
+    int fd = -1;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, entry->hash);
+
+    const size_t content_size = get_object_content(hash_hex, &content);
+    validate(content, "Failed to read blob '%s'.", hash_hex);
+
+    const size_t header_size = strlen(content) + 1;
+    validate(strncmp(content, "blob ", 5) == 0, "'%s' is not a blob.", entry->path);
+
+    const char *data = &content[header_size];
+    const size_t data_size = content_size - header_size;
+
+    validate(unlink(full_path) == 0 || errno == ENOENT, "Unable to remove '%s'.", entry->path);
+
+    if (entry->mode == TREE_MODE_SYMLINK)
+    {
+        validate(symlink(data, full_path) == 0, "Failed to create symlink '%s'.", entry->path);
+    }
+    else
+    {
+        fd = open(full_path, O_WRONLY | O_CREAT | O_EXCL, entry->mode == TREE_MODE_EXECUTABLE ? 0777 : 0666);
+        validate(fd != -1, "Failed to create '%s'.", entry->path);
+        validate(write_file_content(fd, data, data_size, entry->path), "Failed to write '%s'.", entry->path);
+
+        const int close_result = close(fd);
+        fd = -1;
+        validate(close_result == 0, "Failed to write '%s'.", entry->path);
+    }
+
+    free(content);
+
+    return true;
+
+error:
+    if (fd != -1) close(fd);
+    if (content) free(content);
+
+    return false;
+}
+
+// Each worker holds at most one blob, and the blobs held across workers
+// stay within the budget, so a run of large files cannot exhaust memory
+static void checkout_task(void *ctx, const size_t index)
+{
+    checkout_state *state = ctx;
+    index_entry *entry = &state->index.entries[index];
+
+    if (state->is_checked_out[index]) return;
+
+    char full_path[PATH_MAX];
+    (void)snprintf(full_path, PATH_MAX, "%s/%s", state->root, entry->path);
+
+    // Submodules are not checked out, only given their empty directory
+    if (entry->mode == TREE_MODE_GITLINK)
+    {
+        state->is_checked_out[index] = mkdir(full_path, 0777) == 0 || errno == EEXIST;
+        return;
+    }
+
+    size_t size;
+    if (!get_object_size(entry->hash, &size)) return;
+
+    acquire_bytes(&state->budget, size);
+    const bool is_written = checkout_blob(entry, full_path);
+    release_bytes(&state->budget, size);
+
+    struct stat fs;
+    if (!is_written || lstat(full_path, &fs) != 0) return;
+
+    fill_index_stat(&entry->stat, &fs);
+    state->is_checked_out[index] = true;
+}
+
+// Workers must not fetch objects one by one as they find them missing; in
+// a partial clone, every blob the checkout needs is fetched in one request
+// before they start
+static bool prefetch_checkout_blobs(const checkout_state *state)
+{
+    if (!get_promisor_remote()) return true;
+
+    unsigned char (*hashes)[SHA_DIGEST_LENGTH] = malloc((state->index.count ? state->index.count : 1) * SHA_DIGEST_LENGTH);
+    validate(hashes, "Failed to allocate memory.");
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < state->index.count; i++)
+    {
+        const index_entry *entry = &state->index.entries[i];
+        if (state->is_checked_out[i] || entry->mode == TREE_MODE_GITLINK) continue;
+
+        memcpy(hashes[count++], entry->hash, SHA_DIGEST_LENGTH);
+    }
+
+    const bool result = prefetch_missing_objects((const unsigned char (*)[SHA_DIGEST_LENGTH])hashes, count);
+    free(hashes);
+
+    return result;
+
+error:
+    return false;
+}
+
+static bool checkout_entries(checkout_state *state)
+{
+    state->root = get_repository_root();
+    validate(state->root, "Not a git repository.");
+
+    state->is_checked_out = calloc(state->index.count ? state->index.count : 1, sizeof(bool));
+    validate(state->is_checked_out, "Failed to allocate memory.");
+
+    for (size_t i = 0; i < state->index.count; i++)
+    {
+        if (!is_checked_out_entry(&state->index.entries[i])) state->is_checked_out[i] = true;
+    }
+
+    // Stale files go first, as a new directory may take the place of one
+    validate(merge_with_old_index(state), "Failed to compare with the index.");
+    validate(create_dirs(state), "Failed to create directories.");
+    validate(prefetch_checkout_blobs(state), "Failed to fetch missing blobs.");
+
+    long budget = get_config_long("checkout.maxInflightBytes", CHECKOUT_DEFAULT_INFLIGHT_BYTES);
+    if (budget <= 0) budget = CHECKOUT_DEFAULT_INFLIGHT_BYTES;
+
+    init_byte_budget(&state->budget, budget);
+
+    prepare_packed_git_for_threads();
+    run_parallel(state->index.count, get_worker_count("checkout.workers"), checkout_task, state);
+
+    destroy_byte_budget(&state->budget);
+
+    for (size_t i = 0; i < state->index.count; i++)
+    {
+        validate(state->is_checked_out[i], "Failed to check out '%s'.", state->index.entries[i].path);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static void release_checkout_state(checkout_state *state)
+{
+    release_index(&state->index);
+    release_index(&state->old_index);
+    release_sparse_cone(&state->cone);
+
+    for (size_t i = 0; i < state->dirs.count; i++) free(state->dirs.paths[i]);
+    if (state->dirs.paths) free(state->dirs.paths);
+
+    if (state->is_checked_out) free(state->is_checked_out);
+}
+
+bool unpack_tree(const unsigned char tree_hash[SHA_DIGEST_LENGTH], const bool update_worktree)
+{
+    checkout_state state = { .update_worktree = update_worktree };
+
+    validate(load_sparse_cone(&state.cone), "Failed to read the sparse-checkout patterns.");
+    state.is_sparse_index = state.cone.is_enabled && get_config_bool("index.sparse", false);
+
+    char path[PATH_MAX] = "";
+    validate(collect_entries(&state, tree_hash, path, 0, false), "Failed to read the tree.");
+
+    if (update_worktree)
+    {
+        validate(read_index(&state.old_index), "Failed to read the index.");
+        validate(checkout_entries(&state), "Failed to update the worktree.");
+    }
+
+    validate(write_index(&state.index), "Failed to write the index.");
+
+    release_checkout_state(&state);
+
+    return true;
+
+error:
+    release_checkout_state(&state);
+
+    return false;
+}
+
+bool reapply_sparse_checkout(const unsigned char *head_tree)
+{
+    checkout_state state = { .update_worktree = true };
+
+    validate(load_sparse_cone(&state.cone), "Failed to read the sparse-checkout patterns.");
+    state.is_sparse_index = state.cone.is_enabled && get_config_bool("index.sparse", false);
+
+    validate(read_index(&state.old_index), "Failed to read the index.");
+
+    if (state.old_index.count == 0 && head_tree)
+    {
+        char path[PATH_MAX] = "";
+        validate(collect_entries(&state, head_tree, path, 0, false), "Failed to read the tree.");
+    }
+    else
+    {
+        validate(collect_index_entries(&state), "Failed to read the index entries.");
+    }
+
+    validate(checkout_entries(&state), "Failed to update the worktree.");
+    validate(write_index(&state.index), "Failed to write the index.");
+
+    release_checkout_state(&state);
+
+    return true;
+
+error:
+    release_checkout_state(&state);
+
+    return false;
+}
@@ -0,0 +1,21 @@
+#ifndef UNPACK_TREE_H
+#define UNPACK_TREE_H
+
+#include <openssl/sha.h>
+
+// Replaces the index with the entries of a tree. Subtrees outside the
+// sparse cone are marked skip-worktree, or, with index.sparse, collapsed
+// into one sparse directory entry each.
+//
+// With update_worktree the entries in the cone are also written out, their
+// stat data recorded, and files the old index tracked that are no longer
+// wanted are removed. Files already matching the tree are left alone.
+bool unpack_tree(const unsigned char tree_hash[SHA_DIGEST_LENGTH], bool update_worktree);
+
+// Applies the current sparse-checkout patterns to the index as it is,
+// staged changes included, and updates the worktree to match. An index
+// with no entries yet, as in a clone made without a checkout, is filled
+// from head_tree when one is given.
+bool reapply_sparse_checkout(const unsigned char *head_tree);
+
+#endif //UNPACK_TREE_H
@@ -0,0 +1,94 @@
+#include "update_ref.h"
+
+#include <getopt.h>
+#include <stdio.h>
+
+#include "debug_helpers.h"
+#include "git_dir_helpers.h"
+#include "refs.h"
+
+bool delete_opt = false;
+bool no_deref_opt = false;
+
+static bool try_resolve_update_ref_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "no-deref", no_argument, nullptr, 'n' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                delete_opt = true;
+                break;
+            case 'n':
+                no_deref_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// update-ref <ref> <new-value> [<old-value>]
+// update-ref -d <ref> [<old-value>]
+int update_ref(const int argc, char *argv[])
+{
+    validate(try_resolve_update_ref_opts(argc, argv), "Failed to resolve options.");
+
+    const command_args args = get_command_args(argc, argv);
+
+    const int expected_count = delete_opt ? 1 : 2;
+    validate(args.count == expected_count || args.count == expected_count + 1, "Usage: update-ref [-d] [--no-deref] <ref> [<new-value>] [<old-value>]");
+
+    const char *refname = args.argv[0];
+
+    unsigned char old_hash[SHA_DIGEST_LENGTH];
+    const bool has_old_value = args.count == expected_count + 1;
+
+    if (has_old_value)
+    {
+        const char *old_value = args.argv[expected_count];
+
+        // An empty old value, like the null oid, means the ref must not exist yet
+        if (old_value[0] == '\0')
+        {
+            memset(old_hash, 0, SHA_DIGEST_LENGTH);
+        }
+        else
+        {
+            validate(resolve_revision(old_value, old_hash), "Invalid old value '%s'.", old_value);
+        }
+    }
+
+    if (delete_opt)
+    {
+        validate(delete_ref(refname, has_old_value ? old_hash : nullptr, no_deref_opt), "Failed to delete '%s'.", refname);
+        return 0;
+    }
+
+    const char *new_value = args.argv[1];
+
+    unsigned char new_hash[SHA_DIGEST_LENGTH];
+    validate(resolve_revision(new_value, new_hash), "Invalid new value '%s'.", new_value);
+
+    validate(set_ref(refname, new_hash, has_old_value ? old_hash : nullptr, no_deref_opt), "Failed to update '%s'.", refname);
+
+    return 0;
+
+error:
+    return 1;
+}
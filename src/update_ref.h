@@ -0,0 +1,6 @@
+#ifndef UPDATE_REF_H
+#define UPDATE_REF_H
+
+int update_ref(int argc, char *argv[]);
+
+#endif //UPDATE_REF_H
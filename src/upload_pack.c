@@ -0,0 +1,861 @@
+#include "upload_pack.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "commit.h"
+#include "commit_reach.h"
+#include "compression.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "list_objects.h"
+#include "object_filter.h"
+#include "packfile.h"
+#include "pkt_line.h"
+#include "refs.h"
+#include "sha1.h"
+#include "shallow.h"
+
+#define UPLOAD_PACK_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+bool stateless_rpc_opt = false;
+bool advertise_refs_opt = false;
+
+// The lines of one command request, capabilities and arguments alike
+typedef struct request_args
+{
+    char **lines;
+    size_t count;
+    size_t capacity;
+} request_args;
+
+typedef struct ls_refs_state
+{
+    FILE *out;
+    const request_args *args;
+    bool is_symrefs;
+    bool is_peel;
+} ls_refs_state;
+
+// Pack bytes are hashed for the trailer as they go and sent in side-band
+// packets as large as a pkt-line allows
+typedef struct pack_stream
+{
+    FILE *out;
+    sha1_ctx ctx;
+    unsigned char buffer[LARGE_PACKET_DATA_MAX - 1];
+    size_t len;
+} pack_stream;
+
+static bool try_resolve_upload_pack_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "stateless-rpc", no_argument, nullptr, 's' },
+        { "advertise-refs", no_argument, nullptr, 'a' },
+        { "http-backend-info-refs", no_argument, nullptr, 'a' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                stateless_rpc_opt = true;
+                break;
+            case 'a':
+                advertise_refs_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 2 == argc, "Usage: upload-pack [--stateless-rpc] [--advertise-refs] <directory>");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_capabilities(FILE *out)
+{
+    return write_pkt_linef(out, "version 2\n") &&
+           write_pkt_linef(out, "agent=%s\n", GIT_AGENT) &&
+           write_pkt_linef(out, "ls-refs\n") &&
+           write_pkt_linef(out, "fetch=shallow filter\n") &&
+           write_pkt_linef(out, "server-option\n") &&
+           write_pkt_linef(out, "object-format=sha1\n") &&
+           write_pkt_flush(out);
+}
+
+static void release_request_args(request_args *args)
+{
+    for (size_t i = 0; i < args->count; i++) free(args->lines[i]);
+    if (args->lines) free(args->lines);
+
+    *args = (request_args){ };
+}
+
+static bool add_request_arg(request_args *args, const char *line, size_t len)
+{
+    if (args->count == args->capacity)
+    {
+        const size_t capacity = args->capacity ? args->capacity * 2 : 64;
+
+        char **lines = realloc(args->lines, capacity * sizeof(char *));
+        validate(lines, "Failed to allocate memory.");
+
+        args->lines = lines;
+        args->capacity = capacity;
+    }
+
+    if (len && line[len - 1] == '\n') len--;
+
+    args->lines[args->count] = strndup(line, len);
+    validate(args->lines[args->count], "Failed to allocate memory.");
+    args->count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool has_arg(const request_args *args, const char *name)
+{
+    for (size_t i = 0; i < args->count; i++)
+    {
+        if (strcmp(args->lines[i], name) == 0) return true;
+    }
+
+    return false;
+}
+
+static bool is_ref_wanted(const request_args *args, const char *refname)
+{
+    bool has_prefixes = false;
+
+    for (size_t i = 0; i < args->count; i++)
+    {
+        if (strncmp(args->lines[i], "ref-prefix ", 11) != 0) continue;
+
+        has_prefixes = true;
+
+        const char *prefix = &args->lines[i][11];
+        if (strncmp(refname, prefix, strlen(prefix)) == 0) return true;
+    }
+
+    return !has_prefixes;
+}
+
+static bool write_ref_line(const ls_refs_state *state, const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], const char *symref_target)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    char line[LARGE_PACKET_DATA_MAX];
+    int len = snprintf(line, sizeof(line), "%s %s", hex, refname);
+
+    if (state->is_symrefs && symref_target)
+    {
+        len += snprintf(&line[len], sizeof(line) - len, " symref-target:%s", symref_target);
+    }
+
+    unsigned char peeled[SHA_DIGEST_LENGTH];
+    if (state->is_peel && peel_tag(hash, peeled))
+    {
+        while (peel_tag(peeled, peeled)) { }
+
+        hash_bytes_to_hex(hex, peeled);
+        len += snprintf(&line[len], sizeof(line) - len, " peeled:%s", hex);
+    }
+
+    validate(len < (int)sizeof(line) - 1, "Ref line too long for '%s'.", refname);
+    line[len++] = '\n';
+
+    return write_pkt_line(state->out, line, len);
+
+error:
+    return false;
+}
+
+static bool show_ref(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    const ls_refs_state *state = data;
+    if (!is_ref_wanted(state->args, refname)) return true;
+
+    return write_ref_line(state, refname, hash, nullptr);
+}
+
+// HEAD first, with the branch it points to, then refs/ in name order
+static bool ls_refs(FILE *out, const request_args *args)
+{
+    const ls_refs_state state = {
+        .out = out,
+        .args = args,
+        .is_symrefs = has_arg(args, "symrefs"),
+        .is_peel = has_arg(args, "peel"),
+    };
+
+    char head_target[PATH_MAX];
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+
+    if (is_ref_wanted(args, "HEAD") && resolve_ref("HEAD", head_target, head_hash))
+    {
+        const bool is_symref = strcmp(head_target, "HEAD") != 0;
+        validate(write_ref_line(&state, "HEAD", head_hash, is_symref ? head_target : nullptr), "Failed to write HEAD.");
+    }
+
+    validate(for_each_ref(show_ref, (void *)&state), "Failed to list refs.");
+    validate(write_pkt_flush(out), "Failed to write response.");
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_pack_bytes(pack_stream *stream, const void *data, size_t size)
+{
+    const unsigned char *pos = data;
+    sha1_update(&stream->ctx, data, size);
+
+    while (size)
+    {
+        size_t n = sizeof(stream->buffer) - stream->len;
+        if (n > size) n = size;
+
+        memcpy(&stream->buffer[stream->len], pos, n);
+        stream->len += n;
+        pos += n;
+        size -= n;
+
+        if (stream->len == sizeof(stream->buffer))
+        {
+            validate(write_sideband(stream->out, SIDEBAND_PACK_DATA, stream->buffer, stream->len), "Failed to send pack.");
+            stream->len = 0;
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// A whole object stored in a pack is sent as the bytes it already has
+// there, header included, without inflating it again
+static bool try_reuse_packed_object(pack_stream *stream, const unsigned char hash[SHA_DIGEST_LENGTH], bool *is_reused)
+{
+    *is_reused = false;
+
+    packed_git *pack;
+    uint64_t offset;
+    if (!find_pack_entry(hash, &pack, &offset)) return true;
+
+    if (get_packed_object_type(pack, offset) == OBJ_NONE) return true;
+
+    const object_type stored_type = (pack->pack_data[offset] >> 4) & 0x07;
+    if (stored_type == OBJ_OFS_DELTA || stored_type == OBJ_REF_DELTA) return true;
+
+    uint32_t position;
+    if (!load_pack_revindex(pack) || !find_pack_idx_position(pack, hash, &position)) return true;
+
+    const uint32_t pack_position = pack->pack_positions[position];
+    const uint64_t end = pack_position + 1 < pack->object_count
+        ? get_pack_idx_offset(pack, pack->revindex[pack_position + 1])
+        : pack->pack_size - SHA_DIGEST_LENGTH;
+
+    validate(end > offset && end <= pack->pack_size - SHA_DIGEST_LENGTH, "Corrupt pack offsets.");
+    validate(write_pack_bytes(stream, &pack->pack_data[offset], end - offset), "Failed to send object.");
+
+    *is_reused = true;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_pack_object(pack_stream *stream, const listed_object *object)
+{
+    char *content = nullptr;
+    z_stream defstream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    bool is_deflating = false;
+
+    bool is_reused;
+    validate(try_reuse_packed_object(stream, object->hash, &is_reused), "Failed to reuse object.");
+    if (is_reused) return true;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, object->hash);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    const size_t content_size = get_object_content(hex, &content);
+    validate(content, "Failed to read object %s.", hex);
+
+    char type_name[16];
+    get_object_type(type_name, content);
+    const object_type type = object_type_from_name(type_name);
+    validate(type != OBJ_NONE, "Unknown type of object %s.", hex);
+
+    const size_t header_size = get_header_size(content) + 1;
+    const unsigned char *data = (unsigned char *)&content[header_size];
+    const size_t size = content_size - header_size;
+
+    unsigned char header[16];
+    const size_t pack_header_size = encode_pack_object_header(header, type, size);
+    validate(write_pack_bytes(stream, header, pack_header_size), "Failed to send object header.");
+
+    validate(deflateInit(&defstream, Z_DEFAULT_COMPRESSION) == Z_OK, "Failed to initialize deflate.");
+    is_deflating = true;
+
+    defstream.next_in = (unsigned char *)data;
+    defstream.avail_in = (uInt)size;
+
+    int ret;
+    do
+    {
+        unsigned char out[CHUNK];
+        defstream.next_out = out;
+        defstream.avail_out = CHUNK;
+
+        ret = deflate(&defstream, Z_FINISH);
+        validate(ret != Z_STREAM_ERROR, "Failed to deflate object.");
+
+        validate(write_pack_bytes(stream, out, CHUNK - defstream.avail_out), "Failed to send object.");
+
+    } while (ret != Z_STREAM_END);
+
+    (void)deflateEnd(&defstream);
+    free(content);
+
+    return true;
+
+error:
+    if (is_deflating) (void)deflateEnd(&defstream);
+    if (content) free(content);
+
+    return false;
+}
+
+static bool send_pack(FILE *out, const object_list *objects)
+{
+    static pack_stream stream;
+    stream.out = out;
+    stream.len = 0;
+
+    validate(sha1_init(&stream.ctx), "Failed to initialize hashing.");
+
+    unsigned char header[PACK_HEADER_SIZE];
+    memcpy(header, PACK_SIGNATURE, 4);
+    put_be32(&header[4], PACK_VERSION);
+    put_be32(&header[8], (uint32_t)objects->count);
+    validate(write_pack_bytes(&stream, header, PACK_HEADER_SIZE), "Failed to send pack header.");
+
+    for (size_t i = 0; i < objects->count; i++)
+    {
+        validate(write_pack_object(&stream, &objects->items[i]), "Failed to send object.");
+    }
+
+    unsigned char trailer[SHA_DIGEST_LENGTH];
+    sha1_final(&stream.ctx, trailer);
+
+    // The trailer is not part of what it hashes
+    validate(write_sideband(out, SIDEBAND_PACK_DATA, stream.buffer, stream.len), "Failed to send pack.");
+    validate(write_sideband(out, SIDEBAND_PACK_DATA, trailer, SHA_DIGEST_LENGTH), "Failed to send pack trailer.");
+
+    return true;
+
+error:
+    if (stream.ctx.md_ctx) sha1_final(&stream.ctx, (unsigned char[SHA_DIGEST_LENGTH]){ });
+
+    return false;
+}
+
+static bool add_oid_arg(unsigned char (**hashes)[SHA_DIGEST_LENGTH], size_t *count, const char *hex)
+{
+    unsigned char (*grown)[SHA_DIGEST_LENGTH] = realloc(*hashes, (*count + 1) * SHA_DIGEST_LENGTH);
+    validate(grown, "Failed to allocate memory.");
+    *hashes = grown;
+
+    validate(strlen(hex) == SHA_HEX_LENGTH && hash_hex_to_bytes((*hashes)[*count], hex), "Malformed object name '%s'.", hex);
+    (*count)++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool add_oid(unsigned char (**hashes)[SHA_DIGEST_LENGTH], size_t *count, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    unsigned char (*grown)[SHA_DIGEST_LENGTH] = realloc(*hashes, (*count + 1) * SHA_DIGEST_LENGTH);
+    validate(grown, "Failed to allocate memory.");
+    *hashes = grown;
+
+    memcpy((*hashes)[(*count)++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+// What a fetch from or into a shallow history changes on the client.
+// Commits at the requested depth become its new boundary; boundary
+// commits it had that now lie within the depth are unshallowed, and their
+// parents are sent. The walk treats every boundary commit on either side
+// as parentless.
+typedef struct shallow_info
+{
+    long depth;
+
+    unsigned char (*client_shallow)[SHA_DIGEST_LENGTH];
+    size_t client_shallow_count;
+    oid_map boundary;
+
+    unsigned char (*shallow)[SHA_DIGEST_LENGTH];
+    size_t shallow_count;
+    unsigned char (*unshallow)[SHA_DIGEST_LENGTH];
+    size_t unshallow_count;
+} shallow_info;
+
+static void release_shallow_info(shallow_info *info)
+{
+    if (info->client_shallow) free(info->client_shallow);
+    if (info->shallow) free(info->shallow);
+    if (info->unshallow) free(info->unshallow);
+    oid_map_destroy(&info->boundary);
+
+    *info = (shallow_info){ };
+}
+
+static bool is_client_shallow(const shallow_info *info, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    for (size_t i = 0; i < info->client_shallow_count; i++)
+    {
+        if (memcmp(info->client_shallow[i], hash, SHA_DIGEST_LENGTH) == 0) return true;
+    }
+
+    return false;
+}
+
+static commit *lookup_wanted_commit(const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    unsigned char target[SHA_DIGEST_LENGTH];
+    const unsigned char *current = hash;
+    while (peel_tag(current, target)) current = target;
+
+    char hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hex, current);
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    char *content = nullptr;
+    (void)get_object_content(hex, &content);
+    if (!content) return nullptr;
+
+    const bool is_commit = strncmp(content, "commit ", 7) == 0;
+    free(content);
+
+    commit *commit = is_commit ? lookup_commit(current) : nullptr;
+
+    return commit && parse_commit(commit) ? commit : nullptr;
+}
+
+// Breadth first from the wants, so each commit is met at its least depth;
+// the wants themselves are at depth 1
+static bool find_shallow_boundary(
+    shallow_info *info,
+    const unsigned char (*wants)[SHA_DIGEST_LENGTH],
+    const size_t want_count,
+    unsigned char (**extra_wants)[SHA_DIGEST_LENGTH],
+    size_t *extra_want_count)
+{
+    oid_map depths = { };
+    commit_list queue;
+    commit_list_init(&queue);
+
+    validate(oid_map_init(&depths, 1024), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < want_count; i++)
+    {
+        commit *commit = lookup_wanted_commit(wants[i]);
+        if (!commit || oid_map_contains(&depths, commit->hash)) continue;
+
+        validate(oid_map_put(&depths, commit->hash, 1) && commit_list_append(&queue, commit), "Failed to queue commit.");
+    }
+
+    for (size_t head = 0; head < queue.count; head++)
+    {
+        const commit *commit = queue.items[head];
+
+        uint64_t depth;
+        (void)oid_map_get(&depths, commit->hash, &depth);
+
+        if (commit->parent_count == 0) continue;
+
+        if ((long)depth >= info->depth)
+        {
+            if (!is_client_shallow(info, commit->hash)) validate(add_oid(&info->shallow, &info->shallow_count, commit->hash), "Failed to add shallow commit.");
+            validate(oid_map_put(&info->boundary, commit->hash, 0), "Failed to mark boundary.");
+            continue;
+        }
+
+        if (is_client_shallow(info, commit->hash))
+        {
+            validate(add_oid(&info->unshallow, &info->unshallow_count, commit->hash), "Failed to add unshallow commit.");
+
+            for (uint32_t i = 0; i < commit->parent_count; i++)
+            {
+                validate(add_oid(extra_wants, extra_want_count, commit->parents[i]->hash), "Failed to add want.");
+            }
+        }
+
+        for (uint32_t i = 0; i < commit->parent_count; i++)
+        {
+            struct commit *parent = commit->parents[i];
+            if (oid_map_contains(&depths, parent->hash)) continue;
+
+            validate(parse_commit(parent), "Failed to parse commit.");
+            validate(oid_map_put(&depths, parent->hash, depth + 1) && commit_list_append(&queue, parent), "Failed to queue commit.");
+        }
+    }
+
+    oid_map_destroy(&depths);
+    commit_list_destroy(&queue);
+
+    return true;
+
+error:
+    oid_map_destroy(&depths);
+    commit_list_destroy(&queue);
+
+    return false;
+}
+
+// The client's boundary commits stay parentless for the walk even when
+// unshallowed: the client has them, and the parents it lacks are wanted
+// explicitly instead
+static bool prepare_shallow_info(
+    shallow_info *info,
+    const unsigned char (*wants)[SHA_DIGEST_LENGTH],
+    const size_t want_count,
+    unsigned char (**extra_wants)[SHA_DIGEST_LENGTH],
+    size_t *extra_want_count)
+{
+    validate(oid_map_init(&info->boundary, 64), "Failed to allocate memory.");
+
+    for (size_t i = 0; i < info->client_shallow_count; i++)
+    {
+        validate(oid_map_put(&info->boundary, info->client_shallow[i], 0), "Failed to mark boundary.");
+    }
+
+    if (info->depth > 0) validate(find_shallow_boundary(info, wants, want_count, extra_wants, extra_want_count), "Failed to find the shallow boundary.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Commits this repository has no parents for are a boundary the client
+// has to take over when they are sent
+static bool add_own_shallow_commits(shallow_info *info, const object_list *objects)
+{
+    for (size_t i = 0; i < objects->count; i++)
+    {
+        const listed_object *object = &objects->items[i];
+        if (object->type != OBJ_COMMIT || !is_shallow_commit(object->hash)) continue;
+        if (is_client_shallow(info, object->hash) || oid_map_contains(&info->boundary, object->hash)) continue;
+
+        validate(add_oid(&info->shallow, &info->shallow_count, object->hash), "Failed to add shallow commit.");
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool write_shallow_info(FILE *out, const shallow_info *info)
+{
+    char hex[SHA_HEX_LENGTH + 1];
+    hex[SHA_HEX_LENGTH] = '\0';
+
+    validate(write_pkt_linef(out, "shallow-info\n"), "Failed to write response.");
+
+    for (size_t i = 0; i < info->shallow_count; i++)
+    {
+        hash_bytes_to_hex(hex, info->shallow[i]);
+        validate(write_pkt_linef(out, "shallow %s\n", hex), "Failed to write response.");
+    }
+
+    for (size_t i = 0; i < info->unshallow_count; i++)
+    {
+        hash_bytes_to_hex(hex, info->unshallow[i]);
+        validate(write_pkt_linef(out, "unshallow %s\n", hex), "Failed to write response.");
+    }
+
+    validate(write_pkt_delim(out), "Failed to write response.");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Without "done", the haves this side has are acknowledged, and once any
+// is in common the pack follows right away ("ready"). Otherwise the client
+// is left to send more haves in its next request.
+// "filter blob:none" leaves blobs out of the pack, except those wanted by
+// name, as a partial clone asks for them. "deepen <n>" cuts the history
+// sent at n commits from the wants, and "shallow" lines name the
+// client's own boundary; the changes to it go in a shallow-info section
+// ahead of the pack.
+static bool upload_fetch(FILE *out, const request_args *args)
+{
+    unsigned char (*wants)[SHA_DIGEST_LENGTH] = nullptr;
+    unsigned char (*haves)[SHA_DIGEST_LENGTH] = nullptr;
+    size_t want_count = 0;
+    size_t have_count = 0;
+    object_list objects = { };
+    shallow_info shallow = { };
+
+    bool is_done = false;
+    bool is_progress = true;
+    list_filter filter = LIST_FILTER_NONE;
+
+    for (size_t i = 0; i < args->count; i++)
+    {
+        const char *line = args->lines[i];
+
+        if (strncmp(line, "want ", 5) == 0)
+        {
+            validate(add_oid_arg(&wants, &want_count, &line[5]), "Invalid want.");
+            validate(has_object(wants[want_count - 1]), "upload-pack: not our ref %s", &line[5]);
+        }
+        else if (strncmp(line, "have ", 5) == 0)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(strlen(&line[5]) == SHA_HEX_LENGTH && hash_hex_to_bytes(hash, &line[5]), "Malformed have '%s'.", line);
+
+            if (has_object(hash)) validate(add_oid_arg(&haves, &have_count, &line[5]), "Invalid have.");
+        }
+        else if (strncmp(line, "shallow ", 8) == 0)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(strlen(&line[8]) == SHA_HEX_LENGTH && hash_hex_to_bytes(hash, &line[8]), "Malformed shallow '%s'.", line);
+
+            if (has_object(hash)) validate(add_oid_arg(&shallow.client_shallow, &shallow.client_shallow_count, &line[8]), "Invalid shallow.");
+        }
+        else if (strncmp(line, "deepen ", 7) == 0)
+        {
+            char *end;
+            shallow.depth = strtol(&line[7], &end, 10);
+            validate(*end == '\0' && shallow.depth > 0, "upload-pack: invalid depth '%s'", &line[7]);
+        }
+        else if (strcmp(line, "done") == 0)
+        {
+            is_done = true;
+        }
+        else if (strcmp(line, "no-progress") == 0)
+        {
+            is_progress = false;
+        }
+        else if (strncmp(line, "filter ", 7) == 0)
+        {
+            validate(strcmp(&line[7], "blob:none") == 0, "upload-pack: unsupported filter '%s'", &line[7]);
+            filter = LIST_FILTER_BLOB_NONE;
+        }
+    }
+
+    validate(want_count, "Fetch request without wants.");
+
+    if (!is_done)
+    {
+        validate(write_pkt_linef(out, "acknowledgments\n"), "Failed to write response.");
+
+        char hex[SHA_HEX_LENGTH + 1];
+        for (size_t i = 0; i < have_count; i++)
+        {
+            hash_bytes_to_hex(hex, haves[i]);
+            hex[SHA_HEX_LENGTH] = '\0';
+            validate(write_pkt_linef(out, "ACK %s\n", hex), "Failed to write response.");
+        }
+
+        if (!have_count)
+        {
+            validate(write_pkt_linef(out, "NAK\n"), "Failed to write response.");
+            validate(write_pkt_flush(out), "Failed to write response.");
+
+            free(wants);
+            release_shallow_info(&shallow);
+
+            return true;
+        }
+
+        validate(write_pkt_linef(out, "ready\n"), "Failed to write response.");
+        validate(write_pkt_delim(out), "Failed to write response.");
+    }
+
+    const size_t requested_want_count = want_count;
+    validate(prepare_shallow_info(&shallow, wants, requested_want_count, &wants, &want_count), "Failed to prepare shallow fetch.");
+
+    const list_objects_options options = {
+        .filter = filter,
+        .shallow = shallow.client_shallow_count || shallow.depth ? &shallow.boundary : nullptr,
+        .use_bitmap_index = true,
+    };
+    validate(list_objects(wants, want_count, haves, have_count, &options, &objects), "Failed to list objects.");
+    validate(add_own_shallow_commits(&shallow, &objects), "Failed to add shallow commits.");
+
+    if (shallow.depth || shallow.shallow_count || shallow.unshallow_count)
+    {
+        validate(write_shallow_info(out, &shallow), "Failed to write shallow info.");
+    }
+
+    validate(write_pkt_linef(out, "packfile\n"), "Failed to write response.");
+
+    if (is_progress)
+    {
+        char progress[64];
+        const int len = snprintf(progress, sizeof(progress), "Total %zu objects\n", objects.count);
+        validate(write_sideband(out, SIDEBAND_PROGRESS, progress, len), "Failed to send progress.");
+    }
+
+    validate(send_pack(out, &objects), "Failed to send pack.");
+    validate(write_pkt_flush(out), "Failed to write response.");
+
+    object_list_destroy(&objects);
+    release_shallow_info(&shallow);
+    free(wants);
+    if (haves) free(haves);
+
+    return true;
+
+error:
+    object_list_destroy(&objects);
+    release_shallow_info(&shallow);
+    if (wants) free(wants);
+    if (haves) free(haves);
+
+    return false;
+}
+
+// A request is "command=<name>", capability lines, a delimiter, then the
+// command's arguments up to a flush. A flush or the end of the stream in
+// place of a request ends the session.
+static bool serve_command(pkt_reader *reader, FILE *out, bool *is_end)
+{
+    request_args args = { };
+    char command[64] = "";
+    *is_end = false;
+
+    pkt_type type;
+    validate(read_pkt_line(reader, &type), "Failed to read request.");
+
+    if (type == PKT_EOF || type == PKT_FLUSH)
+    {
+        *is_end = true;
+        return true;
+    }
+
+    validate(type == PKT_DATA && strncmp(reader->line, "command=", 8) == 0, "Expected a command, got '%s'.", reader->line);
+    (void)snprintf(command, sizeof(command), "%.*s", (int)strcspn(&reader->line[8], "\n"), &reader->line[8]);
+
+    bool is_args = false;
+
+    while (true)
+    {
+        validate(read_pkt_line(reader, &type), "Failed to read request.");
+        validate(type != PKT_EOF, "Request ended early.");
+
+        if (type == PKT_FLUSH) break;
+
+        if (type == PKT_DELIM)
+        {
+            is_args = true;
+            continue;
+        }
+
+        // Capabilities sent along, such as agent=, are not needed
+        if (is_args) validate(add_request_arg(&args, reader->line, reader->line_len), "Failed to read request.");
+    }
+
+    if (strcmp(command, "ls-refs") == 0)
+    {
+        validate(ls_refs(out, &args), "Failed to list refs.");
+    }
+    else if (strcmp(command, "fetch") == 0)
+    {
+        validate(upload_fetch(out, &args), "Failed to serve fetch.");
+    }
+    else
+    {
+        (void)write_pkt_linef(out, "ERR unknown command '%s'\n", command);
+        validate(false, "Unknown command '%s'.", command);
+    }
+
+    validate(fflush(out) == 0, "Failed to write response.");
+
+    release_request_args(&args);
+
+    return true;
+
+error:
+    release_request_args(&args);
+
+    return false;
+}
+
+// upload-pack [--stateless-rpc] [--advertise-refs] <directory>
+// Serves protocol v2 on stdin/stdout: the capability advertisement, then
+// ls-refs and fetch commands until the client hangs up. In stateless-rpc
+// mode, for smart HTTP, each run either only advertises or answers a
+// single request.
+int upload_pack(const int argc, char *argv[])
+{
+    static pkt_reader reader;
+
+    validate(try_resolve_upload_pack_opts(argc, argv), "Failed to resolve options.");
+
+    const char *dir = argv[argc - 1];
+    validate(chdir(dir) == 0, "Cannot access '%s'.", dir);
+
+    (void)setvbuf(stdout, nullptr, _IOFBF, UPLOAD_PACK_OUTPUT_BUFFER_SIZE);
+
+    if (!stateless_rpc_opt || advertise_refs_opt)
+    {
+        validate(write_capabilities(stdout), "Failed to advertise capabilities.");
+        validate(fflush(stdout) == 0, "Failed to advertise capabilities.");
+    }
+
+    if (advertise_refs_opt) return 0;
+
+    init_pkt_reader(&reader, STDIN_FILENO);
+
+    bool is_end = false;
+
+    do
+    {
+        validate(serve_command(&reader, stdout, &is_end), "Failed to serve request.");
+    } while (!is_end && !stateless_rpc_opt);
+
+    return 0;
+
+error:
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef UPLOAD_PACK_H
+#define UPLOAD_PACK_H
+
+int upload_pack(int argc, char *argv[]);
+
+#endif //UPLOAD_PACK_H
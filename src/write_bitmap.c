@@ -0,0 +1,101 @@
+#include "write_bitmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug_helpers.h"
+#include "pack_bitmap.h"
+#include "packfile.h"
+#include "refs.h"
+
+typedef struct bitmap_tips
+{
+    unsigned char (*hashes)[SHA_DIGEST_LENGTH];
+    size_t count;
+    size_t capacity;
+} bitmap_tips;
+
+static bool add_tip(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    (void)refname;
+    bitmap_tips *tips = data;
+
+    if (tips->count == tips->capacity)
+    {
+        const size_t capacity = tips->capacity ? tips->capacity * 2 : 64;
+
+        unsigned char (*hashes)[SHA_DIGEST_LENGTH] = realloc(tips->hashes, capacity * SHA_DIGEST_LENGTH);
+        validate(hashes, "Failed to allocate memory.");
+
+        tips->hashes = hashes;
+        tips->capacity = capacity;
+    }
+
+    memcpy(tips->hashes[tips->count++], hash, SHA_DIGEST_LENGTH);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Matches a pack by its path, with or without .pack or .idx at the end
+static packed_git *find_pack(const char *name)
+{
+    const size_t name_len = strlen(name);
+    size_t stem_len = name_len;
+
+    if (name_len > 5 && strcmp(&name[name_len - 5], ".pack") == 0) stem_len -= 5;
+    else if (name_len > 4 && strcmp(&name[name_len - 4], ".idx") == 0) stem_len -= 4;
+
+    for (packed_git *pack = get_packed_git_list(); pack; pack = pack->next)
+    {
+        const size_t pack_stem_len = strlen(pack->pack_path) - 5;
+        if (pack_stem_len < stem_len) continue;
+
+        const char *stem = &pack->pack_path[pack_stem_len - stem_len];
+        const bool is_boundary = pack_stem_len == stem_len || stem[-1] == '/';
+
+        if (is_boundary && memcmp(stem, name, stem_len) == 0) return pack;
+    }
+
+    return nullptr;
+}
+
+// write-bitmap [<pack>]
+int write_bitmap(const int argc, char *argv[])
+{
+    bitmap_tips tips = { };
+    packed_git *pack = nullptr;
+
+    validate(argc <= 3, "Usage: write-bitmap [<pack>]");
+
+    if (argc == 3)
+    {
+        pack = find_pack(argv[2]);
+        validate(pack, "No pack named '%s'.", argv[2]);
+    }
+    else
+    {
+        pack = get_packed_git_list();
+        validate(pack, "The repository has no packs.");
+        validate(!pack->next, "The repository has several packs; name the one to bitmap.");
+    }
+
+    // Bitmaps are selected from what the refs and HEAD point at
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+    if (resolve_ref("HEAD", nullptr, head_hash)) validate(add_tip("HEAD", head_hash, &tips), "Failed to add HEAD.");
+
+    validate(for_each_ref(add_tip, &tips), "Failed to read refs.");
+    validate(write_pack_bitmap(pack, tips.hashes, tips.count), "Failed to write bitmap for '%s'.", pack->pack_path);
+
+    if (tips.hashes) free(tips.hashes);
+
+    return 0;
+
+error:
+    if (tips.hashes) free(tips.hashes);
+
+    return 1;
+}
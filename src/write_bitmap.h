@@ -0,0 +1,6 @@
+#ifndef WRITE_BITMAP_H
+#define WRITE_BITMAP_H
+
+int write_bitmap(int argc, char *argv[]);
+
+#endif //WRITE_BITMAP_H
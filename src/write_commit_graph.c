@@ -0,0 +1,124 @@
+#include "write_commit_graph.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit_graph.h"
+#include "debug_helpers.h"
+#include "git_obj_helpers.h"
+#include "refs.h"
+
+bool changed_paths_opt = false;
+
+typedef struct graph_tips
+{
+    unsigned char (*hashes)[SHA_DIGEST_LENGTH];
+    size_t count;
+    size_t capacity;
+} graph_tips;
+
+static bool try_resolve_write_commit_graph_opts(const int argc, char *argv[])
+{
+    opterr = 0;
+
+    const struct option long_opts[] = {
+        { "changed-paths", no_argument, nullptr, 'p' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                changed_paths_opt = true;
+                break;
+            case '?':
+                validate(false, "Invalid switch: '%c'\n", optopt);
+            default:
+                validate(false, "Unrecognized option: '%c'\n", optopt);
+        }
+    }
+
+    validate(optind + 1 == argc, "Usage: write-commit-graph [--changed-paths]");
+
+    return true;
+
+error:
+    return false;
+}
+
+// Refs may point at annotated tags, which are peeled, or at trees and blobs,
+// which have no history to index and are skipped
+static bool add_tip(const char *refname, const unsigned char hash[SHA_DIGEST_LENGTH], void *data)
+{
+    graph_tips *tips = data;
+    char *content = nullptr;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, hash);
+
+    (void)get_object_content(hash_hex, &content);
+    validate(content, "Failed to read '%s'.", refname);
+
+    char obj_type[16];
+    get_object_type(obj_type, content);
+    free(content);
+    content = nullptr;
+
+    if (strcmp(obj_type, "tag") == 0)
+    {
+        if (!resolve_commit_hex(hash_hex, hash_hex)) return true;
+    }
+    else if (strcmp(obj_type, "commit") != 0)
+    {
+        return true;
+    }
+
+    if (tips->count == tips->capacity)
+    {
+        const size_t capacity = tips->capacity ? tips->capacity * 2 : 64;
+
+        unsigned char (*hashes)[SHA_DIGEST_LENGTH] = realloc(tips->hashes, capacity * SHA_DIGEST_LENGTH);
+        validate(hashes, "Failed to allocate memory.");
+
+        tips->hashes = hashes;
+        tips->capacity = capacity;
+    }
+
+    validate(hash_hex_to_bytes(tips->hashes[tips->count], hash_hex), "Malformed object name '%s'.", hash_hex);
+    tips->count++;
+
+    return true;
+
+error:
+    if (content) free(content);
+
+    return false;
+}
+
+// write-commit-graph [--changed-paths]
+int write_commit_graph(const int argc, char *argv[])
+{
+    graph_tips tips = { };
+
+    validate(try_resolve_write_commit_graph_opts(argc, argv), "Failed to resolve options.");
+
+    // The graph covers every commit reachable from HEAD and the refs
+    unsigned char head_hash[SHA_DIGEST_LENGTH];
+    if (resolve_ref("HEAD", nullptr, head_hash)) validate(add_tip("HEAD", head_hash, &tips), "Failed to add HEAD.");
+
+    validate(for_each_ref(add_tip, &tips), "Failed to read refs.");
+    validate(write_reachable_commit_graph(tips.hashes, tips.count, changed_paths_opt), "Failed to write commit-graph.");
+
+    if (tips.hashes) free(tips.hashes);
+
+    return 0;
+
+error:
+    if (tips.hashes) free(tips.hashes);
+
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef WRITE_COMMIT_GRAPH_H
+#define WRITE_COMMIT_GRAPH_H
+
+int write_commit_graph(int argc, char *argv[]);
+
+#endif //WRITE_COMMIT_GRAPH_H
@@ -6,9 +6,47 @@
 #include <sys/stat.h>
 
 #include "debug_helpers.h"
+#include "fsmonitor.h"
 #include "git_dir_helpers.h"
 #include "git_obj_helpers.h"
+#include "index_file.h"
+#include "sparse_cone.h"
 #include "stack.h"
+#include "trace.h"
+#include "tree_cache.h"
+
+// State for fsmonitor-driven incremental snapshots. Directories the monitor
+// reports as unchanged are not rescanned; their tree oids come from the cache
+// written by the previous write-tree.
+typedef struct incremental_state
+{
+    bool is_enabled;
+    size_t root_path_len;
+    fsmonitor_changes changes;
+    tree_cache previous;
+    tree_cache current;
+} incremental_state;
+
+static incremental_state incremental = { .is_enabled = false };
+
+// In a sparse checkout the subtrees outside the cone are not in the
+// worktree; their trees come from the index instead. A sparse index holds
+// their oids as they are; a full one has their skip-worktree entries.
+typedef struct sparse_state
+{
+    bool is_enabled;
+    size_t root_path_len;
+    index_state index;
+    sparse_cone cone;
+} sparse_state;
+
+static sparse_state sparse = { .is_enabled = false };
+
+typedef struct skipped_entry
+{
+    char *name;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} skipped_entry;
 
 static bool is_executable(const mode_t filemode)
 {
@@ -21,9 +59,10 @@ static bool append_blob_entry(
     const mode_t filemode,
     char *file_full_path)
 {
-    FILE *blob_data = nullptr;
+    char hash_hex[SHA_HEX_LENGTH + 1];
     unsigned char hash[SHA_DIGEST_LENGTH];
-    validate(create_blob(file_full_path, &blob_data, hash), "Failed to create a blob object.");
+    validate(write_blob_object(file_full_path, hash_hex), "Failed to write a blob object.");
+    validate(hash_hex_to_bytes(hash, hash_hex), "Invalid blob hash '%s'.", hash_hex);
 
     const char *permissions = is_executable(filemode)
         ? "100755"
@@ -35,25 +74,17 @@ static bool append_blob_entry(
     fputc('\0', tree_content);
     fwrite(hash, sizeof(char), SHA_DIGEST_LENGTH, tree_content);
 
-    fclose(blob_data);
-
     return true;
 
 error:
-    if (blob_data) fclose(blob_data);
-
     return false;
 }
 
-static bool append_tree_entry(
+static void append_tree_entry_hash(
     FILE *parent_tree_content,
     const char *dir_entry_name,
-    const buffer *tree_data_buffer)
+    const unsigned char hash[SHA_DIGEST_LENGTH])
 {
-    FILE *tree_data = nullptr;
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    validate(create_tree(tree_data_buffer, &tree_data, hash), "Failed to create a tree object.");
-
     const char *permissions = "40000";
 
     fwrite(permissions, sizeof(char), 5, parent_tree_content);
@@ -61,12 +92,23 @@ static bool append_tree_entry(
     fwrite(dir_entry_name, sizeof(char), strlen(dir_entry_name), parent_tree_content);
     fputc('\0', parent_tree_content);
     fwrite(hash, sizeof(char), SHA_DIGEST_LENGTH, parent_tree_content);
+}
+
+static bool append_tree_entry(
+    FILE *parent_tree_content,
+    const char *dir_entry_name,
+    const buffer *tree_data_buffer,
+    unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    validate(write_tree_object(tree_data_buffer, hash_hex), "Failed to write a tree object.");
+    validate(hash_hex_to_bytes(hash, hash_hex), "Invalid tree hash '%s'.", hash_hex);
+
+    append_tree_entry_hash(parent_tree_content, dir_entry_name, hash);
 
     return true;
 
 error:
-    if (tree_data) fclose(tree_data);
-
     return false;
 }
 
@@ -82,6 +124,11 @@ typedef struct dir_processing_frame
     // git_dir_data
     FILE *data_stream;
     buffer *buffer;
+
+    // Subtrees taken from the index, sorted by name like dir_entries
+    skipped_entry *skipped;
+    size_t skipped_count;
+    size_t current_skipped_index;
 } dir_processing_frame;
 
 static void destroy_dir_processing_frame(dir_processing_frame *frame)
@@ -108,6 +155,9 @@ static void destroy_dir_processing_frame(dir_processing_frame *frame)
         free(frame->buffer);
     }
 
+    for (size_t i = 0; i < frame->skipped_count; i++) free(frame->skipped[i].name);
+    if (frame->skipped) free(frame->skipped);
+
     free(frame);
 }
 
@@ -121,12 +171,121 @@ static int include_dir(const struct dirent *dir_entry)
     return 1;
 }
 
+static bool add_skipped_entry(dir_processing_frame *frame, const char *name, const size_t name_len, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    skipped_entry *skipped = realloc(frame->skipped, (frame->skipped_count + 1) * sizeof(skipped_entry));
+    validate(skipped, "Failed to allocate memory.");
+    frame->skipped = skipped;
+
+    skipped_entry *entry = &frame->skipped[frame->skipped_count];
+    entry->name = strndup(name, name_len);
+    validate(entry->name, "Failed to allocate memory.");
+    memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+
+    frame->skipped_count++;
+
+    return true;
+
+error:
+    return false;
+}
+
+static int compare_skipped_entries(const void *a, const void *b)
+{
+    return strcmp(((const skipped_entry *)a)->name, ((const skipped_entry *)b)->name);
+}
+
+// The subdirectories of a frame that lie outside the cone. Files, and
+// directories inside the cone, are read from the worktree as usual.
+static bool collect_skipped_entries(dir_processing_frame *frame)
+{
+    if (!sparse.is_enabled) return true;
+
+    const char *rel_path = frame->path[sparse.root_path_len] == '/' ? &frame->path[sparse.root_path_len + 1] : "";
+
+    char prefix[PATH_MAX];
+    const int prefix_len = snprintf(prefix, PATH_MAX, rel_path[0] ? "%s/" : "%s", rel_path);
+    validate(prefix_len >= 0 && prefix_len < PATH_MAX, "Path too long.");
+
+    const index_state *index = &sparse.index;
+    size_t pos = find_index_pos(index, prefix);
+
+    while (pos < index->count && strncmp(index->entries[pos].path, prefix, prefix_len) == 0)
+    {
+        const index_entry *entry = &index->entries[pos];
+        const char *name = &entry->path[prefix_len];
+        const char *slash = strchr(name, '/');
+
+        if (!slash)
+        {
+            pos++;
+            continue;
+        }
+
+        const size_t subdir_len = slash - entry->path;
+
+        if (slash[1] == '\0')
+        {
+            validate(add_skipped_entry(frame, name, slash - name, entry->hash), "Failed to add '%s'.", entry->path);
+            pos++;
+        }
+        else if (match_cone_dir(&sparse.cone, entry->path, subdir_len) == CONE_OUTSIDE)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            validate(write_index_tree(index, entry->path, subdir_len + 1, &pos, hash), "Failed to write '%s'.", entry->path);
+            validate(add_skipped_entry(frame, name, slash - name, hash), "Failed to add '%s'.", entry->path);
+        }
+        else
+        {
+            // Everything below "dir/" sorts before "dir0"
+            char next[PATH_MAX];
+            memcpy(next, entry->path, subdir_len);
+            next[subdir_len] = '/' + 1;
+            next[subdir_len + 1] = '\0';
+
+            pos = find_index_pos(index, next);
+        }
+    }
+
+    qsort(frame->skipped, frame->skipped_count, sizeof(skipped_entry), compare_skipped_entries);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Appends the skipped subtrees that sort up to name, or all that are left
+// when name is nullptr. True when one of them is name itself, which then
+// takes the place of whatever the worktree has there.
+static bool append_skipped_entries(dir_processing_frame *frame, const char *name)
+{
+    bool is_name_skipped = false;
+
+    while (frame->current_skipped_index < frame->skipped_count)
+    {
+        const skipped_entry *entry = &frame->skipped[frame->current_skipped_index];
+
+        const int cmp = name ? strcmp(entry->name, name) : -1;
+        if (cmp > 0) break;
+
+        append_tree_entry_hash(frame->data_stream, entry->name, entry->hash);
+        frame->current_skipped_index++;
+        is_name_skipped = cmp == 0;
+    }
+
+    return is_name_skipped;
+}
+
 static bool push_dir_for_processing(Stack *dirs, char *path)
 {
     dir_processing_frame *frame = malloc(sizeof(dir_processing_frame));
     validate(frame, "Failed to allocate memory.");
 
     frame->path = path;
+    frame->skipped = nullptr;
+    frame->skipped_count = 0;
+    frame->current_skipped_index = 0;
 
     frame->buffer = malloc(sizeof(buffer));
     validate(frame->buffer, "Failed to allocate memory.");
@@ -138,8 +297,11 @@ static bool push_dir_for_processing(Stack *dirs, char *path)
 
     frame->current_dir_index = 0;
     frame->dir_entries_count = scandir(path, &frame->dir_entries, include_dir, alphasort);
+    trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
     validate(frame->dir_entries_count != -1, "Failed to scan directory entries.");
 
+    validate(collect_skipped_entries(frame), "Failed to read '%s' from the index.", path);
+
     Stack_push(dirs, frame);
 
     return true;
@@ -151,6 +313,49 @@ error:
     return false;
 }
 
+static const char *get_relative_path(const char *full_path)
+{
+    return full_path[incremental.root_path_len] == '/'
+        ? &full_path[incremental.root_path_len + 1]
+        : "";
+}
+
+static void record_tree_hash(const char *full_path, const unsigned char hash[SHA_DIGEST_LENGTH])
+{
+    if (!incremental.is_enabled) return;
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
+    hash_bytes_to_hex(hash_hex, hash);
+
+    if (!add_tree_cache_entry(&incremental.current, get_relative_path(full_path), hash_hex))
+    {
+        incremental.is_enabled = false;
+    }
+}
+
+// Appends the cached tree of an unchanged subdirectory instead of rescanning it
+static bool try_reuse_cached_tree(FILE *tree_content, const char *dir_entry_name, const char *dir_full_path)
+{
+    if (!incremental.is_enabled) return false;
+
+    const char *rel_path = get_relative_path(dir_full_path);
+
+    if (!is_dir_unchanged(&incremental.changes, rel_path)) return false;
+
+    const tree_cache_entry *cached = find_tree_cache_entry(&incremental.previous, rel_path);
+    if (!cached) return false;
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    if (!hash_hex_to_bytes(hash, cached->hash_hex)) return false;
+
+    if (!copy_tree_cache_subtree(&incremental.current, &incremental.previous, rel_path)) return false;
+
+    append_tree_entry_hash(tree_content, dir_entry_name, hash);
+    trace_counter_add(TRACE_COUNTER_CACHE_HITS, 1);
+
+    return true;
+}
+
 static bool process_dir(Stack *dirs, dir_processing_frame *frame)
 {
     while (frame->current_dir_index < frame->dir_entries_count)
@@ -166,7 +371,18 @@ static bool process_dir(Stack *dirs, dir_processing_frame *frame)
 
         (void)snprintf(file_full_path, PATH_MAX, "%s/%s", frame->path, dir_name);
 
+        if (append_skipped_entries(frame, dir_name))
+        {
+            free(frame->dir_entries[frame->current_dir_index]);
+            frame->dir_entries[frame->current_dir_index] = nullptr;
+            frame->current_dir_index++;
+
+            free(file_full_path);
+            continue;
+        }
+
         struct stat fs;
+        trace_counter_add(TRACE_COUNTER_SYSCALLS, 1);
         validate(stat(file_full_path, &fs) == 0, "Failed to stat file '%s'.", file_full_path);
 
         free(frame->dir_entries[frame->current_dir_index]);
@@ -181,6 +397,12 @@ static bool process_dir(Stack *dirs, dir_processing_frame *frame)
         }
         else if (S_ISDIR(fs.st_mode))
         {
+            if (try_reuse_cached_tree(frame->data_stream, dir_name, file_full_path))
+            {
+                free(file_full_path);
+                continue;
+            }
+
             bool result = push_dir_for_processing(dirs, file_full_path);
             validate(result, "Failed to push subdir '%s' on stack.", file_full_path);
 
@@ -201,15 +423,110 @@ static bool is_dir_fully_processed(const dir_processing_frame *frame)
     return frame->current_dir_index >= frame->dir_entries_count;
 }
 
+static void begin_incremental_snapshot(const char *root)
+{
+    if (!is_fsmonitor_enabled()) return;
+
+    init_tree_cache(&incremental.previous);
+    init_tree_cache(&incremental.current);
+    (void)load_tree_cache(&incremental.previous);
+
+    // Without an answer from the monitor this is a plain full scan
+    if (!query_fsmonitor(incremental.previous.token, &incremental.changes))
+    {
+        destroy_tree_cache(&incremental.previous);
+        return;
+    }
+
+    incremental.root_path_len = strlen(root);
+    incremental.is_enabled = true;
+}
+
+static void end_incremental_snapshot(const tree_cache *snapshot)
+{
+    if (!incremental.is_enabled) return;
+
+    if (snapshot) (void)save_tree_cache(snapshot, incremental.changes.token);
+
+    destroy_fsmonitor_changes(&incremental.changes);
+    destroy_tree_cache(&incremental.previous);
+    destroy_tree_cache(&incremental.current);
+
+    incremental.is_enabled = false;
+}
+
+static bool begin_sparse_snapshot(const char *root)
+{
+    validate(load_sparse_cone(&sparse.cone), "Failed to read the sparse-checkout patterns.");
+    if (!sparse.cone.is_enabled) return true;
+
+    validate(read_index(&sparse.index), "Failed to read the index.");
+
+    sparse.root_path_len = strlen(root);
+    sparse.is_enabled = true;
+
+    return true;
+
+error:
+    release_sparse_cone(&sparse.cone);
+
+    return false;
+}
+
+static void end_sparse_snapshot(void)
+{
+    release_index(&sparse.index);
+    release_sparse_cone(&sparse.cone);
+
+    sparse.is_enabled = false;
+}
+
+static bool try_print_unchanged_snapshot(void)
+{
+    if (!incremental.is_enabled || !is_dir_unchanged(&incremental.changes, "")) return false;
+
+    const tree_cache_entry *cached_root = find_tree_cache_entry(&incremental.previous, "");
+    if (!cached_root) return false;
+
+    trace_counter_add(TRACE_COUNTER_CACHE_HITS, 1);
+
+    trace_region_enter("write-tree", "output");
+    printf("%s", cached_root->hash_hex);
+    trace_region_leave("write-tree", "output");
+
+    end_incremental_snapshot(&incremental.previous);
+
+    return true;
+}
+
 int write_tree()
 {
-    char *repo_root_path = malloc(PATH_MAX);
+    Stack *dirs = nullptr;
+    char *repo_root_path = nullptr;
+
+    // The cached root, so discovery runs once however often the object
+    // store asks for it; the root frame owns a copy like every other frame
+    const char *repo_root = get_repository_root();
+    validate(repo_root, "Not a git repository.");
+
+    repo_root_path = strdup(repo_root);
     validate(repo_root_path, "Failed to allocate memory");
 
-    char *root = find_repository_root_dir(repo_root_path, PATH_MAX);
-    validate(root, "Not a git repository.");
+    char *root = repo_root_path;
 
-    Stack *dirs = Stack_create();
+    validate(begin_sparse_snapshot(root), "Failed to prepare the sparse checkout.");
+    begin_incremental_snapshot(root);
+
+    if (try_print_unchanged_snapshot())
+    {
+        end_sparse_snapshot();
+        free(repo_root_path);
+        return 0;
+    }
+
+    dirs = Stack_create();
+
+    trace_region_enter("write-tree", "scan");
 
     bool result = push_dir_for_processing(dirs, root);
     validate(result, "Failed to push subdir '%s' on stack.", root);
@@ -222,6 +539,8 @@ int write_tree()
 
         if (is_dir_fully_processed(curr))
         {
+            (void)append_skipped_entries(curr, nullptr);
+
             fclose(curr->data_stream);
             curr->data_stream = nullptr;
 
@@ -231,7 +550,12 @@ int write_tree()
 
             if (parent)
             {
-                append_tree_entry(parent->data_stream, get_dir_name(curr->path), curr->buffer);
+                unsigned char hash[SHA_DIGEST_LENGTH];
+                result = append_tree_entry(parent->data_stream, get_dir_name(curr->path), curr->buffer, hash);
+                validate(result, "Failed to write tree entry for '%s'.", curr->path);
+
+                record_tree_hash(curr->path, hash);
+                destroy_dir_processing_frame(curr);
             }
         }
         else
@@ -241,18 +565,31 @@ int write_tree()
         }
     }
 
-    char hash_hex[SHA_HEX_LENGTH];
+    trace_region_leave("write-tree", "scan");
+
+    char hash_hex[SHA_HEX_LENGTH + 1];
     char *hash = write_tree_object(curr->buffer, hash_hex);
     validate(hash, "Failed to write tree.");
 
+    trace_region_enter("write-tree", "output");
     printf("%s", hash_hex);
+    trace_region_leave("write-tree", "output");
+
+    if (incremental.is_enabled)
+    {
+        (void)add_tree_cache_entry(&incremental.current, "", hash_hex);
+        end_incremental_snapshot(&incremental.current);
+    }
 
     destroy_dir_processing_frame(curr);
     Stack_destroy(dirs, (StackElemCleaner)destroy_dir_processing_frame);
+    end_sparse_snapshot();
 
     return 0;
 
 error:
+    end_incremental_snapshot(nullptr);
+    end_sparse_snapshot();
     if (repo_root_path) free(repo_root_path);
     if (dirs) Stack_destroy(dirs, (StackElemCleaner)destroy_dir_processing_frame);
 
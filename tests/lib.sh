@@ -0,0 +1,25 @@
+# Sourced by every test script, which ctest runs with the git binary under
+# test as $1. Each test starts in a new empty repository in a temporary
+# directory that is removed on exit.
+
+set -eu
+
+GIT=$1
+
+GIT_AUTHOR_NAME="A U Thor"
+GIT_AUTHOR_EMAIL="author@example.com"
+GIT_COMMITTER_NAME="C O Mitter"
+GIT_COMMITTER_EMAIL="committer@example.com"
+export GIT_AUTHOR_NAME GIT_AUTHOR_EMAIL GIT_COMMITTER_NAME GIT_COMMITTER_EMAIL
+
+TEST_DIR=$(mktemp -d)
+trap 'rm -rf "$TEST_DIR"' EXIT
+
+cd "$TEST_DIR"
+"$GIT" init >/dev/null 2>&1
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
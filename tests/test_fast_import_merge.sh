@@ -0,0 +1,56 @@
+# fast-import writes one parent line per "parent" header, so merges import
+. "$(dirname "$0")/lib.sh"
+
+"$GIT" fast-import >out 2>/dev/null <<'IN'
+blob
+mark :1
+data 6
+hello
+
+tree
+mark :2
+100644 :1 hello.txt
+
+commit
+mark :3
+tree :2
+author A U Thor <author@example.com> 1700000000 +0000
+committer C O Mitter <committer@example.com> 1700000000 +0000
+data 5
+base
+
+commit
+mark :4
+tree :2
+parent :3
+author A U Thor <author@example.com> 1700000001 +0000
+committer C O Mitter <committer@example.com> 1700000001 +0000
+data 5
+side
+
+commit
+mark :5
+tree :2
+parent :3
+parent :4
+author A U Thor <author@example.com> 1700000002 +0000
+committer C O Mitter <committer@example.com> 1700000002 +0000
+data 6
+merge
+IN
+
+base=$(sed -n 3p out)
+side=$(sed -n 4p out)
+merge=$(sed -n 5p out)
+
+"$GIT" cat-file -p "$merge" >merge.txt
+[ "$(grep -c '^parent ' merge.txt)" -eq 2 ] || fail "expected two parent lines"
+[ "$(grep '^parent ' merge.txt | sed -n 1p)" = "parent $base" ] || fail "first parent is not the base"
+[ "$(grep '^parent ' merge.txt | sed -n 2p)" = "parent $side" ] || fail "second parent is not the side"
+
+# tree, author and committer still appear once at most
+printf 'commit\ntree %s\ntree %s\nauthor A <a@b> 1 +0000\ndata 1\nx\n' \
+    "$(sed -n 2p out)" "$(sed -n 2p out)" | "$GIT" fast-import >/dev/null 2>&1 \
+    && fail "a duplicate tree header was accepted"
+
+exit 0
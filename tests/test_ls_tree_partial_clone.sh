@@ -0,0 +1,42 @@
+# In a blob:none partial clone, ls-tree takes entry types from their modes
+# and never fetches the blobs it lists
+. "$(dirname "$0")/lib.sh"
+
+mkdir src
+(
+    cd src
+    "$GIT" init >/dev/null 2>&1
+    echo one >one.txt
+    mkdir dir
+    echo two >dir/two.txt
+    tree=$("$GIT" write-tree)
+    commit=$("$GIT" commit-tree "$tree" -m initial)
+    "$GIT" update-ref refs/heads/main "$commit"
+    echo "$tree" >../tree
+)
+
+# Every request to the promisor remote goes through this, and is logged
+cat >upload-pack.sh <<UP
+#!/bin/sh
+echo call >>"$TEST_DIR/fetches"
+exec "$GIT" upload-pack "\$@"
+UP
+chmod +x upload-pack.sh
+
+"$GIT" fetch --filter=blob:none --upload-pack="$TEST_DIR/upload-pack.sh" "$TEST_DIR/src" \
+    'refs/heads/*:refs/remotes/origin/*' >/dev/null 2>&1 || fail "the partial clone failed"
+[ "$(wc -l <fetches)" -eq 1 ] || fail "expected one fetch for the clone"
+
+tree=$(cat tree)
+"$GIT" ls-tree "$tree" >listing || fail "ls-tree failed"
+[ "$(wc -l <fetches)" -eq 1 ] || fail "ls-tree fetched from the promisor remote"
+
+grep -q "^040000 tree [0-9a-f]* dir$" listing || fail "dir is not listed as a tree"
+grep -q "^100644 blob [0-9a-f]* one.txt$" listing || fail "one.txt is not listed as a blob"
+
+# Reading a blob does fetch it, so the checks above are meaningful
+blob=$(grep one.txt listing | cut -d' ' -f3)
+"$GIT" cat-file -p "$blob" >/dev/null 2>&1 || fail "the blob could not be fetched"
+[ "$(wc -l <fetches)" -eq 2 ] || fail "reading a missing blob did not fetch it"
+
+exit 0
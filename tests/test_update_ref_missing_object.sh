@@ -0,0 +1,23 @@
+# update-ref refuses to point a ref at an object that does not exist, and
+# a branch at anything but a commit
+. "$(dirname "$0")/lib.sh"
+
+echo hello >hello.txt
+tree=$("$GIT" write-tree)
+commit=$("$GIT" commit-tree "$tree" -m initial)
+blob=$("$GIT" hash-object -w hello.txt)
+
+"$GIT" update-ref refs/heads/main "$commit" || fail "a commit was rejected"
+[ "$(cat .git/refs/heads/main)" = "$commit" ] || fail "refs/heads/main was not written"
+
+"$GIT" update-ref refs/heads/x 0000000000000000000000000000000000000001 2>/dev/null \
+    && fail "a missing object was accepted"
+[ ! -e .git/refs/heads/x ] || fail "a dangling ref was written"
+[ ! -e .git/refs/heads/x.lock ] || fail "the lock was left behind"
+
+"$GIT" update-ref refs/heads/x "$blob" 2>/dev/null && fail "a blob was accepted for a branch"
+[ ! -e .git/refs/heads/x ] || fail "a branch was pointed at a blob"
+
+"$GIT" update-ref refs/tags/blob "$blob" || fail "a blob was rejected for a tag"
+
+exit 0